@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The specialized receipt decoders against ber_decode, on receipts with a growing number of in-app
+ * purchases: the SignedData alone, and the walk PsiphonAppReceipt does (SignedData, receipt attributes,
+ * then each in-app purchase's attributes), each also with the strict DER checks. Then the JSON transcoding of receipts against decoding them
+ * and printing them with xer_encode.
+ */
+
+#include "AppReceiptDecoder.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+
+// In-app purchases decoded per size, so that every size does a similar amount of work.
+#define TOTAL_IAPS 20000
+
+typedef asn_dec_rval_t (*signed_data_decoder_t)(const void *buf, size_t size, SignedData_t **sd);
+typedef asn_dec_rval_t (*attributes_decoder_t)(const void *buf, size_t size, ReceiptAttributes_t **attrs);
+
+static asn_dec_rval_t generic_signed_data(const void *buf, size_t size, SignedData_t **sd) {
+    return ber_decode(0, &asn_DEF_SignedData, (void **)sd, buf, size);
+}
+
+static asn_dec_rval_t generic_attributes(const void *buf, size_t size, ReceiptAttributes_t **attrs) {
+    return ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)attrs, buf, size);
+}
+
+static asn_dec_rval_t specialized_signed_data(const void *buf, size_t size, SignedData_t **sd) {
+    return app_receipt_decode_signed_data(buf, size, sd, APP_RECEIPT_NO_FALLBACK);
+}
+
+static asn_dec_rval_t specialized_attributes(const void *buf, size_t size, ReceiptAttributes_t **attrs) {
+    return app_receipt_decode_attributes(buf, size, attrs, APP_RECEIPT_NO_FALLBACK);
+}
+
+static asn_dec_rval_t strict_signed_data(const void *buf, size_t size, SignedData_t **sd) {
+    return app_receipt_decode_signed_data(buf, size, sd, APP_RECEIPT_STRICT_DER);
+}
+
+static asn_dec_rval_t strict_attributes(const void *buf, size_t size, ReceiptAttributes_t **attrs) {
+    return app_receipt_decode_attributes(buf, size, attrs, APP_RECEIPT_STRICT_DER);
+}
+
+static volatile long sink;
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+// Decodes the SignedData only.
+static void decode_signed_data(signed_data_decoder_t decode, const uint8_t *receipt, size_t len) {
+    SignedData_t *sd = NULL;
+    if (decode(receipt, len, &sd).code != RC_OK) {
+        fail("SignedData decode");
+    }
+    sink += sd->content.contentInfo.contentData.size;
+    ASN_STRUCT_FREE(asn_DEF_SignedData, sd);
+}
+
+// Decodes the receipt down to every in-app purchase attribute, as PsiphonAppReceipt does.
+static void decode_receipt(signed_data_decoder_t decode_sd, attributes_decoder_t decode_attrs, const uint8_t *receipt,
+                           size_t len) {
+    SignedData_t *sd = NULL;
+    ReceiptAttributes_t *attrs = NULL;
+    if (decode_sd(receipt, len, &sd).code != RC_OK) {
+        fail("SignedData decode");
+    }
+    const OCTET_STRING_t *content = &sd->content.contentInfo.contentData;
+    if (decode_attrs(content->buf, content->size, &attrs).code != RC_OK) {
+        fail("attributes decode");
+    }
+    for (int i = 0; i < attrs->list.count; i++) {
+        const ReceiptAttribute_t *attr = attrs->list.array[i];
+        if (attr->type != 17) {
+            continue;
+        }
+        ReceiptAttributes_t *iap = NULL;
+        if (decode_attrs(attr->value.buf, attr->value.size, &iap).code != RC_OK) {
+            fail("in-app purchase decode");
+        }
+        for (int j = 0; j < iap->list.count; j++) {
+            sink += iap->list.array[j]->type;
+        }
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, iap);
+    }
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    ASN_STRUCT_FREE(asn_DEF_SignedData, sd);
+}
+
+// Counts the bytes written.
+static int count_bytes(const void *buf, size_t size, void *key) {
+    *(size_t *)key += size;
+    return 0;
+}
+
+// Decodes the receipt and prints the attributes and every in-app purchase's attributes as XER.
+static size_t decode_and_print(const uint8_t *receipt, size_t len) {
+    SignedData_t *sd = NULL;
+    ReceiptAttributes_t *attrs = NULL;
+    size_t n = 0;
+    ber_decode(0, &asn_DEF_SignedData, (void **)&sd, receipt, len);
+    const OCTET_STRING_t *content = &sd->content.contentInfo.contentData;
+    ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, content->buf, content->size);
+    xer_encode(&asn_DEF_ReceiptAttributes, attrs, XER_F_CANONICAL, count_bytes, &n);
+    for (int i = 0; i < attrs->list.count; i++) {
+        const ReceiptAttribute_t *attr = attrs->list.array[i];
+        if (attr->type == 17) {
+            ReceiptAttributes_t *iap = NULL;
+            ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&iap, attr->value.buf, attr->value.size);
+            xer_encode(&asn_DEF_ReceiptAttributes, iap, XER_F_CANONICAL, count_bytes, &n);
+            ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, iap);
+        }
+    }
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    ASN_STRUCT_FREE(asn_DEF_SignedData, sd);
+    return n;
+}
+
+typedef struct {
+    const uint8_t *receipt;
+    size_t len;
+} receipt_t;
+
+static int run_noop(void *arg) {
+    return 0;
+}
+
+static int run_json(void *arg) {
+    const receipt_t *r = arg;
+    size_t n = 0;
+    return app_receipt_to_json(r->receipt, r->len, count_bytes, &n);
+}
+
+static int run_xer(void *arg) {
+    const receipt_t *r = arg;
+    return decode_and_print(r->receipt, r->len) > 0 ? 0 : -1;
+}
+
+static void bench_json(void) {
+    static const size_t sizes[] = { 1, 1000, 5000 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t state = 64;
+        size_t iaps = sizes[s], len;
+        uint8_t *receipt = fixture_receipt(&state, iaps, 1514764800000, NULL, &len);
+        uint64_t iterations = TOTAL_IAPS / iaps < 20 ? 20 : TOTAL_IAPS / iaps;
+        char name[96];
+
+        size_t out = 0;
+        uint64_t start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            if (app_receipt_to_json(receipt, len, count_bytes, &out) != 0) {
+                fail("JSON transcoding");
+            }
+        }
+        snprintf(name, sizeof(name), "receipt/json/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+        snprintf(name, sizeof(name), "receipt/json/output/%zu_iaps", iaps);
+        bench_counter(name, (double)out / iterations / 1024.0, "KB");
+
+        out = 0;
+        start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            out += decode_and_print(receipt, len);
+        }
+        snprintf(name, sizeof(name), "receipt/json/decode_xer_baseline/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+        snprintf(name, sizeof(name), "receipt/json/decode_xer_baseline/output/%zu_iaps", iaps);
+        bench_counter(name, (double)out / iterations / 1024.0, "KB");
+
+        if (iaps == 5000) {
+            receipt_t r = { receipt, len };
+            bench_counter("receipt/json/idle_peak_rss", (double)bench_peak_rss_kb(run_noop, NULL), "KB");
+            bench_counter("receipt/json/peak_rss/5000_iaps", (double)bench_peak_rss_kb(run_json, &r), "KB");
+            bench_counter("receipt/json/decode_xer_baseline/peak_rss/5000_iaps",
+                          (double)bench_peak_rss_kb(run_xer, &r), "KB");
+        }
+        free(receipt);
+    }
+}
+
+int main(void) {
+    static const size_t sizes[] = { 1, 100, 1000, 5000 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t state = 63;
+        size_t iaps = sizes[s], len;
+        uint8_t *receipt = fixture_receipt(&state, iaps, 1514764800000, NULL, &len);
+        uint64_t iterations = TOTAL_IAPS / iaps < 20 ? 20 : TOTAL_IAPS / iaps;
+        char name[96];
+
+        uint64_t start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            decode_signed_data(generic_signed_data, receipt, len);
+        }
+        snprintf(name, sizeof(name), "receipt/signed_data/ber_decode_baseline/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            decode_signed_data(specialized_signed_data, receipt, len);
+        }
+        snprintf(name, sizeof(name), "receipt/signed_data/specialized/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            decode_signed_data(strict_signed_data, receipt, len);
+        }
+        snprintf(name, sizeof(name), "receipt/signed_data/strict_der/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            decode_receipt(generic_signed_data, generic_attributes, receipt, len);
+        }
+        snprintf(name, sizeof(name), "receipt/attributes/ber_decode_baseline/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            decode_receipt(specialized_signed_data, specialized_attributes, receipt, len);
+        }
+        snprintf(name, sizeof(name), "receipt/attributes/specialized/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            decode_receipt(strict_signed_data, strict_attributes, receipt, len);
+        }
+        snprintf(name, sizeof(name), "receipt/attributes/strict_der/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        free(receipt);
+    }
+
+    bench_json();
+    return 0;
+}
@@ -0,0 +1,600 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The specialized receipt decoders against ber_decode: fixture receipts must take the specialized path and
+ * decode identically, and mutated receipts must give the generic decoder's results whichever path they take.
+ * Input that passes the strict DER checks must also re-encode to itself. Then the JSON transcoding of receipts,
+ * and receipt summaries against the reference decoding.
+ */
+
+#include "AppReceiptDecoder.h"
+#include "check.h"
+#include "fixtures.h"
+#include "json_reference.h"
+#include "receipt_reference.h"
+#include "der_encoder.h"
+#include <string.h>
+#include <time.h>
+
+#define MUTATIONS 100000
+
+// Compares OCTET STRING, OBJECT IDENTIFIER or ANY values.
+#define octets_equal(a, b) ((a)->size == (b)->size && ((a)->size == 0 || memcmp((a)->buf, (b)->buf, (a)->size) == 0))
+
+static int signed_data_equal(const SignedData_t *a, const SignedData_t *b) {
+    return octets_equal(&a->contentType, &b->contentType) && a->content.version == b->content.version &&
+           octets_equal(&a->content.digestAlgorithms, &b->content.digestAlgorithms) &&
+           octets_equal(&a->content.contentInfo.contentType, &b->content.contentInfo.contentType) &&
+           octets_equal(&a->content.contentInfo.contentData, &b->content.contentInfo.contentData);
+}
+
+static int attributes_equal(const ReceiptAttributes_t *a, const ReceiptAttributes_t *b) {
+    if (a->list.count != b->list.count) {
+        return 0;
+    }
+    for (int i = 0; i < a->list.count; i++) {
+        const ReceiptAttribute_t *x = a->list.array[i], *y = b->list.array[i];
+        if (x->type != y->type || x->version != y->version || !octets_equal(&x->value, &y->value)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Decodes with both decoders and checks they agree. Returns 1 if the specialized path decoded it.
+static int check_signed_data(const uint8_t *buf, size_t len) {
+    SignedData_t *generic = NULL, *fast = NULL, *fallback = NULL, *strict = NULL;
+    asn_dec_rval_t g = ber_decode(0, &asn_DEF_SignedData, (void **)&generic, buf, len);
+    asn_dec_rval_t f = app_receipt_decode_signed_data(buf, len, &fast, APP_RECEIPT_NO_FALLBACK);
+    asn_dec_rval_t a = app_receipt_decode_signed_data(buf, len, &fallback, 0);
+    asn_dec_rval_t s = app_receipt_decode_signed_data(buf, len, &strict, APP_RECEIPT_STRICT_DER);
+
+    CHECK_EQ_INT(a.code, g.code);
+    if (g.code == RC_OK) {
+        CHECK_EQ_INT(a.consumed, g.consumed);
+        CHECK(signed_data_equal(fallback, generic));
+    }
+    if (f.code == RC_OK) {
+        CHECK(g.code == RC_OK);
+        CHECK_EQ_INT(f.consumed, g.consumed);
+        CHECK(signed_data_equal(fast, generic));
+    } else {
+        CHECK(fast == NULL);
+    }
+    // Canonical DER is a subset of what the specialized decoder takes.
+    if (s.code == RC_OK) {
+        CHECK(f.code == RC_OK);
+        CHECK_EQ_INT(s.consumed, f.consumed);
+        CHECK(signed_data_equal(strict, fast));
+    } else {
+        CHECK(strict == NULL);
+        CHECK(s.consumed <= len);
+    }
+
+    ASN_STRUCT_FREE(asn_DEF_SignedData, generic);
+    ASN_STRUCT_FREE(asn_DEF_SignedData, fast);
+    ASN_STRUCT_FREE(asn_DEF_SignedData, fallback);
+    ASN_STRUCT_FREE(asn_DEF_SignedData, strict);
+    return f.code == RC_OK;
+}
+
+static int check_attributes(const uint8_t *buf, size_t len) {
+    ReceiptAttributes_t *generic = NULL, *fast = NULL, *fallback = NULL, *strict = NULL;
+    asn_dec_rval_t g = ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&generic, buf, len);
+    asn_dec_rval_t f = app_receipt_decode_attributes(buf, len, &fast, APP_RECEIPT_NO_FALLBACK);
+    asn_dec_rval_t a = app_receipt_decode_attributes(buf, len, &fallback, 0);
+    asn_dec_rval_t s = app_receipt_decode_attributes(buf, len, &strict, APP_RECEIPT_STRICT_DER);
+
+    CHECK_EQ_INT(a.code, g.code);
+    if (g.code == RC_OK) {
+        CHECK_EQ_INT(a.consumed, g.consumed);
+        CHECK(attributes_equal(fallback, generic));
+    }
+    if (f.code == RC_OK) {
+        CHECK(g.code == RC_OK);
+        CHECK_EQ_INT(f.consumed, g.consumed);
+        CHECK(attributes_equal(fast, generic));
+    } else {
+        CHECK(fast == NULL);
+    }
+    // Canonical DER is a subset of what the specialized decoder takes, and is what der_encode produces.
+    if (s.code == RC_OK) {
+        CHECK(f.code == RC_OK);
+        CHECK_EQ_INT(s.consumed, f.consumed);
+        CHECK(attributes_equal(strict, fast));
+        void *encoded = NULL;
+        CHECK_EQ_INT(der_encode_to_new_buffer(&asn_DEF_ReceiptAttributes, strict, &encoded), s.consumed);
+        CHECK(memcmp(encoded, buf, s.consumed) == 0);
+        free(encoded);
+    } else {
+        CHECK(strict == NULL);
+        CHECK(s.consumed <= len);
+    }
+
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, generic);
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, fast);
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, fallback);
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, strict);
+    return f.code == RC_OK;
+}
+
+// Decodes with APP_RECEIPT_STRICT_DER. Returns -1 if it passes, or the reported offset.
+static long strict_offset_signed_data(const uint8_t *buf, size_t len) {
+    SignedData_t *sd = NULL;
+    asn_dec_rval_t rval = app_receipt_decode_signed_data(buf, len, &sd, APP_RECEIPT_STRICT_DER);
+    ASN_STRUCT_FREE(asn_DEF_SignedData, sd);
+    return rval.code == RC_OK ? -1 : (long)rval.consumed;
+}
+
+static long strict_offset_attributes(const uint8_t *buf, size_t len) {
+    ReceiptAttributes_t *attrs = NULL;
+    asn_dec_rval_t rval = app_receipt_decode_attributes(buf, len, &attrs, APP_RECEIPT_STRICT_DER);
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    return rval.code == RC_OK ? -1 : (long)rval.consumed;
+}
+
+// Fixture receipts, their attributes and every in-app purchase's attributes take the specialized path.
+static void test_fixtures(void) {
+    static const size_t sizes[] = { 0, 1, 10, 300 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t state = 63;
+        size_t len, payload_len;
+        uint8_t *receipt = fixture_receipt(&state, sizes[s], 1514764800000, NULL, &len), *payload;
+        CHECK(check_signed_data(receipt, len));
+        CHECK(strict_offset_signed_data(receipt, len) == -1);
+
+        CHECK_EQ_INT(receipt_ref_payload(receipt, len, &payload, &payload_len), 0);
+        CHECK(check_attributes(payload, payload_len));
+        CHECK(strict_offset_attributes(payload, payload_len) == -1);
+
+        ReceiptAttributes_t *attrs = NULL;
+        CHECK(app_receipt_decode_attributes(payload, payload_len, &attrs, 0).code == RC_OK);
+        size_t iaps = 0;
+        for (int i = 0; i < attrs->list.count; i++) {
+            const ReceiptAttribute_t *attr = attrs->list.array[i];
+            if (attr->type == 17) {
+                CHECK(check_attributes(attr->value.buf, attr->value.size));
+                CHECK(strict_offset_attributes(attr->value.buf, attr->value.size) == -1);
+                iaps++;
+            }
+        }
+        CHECK_EQ_INT(iaps, sizes[s]);
+
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+        free(payload);
+        free(receipt);
+    }
+}
+
+// Encodings the generic decoder accepts that the specialized one leaves to it, and ones both reject.
+static void test_fallbacks(void) {
+    static const struct {
+        uint8_t der[24];
+        size_t len;
+        int fast;
+    } cases[] = {
+        { { 0x31, 0x09, 0x30, 0x07, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 11, 0 },    // Truncated.
+        { { 0x31, 0x09, 0x30, 0x07, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 12, 0 },    // Wrong length.
+        { { 0x31, 0x0a, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 12, 1 },
+        { { 0x31, 0x0a, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00, 0xff }, 13, 1 }, // Trailing.
+        { { 0x31, 0x81, 0x0a, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 13, 1 }, // Long form.
+        { { 0x31, 0x80, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00, 0x00, 0x00 }, 14, 0 }, // Indefinite.
+        { { 0x31, 0x0a, 0x30, 0x08, 0x02, 0x00, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 12, 0 },    // Empty INTEGER.
+        { { 0x31, 0x0e, 0x30, 0x0c, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x24, 0x04, 0x04, 0x02, 0x61, 0x62 },
+          16, 0 },                                                                                  // Constructed.
+        { { 0x31, 0x12, 0x30, 0x10, 0x02, 0x09, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x11, 0x02, 0x01,
+            0x01, 0x04, 0x00 }, 20, 0 },                                                            // 9-octet INTEGER.
+        { { 0x31, 0x0a, 0x30, 0x08, 0x02, 0x01, 0xff, 0x02, 0x01, 0x80, 0x04, 0x00 }, 12, 1 },    // Negative.
+        { { 0x31, 0x00 }, 2, 1 },
+        { { 0x30, 0x00 }, 2, 0 },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        CHECK_EQ_INT(check_attributes(cases[i].der, cases[i].len), cases[i].fast);
+    }
+}
+
+// Wraps receipt attributes in a minimal SignedData.
+static size_t wrap_attributes(const uint8_t *attrs, size_t attrs_len, uint8_t *dst) {
+    uint8_t *p = dst;
+    size_t content_len = 3 + 2 + 2 + 6 + attrs_len;
+    const uint8_t head[] = { 0x30, 0x82, (content_len + 10) >> 8, (content_len + 10) & 0xff, 0x06, 0x00,
+                             0xa0, 0x82, (content_len + 4) >> 8, (content_len + 4) & 0xff, 0x30, 0x82 };
+    memcpy(p, head, sizeof(head));
+    p += sizeof(head);
+    *p++ = content_len >> 8;
+    *p++ = content_len & 0xff;
+    const uint8_t version_and_digests[] = { 0x02, 0x01, 0x01, 0x31, 0x00 };
+    memcpy(p, version_and_digests, sizeof(version_and_digests));
+    p += sizeof(version_and_digests);
+    // contentInfo, whose lengths all fit in one octet here.
+    const uint8_t info[] = { 0x30, (uint8_t)(6 + attrs_len), 0x06, 0x00, 0xa0, (uint8_t)(2 + attrs_len), 0x04,
+                             (uint8_t)attrs_len };
+    memcpy(p, info, sizeof(info));
+    p += sizeof(info);
+    memcpy(p, attrs, attrs_len);
+    p += attrs_len;
+    return p - dst;
+}
+
+// Appends a TLV with its length in the fewest octets.
+static uint8_t * put_tlv(uint8_t *p, uint8_t tag, const uint8_t *contents, size_t len) {
+    *p++ = tag;
+    if (len >= 0x100) {
+        *p++ = 0x82;
+        *p++ = (uint8_t)(len >> 8);
+    } else if (len >= 0x80) {
+        *p++ = 0x81;
+    }
+    *p++ = (uint8_t)len;
+    memmove(p, contents, len);
+    return p + len;
+}
+
+// Builds a SignedData in DER around receipt attributes, with extensions at the end of the content.
+static size_t build_signed_data(const uint8_t *attrs, size_t attrs_len, const uint8_t *ext, size_t ext_len,
+                                uint8_t *dst) {
+    static const uint8_t signed_data_oid[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x02 };
+    static const uint8_t data_oid[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x01 };
+    static const uint8_t version_and_digests[] = { 0x02, 0x01, 0x01, 0x31, 0x0b, 0x30, 0x09, 0x06, 0x05, 0x2b,
+                                                   0x0e, 0x03, 0x02, 0x1a, 0x05, 0x00 };
+    uint8_t a[512], b[512], *p;
+
+    p = put_tlv(a, 0x04, attrs, attrs_len);
+    p = put_tlv(b, 0xa0, a, p - a);
+    size_t tagged_len = p - b;
+    p = put_tlv(a, 0x06, data_oid, sizeof(data_oid));
+    memcpy(p, b, tagged_len);
+    p += tagged_len;
+    size_t info_len = put_tlv(b, 0x30, a, p - a) - b;
+
+    p = a;
+    memcpy(p, version_and_digests, sizeof(version_and_digests));
+    p += sizeof(version_and_digests);
+    memcpy(p, b, info_len);
+    p += info_len;
+    memcpy(p, ext, ext_len);
+    p += ext_len;
+    p = put_tlv(b, 0x30, a, p - a);
+    p = put_tlv(a, 0xa0, b, p - b);
+    size_t content_len = p - a;
+
+    p = put_tlv(b, 0x06, signed_data_oid, sizeof(signed_data_oid));
+    memcpy(p, a, content_len);
+    p += content_len;
+    return put_tlv(dst, 0x30, b, p - b) - dst;
+}
+
+// Non-canonical DER is rejected, at the first octet that isn't canonical.
+static void test_strict_der(void) {
+    static const struct {
+        uint8_t der[24];
+        size_t len;
+        long offset;    // -1 if canonical.
+    } attributes[] = {
+        { { 0x31, 0x0a, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 12, -1 },
+        { { 0x31, 0x0a, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00, 0xff }, 13, -1 },  // Trailing.
+        { { 0x31, 0x0a, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 11, 1 },    // Truncated.
+        { { 0x31, 0x81, 0x0a, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 13, 1 }, // Long form.
+        { { 0x31, 0x0b, 0x30, 0x82, 0x00, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 14, 3 },
+        { { 0x31, 0x80, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00, 0x00, 0x00 }, 14, 1 }, // Indefinite.
+        // Out of order, then the same elements in order, then a repeated element, which DER allows.
+        { { 0x31, 0x14, 0x30, 0x08, 0x02, 0x01, 0x03, 0x02, 0x01, 0x01, 0x04, 0x00,
+            0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 22, 12 },
+        { { 0x31, 0x14, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00,
+            0x30, 0x08, 0x02, 0x01, 0x03, 0x02, 0x01, 0x01, 0x04, 0x00 }, 22, -1 },
+        { { 0x31, 0x14, 0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00,
+            0x30, 0x08, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 22, -1 },
+        { { 0x31, 0x0e, 0x30, 0x0c, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x24, 0x04, 0x04, 0x02, 0x61, 0x62 },
+          16, 10 },                                                                                 // Constructed.
+        { { 0x31, 0x0b, 0x30, 0x09, 0x02, 0x02, 0x00, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 13, 6 },  // Leading 0.
+        { { 0x31, 0x0b, 0x30, 0x09, 0x02, 0x02, 0xff, 0x80, 0x02, 0x01, 0x01, 0x04, 0x00 }, 13, 6 },  // Leading ff.
+        { { 0x31, 0x0b, 0x30, 0x09, 0x02, 0x02, 0x00, 0x80, 0x02, 0x01, 0x01, 0x04, 0x00 }, 13, -1 },
+        { { 0x31, 0x0a, 0x30, 0x08, 0x02, 0x00, 0x02, 0x02, 0x01, 0x01, 0x04, 0x00 }, 12, 6 },    // Empty INTEGER.
+    };
+    for (size_t i = 0; i < sizeof(attributes) / sizeof(attributes[0]); i++) {
+        check_attributes(attributes[i].der, attributes[i].len);
+        CHECK_EQ_INT(strict_offset_attributes(attributes[i].der, attributes[i].len), attributes[i].offset);
+    }
+
+    // The certificates and signer infos are checked too, though they aren't decoded.
+    static const struct {
+        uint8_t ext[24];
+        size_t len;
+        long offset;    // Within the extensions, or -1 if canonical.
+    } extensions[] = {
+        { { 0xa0, 0x06, 0x30, 0x04, 0x02, 0x02, 0x00, 0x80, 0x31, 0x06, 0x02, 0x01, 0x01, 0x02, 0x01, 0x02 }, 16, -1 },
+        { { 0xa0, 0x06, 0x30, 0x04, 0x02, 0x02, 0x00, 0x01 }, 8, 6 },
+        { { 0xa0, 0x06, 0x30, 0x04, 0x24, 0x02, 0x04, 0x00 }, 8, 4 },
+        { { 0xa0, 0x81, 0x04, 0x30, 0x02, 0x05, 0x00 }, 7, 1 },
+        { { 0x31, 0x06, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01 }, 8, 5 },
+        { { 0x31, 0x08, 0x30, 0x06, 0x31, 0x04, 0x05, 0x00, 0x04, 0x00 }, 10, 8 },     // Nested set, NULL > OCTET.
+    };
+    uint8_t receipt[256];
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        size_t len = build_signed_data(attributes[0].der, attributes[0].len, extensions[i].ext, extensions[i].len,
+                                       receipt);
+        CHECK(check_signed_data(receipt, len));
+        long offset = strict_offset_signed_data(receipt, len);
+        CHECK_EQ_INT(offset, extensions[i].offset == -1 ? -1 : (long)(len - extensions[i].len) + extensions[i].offset);
+    }
+
+    // The lengths of wrap_attributes are two octets long whatever their value.
+    size_t len = wrap_attributes(attributes[0].der, attributes[0].len, receipt);
+    CHECK(check_signed_data(receipt, len));
+    CHECK_EQ_INT(strict_offset_signed_data(receipt, len), 1);
+}
+
+typedef struct {
+    char *p;
+    size_t len;
+    size_t writes;
+    int fail_after;     // Fail the write after this many, or 0.
+} output_t;
+
+static int collect(const void *buf, size_t size, void *key) {
+    output_t *out = key;
+    if (out->fail_after && out->writes == (size_t)out->fail_after) {
+        return -1;
+    }
+    out->p = realloc(out->p, out->len + size + 1);
+    memcpy(out->p + out->len, buf, size);
+    out->len += size;
+    out->p[out->len] = '\0';
+    out->writes++;
+    return 0;
+}
+
+// Transcodes to JSON: either the JSON is well-formed, or the receipt is rejected before anything is written.
+static void check_json(const uint8_t *buf, size_t len) {
+    output_t out = { 0 };
+    if (app_receipt_to_json(buf, len, collect, &out) == 0) {
+        json_ref_t *root = json_ref_parse(out.p, out.len);
+        CHECK(root != NULL);
+        json_ref_free(root);
+    } else {
+        CHECK_EQ_INT(out.len, 0);
+    }
+    free(out.p);
+}
+
+// Summarizes a receipt, which must give the reference's results.
+static void check_summary(const uint8_t *buf, size_t len) {
+    app_receipt_summary_t summary;
+    receipt_ref_t ref;
+    int ret = app_receipt_summarize(buf, len, &summary);
+    CHECK_EQ_INT(ret, receipt_ref_decode(buf, len, &ref));
+    if (ret == 0) {
+        CHECK(strcmp(summary.bundle_id, ref.bundle_id) == 0);
+        CHECK(strcmp(summary.product_id, ref.product_id) == 0);
+        CHECK(summary.latest_expiration_ms == ref.latest_expiration_ms);
+        CHECK_EQ_INT(summary.iap_count, ref.iap_count);
+        CHECK_EQ_INT(summary.cancelled_count, ref.cancelled_count);
+    }
+}
+
+// Applies a random mutation: overwritten octets, a truncation, or an inserted or removed octet.
+static size_t mutate(uint64_t *state, const uint8_t *src, size_t len, uint8_t *dst) {
+    uint64_t r = fixture_rand(state);
+    memcpy(dst, src, len);
+    size_t at = (size_t)(r >> 8) % len;
+    switch (r % 4) {
+        case 0:
+        case 1:
+            for (int n = (int)((r >> 40) % 3); n >= 0; n--) {
+                dst[(size_t)fixture_rand(state) % len] = (uint8_t)fixture_rand(state);
+            }
+            return len;
+        case 2:
+            // Favour the headers at the start, where most of the structure is.
+            return (r >> 40) % 2 ? at : at % 64;
+        default:
+            if ((r >> 40) % 2) {
+                memmove(dst + at + 1, src + at, len - at);
+                dst[at] = (uint8_t)(r >> 48);
+                return len + 1;
+            }
+            memmove(dst + at, src + at + 1, len - at - 1);
+            return len - 1;
+    }
+}
+
+static void test_mutations(void) {
+    uint64_t state = 63;
+    size_t len, payload_len;
+    uint8_t *receipt = fixture_receipt(&state, 2, 1514764800000, NULL, &len), *payload;
+    CHECK_EQ_INT(receipt_ref_payload(receipt, len, &payload, &payload_len), 0);
+    uint8_t *buf = malloc(len + 1);
+
+    size_t fast = 0, strict = 0;
+    for (int i = 0; i < MUTATIONS; i++) {
+        size_t n = mutate(&state, receipt, len, buf);
+        fast += check_signed_data(buf, n);
+        check_json(buf, n);
+        check_summary(buf, n);
+        strict += strict_offset_signed_data(buf, n) == -1;
+        n = mutate(&state, payload, payload_len, buf);
+        fast += check_attributes(buf, n);
+        strict += strict_offset_attributes(buf, n) == -1;
+    }
+    // Some mutations leave the structure intact, e.g. those in a value, and some of those leave it canonical.
+    CHECK(fast > 0);
+    CHECK(strict > 0 && strict < fast);
+
+    free(buf);
+    free(payload);
+    free(receipt);
+}
+
+static const char * string_at(const json_ref_t *v, const char *path) {
+    const json_ref_t *s = json_ref_path(v, path);
+    return (s != NULL && s->type == JSON_REF_STRING) ? s->string : NULL;
+}
+
+static void format_date(char *dst, size_t len, int64_t unix_ms) {
+    time_t sec = (time_t)(unix_ms / 1000);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    strftime(dst, len, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static void test_json(void) {
+    uint64_t state = 64;
+    size_t len;
+    fixture_iap_t iaps[40];
+    uint8_t *receipt = fixture_receipt(&state, 40, 1514764800000, iaps, &len);
+    output_t out = { 0 };
+    CHECK_EQ_INT(app_receipt_to_json(receipt, len, collect, &out), 0);
+    // Written in chunks of the internal buffer.
+    CHECK(out.writes > 1);
+
+    json_ref_t *root = json_ref_parse(out.p, out.len);
+    CHECK(root != NULL);
+    CHECK(strcmp(string_at(root, "bundle_id"), FIXTURE_RECEIPT_BUNDLE_ID) == 0);
+    CHECK(strcmp(string_at(root, "receipt_type"), "Production") == 0);
+    CHECK(strcmp(string_at(root, "receipt_creation_date"), "2018-01-01T00:00:00Z") == 0);
+    CHECK_EQ_INT(strlen(string_at(root, "opaque_value")), 24);    // 16 octets in base64.
+
+    // Unnamed attributes (8, 10, 11, 13, 25) are kept in base64.
+    const json_ref_t *attributes = json_ref_path(root, "attributes");
+    CHECK(attributes != NULL && attributes->type == JSON_REF_ARRAY);
+    CHECK_EQ_INT(attributes->child_count, 5);
+    for (size_t i = 0; i < attributes->child_count; i++) {
+        if (json_ref_path(attributes->children[i], "type")->number == 8) {
+            CHECK_EQ_INT(strlen(string_at(attributes->children[i], "value")), 32);    // 24 octets.
+        }
+    }
+
+    // Every purchase, in DER order rather than purchase order.
+    const json_ref_t *in_app = json_ref_path(root, "in_app");
+    CHECK(in_app != NULL && in_app->type == JSON_REF_ARRAY);
+    CHECK_EQ_INT(in_app->child_count, 40);
+    for (size_t i = 0; i < 40; i++) {
+        char expires[32], purchase[32];
+        format_date(expires, sizeof(expires), iaps[i].expires_ms);
+        format_date(purchase, sizeof(purchase), iaps[i].purchase_ms);
+        size_t found = 0;
+        for (size_t j = 0; j < in_app->child_count; j++) {
+            const json_ref_t *iap = in_app->children[j];
+            if (strcmp(string_at(iap, "expires_date"), expires) == 0) {
+                CHECK(strcmp(string_at(iap, "product_id"), iaps[i].product_id) == 0);
+                CHECK(strcmp(string_at(iap, "purchase_date"), purchase) == 0);
+                CHECK_EQ_INT(json_ref_path(iap, "quantity")->number, 1);
+                CHECK_EQ_INT(json_ref_path(iap, "is_trial_period")->number, 0);
+                // An empty cancellation date isn't a date, and stays an empty string.
+                CHECK_EQ_INT(string_at(iap, "cancellation_date")[0] != '\0', iaps[i].cancelled);
+                found++;
+            }
+        }
+        CHECK_EQ_INT(found, 1);
+    }
+    json_ref_free(root);
+
+    // A failing write stops the transcoding.
+    free(out.p);
+    output_t failing = { .fail_after = 1 };
+    CHECK_EQ_INT(app_receipt_to_json(receipt, len, collect, &failing), -1);
+    free(failing.p);
+    free(receipt);
+}
+
+static void test_json_values(void) {
+    // Escapes, invalid UTF-8, an INTEGER that isn't one, a non-RFC 3339 date and a malformed nested set.
+    static const uint8_t attrs[] = {
+        0x31, 0x48,
+        0x30, 0x0f, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x07, 0x0c, 0x05, 'a', '"', '\\', '\n', 'b',
+        0x30, 0x0b, 0x02, 0x01, 0x03, 0x02, 0x01, 0x01, 0x04, 0x03, 0x0c, 0x01, 0xff,
+        0x30, 0x0b, 0x02, 0x01, 0x0c, 0x02, 0x01, 0x01, 0x04, 0x03, 0x16, 0x01, 'x',
+        0x30, 0x0c, 0x02, 0x01, 0x11, 0x02, 0x01, 0x01, 0x04, 0x04, 0x31, 0x02, 0x30, 0x01,
+        0x30, 0x0d, 0x02, 0x02, 0x06, 0xa5, 0x02, 0x01, 0x01, 0x04, 0x04, 0x0c, 0x02, '4', '2',
+    };
+    uint8_t receipt[256];
+    size_t len = wrap_attributes(attrs, sizeof(attrs), receipt);
+    output_t out = { 0 };
+    CHECK_EQ_INT(app_receipt_to_json(receipt, len, collect, &out), 0);
+    CHECK(strcmp(out.p, "{\"bundle_id\":\"a\\\"\\\\\\u000ab\",\"application_version\":\"DAH/\","
+                        "\"receipt_creation_date\":\"x\",\"quantity\":\"DAI0Mg==\",\"in_app\":[\"MQIwAQ==\"]}") == 0);
+    free(out.p);
+
+    // Nothing is written for a malformed receipt.
+    for (size_t cut = 0; cut < len; cut++) {
+        output_t partial = { 0 };
+        CHECK_EQ_INT(app_receipt_to_json(receipt, cut, collect, &partial), -1);
+        CHECK_EQ_INT(partial.len, 0);
+    }
+}
+
+static void test_summary(void) {
+    for (size_t iap_count = 0; iap_count <= 40; iap_count += 8) {
+        uint64_t state = 65 + iap_count;
+        size_t len;
+        fixture_iap_t iaps[40];
+        uint8_t *receipt = fixture_receipt(&state, iap_count, 1514764800000, iaps, &len);
+        app_receipt_summary_t summary;
+        CHECK_EQ_INT(app_receipt_summarize(receipt, len, &summary), 0);
+        check_summary(receipt, len);
+
+        // The latest renewal that wasn't cancelled.
+        const fixture_iap_t *latest = NULL;
+        size_t cancelled = 0;
+        for (size_t i = 0; i < iap_count; i++) {
+            if (iaps[i].cancelled) {
+                cancelled++;
+            } else if (latest == NULL || latest->expires_ms < iaps[i].expires_ms) {
+                latest = &iaps[i];
+            }
+        }
+        CHECK(strcmp(summary.bundle_id, FIXTURE_RECEIPT_BUNDLE_ID) == 0);
+        CHECK(strcmp(summary.product_id, latest ? latest->product_id : "") == 0);
+        CHECK(summary.latest_expiration_ms == (latest ? latest->expires_ms : 0));
+        CHECK_EQ_INT(summary.iap_count, iap_count);
+        CHECK_EQ_INT(summary.cancelled_count, cancelled);
+        free(receipt);
+    }
+
+    // A constructed bundle ID, which the walk leaves to asn1c, a long-form product ID and an empty expiration
+    // date, in a SignedData whose lengths are longer than needed.
+    static const uint8_t attrs[] = {
+        0x31, 0x38,
+        0x30, 0x10, 0x02, 0x01, 0x02, 0x02, 0x01, 0x01, 0x04, 0x08, 0x2c, 0x06, 0x0c, 0x01, 'a', 0x0c, 0x01, 'b',
+        0x30, 0x24, 0x02, 0x01, 0x11, 0x02, 0x01, 0x01, 0x04, 0x1c, 0x31, 0x1a,
+        0x30, 0x0d, 0x02, 0x02, 0x06, 0xa6, 0x02, 0x01, 0x01, 0x04, 0x04, 0x0c, 0x81, 0x01, 'p',
+        0x30, 0x09, 0x02, 0x02, 0x06, 0xac, 0x02, 0x01, 0x01, 0x04, 0x00,
+    };
+    uint8_t receipt[256];
+    size_t len = wrap_attributes(attrs, sizeof(attrs), receipt);
+    app_receipt_summary_t summary;
+    CHECK_EQ_INT(app_receipt_summarize(receipt, len, &summary), 0);
+    check_summary(receipt, len);
+    CHECK(strcmp(summary.bundle_id, "ab") == 0);
+    CHECK_EQ_INT(summary.iap_count, 1);
+    CHECK(summary.product_id[0] == '\0');    // No expiration date.
+    CHECK_EQ_INT(app_receipt_summarize(receipt, len - 1, &summary), -1);
+}
+
+int main(void) {
+    RUN_TEST(test_fixtures);
+    RUN_TEST(test_fallbacks);
+    RUN_TEST(test_strict_der);
+    RUN_TEST(test_mutations);
+    RUN_TEST(test_json);
+    RUN_TEST(test_json_values);
+    RUN_TEST(test_summary);
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef bench_h
+#define bench_h
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Minimal benchmark helpers shared by the Linux benchmarks in this directory.
+ *
+ * Results are printed for reading, and when the BENCH_RESULTS environment variable names a file they
+ * are also appended to it, one JSON object per line:
+ *
+ *   {"name":"purchase_index/get","ns_per_op":41.2,"iterations":10000,"mb_per_s":0}
+ *   {"name":"server_entry_table/memory","value":312.50,"unit":"KB"}
+ *
+ * bench_compare compares two such files. Names must not contain quotes or backslashes.
+ */
+
+/*!
+ * @brief The BENCH_RESULTS file, opened for appending on first use, or NULL if results aren't recorded.
+ */
+static inline FILE * bench_results(void) {
+    static FILE *fp;
+    static int opened;
+    if (!opened) {
+        opened = 1;
+        const char *path = getenv("BENCH_RESULTS");
+        if (path != NULL && path[0] != '\0') {
+            fp = fopen(path, "a");
+        }
+    }
+    return fp;
+}
+
+/*!
+ * @brief Monotonic time in nanoseconds.
+ */
+static inline uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*!
+ * @brief Prints a timing result.
+ *
+ * @param name Benchmark name.
+ * @param iterations Number of operations timed.
+ * @param elapsed_ns Total time for all operations.
+ * @param bytes Bytes processed by all operations, or 0 if throughput is not meaningful.
+ */
+static inline void bench_report(const char *name, uint64_t iterations, uint64_t elapsed_ns, uint64_t bytes) {
+    double ns_per_op = iterations ? (double)elapsed_ns / (double)iterations : 0;
+    double mb_per_s = (bytes > 0 && elapsed_ns > 0) ? ((double)bytes / (1024.0 * 1024.0)) / ((double)elapsed_ns / 1e9) : 0;
+    printf("%-56s %14.1f ns/op %12" PRIu64 " iters", name, ns_per_op, iterations);
+    if (mb_per_s > 0) {
+        printf(" %10.1f MB/s", mb_per_s);
+    }
+    printf("\n");
+
+    FILE *fp = bench_results();
+    if (fp != NULL) {
+        fprintf(fp, "{\"name\":\"%s\",\"ns_per_op\":%.3f,\"iterations\":%" PRIu64 ",\"mb_per_s\":%.3f}\n",
+                name, ns_per_op, iterations, mb_per_s);
+        fflush(fp);
+    }
+}
+
+/*!
+ * @brief Prints a named value that isn't a timing, e.g. a size or a ratio.
+ */
+static inline void bench_counter(const char *name, double value, const char *unit) {
+    printf("%-56s %14.2f %s\n", name, value, unit);
+
+    FILE *fp = bench_results();
+    if (fp != NULL) {
+        fprintf(fp, "{\"name\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n", name, value, unit);
+        fflush(fp);
+    }
+}
+
+/*!
+ * @brief Runs fn in a forked child and returns the child's peak resident set size in KB.
+ *
+ * Forking isolates the measurement from allocations made by earlier benchmarks.
+ *
+ * @return Peak RSS in KB, or -1 if the child failed.
+ */
+static inline long bench_peak_rss_kb(int (*fn)(void *), void *arg) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(fn(arg) == 0 ? 0 : 1);
+    }
+    if (pid < 0) {
+        return -1;
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return ru.ru_maxrss;
+}
+
+#endif /* bench_h */
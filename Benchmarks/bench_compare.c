@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compares two benchmark result files written through BENCH_RESULTS (see bench.h) and flags
+ * timings that got slower by more than a threshold.
+ *
+ *   bench_compare [-t percent] baseline.json current.json
+ *
+ * A benchmark that appears more than once in a file, e.g. from repeated runs appended to the same
+ * file, is reduced to its fastest run. Counters (sizes, ratios) are listed but never gate, since
+ * whether more is better depends on the counter.
+ *
+ * Exits with 1 if any timing regressed, 2 on usage or input errors.
+ */
+
+#include "fixtures.h"
+#include "json_reference.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    char *name;
+    int timing;                 // ns_per_op, or a counter's value.
+    double value;
+    char unit[16];
+} result_t;
+
+typedef struct {
+    result_t *results;
+    size_t count;
+} results_t;
+
+static result_t * find(const results_t *r, const char *name) {
+    for (size_t i = 0; i < r->count; i++) {
+        if (strcmp(r->results[i].name, name) == 0) {
+            return &r->results[i];
+        }
+    }
+    return NULL;
+}
+
+static int load(const char *path, results_t *r) {
+    size_t len;
+    char *data = fixture_read_file(path, &len);
+    if (data == NULL) {
+        fprintf(stderr, "bench_compare: can't read %s\n", path);
+        return -1;
+    }
+
+    int line_number = 0;
+    for (char *line = data, *end; line < data + len; line = end + 1) {
+        line_number++;
+        end = memchr(line, '\n', data + len - line);
+        if (end == NULL) {
+            end = data + len;
+        }
+        if (end == line) {
+            continue;
+        }
+
+        json_ref_t *doc = json_ref_parse(line, end - line);
+        const json_ref_t *name = doc ? json_ref_path(doc, "name") : NULL;
+        const json_ref_t *ns = doc ? json_ref_path(doc, "ns_per_op") : NULL;
+        const json_ref_t *value = doc ? json_ref_path(doc, "value") : NULL;
+        const json_ref_t *unit = doc ? json_ref_path(doc, "unit") : NULL;
+        if (name == NULL || name->type != JSON_REF_STRING || (ns == NULL) == (value == NULL)) {
+            fprintf(stderr, "bench_compare: %s:%d: not a benchmark result\n", path, line_number);
+            json_ref_free(doc);
+            free(data);
+            return -1;
+        }
+
+        result_t result = { .timing = (ns != NULL), .value = ns ? ns->number : value->number };
+        if (unit != NULL && unit->type == JSON_REF_STRING) {
+            snprintf(result.unit, sizeof(result.unit), "%s", unit->string);
+        } else {
+            strcpy(result.unit, "ns/op");
+        }
+
+        result_t *existing = find(r, name->string);
+        if (existing == NULL) {
+            result.name = strdup(name->string);
+            result_t *results = result.name ? realloc(r->results, (r->count + 1) * sizeof(result_t)) : NULL;
+            if (results == NULL) {
+                fprintf(stderr, "bench_compare: out of memory\n");
+                free(result.name);
+                json_ref_free(doc);
+                free(data);
+                return -1;
+            }
+            r->results = results;
+            r->results[r->count++] = result;
+        } else if (result.timing && result.value < existing->value) {
+            existing->value = result.value;
+        } else if (!result.timing) {
+            existing->value = result.value;
+        }
+        json_ref_free(doc);
+    }
+    free(data);
+    return 0;
+}
+
+static void release(results_t *r) {
+    for (size_t i = 0; i < r->count; i++) {
+        free(r->results[i].name);
+    }
+    free(r->results);
+}
+
+int main(int argc, char **argv) {
+    double threshold = 10.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt == 't') {
+            threshold = atof(optarg);
+        } else {
+            optind = argc + 1;
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "usage: bench_compare [-t percent] baseline.json current.json\n");
+        return 2;
+    }
+
+    results_t baseline = { 0 }, current = { 0 };
+    if (load(argv[optind], &baseline) != 0 || load(argv[optind + 1], &current) != 0) {
+        release(&baseline);
+        release(&current);
+        return 2;
+    }
+
+    printf("%-56s %14s %14s %-6s %9s\n", "benchmark", "baseline", "current", "unit", "change");
+    int regressions = 0, improvements = 0;
+    for (size_t i = 0; i < current.count; i++) {
+        const result_t *c = &current.results[i];
+        const result_t *b = find(&baseline, c->name);
+        if (b == NULL) {
+            printf("%-56s %14s %14.2f %-6s %9s  new\n", c->name, "-", c->value, c->unit, "");
+            continue;
+        }
+        double change = (b->value != 0) ? (c->value - b->value) / b->value * 100.0 : 0;
+        const char *flag = "";
+        if (c->timing && b->timing && change > threshold) {
+            flag = "  REGRESSION";
+            regressions++;
+        } else if (c->timing && b->timing && change < -threshold) {
+            flag = "  improved";
+            improvements++;
+        }
+        printf("%-56s %14.2f %14.2f %-6s %+8.1f%%%s\n", c->name, b->value, c->value, c->unit, change, flag);
+    }
+    for (size_t i = 0; i < baseline.count; i++) {
+        if (find(&current, baseline.results[i].name) == NULL) {
+            printf("%-56s %14.2f %14s %-6s %9s  missing\n", baseline.results[i].name, baseline.results[i].value, "-",
+                   baseline.results[i].unit, "");
+        }
+    }
+    printf("\n%d regressed, %d improved by more than %.1f%%\n", regressions, improvements, threshold);
+
+    release(&baseline);
+    release(&current);
+    return regressions ? 1 : 0;
+}
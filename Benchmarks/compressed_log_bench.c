@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compares compressed rotating notices files against the plain JSON-lines files PsiFeedbackLogger
+ * writes today, at the extension (64KB) and container (164KB) rotation budgets: the cost of writing a
+ * line, how many lines the two files of a source hold, and the latency of reading the last lines
+ * and the whole history back.
+ */
+
+#define _GNU_SOURCE
+#include "CompressedLog.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LINES 40000
+#define TAIL_LINES 100
+#define READ_ITERATIONS 2000
+
+typedef struct {
+    char *buf;
+    size_t *offsets;
+} input_t;
+
+/*
+ * Baseline: PsiFeedbackLogger's writes, one write of the line and its newline at the end of the
+ * file, and a move to the older file once the file reaches the budget.
+ */
+static void write_plain(const input_t *in, const char *path, const char *older, size_t budget) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+    size_t size = 0;
+    for (size_t i = 0; i < LINES; i++) {
+        size_t len = in->offsets[i + 1] - in->offsets[i];
+        if (write(fd, in->buf + in->offsets[i], len) != (ssize_t)len) {
+            fprintf(stderr, "write failed\n");
+            exit(1);
+        }
+        size += len;
+        if (size >= budget) {
+            close(fd);
+            rename(path, older);
+            fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_TRUNC, 0644);
+            size = 0;
+        }
+    }
+    close(fd);
+}
+
+static void write_compressed(const input_t *in, const char *path, const char *older, size_t budget) {
+    compressed_log_options_t o = { COMPRESSED_LOG_FRAME_SIZE, budget, 6 };
+    compressed_log_t *log = compressed_log_open(path, older, &o);
+    for (size_t i = 0; i < LINES; i++) {
+        // Without the newline, which the log adds.
+        if (compressed_log_append(log, in->buf + in->offsets[i], in->offsets[i + 1] - in->offsets[i] - 1) != 0) {
+            fprintf(stderr, "append failed\n");
+            exit(1);
+        }
+    }
+    compressed_log_close(log);
+}
+
+static size_t count_lines(const char *buf, size_t len) {
+    size_t n = 0;
+    for (const char *p = buf; (p = memchr(p, '\n', (size_t)(buf + len - p))) != NULL; p++) {
+        n++;
+    }
+    return n;
+}
+
+static size_t file_size(const char *path) {
+    size_t len;
+    free(fixture_read_file(path, &len));
+    return len;
+}
+
+// The last lines of a plain file: the file read whole, like getAllLogs, and the lines found from its end.
+static size_t tail_plain(const char *path, size_t lines) {
+    size_t len;
+    char *data = fixture_read_file(path, &len);
+    size_t start = len;
+    for (size_t n = 0; start > 0 && n <= lines; start--) {
+        if (data[start - 1] == '\n' && n++ == lines) {
+            break;
+        }
+    }
+    free(data);
+    return len - start;
+}
+
+static size_t tail_compressed(const char *path, size_t lines) {
+    compressed_log_reader_t *r = compressed_log_reader_open(path);
+    char *out;
+    size_t len;
+    compressed_log_reader_tail(r, lines, &out, &len);
+    free(out);
+    compressed_log_reader_free(r);
+    return len;
+}
+
+static void run(const input_t *in, const char *dir, const char *name, size_t budget) {
+    char label[128];
+    char *plain, *plain_older, *comp, *comp_older;
+    asprintf(&plain, "%s/%s", dir, name);
+    asprintf(&plain_older, "%s/%s.1", dir, name);
+    asprintf(&comp, "%s/%s.z", dir, name);
+    asprintf(&comp_older, "%s/%s.z.1", dir, name);
+    uint64_t bytes = in->offsets[LINES];
+
+    uint64_t start = bench_now_ns();
+    write_plain(in, plain, plain_older, budget);
+    snprintf(label, sizeof(label), "compressed_log/%s/write_plain_baseline", name);
+    bench_report(label, LINES, bench_now_ns() - start, bytes);
+
+    start = bench_now_ns();
+    write_compressed(in, comp, comp_older, budget);
+    snprintf(label, sizeof(label), "compressed_log/%s/write_compressed", name);
+    bench_report(label, LINES, bench_now_ns() - start, bytes);
+
+    // History held by a full, rotated file, and compression over both files.
+    size_t plain_lines = 0, comp_lines = 0, comp_raw = 0, comp_stored = 0;
+    const char *plain_paths[2] = { plain_older, plain };
+    const char *comp_paths[2] = { comp_older, comp };
+    for (int f = 0; f < 2; f++) {
+        size_t len;
+        char *data = fixture_read_file(plain_paths[f], &len);
+        if (f == 0) {
+            plain_lines = count_lines(data, len);
+        }
+        free(data);
+
+        compressed_log_reader_t *r = compressed_log_reader_open(comp_paths[f]);
+        if (f == 0) {
+            comp_lines = compressed_log_reader_line_count(r);
+        }
+        for (size_t i = 0; i < compressed_log_reader_frame_count(r); i++) {
+            comp_raw += compressed_log_reader_frame(r, i)->raw_len;
+        }
+        compressed_log_reader_free(r);
+        comp_stored += file_size(comp_paths[f]);
+    }
+    snprintf(label, sizeof(label), "compressed_log/%s/plain_lines_per_file", name);
+    bench_counter(label, (double)plain_lines, "lines");
+    snprintf(label, sizeof(label), "compressed_log/%s/compressed_lines_per_file", name);
+    bench_counter(label, (double)comp_lines, "lines");
+    snprintf(label, sizeof(label), "compressed_log/%s/history_ratio", name);
+    bench_counter(label, (double)comp_lines / (double)plain_lines, "x");
+    snprintf(label, sizeof(label), "compressed_log/%s/compression_ratio", name);
+    bench_counter(label, (double)comp_raw / (double)comp_stored, "x");
+
+    // The last lines of the current file, and of both files.
+    size_t read_bytes = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < READ_ITERATIONS; i++) {
+        read_bytes += tail_plain(plain, TAIL_LINES);
+    }
+    snprintf(label, sizeof(label), "compressed_log/%s/tail_plain_baseline", name);
+    bench_report(label, READ_ITERATIONS, bench_now_ns() - start, read_bytes);
+
+    read_bytes = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < READ_ITERATIONS; i++) {
+        read_bytes += tail_compressed(comp, TAIL_LINES);
+    }
+    snprintf(label, sizeof(label), "compressed_log/%s/tail_compressed", name);
+    bench_report(label, READ_ITERATIONS, bench_now_ns() - start, read_bytes);
+
+    read_bytes = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < READ_ITERATIONS; i++) {
+        for (int f = 0; f < 2; f++) {
+            read_bytes += tail_plain(plain_paths[f], SIZE_MAX);
+        }
+    }
+    snprintf(label, sizeof(label), "compressed_log/%s/read_all_plain_baseline", name);
+    bench_report(label, READ_ITERATIONS, bench_now_ns() - start, read_bytes);
+
+    read_bytes = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < READ_ITERATIONS; i++) {
+        for (int f = 0; f < 2; f++) {
+            read_bytes += tail_compressed(comp_paths[f], SIZE_MAX);
+        }
+    }
+    snprintf(label, sizeof(label), "compressed_log/%s/read_all_compressed", name);
+    bench_report(label, READ_ITERATIONS, bench_now_ns() - start, read_bytes);
+
+    free(plain);
+    free(plain_older);
+    free(comp);
+    free(comp_older);
+}
+
+int main(void) {
+    char *dir = fixture_tmpdir();
+
+    input_t in;
+    in.offsets = malloc((LINES + 1) * sizeof(size_t));
+    in.buf = malloc((size_t)LINES * 1024);
+    uint64_t state = 1;
+    int64_t now_ms = INT64_C(1537351200000);
+    size_t len = 0;
+    for (size_t i = 0; i < LINES; i++) {
+        fixture_notice_t n;
+        fixture_notice(&state, &now_ms, &n);
+        in.offsets[i] = len;
+        len += fixture_notice_line(in.buf + len, 1023, &n);
+        in.buf[len++] = '\n';
+    }
+    in.offsets[LINES] = len;
+
+    run(&in, dir, "extension_notices", 64000);
+    run(&in, dir, "container_notices", 164000);
+
+    free(in.buf);
+    free(in.offsets);
+    fixture_rmdir(dir);
+    free(dir);
+    return 0;
+}
@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "CompressedLog.h"
+#include "check.h"
+#include "fixtures.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_SIZE 4096
+#define MAX_LINE 4096
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t *line_starts;
+    size_t line_count;
+} lines_t;
+
+static char * path_join(const char *dir, const char *name) {
+    char *p = NULL;
+    CHECK(asprintf(&p, "%s/%s", dir, name) > 0);
+    return p;
+}
+
+static void lines_add(lines_t *l, const char *line, size_t len) {
+    if (l->len + len + 1 > l->cap) {
+        l->cap = (l->len + len + 1) * 2;
+        l->buf = realloc(l->buf, l->cap);
+    }
+    l->line_starts = realloc(l->line_starts, (l->line_count + 1) * sizeof(size_t));
+    l->line_starts[l->line_count++] = l->len;
+    memcpy(l->buf + l->len, line, len);
+    l->buf[l->len + len] = '\n';
+    l->len += len + 1;
+}
+
+static void lines_free(lines_t *l) {
+    free(l->buf);
+    free(l->line_starts);
+}
+
+// Appends count notices to the log, and to the expected lines.
+static void append_notices(compressed_log_t *log, lines_t *expected, size_t count, uint64_t *state, int64_t *now_ms) {
+    char line[MAX_LINE];
+    for (size_t i = 0; i < count; i++) {
+        fixture_notice_t n;
+        fixture_notice(state, now_ms, &n);
+        size_t len = fixture_notice_line(line, sizeof(line), &n);
+        CHECK(compressed_log_append(log, line, len) == 0);
+        lines_add(expected, line, len);
+    }
+}
+
+// Checks that the file holds lines [first, first + count) of the expected lines.
+static void check_file(const char *path, const lines_t *expected, size_t first, size_t count) {
+    compressed_log_reader_t *r = compressed_log_reader_open(path);
+    CHECK(r != NULL);
+    CHECK_EQ_INT(compressed_log_reader_line_count(r), count);
+
+    char *out;
+    size_t len;
+    CHECK_EQ_INT(compressed_log_reader_tail(r, SIZE_MAX, &out, &len), count);
+    size_t start = first < expected->line_count ? expected->line_starts[first] : expected->len;
+    size_t end = first + count < expected->line_count ? expected->line_starts[first + count] : expected->len;
+    CHECK_EQ_INT(len, end - start);
+    CHECK(memcmp(out, expected->buf + start, len) == 0);
+    free(out);
+
+    // Frames follow each other, and each one reads on its own.
+    size_t line = 0;
+    for (size_t i = 0; i < compressed_log_reader_frame_count(r); i++) {
+        const compressed_log_frame_t *f = compressed_log_reader_frame(r, i);
+        CHECK_EQ_INT(f->first_line, line);
+        char *raw = malloc(f->raw_len + 1);
+        CHECK_EQ_INT(compressed_log_reader_read(r, i, raw, f->raw_len), f->raw_len);
+        CHECK(memcmp(raw, expected->buf + expected->line_starts[first + line], f->raw_len) == 0);
+        CHECK_EQ_INT(compressed_log_reader_read(r, i, raw, f->raw_len - 1), -1);
+        free(raw);
+        line += f->line_count;
+    }
+    CHECK(compressed_log_reader_frame(r, compressed_log_reader_frame_count(r)) == NULL);
+    compressed_log_reader_free(r);
+}
+
+static void check_frames(const char *path, size_t compressed, int has_tail) {
+    compressed_log_reader_t *r = compressed_log_reader_open(path);
+    CHECK(r != NULL);
+    size_t n = compressed_log_reader_frame_count(r);
+    CHECK_EQ_INT(n, compressed + (has_tail ? 1 : 0));
+    for (size_t i = 0; i < n; i++) {
+        CHECK_EQ_INT(compressed_log_reader_frame(r, i)->compressed, i < compressed);
+    }
+    compressed_log_reader_free(r);
+}
+
+static compressed_log_options_t options(size_t max_file_size) {
+    compressed_log_options_t o = { FRAME_SIZE, max_file_size, 6 };
+    return o;
+}
+
+static void test_round_trip(void) {
+    char *dir = fixture_tmpdir();
+    char *current = path_join(dir, "notices");
+    char *older = path_join(dir, "notices.1");
+    compressed_log_options_t o = options(1 << 30);
+
+    compressed_log_t *log = compressed_log_open(current, older, &o);
+    CHECK(log != NULL);
+    lines_t expected = {0};
+    uint64_t state = 42;
+    int64_t now_ms = INT64_C(1537351200000);
+    append_notices(log, &expected, 3000, &state, &now_ms);
+
+    // Complete frames are deflated as they fill up, and lines after them are readable right away.
+    check_file(current, &expected, 0, 3000);
+    compressed_log_reader_t *r = compressed_log_reader_open(current);
+    size_t frames = compressed_log_reader_frame_count(r);
+    CHECK(frames > 10);
+    CHECK(!compressed_log_reader_frame(r, frames - 1)->compressed);
+    compressed_log_reader_free(r);
+    CHECK(compressed_log_size(log) * 4 < expected.len);
+
+    CHECK(compressed_log_flush(log) == 0);
+    check_frames(current, frames, 0);
+    check_file(current, &expected, 0, 3000);
+    CHECK(compressed_log_flush(log) == 0);
+    check_frames(current, frames, 0);
+
+    // Reopening appends after what is there.
+    compressed_log_close(log);
+    log = compressed_log_open(current, older, &o);
+    CHECK(log != NULL);
+    append_notices(log, &expected, 500, &state, &now_ms);
+    compressed_log_close(log);
+    check_file(current, &expected, 0, 3500);
+
+    // The last lines are read from the last frames only.
+    r = compressed_log_reader_open(current);
+    char *out;
+    size_t len;
+    CHECK_EQ_INT(compressed_log_reader_tail(r, 100, &out, &len), 100);
+    size_t start = expected.line_starts[3400];
+    CHECK_EQ_INT(len, expected.len - start);
+    CHECK(memcmp(out, expected.buf + start, len) == 0);
+    free(out);
+    CHECK_EQ_INT(compressed_log_reader_tail(r, 0, &out, &len), 0);
+    CHECK_EQ_INT(len, 0);
+    free(out);
+    compressed_log_reader_free(r);
+
+    lines_free(&expected);
+    free(current);
+    free(older);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+static void test_rotation(void) {
+    char *dir = fixture_tmpdir();
+    char *current = path_join(dir, "notices");
+    char *older = path_join(dir, "notices.1");
+    compressed_log_options_t o = options(64000);
+
+    compressed_log_t *log = compressed_log_open(current, older, &o);
+    CHECK(log != NULL);
+    lines_t expected = {0};
+    uint64_t state = 7;
+    int64_t now_ms = INT64_C(1537351200000);
+    size_t total = 0;
+    while (1) {
+        append_notices(log, &expected, 1, &state, &now_ms);
+        total++;
+        if (compressed_log_size(log) == 0) {
+            break;
+        }
+        CHECK(compressed_log_size(log) < o.max_file_size);
+    }
+    CHECK(total > 1000);
+
+    // The rotated file holds every line written so far, within the size limit, and is read from its index.
+    size_t len;
+    char *data = fixture_read_file(older, &len);
+    CHECK(len <= o.max_file_size);
+    CHECK(memcmp(data + len - 4, "PSLI", 4) == 0);
+    free(data);
+    check_file(older, &expected, 0, total);
+
+    // Another rotation replaces it.
+    append_notices(log, &expected, 100, &state, &now_ms);
+    CHECK(compressed_log_rotate(log) == 0);
+    check_file(older, &expected, total, 100);
+    CHECK_EQ_INT(compressed_log_size(log), 0);
+    check_file(current, &expected, total + 100, 0);
+    compressed_log_close(log);
+
+    // A rotated file that wasn't renamed is appended to as a current file.
+    char *copy = path_join(dir, "notices.copy");
+    data = fixture_read_file(older, &len);
+    FILE *f = fopen(copy, "wb");
+    CHECK(fwrite(data, 1, len, f) == len);
+    fclose(f);
+    free(data);
+    o = options(1 << 30);
+    log = compressed_log_open(copy, older, &o);
+    CHECK(log != NULL);
+    lines_t more = {0};
+    for (size_t i = total; i < total + 100; i++) {
+        size_t end = i + 1 < expected.line_count ? expected.line_starts[i + 1] : expected.len;
+        lines_add(&more, expected.buf + expected.line_starts[i], end - expected.line_starts[i] - 1);
+    }
+    append_notices(log, &more, 10, &state, &now_ms);
+    compressed_log_close(log);
+    check_file(copy, &more, 0, 110);
+
+    lines_free(&more);
+    lines_free(&expected);
+    free(copy);
+    free(current);
+    free(older);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+static void test_plain_file(void) {
+    char *dir = fixture_tmpdir();
+    char *current = path_join(dir, "notices");
+    char *older = path_join(dir, "notices.1");
+
+    // A notices file written one line at a time reads as it is.
+    uint64_t state = 3;
+    int64_t now_ms = INT64_C(1537351200000);
+    long count = fixture_write_notices_file(current, 20000, &state, &now_ms);
+    CHECK(count > 0);
+    size_t len;
+    char *data = fixture_read_file(current, &len);
+    lines_t expected = {0};
+    for (char *p = data, *nl; (nl = memchr(p, '\n', (size_t)(data + len - p))) != NULL; p = nl + 1) {
+        lines_add(&expected, p, (size_t)(nl - p));
+    }
+    free(data);
+    CHECK_EQ_INT(expected.line_count, count);
+    check_file(current, &expected, 0, (size_t)count);
+    check_frames(current, 0, 1);
+
+    // Appending to it deflates it.
+    compressed_log_options_t o = options(1 << 30);
+    compressed_log_t *log = compressed_log_open(current, older, &o);
+    CHECK(log != NULL);
+    append_notices(log, &expected, 1, &state, &now_ms);
+    CHECK(compressed_log_flush(log) == 0);
+    compressed_log_close(log);
+    check_frames(current, 1, 0);
+    check_file(current, &expected, 0, (size_t)count + 1);
+
+    // A last line without its newline is ended before the next one.
+    FILE *f = fopen(current, "wb");
+    fputs("{\"a\":1}\n{\"b\":", f);
+    fclose(f);
+    log = compressed_log_open(current, older, &o);
+    CHECK(compressed_log_append(log, "{\"c\":3}", 7) == 0);
+    compressed_log_close(log);
+    data = fixture_read_file(current, &len);
+    CHECK_EQ_INT(len, 22);
+    CHECK(memcmp(data, "{\"a\":1}\n{\"b\":\n{\"c\":3}\n", len) == 0);
+    free(data);
+
+    // An empty file has no frames.
+    f = fopen(current, "wb");
+    fclose(f);
+    compressed_log_reader_t *r = compressed_log_reader_open(current);
+    CHECK_EQ_INT(compressed_log_reader_frame_count(r), 0);
+    char *out;
+    CHECK_EQ_INT(compressed_log_reader_tail(r, 10, &out, &len), 0);
+    CHECK_EQ_INT(len, 0);
+    free(out);
+    compressed_log_reader_free(r);
+
+    lines_free(&expected);
+    free(current);
+    free(older);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+static void test_damaged_file(void) {
+    char *dir = fixture_tmpdir();
+    char *current = path_join(dir, "notices");
+    char *older = path_join(dir, "notices.1");
+    compressed_log_options_t o = options(1 << 30);
+
+    compressed_log_t *log = compressed_log_open(current, older, &o);
+    lines_t expected = {0};
+    uint64_t state = 11;
+    int64_t now_ms = INT64_C(1537351200000);
+    append_notices(log, &expected, 200, &state, &now_ms);
+    CHECK(compressed_log_flush(log) == 0);
+    compressed_log_reader_t *r = compressed_log_reader_open(current);
+    size_t frames = compressed_log_reader_frame_count(r);
+    compressed_log_reader_free(r);
+
+    // The tail the next frame is deflated from.
+    size_t frame_end = (size_t)compressed_log_size(log);
+    size_t first = expected.line_count;
+    append_notices(log, &expected, 10, &state, &now_ms);
+    size_t len;
+    char *before = fixture_read_file(current, &len);
+    CHECK(compressed_log_flush(log) == 0);
+    compressed_log_close(log);
+    size_t sealed_len;
+    char *sealed = fixture_read_file(current, &sealed_len);
+    check_file(current, &expected, 0, first + 10);
+
+    // A last frame damaged otherwise fails its CRC, and what is after the last good frame is tail.
+    FILE *f = fopen(current, "wb");
+    fwrite(sealed, 1, sealed_len - 10, f);
+    fwrite(before + sealed_len - 10, 1, len - (sealed_len - 10), f);
+    fclose(f);
+    r = compressed_log_reader_open(current);
+    CHECK(r != NULL);
+    CHECK_EQ_INT(compressed_log_reader_frame_count(r), frames + 1);
+    const compressed_log_frame_t *tail = compressed_log_reader_frame(r, compressed_log_reader_frame_count(r) - 1);
+    CHECK(!tail->compressed);
+    CHECK_EQ_INT(tail->offset, frame_end);
+    CHECK_EQ_INT(tail->first_line, first);
+    compressed_log_reader_free(r);
+
+    // A truncated file keeps its whole frames.
+    f = fopen(current, "wb");
+    fwrite(sealed, 1, frame_end + 30, f);
+    fclose(f);
+    r = compressed_log_reader_open(current);
+    CHECK_EQ_INT(compressed_log_reader_frame_count(r), frames + 1);
+    CHECK_EQ_INT(compressed_log_reader_frame(r, frames)->first_line, first);
+    CHECK_EQ_INT(compressed_log_reader_frame(r, frames)->stored_len, 30);
+    compressed_log_reader_free(r);
+
+    // A frame damaged in a rotated file is found from the index, and fails to read.
+    f = fopen(current, "wb");
+    fwrite(sealed, 1, sealed_len, f);
+    fclose(f);
+    log = compressed_log_open(current, older, &o);
+    CHECK(compressed_log_rotate(log) == 0);
+    compressed_log_close(log);
+    char *rotated = fixture_read_file(older, &len);
+    rotated[COMPRESSED_LOG_FRAME_HEADER_LEN + 5] ^= 0x55;
+    r = compressed_log_reader_parse(rotated, len);
+    CHECK(r != NULL);
+    CHECK_EQ_INT(compressed_log_reader_frame_count(r), frames + 1);
+    char *out;
+    CHECK_EQ_INT(compressed_log_reader_tail(r, SIZE_MAX, &out, &len), -1);
+    CHECK_EQ_INT(compressed_log_reader_tail(r, 10, &out, &len), 10);
+    free(out);
+    compressed_log_reader_free(r);
+
+    free(rotated);
+    free(before);
+    free(sealed);
+    lines_free(&expected);
+    free(current);
+    free(older);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+// Writes the parts of a file.
+static void write_parts(const char *path, const char *a, size_t a_len, const char *b, size_t b_len, const char *c,
+                        size_t c_len) {
+    FILE *f = fopen(path, "wb");
+    CHECK(f != NULL);
+    fwrite(a, 1, a_len, f);
+    fwrite(b, 1, b_len, f);
+    fwrite(c, 1, c_len, f);
+    fclose(f);
+}
+
+// Checks that a file left by a seal cut short reads whole, and that the writer carries on from it without losing
+// lines either.
+static void check_resolved(const char *current, const char *older, const lines_t *expected, size_t sealed_len,
+                           size_t before_len) {
+    check_file(current, expected, 0, expected->line_count);
+    compressed_log_options_t o = options(1 << 30);
+    compressed_log_t *log = compressed_log_open(current, older, &o);
+    CHECK(log != NULL);
+    uint64_t size = compressed_log_size(log);
+    CHECK(size == sealed_len || size == before_len);
+    compressed_log_close(log);
+    check_file(current, expected, 0, expected->line_count);
+}
+
+// A seal writes the frame after the tail, then over it, then truncates the file. Killed at any point, no line is
+// lost.
+static void test_killed_while_sealing(void) {
+    char *dir = fixture_tmpdir();
+    char *current = path_join(dir, "notices");
+    char *older = path_join(dir, "notices.1");
+    compressed_log_options_t o = options(1 << 30);
+
+    compressed_log_t *log = compressed_log_open(current, older, &o);
+    lines_t expected = {0};
+    uint64_t state = 13;
+    int64_t now_ms = INT64_C(1537351200000);
+    append_notices(log, &expected, 120, &state, &now_ms);
+    size_t before_len, sealed_len;
+    char *before = fixture_read_file(current, &before_len);
+    compressed_log_reader_t *r = compressed_log_reader_open(current);
+    const compressed_log_frame_t *last = compressed_log_reader_frame(r, compressed_log_reader_frame_count(r) - 1);
+    CHECK(!last->compressed);
+    size_t frames_end = (size_t)last->offset;
+    compressed_log_reader_free(r);
+    CHECK(compressed_log_flush(log) == 0);
+    compressed_log_close(log);
+    char *sealed = fixture_read_file(current, &sealed_len);
+
+    const char *tail = before + frames_end, *frame = sealed + frames_end;
+    size_t tail_len = before_len - frames_end, frame_len = sealed_len - frames_end;
+    CHECK(frame_len < tail_len);
+    for (size_t cut = 0; cut <= frame_len; cut++) {
+        // Killed while the frame was written after the tail.
+        write_parts(current, before, before_len, frame, cut, NULL, 0);
+        check_resolved(current, older, &expected, sealed_len, before_len);
+
+        // Killed while the frame was written over the tail, or before the file was truncated.
+        write_parts(current, sealed, frames_end + cut, tail + cut, tail_len - cut, frame, frame_len);
+        check_resolved(current, older, &expected, sealed_len, before_len);
+    }
+
+    free(before);
+    free(sealed);
+    lines_free(&expected);
+    free(current);
+    free(older);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+static void test_invalid_options(void) {
+    compressed_log_options_t o = options(0);
+    CHECK(compressed_log_open("/nonexistent/notices", "/nonexistent/notices.1", &o) == NULL);
+    o = options(64000);
+    o.level = 0;
+    CHECK(compressed_log_open("/nonexistent/notices", "/nonexistent/notices.1", &o) == NULL);
+    o = options(64000);
+    CHECK(compressed_log_open("/nonexistent/notices", "/nonexistent/notices.1", &o) == NULL);
+    CHECK(compressed_log_reader_open("/nonexistent/notices") == NULL);
+}
+
+int main(void) {
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_rotation);
+    RUN_TEST(test_plain_file);
+    RUN_TEST(test_damaged_file);
+    RUN_TEST(test_killed_while_sealing);
+    RUN_TEST(test_invalid_options);
+    return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Re-wrapping the attributes of a receipt with 1000 purchases into ANY_t, and re-encoding the whole
+ * attribute set: ANY_fromType's growing-buffer callback against the opt-in measure-then-encode path
+ * (speed and retained memory), and I/O vector encoding against a contiguous buffer.
+ */
+
+#include "ANY.h"
+#include "ReceiptAttributes.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "receipt_reference.h"
+#include <string.h>
+
+#define IAPS 1000
+#define ROUNDS 20
+
+typedef struct {
+    uint8_t *buffer;
+    size_t offset;
+    size_t size;
+} growing_buffer_t;
+
+// A copy of ANY_fromType's callback (grows by 4x as chunks arrive), so its capacity can be observed.
+static int growing_consume_bytes(const void *buffer, size_t size, void *key) {
+    growing_buffer_t *arg = key;
+    if (arg->offset + size >= arg->size) {
+        size_t nsize = (arg->size ? arg->size << 2 : 16) + size;
+        void *p = realloc(arg->buffer, nsize);
+        if (p == NULL) {
+            return -1;
+        }
+        arg->buffer = p;
+        arg->size = nsize;
+    }
+    memcpy(arg->buffer + arg->offset, buffer, size);
+    arg->offset += size;
+    return 0;
+}
+
+// Bytes allocated for ANY buffers by the growing callback, which keeps its final capacity.
+static size_t growing_allocated;
+
+static int any_from_type_growing(ANY_t *st, asn_TYPE_descriptor_t *td, void *sptr) {
+    growing_buffer_t arg = { 0 };
+    asn_enc_rval_t er = der_encode(td, sptr, growing_consume_bytes, &arg);
+    if (er.encoded == -1) {
+        free(arg.buffer);
+        return -1;
+    }
+    growing_allocated += arg.size;
+    free(st->buf);
+    st->buf = arg.buffer;
+    st->size = (int)arg.offset;
+    return 0;
+}
+
+static volatile size_t sink;
+
+int main(void) {
+    uint64_t state = 61;
+    size_t len, payload_len;
+    uint8_t *receipt = fixture_receipt(&state, IAPS, 1514764800000, NULL, &len), *payload;
+    receipt_ref_payload(receipt, len, &payload, &payload_len);
+    ReceiptAttributes_t *attrs = NULL;
+    ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, payload_len);
+    int count = attrs->list.count;
+
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < count; i++) {
+            ANY_t any = { 0 };
+            ANY_fromType(&any, &asn_DEF_ReceiptAttribute, attrs->list.array[i]);
+            sink += any.size;
+            free(any.buf);
+        }
+    }
+    bench_report("der/any_from_type", (uint64_t)count * ROUNDS, bench_now_ns() - start, payload_len * ROUNDS);
+
+    start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < count; i++) {
+            ANY_t any = { 0 };
+            ANY_fromType_exact(&any, &asn_DEF_ReceiptAttribute, attrs->list.array[i]);
+            sink += any.size;
+            free(any.buf);
+        }
+    }
+    bench_report("der/any_from_type/exact", (uint64_t)count * ROUNDS, bench_now_ns() - start, payload_len * ROUNDS);
+
+    // What the wrapped attributes hold on to: the growing buffer keeps up to 4x slack.
+    size_t exact = 0;
+    growing_allocated = 0;
+    for (int i = 0; i < count; i++) {
+        ANY_t growing = { 0 }, any = { 0 };
+        any_from_type_growing(&growing, &asn_DEF_ReceiptAttribute, attrs->list.array[i]);
+        ANY_fromType_exact(&any, &asn_DEF_ReceiptAttribute, attrs->list.array[i]);
+        exact += any.size + 1;
+        free(growing.buf);
+        free(any.buf);
+    }
+    bench_counter("der/any_from_type/retained", growing_allocated / 1024.0, "KB");
+    bench_counter("der/any_from_type/exact/retained", exact / 1024.0, "KB");
+
+    start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        ANY_t any = { 0 };
+        ANY_fromType(&any, &asn_DEF_ReceiptAttributes, attrs);
+        sink += any.size;
+        free(any.buf);
+    }
+    bench_report("der/encode_set/any_from_type", ROUNDS, bench_now_ns() - start, payload_len * ROUNDS);
+
+    start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        void *buffer;
+        sink += der_encode_to_new_buffer(&asn_DEF_ReceiptAttributes, attrs, &buffer);
+        free(buffer);
+    }
+    bench_report("der/encode_set/to_new_buffer", ROUNDS, bench_now_ns() - start, payload_len * ROUNDS);
+
+    der_iovec_t v = { 0 };
+    start = bench_now_ns();
+    for (int round = 0; round < ROUNDS; round++) {
+        der_encode_to_iovec(&asn_DEF_ReceiptAttributes, attrs, &v);
+        sink += v.length;
+    }
+    bench_report("der/encode_set/to_iovec", ROUNDS, bench_now_ns() - start, payload_len * ROUNDS);
+    bench_counter("der/encode_set/to_iovec/copied_fraction", (double)v.scratch_used / (double)v.length, "ratio");
+    bench_counter("der/encode_set/to_iovec/elements", v.iovcnt, "iovecs");
+    der_iovec_free(&v);
+
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    free(payload);
+    free(receipt);
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Measure-then-encode and I/O vector encoding in the asn1c DER encoder, checked against
+ * der_encode_to_buffer on receipt attributes.
+ */
+
+#include "ANY.h"
+#include "ReceiptAttributes.h"
+#include "check.h"
+#include "fixtures.h"
+#include "receipt_reference.h"
+#include <string.h>
+
+static ReceiptAttributes_t * decode_attributes(size_t iaps, uint8_t **payload, size_t *payload_len) {
+    uint64_t state = 61;
+    size_t len;
+    uint8_t *receipt = fixture_receipt(&state, iaps, 1514764800000, NULL, &len);
+    CHECK_EQ_INT(receipt_ref_payload(receipt, len, payload, payload_len), 0);
+    free(receipt);
+
+    ReceiptAttributes_t *attrs = NULL;
+    asn_dec_rval_t rval = ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, *payload, *payload_len);
+    CHECK(rval.code == RC_OK);
+    return attrs;
+}
+
+static void test_new_buffer(void) {
+    uint8_t *payload;
+    size_t payload_len;
+    ReceiptAttributes_t *attrs = decode_attributes(100, &payload, &payload_len);
+
+    CHECK_EQ_INT(der_encoded_size(&asn_DEF_ReceiptAttributes, attrs), payload_len);
+    void *buffer = NULL;
+    CHECK_EQ_INT(der_encode_to_new_buffer(&asn_DEF_ReceiptAttributes, attrs, &buffer), payload_len);
+    CHECK(memcmp(buffer, payload, payload_len) == 0);
+    CHECK_EQ_INT(((uint8_t *)buffer)[payload_len], 0);
+    free(buffer);
+
+    // Each attribute on its own, matching the fixed-size encoder.
+    for (int i = 0; i < attrs->list.count; i++) {
+        ReceiptAttribute_t *attr = attrs->list.array[i];
+        uint8_t expected[4096];
+        asn_enc_rval_t er = der_encode_to_buffer(&asn_DEF_ReceiptAttribute, attr, expected, sizeof(expected));
+        CHECK(er.encoded > 0);
+        CHECK_EQ_INT(der_encode_to_new_buffer(&asn_DEF_ReceiptAttribute, attr, &buffer), er.encoded);
+        CHECK(memcmp(buffer, expected, er.encoded) == 0);
+        free(buffer);
+    }
+
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    free(payload);
+}
+
+static void test_any_from_type(void) {
+    uint8_t *payload;
+    size_t payload_len;
+    ReceiptAttributes_t *attrs = decode_attributes(20, &payload, &payload_len);
+
+    ANY_t any = { 0 }, exact = { 0 };
+    for (int i = 0; i < attrs->list.count; i++) {
+        ReceiptAttribute_t *attr = attrs->list.array[i];
+        // Reusing the ANY replaces its previous contents.
+        CHECK_EQ_INT(ANY_fromType(&any, &asn_DEF_ReceiptAttribute, attr), 0);
+        CHECK_EQ_INT(any.size, der_encoded_size(&asn_DEF_ReceiptAttribute, attr));
+
+        // The exact-size variant produces the same encoding.
+        CHECK_EQ_INT(ANY_fromType_exact(&exact, &asn_DEF_ReceiptAttribute, attr), 0);
+        CHECK_EQ_INT(exact.size, any.size);
+        CHECK(memcmp(exact.buf, any.buf, any.size) == 0);
+
+        ReceiptAttribute_t *decoded = NULL;
+        CHECK_EQ_INT(ANY_to_type(&any, &asn_DEF_ReceiptAttribute, (void **)&decoded), 0);
+        CHECK_EQ_INT(decoded->type, attr->type);
+        CHECK_EQ_INT(decoded->value.size, attr->value.size);
+        CHECK(memcmp(decoded->value.buf, attr->value.buf, attr->value.size) == 0);
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttribute, decoded);
+    }
+    CHECK_EQ_INT(ANY_fromType(&any, &asn_DEF_ReceiptAttribute, NULL), 0);
+    CHECK_EQ_INT(any.size, 0);
+    CHECK_EQ_INT(ANY_fromType_exact(&exact, &asn_DEF_ReceiptAttribute, NULL), 0);
+    CHECK_EQ_INT(exact.size, 0);
+
+    ANY_t *wrapped = ANY_new_fromType(&asn_DEF_ReceiptAttributes, attrs);
+    CHECK(wrapped != NULL);
+    CHECK_EQ_INT(wrapped->size, payload_len);
+    CHECK(memcmp(wrapped->buf, payload, payload_len) == 0);
+    ASN_STRUCT_FREE(asn_DEF_ANY, wrapped);
+
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    free(payload);
+}
+
+static void test_iovec(void) {
+    uint8_t *payload;
+    size_t payload_len;
+    ReceiptAttributes_t *attrs = decode_attributes(100, &payload, &payload_len);
+
+    der_iovec_t v = { 0 };
+    for (int round = 0; round < 2; round++) {
+        asn_enc_rval_t er = der_encode_to_iovec(&asn_DEF_ReceiptAttributes, attrs, &v);
+        CHECK_EQ_INT(er.encoded, payload_len);
+        CHECK_EQ_INT(v.length, payload_len);
+
+        uint8_t *joined = malloc(payload_len);
+        size_t offset = 0;
+        for (int i = 0; i < v.iovcnt; i++) {
+            memcpy(joined + offset, v.iov[i].iov_base, v.iov[i].iov_len);
+            offset += v.iov[i].iov_len;
+        }
+        CHECK_EQ_INT(offset, payload_len);
+        CHECK(memcmp(joined, payload, payload_len) == 0);
+        free(joined);
+    }
+
+    // Long values are referenced, and the copies between them are coalesced.
+    int referenced = 0;
+    for (int i = 0; i < attrs->list.count; i++) {
+        const ReceiptAttribute_t *attr = attrs->list.array[i];
+        if (attr->value.size < DER_IOVEC_MIN_REFERENCE) {
+            continue;
+        }
+        referenced++;
+        int found = 0;
+        for (int j = 0; j < v.iovcnt && !found; j++) {
+            found = (v.iov[j].iov_base == attr->value.buf && v.iov[j].iov_len == (size_t)attr->value.size);
+        }
+        CHECK(found);
+    }
+    CHECK(referenced >= 100);
+    CHECK(v.iovcnt <= 2 * referenced + 1);
+
+    der_iovec_free(&v);
+    CHECK(v.iov == NULL && v.iovcnt == 0);
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    free(payload);
+}
+
+int main(void) {
+    RUN_TEST(test_new_buffer);
+    RUN_TEST(test_any_from_type);
+    RUN_TEST(test_iovec);
+    return 0;
+}
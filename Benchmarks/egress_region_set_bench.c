@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Egress region merge, membership and listing, against the ordered-set merge done by
+ * embeddedAndEmittedEgressRegions and the linear containsObject: check in onAvailableEgressRegions:,
+ * modelled here with an array of codes and a linear search.
+ */
+
+#include "EgressRegionSet.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define ITERATIONS 200000
+#define EMITTED 40
+#define EMBEDDED 30
+
+typedef struct {
+    char codes[EMITTED + EMBEDDED][3];
+    size_t count;
+} ordered_set_t;
+
+static int ordered_set_index(const ordered_set_t *o, const char *code) {
+    for (size_t i = 0; i < o->count; i++) {
+        if (strcmp(o->codes[i], code) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static void ordered_set_merge(ordered_set_t *o, char (*a)[3], size_t a_count, char (*b)[3], size_t b_count) {
+    o->count = 0;
+    for (size_t i = 0; i < a_count + b_count; i++) {
+        const char *code = (i < a_count) ? a[i] : b[i - a_count];
+        if (ordered_set_index(o, code) < 0) {
+            memcpy(o->codes[o->count++], code, 3);
+        }
+    }
+}
+
+int main(void) {
+    uint64_t state = 58;
+    char emitted[EMITTED][3], embedded[EMBEDDED][3];
+    const char *emitted_ptrs[EMITTED], *embedded_ptrs[EMBEDDED];
+    for (int i = 0; i < EMITTED + EMBEDDED; i++) {
+        char *code = (i < EMITTED) ? emitted[i] : embedded[i - EMITTED];
+        uint64_t r = fixture_rand(&state);
+        code[0] = (char)('A' + r % 26);
+        code[1] = (char)('A' + (r >> 8) % 26);
+        code[2] = '\0';
+        if (i < EMITTED) {
+            emitted_ptrs[i] = code;
+        } else {
+            embedded_ptrs[i - EMITTED] = code;
+        }
+    }
+
+    egress_region_set_t *s = egress_region_set_new();
+    egress_region_set_replace(s, EGRESS_REGION_SOURCE_EMITTED, emitted_ptrs, EMITTED);
+    egress_region_set_replace(s, EGRESS_REGION_SOURCE_EMBEDDED, embedded_ptrs, EMBEDDED);
+    uint64_t sink = 0;
+
+    uint16_t merged[EMITTED + EMBEDDED];
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        sink += egress_region_set_merged(s, EGRESS_REGION_ALL_SOURCES, merged, EMITTED + EMBEDDED);
+    }
+    bench_report("egress_region_set/merged_list", ITERATIONS, bench_now_ns() - start, 0);
+
+    ordered_set_t o;
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        ordered_set_merge(&o, emitted, EMITTED, embedded, EMBEDDED);
+        sink += o.count;
+    }
+    bench_report("egress_region_set/merged_list/ordered_set_baseline", ITERATIONS, bench_now_ns() - start, 0);
+
+    egress_region_bitmap_t bitmap;
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        egress_region_set_union(s, EGRESS_REGION_ALL_SOURCES, &bitmap);
+        sink += bitmap.words[i % 16];
+    }
+    bench_report("egress_region_set/union", ITERATIONS, bench_now_ns() - start, 0);
+
+    // Membership of the selected region, present or not.
+    const char *queries[] = { emitted[EMITTED - 1], "QQ", embedded[0], "ZZ" };
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        sink += egress_region_set_contains(s, 1u << EGRESS_REGION_SOURCE_EMITTED, queries[i % 4]);
+    }
+    bench_report("egress_region_set/contains", ITERATIONS, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        sink += ordered_set_index(&o, queries[i % 4]) >= 0;
+    }
+    bench_report("egress_region_set/contains/linear_baseline", ITERATIONS, bench_now_ns() - start, 0);
+
+    size_t len;
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS / 10; i++) {
+        uint8_t *buf = egress_region_set_serialize(s, &len);
+        egress_region_set_t *copy = egress_region_set_deserialize(buf, len);
+        sink += egress_region_set_count(copy, EGRESS_REGION_ALL_SOURCES);
+        egress_region_set_free(copy);
+        free(buf);
+    }
+    bench_report("egress_region_set/serialize_roundtrip", ITERATIONS / 10, bench_now_ns() - start, 0);
+    bench_counter("egress_region_set/serialized_size", (double)len, "bytes");
+    bench_counter("egress_region_set/regions", (double)egress_region_set_count(s, EGRESS_REGION_ALL_SOURCES), "regions");
+
+    egress_region_set_free(s);
+    return sink == 0 ? 1 : 0;
+}
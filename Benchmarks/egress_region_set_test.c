@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "EgressRegionSet.h"
+#include "check.h"
+#include "fixtures.h"
+#include <string.h>
+
+static void random_code(uint64_t *state, char code[3]) {
+    // A small alphabet, so that sources overlap.
+    uint64_t r = fixture_rand(state);
+    code[0] = (char)('A' + r % 6);
+    code[1] = (char)('A' + (r >> 8) % 6);
+    code[2] = '\0';
+}
+
+static void test_codes(void) {
+    char code[3];
+    for (int i = 0; i < 26 * 26; i++) {
+        CHECK_EQ_INT(egress_region_code(i, code), 0);
+        CHECK_EQ_INT(egress_region_index(code), i);
+    }
+    CHECK_EQ_INT(egress_region_index("AA"), 0);
+    CHECK_EQ_INT(egress_region_index("ZZ"), 675);
+    CHECK(egress_region_index("US") < EGRESS_REGION_INDEX_COUNT);
+    CHECK_EQ_INT(egress_region_index("us"), -1);
+    CHECK_EQ_INT(egress_region_index("U"), -1);
+    CHECK_EQ_INT(egress_region_index(""), -1);
+    CHECK_EQ_INT(egress_region_index("U1"), -1);
+    CHECK_EQ_INT(egress_region_index(NULL), -1);
+    CHECK_EQ_INT(egress_region_code(676, code), -1);
+    CHECK_EQ_INT(egress_region_code(-1, code), -1);
+}
+
+static void test_sources(void) {
+    egress_region_set_t *s = egress_region_set_new();
+    const char *emitted[] = { "US", "CA", "DE", "US", "usa", "XX1", "GB" };
+    const char *embedded[] = { "JP", "DE", "FR", "US" };
+    CHECK_EQ_INT(egress_region_set_replace(s, EGRESS_REGION_SOURCE_EMITTED, emitted, 7), 4);
+    CHECK_EQ_INT(egress_region_set_replace(s, EGRESS_REGION_SOURCE_EMBEDDED, embedded, 4), 4);
+    CHECK_EQ_INT(egress_region_set_replace(s, EGRESS_REGION_SOURCES, embedded, 4), -1);
+
+    CHECK(egress_region_set_contains(s, 1u << EGRESS_REGION_SOURCE_EMITTED, "CA"));
+    CHECK(!egress_region_set_contains(s, 1u << EGRESS_REGION_SOURCE_EMITTED, "JP"));
+    CHECK(egress_region_set_contains(s, EGRESS_REGION_ALL_SOURCES, "JP"));
+    CHECK(!egress_region_set_contains(s, EGRESS_REGION_ALL_SOURCES, "USA"));
+    CHECK(!egress_region_set_contains(s, EGRESS_REGION_ALL_SOURCES, "SE"));
+
+    CHECK_EQ_INT(egress_region_set_count(s, EGRESS_REGION_ALL_SOURCES), 6);
+    uint16_t merged[16];
+    CHECK_EQ_INT(egress_region_set_merged(s, EGRESS_REGION_ALL_SOURCES, merged, 16), 6);
+    const char *expected[] = { "US", "CA", "DE", "GB", "JP", "FR" };
+    for (int i = 0; i < 6; i++) {
+        CHECK_EQ_INT(merged[i], egress_region_index(expected[i]));
+    }
+    CHECK_EQ_INT(egress_region_set_merged(s, EGRESS_REGION_ALL_SOURCES, merged, 2), 6);
+    CHECK_EQ_INT(egress_region_set_merged(s, 1u << EGRESS_REGION_SOURCE_EMBEDDED, merged, 16), 4);
+    CHECK_EQ_INT(merged[0], egress_region_index("JP"));
+
+    CHECK_EQ_INT(egress_region_set_add(s, EGRESS_REGION_SOURCE_EMITTED, "SE"), 1);
+    CHECK_EQ_INT(egress_region_set_add(s, EGRESS_REGION_SOURCE_EMITTED, "SE"), 0);
+    CHECK_EQ_INT(egress_region_set_add(s, EGRESS_REGION_SOURCE_EMITTED, "se"), -1);
+    CHECK_EQ_INT(egress_region_set_add(s, -1, "SE"), -1);
+    CHECK_EQ_INT(egress_region_set_merged(s, EGRESS_REGION_ALL_SOURCES, merged, 16), 7);
+    CHECK_EQ_INT(merged[4], egress_region_index("SE"));
+
+    // Replacing with nothing clears the source.
+    CHECK_EQ_INT(egress_region_set_replace(s, EGRESS_REGION_SOURCE_EMITTED, NULL, 0), 0);
+    CHECK_EQ_INT(egress_region_set_count(s, EGRESS_REGION_ALL_SOURCES), 4);
+    CHECK(!egress_region_set_contains(s, EGRESS_REGION_ALL_SOURCES, "CA"));
+    egress_region_set_free(s);
+}
+
+// Compares against an ordered set merge done the obvious way.
+static void test_randomized_against_ordered_set(void) {
+    uint64_t state = 58;
+    egress_region_set_t *s = egress_region_set_new();
+    for (int round = 0; round < 2000; round++) {
+        char codes[EGRESS_REGION_SOURCES][40][3];
+        const char *ptrs[EGRESS_REGION_SOURCES][40];
+        size_t counts[EGRESS_REGION_SOURCES];
+        for (int src = 0; src < EGRESS_REGION_SOURCES; src++) {
+            counts[src] = fixture_rand(&state) % 40;
+            for (size_t i = 0; i < counts[src]; i++) {
+                random_code(&state, codes[src][i]);
+                ptrs[src][i] = codes[src][i];
+            }
+            egress_region_set_replace(s, src, ptrs[src], counts[src]);
+        }
+
+        unsigned mask = (unsigned)(fixture_rand(&state) % (EGRESS_REGION_ALL_SOURCES + 1));
+        char expected[EGRESS_REGION_SOURCES * 40][3];
+        size_t expected_count = 0;
+        for (int src = 0; src < EGRESS_REGION_SOURCES; src++) {
+            if (!(mask & (1u << src))) {
+                continue;
+            }
+            for (size_t i = 0; i < counts[src]; i++) {
+                size_t j = 0;
+                while (j < expected_count && strcmp(expected[j], codes[src][i]) != 0) {
+                    j++;
+                }
+                if (j == expected_count) {
+                    memcpy(expected[expected_count++], codes[src][i], 3);
+                }
+            }
+        }
+
+        uint16_t merged[EGRESS_REGION_SOURCES * 40];
+        CHECK_EQ_INT(egress_region_set_merged(s, mask, merged, EGRESS_REGION_SOURCES * 40), expected_count);
+        CHECK_EQ_INT(egress_region_set_count(s, mask), expected_count);
+        for (size_t i = 0; i < expected_count; i++) {
+            char code[3];
+            egress_region_code(merged[i], code);
+            CHECK(strcmp(code, expected[i]) == 0);
+            CHECK(egress_region_set_contains(s, mask, code));
+        }
+
+        egress_region_bitmap_t bitmap;
+        egress_region_set_union(s, mask, &bitmap);
+        size_t bits = 0;
+        for (int w = 0; w < EGRESS_REGION_INDEX_COUNT / 64; w++) {
+            bits += (size_t)__builtin_popcountll(bitmap.words[w]);
+        }
+        CHECK_EQ_INT(bits, expected_count);
+    }
+    egress_region_set_free(s);
+}
+
+static void test_serialization(void) {
+    egress_region_set_t *s = egress_region_set_new();
+    const char *emitted[] = { "US", "CA", "DE", "GB", "NL", "JP", "SG", "FR", "AT", "BE", "CH", "ES", "IN", "IT", "SE", "AU" };
+    const char *embedded[] = { "FI", "US", "NO" };
+    egress_region_set_replace(s, EGRESS_REGION_SOURCE_EMITTED, emitted, 16);
+    egress_region_set_replace(s, EGRESS_REGION_SOURCE_EMBEDDED, embedded, 3);
+
+    size_t len;
+    uint8_t *buf = egress_region_set_serialize(s, &len);
+    CHECK(buf != NULL);
+    CHECK_EQ_INT(len, 8 + 4 * 2 + 19 * 2);
+
+    egress_region_set_t *copy = egress_region_set_deserialize(buf, len);
+    CHECK(copy != NULL);
+    uint16_t a[32], b[32];
+    for (unsigned mask = 0; mask <= EGRESS_REGION_ALL_SOURCES; mask++) {
+        size_t n = egress_region_set_merged(s, mask, a, 32);
+        CHECK_EQ_INT(egress_region_set_merged(copy, mask, b, 32), n);
+        CHECK(memcmp(a, b, n * sizeof(uint16_t)) == 0);
+    }
+    egress_region_set_free(copy);
+
+    // Truncations, trailing bytes and bad contents are rejected.
+    for (size_t i = 0; i < len; i++) {
+        CHECK(egress_region_set_deserialize(buf, i) == NULL);
+    }
+    uint8_t *longer = malloc(len + 1);
+    memcpy(longer, buf, len);
+    longer[len] = 0;
+    CHECK(egress_region_set_deserialize(longer, len + 1) == NULL);
+    memcpy(longer, buf, len);
+    longer[4] = 2;
+    CHECK(egress_region_set_deserialize(longer, len) == NULL);
+    memcpy(longer, buf, len);
+    longer[12] = longer[10];            // Duplicate of the first region.
+    longer[13] = longer[11];
+    CHECK(egress_region_set_deserialize(longer, len) == NULL);
+    memcpy(longer, buf, len);
+    longer[11] = 0x03;                  // Index past "ZZ".
+    CHECK(egress_region_set_deserialize(longer, len) == NULL);
+    free(longer);
+
+    free(buf);
+    egress_region_set_free(s);
+}
+
+int main(void) {
+    RUN_TEST(test_codes);
+    RUN_TEST(test_sources);
+    RUN_TEST(test_randomized_against_ordered_set);
+    RUN_TEST(test_serialization);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The embedded server entries helpers as egressRegionsFromFile: uses them: read each line, drop the
+ * newline, hex decode it, skip to the JSON and parse it for the region. NSJSONSerialization is
+ * stood in for by the allocating reference parser.
+ */
+
+#define _GNU_SOURCE
+#include "EmbeddedServerEntriesHelpers.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "json_reference.h"
+#include <string.h>
+
+#define ENTRIES 500
+
+static volatile size_t sink;
+
+// Returns the number of regions read, or -1 on error.
+static long egress_regions_from_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    long regions = 0;
+    while (getline(&line, &len, fp) != -1) {
+        drop_newline_and_carriage_return(line);
+        char *decoded = hex_decode(line);
+        if (decoded == NULL) {
+            regions = -1;
+            break;
+        }
+        char *json = server_entry_json(decoded);
+        json_ref_t *doc = json ? json_ref_parse(json, strlen(json)) : NULL;
+        const json_ref_t *region = doc ? json_ref_path(doc, "region") : NULL;
+        if (region == NULL || region->type != JSON_REF_STRING) {
+            json_ref_free(doc);
+            free(decoded);
+            regions = -1;
+            break;
+        }
+        sink += region->string_len;
+        regions++;
+        json_ref_free(doc);
+        free(decoded);
+    }
+    free(line);
+    fclose(fp);
+    return regions;
+}
+
+int main(void) {
+    char *dir = fixture_tmpdir();
+    char *path;
+    asprintf(&path, "%s/embedded_server_entries", dir);
+    uint64_t state = 60;
+    fixture_write_server_entries_file(path, ENTRIES, &state, NULL);
+    size_t len;
+    char *data = fixture_read_file(path, &len);
+
+    // Lines, without their newlines, for the per-helper timings.
+    char *lines[ENTRIES];
+    size_t count = 0;
+    for (char *p = data; count < ENTRIES && p < data + len; count++) {
+        char *end = memchr(p, '\n', data + len - p);
+        lines[count] = strndup(p, end - p);
+        p = end + 1;
+    }
+
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < count; i++) {
+        char *decoded = hex_decode(lines[i]);
+        sink += (decoded != NULL);
+        free(decoded);
+    }
+    bench_report("embedded_server_entries/hex_decode", count, bench_now_ns() - start, len);
+
+    char **decoded = malloc(count * sizeof(char *));
+    for (size_t i = 0; i < count; i++) {
+        decoded[i] = hex_decode(lines[i]);
+    }
+    start = bench_now_ns();
+    for (int round = 0; round < 100; round++) {
+        for (size_t i = 0; i < count; i++) {
+            sink += (size_t)server_entry_json(decoded[i]);
+        }
+    }
+    bench_report("embedded_server_entries/server_entry_json", count * 100, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    long regions = egress_regions_from_file(path);
+    bench_report("embedded_server_entries/egress_regions_from_file", 1, bench_now_ns() - start, len);
+    if (regions != ENTRIES) {
+        fprintf(stderr, "read %ld regions\n", regions);
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(lines[i]);
+        free(decoded[i]);
+    }
+    free(decoded);
+    free(data);
+    fixture_rmdir(dir);
+    free(path);
+    free(dir);
+    return 0;
+}
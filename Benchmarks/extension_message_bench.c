@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The binary status messages: encoding and decoding a request for every field and the snapshot
+ * response, against the same snapshot as a JSON message parsed with the allocating reference parser,
+ * as NSJSONSerialization would. Also counts what a UI refresh costs in round trips today and with
+ * one snapshot request.
+ */
+
+#include "ExtensionMessage.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "json_reference.h"
+#include <string.h>
+
+#define ITERATIONS 200000
+#define JSON_ITERATIONS 50000
+#define AUTHORIZATIONS 3
+#define REGIONS 30
+
+// Round trips of a UI refresh today: the isProviderZombie and isTunnelConnected queries.
+#define LEGACY_QUERIES 2
+
+// Shared defaults reads the snapshot replaces: client region, sponsor ID, server timestamp, jetsam
+// counter, marked authorizations and egress regions.
+#define DEFAULTS_READS 6
+
+static volatile size_t sink;
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+int main(void) {
+    static const char *regions[] = { "AT", "BE", "BG", "CA", "CH", "CZ", "DE", "DK", "EE", "ES", "FI", "FR", "GB",
+                                     "HU", "IE", "IN", "IT", "JP", "LV", "NL", "NO", "PL", "RO", "RS", "SE", "SG",
+                                     "SK", "UA", "US", "AU" };
+    static char authorizations[AUTHORIZATIONS][45];
+    uint64_t state = 71;
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    extension_status_t status = {
+        .fields = EXTENSION_FIELDS_ALL, .provider_zombie = false, .tunnel_connected = true,
+        .client_region = { "CA", 2 }, .sponsor_id = { "FFFFFFFFFFFFFFFF", 16 },
+        .server_timestamp = { "2018-01-24T18:24:32.123Z", 24 }, .jetsam_count = 2 };
+    for (int i = 0; i < AUTHORIZATIONS; i++) {
+        for (int j = 0; j < 44; j++) {
+            authorizations[i][j] = b64[fixture_rand(&state) % 64];
+        }
+        status.marked_authorizations.items[i] = (extension_message_string_t){ authorizations[i], 44 };
+    }
+    status.marked_authorizations.count = AUTHORIZATIONS;
+    for (int i = 0; i < REGIONS; i++) {
+        status.egress_regions.items[i] = (extension_message_string_t){ regions[i], 2 };
+    }
+    status.egress_regions.count = REGIONS;
+
+    uint8_t request[64], response[1024];
+    long request_len = 0, response_len = 0;
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        request_len = extension_request_encode(EXTENSION_FIELDS_ALL, request, sizeof(request));
+        uint32_t fields;
+        if (request_len < 0 || extension_request_decode(request, (size_t)request_len, &fields) != 0) {
+            fail("request");
+        }
+        sink += fields;
+    }
+    bench_report("extension_message/request_encode_decode", ITERATIONS, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        status.jetsam_count = (uint64_t)i;
+        response_len = extension_response_encode(&status, EXTENSION_FIELDS_ALL, response, sizeof(response));
+        if (response_len < 0) {
+            fail("response encode");
+        }
+    }
+    bench_report("extension_message/response_encode", ITERATIONS, bench_now_ns() - start, 0);
+
+    extension_status_t decoded;
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (extension_response_decode(response, (size_t)response_len, &decoded) != 0) {
+            fail("response decode");
+        }
+        sink += decoded.egress_regions.count;
+    }
+    bench_report("extension_message/response_decode", ITERATIONS, bench_now_ns() - start, 0);
+
+    // The same snapshot as JSON.
+    char json[2048];
+    size_t json_len = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < JSON_ITERATIONS; i++) {
+        int n = snprintf(json, sizeof(json),
+                         "{\"isProviderZombie\":false,\"isTunnelConnected\":true,\"clientRegion\":\"CA\","
+                         "\"sponsorId\":\"FFFFFFFFFFFFFFFF\",\"serverTimestamp\":\"2018-01-24T18:24:32.123Z\","
+                         "\"jetsamCount\":%d,\"markedAuthorizations\":[", i);
+        for (int j = 0; j < AUTHORIZATIONS; j++) {
+            n += snprintf(json + n, sizeof(json) - n, "%s\"%.44s\"", j ? "," : "", authorizations[j]);
+        }
+        n += snprintf(json + n, sizeof(json) - n, "],\"egressRegions\":[");
+        for (int j = 0; j < REGIONS; j++) {
+            n += snprintf(json + n, sizeof(json) - n, "%s\"%s\"", j ? "," : "", regions[j]);
+        }
+        n += snprintf(json + n, sizeof(json) - n, "]}");
+        json_len = (size_t)n;
+    }
+    bench_report("extension_message/json_baseline/encode", JSON_ITERATIONS, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < JSON_ITERATIONS; i++) {
+        json_ref_t *doc = json_ref_parse(json, json_len);
+        const json_ref_t *list = doc ? json_ref_path(doc, "egressRegions") : NULL;
+        if (list == NULL || json_ref_path(doc, "sponsorId") == NULL) {
+            fail("json decode");
+        }
+        sink += list->child_count;
+        json_ref_free(doc);
+    }
+    bench_report("extension_message/json_baseline/decode", JSON_ITERATIONS, bench_now_ns() - start, 0);
+
+    bench_counter("extension_message/request_size", (double)request_len, "B");
+    bench_counter("extension_message/response_size", (double)response_len, "B");
+    bench_counter("extension_message/json_baseline/response_size", (double)json_len, "B");
+    bench_counter("extension_message/round_trips_per_refresh/legacy", LEGACY_QUERIES, "");
+    bench_counter("extension_message/round_trips_per_refresh/snapshot", 1, "");
+    bench_counter("extension_message/round_trips_per_refresh/saved", LEGACY_QUERIES - 1, "");
+    bench_counter("extension_message/defaults_reads_per_refresh/replaced", DEFAULTS_READS, "");
+    return 0;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ExtensionMessage.h"
+#include "check.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define BUF_LEN 8192
+
+static extension_message_string_t str(const char *s) {
+    return (extension_message_string_t){ s, strlen(s) };
+}
+
+static bool same_string(extension_message_string_t a, extension_message_string_t b) {
+    return a.len == b.len && (a.len == 0 || memcmp(a.p, b.p, a.len) == 0);
+}
+
+static bool same_list(const extension_message_list_t *a, const extension_message_list_t *b) {
+    if (a->count != b->count) {
+        return false;
+    }
+    for (size_t i = 0; i < a->count; i++) {
+        if (!same_string(a->items[i], b->items[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Checks that the fields of decoded are those of status in fields, with the same values.
+static void check_status(const extension_status_t *status, uint32_t fields, const extension_status_t *decoded) {
+    fields &= status->fields;
+    CHECK_EQ_INT(decoded->fields, fields);
+    #define HAS(field) (fields & EXTENSION_FIELD_BIT(field))
+    CHECK(!HAS(EXTENSION_FIELD_PROVIDER_ZOMBIE) || decoded->provider_zombie == status->provider_zombie);
+    CHECK(!HAS(EXTENSION_FIELD_TUNNEL_CONNECTED) || decoded->tunnel_connected == status->tunnel_connected);
+    CHECK(!HAS(EXTENSION_FIELD_CLIENT_REGION) || same_string(decoded->client_region, status->client_region));
+    CHECK(!HAS(EXTENSION_FIELD_SPONSOR_ID) || same_string(decoded->sponsor_id, status->sponsor_id));
+    CHECK(!HAS(EXTENSION_FIELD_SERVER_TIMESTAMP) || same_string(decoded->server_timestamp, status->server_timestamp));
+    CHECK(!HAS(EXTENSION_FIELD_JETSAM_COUNT) || decoded->jetsam_count == status->jetsam_count);
+    CHECK(!HAS(EXTENSION_FIELD_MARKED_AUTHORIZATIONS) ||
+          same_list(&decoded->marked_authorizations, &status->marked_authorizations));
+    CHECK(!HAS(EXTENSION_FIELD_EGRESS_REGIONS) || same_list(&decoded->egress_regions, &status->egress_regions));
+    #undef HAS
+}
+
+static void test_encoding(void) {
+    uint8_t buf[BUF_LEN];
+    CHECK_EQ_INT(extension_request_encode(EXTENSION_FIELD_BIT(EXTENSION_FIELD_PROVIDER_ZOMBIE) |
+                                          EXTENSION_FIELD_BIT(EXTENSION_FIELD_JETSAM_COUNT), buf, sizeof(buf)), 7);
+    CHECK(memcmp(buf, "\xb5\x01\x01\x01\x00\x06\x00", 7) == 0);
+    CHECK_EQ_INT(extension_request_encode(0, buf, sizeof(buf)), -1);
+    CHECK_EQ_INT(extension_request_encode(1u << 31, buf, sizeof(buf)), -1);
+    CHECK_EQ_INT(extension_request_encode(EXTENSION_FIELDS_ALL, buf, 18), -1);
+    CHECK_EQ_INT(extension_request_encode(EXTENSION_FIELDS_ALL, buf, 19), 19);
+
+    extension_status_t status = {
+        .fields = EXTENSION_FIELDS_ALL, .provider_zombie = false, .tunnel_connected = true,
+        .client_region = str("CA"), .sponsor_id = str(""), .server_timestamp = str("2018-01-01T00:00:00Z"),
+        .jetsam_count = 300, .marked_authorizations = { { { "a", 1 }, { "bc", 2 } }, 2 },
+        .egress_regions = { .count = 0 } };
+    static const uint8_t expected[] = {
+        0xb5, 0x01, 0x02,
+        0x01, 0x01, 0x00,
+        0x02, 0x01, 0x01,
+        0x03, 0x02, 'C', 'A',
+        0x04, 0x00,
+        0x05, 0x14, '2', '0', '1', '8', '-', '0', '1', '-', '0', '1', 'T', '0', '0', ':', '0', '0', ':', '0', '0', 'Z',
+        0x06, 0x02, 0xac, 0x02,
+        0x07, 0x05, 0x01, 'a', 0x02, 'b', 'c',
+        0x08, 0x00 };
+    long len = extension_response_encode(&status, EXTENSION_FIELDS_ALL, buf, sizeof(buf));
+    CHECK_EQ_INT(len, sizeof(expected));
+    CHECK(memcmp(buf, expected, sizeof(expected)) == 0);
+    for (size_t short_len = 0; short_len < sizeof(expected); short_len++) {
+        CHECK_EQ_INT(extension_response_encode(&status, EXTENSION_FIELDS_ALL, buf, short_len), -1);
+    }
+
+    // Only the requested fields the status has.
+    status.fields &= ~EXTENSION_FIELD_BIT(EXTENSION_FIELD_SPONSOR_ID);
+    len = extension_response_encode(&status, EXTENSION_FIELD_BIT(EXTENSION_FIELD_SPONSOR_ID) |
+                                    EXTENSION_FIELD_BIT(EXTENSION_FIELD_CLIENT_REGION), buf, sizeof(buf));
+    CHECK_EQ_INT(len, 7);
+    CHECK(memcmp(buf, "\xb5\x01\x02\x03\x02" "CA", 7) == 0);
+
+    status.egress_regions.count = EXTENSION_MESSAGE_MAX_LIST + 1;
+    CHECK_EQ_INT(extension_response_encode(&status, EXTENSION_FIELDS_ALL, buf, sizeof(buf)), -1);
+}
+
+static void test_decoding(void) {
+    uint32_t fields = 0;
+    CHECK_EQ_INT(extension_request_decode((const uint8_t *)"\xb5\x01\x01\x02\x00\x63\x01x\x08\x00", 10, &fields), 0);
+    CHECK_EQ_INT(fields, EXTENSION_FIELD_BIT(EXTENSION_FIELD_TUNNEL_CONNECTED) |
+                         EXTENSION_FIELD_BIT(EXTENSION_FIELD_EGRESS_REGIONS));
+    CHECK_EQ_INT(extension_request_decode((const uint8_t *)"\xb5\x01\x01", 3, &fields), 0);
+    CHECK_EQ_INT(fields, 0);
+    CHECK_EQ_INT(extension_request_decode((const uint8_t *)"\xb5\x01\x01\x02", 4, &fields), -1);
+    CHECK_EQ_INT(extension_request_decode((const uint8_t *)"\xb5\x01\x02\x02\x00", 5, &fields), -1);
+    CHECK_EQ_INT(extension_request_decode((const uint8_t *)"\xb5\x02\x01\x02\x00", 5, &fields), -1);
+    CHECK_EQ_INT(extension_request_decode((const uint8_t *)"isTunnelConnected", 17, &fields), -1);
+
+    CHECK(extension_message_is_binary("\xb5\x01\x01", 3));
+    CHECK(!extension_message_is_binary("isProviderZombie", 16));
+    CHECK(!extension_message_is_binary("", 0));
+
+    static const struct { const char *data; size_t len; int rc; } responses[] = {
+        { "\xb5\x01\x02", 3, 0 },
+        { "\xb5\x01\x02\x01\x01\x01", 6, 0 },
+        { "\xb5\x01\x02\x01\x01\x02", 6, -1 },                  // Bool out of range.
+        { "\xb5\x01\x02\x01\x02\x01\x00", 7, -1 },              // Bool too long.
+        { "\xb5\x01\x02\x01\x01\x01\x01\x01\x00", 9, -1 },      // Repeated field.
+        { "\xb5\x01\x02\x06\x02\x80\x00", 7, -1 },              // Overlong varint.
+        { "\xb5\x01\x02\x06\x02\x01\x01", 7, -1 },              // Varint shorter than the value.
+        { "\xb5\x01\x02\x03\x80\x00", 6, -1 },                  // Overlong length.
+        { "\xb5\x01\x02\x03\x05" "CA", 7, -1 },                 // Truncated value.
+        { "\xb5\x01\x02\x07\x03\x01" "a\x05", 8, -1 },          // String past the end of its list.
+        { "\xb5\x01\x02\x63\x02xx\xff\x00\x03\x02" "CA", 13, 0 },  // Unknown fields are skipped.
+        { "\xb5\x01\x01", 3, -1 },
+        { "\xb6\x01\x02", 3, -1 },
+        { "\xb5\x01", 2, -1 } };
+    for (size_t i = 0; i < sizeof(responses) / sizeof(responses[0]); i++) {
+        extension_status_t status;
+        CHECK_EQ_INT(extension_response_decode((const uint8_t *)responses[i].data, responses[i].len, &status),
+                     responses[i].rc);
+    }
+    extension_status_t status;
+    CHECK_EQ_INT(extension_response_decode((const uint8_t *)responses[10].data, responses[10].len, &status), 0);
+    CHECK_EQ_INT(status.fields, EXTENSION_FIELD_BIT(EXTENSION_FIELD_CLIENT_REGION));
+    CHECK(same_string(status.client_region, str("CA")));
+
+    // A list at the limit, and one past it. Its length takes a 2-byte varint.
+    uint8_t buf[3 + 3 + 2 * (EXTENSION_MESSAGE_MAX_LIST + 1)] = { 0xb5, 0x01, 0x02, 0x08 };
+    for (size_t count = EXTENSION_MESSAGE_MAX_LIST; count <= EXTENSION_MESSAGE_MAX_LIST + 1; count++) {
+        buf[4] = (uint8_t)(2 * count) | 0x80;
+        buf[5] = (uint8_t)(2 * count >> 7);
+        for (size_t i = 0; i < count; i++) {
+            buf[6 + 2 * i] = 1;
+            buf[7 + 2 * i] = 'A';
+        }
+        CHECK_EQ_INT(extension_response_decode(buf, 6 + 2 * count, &status),
+                     count == EXTENSION_MESSAGE_MAX_LIST ? 0 : -1);
+    }
+}
+
+static void random_string(uint64_t *state, char *dst, size_t max, extension_message_string_t *s) {
+    s->len = fixture_rand(state) % max;
+    for (size_t i = 0; i < s->len; i++) {
+        dst[i] = (char)fixture_rand(state);
+    }
+    s->p = dst;
+}
+
+static void random_list(uint64_t *state, char (*strings)[200], extension_message_list_t *list) {
+    list->count = fixture_rand(state) % (EXTENSION_MESSAGE_MAX_LIST + 1);
+    for (size_t i = 0; i < list->count; i++) {
+        random_string(state, strings[i], fixture_rand(state) % 2 ? 200 : 4, &list->items[i]);
+    }
+}
+
+// Random statuses and field sets round trip, and truncated or corrupted messages don't decode to
+// anything but what was encoded.
+static void test_round_trip(void) {
+    static char strings[3][200], authorizations[EXTENSION_MESSAGE_MAX_LIST][200];
+    static char regions[EXTENSION_MESSAGE_MAX_LIST][200];
+    static uint8_t buf[32768];
+    uint64_t state = 71;
+    for (int i = 0; i < 20000; i++) {
+        extension_status_t status = { .fields = (uint32_t)fixture_rand(&state) };
+        status.provider_zombie = fixture_rand(&state) & 1;
+        status.tunnel_connected = fixture_rand(&state) & 1;
+        random_string(&state, strings[0], 4, &status.client_region);
+        random_string(&state, strings[1], 200, &status.sponsor_id);
+        random_string(&state, strings[2], 40, &status.server_timestamp);
+        status.jetsam_count = fixture_rand(&state) >> (fixture_rand(&state) % 64);
+        random_list(&state, authorizations, &status.marked_authorizations);
+        random_list(&state, regions, &status.egress_regions);
+        uint32_t fields = (uint32_t)fixture_rand(&state) | EXTENSION_FIELD_BIT(1);
+
+        long len = extension_request_encode(fields, buf, sizeof(buf));
+        uint32_t decoded_fields;
+        CHECK(len > 0);
+        CHECK_EQ_INT(extension_request_decode(buf, (size_t)len, &decoded_fields), 0);
+        CHECK_EQ_INT(decoded_fields, fields & EXTENSION_FIELDS_ALL);
+
+        len = extension_response_encode(&status, decoded_fields, buf, sizeof(buf));
+        CHECK(len >= EXTENSION_MESSAGE_HEADER_LEN);
+        extension_status_t decoded;
+        CHECK_EQ_INT(extension_response_decode(buf, (size_t)len, &decoded), 0);
+        check_status(&status, decoded_fields, &decoded);
+
+        // A truncation decodes, when it ends between fields, to some of the same fields.
+        size_t cut = fixture_rand(&state) % (size_t)len;
+        if (extension_response_decode(buf, cut, &decoded) == 0) {
+            CHECK((decoded.fields & ~(status.fields & decoded_fields)) == 0);
+            check_status(&status, decoded.fields, &decoded);
+        }
+        // A corruption is either rejected or decodes to something that encodes back to the message,
+        // unless it hit a field's ID.
+        buf[fixture_rand(&state) % (size_t)len] ^= (uint8_t)(1 + fixture_rand(&state) % 255);
+        if (extension_response_decode(buf, (size_t)len, &decoded) == 0) {
+            static uint8_t again[sizeof(buf)];
+            long again_len = extension_response_encode(&decoded, EXTENSION_FIELDS_ALL, again, sizeof(again));
+            CHECK(again_len >= EXTENSION_MESSAGE_HEADER_LEN && again_len <= len);
+        }
+    }
+}
+
+int main(void) {
+    RUN_TEST(test_encoding);
+    RUN_TEST(test_decoding);
+    RUN_TEST(test_round_trip);
+    return 0;
+}
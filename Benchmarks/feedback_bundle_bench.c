@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compares the streaming feedback bundle writer against the current approach of
+ * materializing every log line, building one JSON string and compressing it at the end.
+ *
+ * Input is maxed-out rotating logs for all three sources: tunnel-core (2 x 1MB),
+ * container (2 x 164KB) and extension (2 x 64KB).
+ */
+
+#define _GNU_SOURCE
+#include "FeedbackBundle.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+#include <zlib.h>
+
+#define ITERATIONS 10
+
+typedef struct {
+    feedback_bundle_source_t sources[3];
+    uint64_t input_bytes;
+} input_t;
+
+static int discard_write(void *ctx, const uint8_t *buf, size_t len) {
+    *(uint64_t *)ctx += len;
+    return 0;
+}
+
+static int run_streaming(void *arg) {
+    input_t *in = arg;
+    uint64_t out_bytes = 0;
+    feedback_bundle_writer_t *w = feedback_bundle_writer_new(discard_write, &out_bytes, 16 * 1024);
+    if (w == NULL || feedback_bundle_add_sources(w, in->sources, 3) != 0 || feedback_bundle_finish(w) != 0) {
+        return -1;
+    }
+    feedback_bundle_writer_free(w);
+    return 0;
+}
+
+/*
+ * Baseline: every file read whole, every line copied into its own allocation (the NSString per line
+ * from componentsSeparatedByString:), an entry string per line (the DiagnosticEntry), one joined
+ * JSON string, and one compressed copy of it.
+ */
+static int run_materialized(void *arg) {
+    input_t *in = arg;
+    size_t cap = 1024, count = 0;
+    char **entries = malloc(cap * sizeof(char *));
+    size_t json_len = 2;
+
+    for (int s = 0; s < 3; s++) {
+        const char *paths[2] = { in->sources[s].older_path, in->sources[s].path };
+        for (int f = 0; f < 2; f++) {
+            size_t len;
+            char *data = fixture_read_file(paths[f], &len);
+            if (data == NULL) {
+                continue;
+            }
+            char *save = NULL;
+            for (char *line = strtok_r(data, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+                char *copy = strdup(line);
+                char *entry;
+                int n = asprintf(&entry, "{\"data\":{},\"msg\":\"%s\",\"timestamp!!timestamp\":\"\"}", copy);
+                free(copy);
+                if (n < 0) {
+                    return -1;
+                }
+                if (count == cap) {
+                    cap *= 2;
+                    entries = realloc(entries, cap * sizeof(char *));
+                }
+                entries[count++] = entry;
+                json_len += (size_t)n + 1;
+            }
+            free(data);
+        }
+    }
+
+    char *json = malloc(json_len + 1);
+    char *p = json;
+    *p++ = '[';
+    for (size_t i = 0; i < count; i++) {
+        size_t l = strlen(entries[i]);
+        memcpy(p, entries[i], l);
+        p += l;
+        *p++ = ',';
+    }
+    p[-1] = ']';
+
+    uLongf comp_len = compressBound((uLong)(p - json));
+    Bytef *comp = malloc(comp_len);
+    int rc = compress2(comp, &comp_len, (const Bytef *)json, (uLong)(p - json), Z_DEFAULT_COMPRESSION);
+
+    free(comp);
+    free(json);
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i]);
+    }
+    free(entries);
+    return rc == Z_OK ? 0 : -1;
+}
+
+static int run_noop(void *arg) {
+    return 0;
+}
+
+static void time_mode(const char *name, int (*fn)(void *), input_t *in) {
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+        if (fn(in) != 0) {
+            fprintf(stderr, "%s failed\n", name);
+            exit(1);
+        }
+    }
+    bench_report(name, ITERATIONS, bench_now_ns() - start, in->input_bytes * ITERATIONS);
+}
+
+int main(void) {
+    char *dir = fixture_tmpdir();
+    const char *names[3] = { "rotating_notices", "container_notices", "extension_notices" };
+    const size_t sizes[3] = { 1000000, 164000, 64000 };
+    char *paths[6];
+
+    input_t in;
+    in.input_bytes = 0;
+    uint64_t state = 1;
+    int64_t now_ms = INT64_C(1537351200000);
+
+    for (int s = 0; s < 3; s++) {
+        asprintf(&paths[2 * s], "%s/%s.1", dir, names[s]);
+        asprintf(&paths[2 * s + 1], "%s/%s", dir, names[s]);
+        for (int f = 0; f < 2; f++) {
+            fixture_write_notices_file(paths[2 * s + f], sizes[s], &state, &now_ms);
+            size_t len;
+            free(fixture_read_file(paths[2 * s + f], &len));
+            in.input_bytes += len;
+        }
+        in.sources[s].older_path = paths[2 * s];
+        in.sources[s].path = paths[2 * s + 1];
+    }
+
+    bench_counter("feedback_bundle/input", (double)in.input_bytes / 1024.0, "KB");
+
+    uint64_t out_bytes = 0;
+    feedback_bundle_writer_t *w = feedback_bundle_writer_new(discard_write, &out_bytes, 16 * 1024);
+    feedback_bundle_add_sources(w, in.sources, 3);
+    feedback_bundle_finish(w);
+    feedback_bundle_writer_free(w);
+    bench_counter("feedback_bundle/payload", (double)out_bytes / 1024.0, "KB");
+
+    time_mode("feedback_bundle/streaming", run_streaming, &in);
+    time_mode("feedback_bundle/materialized_baseline", run_materialized, &in);
+
+    long idle_rss = bench_peak_rss_kb(run_noop, NULL);
+    long streaming_rss = bench_peak_rss_kb(run_streaming, &in);
+    long materialized_rss = bench_peak_rss_kb(run_materialized, &in);
+    bench_counter("feedback_bundle/idle_peak_rss", (double)idle_rss, "KB");
+    bench_counter("feedback_bundle/streaming_peak_rss", (double)streaming_rss, "KB");
+    bench_counter("feedback_bundle/materialized_peak_rss", (double)materialized_rss, "KB");
+
+    for (int i = 0; i < 6; i++) {
+        free(paths[i]);
+    }
+    fixture_rmdir(dir);
+    free(dir);
+    return 0;
+}
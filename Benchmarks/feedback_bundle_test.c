@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "FeedbackBundle.h"
+#include "check.h"
+#include "fixtures.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+} sink_t;
+
+static int sink_write(void *ctx, const uint8_t *buf, size_t len) {
+    sink_t *s = ctx;
+    if (s->len + len > s->cap) {
+        s->cap = (s->len + len) * 2;
+        s->buf = realloc(s->buf, s->cap);
+    }
+    memcpy(s->buf + s->len, buf, len);
+    s->len += len;
+    return 0;
+}
+
+static void sink_append_str(sink_t *s, const char *str) {
+    sink_write(s, (const uint8_t *)str, strlen(str));
+}
+
+/*
+ * Reference layout of an entry, as documented in FeedbackBundle.h. The fixture notices
+ * only have string and object data, the kinds that match readLogsData:.
+ */
+static void expected_entry(sink_t *s, const fixture_notice_t *n, int first) {
+    sink_append_str(s, first ? "[" : ",");
+    sink_append_str(s, "{\"data\":{},\"msg\":\"");
+    sink_append_str(s, n->notice_type);
+    sink_append_str(s, ": ");
+    const char *d = n->data_json;
+    if (d[0] == '"') {
+        sink_write(s, (const uint8_t *)d + 1, strlen(d) - 2);
+    } else {
+        for (; *d; d++) {
+            if (*d == '"' || *d == '\\') {
+                sink_append_str(s, "\\");
+            }
+            sink_write(s, (const uint8_t *)d, 1);
+        }
+    }
+    sink_append_str(s, "\",\"timestamp!!timestamp\":\"");
+    sink_append_str(s, n->timestamp);
+    sink_append_str(s, "\"}");
+}
+
+static char * path_join(const char *dir, const char *name) {
+    char *p;
+    CHECK(asprintf(&p, "%s/%s", dir, name) > 0);
+    return p;
+}
+
+// Writes count notices to path, recording them in notices.
+static void write_notices(const char *path, fixture_notice_t *notices, size_t count, uint64_t *state, int64_t *now_ms) {
+    FILE *fp = fopen(path, "wb");
+    CHECK(fp != NULL);
+    char line[1024];
+    for (size_t i = 0; i < count; i++) {
+        fixture_notice(state, now_ms, &notices[i]);
+        size_t l = fixture_notice_line(line, sizeof(line), &notices[i]);
+        fwrite(line, 1, l, fp);
+        fputc('\n', fp);
+    }
+    fclose(fp);
+}
+
+static void decompress(const sink_t *payload, sink_t *json) {
+    memset(json, 0, sizeof(*json));
+    CHECK(feedback_bundle_decompress(payload->buf, payload->len, sink_write, json) == 0);
+    sink_write(json, (const uint8_t *)"", 1);
+}
+
+static void test_entries_match_reference_layout(void) {
+    char *dir = fixture_tmpdir();
+    char *older = path_join(dir, "notices.1");
+    char *current = path_join(dir, "notices");
+
+    const size_t n_older = 1500, n_current = 2500;
+    fixture_notice_t *notices = malloc((n_older + n_current) * sizeof(fixture_notice_t));
+    uint64_t state = 42;
+    int64_t now_ms = INT64_C(1537351200000);
+    write_notices(older, notices, n_older, &state, &now_ms);
+    write_notices(current, notices + n_older, n_current, &state, &now_ms);
+
+    sink_t expected = {0};
+    for (size_t i = 0; i < n_older + n_current; i++) {
+        expected_entry(&expected, &notices[i], i == 0);
+    }
+    sink_append_str(&expected, "]");
+    sink_write(&expected, (const uint8_t *)"", 1);
+
+    sink_t payload = {0};
+    feedback_bundle_writer_t *w = feedback_bundle_writer_new(sink_write, &payload, 4096);
+    CHECK(w != NULL);
+    feedback_bundle_source_t source = { older, current };
+    CHECK(feedback_bundle_add_sources(w, &source, 1) == 0);
+    CHECK(feedback_bundle_finish(w) == 0);
+    CHECK_EQ_INT(feedback_bundle_entry_count(w), n_older + n_current);
+    feedback_bundle_writer_free(w);
+
+    sink_t json;
+    decompress(&payload, &json);
+    CHECK_EQ_INT(json.len, expected.len);
+    CHECK(strcmp((char *)json.buf, (char *)expected.buf) == 0);
+
+    // Compressed payload is much smaller than the JSON it carries.
+    CHECK(payload.len * 3 < json.len);
+
+    free(json.buf);
+    free(expected.buf);
+    free(payload.buf);
+    free(notices);
+    free(older);
+    free(current);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+static void test_index_is_consistent(void) {
+    char *dir = fixture_tmpdir();
+    char *current = path_join(dir, "notices");
+    uint64_t state = 7;
+    int64_t now_ms = INT64_C(1537351200000);
+    long count = fixture_write_notices_file(current, 400 * 1024, &state, &now_ms);
+
+    sink_t payload = {0};
+    feedback_bundle_writer_t *w = feedback_bundle_writer_new(sink_write, &payload, 1000);
+    CHECK(feedback_bundle_add_file(w, current) == 0);
+    CHECK(feedback_bundle_finish(w) == 0);
+    feedback_bundle_writer_free(w);
+
+    feedback_bundle_frame_t *frames;
+    uint32_t n;
+    CHECK(feedback_bundle_read_index(payload.buf, payload.len, &frames, &n) == 0);
+    CHECK(n > 1);
+
+    uint64_t raw_offset = 0, payload_offset = FEEDBACK_BUNDLE_HEADER_LEN;
+    uint32_t entries = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        CHECK_EQ_INT(frames[i].raw_offset, raw_offset);
+        CHECK_EQ_INT(frames[i].payload_offset, payload_offset);
+        CHECK_EQ_INT(frames[i].first_entry, entries);
+        CHECK(frames[i].raw_len <= FEEDBACK_BUNDLE_FRAME_SIZE);
+        raw_offset += frames[i].raw_len;
+        payload_offset += FEEDBACK_BUNDLE_FRAME_HEADER_LEN + frames[i].compressed_len;
+        entries += frames[i].entry_count;
+    }
+    CHECK_EQ_INT(entries, count);
+
+    // Truncated payloads are rejected.
+    feedback_bundle_frame_t *unused;
+    CHECK(feedback_bundle_read_index(payload.buf, payload.len - 1, &unused, &n) != 0);
+
+    // So is a frame offset that only passes as in bounds because adding the frame length wraps it.
+    uint64_t wrapped = FEEDBACK_BUNDLE_HEADER_LEN;
+    wrapped -= FEEDBACK_BUNDLE_FRAME_HEADER_LEN + (uint64_t)frames[0].compressed_len;
+    size_t index_offset = payload.len - FEEDBACK_BUNDLE_FOOTER_LEN - (size_t)n * FEEDBACK_BUNDLE_INDEX_ENTRY_LEN;
+    uint8_t *entry = payload.buf + index_offset;
+    for (int i = 0; i < 8; i++) {
+        entry[8 + i] = (uint8_t)(wrapped >> (8 * i));
+    }
+    CHECK(feedback_bundle_read_index(payload.buf, payload.len, &unused, &n) != 0);
+    sink_t json = {0};
+    CHECK(feedback_bundle_decompress(payload.buf, payload.len, sink_write, &json) != 0);
+    free(json.buf);
+
+    free(frames);
+    free(payload.buf);
+    free(current);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+static void test_sources_ordered_by_last_notice(void) {
+    char *dir = fixture_tmpdir();
+    char *a = path_join(dir, "a"), *b = path_join(dir, "b"), *c = path_join(dir, "c");
+
+    FILE *fp = fopen(a, "wb");
+    fputs("{\"data\":{\"m\":1},\"noticeType\":\"A\",\"timestamp\":\"2018-09-19T10:00:00.000Z\"}\n", fp);
+    fclose(fp);
+    fp = fopen(b, "wb");
+    fputs("{\"data\":{\"m\":2},\"noticeType\":\"B\",\"timestamp\":\"2018-09-19T12:00:00.000Z\"}\n", fp);
+    fclose(fp);
+    fp = fopen(c, "wb");
+    // Same instant as b in a different offset; stable ordering keeps b first.
+    fputs("{\"data\":{\"m\":3},\"noticeType\":\"C\",\"timestamp\":\"2018-09-19T08:00:00.000-04:00\"}\n", fp);
+    fclose(fp);
+
+    feedback_bundle_source_t sources[4] = {
+        { NULL, a },
+        { NULL, "/nonexistent/notices" },
+        { NULL, b },
+        { c, NULL },
+    };
+
+    sink_t payload = {0};
+    feedback_bundle_writer_t *w = feedback_bundle_writer_new(sink_write, &payload, 64);
+    CHECK(feedback_bundle_add_sources(w, sources, 4) == 0);
+    CHECK(feedback_bundle_finish(w) == 0);
+    feedback_bundle_writer_free(w);
+
+    sink_t json;
+    decompress(&payload, &json);
+    const char *s = (const char *)json.buf;
+    const char *pa = strstr(s, "\"msg\":\"A: "), *pb = strstr(s, "\"msg\":\"B: "), *pc = strstr(s, "\"msg\":\"C: ");
+    CHECK(pa != NULL && pb != NULL && pc != NULL);
+    CHECK(pb < pc && pc < pa);
+
+    free(json.buf);
+    free(payload.buf);
+    free(a);
+    free(b);
+    free(c);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+static void test_skips_and_normalizes_lines(void) {
+    char *dir = fixture_tmpdir();
+    char *path = path_join(dir, "notices");
+
+    FILE *fp = fopen(path, "wb");
+    fputs("\n", fp);
+    fputs("not json at all\n", fp);
+    fputs("{\"data\":{\"k\":\"v\"},\"noticeType\":\"Crlf\",\"timestamp\":\"2018-09-19T10:00:00.000Z\"}\r\n", fp);
+    fputs("{\"data\":\"plain\",\"noticeType\":\"BadTime\",\"timestamp\":\"yesterday\"}\n", fp);
+    fputs("{\"data\":true,\"noticeType\":\"Bool\",\"timestamp\":\"2018-09-19T10:00:01.000Z\"}\n", fp);
+    fputs("{\"data\":{\"unterminated\":", fp);
+    fputs("\n{\"data\":{},\"noticeType\":\"NoNewline\",\"timestamp\":\"2018-09-19T10:00:02.000Z\"}", fp);
+    fclose(fp);
+
+    sink_t payload = {0};
+    feedback_bundle_writer_t *w = feedback_bundle_writer_new(sink_write, &payload, 4096);
+    CHECK(feedback_bundle_add_file(w, path) == 0);
+    CHECK(feedback_bundle_add_entry(w, "PsiCash: \"quoted\"\n", 18, "2018-09-19T10:00:03.000Z") == 0);
+    CHECK(feedback_bundle_finish(w) == 0);
+    CHECK_EQ_INT(feedback_bundle_entry_count(w), 5);
+    feedback_bundle_writer_free(w);
+
+    sink_t json;
+    decompress(&payload, &json);
+    const char *expected =
+        "[{\"data\":{},\"msg\":\"Crlf: {\\\"k\\\":\\\"v\\\"}\",\"timestamp!!timestamp\":\"2018-09-19T10:00:00.000Z\"},"
+        "{\"data\":{},\"msg\":\"BadTime: plain\",\"timestamp!!timestamp\":\"1970-01-01T00:00:00.000Z\"},"
+        "{\"data\":{},\"msg\":\"Bool: 1\",\"timestamp!!timestamp\":\"2018-09-19T10:00:01.000Z\"},"
+        "{\"data\":{},\"msg\":\"NoNewline: {}\",\"timestamp!!timestamp\":\"2018-09-19T10:00:02.000Z\"},"
+        "{\"data\":{},\"msg\":\"PsiCash: \\\"quoted\\\"\\n\",\"timestamp!!timestamp\":\"2018-09-19T10:00:03.000Z\"}]";
+    CHECK(strcmp((const char *)json.buf, expected) == 0);
+
+    free(json.buf);
+    free(payload.buf);
+    free(path);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+static void test_empty_bundle(void) {
+    sink_t payload = {0};
+    feedback_bundle_writer_t *w = feedback_bundle_writer_new(sink_write, &payload, 16);
+    CHECK(feedback_bundle_finish(w) == 0);
+    feedback_bundle_writer_free(w);
+
+    sink_t json;
+    decompress(&payload, &json);
+    CHECK(strcmp((const char *)json.buf, "[]") == 0);
+
+    free(json.buf);
+    free(payload.buf);
+}
+
+int main(void) {
+    RUN_TEST(test_entries_match_reference_layout);
+    RUN_TEST(test_index_is_consistent);
+    RUN_TEST(test_sources_ordered_by_last_notice);
+    RUN_TEST(test_skips_and_normalizes_lines);
+    RUN_TEST(test_empty_bundle);
+    return 0;
+}
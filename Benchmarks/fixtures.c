@@ -0,0 +1,633 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "fixtures.h"
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// See comment in header
+uint64_t fixture_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * UINT64_C(2685821657736338717);
+}
+
+// See comment in header
+size_t fixture_timestamp(char *dst, size_t len, int64_t unix_ms, int offset_minutes) {
+    time_t sec = (time_t)(unix_ms / 1000) + offset_minutes * 60;
+    int ms = (int)(unix_ms % 1000);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+
+    int n;
+    if (offset_minutes == 0) {
+        n = snprintf(dst, len, "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ms);
+    } else {
+        int off = offset_minutes < 0 ? -offset_minutes : offset_minutes;
+        n = snprintf(dst, len, "%04d-%02d-%02dT%02d:%02d:%02d.%03d%c%02d:%02d",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, ms,
+                     offset_minutes < 0 ? '-' : '+', off / 60, off % 60);
+    }
+    return (n > 0) ? (size_t)n : 0;
+}
+
+static const char *kServerIPs[] = {
+    "192.0.2.17", "198.51.100.4", "203.0.113.250", "192.0.2.201", "198.51.100.77"
+};
+
+static const char *kRegions[] = { "CA", "US", "DE", "GB", "NL", "JP", "SG", "FR" };
+
+// See comment in header
+void fixture_notice(uint64_t *state, int64_t *now_ms, fixture_notice_t *n) {
+    uint64_t r = fixture_rand(state);
+    unsigned kind = (unsigned)(r % 100);
+
+    // Bursty arrival: mostly a few ms apart, occasionally seconds apart.
+    *now_ms += (kind < 80) ? (int64_t)(fixture_rand(state) % 20) : (int64_t)(fixture_rand(state) % 5000);
+
+    fixture_timestamp(n->timestamp, sizeof(n->timestamp), *now_ms, -240);
+
+    const char *ip = kServerIPs[(r >> 8) % (sizeof(kServerIPs) / sizeof(kServerIPs[0]))];
+    const char *region = kRegions[(r >> 16) % (sizeof(kRegions) / sizeof(kRegions[0]))];
+    unsigned port = 443 + (unsigned)((r >> 24) % 3) * 100;
+    unsigned count = (unsigned)((r >> 32) % 50);
+
+    if (kind < 55) {
+        // tunnel-core diagnostic: the message is itself a JSON notice, escaped.
+        strcpy(n->notice_type, "tunnel-core");
+        snprintf(n->data_json, sizeof(n->data_json),
+                 "{\"message\":\"{\\\"data\\\":{\\\"candidates\\\":%u,\\\"region\\\":\\\"%s\\\",\\\"protocol\\\":\\\"OSSH\\\",\\\"ipAddress\\\":\\\"%s:%u\\\"},\\\"noticeType\\\":\\\"ConnectingServer\\\",\\\"showUser\\\":false,\\\"timestamp\\\":\\\"%s\\\"}\"}",
+                 count, region, ip, port, n->timestamp);
+    } else if (kind < 75) {
+        strcpy(n->notice_type, "ExtensionInfo");
+        snprintf(n->data_json, sizeof(n->data_json),
+                 "{\"Reachability\":\"network changed to %s (flags 0x%02x)\"}",
+                 (r & 1) ? "WiFi" : "Cellular", (unsigned)(r >> 40) & 0xff);
+    } else if (kind < 88) {
+        strcpy(n->notice_type, "ExtensionInfo");
+        snprintf(n->data_json, sizeof(n->data_json),
+                 "{\"MemoryProfiling\":{\"rss\":\"%.2f MB\"}}", 8.0 + (double)(count) / 10.0);
+    } else if (kind < 96) {
+        strcpy(n->notice_type, "ContainerInfo");
+        snprintf(n->data_json, sizeof(n->data_json),
+                 "{\"VPNManager\":\"status changed to \\\"%s\\\" path C:\\\\tmp\\\\%u\"}",
+                 (r & 2) ? "connected" : "connecting", count);
+    } else {
+        // Plain string data, as written by some older notices.
+        strcpy(n->notice_type, "ContainerWarn");
+        snprintf(n->data_json, sizeof(n->data_json), "\"failed attempt %u to %s\"", count, ip);
+    }
+}
+
+// See comment in header
+size_t fixture_notice_line(char *dst, size_t len, const fixture_notice_t *n) {
+    int w = snprintf(dst, len, "{\"data\":%s,\"noticeType\":\"%s\",\"showUser\":false,\"timestamp\":\"%s\"}",
+                     n->data_json, n->notice_type, n->timestamp);
+    return (w > 0) ? (size_t)w : 0;
+}
+
+// See comment in header
+long fixture_write_notices_file(const char *path, size_t target_bytes, uint64_t *state, int64_t *now_ms) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    char line[1024];
+    size_t written = 0;
+    long count = 0;
+    while (written < target_bytes) {
+        fixture_notice_t n;
+        fixture_notice(state, now_ms, &n);
+        size_t l = fixture_notice_line(line, sizeof(line), &n);
+        line[l++] = '\n';
+        fwrite(line, 1, l, fp);
+        written += l;
+        count++;
+    }
+
+    fclose(fp);
+    return count;
+}
+
+const char *const kFixtureCapabilities[FIXTURE_CAPABILITY_COUNT] = {
+    "handshake", "SSH", "OSSH", "VPN", "FRONTED-MEEK", "UNFRONTED-MEEK", "UNFRONTED-MEEK-HTTPS", "QUIC", "TAPDANCE"
+};
+
+static const char *kEntryRegions[] = {
+    "US", "CA", "DE", "GB", "NL", "JP", "SG", "FR", "AT", "BE", "CH", "ES", "IN", "IT", "SE", "AU"
+};
+
+static size_t random_text(uint64_t *state, char *dst, size_t n, const char *alphabet) {
+    size_t alphabet_len = strlen(alphabet);
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = alphabet[fixture_rand(state) % alphabet_len];
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+// Formats "<ip> <port> <secret> <certificate> <json>" and returns the offset of the JSON, or -1.
+static int server_entry_plain(uint64_t *state, char *dst, size_t len, fixture_server_entry_t *entry, size_t *plain_len) {
+    static const char hex[] = "0123456789abcdef";
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    uint64_t r = fixture_rand(state);
+    snprintf(entry->ip_address, sizeof(entry->ip_address), "%u.%u.%u.%u",
+             (unsigned)(r & 0xff) | 1, (unsigned)(r >> 8) & 0xff, (unsigned)(r >> 16) & 0xff, (unsigned)(r >> 24) & 0xff);
+    // Skewed so that a few regions have most of the entries.
+    unsigned region = (unsigned)((r >> 32) % 16);
+    region = (region * region) / 16;
+    strcpy(entry->region, kEntryRegions[region]);
+    entry->capabilities = UINT64_C(1) | ((r >> 40) & ((UINT64_C(1) << FIXTURE_CAPABILITY_COUNT) - 2));
+
+    char secret[65], certificate[1201], host_key[401], obfuscated_key[65], signature[89];
+    random_text(state, secret, 64, hex);
+    random_text(state, certificate, 1200, b64);
+    random_text(state, host_key, 400, b64);
+    random_text(state, obfuscated_key, 64, hex);
+    random_text(state, signature, 88, b64);
+
+    char capabilities[256] = "";
+    for (int i = 0; i < FIXTURE_CAPABILITY_COUNT; i++) {
+        if (entry->capabilities & (UINT64_C(1) << i)) {
+            strcat(capabilities, capabilities[0] ? ",\"" : "\"");
+            strcat(capabilities, kFixtureCapabilities[i]);
+            strcat(capabilities, "\"");
+        }
+    }
+
+    int json = 0;
+    int n = snprintf(dst, len,
+                     "%s 8080 %s %s %n{\"ipAddress\":\"%s\",\"webServerPort\":\"8080\",\"webServerSecret\":\"%s\","
+                     "\"webServerCertificate\":\"%s\",\"sshPort\":22,\"sshUsername\":\"user%u\",\"sshPassword\":\"%s\","
+                     "\"sshHostKey\":\"%s\",\"sshObfuscatedPort\":%u,\"sshObfuscatedKey\":\"%s\","
+                     "\"capabilities\":[%s],\"region\":\"%s\",\"meekServerPort\":443,"
+                     "\"configurationVersion\":1,\"signature\":\"%s\"}",
+                     entry->ip_address, secret, certificate, &json, entry->ip_address, secret, certificate,
+                     (unsigned)(r % 1000), obfuscated_key, host_key, 1000 + (unsigned)(r % 60000), obfuscated_key,
+                     capabilities, entry->region, signature);
+    if (n < 0 || (size_t)n >= len) {
+        return -1;
+    }
+    *plain_len = (size_t)n;
+    return json;
+}
+
+// See comment in header
+size_t fixture_server_entry_line(uint64_t *state, char *dst, size_t len, fixture_server_entry_t *entry) {
+    static const char hex[] = "0123456789abcdef";
+
+    char plain[4096];
+    size_t n;
+    if (server_entry_plain(state, plain, sizeof(plain), entry, &n) < 0 || n * 2 + 1 > len) {
+        return 0;
+    }
+    for (size_t i = 0; i < n; i++) {
+        dst[2 * i] = hex[(uint8_t)plain[i] >> 4];
+        dst[2 * i + 1] = hex[(uint8_t)plain[i] & 0xf];
+    }
+    dst[2 * n] = '\0';
+    return n * 2;
+}
+
+// See comment in header
+size_t fixture_server_entry_json(uint64_t *state, char *dst, size_t len, fixture_server_entry_t *entry) {
+    char plain[4096];
+    size_t n;
+    int json = server_entry_plain(state, plain, sizeof(plain), entry, &n);
+    if (json < 0 || n - (size_t)json + 1 > len) {
+        return 0;
+    }
+    memcpy(dst, plain + json, n - (size_t)json + 1);
+    return n - (size_t)json;
+}
+
+// See comment in header
+size_t fixture_homepage_line(uint64_t *state, int64_t *now_ms, char *dst, size_t len) {
+    static const char *hosts[] = { "psip.me", "www.psiphon3.com", "psiphon.ca", "s3.amazonaws.com" };
+    char timestamp[40];
+    *now_ms += 1000 + (int64_t)(fixture_rand(state) % 600000);
+    fixture_timestamp(timestamp, sizeof(timestamp), *now_ms, 0);
+    uint64_t r = fixture_rand(state);
+    int w = snprintf(dst, len,
+                     "{\"data\":{\"url\":\"https://%s/%s/index.html?client_region=%s&psiphon_ssl=1&sponsor=%016" PRIx64 "\"},"
+                     "\"noticeType\":\"Homepage\",\"showUser\":false,\"timestamp\":\"%s\"}",
+                     hosts[r % 4], (r & 16) ? "en" : "fa", kEntryRegions[(r >> 8) % 16], fixture_rand(state), timestamp);
+    return (w > 0 && (size_t)w < len) ? (size_t)w : 0;
+}
+
+// See comment in header
+size_t fixture_authorization_json(uint64_t *state, char *dst, size_t len, int64_t expires_ms) {
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char id[45], key_id[45], signature[89], expires[40];
+    random_text(state, id, 44, b64);
+    random_text(state, key_id, 44, b64);
+    random_text(state, signature, 88, b64);
+    fixture_timestamp(expires, sizeof(expires), expires_ms, 0);
+    int w = snprintf(dst, len,
+                     "{\"Authorization\":{\"ID\":\"%s\",\"AccessType\":\"%s\",\"Expires\":\"%s\"},"
+                     "\"SigningKeyID\":\"%s\",\"Signature\":\"%s\"}",
+                     id, (fixture_rand(state) & 1) ? "apple-subscription" : "speed-boost", expires, key_id, signature);
+    return (w > 0 && (size_t)w < len) ? (size_t)w : 0;
+}
+
+// See comment in header
+int fixture_write_server_entries_file(const char *path, size_t count, uint64_t *state, fixture_server_entry_t *entries) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    char *line = malloc(8192);
+    for (size_t i = 0; i < count; i++) {
+        fixture_server_entry_t entry;
+        size_t n = fixture_server_entry_line(state, line, 8192, &entry);
+        line[n++] = '\n';
+        fwrite(line, 1, n, fp);
+        if (entries != NULL) {
+            entries[i] = entry;
+        }
+    }
+    free(line);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+// See comment in header
+size_t fixture_timestamp_variant(uint64_t *state, char *dst, size_t len, int64_t unix_ms) {
+    static const int precisions[] = { 0, 3, 3, 3, 6, 9 };
+    static const int offsets[] = { -480, -300, -210, 60, 120, 210, 330, 540, 765 };
+
+    uint64_t r = fixture_rand(state);
+    int precision = precisions[r % 6];
+    int offset = (r & 64) ? 0 : offsets[(r >> 8) % 9];
+    char separator = ((r >> 16) % 20 == 0) ? ' ' : ((r >> 16) % 20 == 1) ? 't' : 'T';
+
+    time_t sec = (time_t)(unix_ms / 1000) + offset * 60;
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    int n = snprintf(dst, len, "%04d-%02d-%02d%c%02d:%02d:%02d",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, separator, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    if (n < 0 || (size_t)n >= len) {
+        return 0;
+    }
+    if (precision > 0) {
+        // Milliseconds, then random sub-millisecond digits.
+        char fraction[16];
+        snprintf(fraction, sizeof(fraction), "%03d%06u", (int)(unix_ms % 1000), (unsigned)((r >> 24) % 1000000));
+        n += snprintf(dst + n, len - n, ".%.*s", precision, fraction);
+    }
+    if (offset == 0) {
+        n += snprintf(dst + n, len - n, "Z");
+    } else {
+        int off = offset < 0 ? -offset : offset;
+        n += snprintf(dst + n, len - n, "%c%02d:%02d", offset < 0 ? '-' : '+', off / 60, off % 60);
+    }
+    return ((size_t)n < len) ? (size_t)n : 0;
+}
+
+/*** RECEIPTS ***/
+
+typedef struct {
+    uint8_t *p;
+    size_t len;
+    size_t cap;
+} der_buf_t;
+
+static void der_append(der_buf_t *b, const void *data, size_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2 + 64;
+        b->p = realloc(b->p, b->cap);
+    }
+    memcpy(b->p + b->len, data, n);
+    b->len += n;
+}
+
+static void der_tlv(der_buf_t *b, uint8_t tag, const void *content, size_t n) {
+    uint8_t header[6];
+    size_t h = 0;
+    header[h++] = tag;
+    if (n < 0x80) {
+        header[h++] = (uint8_t)n;
+    } else {
+        int bytes = (n > 0xffffff) ? 4 : (n > 0xffff) ? 3 : (n > 0xff) ? 2 : 1;
+        header[h++] = (uint8_t)(0x80 | bytes);
+        for (int i = bytes - 1; i >= 0; i--) {
+            header[h++] = (uint8_t)(n >> (8 * i));
+        }
+    }
+    der_append(b, header, h);
+    der_append(b, content, n);
+}
+
+// Wraps the contents of inner in a TLV appended to b, and frees inner.
+static void der_wrap(der_buf_t *b, uint8_t tag, der_buf_t *inner) {
+    der_tlv(b, tag, inner->p, inner->len);
+    free(inner->p);
+    *inner = (der_buf_t){ 0 };
+}
+
+static void der_integer(der_buf_t *b, int64_t v) {
+    uint8_t content[8];
+    int n = 8;
+    for (int i = 7; i >= 0; i--) {
+        content[i] = (uint8_t)v;
+        v >>= 8;
+    }
+    // Minimal two's complement: drop leading bytes that only repeat the sign.
+    int start = 0;
+    while (start < n - 1 && ((content[start] == 0x00 && !(content[start + 1] & 0x80)) ||
+                             (content[start] == 0xff && (content[start + 1] & 0x80)))) {
+        start++;
+    }
+    der_tlv(b, 0x02, content + start, n - start);
+}
+
+// Appends a ReceiptAttribute { type, version, value } whose value is the DER of a string of the given tag.
+static void der_string_attribute(der_buf_t *b, int type, uint8_t string_tag, const char *s) {
+    der_buf_t value = { 0 }, attr = { 0 };
+    der_tlv(&value, string_tag, s, strlen(s));
+    der_integer(&attr, type);
+    der_integer(&attr, 1);
+    der_wrap(&attr, 0x04, &value);
+    der_wrap(b, 0x30, &attr);
+}
+
+static void der_integer_attribute(der_buf_t *b, int type, int64_t v) {
+    der_buf_t value = { 0 }, attr = { 0 };
+    der_integer(&value, v);
+    der_integer(&attr, type);
+    der_integer(&attr, 1);
+    der_wrap(&attr, 0x04, &value);
+    der_wrap(b, 0x30, &attr);
+}
+
+static void der_opaque_attribute(der_buf_t *b, int type, uint64_t *state, size_t n) {
+    uint8_t value[64];
+    for (size_t i = 0; i < n; i++) {
+        value[i] = (uint8_t)fixture_rand(state);
+    }
+    der_buf_t attr = { 0 };
+    der_integer(&attr, type);
+    der_integer(&attr, 1);
+    der_tlv(&attr, 0x04, value, n);
+    der_wrap(b, 0x30, &attr);
+}
+
+// DER orders SET OF elements by their encodings, as octet strings padded with trailing zeros.
+static int der_compare(const void *a, const void *b) {
+    const der_buf_t *x = a, *y = b;
+    size_t n = x->len < y->len ? x->len : y->len;
+    int c = memcmp(x->p, y->p, n);
+    if (c != 0 || x->len == y->len) {
+        return c;
+    }
+    const der_buf_t *longer = x->len > y->len ? x : y;
+    for (size_t i = n; i < longer->len; i++) {
+        if (longer->p[i] != 0) {
+            return longer == x ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+// Appends a SET OF the elements in DER order, and frees them.
+static void der_set_of(der_buf_t *b, der_buf_t *elements, size_t count) {
+    qsort(elements, count, sizeof(*elements), der_compare);
+    der_buf_t set = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        der_append(&set, elements[i].p, elements[i].len);
+        free(elements[i].p);
+    }
+    der_wrap(b, 0x31, &set);
+}
+
+static void receipt_date(char *dst, size_t len, int64_t unix_ms) {
+    time_t sec = (time_t)(unix_ms / 1000);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    strftime(dst, len, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static const struct {
+    const char *product_id;
+    int days;
+} kSubscriptionProducts[] = {
+    { "ca.psiphon.Psiphon.1.week", 7 },
+    { "ca.psiphon.Psiphon.1.month", 30 },
+    { "ca.psiphon.Psiphon.2.month", 61 },
+    { "ca.psiphon.Psiphon.3.month", 91 },
+    { "ca.psiphon.Psiphon.6.month", 182 },
+    { "ca.psiphon.Psiphon.1.year", 365 },
+};
+
+// Encodes the value of an in-app purchase receipt attribute (type 17).
+static void iap_value(der_buf_t *b, uint64_t *state, const fixture_iap_t *iap, int64_t original_purchase_ms,
+                      uint64_t transaction_id, uint64_t original_transaction_id) {
+    char purchase[32], original_purchase[32], expires[32], cancellation[32] = "", id[24], original_id[24];
+    receipt_date(purchase, sizeof(purchase), iap->purchase_ms);
+    receipt_date(original_purchase, sizeof(original_purchase), original_purchase_ms);
+    receipt_date(expires, sizeof(expires), iap->expires_ms);
+    if (iap->cancelled) {
+        receipt_date(cancellation, sizeof(cancellation), iap->purchase_ms + 86400000);
+    }
+    snprintf(id, sizeof(id), "%" PRIu64, transaction_id);
+    snprintf(original_id, sizeof(original_id), "%" PRIu64, original_transaction_id);
+
+    der_buf_t attrs[11] = { { 0 } };
+    der_integer_attribute(&attrs[0], 1701, 1);
+    der_string_attribute(&attrs[1], 1702, 0x0c, iap->product_id);
+    der_string_attribute(&attrs[2], 1703, 0x0c, id);
+    der_string_attribute(&attrs[3], 1704, 0x16, purchase);
+    der_string_attribute(&attrs[4], 1705, 0x0c, original_id);
+    der_string_attribute(&attrs[5], 1706, 0x16, original_purchase);
+    der_string_attribute(&attrs[6], 1708, 0x16, expires);
+    der_integer_attribute(&attrs[7], 1711, 1000000000 + (int64_t)(fixture_rand(state) % 1000000000));
+    der_string_attribute(&attrs[8], 1712, 0x16, cancellation);
+    der_integer_attribute(&attrs[9], 1713, 0);
+    der_integer_attribute(&attrs[10], 1719, 0);
+    der_set_of(b, attrs, 11);
+}
+
+// See comment in header
+uint8_t * fixture_receipt(uint64_t *state, size_t iap_count, int64_t start_ms, fixture_iap_t *iaps, size_t *len) {
+    static const uint8_t signed_data_oid[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x02 };
+    static const uint8_t data_oid[] = { 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x07, 0x01 };
+    static const uint8_t sha256_algorithm[] = {
+        0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00
+    };
+
+    char creation[32];
+    int64_t purchase_ms = start_ms - start_ms % 1000;
+    receipt_date(creation, sizeof(creation), purchase_ms);
+
+    // Top-level attributes, then one per purchase.
+    size_t count = 12 + iap_count;
+    der_buf_t *attrs = calloc(count, sizeof(der_buf_t));
+    der_string_attribute(&attrs[0], 0, 0x0c, "Production");
+    der_string_attribute(&attrs[1], 2, 0x0c, FIXTURE_RECEIPT_BUNDLE_ID);
+    der_string_attribute(&attrs[2], 3, 0x0c, "153");
+    der_opaque_attribute(&attrs[3], 4, state, 16);
+    der_opaque_attribute(&attrs[4], 5, state, 20);
+    der_string_attribute(&attrs[5], 12, 0x16, creation);
+    der_string_attribute(&attrs[6], 19, 0x0c, "1.0");
+    der_opaque_attribute(&attrs[7], 8, state, 24);
+    der_opaque_attribute(&attrs[8], 10, state, 8);
+    der_opaque_attribute(&attrs[9], 11, state, 8);
+    der_opaque_attribute(&attrs[10], 13, state, 6);
+    der_opaque_attribute(&attrs[11], 25, state, 4);
+
+    size_t product = 1;
+    uint64_t original_transaction_id = 100000000000000 + fixture_rand(state) % 100000000000000;
+    for (size_t i = 0; i < iap_count; i++) {
+        // Renewals occasionally switch product.
+        if (fixture_rand(state) % 10 == 0) {
+            product = fixture_rand(state) % 6;
+        }
+        fixture_iap_t iap = { .purchase_ms = purchase_ms };
+        strcpy(iap.product_id, kSubscriptionProducts[product].product_id);
+        iap.expires_ms = purchase_ms + (int64_t)kSubscriptionProducts[product].days * 86400000;
+        iap.cancelled = (fixture_rand(state) % 25 == 0);
+
+        der_buf_t value = { 0 }, attr = { 0 };
+        iap_value(&value, state, &iap, start_ms - start_ms % 1000, original_transaction_id + i, original_transaction_id);
+        der_integer(&attr, 17);
+        der_integer(&attr, 1);
+        der_wrap(&attr, 0x04, &value);
+        der_wrap(&attrs[12 + i], 0x30, &attr);
+
+        if (iaps != NULL) {
+            iaps[i] = iap;
+        }
+        purchase_ms = iap.expires_ms;
+    }
+
+    der_buf_t payload = { 0 }, content_data = { 0 }, content_info = { 0 };
+    der_set_of(&payload, attrs, count);
+    free(attrs);
+    der_wrap(&content_data, 0x04, &payload);
+    der_tlv(&content_info, 0x06, data_oid, sizeof(data_oid));
+    der_wrap(&content_info, 0xa0, &content_data);
+
+    // Three certificates and a signer info of random bytes.
+    der_buf_t certificates = { 0 }, signer_infos = { 0 }, signer_info = { 0 };
+    uint8_t *random = malloc(1400);
+    for (int i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 1400; j++) {
+            random[j] = (uint8_t)fixture_rand(state);
+        }
+        der_buf_t certificate = { 0 };
+        der_tlv(&certificate, 0x04, random, 900 + i * 250);
+        der_wrap(&certificates, 0x30, &certificate);
+    }
+    der_integer(&signer_info, 1);
+    der_tlv(&signer_info, 0x04, random, 256);
+    der_wrap(&signer_infos, 0x30, &signer_info);
+    free(random);
+
+    der_buf_t content = { 0 }, content_seq = { 0 }, digest_algorithms = { 0 };
+    der_integer(&content, 1);
+    der_append(&digest_algorithms, sha256_algorithm, sizeof(sha256_algorithm));
+    der_wrap(&content, 0x31, &digest_algorithms);
+    der_wrap(&content, 0x30, &content_info);
+    der_wrap(&content, 0xa0, &certificates);
+    der_wrap(&content, 0x31, &signer_infos);
+    der_wrap(&content_seq, 0x30, &content);
+
+    der_buf_t signed_data = { 0 }, receipt = { 0 };
+    der_tlv(&signed_data, 0x06, signed_data_oid, sizeof(signed_data_oid));
+    der_wrap(&signed_data, 0xa0, &content_seq);
+    der_wrap(&receipt, 0x30, &signed_data);
+
+    *len = receipt.len;
+    return receipt.p;
+}
+
+// See comment in header
+char * fixture_tmpdir(void) {
+    const char *base = getenv("TMPDIR");
+    char *path;
+    if (asprintf(&path, "%s/psi-fixtures-XXXXXX", base ? base : "/tmp") < 0) {
+        return NULL;
+    }
+    if (mkdtemp(path) == NULL) {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+// See comment in header
+void fixture_rmdir(const char *path) {
+    DIR *d = opendir(path);
+    if (d == NULL) {
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        char *child;
+        if (asprintf(&child, "%s/%s", path, e->d_name) < 0) {
+            continue;
+        }
+        struct stat st;
+        if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode)) {
+            fixture_rmdir(child);
+        } else {
+            unlink(child);
+        }
+        free(child);
+    }
+    closedir(d);
+    rmdir(path);
+}
+
+// See comment in header
+char * fixture_read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *buf = malloc((size_t)size + 1);
+    if (buf != NULL && fread(buf, 1, (size_t)size, fp) != (size_t)size) {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(fp);
+    if (buf != NULL) {
+        buf[size] = '\0';
+        *len = (size_t)size;
+    }
+    return buf;
+}
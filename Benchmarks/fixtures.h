@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef fixtures_h
+#define fixtures_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Deterministic synthetic fixtures shaped like the files the app reads and writes.
+ */
+
+/*!
+ * @brief A notice as written by PsiFeedbackLogger.
+ *
+ * data_json is the JSON text of the "data" member: an object, or a string for a few notice types.
+ */
+typedef struct {
+    char notice_type[32];
+    char data_json[512];
+    char timestamp[40];
+} fixture_notice_t;
+
+/*!
+ * @brief Small deterministic PRNG (xorshift64*), so fixtures are identical across runs and machines.
+ */
+uint64_t fixture_rand(uint64_t *state);
+
+/*!
+ * @brief Formats an RFC3339Milli timestamp with the given UTC offset in minutes, like NSDate+PSIDateExtension.
+ */
+size_t fixture_timestamp(char *dst, size_t len, int64_t unix_ms, int offset_minutes);
+
+/*!
+ * @brief Generates the i'th notice of a stream starting at start_ms.
+ *
+ * Notice timestamps advance by a few milliseconds to a few seconds, mimicking
+ * tunnel-core diagnostics, reachability changes and memory profiling samples.
+ *
+ * @param now_ms In/out current time of the stream in unix milliseconds.
+ */
+void fixture_notice(uint64_t *state, int64_t *now_ms, fixture_notice_t *n);
+
+/*!
+ * @brief Formats a notice as a single JSON line, without the trailing newline.
+ * @return Length of the line.
+ */
+size_t fixture_notice_line(char *dst, size_t len, const fixture_notice_t *n);
+
+/*!
+ * @brief Writes a rotating notices file of approximately target_bytes.
+ * @return Number of notices written, or -1 on error.
+ */
+long fixture_write_notices_file(const char *path, size_t target_bytes, uint64_t *state, int64_t *now_ms);
+
+/*!
+ * @brief A server entry as embedded in the app, before hex encoding.
+ */
+typedef struct {
+    char ip_address[16];
+    char region[4];
+    uint64_t capabilities;      // Bits index kFixtureCapabilities.
+} fixture_server_entry_t;
+
+#define FIXTURE_CAPABILITY_COUNT 9
+
+/*!
+ * @brief Capability names used by fixture server entries, e.g. "OSSH".
+ */
+extern const char *const kFixtureCapabilities[FIXTURE_CAPABILITY_COUNT];
+
+/*!
+ * @brief Generates a server entry and formats it as an embedded server entries line:
+ *        the hex encoding of "<ip> <port> <secret> <certificate> <json>", without the trailing newline.
+ *
+ * Lines are a few KB, like real entries with their certificates and keys.
+ *
+ * @return Length of the line, or 0 if dst is too small.
+ */
+size_t fixture_server_entry_line(uint64_t *state, char *dst, size_t len, fixture_server_entry_t *entry);
+
+/*!
+ * @brief Generates a server entry like fixture_server_entry_line, but formats only its JSON part.
+ * @return Length of the JSON, or 0 if dst is too small.
+ */
+size_t fixture_server_entry_json(uint64_t *state, char *dst, size_t len, fixture_server_entry_t *entry);
+
+/*!
+ * @brief Writes an embedded server entries file of count entries.
+ * @param entries Populated with the generated entries, or NULL.
+ * @return 0 on success, -1 on error.
+ */
+int fixture_write_server_entries_file(const char *path, size_t count, uint64_t *state, fixture_server_entry_t *entries);
+
+/*!
+ * @brief Formats a homepage notice line, as read by getHomepages, without the trailing newline.
+ * @param now_ms In/out time of the notice in unix milliseconds.
+ * @return Length of the line, or 0 if dst is too small.
+ */
+size_t fixture_homepage_line(uint64_t *state, int64_t *now_ms, char *dst, size_t len);
+
+/*!
+ * @brief Formats a decoded authorization, as read by Authorization initWithEncodedAuthorization:.
+ * @return Length of the JSON, or 0 if dst is too small.
+ */
+size_t fixture_authorization_json(uint64_t *state, char *dst, size_t len, int64_t expires_ms);
+
+/*!
+ * @brief Formats a timestamp as one of the RFC 3339 variants the app reads: whole seconds to nanoseconds,
+ *        'Z' or a numeric offset, and occasionally ' ' or 't' as the separator.
+ * @return Length of the timestamp, or 0 if dst is too small.
+ */
+size_t fixture_timestamp_variant(uint64_t *state, char *dst, size_t len, int64_t unix_ms);
+
+#define FIXTURE_RECEIPT_BUNDLE_ID "ca.psiphon.Psiphon"
+
+/*!
+ * @brief An in-app purchase in a fixture receipt.
+ */
+typedef struct {
+    char product_id[48];        // e.g. "ca.psiphon.Psiphon.1.month"
+    int64_t purchase_ms;        // Whole seconds, like receipt dates.
+    int64_t expires_ms;
+    int cancelled;              // Has a cancellation date.
+} fixture_iap_t;
+
+/*!
+ * @brief Generates a DER encoded app receipt: a PKCS#7 SignedData wrapping the receipt attributes, with
+ *        the bundle identifier, the other top-level attributes of real receipts, and iap_count
+ *        consecutive subscription renewals starting at start_ms.
+ *
+ * Attribute sets are in DER order. The certificates and signature are random bytes of realistic size.
+ *
+ * @param iaps Populated with the generated purchases, in renewal order, or NULL.
+ * @param len Populated with the length of the receipt.
+ * @return Receipt. Caller must free.
+ */
+uint8_t * fixture_receipt(uint64_t *state, size_t iap_count, int64_t start_ms, fixture_iap_t *iaps, size_t *len);
+
+/*!
+ * @brief Creates a fresh temporary directory for fixtures. Caller must free the returned path.
+ */
+char * fixture_tmpdir(void);
+
+/*!
+ * @brief Recursively removes a fixture directory created by fixture_tmpdir.
+ */
+void fixture_rmdir(const char *path);
+
+/*!
+ * @brief Reads a whole file into memory. Caller must free.
+ */
+char * fixture_read_file(const char *path, size_t *len);
+
+#endif /* fixtures_h */
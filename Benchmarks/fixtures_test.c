@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks that the synthetic receipts and timestamps are what the app's decoders expect, so that the
+ * benchmarks built on them measure real work.
+ */
+
+#include "ReceiptAttributes.h"
+#include "check.h"
+#include "fixtures.h"
+#include "receipt_reference.h"
+#include "timestamp.h"
+#include <string.h>
+
+#define IAPS 200
+
+static void test_receipt_decodes(void) {
+    uint64_t state = 60;
+    int64_t start_ms = 1514764800123;
+    fixture_iap_t iaps[IAPS];
+    size_t len;
+    uint8_t *receipt = fixture_receipt(&state, IAPS, start_ms, iaps, &len);
+
+    receipt_ref_t r;
+    CHECK_EQ_INT(receipt_ref_decode(receipt, len, &r), 0);
+    CHECK(strcmp(r.bundle_id, FIXTURE_RECEIPT_BUNDLE_ID) == 0);
+    CHECK_EQ_INT(r.iap_count, IAPS);
+
+    // Renewals are consecutive, so the latest is the last one that wasn't cancelled.
+    size_t cancelled = 0;
+    const fixture_iap_t *latest = NULL;
+    for (int i = 0; i < IAPS; i++) {
+        CHECK_EQ_INT(iaps[i].purchase_ms % 1000, 0);
+        CHECK(i == 0 || iaps[i].purchase_ms == iaps[i - 1].expires_ms);
+        if (iaps[i].cancelled) {
+            cancelled++;
+        } else {
+            latest = &iaps[i];
+        }
+    }
+    CHECK(cancelled > 0 && cancelled < IAPS / 5);
+    CHECK_EQ_INT(r.cancelled_count, cancelled);
+    CHECK(latest != NULL);
+    CHECK_EQ_INT(r.latest_expiration_ms, latest->expires_ms);
+    CHECK(strcmp(r.product_id, latest->product_id) == 0);
+    free(receipt);
+
+    receipt = fixture_receipt(&state, 0, start_ms, NULL, &len);
+    CHECK_EQ_INT(receipt_ref_decode(receipt, len, &r), 0);
+    CHECK_EQ_INT(r.iap_count, 0);
+    CHECK_EQ_INT(r.latest_expiration_ms, 0);
+    CHECK(strcmp(r.product_id, "") == 0);
+    free(receipt);
+}
+
+// asn1c's DER encoder sorts SET OF, so re-encoding a canonical payload reproduces it exactly.
+static void test_receipt_is_der(void) {
+    uint64_t state = 61;
+    size_t len, payload_len;
+    uint8_t *receipt = fixture_receipt(&state, 50, 1514764800000, NULL, &len), *payload;
+    CHECK_EQ_INT(receipt_ref_payload(receipt, len, &payload, &payload_len), 0);
+
+    ReceiptAttributes_t *attrs = NULL;
+    asn_dec_rval_t rval = ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, payload_len);
+    CHECK(rval.code == RC_OK);
+    CHECK_EQ_INT(rval.consumed, payload_len);
+    CHECK_EQ_INT(attrs->list.count, 12 + 50);
+
+    uint8_t *encoded = malloc(payload_len);
+    asn_enc_rval_t er = der_encode_to_buffer(&asn_DEF_ReceiptAttributes, attrs, encoded, payload_len);
+    CHECK_EQ_INT(er.encoded, payload_len);
+    CHECK(memcmp(encoded, payload, payload_len) == 0);
+
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    free(encoded);
+    free(payload);
+    free(receipt);
+}
+
+static void test_timestamp_variants(void) {
+    uint64_t state = 62;
+    int64_t unix_ms = 1514764800000;
+    int zulu = 0, offset = 0, precisions[10] = { 0 };
+    for (int i = 0; i < 10000; i++) {
+        unix_ms += (int64_t)(fixture_rand(&state) % 100000000);
+        char s[64];
+        size_t n = fixture_timestamp_variant(&state, s, sizeof(s), unix_ms);
+        CHECK(n > 0 && n == strlen(s));
+
+        timestamp_t ts;
+        CHECK_EQ_INT(timestamp_parse(s, n, &ts), 0);
+        CHECK_EQ_INT(ts.sec, unix_ms / 1000);
+        const char *dot = strchr(s, '.');
+        int precision = dot ? (int)strspn(dot + 1, "0123456789") : 0;
+        if (precision >= 3) {
+            CHECK_EQ_INT(ts.nsec / 1000000, unix_ms % 1000);
+        } else {
+            CHECK_EQ_INT(ts.nsec, 0);
+        }
+        precisions[precision]++;
+        zulu += (s[n - 1] == 'Z');
+        offset += (ts.offset != 0);
+    }
+    CHECK(zulu > 1000 && offset > 1000);
+    CHECK(precisions[0] > 0 && precisions[3] > 0 && precisions[6] > 0 && precisions[9] > 0);
+}
+
+int main(void) {
+    RUN_TEST(test_receipt_decodes);
+    RUN_TEST(test_receipt_is_der);
+    RUN_TEST(test_timestamp_variants);
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * JSON path extraction over the four JSON-lines shapes the app reads with NSJSONSerialization, against
+ * building the whole tree with an allocating parser and looking the keys up in it:
+ *   - notices (readLogsData:): noticeType, data, timestamp
+ *   - homepage notices (getHomepages): data.url, timestamp
+ *   - embedded server entries (egressRegionsFromFile:): region, ipAddress, capabilities
+ *   - authorizations (initWithEncodedAuthorization:): Authorization.ID, .AccessType, .Expires
+ *
+ * Built twice: with the SIMD structural scan, and with JSON_PATH_NO_SIMD for the portable scan.
+ */
+
+#include "JSONPath.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "json_reference.h"
+#include <string.h>
+
+#if defined(JSON_PATH_NO_SIMD)
+#define VARIANT "scalar"
+#else
+#define VARIANT "simd"
+#endif
+
+#define CORPUS_BYTES (8 * 1024 * 1024)
+#define ROUNDS 5
+
+typedef enum { NOTICES, HOMEPAGES, SERVER_ENTRIES, AUTHORIZATIONS } shape_t;
+
+typedef struct {
+    const char *name;
+    const char *paths[3];
+    size_t path_count;
+} shape_info_t;
+
+static const shape_info_t kShapes[] = {
+    { "notices", { "noticeType", "data", "timestamp" }, 3 },
+    { "homepages", { "data.url", "timestamp" }, 2 },
+    { "server_entries", { "region", "ipAddress", "capabilities" }, 3 },
+    { "authorizations", { "Authorization.ID", "Authorization.AccessType", "Authorization.Expires" }, 3 },
+};
+
+// Builds a newline separated corpus of about CORPUS_BYTES of one shape.
+static char * build_corpus(shape_t shape, size_t *len, size_t *lines) {
+    char *corpus = malloc(CORPUS_BYTES + 8192);
+    uint64_t state = 60 + shape;
+    int64_t now_ms = 1514764800000;
+    size_t n = 0;
+    *lines = 0;
+    while (n < CORPUS_BYTES) {
+        size_t l = 0;
+        fixture_notice_t notice;
+        fixture_server_entry_t entry;
+        switch (shape) {
+            case NOTICES:
+                fixture_notice(&state, &now_ms, &notice);
+                l = fixture_notice_line(corpus + n, 8192, &notice);
+                break;
+            case HOMEPAGES:
+                l = fixture_homepage_line(&state, &now_ms, corpus + n, 8192);
+                break;
+            case SERVER_ENTRIES:
+                l = fixture_server_entry_json(&state, corpus + n, 8192, &entry);
+                break;
+            case AUTHORIZATIONS:
+                l = fixture_authorization_json(&state, corpus + n, 8192, now_ms);
+                break;
+        }
+        n += l;
+        corpus[n++] = '\n';
+        (*lines)++;
+    }
+    *len = n;
+    return corpus;
+}
+
+static size_t run_reference(const shape_info_t *info, const char *corpus, size_t len) {
+    size_t found = 0;
+    const char *p = corpus, *end = corpus + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        json_ref_t *v = json_ref_parse(p, (size_t)(nl - p));
+        for (size_t i = 0; i < info->path_count; i++) {
+            found += json_ref_path(v, info->paths[i]) != NULL;
+        }
+        json_ref_free(v);
+        p = nl + 1;
+    }
+    return found;
+}
+
+static size_t run_extract(const json_path_set_t *set, const char *corpus, size_t len) {
+    size_t found = 0;
+    json_path_value_t values[JSON_PATH_MAX_PATHS];
+    const char *p = corpus, *end = corpus + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        int n = json_path_extract(set, p, (size_t)(nl - p), values);
+        found += (n > 0) ? (size_t)n : 0;
+        p = nl + 1;
+    }
+    return found;
+}
+
+int main(void) {
+    for (shape_t shape = NOTICES; shape <= AUTHORIZATIONS; shape++) {
+        const shape_info_t *info = &kShapes[shape];
+        size_t len, lines;
+        char *corpus = build_corpus(shape, &len, &lines);
+        json_path_set_t *set = json_path_set_new(info->paths, info->path_count, 0);
+        json_path_set_t *whole = json_path_set_new(info->paths, info->path_count, JSON_PATH_WHOLE_OBJECT);
+        char name[96];
+
+        uint64_t start = bench_now_ns();
+        size_t expected = run_reference(info, corpus, len);
+        snprintf(name, sizeof(name), "json_path/%s/full_parse_baseline", info->name);
+        bench_report(name, lines, bench_now_ns() - start, len);
+
+        start = bench_now_ns();
+        size_t found = 0;
+        for (int i = 0; i < ROUNDS; i++) {
+            found += run_extract(set, corpus, len);
+        }
+        snprintf(name, sizeof(name), "json_path/%s/extract_%s", info->name, VARIANT);
+        bench_report(name, lines * ROUNDS, bench_now_ns() - start, len * ROUNDS);
+
+        start = bench_now_ns();
+        for (int i = 0; i < ROUNDS; i++) {
+            found += run_extract(whole, corpus, len);
+        }
+        snprintf(name, sizeof(name), "json_path/%s/extract_whole_object_%s", info->name, VARIANT);
+        bench_report(name, lines * ROUNDS, bench_now_ns() - start, len * ROUNDS);
+
+        if (found != expected * ROUNDS * 2) {
+            fprintf(stderr, "%s: found %zu values, expected %zu\n", info->name, found, expected * ROUNDS * 2);
+            return 1;
+        }
+
+        json_path_set_free(set);
+        json_path_set_free(whole);
+        free(corpus);
+    }
+    return 0;
+}
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "JSONPath.h"
+#include "check.h"
+#include "fixtures.h"
+#include "json_reference.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_DOC 16384
+
+static const char *kPaths[] = { "a", "b", "b.a", "b.c", "c.b.a", "d", "url", "e.e" };
+#define PATH_COUNT (sizeof(kPaths) / sizeof(kPaths[0]))
+
+/*** Random documents ***/
+
+typedef struct {
+    char *p;
+    char *end;
+    uint64_t *state;
+} gen_t;
+
+static void put(gen_t *g, const char *s) {
+    size_t n = strlen(s);
+    if (g->p + n < g->end) {
+        memcpy(g->p, s, n);
+        g->p += n;
+    }
+}
+
+static void put_ws(gen_t *g) {
+    static const char *ws[] = { "", "", "", " ", "\t", "\r\n  " };
+    put(g, ws[fixture_rand(g->state) % 6]);
+}
+
+static void put_string(gen_t *g) {
+    static const char *pieces[] = {
+        "a", "bc", "url", " ", "{", "}", "[", "]", ":", ",", "\\\"", "\\\\", "\\n", "\\/", "\\u00e9",
+        "\\ud83d\\ude00", "\xc3\xa9", "\\\\\\\"", "\\\\\\\\",
+    };
+    put(g, "\"");
+    unsigned n = (unsigned)(fixture_rand(g->state) % 12);
+    for (unsigned i = 0; i < n; i++) {
+        uint64_t r = fixture_rand(g->state);
+        if (r % 16 == 0) {
+            // Long runs of escaped backslashes, to straddle block boundaries.
+            unsigned run = (unsigned)((r >> 8) % 80);
+            for (unsigned j = 0; j < run; j++) {
+                put(g, "\\\\");
+            }
+        } else if (r % 16 == 1) {
+            for (unsigned j = 0; j < (unsigned)((r >> 8) % 100); j++) {
+                put(g, "x");
+            }
+        } else {
+            put(g, pieces[(r >> 8) % (sizeof(pieces) / sizeof(pieces[0]))]);
+        }
+    }
+    put(g, "\"");
+}
+
+static void put_value(gen_t *g, int depth);
+
+static void put_object(gen_t *g, int depth) {
+    static const char *keys[] = { "\"a\"", "\"b\"", "\"c\"", "\"d\"", "\"e\"", "\"url\"", "\"x\"", "\"a.b\"", "\"\\\"a\"", "\"\"" };
+    const size_t key_count = sizeof(keys) / sizeof(keys[0]);
+    unsigned used = 0;
+    unsigned n = (unsigned)(fixture_rand(g->state) % 6);
+    put(g, "{");
+    put_ws(g);
+    for (unsigned i = 0; i < n; i++) {
+        size_t k = fixture_rand(g->state) % key_count;
+        if (used & (1u << k)) {
+            continue;
+        }
+        if (used) {
+            put(g, ",");
+            put_ws(g);
+        }
+        used |= 1u << k;
+        put(g, keys[k]);
+        put_ws(g);
+        put(g, ":");
+        put_ws(g);
+        put_value(g, depth + 1);
+        put_ws(g);
+    }
+    put(g, "}");
+}
+
+static void put_value(gen_t *g, int depth) {
+    static const char *scalars[] = { "0", "-1", "12.5e3", "3.25", "true", "false", "null", "-0.0001" };
+    uint64_t r = fixture_rand(g->state) % 10;
+    if (depth > 4) {
+        r = r % 4;
+    }
+    if (r < 2) {
+        put_string(g);
+    } else if (r < 4) {
+        put(g, scalars[fixture_rand(g->state) % 8]);
+    } else if (r < 8) {
+        put_object(g, depth);
+    } else {
+        unsigned n = (unsigned)(fixture_rand(g->state) % 4);
+        put(g, "[");
+        for (unsigned i = 0; i < n; i++) {
+            put_ws(g);
+            if (i > 0) {
+                put(g, ",");
+            }
+            put_value(g, depth + 1);
+        }
+        put_ws(g);
+        put(g, "]");
+    }
+}
+
+/*** Comparison ***/
+
+// Checks an extracted value against the reference parser's.
+static void check_value(const json_path_value_t *v, const json_ref_t *ref) {
+    if (ref == NULL) {
+        CHECK_EQ_INT(v->type, JSON_PATH_MISSING);
+        return;
+    }
+    static char buf[MAX_DOC];
+    json_ref_t *parsed;
+    switch (ref->type) {
+        case JSON_REF_STRING:
+            CHECK_EQ_INT(v->type, JSON_PATH_STRING);
+            CHECK_EQ_INT(json_path_unescape(v->start, v->len, buf, sizeof(buf)), ref->string_len);
+            CHECK(memcmp(buf, ref->string, ref->string_len) == 0);
+            break;
+        case JSON_REF_NUMBER:
+            CHECK_EQ_INT(v->type, JSON_PATH_NUMBER);
+            memcpy(buf, v->start, v->len);
+            buf[v->len] = '\0';
+            CHECK(strtod(buf, NULL) == ref->number);
+            break;
+        case JSON_REF_OBJECT:
+        case JSON_REF_ARRAY:
+            CHECK_EQ_INT(v->type, ref->type == JSON_REF_OBJECT ? JSON_PATH_OBJECT : JSON_PATH_ARRAY);
+            parsed = json_ref_parse(v->start, v->len);
+            CHECK(parsed != NULL && json_ref_equal(parsed, ref));
+            json_ref_free(parsed);
+            break;
+        case JSON_REF_TRUE:
+            CHECK_EQ_INT(v->type, JSON_PATH_TRUE);
+            break;
+        case JSON_REF_FALSE:
+            CHECK_EQ_INT(v->type, JSON_PATH_FALSE);
+            break;
+        case JSON_REF_NULL:
+            CHECK_EQ_INT(v->type, JSON_PATH_NULL);
+            break;
+    }
+}
+
+// Extracts paths from doc and checks every value against the reference. Returns the number found.
+static int check_against_reference(const json_path_set_t *set, const char *const *paths, size_t count,
+                                   const char *doc, size_t len, const json_ref_t *ref) {
+    json_path_value_t values[JSON_PATH_MAX_PATHS];
+    int found = json_path_extract(set, doc, len, values);
+    CHECK(found >= 0);
+    int expected = 0;
+    for (size_t i = 0; i < count; i++) {
+        const json_ref_t *r = json_ref_path(ref, paths[i]);
+        check_value(&values[i], r);
+        expected += (r != NULL);
+    }
+    CHECK_EQ_INT(found, expected);
+    return found;
+}
+
+/*** Tests ***/
+
+static void test_differential(void) {
+    json_path_set_t *whole = json_path_set_new(kPaths, PATH_COUNT, JSON_PATH_WHOLE_OBJECT);
+    json_path_set_t *early = json_path_set_new(kPaths, PATH_COUNT, 0);
+    CHECK(whole != NULL && early != NULL);
+
+    static char doc[MAX_DOC];
+    static char mutated[MAX_DOC];
+    uint64_t state = 57;
+    long total_found = 0, mutated_valid = 0;
+    for (int i = 0; i < 20000; i++) {
+        gen_t g = { doc, doc + sizeof(doc) - 1, &state };
+        put_ws(&g);
+        put_object(&g, 0);
+        put_ws(&g);
+        size_t len = (size_t)(g.p - doc);
+
+        json_ref_t *ref = json_ref_parse(doc, len);
+        if (ref == NULL) {
+            // Generator output truncated at the buffer size.
+            continue;
+        }
+        total_found += check_against_reference(whole, kPaths, PATH_COUNT, doc, len, ref);
+        check_against_reference(early, kPaths, PATH_COUNT, doc, len, ref);
+        json_ref_free(ref);
+
+        // Every truncation breaks the top level object.
+        json_path_value_t values[JSON_PATH_MAX_PATHS];
+        size_t cut = fixture_rand(&state) % len;
+        while (cut > 0 && (doc[cut - 1] == '}' || doc[cut - 1] == ' ' || doc[cut - 1] == '\t' ||
+                           doc[cut - 1] == '\r' || doc[cut - 1] == '\n')) {
+            cut--;
+        }
+        CHECK_EQ_INT(json_path_extract(whole, doc, cut, values), -1);
+
+        // Mutations: whenever the result is still valid JSON, the extractor must agree with the reference.
+        memcpy(mutated, doc, len);
+        static const char noise[] = "{}[]:,\"\\ a1";
+        mutated[fixture_rand(&state) % len] = noise[fixture_rand(&state) % (sizeof(noise) - 1)];
+        ref = json_ref_parse(mutated, len);
+        if (ref != NULL && ref->type == JSON_REF_OBJECT) {
+            check_against_reference(whole, kPaths, PATH_COUNT, mutated, len, ref);
+            mutated_valid++;
+        } else {
+            json_path_extract(whole, mutated, len, values);
+            json_path_extract(early, mutated, len, values);
+        }
+        json_ref_free(ref);
+    }
+    CHECK(total_found > 10000);
+    CHECK(mutated_valid > 1000);
+
+    json_path_set_free(whole);
+    json_path_set_free(early);
+}
+
+static void test_file_shapes(void) {
+    static const char *notice_paths[] = { "noticeType", "data", "timestamp" };
+    static const char *homepage_paths[] = { "data.url", "timestamp" };
+    static const char *server_entry_paths[] = { "region", "ipAddress", "capabilities" };
+    static const char *authorization_paths[] = { "Authorization.ID", "Authorization.AccessType", "Authorization.Expires" };
+
+    json_path_set_t *notices = json_path_set_new(notice_paths, 3, 0);
+    json_path_set_t *homepages = json_path_set_new(homepage_paths, 2, 0);
+    json_path_set_t *server_entries = json_path_set_new(server_entry_paths, 3, 0);
+    json_path_set_t *authorizations = json_path_set_new(authorization_paths, 3, 0);
+
+    static char line[8192];
+    uint64_t state = 7;
+    int64_t now_ms = 1514764800000;
+    for (int i = 0; i < 500; i++) {
+        fixture_notice_t n;
+        fixture_notice(&state, &now_ms, &n);
+        size_t len = fixture_notice_line(line, sizeof(line), &n);
+        json_ref_t *ref = json_ref_parse(line, len);
+        CHECK_EQ_INT(check_against_reference(notices, notice_paths, 3, line, len, ref), 3);
+        json_ref_free(ref);
+
+        len = fixture_homepage_line(&state, &now_ms, line, sizeof(line));
+        ref = json_ref_parse(line, len);
+        CHECK_EQ_INT(check_against_reference(homepages, homepage_paths, 2, line, len, ref), 2);
+        json_ref_free(ref);
+
+        fixture_server_entry_t entry;
+        len = fixture_server_entry_json(&state, line, sizeof(line), &entry);
+        ref = json_ref_parse(line, len);
+        CHECK_EQ_INT(check_against_reference(server_entries, server_entry_paths, 3, line, len, ref), 3);
+        json_ref_free(ref);
+
+        len = fixture_authorization_json(&state, line, sizeof(line), now_ms + 86400000);
+        ref = json_ref_parse(line, len);
+        CHECK_EQ_INT(check_against_reference(authorizations, authorization_paths, 3, line, len, ref), 3);
+        json_ref_free(ref);
+    }
+
+    json_path_set_free(notices);
+    json_path_set_free(homepages);
+    json_path_set_free(server_entries);
+    json_path_set_free(authorizations);
+}
+
+static void test_values(void) {
+    static const char *paths[] = { "s", "o", "o.n", "arr", "t", "f", "z", "missing.deeper" };
+    json_path_set_t *set = json_path_set_new(paths, 8, JSON_PATH_WHOLE_OBJECT);
+    const char *doc = " { \"s\" : \"x\\\"y\" , \"o\":{\"n\": -1.5e2 ,\"q\":[1,{\"n\":2}]}, \"arr\":[ \"OSSH\", \"QUIC\" ,3,{\"k\":[]},[]],"
+                      "\"t\":true,\"f\":false,\"z\":null,\"missing\":\"scalar\"}\n";
+    json_path_value_t v[8];
+    CHECK_EQ_INT(json_path_extract(set, doc, strlen(doc), v), 7);
+    CHECK(v[0].type == JSON_PATH_STRING && v[0].len == 4 && memcmp(v[0].start, "x\\\"y", 4) == 0);
+    CHECK(v[1].type == JSON_PATH_OBJECT && v[1].start[0] == '{' && v[1].start[v[1].len - 1] == '}');
+    CHECK(v[2].type == JSON_PATH_NUMBER && v[2].len == 6 && memcmp(v[2].start, "-1.5e2", 6) == 0);
+    CHECK(v[3].type == JSON_PATH_ARRAY);
+    CHECK_EQ_INT(v[4].type, JSON_PATH_TRUE);
+    CHECK_EQ_INT(v[5].type, JSON_PATH_FALSE);
+    CHECK_EQ_INT(v[6].type, JSON_PATH_NULL);
+    CHECK_EQ_INT(v[7].type, JSON_PATH_MISSING);
+
+    json_path_iter_t it;
+    json_path_value_t e;
+    CHECK_EQ_INT(json_path_array_begin(&it, &v[3]), 0);
+    CHECK(json_path_array_next(&it, &e) == 1 && e.type == JSON_PATH_STRING && e.len == 4 && memcmp(e.start, "OSSH", 4) == 0);
+    CHECK(json_path_array_next(&it, &e) == 1 && e.type == JSON_PATH_STRING && e.len == 4 && memcmp(e.start, "QUIC", 4) == 0);
+    CHECK(json_path_array_next(&it, &e) == 1 && e.type == JSON_PATH_NUMBER && e.len == 1);
+    CHECK(json_path_array_next(&it, &e) == 1 && e.type == JSON_PATH_OBJECT && e.len == 8);
+    CHECK(json_path_array_next(&it, &e) == 1 && e.type == JSON_PATH_ARRAY && e.len == 2);
+    CHECK_EQ_INT(json_path_array_next(&it, &e), 0);
+    CHECK_EQ_INT(json_path_array_begin(&it, &v[0]), -1);
+
+    // Not objects, or broken.
+    const char *bad[] = { "", "   ", "[1]", "\"s\"", "{", "{\"s\"}", "{\"s\":}", "{\"s\":1,}", "{\"s\":1 2}",
+                          "{\"s\":tru}", "{\"s\":1}}", "{\"s\":1} x", "x{\"s\":1}", "{\"s\" x:1}", "{,\"s\":1}" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        CHECK_EQ_INT(json_path_extract(set, bad[i], strlen(bad[i]), v), -1);
+    }
+    CHECK_EQ_INT(json_path_extract(set, "{}", 2, v), 0);
+
+    // Duplicate keys: the last one with JSON_PATH_WHOLE_OBJECT, the first one otherwise.
+    const char *dup = "{\"s\":\"1\",\"s\":\"2\"}";
+    CHECK(json_path_extract(set, dup, strlen(dup), v) == 1 && v[0].start[0] == '2');
+    json_path_set_t *early = json_path_set_new(paths, 1, 0);
+    CHECK(json_path_extract(early, dup, strlen(dup), v) == 1 && v[0].start[0] == '1');
+    // Extraction stops once everything is found, so trailing garbage isn't seen.
+    CHECK_EQ_INT(json_path_extract(early, "{\"s\":\"1\",garbage", 16, v), 1);
+
+    json_path_set_free(set);
+    json_path_set_free(early);
+}
+
+static void test_set_errors(void) {
+    const char *empty[] = { "" }, *empty_key[] = { "a..b" }, *trailing[] = { "a." }, *dup[] = { "a.b", "a.b" };
+    const char *deep[] = { "a.b.c.d.e.f.g.h.i" }, *ok_deep[] = { "a.b.c.d.e.f.g.h" }, *prefix[] = { "a", "a.b" };
+    CHECK(json_path_set_new(empty, 1, 0) == NULL);
+    CHECK(json_path_set_new(empty_key, 1, 0) == NULL);
+    CHECK(json_path_set_new(trailing, 1, 0) == NULL);
+    CHECK(json_path_set_new(dup, 2, 0) == NULL);
+    CHECK(json_path_set_new(deep, 1, 0) == NULL);
+    CHECK(json_path_set_new(kPaths, JSON_PATH_MAX_PATHS + 1, 0) == NULL);
+
+    json_path_set_t *set = json_path_set_new(ok_deep, 1, 0);
+    json_path_value_t v[2];
+    const char *doc = "{\"a\":{\"b\":{\"c\":{\"d\":{\"e\":{\"f\":{\"g\":{\"h\":42}}}}}}}}";
+    CHECK(json_path_extract(set, doc, strlen(doc), v) == 1 && v[0].len == 2);
+    json_path_set_free(set);
+
+    // A path that is also the prefix of another.
+    set = json_path_set_new(prefix, 2, 0);
+    doc = "{\"a\":{\"x\":[1],\"b\":\"y\"}}";
+    CHECK_EQ_INT(json_path_extract(set, doc, strlen(doc), v), 2);
+    CHECK(v[0].type == JSON_PATH_OBJECT && v[0].len == strlen(doc) - 6);
+    CHECK(v[1].type == JSON_PATH_STRING && v[1].len == 1);
+    json_path_set_free(set);
+}
+
+static void test_unescape(void) {
+    char buf[64];
+    const char *s = "a\\n\\t\\\"\\\\\\/\\u00e9\\u20ac\\ud83d\\ude00\\u0041";
+    long n = json_path_unescape(s, strlen(s), buf, sizeof(buf));
+    const char expected[] = "a\n\t\"\\/\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80" "A";
+    CHECK_EQ_INT(n, sizeof(expected) - 1);
+    CHECK(memcmp(buf, expected, (size_t)n) == 0);
+
+    const char *bad[] = { "\\", "\\x", "\\u12", "\\u12g4", "\\ud83d", "\\ud83dx\\ude00", "\\ude00", "\\ud83d\\u0041" };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        CHECK_EQ_INT(json_path_unescape(bad[i], strlen(bad[i]), buf, sizeof(buf)), -1);
+    }
+    CHECK_EQ_INT(json_path_unescape("abc", 3, buf, 2), -1);
+
+    // In place.
+    strcpy(buf, "x\\u00e9y");
+    CHECK_EQ_INT(json_path_unescape(buf, strlen(buf), buf, sizeof(buf)), 4);
+    CHECK(memcmp(buf, "x\xc3\xa9y", 4) == 0);
+}
+
+int main(void) {
+    RUN_TEST(test_values);
+    RUN_TEST(test_set_errors);
+    RUN_TEST(test_unescape);
+    RUN_TEST(test_file_shapes);
+    RUN_TEST(test_differential);
+    return 0;
+}
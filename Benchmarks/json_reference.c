@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "json_reference.h"
+#include "JSONPath.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    const char *p;
+    const char *end;
+    int depth;
+} parser_t;
+
+static void skip_ws(parser_t *ps) {
+    while (ps->p < ps->end && (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r')) {
+        ps->p++;
+    }
+}
+
+// Parses a string at its opening quote into a freshly allocated decoded copy.
+static char * parse_string(parser_t *ps, size_t *len) {
+    const char *start = ++ps->p;
+    while (ps->p < ps->end && *ps->p != '"') {
+        if ((unsigned char)*ps->p < 0x20) {
+            return NULL;
+        }
+        ps->p += (*ps->p == '\\') ? 2 : 1;
+    }
+    if (ps->p >= ps->end) {
+        return NULL;
+    }
+    size_t raw_len = (size_t)(ps->p - start);
+    ps->p++;
+    char *s = malloc(raw_len + 1);
+    long n = json_path_unescape(start, raw_len, s, raw_len);
+    if (n < 0) {
+        free(s);
+        return NULL;
+    }
+    s[n] = '\0';
+    *len = (size_t)n;
+    return s;
+}
+
+static json_ref_t * parse_value(parser_t *ps);
+
+static void add_child(json_ref_t *v, json_ref_t *child, char *key, size_t key_len) {
+    v->children = realloc(v->children, (v->child_count + 1) * sizeof(*v->children));
+    v->keys = realloc(v->keys, (v->child_count + 1) * sizeof(*v->keys));
+    v->key_lens = realloc(v->key_lens, (v->child_count + 1) * sizeof(*v->key_lens));
+    v->children[v->child_count] = child;
+    v->keys[v->child_count] = key;
+    v->key_lens[v->child_count] = key_len;
+    v->child_count++;
+}
+
+static int parse_number(parser_t *ps, json_ref_t *v) {
+    const char *start = ps->p;
+    if (ps->p < ps->end && *ps->p == '-') {
+        ps->p++;
+    }
+    if (ps->p >= ps->end || *ps->p < '0' || *ps->p > '9') {
+        return -1;
+    }
+    if (*ps->p == '0') {
+        ps->p++;
+    } else {
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+            ps->p++;
+        }
+    }
+    if (ps->p < ps->end && *ps->p == '.') {
+        ps->p++;
+        const char *digits = ps->p;
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+            ps->p++;
+        }
+        if (ps->p == digits) {
+            return -1;
+        }
+    }
+    if (ps->p < ps->end && (*ps->p == 'e' || *ps->p == 'E')) {
+        ps->p++;
+        if (ps->p < ps->end && (*ps->p == '+' || *ps->p == '-')) {
+            ps->p++;
+        }
+        const char *digits = ps->p;
+        while (ps->p < ps->end && *ps->p >= '0' && *ps->p <= '9') {
+            ps->p++;
+        }
+        if (ps->p == digits) {
+            return -1;
+        }
+    }
+    char buf[64];
+    size_t n = (size_t)(ps->p - start);
+    if (n >= sizeof(buf)) {
+        n = sizeof(buf) - 1;
+    }
+    memcpy(buf, start, n);
+    buf[n] = '\0';
+    v->number = strtod(buf, NULL);
+    return 0;
+}
+
+static json_ref_t * parse_value(parser_t *ps) {
+    skip_ws(ps);
+    if (ps->p >= ps->end || ++ps->depth > 64) {
+        return NULL;
+    }
+    json_ref_t *v = calloc(1, sizeof(*v));
+    int ok = 0;
+    char c = *ps->p;
+
+    if (c == '"') {
+        v->type = JSON_REF_STRING;
+        ok = (v->string = parse_string(ps, &v->string_len)) != NULL;
+    } else if (c == '{' || c == '[') {
+        v->type = (c == '{') ? JSON_REF_OBJECT : JSON_REF_ARRAY;
+        char close = (c == '{') ? '}' : ']';
+        ps->p++;
+        skip_ws(ps);
+        if (ps->p < ps->end && *ps->p == close) {
+            ps->p++;
+            ok = 1;
+        }
+        while (!ok && ps->p < ps->end) {
+            char *key = NULL;
+            size_t key_len = 0;
+            if (c == '{') {
+                skip_ws(ps);
+                if (ps->p >= ps->end || *ps->p != '"' || (key = parse_string(ps, &key_len)) == NULL) {
+                    break;
+                }
+                skip_ws(ps);
+                if (ps->p >= ps->end || *ps->p != ':') {
+                    free(key);
+                    break;
+                }
+                ps->p++;
+            }
+            json_ref_t *child = parse_value(ps);
+            if (child == NULL) {
+                free(key);
+                break;
+            }
+            add_child(v, child, key, key_len);
+            skip_ws(ps);
+            if (ps->p < ps->end && *ps->p == ',') {
+                ps->p++;
+            } else if (ps->p < ps->end && *ps->p == close) {
+                ps->p++;
+                ok = 1;
+            } else {
+                break;
+            }
+        }
+    } else if (ps->end - ps->p >= 4 && memcmp(ps->p, "true", 4) == 0) {
+        v->type = JSON_REF_TRUE;
+        ps->p += 4;
+        ok = 1;
+    } else if (ps->end - ps->p >= 5 && memcmp(ps->p, "false", 5) == 0) {
+        v->type = JSON_REF_FALSE;
+        ps->p += 5;
+        ok = 1;
+    } else if (ps->end - ps->p >= 4 && memcmp(ps->p, "null", 4) == 0) {
+        v->type = JSON_REF_NULL;
+        ps->p += 4;
+        ok = 1;
+    } else {
+        v->type = JSON_REF_NUMBER;
+        ok = parse_number(ps, v) == 0;
+    }
+
+    ps->depth--;
+    if (!ok) {
+        json_ref_free(v);
+        return NULL;
+    }
+    return v;
+}
+
+// See comment in header
+json_ref_t * json_ref_parse(const char *s, size_t len) {
+    parser_t ps = { s, s + len, 0 };
+    json_ref_t *v = parse_value(&ps);
+    skip_ws(&ps);
+    if (v != NULL && ps.p != ps.end) {
+        json_ref_free(v);
+        return NULL;
+    }
+    return v;
+}
+
+// See comment in header
+void json_ref_free(json_ref_t *v) {
+    if (v == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < v->child_count; i++) {
+        json_ref_free(v->children[i]);
+        free(v->keys[i]);
+    }
+    free(v->children);
+    free(v->keys);
+    free(v->key_lens);
+    free(v->string);
+    free(v);
+}
+
+// See comment in header
+const json_ref_t * json_ref_path(const json_ref_t *v, const char *path) {
+    while (v != NULL) {
+        if (v->type != JSON_REF_OBJECT) {
+            return NULL;
+        }
+        const char *dot = strchr(path, '.');
+        size_t len = dot ? (size_t)(dot - path) : strlen(path);
+        const json_ref_t *found = NULL;
+        for (size_t i = 0; i < v->child_count; i++) {
+            if (v->key_lens[i] == len && memcmp(v->keys[i], path, len) == 0) {
+                found = v->children[i];
+            }
+        }
+        if (dot == NULL) {
+            return found;
+        }
+        v = found;
+        path = dot + 1;
+    }
+    return NULL;
+}
+
+// See comment in header
+int json_ref_equal(const json_ref_t *a, const json_ref_t *b) {
+    if (a->type != b->type || a->child_count != b->child_count) {
+        return 0;
+    }
+    switch (a->type) {
+        case JSON_REF_STRING:
+            return a->string_len == b->string_len && memcmp(a->string, b->string, a->string_len) == 0;
+        case JSON_REF_NUMBER:
+            return a->number == b->number;
+        case JSON_REF_OBJECT:
+        case JSON_REF_ARRAY:
+            for (size_t i = 0; i < a->child_count; i++) {
+                if (a->type == JSON_REF_OBJECT &&
+                    (a->key_lens[i] != b->key_lens[i] || memcmp(a->keys[i], b->keys[i], a->key_lens[i]) != 0)) {
+                    return 0;
+                }
+                if (!json_ref_equal(a->children[i], b->children[i])) {
+                    return 0;
+                }
+            }
+            return 1;
+        default:
+            return 1;
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef json_reference_h
+#define json_reference_h
+
+#include <stddef.h>
+
+/*
+ * Straightforward allocating JSON parser: builds the whole tree and decodes every string, like
+ * NSJSONSerialization does. Used as the baseline for the on-demand extractor and as the reference
+ * in its differential test.
+ */
+
+typedef enum {
+    JSON_REF_STRING,
+    JSON_REF_NUMBER,
+    JSON_REF_OBJECT,
+    JSON_REF_ARRAY,
+    JSON_REF_TRUE,
+    JSON_REF_FALSE,
+    JSON_REF_NULL,
+} json_ref_type_t;
+
+typedef struct json_ref {
+    json_ref_type_t type;
+    char *string;               // Decoded string, or the key of an object member.
+    size_t string_len;
+    double number;
+    struct json_ref **children; // Object members (with their key in string) or array elements.
+    char **keys;
+    size_t *key_lens;
+    size_t child_count;
+} json_ref_t;
+
+/*!
+ * @brief Parses a complete JSON document.
+ * @return Tree, or NULL if the document is malformed.
+ */
+json_ref_t * json_ref_parse(const char *s, size_t len);
+
+void json_ref_free(json_ref_t *v);
+
+/*!
+ * @brief Looks up a dotted path of object keys. The last of repeated keys wins.
+ * @return Value, or NULL if missing.
+ */
+const json_ref_t * json_ref_path(const json_ref_t *v, const char *path);
+
+/*!
+ * @brief Deep equality. Object members are compared in order.
+ */
+int json_ref_equal(const json_ref_t *a, const json_ref_t *b);
+
+#endif /* json_reference_h */
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Indexing the lines of JSON-lines data: the line index over the whole buffer and over 4 KiB appends,
+ * against a memchr loop recording the same offsets, and against getline and
+ * drop_newline_and_carriage_return over the file, as EmbeddedServerEntries.m reads it.
+ * Over a notices file, of 150-300 byte lines, and over short log lines with "\r\n".
+ */
+
+#define _GNU_SOURCE
+#include "EmbeddedServerEntriesHelpers.h"
+#include "LineIndex.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define NOTICES_BYTES (64 << 20)
+#define SHORT_LINES_BYTES (16 << 20)
+#define CHUNK 4096
+#define RUNS 3
+
+static volatile size_t sink;
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+// The offsets the line index records, with memchr.
+static size_t memchr_index(const char *data, size_t len, uint32_t *starts, uint8_t *crlf) {
+    size_t count = 0;
+    const char *p = data, *end = data + len;
+    starts[0] = 0;
+    const char *nl;
+    while (p < end && (nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        crlf[count] = nl > p && nl[-1] == '\r';
+        starts[++count] = (uint32_t)(nl + 1 - data);
+        p = nl + 1;
+    }
+    return count;
+}
+
+static size_t getline_index(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fail("fopen");
+    }
+    char *line = NULL;
+    size_t cap = 0, count = 0;
+    while (getline(&line, &cap, fp) != -1) {
+        drop_newline_and_carriage_return(line);
+        sink += strlen(line);
+        count++;
+    }
+    free(line);
+    fclose(fp);
+    return count;
+}
+
+static void run(const char *name, const char *path) {
+    size_t len;
+    char *data = fixture_read_file(path, &len);
+    if (data == NULL) {
+        fail("read");
+    }
+    char label[128];
+    size_t lines = 0;
+
+    line_index_t *idx = line_index_new();
+    uint64_t best = UINT64_MAX;
+    for (int run = 0; run < RUNS; run++) {
+        line_index_reset(idx);
+        uint64_t start = bench_now_ns();
+        if (line_index_append(idx, data, len) != 0) {
+            fail("line_index_append");
+        }
+        uint64_t ns = bench_now_ns() - start;
+        best = ns < best ? ns : best;
+    }
+    lines = line_index_count(idx);
+    snprintf(label, sizeof(label), "line_index/%s/line_index", name);
+    bench_report(label, 1, best, len);
+
+    best = UINT64_MAX;
+    for (int run = 0; run < RUNS; run++) {
+        line_index_reset(idx);
+        uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < len; i += CHUNK) {
+            if (line_index_append(idx, data + i, len - i < CHUNK ? len - i : CHUNK) != 0) {
+                fail("line_index_append");
+            }
+        }
+        uint64_t ns = bench_now_ns() - start;
+        best = ns < best ? ns : best;
+    }
+    if (line_index_count(idx) != lines) {
+        fail("chunked index");
+    }
+    snprintf(label, sizeof(label), "line_index/%s/line_index_4k_appends", name);
+    bench_report(label, 1, best, len);
+
+    uint32_t *starts = malloc((len + 1) * sizeof(*starts));
+    uint8_t *crlf = malloc(len + 1);
+    best = UINT64_MAX;
+    for (int run = 0; run < RUNS; run++) {
+        uint64_t start = bench_now_ns();
+        if (memchr_index(data, len, starts, crlf) != lines) {
+            fail("memchr index");
+        }
+        uint64_t ns = bench_now_ns() - start;
+        best = ns < best ? ns : best;
+    }
+    for (size_t i = 0; i < lines; i++) {
+        uint32_t offset, line_len;
+        if (line_index_line(idx, i, &offset, &line_len) != 0 || offset != starts[i] ||
+            line_len != starts[i + 1] - 1 - starts[i] - crlf[i]) {
+            fail("index comparison");
+        }
+    }
+    snprintf(label, sizeof(label), "line_index/%s/memchr_loop", name);
+    bench_report(label, 1, best, len);
+
+    best = UINT64_MAX;
+    for (int run = 0; run < RUNS; run++) {
+        uint64_t start = bench_now_ns();
+        if (getline_index(path) != lines) {
+            fail("getline");
+        }
+        uint64_t ns = bench_now_ns() - start;
+        best = ns < best ? ns : best;
+    }
+    snprintf(label, sizeof(label), "line_index/%s/getline_drop_newline", name);
+    bench_report(label, 1, best, len);
+
+    snprintf(label, sizeof(label), "line_index/%s/mean_line", name);
+    bench_counter(label, (double)len / (double)lines, "B");
+    snprintf(label, sizeof(label), "line_index/%s/index_memory_per_line", name);
+    bench_counter(label, (double)line_index_memory(idx) / (double)lines, "B");
+
+    line_index_free(idx);
+    free(starts);
+    free(crlf);
+    free(data);
+}
+
+int main(void) {
+    char *dir = fixture_tmpdir(), *notices, *short_lines;
+    if (dir == NULL || asprintf(&notices, "%s/notices", dir) < 0 || asprintf(&short_lines, "%s/short", dir) < 0) {
+        fail("setup");
+    }
+    uint64_t state = 70;
+    int64_t now_ms = 1514764800000;
+    if (fixture_write_notices_file(notices, NOTICES_BYTES, &state, &now_ms) < 0) {
+        fail("notices file");
+    }
+
+    FILE *fp = fopen(short_lines, "w");
+    if (fp == NULL) {
+        fail("short lines file");
+    }
+    for (long written = 0; written < SHORT_LINES_BYTES;) {
+        uint64_t r = fixture_rand(&state);
+        written += fprintf(fp, "%s %u: %.*s\r\n", (r & 1) ? "ExtensionInfo" : "ContainerWarn",
+                           (unsigned)(r >> 8) % 1000, (int)((r >> 20) % 30), "abcdefghijklmnopqrstuvwxyzabcdefghij");
+    }
+    fclose(fp);
+
+    run("notices", notices);
+    run("short_lines", short_lines);
+
+    fixture_rmdir(dir);
+    free(notices);
+    free(short_lines);
+    free(dir);
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "LineIndex.h"
+#include "check.h"
+#include "fixtures.h"
+#include <string.h>
+
+// Checks the index of data against splitting it byte by byte.
+static void check_index(const line_index_t *idx, const char *data, size_t len) {
+    size_t line = 0, start = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n') {
+            continue;
+        }
+        size_t end = (i > start && data[i - 1] == '\r') ? i - 1 : i;
+        uint32_t offset, line_len;
+        CHECK_EQ_INT(line_index_line(idx, line, &offset, &line_len), 0);
+        CHECK_EQ_INT(offset, start);
+        CHECK_EQ_INT(line_len, end - start);
+        line++;
+        start = i + 1;
+    }
+    CHECK_EQ_INT(line_index_count(idx), line);
+    uint32_t offset = 1, line_len = 1;
+    CHECK_EQ_INT(line_index_line(idx, line, &offset, &line_len), -1);
+    CHECK_EQ_INT(line_index_partial(idx, &offset, &line_len), start < len);
+    CHECK_EQ_INT(offset, start);
+    CHECK_EQ_INT(line_len, len - start);
+    CHECK_EQ_INT(line_index_size(idx), len);
+}
+
+static void test_cases(void) {
+    static const struct { const char *data; size_t lines; } cases[] = {
+        { "", 0 }, { "\n", 1 }, { "\r\n", 1 }, { "\r", 0 }, { "a", 0 }, { "a\nb", 1 }, { "a\r\nb\r\n", 2 },
+        { "\n\r\n\r\r\n\n", 4 }, { "a\rb\n", 1 },
+        { "{\"noticeType\":\"Info\",\"data\":{\"message\":\"a line longer than a block\"}}\r\n{}\n\n", 3 } };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        line_index_t *idx = line_index_new();
+        size_t len = strlen(cases[i].data);
+        CHECK_EQ_INT(line_index_append(idx, cases[i].data, len), 0);
+        CHECK_EQ_INT(line_index_count(idx), cases[i].lines);
+        check_index(idx, cases[i].data, len);
+
+        // The same, a byte at a time.
+        line_index_reset(idx);
+        for (size_t j = 0; j < len; j++) {
+            CHECK_EQ_INT(line_index_append(idx, cases[i].data + j, 1), 0);
+        }
+        check_index(idx, cases[i].data, len);
+        line_index_free(idx);
+    }
+
+    uint32_t offset, len;
+    line_index_t *idx = line_index_new();
+    CHECK_EQ_INT(line_index_append(idx, "a\r", 2), 0);
+    CHECK_EQ_INT(line_index_partial(idx, &offset, &len), 1);
+    CHECK_EQ_INT(len, 2);
+    CHECK_EQ_INT(line_index_append(idx, "", 0), 0);
+    CHECK_EQ_INT(line_index_append(idx, "\n", 1), 0);
+    CHECK_EQ_INT(line_index_line(idx, 0, &offset, &len), 0);
+    CHECK_EQ_INT(len, 1);
+    CHECK_EQ_INT(line_index_partial(idx, &offset, &len), 0);
+
+    // Too much data is refused without being read.
+    CHECK_EQ_INT(line_index_append(idx, NULL, (size_t)LINE_INDEX_MAX_SIZE), -1);
+    CHECK_EQ_INT(line_index_size(idx), 3);
+    CHECK(line_index_memory(idx) > 0);
+    line_index_free(idx);
+}
+
+// Random data, dense with '\r' and '\n', appended in random chunks.
+static void test_randomized(void) {
+    uint64_t state = 70;
+    enum { LEN = 1 << 16 };
+    char *data = malloc(LEN);
+    for (int round = 0; round < 40; round++) {
+        size_t len = fixture_rand(&state) % LEN;
+        int density = 2 + round;
+        for (size_t i = 0; i < len; i++) {
+            uint64_t r = fixture_rand(&state) % (uint64_t)density;
+            data[i] = r == 0 ? '\n' : r == 1 ? '\r' : (char)('a' + r % 26);
+        }
+        line_index_t *idx = line_index_new();
+        size_t appended = 0;
+        while (appended < len) {
+            size_t n = fixture_rand(&state) % (round % 2 ? 100 : 5000);
+            n = n < len - appended ? n : len - appended;
+            CHECK_EQ_INT(line_index_append(idx, data + appended, n), 0);
+            appended += n;
+            if (fixture_rand(&state) % 8 == 0) {
+                check_index(idx, data, appended);
+            }
+        }
+        check_index(idx, data, len);
+        line_index_free(idx);
+    }
+    free(data);
+}
+
+int main(void) {
+    RUN_TEST(test_cases);
+    RUN_TEST(test_randomized);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Size reduction and throughput of notice folding on two notice streams:
+ *
+ *  - mixed: the fixture mix of tunnel-core diagnostics, reachability, memory profiling and
+ *    container notices.
+ *  - storm: tunnel-core stuck in a reconnect loop, cycling through a handful of candidate
+ *    servers with reachability flaps in between.
+ */
+
+#include "NoticeFolding.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define NOTICES 200000
+
+typedef struct {
+    fixture_notice_t *notices;
+    size_t count;
+    uint64_t input_bytes;
+} stream_t;
+
+typedef struct {
+    uint64_t output_bytes;
+    uint64_t runs;
+    char line[16 * 1024];
+} output_t;
+
+static int format_run(void *ctx, const notice_fold_run_t *run) {
+    output_t *o = ctx;
+    long n = notice_fold_format_json(run, o->line, sizeof(o->line));
+    if (n < 0) {
+        return -1;
+    }
+    o->output_bytes += (uint64_t)n + 1;
+    o->runs++;
+    return 0;
+}
+
+static void make_mixed(stream_t *s) {
+    uint64_t state = 5;
+    int64_t now_ms = INT64_C(1537351200000);
+    for (size_t i = 0; i < s->count; i++) {
+        fixture_notice(&state, &now_ms, &s->notices[i]);
+    }
+}
+
+static void make_storm(stream_t *s) {
+    uint64_t state = 9;
+    int64_t now_ms = INT64_C(1537351200000);
+    const char *ips[] = { "192.0.2.17", "198.51.100.4", "203.0.113.250", "192.0.2.201" };
+    for (size_t i = 0; i < s->count; i++) {
+        fixture_notice_t *n = &s->notices[i];
+        now_ms += (int64_t)(fixture_rand(&state) % 40);
+        fixture_timestamp(n->timestamp, sizeof(n->timestamp), now_ms, -240);
+        if (i % 10 == 9) {
+            strcpy(n->notice_type, "ExtensionInfo");
+            snprintf(n->data_json, sizeof(n->data_json), "{\"Reachability\":\"network changed to %s (flags 0x%02x)\"}",
+                     (i / 10) % 2 ? "WiFi" : "Cellular", (unsigned)(i % 7));
+        } else {
+            strcpy(n->notice_type, "tunnel-core");
+            snprintf(n->data_json, sizeof(n->data_json),
+                     "{\"message\":\"{\\\"data\\\":{\\\"ipAddress\\\":\\\"%s:443\\\",\\\"error\\\":\\\"dial tcp %s:443: i/o timeout after %ums\\\"},\\\"noticeType\\\":\\\"ConnectedServerFailed\\\",\\\"showUser\\\":false,\\\"timestamp\\\":\\\"%s\\\"}\"}",
+                     ips[i % 4], ips[i % 4], (unsigned)(fixture_rand(&state) % 10000), n->timestamp);
+        }
+    }
+}
+
+static void measure(const char *name, stream_t *s, unsigned window) {
+    static output_t out;
+    char line[2048];
+
+    // The notice lines, back to back, as the folder is given them along with their parts.
+    size_t *offsets = malloc((s->count + 1) * sizeof(size_t));
+    s->input_bytes = 0;
+    for (size_t i = 0; i < s->count; i++) {
+        offsets[i] = s->input_bytes;
+        s->input_bytes += fixture_notice_line(line, sizeof(line), &s->notices[i]);
+    }
+    offsets[s->count] = s->input_bytes;
+    char *lines = malloc(s->input_bytes + 1);
+    for (size_t i = 0; i < s->count; i++) {
+        fixture_notice_line(lines + offsets[i], offsets[i + 1] - offsets[i] + 1, &s->notices[i]);
+    }
+    s->input_bytes += s->count;
+
+    memset(&out, 0, sizeof(out));
+    notice_folder_t *f = notice_folder_new(window, 60000, format_run, &out);
+
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < s->count; i++) {
+        const fixture_notice_t *n = &s->notices[i];
+        notice_folder_add(f, n->notice_type, n->data_json, strlen(n->data_json), n->timestamp, strlen(n->timestamp),
+                          lines + offsets[i], offsets[i + 1] - offsets[i]);
+    }
+    notice_folder_flush(f);
+    uint64_t elapsed = bench_now_ns() - start;
+    notice_folder_free(f);
+    free(lines);
+    free(offsets);
+
+    char label[128];
+    snprintf(label, sizeof(label), "notice_folding/%s/window_%u", name, window);
+    bench_report(label, s->count, elapsed, s->input_bytes);
+    snprintf(label, sizeof(label), "notice_folding/%s/window_%u/output_bytes", name, window);
+    bench_counter(label, (double)out.output_bytes, "bytes");
+    snprintf(label, sizeof(label), "notice_folding/%s/window_%u/reduction", name, window);
+    bench_counter(label, (double)s->input_bytes / (double)out.output_bytes, "x");
+    snprintf(label, sizeof(label), "notice_folding/%s/window_%u/records", name, window);
+    bench_counter(label, (double)out.runs, "records");
+}
+
+int main(void) {
+    stream_t s;
+    s.count = NOTICES;
+    s.notices = malloc(NOTICES * sizeof(fixture_notice_t));
+
+    make_mixed(&s);
+    measure("mixed", &s, 8);
+    measure("mixed", &s, 32);
+
+    make_storm(&s);
+    measure("storm", &s, 8);
+    measure("storm", &s, 32);
+
+    free(s.notices);
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "NoticeFolding.h"
+#include "check.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define MAX_RUNS 100000
+
+typedef struct {
+    uint64_t total;
+    unsigned runs;
+    unsigned folded;
+    char lines[64][1024];
+} collect_t;
+
+static int collect(void *ctx, const notice_fold_run_t *run) {
+    collect_t *c = ctx;
+    c->total += run->count;
+    c->folded += (run->count > 1);
+    if (c->runs < 64) {
+        long n = notice_fold_format_json(run, c->lines[c->runs], sizeof(c->lines[0]) - 1);
+        CHECK(n > 0);
+        c->lines[c->runs][n] = '\0';
+    }
+    c->runs++;
+    return 0;
+}
+
+static void test_templatize(void) {
+    const char *msg = "{\"message\":\"dial 192.0.2.17:443 failed after 3 tries (12.5ms) at 2018-09-19T10:00:00.123-04:00, IPv4 100%\"}";
+    char template[512], params[512];
+    size_t params_len;
+    uint32_t count;
+    size_t n = notice_fold_templatize(msg, strlen(msg), template, params, &params_len, &count);
+    template[n] = '\0';
+
+    CHECK(strcmp(template, "{\"message\":\"dial %a failed after %n tries (%nms) at %t, IPv4 %n%%\"}") == 0);
+    CHECK_EQ_INT(count, 5);
+    CHECK(memcmp(params, "192.0.2.17:443\0" "3\0" "12.5\0" "2018-09-19T10:00:00.123-04:00\0" "100", params_len) == 0);
+
+    char expanded[512];
+    long e = notice_fold_expand(template, n, params, params_len, expanded, sizeof(expanded));
+    CHECK_EQ_INT(e, strlen(msg));
+    CHECK(memcmp(expanded, msg, (size_t)e) == 0);
+
+    // Too few parameters is an error, not a silent truncation.
+    CHECK(notice_fold_expand(template, n, params, 4, expanded, sizeof(expanded)) < 0);
+}
+
+static void test_round_trip_fixture_messages(void) {
+    uint64_t state = 3;
+    int64_t now_ms = INT64_C(1537351200000);
+    char template[2048], params[2048], expanded[2048];
+    for (int i = 0; i < 20000; i++) {
+        fixture_notice_t n;
+        fixture_notice(&state, &now_ms, &n);
+        size_t len = strlen(n.data_json), params_len;
+        uint32_t count;
+        size_t t = notice_fold_templatize(n.data_json, len, template, params, &params_len, &count);
+        long e = notice_fold_expand(template, t, params, params_len, expanded, sizeof(expanded));
+        CHECK_EQ_INT(e, len);
+        CHECK(memcmp(expanded, n.data_json, len) == 0);
+    }
+}
+
+static void test_folds_consecutive_and_interleaved_repeats(void) {
+    static collect_t c;
+    memset(&c, 0, sizeof(c));
+    notice_folder_t *f = notice_folder_new(4, 60000, collect, &c);
+    CHECK(f != NULL);
+
+    char msg[128], ts[40];
+    for (int i = 0; i < 10; i++) {
+        fixture_timestamp(ts, sizeof(ts), INT64_C(1537351200000) + i * 100, 0);
+        snprintf(msg, sizeof(msg), "{\"Reachability\":\"attempt %d\"}", i);
+        CHECK(notice_folder_add(f, "ExtensionInfo", msg, strlen(msg), ts, strlen(ts), NULL, 0) == 0);
+        snprintf(msg, sizeof(msg), "{\"rss\":\"%d.5 MB\"}", 10 + i);
+        CHECK(notice_folder_add(f, "MemoryProfiling", msg, strlen(msg), ts, strlen(ts), NULL, 0) == 0);
+    }
+    CHECK(notice_folder_add(f, "ExtensionInfo", "\"done\"", 6, ts, strlen(ts), NULL, 0) == 0);
+    CHECK(notice_folder_flush(f) == 0);
+
+    CHECK_EQ_INT(c.total, 21);
+    CHECK_EQ_INT(c.runs, 3);
+    CHECK(strcmp(c.lines[0],
+                 "{\"noticeType\":\"ExtensionInfo\",\"template\":\"{\\\"Reachability\\\":\\\"attempt %n\\\"}\",\"count\":10,"
+                 "\"first\":\"2018-09-19T10:00:00.000Z\",\"last\":\"2018-09-19T10:00:00.900Z\","
+                 "\"firstParams\":[\"0\"],\"lastParams\":[\"9\"]}") == 0);
+    CHECK(strstr(c.lines[1], "\"noticeType\":\"MemoryProfiling\"") != NULL);
+    CHECK(strstr(c.lines[1], "\"count\":10") != NULL);
+    // A single notice without its line is rebuilt from its parts, keeping the timestamp as written.
+    CHECK(strcmp(c.lines[2], "{\"data\":\"done\",\"noticeType\":\"ExtensionInfo\",\"timestamp\":\"2018-09-19T10:00:00.900Z\"}") == 0);
+
+    notice_folder_free(f);
+}
+
+static void test_gap_and_window_close_runs(void) {
+    static collect_t c;
+    memset(&c, 0, sizeof(c));
+    notice_folder_t *f = notice_folder_new(2, 1000, collect, &c);
+
+    char ts[40];
+    const char *types[] = { "A", "A", "B", "C", "A", "A" };
+    const int64_t times[] = { 0, 500, 600, 700, 800, 5000 };
+    for (int i = 0; i < 6; i++) {
+        fixture_timestamp(ts, sizeof(ts), INT64_C(1537351200000) + times[i], 0);
+        CHECK(notice_folder_add(f, types[i], "{}", 2, ts, strlen(ts), NULL, 0) == 0);
+    }
+    CHECK(notice_folder_flush(f) == 0);
+
+    // A x2 is evicted by C (window of 2), A at 800 starts a new run, A at 5000 is past the gap.
+    CHECK_EQ_INT(c.total, 6);
+    CHECK_EQ_INT(c.runs, 5);
+    CHECK(strstr(c.lines[0], "\"count\":2") != NULL);
+    CHECK(strstr(c.lines[1], "\"noticeType\":\"B\"") != NULL);
+    CHECK(strstr(c.lines[2], "\"noticeType\":\"C\"") != NULL);
+
+    notice_folder_free(f);
+}
+
+static void test_single_notices_pass_through(void) {
+    static collect_t c;
+    memset(&c, 0, sizeof(c));
+    notice_folder_t *f = notice_folder_new(4, 60000, collect, &c);
+
+    // Other keys, and the timestamp's offset and precision, are kept.
+    const char *lines[] = {
+        "{\"data\":{\"count\":2},\"noticeType\":\"AvailableEgressRegions\",\"showUser\":true,"
+        "\"timestamp\":\"2018-09-19T06:00:00.123456-04:00\"}",
+        "{\"data\":\"connected\",\"noticeType\":\"ExtensionInfo\",\"showUser\":false,"
+        "\"timestamp\":\"2018-09-19T10:00:01Z\"}",
+    };
+    CHECK(notice_folder_add(f, "AvailableEgressRegions", "{\"count\":2}", 11, "2018-09-19T06:00:00.123456-04:00", 32,
+                            lines[0], strlen(lines[0])) == 0);
+    CHECK(notice_folder_add(f, "ExtensionInfo", "\"connected\"", 11, "2018-09-19T10:00:01Z", 20,
+                            lines[1], strlen(lines[1])) == 0);
+    // Folded runs are unchanged by the line.
+    for (int i = 0; i < 3; i++) {
+        char line[128];
+        snprintf(line, sizeof(line), "{\"data\":\"retry %d\",\"noticeType\":\"Info\",\"timestamp\":\"2018-09-19T10:00:02Z\"}", i);
+        char msg[16];
+        snprintf(msg, sizeof(msg), "\"retry %d\"", i);
+        CHECK(notice_folder_add(f, "Info", msg, strlen(msg), "2018-09-19T10:00:02Z", 20, line, strlen(line)) == 0);
+    }
+    CHECK(notice_folder_flush(f) == 0);
+
+    CHECK_EQ_INT(c.runs, 3);
+    CHECK(strcmp(c.lines[0], lines[0]) == 0);
+    CHECK(strcmp(c.lines[1], lines[1]) == 0);
+    CHECK(strstr(c.lines[2], "\"template\":\"\\\"retry %n\\\"\",\"count\":3") != NULL);
+
+    notice_folder_free(f);
+}
+
+static void test_counts_preserved_on_fixture_stream(void) {
+    static collect_t c;
+    memset(&c, 0, sizeof(c));
+    notice_folder_t *f = notice_folder_new(16, 30000, collect, &c);
+
+    uint64_t state = 11;
+    int64_t now_ms = INT64_C(1537351200000);
+    const int count = 50000;
+    for (int i = 0; i < count; i++) {
+        fixture_notice_t n;
+        fixture_notice(&state, &now_ms, &n);
+        CHECK(notice_folder_add(f, n.notice_type, n.data_json, strlen(n.data_json), n.timestamp, strlen(n.timestamp), NULL, 0) == 0);
+    }
+    CHECK(notice_folder_flush(f) == 0);
+    CHECK_EQ_INT(c.total, count);
+    CHECK(c.runs < count / 4);
+
+    notice_folder_free(f);
+}
+
+int main(void) {
+    RUN_TEST(test_templatize);
+    RUN_TEST(test_round_trip_fixture_messages);
+    RUN_TEST(test_folds_consecutive_and_interleaved_repeats);
+    RUN_TEST(test_gap_and_window_close_runs);
+    RUN_TEST(test_single_notices_pass_through);
+    RUN_TEST(test_counts_preserved_on_fixture_stream);
+    return 0;
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+
+/*
+ * Cost of writing notices the way PsiFeedbackLogger does, with and without the notice limiter in
+ * front of the writer, on two notice streams:
+ *
+ *  - mixed: the fixture mix of tunnel-core diagnostics, reachability, memory profiling and
+ *    container notices, which the limiter should leave alone.
+ *  - storm: tunnel-core stuck in a reconnect loop, with reachability flapping in between.
+ *
+ * The writer opens the file, appends the line and a newline, syncs and closes it for every notice,
+ * and copies the file to the older file when it reaches 64KB, like writeData:toPath: and rotateFile:.
+ */
+
+#include "NoticeLimiter.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "timestamp.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NOTICES 20000
+#define MAX_FILE_SIZE 64000
+
+typedef struct {
+    fixture_notice_t *notices;
+    size_t count;
+} stream_t;
+
+typedef struct {
+    char *path;
+    char *older_path;
+    pthread_mutex_t lock;
+    uint64_t size;
+    uint64_t bytes;
+    uint64_t syncs;
+    uint64_t rotations;
+    uint64_t summarized;
+    char line[4096];
+} writer_t;
+
+static void write_all(int fd, const char *buf, size_t len) {
+    if (write(fd, buf, len) != (ssize_t)len) {
+        fprintf(stderr, "write failed\n");
+        exit(1);
+    }
+}
+
+static void rotate(writer_t *w) {
+    size_t len;
+    char *data = fixture_read_file(w->path, &len);
+    int fd = open(w->older_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    write_all(fd, data, len);
+    close(fd);
+    free(data);
+    close(open(w->path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    w->size = 0;
+    w->rotations++;
+}
+
+static void write_line(writer_t *w, const char *line, size_t len) {
+    pthread_mutex_lock(&w->lock);
+    int fd = open(w->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    write_all(fd, line, len);
+    write_all(fd, "\n", 1);
+    fsync(fd);
+    close(fd);
+    w->size += len + 1;
+    w->bytes += len + 1;
+    w->syncs++;
+    if (w->size > MAX_FILE_SIZE) {
+        rotate(w);
+    }
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void write_notice(writer_t *w, const fixture_notice_t *n) {
+    write_line(w, w->line, fixture_notice_line(w->line, sizeof(w->line), n));
+}
+
+static int write_summary(void *ctx, const notice_limit_summary_t *summary) {
+    writer_t *w = ctx;
+    long n = notice_limit_format_json(summary, w->line, sizeof(w->line));
+    if (n < 0) {
+        return -1;
+    }
+    w->summarized += summary->count;
+    write_line(w, w->line, (size_t)n);
+    return 0;
+}
+
+static notice_limiter_t * new_limiter(notice_limit_emit_fn emit, void *ctx) {
+    notice_limit_rule_t default_rule = { 10, 50, 60000, 0 };
+    notice_limit_rule_t tunnel_core = { 5, 20, 30000, NOTICE_LIMIT_PER_MESSAGE };
+    notice_limiter_t *l = notice_limiter_new(256, &default_rule, emit, ctx);
+    notice_limiter_set_rule(l, "tunnel-core", &tunnel_core);
+    return l;
+}
+
+static int64_t notice_ms(const fixture_notice_t *n) {
+    timestamp_t ts;
+    timestamp_parse(n->timestamp, strlen(n->timestamp), &ts);
+    return ts.sec * 1000 + ts.nsec / 1000000;
+}
+
+static uint64_t cpu_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void make_mixed(stream_t *s) {
+    uint64_t state = 5;
+    int64_t now_ms = INT64_C(1537351200000);
+    for (size_t i = 0; i < s->count; i++) {
+        fixture_notice(&state, &now_ms, &s->notices[i]);
+    }
+}
+
+static void make_storm(stream_t *s) {
+    uint64_t state = 9;
+    int64_t now_ms = INT64_C(1537351200000);
+    const char *ips[] = { "192.0.2.17", "198.51.100.4", "203.0.113.250", "192.0.2.201" };
+    for (size_t i = 0; i < s->count; i++) {
+        fixture_notice_t *n = &s->notices[i];
+        now_ms += (int64_t)(fixture_rand(&state) % 40);
+        fixture_timestamp(n->timestamp, sizeof(n->timestamp), now_ms, -240);
+        if (i % 10 == 9) {
+            strcpy(n->notice_type, "ExtensionInfo");
+            snprintf(n->data_json, sizeof(n->data_json), "{\"Reachability\":\"network changed to %s (flags 0x%02x)\"}",
+                     (i / 10) % 2 ? "WiFi" : "Cellular", (unsigned)(i % 7));
+        } else {
+            strcpy(n->notice_type, "tunnel-core");
+            snprintf(n->data_json, sizeof(n->data_json),
+                     "{\"message\":\"{\\\"data\\\":{\\\"ipAddress\\\":\\\"%s:443\\\","
+                     "\\\"error\\\":\\\"dial tcp %s:443: i/o timeout after %ums\\\"},"
+                     "\\\"noticeType\\\":\\\"ConnectedServerFailed\\\",\\\"showUser\\\":false,"
+                     "\\\"timestamp\\\":\\\"%s\\\"}\"}",
+                     ips[i % 4], ips[i % 4], (unsigned)(fixture_rand(&state) % 10000), n->timestamp);
+        }
+    }
+}
+
+static void measure(const char *name, const stream_t *s, const char *dir, int limited) {
+    writer_t *w = calloc(1, sizeof(*w));
+    asprintf(&w->path, "%s/%s_notices", dir, name);
+    asprintf(&w->older_path, "%s/%s_notices.1", dir, name);
+    pthread_mutex_init(&w->lock, NULL);
+    close(open(w->path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+
+    notice_limiter_t *l = limited ? new_limiter(write_summary, w) : NULL;
+    uint64_t admitted = 0;
+    int64_t next_poll_ms = 0;
+
+    uint64_t start = bench_now_ns();
+    uint64_t cpu_start = cpu_now_ns();
+    for (size_t i = 0; i < s->count; i++) {
+        const fixture_notice_t *n = &s->notices[i];
+        if (l != NULL) {
+            // A once-a-second timer, on notice time.
+            int64_t ms = notice_ms(n);
+            if (ms >= next_poll_ms) {
+                notice_limiter_poll(l, ms);
+                next_poll_ms = ms + 1000;
+            }
+            if (notice_limiter_admit(l, n->notice_type, n->data_json, strlen(n->data_json), n->timestamp,
+                                     strlen(n->timestamp)) == 0) {
+                continue;
+            }
+        }
+        write_notice(w, n);
+        admitted++;
+    }
+    if (l != NULL) {
+        notice_limiter_flush(l);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    uint64_t cpu = cpu_now_ns() - cpu_start;
+
+    char label[128];
+    const char *mode = limited ? "limited" : "unlimited_baseline";
+    snprintf(label, sizeof(label), "notice_limiter/%s/%s", name, mode);
+    bench_report(label, s->count, elapsed, 0);
+    snprintf(label, sizeof(label), "notice_limiter/%s/%s/cpu", name, mode);
+    bench_counter(label, (double)cpu / 1e6, "ms");
+    snprintf(label, sizeof(label), "notice_limiter/%s/%s/bytes_written", name, mode);
+    bench_counter(label, (double)w->bytes, "bytes");
+    snprintf(label, sizeof(label), "notice_limiter/%s/%s/syncs", name, mode);
+    bench_counter(label, (double)w->syncs, "syncs");
+    snprintf(label, sizeof(label), "notice_limiter/%s/%s/rotations", name, mode);
+    bench_counter(label, (double)w->rotations, "rotations");
+
+    if (l != NULL) {
+        // Every notice is written, or counted in a summary.
+        notice_limit_stats_t stats;
+        notice_limiter_stats(l, &stats);
+        snprintf(label, sizeof(label), "notice_limiter/%s/%s/summaries", name, mode);
+        bench_counter(label, (double)stats.summaries, "records");
+        snprintf(label, sizeof(label), "notice_limiter/%s/%s/unaccounted", name, mode);
+        bench_counter(label, (double)(s->count - admitted - w->summarized), "notices");
+        if (admitted + w->summarized != s->count || stats.suppressed != w->summarized) {
+            fprintf(stderr, "%s: summary counts don't add up\n", name);
+            exit(1);
+        }
+        notice_limiter_free(l);
+    }
+
+    pthread_mutex_destroy(&w->lock);
+    free(w->path);
+    free(w->older_path);
+    free(w);
+}
+
+static int discard(void *ctx, const notice_limit_summary_t *summary) {
+    return 0;
+}
+
+// Cost of the admission decision alone.
+static void measure_admit(const char *name, const stream_t *s) {
+    notice_limiter_t *l = new_limiter(discard, NULL);
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < s->count; i++) {
+        const fixture_notice_t *n = &s->notices[i];
+        notice_limiter_admit(l, n->notice_type, n->data_json, strlen(n->data_json), n->timestamp,
+                             strlen(n->timestamp));
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+    notice_limiter_free(l);
+
+    char label[128];
+    snprintf(label, sizeof(label), "notice_limiter/%s/admit", name);
+    bench_report(label, s->count, elapsed, 0);
+}
+
+int main(void) {
+    char *dir = fixture_tmpdir();
+    stream_t s;
+    s.count = NOTICES;
+    s.notices = malloc(NOTICES * sizeof(fixture_notice_t));
+
+    make_mixed(&s);
+    measure_admit("mixed", &s);
+    measure("mixed", &s, dir, 0);
+    measure("mixed", &s, dir, 1);
+
+    make_storm(&s);
+    measure_admit("storm", &s);
+    measure("storm", &s, dir, 0);
+    measure("storm", &s, dir, 1);
+
+    free(s.notices);
+    fixture_rmdir(dir);
+    free(dir);
+    return 0;
+}
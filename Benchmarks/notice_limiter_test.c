@@ -0,0 +1,305 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "NoticeLimiter.h"
+#include "check.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define T0 INT64_C(1537351200000)
+
+typedef struct {
+    uint64_t suppressed;
+    unsigned summaries;
+    notice_limit_summary_t last;
+    char sample[NOTICE_LIMIT_MAX_SAMPLE];
+    char notice_type[NOTICE_LIMIT_MAX_NOTICE_TYPE];
+    char json[1024];
+    // Order of admitted notices ('n') and summaries ('s'), for the first events.
+    char events[256];
+    size_t event_count;
+} collect_t;
+
+static int collect(void *ctx, const notice_limit_summary_t *s) {
+    collect_t *c = ctx;
+    CHECK(s->count > 0);
+    c->suppressed += s->count;
+    c->summaries++;
+    c->last = *s;
+    memcpy(c->sample, s->sample, s->sample_len);
+    c->last.sample = c->sample;
+    strcpy(c->notice_type, s->notice_type);
+    c->last.notice_type = c->notice_type;
+    long n = notice_limit_format_json(s, c->json, sizeof(c->json) - 1);
+    CHECK(n > 0);
+    c->json[n] = '\0';
+    if (c->event_count < sizeof(c->events)) {
+        c->events[c->event_count++] = 's';
+    }
+    return 0;
+}
+
+static int admit(notice_limiter_t *l, collect_t *c, const char *type, const char *message, int64_t ms) {
+    char ts[64];
+    size_t n = fixture_timestamp(ts, sizeof(ts), ms, 0);
+    int rc = notice_limiter_admit(l, type, message, strlen(message), ts, n);
+    CHECK(rc == 0 || rc == 1);
+    if (rc == 1 && c->event_count < sizeof(c->events)) {
+        c->events[c->event_count++] = 'n';
+    }
+    return rc;
+}
+
+static void test_burst_then_suppression(void) {
+    collect_t c = {0};
+    notice_limit_rule_t rule = { 1, 5, 0, 0 };
+    notice_limiter_t *l = notice_limiter_new(64, &rule, collect, &c);
+    CHECK(l != NULL);
+
+    // The burst is admitted, the rest suppressed while the bucket is empty.
+    int admitted = 0;
+    for (int i = 0; i < 100; i++) {
+        admitted += admit(l, &c, "tunnel-core", "reconnecting", T0 + i);
+    }
+    CHECK_EQ_INT(admitted, 5);
+    CHECK_EQ_INT(c.summaries, 0);
+
+    // One notice a second refills as fast as it is taken: admitted, and the burst goes on.
+    CHECK_EQ_INT(admit(l, &c, "tunnel-core", "reconnecting", T0 + 1100), 1);
+    CHECK_EQ_INT(admit(l, &c, "tunnel-core", "reconnecting", T0 + 1200), 0);
+    CHECK_EQ_INT(c.summaries, 0);
+
+    // Not over until the bucket is full again.
+    CHECK(notice_limiter_poll(l, T0 + 4000) == 0);
+    CHECK_EQ_INT(c.summaries, 0);
+    CHECK(notice_limiter_poll(l, T0 + 6200) == 0);
+    CHECK_EQ_INT(c.summaries, 1);
+    CHECK_EQ_INT(c.last.count, 96);
+    CHECK_EQ_INT(c.last.first_ms, T0 + 5);
+    CHECK_EQ_INT(c.last.last_ms, T0 + 1200);
+    CHECK(strcmp(c.notice_type, "tunnel-core") == 0);
+    CHECK(c.last.sample_len == 12 && memcmp(c.sample, "reconnecting", 12) == 0);
+    CHECK(strcmp(c.json, "{\"data\":{\"message\":\"suppressed 96 similar messages\",\"count\":96,"
+                         "\"first\":\"2018-09-19T10:00:00.005Z\",\"last\":\"2018-09-19T10:00:01.200Z\","
+                         "\"sample\":\"reconnecting\"},\"noticeType\":\"tunnel-core\",\"showUser\":false,"
+                         "\"timestamp\":\"2018-09-19T10:00:01.200Z\"}") == 0);
+
+    // Nothing left to summarize.
+    CHECK(notice_limiter_poll(l, T0 + 60000) == 0);
+    CHECK(notice_limiter_flush(l) == 0);
+    CHECK_EQ_INT(c.summaries, 1);
+
+    notice_limit_stats_t stats;
+    notice_limiter_stats(l, &stats);
+    CHECK_EQ_INT(stats.admitted, 6);
+    CHECK_EQ_INT(stats.suppressed, 96);
+    CHECK_EQ_INT(stats.summaries, 1);
+    CHECK_EQ_INT(stats.untracked, 0);
+    notice_limiter_free(l);
+}
+
+static void test_summary_precedes_next_notice(void) {
+    collect_t c = {0};
+    notice_limit_rule_t rule = { 10, 2, 0, 0 };
+    notice_limiter_t *l = notice_limiter_new(16, &rule, collect, &c);
+
+    for (int i = 0; i < 5; i++) {
+        admit(l, &c, "Info", "flap", T0);
+    }
+    // Without a poll, the notice after the burst carries its summary.
+    CHECK_EQ_INT(admit(l, &c, "Info", "flap", T0 + 1000), 1);
+    c.events[c.event_count] = '\0';
+    CHECK(strcmp(c.events, "nnsn") == 0);
+    CHECK_EQ_INT(c.last.count, 3);
+    notice_limiter_free(l);
+}
+
+static void test_rules_per_notice_type(void) {
+    collect_t c = {0};
+    notice_limit_rule_t limited = { 1, 1, 0, 0 };
+    notice_limit_rule_t unlimited = { 0, 0, 0, 0 };
+    notice_limit_rule_t per_message = { 1, 1, 0, NOTICE_LIMIT_PER_MESSAGE };
+    notice_limiter_t *l = notice_limiter_new(64, &limited, collect, &c);
+    CHECK(notice_limiter_set_rule(l, "Error", &unlimited) == 0);
+    CHECK(notice_limiter_set_rule(l, "tunnel-core", &per_message) == 0);
+    notice_limit_rule_t invalid = { 1, 0, 0, 0 };
+    CHECK(notice_limiter_set_rule(l, "Info", &invalid) == -1);
+
+    for (int i = 0; i < 10; i++) {
+        CHECK_EQ_INT(admit(l, &c, "Error", "failed", T0), 1);
+    }
+
+    // Types have their own buckets.
+    CHECK_EQ_INT(admit(l, &c, "Info", "a", T0), 1);
+    CHECK_EQ_INT(admit(l, &c, "Info", "b", T0), 0);
+    CHECK_EQ_INT(admit(l, &c, "Warning", "a", T0), 1);
+
+    // Messages that differ only in their numbers share a bucket, others don't.
+    CHECK_EQ_INT(admit(l, &c, "tunnel-core", "retry 1 in 5s", T0), 1);
+    CHECK_EQ_INT(admit(l, &c, "tunnel-core", "retry 2 in 10s", T0), 0);
+    CHECK_EQ_INT(admit(l, &c, "tunnel-core", "established tunnel", T0), 1);
+    CHECK_EQ_INT(admit(l, &c, "tunnel-core", "established tunnel", T0), 0);
+
+    // A rule can be changed afterwards.
+    notice_limit_rule_t relaxed = { 100, 100, 0, 0 };
+    CHECK(notice_limiter_set_rule(l, "Error", &limited) == 0);
+    CHECK_EQ_INT(admit(l, &c, "Error", "failed", T0), 1);
+    CHECK_EQ_INT(admit(l, &c, "Error", "failed", T0), 0);
+    CHECK(notice_limiter_set_rule(l, "Error", &relaxed) == 0);
+
+    CHECK(notice_limiter_flush(l) == 0);
+    CHECK_EQ_INT(c.summaries, 4);
+    CHECK_EQ_INT(c.suppressed, 4);
+    notice_limiter_free(l);
+}
+
+static void test_rule_change_applies_to_buckets_in_use(void) {
+    collect_t c = {0};
+    notice_limit_rule_t loose = { 1, 10, 0, 0 };
+    notice_limit_rule_t fast = { 1000, 2, 0, 0 };
+    notice_limit_rule_t tight = { 1, 2, 0, 0 };
+    notice_limiter_t *l = notice_limiter_new(16, &loose, collect, &c);
+
+    // A burst under the default rule ends as soon as the new rule's bucket has filled up.
+    for (int i = 0; i < 12; i++) {
+        admit(l, &c, "Info", "flap", T0);
+    }
+    CHECK(notice_limiter_set_rule(l, "Info", &fast) == 0);
+    CHECK(notice_limiter_poll(l, T0 + 2) == 0);
+    CHECK_EQ_INT(c.summaries, 1);
+    CHECK_EQ_INT(c.last.count, 2);
+    notice_limiter_free(l);
+
+    // A lower burst caps the tokens the bucket already had.
+    memset(&c, 0, sizeof(c));
+    l = notice_limiter_new(16, &loose, collect, &c);
+    CHECK_EQ_INT(admit(l, &c, "Info", "flap", T0), 1);
+    CHECK(notice_limiter_set_rule(l, "Info", &tight) == 0);
+    CHECK_EQ_INT(admit(l, &c, "Info", "flap", T0), 1);
+    CHECK_EQ_INT(admit(l, &c, "Info", "flap", T0), 1);
+    CHECK_EQ_INT(admit(l, &c, "Info", "flap", T0), 0);
+    notice_limiter_free(l);
+}
+
+static void test_periodic_summaries_during_storm(void) {
+    collect_t c = {0};
+    notice_limit_rule_t rule = { 2, 10, 10000, 0 };
+    notice_limiter_t *l = notice_limiter_new(16, &rule, collect, &c);
+
+    // A storm of 100 notices a second for a minute, polled every second.
+    uint64_t admitted = 0;
+    for (int64_t ms = 0; ms < 60000; ms += 10) {
+        admitted += (uint64_t)admit(l, &c, "tunnel-core", "reconnecting", T0 + ms);
+        if (ms % 1000 == 0) {
+            CHECK(notice_limiter_poll(l, T0 + ms) == 0);
+        }
+    }
+    CHECK(c.summaries >= 5 && c.summaries <= 6);
+    CHECK(notice_limiter_flush(l) == 0);
+    CHECK_EQ_INT(admitted + c.suppressed, 6000);
+    CHECK(admitted <= 10 + 2 * 60 + 1);
+    notice_limiter_free(l);
+}
+
+static void test_counts_preserved_on_fixture_stream(void) {
+    collect_t c = {0};
+    notice_limit_rule_t rule = { 5, 20, 30000, NOTICE_LIMIT_PER_MESSAGE };
+    notice_limiter_t *l = notice_limiter_new(NOTICE_LIMIT_PROBE, &rule, collect, &c);
+
+    // Fixture notices, interleaved with storms of a few keys, in a table small enough to run out of slots.
+    uint64_t state = 9;
+    int64_t now_ms = T0;
+    uint64_t admitted = 0;
+    const size_t total = 200000;
+    for (size_t i = 0; i < total; i++) {
+        fixture_notice_t n;
+        fixture_notice(&state, &now_ms, &n);
+        char message[64];
+        const char *m = n.data_json;
+        if (fixture_rand(&state) % 4 != 0) {
+            snprintf(message, sizeof(message), "storm %u attempt %zu", (unsigned)(fixture_rand(&state) % 12), i);
+            m = message;
+        }
+        int rc = notice_limiter_admit(l, n.notice_type, m, strlen(m), n.timestamp, strlen(n.timestamp));
+        CHECK(rc == 0 || rc == 1);
+        admitted += (uint64_t)rc;
+        if (i % 1000 == 0) {
+            CHECK(notice_limiter_poll(l, now_ms) == 0);
+        }
+    }
+    CHECK(notice_limiter_flush(l) == 0);
+
+    notice_limit_stats_t stats;
+    notice_limiter_stats(l, &stats);
+    CHECK_EQ_INT(stats.admitted, admitted);
+    CHECK_EQ_INT(stats.suppressed, c.suppressed);
+    CHECK_EQ_INT(stats.summaries, c.summaries);
+    CHECK_EQ_INT(admitted + c.suppressed, total);
+    CHECK(c.suppressed > 0);
+    CHECK(stats.untracked > 0);
+    notice_limiter_free(l);
+}
+
+static void test_format_json(void) {
+    const char sample[] = "say \"hi\"\n\xc3\xa9\xe2\x82";
+    notice_limit_summary_t s = { "tunnel-core", sample, sizeof(sample) - 1, 1, T0, T0 + 1, -300 };
+    char json[512];
+    long n = notice_limit_format_json(&s, json, sizeof(json));
+    CHECK(n > 0);
+    json[n] = '\0';
+
+    // Escaped, and without the multibyte character cut short by the sample's truncation.
+    CHECK(strcmp(json, "{\"data\":{\"message\":\"suppressed 1 similar message\",\"count\":1,"
+                       "\"first\":\"2018-09-19T05:00:00.000-05:00\",\"last\":\"2018-09-19T05:00:00.001-05:00\","
+                       "\"sample\":\"say \\\"hi\\\"\\u000a\xc3\xa9\"},\"noticeType\":\"tunnel-core\","
+                       "\"showUser\":false,\"timestamp\":\"2018-09-19T05:00:00.001-05:00\"}") == 0);
+    CHECK_EQ_INT(notice_limit_format_json(&s, json, (size_t)n - 1), -1);
+}
+
+static void test_invalid_arguments(void) {
+    collect_t c = {0};
+    notice_limit_rule_t rule = { 1, 1, 0, 0 };
+    notice_limit_rule_t no_burst = { 1, 0, 0, 0 };
+    CHECK(notice_limiter_new(NOTICE_LIMIT_PROBE - 1, &rule, collect, &c) == NULL);
+    CHECK(notice_limiter_new(16, &no_burst, collect, &c) == NULL);
+    CHECK(notice_limiter_new(16, &rule, NULL, &c) == NULL);
+
+    notice_limiter_t *l = notice_limiter_new(16, &rule, collect, &c);
+    CHECK_EQ_INT(notice_limiter_admit(l, "Info", "x", 1, "yesterday", 9), -1);
+    for (int i = 0; i < NOTICE_LIMIT_MAX_RULES; i++) {
+        char type[16];
+        snprintf(type, sizeof(type), "type%d", i);
+        CHECK(notice_limiter_set_rule(l, type, &rule) == 0);
+    }
+    CHECK(notice_limiter_set_rule(l, "one-too-many", &rule) == -1);
+    CHECK(notice_limiter_set_rule(l, "type0", &rule) == 0);
+    notice_limiter_free(l);
+}
+
+int main(void) {
+    RUN_TEST(test_burst_then_suppression);
+    RUN_TEST(test_summary_precedes_next_notice);
+    RUN_TEST(test_rules_per_notice_type);
+    RUN_TEST(test_rule_change_applies_to_buckets_in_use);
+    RUN_TEST(test_periodic_summaries_during_storm);
+    RUN_TEST(test_counts_preserved_on_fixture_stream);
+    RUN_TEST(test_format_json);
+    RUN_TEST(test_invalid_arguments);
+    return 0;
+}
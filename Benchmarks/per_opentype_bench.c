@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Decoding OCTET STRINGs nested in two and three PER open types, from 1 KB to 1 MB: views of the
+ * enclosing stream against the copy into a reassembly buffer per level that uper_open_type_get
+ * made before.
+ */
+
+#include "OCTET_STRING.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "per_decoder.h"
+#include "per_encoder.h"
+#include "per_opentype.h"
+#include <string.h>
+
+#define DEPTH 3
+
+static asn_TYPE_descriptor_t levels[DEPTH + 1];
+static asn_TYPE_descriptor_t copy_levels[DEPTH + 1];
+
+// Bytes copied into reassembly buffers by the baseline.
+static size_t copied;
+
+// The open type decoding uper_open_type_get did before: reassemble the fragments, then decode the copy.
+static asn_dec_rval_t copy_open_type_get(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td, void **sptr,
+                                         asn_per_data_t *pd) {
+    asn_dec_rval_t rv = { RC_FAIL, 0 };
+    uint8_t *buf = NULL;
+    size_t buf_len = 0, buf_size = 0;
+    int repeat;
+
+    do {
+        ssize_t chunk_bytes = uper_get_length(pd, -1, &repeat);
+        if (chunk_bytes < 0) {
+            goto fail;
+        }
+        if (buf_len + chunk_bytes > buf_size) {
+            buf_size = chunk_bytes + (buf_size << 2);
+            void *p = realloc(buf, buf_size);
+            if (p == NULL) {
+                goto fail;
+            }
+            buf = p;
+        }
+        if (per_get_many_bits(pd, buf + buf_len, 0, chunk_bytes << 3)) {
+            goto fail;
+        }
+        buf_len += chunk_bytes;
+    } while (repeat);
+    copied += buf_len;
+
+    asn_per_data_t spd = { buf, 0, buf_len << 3, 0, 0, 0 };
+    rv = td->uper_decoder(ctx, td, 0, sptr, &spd);
+    if (rv.code == RC_OK && spd.nbits - spd.nboff >= 8) {
+        rv.code = RC_FAIL;
+    }
+
+fail:
+    free(buf);
+    return rv;
+}
+
+static asn_dec_rval_t nested_decode(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
+                                    asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd) {
+    return uper_open_type_get(ctx, td - 1, 0, sptr, pd);
+}
+
+static asn_dec_rval_t copy_nested_decode(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
+                                         asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd) {
+    return copy_open_type_get(ctx, td - 1, sptr, pd);
+}
+
+static asn_enc_rval_t nested_encode(asn_TYPE_descriptor_t *td, asn_per_constraints_t *constraints, void *sptr,
+                                    asn_per_outp_t *po) {
+    asn_enc_rval_t er = { 0, td, sptr };
+    if (uper_open_type_put(td - 1, 0, sptr, po) != 0) {
+        er.encoded = -1;
+    }
+    return er;
+}
+
+static volatile size_t sink;
+
+static void bench_decode(const char *name, asn_TYPE_descriptor_t *td, const uint8_t *buffer, size_t len,
+                         int rounds) {
+    uint64_t start = bench_now_ns();
+    for (int round = 0; round < rounds; round++) {
+        OCTET_STRING_t *decoded = NULL;
+        asn_dec_rval_t rv = uper_decode_complete(0, td, (void **)&decoded, buffer, len);
+        if (rv.code != RC_OK) {
+            fprintf(stderr, "%s: decode failed\n", name);
+            exit(1);
+        }
+        sink += decoded->size;
+        ASN_STRUCT_FREE(asn_DEF_OCTET_STRING, decoded);
+    }
+    bench_report(name, rounds, bench_now_ns() - start, (uint64_t)len * rounds);
+}
+
+int main(void) {
+    static const size_t sizes[] = { 1024, 16 * 1024, 64 * 1024, 1024 * 1024 };
+    levels[0] = copy_levels[0] = asn_DEF_OCTET_STRING;
+    for (int i = 1; i <= DEPTH; i++) {
+        levels[i] = copy_levels[i] = asn_DEF_OCTET_STRING;
+        levels[i].uper_decoder = nested_decode;
+        levels[i].uper_encoder = copy_levels[i].uper_encoder = nested_encode;
+        copy_levels[i].uper_decoder = copy_nested_decode;
+    }
+
+    uint64_t state = 62;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint8_t *octets = malloc(sizes[s]);
+        for (size_t i = 0; i < sizes[s]; i++) {
+            octets[i] = (uint8_t)fixture_rand(&state);
+        }
+        OCTET_STRING_t value = { 0 };
+        OCTET_STRING_fromBuf(&value, (const char *)octets, (int)sizes[s]);
+        int rounds = (int)(64 * 1024 * 1024 / sizes[s] / 16) + 1;
+
+        for (int depth = 2; depth <= DEPTH; depth++) {
+            void *buffer;
+            ssize_t len = uper_encode_to_new_buffer(&levels[depth], 0, &value, &buffer);
+            char name[64];
+
+            snprintf(name, sizeof(name), "per/open_type/depth%d/%zuKB/copy_baseline", depth, sizes[s] / 1024);
+            copied = 0;
+            bench_decode(name, &copy_levels[depth], buffer, len, rounds);
+            snprintf(name, sizeof(name), "per/open_type/depth%d/%zuKB/copied", depth, sizes[s] / 1024);
+            bench_counter(name, (double)copied / rounds / len, "x input");
+
+            snprintf(name, sizeof(name), "per/open_type/depth%d/%zuKB", depth, sizes[s] / 1024);
+            bench_decode(name, &levels[depth], buffer, len, rounds);
+            free(buffer);
+        }
+
+        ASN_STRUCT_FREE_CONTENTS_ONLY(asn_DEF_OCTET_STRING, &value);
+        free(octets);
+    }
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * PER open types decoded through views of the enclosing stream: nested and fragmented open types,
+ * the enclosing stream's position afterwards, skipping, and malformed padding and lengths. Also
+ * failed writes when encoding.
+ */
+
+#include "OCTET_STRING.h"
+#include "check.h"
+#include "fixtures.h"
+#include "per_decoder.h"
+#include "per_encoder.h"
+#include "per_opentype.h"
+#include <string.h>
+
+#define DEPTH 4
+
+/*
+ * levels[0] is an OCTET STRING, and levels[i] is levels[i - 1] wrapped in an open type. Every
+ * level decodes to the same OCTET_STRING_t.
+ */
+static asn_TYPE_descriptor_t levels[DEPTH + 1];
+
+static asn_dec_rval_t nested_decode(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
+                                    asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd) {
+    return uper_open_type_get(ctx, td - 1, 0, sptr, pd);
+}
+
+static asn_enc_rval_t nested_encode(asn_TYPE_descriptor_t *td, asn_per_constraints_t *constraints, void *sptr,
+                                    asn_per_outp_t *po) {
+    asn_enc_rval_t er = { 0, td, sptr };
+    if (uper_open_type_put(td - 1, 0, sptr, po) != 0) {
+        er.encoded = -1;
+    }
+    return er;
+}
+
+static void init_levels(void) {
+    levels[0] = asn_DEF_OCTET_STRING;
+    for (int i = 1; i <= DEPTH; i++) {
+        levels[i] = asn_DEF_OCTET_STRING;
+        levels[i].uper_decoder = nested_decode;
+        levels[i].uper_encoder = nested_encode;
+    }
+}
+
+// Encodes size random octets at a nesting depth. Caller must free.
+static uint8_t * encode(int depth, size_t size, OCTET_STRING_t *value, size_t *len) {
+    uint64_t state = 62 + size;
+    uint8_t *octets = malloc(size + 1);
+    for (size_t i = 0; i < size; i++) {
+        octets[i] = (uint8_t)fixture_rand(&state);
+    }
+    memset(value, 0, sizeof(*value));
+    CHECK_EQ_INT(OCTET_STRING_fromBuf(value, (const char *)octets, (int)size), 0);
+    free(octets);
+
+    void *buffer;
+    ssize_t n = uper_encode_to_new_buffer(&levels[depth], 0, value, &buffer);
+    CHECK(n > 0);
+    *len = (size_t)n;
+    return buffer;
+}
+
+static void test_roundtrip(void) {
+    static const size_t sizes[] = { 0, 1, 100, 16383, 16384, 16385, 32768, 65536, 65537, 200000 };
+    for (int depth = 0; depth <= DEPTH; depth++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            OCTET_STRING_t value;
+            size_t len;
+            uint8_t *buffer = encode(depth, sizes[s], &value, &len);
+
+            OCTET_STRING_t *decoded = NULL;
+            asn_dec_rval_t rv = uper_decode_complete(0, &levels[depth], (void **)&decoded, buffer, len);
+            CHECK(rv.code == RC_OK);
+            CHECK_EQ_INT(rv.consumed, len);
+            CHECK_EQ_INT(decoded->size, value.size);
+            CHECK(memcmp(decoded->buf, value.buf, value.size) == 0);
+
+            ASN_STRUCT_FREE(asn_DEF_OCTET_STRING, decoded);
+            ASN_STRUCT_FREE_CONTENTS_ONLY(asn_DEF_OCTET_STRING, &value);
+            free(buffer);
+        }
+    }
+}
+
+// The enclosing stream continues right after the open type, whether it was decoded or skipped.
+static void test_stream_position(void) {
+    static const size_t sizes[] = { 10, 16384, 70000 };
+    for (int depth = 1; depth <= DEPTH; depth++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            OCTET_STRING_t value;
+            size_t len;
+            uint8_t *buffer = encode(depth, sizes[s], &value, &len);
+
+            // The open type, then a marker octet.
+            size_t stream_len = len + 1;
+            uint8_t *stream = malloc(stream_len);
+            memcpy(stream, buffer, len);
+            stream[len] = 0xa5;
+
+            for (int skip = 0; skip < 2; skip++) {
+                asn_per_data_t pd = { stream, 0, stream_len * 8, 0, 0, 0 };
+                if (skip) {
+                    CHECK_EQ_INT(uper_open_type_skip(0, &pd), 0);
+                } else {
+                    OCTET_STRING_t *decoded = NULL;
+                    asn_dec_rval_t rv = uper_open_type_get(0, &levels[depth - 1], 0, (void **)&decoded, &pd);
+                    CHECK(rv.code == RC_OK);
+                    CHECK_EQ_INT(decoded->size, value.size);
+                    CHECK(memcmp(decoded->buf, value.buf, value.size) == 0);
+                    ASN_STRUCT_FREE(asn_DEF_OCTET_STRING, decoded);
+                }
+                CHECK_EQ_INT(pd.moved, (stream_len - 1) * 8);
+                CHECK_EQ_INT(per_get_few_bits(&pd, 8), 0xa5);
+                CHECK_EQ_INT(per_get_few_bits(&pd, 1), -1);
+            }
+
+            ASN_STRUCT_FREE_CONTENTS_ONLY(asn_DEF_OCTET_STRING, &value);
+            free(buffer);
+            free(stream);
+        }
+    }
+}
+
+// Decodes three bits, for padding checks.
+static asn_dec_rval_t three_bits_decode(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
+                                        asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd) {
+    asn_dec_rval_t rv = { RC_OK, 0 };
+    if (per_get_few_bits(pd, 3) < 0) {
+        rv.code = RC_WMORE;
+    }
+    return rv;
+}
+
+static void test_padding(void) {
+    asn_TYPE_descriptor_t three_bits = { .name = "three_bits", .uper_decoder = three_bits_decode };
+    static const struct {
+        uint8_t octets[3];
+        size_t len;
+        int ok;
+    } cases[] = {
+        { { 0x01, 0xa0 }, 2, 1 },           // 101 00000
+        { { 0x01, 0xa1 }, 2, 0 },           // Non-zero padding.
+        { { 0x02, 0xa0, 0x00 }, 3, 0 },     // Padding longer than 7 bits.
+        { { 0x02, 0xa0 }, 2, 0 },           // Truncated.
+        { { 0x00 }, 1, 0 },                 // Empty.
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        asn_per_data_t pd = { cases[i].octets, 0, cases[i].len * 8, 0, 0, 0 };
+        asn_dec_rval_t rv = uper_open_type_get(0, &three_bits, 0, 0, &pd);
+        CHECK_EQ_INT(rv.code == RC_OK, cases[i].ok);
+        if (cases[i].ok) {
+            CHECK_EQ_INT(pd.moved, cases[i].len * 8);
+        }
+    }
+}
+
+static void test_malformed(void) {
+    OCTET_STRING_t value;
+    size_t len;
+    uint8_t *buffer = encode(2, 3, &value, &len);
+    OCTET_STRING_t *decoded = NULL;
+
+    // Truncated: the outer length promises more than there is.
+    for (size_t cut = 1; cut < len; cut++) {
+        asn_dec_rval_t rv = uper_decode_complete(0, &levels[2], (void **)&decoded, buffer, cut);
+        CHECK(rv.code != RC_OK);
+        ASN_STRUCT_FREE(asn_DEF_OCTET_STRING, decoded);
+        decoded = NULL;
+    }
+
+    // A whole octet of padding: the outer open type is one octet longer than its contents.
+    uint8_t *padded = malloc(len + 1);
+    padded[0] = buffer[0] + 1;
+    memcpy(padded + 1, buffer + 1, len - 1);
+    padded[len] = 0;
+    asn_dec_rval_t rv = uper_decode_complete(0, &levels[2], (void **)&decoded, padded, len + 1);
+    CHECK(rv.code != RC_OK);
+    ASN_STRUCT_FREE(asn_DEF_OCTET_STRING, decoded);
+
+    ASN_STRUCT_FREE_CONTENTS_ONLY(asn_DEF_OCTET_STRING, &value);
+    free(padded);
+    free(buffer);
+}
+
+typedef struct {
+    int calls;
+    int fail_call;
+} flaky_output_t;
+
+// Fails once, on the fail_call'th write.
+static int flaky_output(const void *data, size_t size, void *key) {
+    flaky_output_t *out = key;
+    return (out->calls++ == out->fail_call) ? -1 : 0;
+}
+
+// Puts the open type after a prefix of bits, failing the fail_call'th write. Returns the number of writes.
+static int put_after_prefix(int prefix, OCTET_STRING_t *value, int fail_call, int *rc) {
+    flaky_output_t out = { 0, fail_call };
+    asn_per_outp_t po = { 0 };
+    po.buffer = po.tmpspace;
+    po.nbits = 8 * sizeof(po.tmpspace);
+    po.outper = flaky_output;
+    po.op_key = &out;
+    for (int i = 0; i < prefix; i++) {
+        CHECK_EQ_INT(per_put_few_bits(&po, 0, 1), 0);
+    }
+    *rc = uper_open_type_put(&asn_DEF_OCTET_STRING, 0, value, &po);
+    return out.calls;
+}
+
+// A failed write is reported, never followed by more output. The open type's contents are exactly
+// 16K, so it ends with an empty fragment, whose length is written last: depending on the prefix,
+// the last write is of that length.
+static void test_write_failure(void) {
+    OCTET_STRING_t value;
+    size_t len;
+    uint8_t *buffer = encode(1, 16382, &value, &len);
+    CHECK_EQ_INT(len, 1 + 16384 + 1);
+
+    for (int prefix = 0; prefix < 8 * 32; prefix++) {
+        int rc;
+        int calls = put_after_prefix(prefix, &value, -1, &rc);
+        CHECK_EQ_INT(rc, 0);
+        if (calls > 0) {
+            put_after_prefix(prefix, &value, calls - 1, &rc);
+            CHECK_EQ_INT(rc, -1);
+        }
+    }
+
+    ASN_STRUCT_FREE_CONTENTS_ONLY(asn_DEF_OCTET_STRING, &value);
+    free(buffer);
+}
+
+int main(void) {
+    init_levels();
+    RUN_TEST(test_roundtrip);
+    RUN_TEST(test_stream_position);
+    RUN_TEST(test_padding);
+    RUN_TEST(test_malformed);
+    RUN_TEST(test_write_failure);
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Purchase index operations with 100k synthetic purchases, against the array approach of
+ * PsiCashClient: linear scans for the next expiring purchase and expiration, and a filtered
+ * copy of the purchases for the active set.
+ */
+
+#include "PurchaseIndex.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define PURCHASES 100000
+#define MARKED 1000
+#define QUERIES 1000
+
+typedef struct {
+    char id[40];
+    char authorization_id[48];
+    const char *transaction_class;
+    int64_t expiry_ms;
+    int marked_expired;
+} synthetic_t;
+
+static synthetic_t purchases[PURCHASES];
+static const char *marked_ids[MARKED];
+
+static uint64_t sink;
+
+static void count_visit(void *ctx, const purchase_t *p) {
+    sink += (uint64_t)p->expiry_ms;
+}
+
+/*** Array baseline ***/
+
+static int64_t array_next_expiring(const synthetic_t *a, size_t n) {
+    int64_t best = PURCHASE_INDEX_NO_EXPIRY;
+    for (size_t i = 0; i < n; i++) {
+        if (a[i].expiry_ms < best) {
+            best = a[i].expiry_ms;
+        }
+    }
+    return best;
+}
+
+static size_t array_active(const synthetic_t *a, size_t n, int64_t now_ms, synthetic_t **out) {
+    // Filtered copy, like filterUsingPredicate: on a copy of validPurchases.
+    synthetic_t *copy = malloc(n * sizeof(synthetic_t));
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!a[i].marked_expired && a[i].expiry_ms > now_ms && strcmp(a[i].transaction_class, "speed-boost") == 0) {
+            copy[count++] = a[i];
+        }
+    }
+    *out = copy;
+    return count;
+}
+
+static size_t array_expire(synthetic_t *a, size_t n, int64_t now_ms) {
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (a[i].expiry_ms > now_ms) {
+            a[kept++] = a[i];
+        }
+    }
+    return kept;
+}
+
+int main(void) {
+    uint64_t state = 9;
+    const int64_t now_ms = INT64_C(1537351200000);
+    for (int i = 0; i < PURCHASES; i++) {
+        snprintf(purchases[i].id, sizeof(purchases[i].id), "%016" PRIx64 "-purchase", fixture_rand(&state));
+        snprintf(purchases[i].authorization_id, sizeof(purchases[i].authorization_id), "%016" PRIx64 "%016" PRIx64,
+                 fixture_rand(&state), fixture_rand(&state));
+        purchases[i].transaction_class = i % 10 == 0 ? "other" : "speed-boost";
+        purchases[i].expiry_ms = now_ms + (int64_t)(fixture_rand(&state) % (7 * 24 * 3600 * 1000ULL));
+    }
+    for (int i = 0; i < MARKED; i++) {
+        marked_ids[i] = purchases[(i * 97) % PURCHASES].authorization_id;
+    }
+
+    purchase_index_t *idx = purchase_index_new();
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < PURCHASES; i++) {
+        purchase_t p = { purchases[i].id, purchases[i].transaction_class, purchases[i].authorization_id,
+                         purchases[i].expiry_ms, 0 };
+        purchase_index_put(idx, &p);
+    }
+    bench_report("purchase_index/put", PURCHASES, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < PURCHASES; i++) {
+        purchase_t p;
+        sink += (uint64_t)purchase_index_get(idx, purchases[(i * 7919) % PURCHASES].id, &p);
+    }
+    bench_report("purchase_index/get", PURCHASES, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < QUERIES; i++) {
+        purchase_t p;
+        purchase_index_next_expiring(idx, &p);
+        sink += (uint64_t)p.expiry_ms;
+    }
+    bench_report("purchase_index/next_expiring", QUERIES, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < QUERIES; i++) {
+        sink += array_next_expiring(purchases, PURCHASES);
+    }
+    bench_report("purchase_index/next_expiring/array_baseline", QUERIES, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    purchase_index_mark_authorizations_expired(idx, marked_ids, MARKED);
+    bench_report("purchase_index/mark_1000_authorizations", 1, bench_now_ns() - start, 0);
+    for (int i = 0; i < MARKED; i++) {
+        purchases[(i * 97) % PURCHASES].marked_expired = 1;
+    }
+
+    const int active_runs = 20;
+    start = bench_now_ns();
+    for (int i = 0; i < active_runs; i++) {
+        purchase_index_each_active(idx, now_ms + 3600 * 1000, "speed-boost", count_visit, NULL);
+    }
+    bench_report("purchase_index/each_active", active_runs, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < active_runs; i++) {
+        synthetic_t *active;
+        sink += array_active(purchases, PURCHASES, now_ms + 3600 * 1000, &active);
+        free(active);
+    }
+    bench_report("purchase_index/each_active/array_baseline", active_runs, bench_now_ns() - start, 0);
+
+    size_t len;
+    start = bench_now_ns();
+    uint8_t *buf = purchase_index_serialize(idx, &len);
+    bench_report("purchase_index/serialize", 1, bench_now_ns() - start, len);
+    start = bench_now_ns();
+    purchase_index_t *copy = purchase_index_deserialize(buf, len);
+    bench_report("purchase_index/deserialize", 1, bench_now_ns() - start, len);
+    bench_counter("purchase_index/serialized_size", (double)len / 1024.0, "KB");
+    free(buf);
+    purchase_index_free(copy);
+
+    start = bench_now_ns();
+    purchase_index_remove_marked(idx, NULL, NULL);
+    bench_report("purchase_index/remove_marked", 1, bench_now_ns() - start, 0);
+
+    // Expiry checks once a minute for the first hour, each removing a handful of purchases,
+    // then a day's worth of purchases at a time for the rest of the week.
+    size_t remaining = PURCHASES;
+    uint64_t index_ns = 0, array_ns = 0;
+    for (int minute = 1; minute <= 60; minute++) {
+        int64_t t = now_ms + (int64_t)minute * 60 * 1000;
+        start = bench_now_ns();
+        purchase_index_expire(idx, t, NULL, NULL);
+        index_ns += bench_now_ns() - start;
+        start = bench_now_ns();
+        remaining = array_expire(purchases, remaining, t);
+        array_ns += bench_now_ns() - start;
+    }
+    bench_report("purchase_index/expire_minutely", 60, index_ns, 0);
+    bench_report("purchase_index/expire_minutely/array_baseline", 60, array_ns, 0);
+
+    index_ns = array_ns = 0;
+    for (int day = 1; day <= 7; day++) {
+        int64_t t = now_ms + (int64_t)day * 24 * 3600 * 1000;
+        start = bench_now_ns();
+        purchase_index_expire(idx, t, NULL, NULL);
+        index_ns += bench_now_ns() - start;
+        start = bench_now_ns();
+        remaining = array_expire(purchases, remaining, t);
+        array_ns += bench_now_ns() - start;
+    }
+    bench_report("purchase_index/expire_daily", 7, index_ns, 0);
+    bench_report("purchase_index/expire_daily/array_baseline", 7, array_ns, 0);
+
+    purchase_index_free(idx);
+    return sink == 42 ? 1 : 0;
+}
@@ -0,0 +1,251 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "PurchaseIndex.h"
+#include "check.h"
+#include "fixtures.h"
+#include <stdio.h>
+#include <string.h>
+
+#define ID_POOL 600
+#define OPERATIONS 200000
+
+/*** Naive reference ***/
+
+typedef struct {
+    int used;
+    char id[16];
+    char transaction_class[16];
+    char authorization_id[16];
+    int64_t expiry_ms;
+    int marked_expired;
+} ref_t;
+
+static ref_t ref[ID_POOL];
+
+static int ref_count(void) {
+    int n = 0;
+    for (int i = 0; i < ID_POOL; i++) {
+        n += ref[i].used;
+    }
+    return n;
+}
+
+/*** Collecting visited IDs ***/
+
+typedef struct {
+    int seen[ID_POOL];
+    int count;
+    int ordered;            // Whether visits must be in expiry order.
+    int64_t last_expiry;
+} visited_t;
+
+static int id_number(const char *id) {
+    int n;
+    CHECK(sscanf(id, "purchase-%d", &n) == 1 && n >= 0 && n < ID_POOL);
+    return n;
+}
+
+static void visit(void *ctx, const purchase_t *p) {
+    visited_t *v = ctx;
+    int n = id_number(p->id);
+    CHECK(!v->seen[n]);
+    v->seen[n] = 1;
+    v->count++;
+    CHECK(!v->ordered || p->expiry_ms >= v->last_expiry);
+    v->last_expiry = p->expiry_ms;
+}
+
+static void check_matches_reference(const purchase_index_t *idx, int64_t now_ms) {
+    CHECK_EQ_INT(purchase_index_count(idx), ref_count());
+
+    for (int i = 0; i < ID_POOL; i++) {
+        char id[32];
+        snprintf(id, sizeof(id), "purchase-%d", i);
+        purchase_t p;
+        int found = purchase_index_get(idx, id, &p) == 0;
+        CHECK_EQ_INT(found, ref[i].used);
+        if (found) {
+            CHECK(strcmp(p.transaction_class, ref[i].transaction_class) == 0);
+            CHECK(strcmp(p.authorization_id, ref[i].authorization_id) == 0);
+            CHECK_EQ_INT(p.expiry_ms, ref[i].expiry_ms);
+            CHECK_EQ_INT(p.marked_expired, ref[i].marked_expired);
+        }
+    }
+
+    // Next expiring: the earliest expiry, among purchases that expire.
+    int64_t earliest = PURCHASE_INDEX_NO_EXPIRY;
+    for (int i = 0; i < ID_POOL; i++) {
+        if (ref[i].used && ref[i].expiry_ms < earliest) {
+            earliest = ref[i].expiry_ms;
+        }
+    }
+    purchase_t next;
+    if (earliest == PURCHASE_INDEX_NO_EXPIRY) {
+        CHECK(purchase_index_next_expiring(idx, &next) != 0);
+    } else {
+        CHECK(purchase_index_next_expiring(idx, &next) == 0);
+        CHECK_EQ_INT(next.expiry_ms, earliest);
+        CHECK_EQ_INT(ref[id_number(next.id)].expiry_ms, earliest);
+    }
+
+    // Active speed-boost purchases.
+    visited_t v = { { 0 }, 0, 0, INT64_MIN };
+    purchase_index_each_active(idx, now_ms, "speed-boost", visit, &v);
+    int expected = 0;
+    for (int i = 0; i < ID_POOL; i++) {
+        int active = ref[i].used && !ref[i].marked_expired && ref[i].authorization_id[0] != '\0' &&
+                     ref[i].expiry_ms > now_ms && strcmp(ref[i].transaction_class, "speed-boost") == 0;
+        CHECK_EQ_INT(v.seen[i], active);
+        expected += active;
+    }
+    CHECK_EQ_INT(v.count, expected);
+}
+
+static void test_randomized_against_reference(void) {
+    purchase_index_t *idx = purchase_index_new();
+    uint64_t state = 42;
+    int64_t now_ms = 1000000;
+    memset(ref, 0, sizeof(ref));
+
+    for (int op = 0; op < OPERATIONS; op++) {
+        uint64_t r = fixture_rand(&state);
+        int n = (int)(fixture_rand(&state) % ID_POOL);
+        char id[32], auth[32];
+        snprintf(id, sizeof(id), "purchase-%d", n);
+
+        switch (r % 16) {
+            case 0: case 1: case 2: case 3: case 4: case 5: {
+                // Authorization IDs are shared by a few purchases now and then.
+                if ((r >> 8) % 8 == 0) {
+                    auth[0] = '\0';
+                } else {
+                    snprintf(auth, sizeof(auth), "auth-%d", (int)((r >> 12) % (ID_POOL + 20)));
+                }
+                const char *transaction_class = (r >> 24) % 4 == 0 ? "other" : "speed-boost";
+                int64_t expiry = (r >> 28) % 10 == 0 ? PURCHASE_INDEX_NO_EXPIRY
+                                                     : now_ms + (int64_t)((r >> 32) % 100000) - 1000;
+                purchase_t p = { id, transaction_class, auth, expiry, 0 };
+                CHECK_EQ_INT(purchase_index_put(idx, &p), 0);
+
+                int keep_mark = ref[n].used && strcmp(ref[n].authorization_id, auth) == 0 && ref[n].marked_expired;
+                ref[n].used = 1;
+                strcpy(ref[n].transaction_class, transaction_class);
+                strcpy(ref[n].authorization_id, auth);
+                ref[n].expiry_ms = expiry;
+                ref[n].marked_expired = keep_mark;
+                break;
+            }
+            case 6: case 7:
+                CHECK_EQ_INT(purchase_index_remove(idx, id), ref[n].used ? 0 : -1);
+                ref[n].used = 0;
+                break;
+            case 8: case 9: {
+                now_ms += (int64_t)((r >> 8) % 5000);
+                // Expiration visits in expiry order.
+                visited_t v = { { 0 }, 0, 1, INT64_MIN };
+                size_t removed = purchase_index_expire(idx, now_ms, visit, &v);
+                CHECK_EQ_INT(removed, v.count);
+                for (int i = 0; i < ID_POOL; i++) {
+                    int expired = ref[i].used && ref[i].expiry_ms <= now_ms;
+                    CHECK_EQ_INT(v.seen[i], expired);
+                    if (expired) {
+                        ref[i].used = 0;
+                    }
+                }
+                break;
+            }
+            case 10: case 11: {
+                char ids[4][32];
+                const char *ptrs[4];
+                for (int k = 0; k < 4; k++) {
+                    snprintf(ids[k], sizeof(ids[k]), "auth-%d", (int)(fixture_rand(&state) % (ID_POOL + 20)));
+                    ptrs[k] = ids[k];
+                }
+                size_t marked = purchase_index_mark_authorizations_expired(idx, ptrs, 4);
+                size_t expected = 0;
+                for (int i = 0; i < ID_POOL; i++) {
+                    for (int k = 0; k < 4; k++) {
+                        if (ref[i].used && !ref[i].marked_expired && strcmp(ref[i].authorization_id, ids[k]) == 0) {
+                            ref[i].marked_expired = 1;
+                            expected++;
+                        }
+                    }
+                }
+                CHECK_EQ_INT(marked, expected);
+                break;
+            }
+            case 12: {
+                size_t removed = purchase_index_remove_marked(idx, NULL, NULL);
+                size_t expected = 0;
+                for (int i = 0; i < ID_POOL; i++) {
+                    if (ref[i].used && ref[i].marked_expired) {
+                        ref[i].used = 0;
+                        expected++;
+                    }
+                }
+                CHECK_EQ_INT(removed, expected);
+                break;
+            }
+            case 13: {
+                size_t len;
+                uint8_t *buf = purchase_index_serialize(idx, &len);
+                CHECK(buf != NULL);
+                purchase_index_t *copy = purchase_index_deserialize(buf, len);
+                CHECK(copy != NULL);
+                // Truncated and corrupted data is rejected.
+                CHECK(purchase_index_deserialize(buf, len - 1) == NULL || len == 12);
+                free(buf);
+                purchase_index_free(idx);
+                idx = copy;
+                break;
+            }
+            default:
+                break;
+        }
+
+        if (op % 997 == 0) {
+            check_matches_reference(idx, now_ms);
+        }
+    }
+    check_matches_reference(idx, now_ms);
+    purchase_index_free(idx);
+}
+
+static void test_rejects_long_strings(void) {
+    purchase_index_t *idx = purchase_index_new();
+    char long_id[PURCHASE_INDEX_MAX_ID + 2];
+    memset(long_id, 'x', sizeof(long_id) - 1);
+    long_id[sizeof(long_id) - 1] = '\0';
+    purchase_t p = { long_id, "speed-boost", "auth", 10, 0 };
+    CHECK_EQ_INT(purchase_index_put(idx, &p), -1);
+    p.id = "ok";
+    p.authorization_id = NULL;
+    CHECK_EQ_INT(purchase_index_put(idx, &p), 0);
+    purchase_t got;
+    CHECK_EQ_INT(purchase_index_get(idx, "ok", &got), 0);
+    CHECK(strcmp(got.authorization_id, "") == 0);
+    purchase_index_free(idx);
+}
+
+int main(void) {
+    RUN_TEST(test_randomized_against_reference);
+    RUN_TEST(test_rejects_long_strings);
+    return 0;
+}
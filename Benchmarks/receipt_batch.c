@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "receipt_batch.h"
+#include "AppReceiptDecoder.h"
+#include "timestamp.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bytes of JSON lines each worker buffers before writing them out.
+#define OUTPUT_BUFFER 65536
+
+#define SHARE(lo, hi) (((uint64_t)(lo) << 32) | (uint32_t)(hi))
+#define SHARE_LO(s) ((uint32_t)((s) >> 32))
+#define SHARE_HI(s) ((uint32_t)(s))
+
+typedef struct batch batch_t;
+
+typedef struct {
+    // Indices [lo, hi) of the files left in the worker's share, as SHARE(lo, hi). Only the worker takes from
+    // the front, and thieves only take from the back of shares that aren't empty.
+    _Alignas(64) _Atomic uint64_t share;
+    batch_t *batch;
+    pthread_t thread;
+    int started;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    size_t files;
+    size_t failed;
+    size_t steals;
+    uint64_t bytes;
+} worker_t;
+
+struct batch {
+    const char *const *paths;
+    const receipt_batch_options_t *options;
+    FILE *out;
+    pthread_mutex_t out_mutex;
+    int out_errno;      // Set once writing to out failed. Guarded by out_mutex.
+    worker_t *workers;
+    int worker_count;
+};
+
+/*** Work stealing ***/
+
+// Takes the next file of the worker's own share. Returns 1 if index was populated, 0 if the share is empty.
+static int take(worker_t *w, uint32_t *index) {
+    uint64_t s = atomic_load_explicit(&w->share, memory_order_acquire);
+    while (SHARE_LO(s) < SHARE_HI(s)) {
+        if (atomic_compare_exchange_weak_explicit(&w->share, &s, SHARE(SHARE_LO(s) + 1, SHARE_HI(s)),
+                                                  memory_order_acq_rel, memory_order_acquire)) {
+            *index = SHARE_LO(s);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Moves the back half of the largest other share into the worker's empty share.
+// Returns 1 on success, 0 if every share is empty.
+static int steal(worker_t *w) {
+    batch_t *b = w->batch;
+    for (;;) {
+        worker_t *victim = NULL;
+        uint64_t victim_share = 0;
+        uint32_t most = 0;
+        for (int i = 0; i < b->worker_count; i++) {
+            uint64_t s = atomic_load_explicit(&b->workers[i].share, memory_order_acquire);
+            if (&b->workers[i] != w && SHARE_HI(s) - SHARE_LO(s) > most) {
+                victim = &b->workers[i];
+                victim_share = s;
+                most = SHARE_HI(s) - SHARE_LO(s);
+            }
+        }
+        if (victim == NULL) {
+            return 0;
+        }
+        uint32_t lo = SHARE_LO(victim_share), hi = SHARE_HI(victim_share), mid = lo + most / 2;
+        if (atomic_compare_exchange_strong_explicit(&victim->share, &victim_share, SHARE(lo, mid),
+                                                    memory_order_acq_rel, memory_order_acquire)) {
+            atomic_store_explicit(&w->share, SHARE(mid, hi), memory_order_release);
+            w->steals++;
+            return 1;
+        }
+        // The victim or another thief got there first: look again.
+    }
+}
+
+/*** Output ***/
+
+// Writes out the worker's buffered lines.
+static void flush(worker_t *w) {
+    batch_t *b = w->batch;
+    if (w->out_len == 0) {
+        return;
+    }
+    pthread_mutex_lock(&b->out_mutex);
+    if (b->out_errno == 0 && fwrite(w->out, 1, w->out_len, b->out) != w->out_len) {
+        b->out_errno = errno ? errno : EIO;
+    }
+    pthread_mutex_unlock(&b->out_mutex);
+    w->out_len = 0;
+}
+
+// Makes room for n more bytes of output. Returns 0 on success, -1 if allocation failed.
+static int reserve(worker_t *w, size_t n) {
+    if (w->out_len + n <= w->out_cap) {
+        return 0;
+    }
+    flush(w);
+    if (n > w->out_cap) {
+        char *p = realloc(w->out, n);
+        if (p == NULL) {
+            return -1;
+        }
+        w->out = p;
+        w->out_cap = n;
+    }
+    return 0;
+}
+
+// Appends text. Room must have been reserved.
+static void put(worker_t *w, const char *s) {
+    size_t n = strlen(s);
+    memcpy(w->out + w->out_len, s, n);
+    w->out_len += n;
+}
+
+// Appends a JSON string. Room for six bytes per character, plus the quotes, must have been reserved.
+static void put_string(worker_t *w, const char *s) {
+    static const char hex[] = "0123456789abcdef";
+    char *p = w->out + w->out_len;
+    *p++ = '"';
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+        } else if (c < 0x20) {
+            memcpy(p, "\\u00", 4);
+            p[4] = hex[c >> 4];
+            p[5] = hex[c & 0xf];
+            p += 6;
+        } else {
+            *p++ = (char)c;
+        }
+    }
+    *p++ = '"';
+    w->out_len = p - w->out;
+}
+
+// Appends a line for a file. summary is NULL if error is set.
+static int put_line(worker_t *w, const char *path, const app_receipt_summary_t *summary, const char *error) {
+    // Every string fully escaped, plus the member names, numbers and date.
+    size_t n = 6 * (strlen(path) + (error ? strlen(error) : 2 * APP_RECEIPT_SUMMARY_STRING)) + 256;
+    if (reserve(w, n) != 0) {
+        return -1;
+    }
+    put(w, "{\"file\":");
+    put_string(w, path);
+    if (error != NULL) {
+        put(w, ",\"error\":");
+        put_string(w, error);
+        put(w, "}\n");
+        return 0;
+    }
+
+    put(w, ",\"bundle_id\":");
+    put_string(w, summary->bundle_id);
+    if (summary->product_id[0] != '\0') {
+        int64_t ms = summary->latest_expiration_ms, sec = ms / 1000 - (ms % 1000 < 0);
+        timestamp_t ts = { .sec = sec, .nsec = (int32_t)(ms - sec * 1000) * 1000000, .offset = 0 };
+        char date[40];
+        timestamp_format(date, sizeof(date), &ts);
+        put(w, ",\"product_id\":");
+        put_string(w, summary->product_id);
+        put(w, ",\"expires_date\":\"");
+        put(w, date);
+        put(w, "\"");
+    } else {
+        put(w, ",\"product_id\":null,\"expires_date\":null");
+    }
+    w->out_len += snprintf(w->out + w->out_len, w->out_cap - w->out_len,
+                           ",\"iap_count\":%zu,\"cancelled_count\":%zu}\n", summary->iap_count,
+                           summary->cancelled_count);
+    return 0;
+}
+
+/*** Validation ***/
+
+// Checks the receipt, its attributes and each in-app purchase's attributes are canonical DER.
+// Returns NULL if they are, or what isn't.
+static const char * check_strict_der(const uint8_t *buf, size_t len, char *error, size_t error_len) {
+    SignedData_t *sd = NULL;
+    ReceiptAttributes_t *attrs = NULL;
+    const char *ret = NULL;
+
+    asn_dec_rval_t rval = app_receipt_decode_signed_data(buf, len, &sd, APP_RECEIPT_STRICT_DER);
+    if (rval.code != RC_OK) {
+        snprintf(error, error_len, "not canonical DER at offset %zu", rval.consumed);
+        ret = error;
+        goto done;
+    }
+    const OCTET_STRING_t *content = &sd->content.contentInfo.contentData;
+    rval = app_receipt_decode_attributes(content->buf, content->size, &attrs, APP_RECEIPT_STRICT_DER);
+    if (rval.code != RC_OK) {
+        snprintf(error, error_len, "receipt attributes not canonical DER at offset %zu", rval.consumed);
+        ret = error;
+        goto done;
+    }
+    for (int i = 0; i < attrs->list.count && ret == NULL; i++) {
+        const ReceiptAttribute_t *attr = attrs->list.array[i];
+        if (attr->type != 17) {
+            continue;
+        }
+        ReceiptAttributes_t *iap = NULL;
+        rval = app_receipt_decode_attributes(attr->value.buf, attr->value.size, &iap, APP_RECEIPT_STRICT_DER);
+        if (rval.code != RC_OK) {
+            snprintf(error, error_len, "in-app purchase not canonical DER at offset %zu", rval.consumed);
+            ret = error;
+        }
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, iap);
+    }
+
+done:
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    ASN_STRUCT_FREE(asn_DEF_SignedData, sd);
+    return ret;
+}
+
+// Validates a file and appends its line.
+static int validate(worker_t *w, const char *path) {
+    app_receipt_summary_t summary;
+    char error[128];
+    const char *failure = NULL;
+    struct stat st;
+    void *map = NULL;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (strerror_r(errno, error, sizeof(error)) != 0) {
+            snprintf(error, sizeof(error), "error %d", errno);
+        }
+        failure = error;
+    } else if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+            if (strerror_r(errno, error, sizeof(error)) != 0) {
+                snprintf(error, sizeof(error), "error %d", errno);
+            }
+            failure = error;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    if (failure == NULL) {
+        size_t len = st.st_size;
+        w->bytes += len;
+        if (app_receipt_summarize(map, len, &summary) != 0) {
+            failure = "malformed receipt";
+        } else if (w->batch->options->strict_der) {
+            failure = check_strict_der(map, len, error, sizeof(error));
+        }
+    }
+    if (map != NULL) {
+        munmap(map, st.st_size);
+    }
+
+    w->files++;
+    if (failure != NULL) {
+        w->failed++;
+    }
+    return put_line(w, path, failure ? NULL : &summary, failure);
+}
+
+static void * run_worker(void *arg) {
+    worker_t *w = arg;
+    uint32_t index;
+    for (;;) {
+        if (!take(w, &index)) {
+            // What was stolen may be stolen back before it is taken, so take again either way.
+            if (!steal(w)) {
+                break;
+            }
+            continue;
+        }
+        if (validate(w, w->batch->paths[index]) != 0) {
+            pthread_mutex_lock(&w->batch->out_mutex);
+            if (w->batch->out_errno == 0) {
+                w->batch->out_errno = ENOMEM;
+            }
+            pthread_mutex_unlock(&w->batch->out_mutex);
+        }
+    }
+    flush(w);
+    return NULL;
+}
+
+// See comment in header
+int receipt_batch_run(const char *const *paths, size_t count, const receipt_batch_options_t *options, FILE *out,
+                      receipt_batch_stats_t *stats) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    memset(stats, 0, sizeof(*stats));
+    if (count > UINT32_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int n = options->threads > 0 ? options->threads : 1;
+    batch_t b = { .paths = paths, .options = options, .out = out, .worker_count = n };
+    b.workers = calloc(n, sizeof(*b.workers));
+    if (b.workers == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&b.out_mutex, NULL);
+    for (int i = 0; i < n; i++) {
+        worker_t *w = &b.workers[i];
+        w->batch = &b;
+        w->out_cap = OUTPUT_BUFFER;
+        w->out = malloc(w->out_cap);
+        atomic_init(&w->share, SHARE(count * i / n, count * (i + 1) / n));
+        if (w->out == NULL) {
+            w->out_cap = 0;     // Allocated by reserve, or reported from there.
+        }
+    }
+
+    // The calling thread is the first worker. The shares of workers that fail to start are stolen.
+    for (int i = 1; i < n; i++) {
+        b.workers[i].started = (pthread_create(&b.workers[i].thread, NULL, run_worker, &b.workers[i]) == 0);
+    }
+    run_worker(&b.workers[0]);
+    for (int i = 0; i < n; i++) {
+        worker_t *w = &b.workers[i];
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+        }
+        stats->files += w->files;
+        stats->failed += w->failed;
+        stats->steals += w->steals;
+        stats->bytes += w->bytes;
+        free(w->out);
+    }
+    pthread_mutex_destroy(&b.out_mutex);
+    free(b.workers);
+
+    if (b.out_errno == 0 && fflush(out) != 0) {
+        b.out_errno = errno ? errno : EIO;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->elapsed_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + end.tv_nsec - start.tv_nsec;
+    if (b.out_errno != 0) {
+        errno = b.out_errno;
+        return -1;
+    }
+    return 0;
+}
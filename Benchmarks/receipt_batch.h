@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef receipt_batch_h
+#define receipt_batch_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Batch validation of receipt files, for support and QA: each file is memory-mapped and summarized with
+ * app_receipt_summarize on a pool of worker threads, and a JSON line is written per file:
+ *
+ *   {"file":"a.receipt","bundle_id":"ca.psiphon.Psiphon","product_id":"ca.psiphon.Psiphon.1.month",
+ *    "expires_date":"2018-02-01T00:00:00Z","iap_count":3,"cancelled_count":1}
+ *   {"file":"b.receipt","error":"malformed receipt"}
+ *
+ * "product_id" and "expires_date" are null when there is no subscription. Lines are written as workers
+ * finish, so they aren't in the order of the paths.
+ *
+ * Each worker starts with an equal share of the files and takes them from the front of its share. Once
+ * that is empty it steals the back half of the largest remaining share, so a few large receipts don't
+ * leave the other workers idle.
+ */
+
+/*!
+ * @brief Options of a batch.
+ */
+typedef struct {
+    int threads;        // Worker threads, at least 1.
+    int strict_der;     // Also reject receipts that aren't canonical DER, see APP_RECEIPT_STRICT_DER.
+} receipt_batch_options_t;
+
+/*!
+ * @brief Totals of a batch.
+ */
+typedef struct {
+    size_t files;
+    size_t failed;          // Files that couldn't be read or summarized.
+    uint64_t bytes;         // Bytes of the files that were read.
+    uint64_t elapsed_ns;    // Wall time of the batch.
+    size_t steals;          // Times a worker took files from another's share.
+} receipt_batch_stats_t;
+
+/*!
+ * @brief Validates and summarizes receipt files.
+ *
+ * @param out Where the JSON lines are written.
+ * @param stats Populated with the totals of the batch.
+ * Workers that can't be started leave their shares to the others, so every file is always validated.
+ *
+ * @return 0 on success, -1 if writing to out or an allocation failed (errno is set).
+ */
+int receipt_batch_run(const char *const *paths, size_t count, const receipt_batch_options_t *options, FILE *out,
+                      receipt_batch_stats_t *stats);
+
+#endif /* receipt_batch_h */
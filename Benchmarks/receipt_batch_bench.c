@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Batch validation of a synthetic corpus of 100k receipt files on 1 to N worker threads, against reading
+ * and decoding them one at a time with the generic decoders.
+ */
+
+#define _GNU_SOURCE
+#include "receipt_batch.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "receipt_reference.h"
+#include <string.h>
+
+#define RECEIPTS 100000
+
+// Distinct receipts in the corpus, each written to many files.
+#define DISTINCT 1000
+
+// Files decoded by the one-at-a-time baseline.
+#define BASELINE_RECEIPTS 10000
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+// Mostly receipts of a few purchases, and one in a hundred of a few hundred.
+static char ** write_corpus(const char *dir) {
+    uint64_t state = 66;
+    char **paths = malloc(RECEIPTS * sizeof(*paths));
+    uint8_t *receipts[DISTINCT];
+    size_t lens[DISTINCT];
+    for (int i = 0; i < DISTINCT; i++) {
+        size_t iaps = i % 100 == 0 ? 300 : fixture_rand(&state) % 10;
+        receipts[i] = fixture_receipt(&state, iaps, 1514764800000, NULL, &lens[i]);
+    }
+    for (int i = 0; i < RECEIPTS; i++) {
+        if (asprintf(&paths[i], "%s/%06d.receipt", dir, i) < 0) {
+            fail("asprintf");
+        }
+        FILE *fp = fopen(paths[i], "wb");
+        if (fp == NULL || fwrite(receipts[i % DISTINCT], 1, lens[i % DISTINCT], fp) != lens[i % DISTINCT] ||
+            fclose(fp) != 0) {
+            fail("writing corpus");
+        }
+    }
+    for (int i = 0; i < DISTINCT; i++) {
+        free(receipts[i]);
+    }
+    return paths;
+}
+
+int main(void) {
+    char *dir = fixture_tmpdir();
+    if (dir == NULL) {
+        fail("fixture_tmpdir");
+    }
+    char **paths = write_corpus(dir);
+    FILE *out = fopen("/dev/null", "w");
+    char name[96];
+
+    // Baseline: each file read and decoded in turn.
+    uint64_t bytes = 0, start = bench_now_ns();
+    for (int i = 0; i < BASELINE_RECEIPTS; i++) {
+        size_t len;
+        receipt_ref_t ref;
+        char *buf = fixture_read_file(paths[i], &len);
+        if (buf == NULL || receipt_ref_decode((const uint8_t *)buf, len, &ref) != 0) {
+            fail("baseline decode");
+        }
+        bytes += len;
+        free(buf);
+    }
+    uint64_t baseline_ns = bench_now_ns() - start;
+    bench_report("receipt_batch/one_at_a_time_baseline", BASELINE_RECEIPTS, baseline_ns, bytes);
+
+    // Powers of two up to the number of CPUs, then that number.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpus = cpus > 0 ? cpus : 1;
+    uint64_t single_ns = 0;
+    for (long threads = 1;; threads = threads * 2 < cpus ? threads * 2 : cpus) {
+        receipt_batch_options_t options = { .threads = (int)threads };
+        receipt_batch_stats_t stats;
+        if (receipt_batch_run((const char *const *)paths, RECEIPTS, &options, out, &stats) != 0 || stats.failed) {
+            fail("batch");
+        }
+        if (threads == 1) {
+            single_ns = stats.elapsed_ns;
+            bench_counter("receipt_batch/speedup_over_baseline/1_thread",
+                          ((double)baseline_ns / BASELINE_RECEIPTS) / ((double)single_ns / RECEIPTS), "x");
+        }
+        snprintf(name, sizeof(name), "receipt_batch/%d_receipts/%ld_threads", RECEIPTS, threads);
+        bench_report(name, stats.files, stats.elapsed_ns, stats.bytes);
+        snprintf(name, sizeof(name), "receipt_batch/speedup/%ld_threads", threads);
+        bench_counter(name, (double)single_ns / (double)stats.elapsed_ns, "x");
+        snprintf(name, sizeof(name), "receipt_batch/steals/%ld_threads", threads);
+        bench_counter(name, (double)stats.steals, "steals");
+        if (threads == cpus) {
+            break;
+        }
+    }
+
+    fclose(out);
+    for (int i = 0; i < RECEIPTS; i++) {
+        free(paths[i]);
+    }
+    free(paths);
+    fixture_rmdir(dir);
+    free(dir);
+    return 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Batch validation of a corpus of receipt files on different numbers of workers: every file gets exactly one
+ * line, matching the reference decoding of the file.
+ */
+
+#define _GNU_SOURCE
+#include "receipt_batch.h"
+#include "check.h"
+#include "fixtures.h"
+#include "json_reference.h"
+#include "receipt_reference.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define RECEIPTS 300
+
+static char *dir;
+static char *paths[RECEIPTS + 5];
+static size_t path_count;
+
+static char * corpus_path(const char *name) {
+    char *path;
+    CHECK(asprintf(&path, "%s/%s", dir, name) > 0);
+    paths[path_count++] = path;
+    return path;
+}
+
+static void write_file(const char *path, const uint8_t *buf, size_t len) {
+    FILE *fp = fopen(path, "wb");
+    CHECK(fp != NULL);
+    CHECK_EQ_INT(fwrite(buf, 1, len, fp), len);
+    CHECK_EQ_INT(fclose(fp), 0);
+}
+
+// Receipts of a few to a few hundred purchases, then files that can't be read, aren't receipts, or
+// aren't canonical DER.
+static void write_corpus(void) {
+    uint64_t state = 66;
+    char name[32];
+    dir = fixture_tmpdir();
+    CHECK(dir != NULL);
+    for (int i = 0; i < RECEIPTS; i++) {
+        size_t len, iaps = i % 50 == 0 ? 400 : fixture_rand(&state) % 30;
+        uint8_t *receipt = fixture_receipt(&state, iaps, 1514764800000, NULL, &len);
+        snprintf(name, sizeof(name), "r%03d.receipt", i);
+        write_file(corpus_path(name), receipt, len);
+        free(receipt);
+    }
+
+    size_t len;
+    uint8_t *receipt = fixture_receipt(&state, 3, 1514764800000, NULL, &len);
+    corpus_path("missing.receipt");
+    write_file(corpus_path("empty.receipt"), receipt, 0);
+    write_file(corpus_path("truncated \"quoted\".receipt"), receipt, len / 2);
+
+    // The outer length in three octets rather than two.
+    CHECK(receipt[1] == 0x82);
+    uint8_t *long_form = malloc(len + 1);
+    long_form[0] = 0x30;
+    long_form[1] = 0x83;
+    long_form[2] = 0;
+    memcpy(long_form + 3, receipt + 2, len - 2);
+    write_file(corpus_path("long_form.receipt"), long_form, len + 1);
+    write_file(corpus_path("valid.receipt"), receipt, len);
+    free(long_form);
+    free(receipt);
+}
+
+static const char * string_at(const json_ref_t *v, const char *path) {
+    const json_ref_t *s = json_ref_path(v, path);
+    return (s != NULL && s->type == JSON_REF_STRING) ? s->string : NULL;
+}
+
+// Checks a line against the reference decoding of its file.
+static void check_line(const json_ref_t *line, const char *path, int strict_der) {
+    size_t len = 0;
+    char *buf = fixture_read_file(path, &len);
+    receipt_ref_t ref;
+    int valid = buf != NULL && receipt_ref_decode((const uint8_t *)buf, len, &ref) == 0;
+    if (strict_der && strstr(path, "long_form") != NULL) {
+        valid = 0;
+    }
+    free(buf);
+
+    if (!valid) {
+        CHECK(string_at(line, "error") != NULL);
+        return;
+    }
+    CHECK(json_ref_path(line, "error") == NULL);
+    CHECK(strcmp(string_at(line, "bundle_id"), ref.bundle_id) == 0);
+    CHECK_EQ_INT(json_ref_path(line, "iap_count")->number, ref.iap_count);
+    CHECK_EQ_INT(json_ref_path(line, "cancelled_count")->number, ref.cancelled_count);
+    if (ref.product_id[0] == '\0') {
+        CHECK(json_ref_path(line, "product_id")->type == JSON_REF_NULL);
+        CHECK(json_ref_path(line, "expires_date")->type == JSON_REF_NULL);
+        return;
+    }
+    char expires[32];
+    time_t sec = (time_t)(ref.latest_expiration_ms / 1000);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+    strftime(expires, sizeof(expires), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    CHECK(strcmp(string_at(line, "product_id"), ref.product_id) == 0);
+    CHECK(strcmp(string_at(line, "expires_date"), expires) == 0);
+}
+
+static void run(int threads, int strict_der) {
+    char *out = NULL;
+    size_t out_len = 0;
+    FILE *fp = open_memstream(&out, &out_len);
+    CHECK(fp != NULL);
+    receipt_batch_options_t options = { .threads = threads, .strict_der = strict_der };
+    receipt_batch_stats_t stats;
+    CHECK_EQ_INT(receipt_batch_run((const char *const *)paths, path_count, &options, fp, &stats), 0);
+    CHECK_EQ_INT(fclose(fp), 0);
+
+    CHECK_EQ_INT(stats.files, path_count);
+    CHECK_EQ_INT(stats.failed, strict_der ? 4 : 3);
+    if (threads == 1) {
+        CHECK_EQ_INT(stats.steals, 0);
+    }
+
+    int seen[RECEIPTS + 5] = { 0 };
+    size_t lines = 0;
+    for (char *p = out, *nl; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+        json_ref_t *line = json_ref_parse(p, nl - p);
+        CHECK(line != NULL);
+        const char *file = string_at(line, "file");
+        CHECK(file != NULL);
+        size_t i = 0;
+        while (i < path_count && strcmp(paths[i], file) != 0) {
+            i++;
+        }
+        CHECK(i < path_count);
+        CHECK_EQ_INT(seen[i]++, 0);
+        check_line(line, paths[i], strict_der);
+        json_ref_free(line);
+        lines++;
+    }
+    CHECK_EQ_INT(lines, path_count);
+    free(out);
+}
+
+static void test_threads(void) {
+    static const int threads[] = { 1, 2, 3, 8, 64 };
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        run(threads[i], 0);
+    }
+}
+
+static void test_strict_der(void) {
+    run(1, 1);
+    run(4, 1);
+}
+
+// Fewer files than workers, and none.
+static void test_small(void) {
+    char *out = NULL;
+    size_t out_len = 0;
+    FILE *fp = open_memstream(&out, &out_len);
+    receipt_batch_options_t options = { .threads = 8 };
+    receipt_batch_stats_t stats;
+    CHECK_EQ_INT(receipt_batch_run((const char *const *)paths, 2, &options, fp, &stats), 0);
+    CHECK_EQ_INT(receipt_batch_run((const char *const *)paths, 0, &options, fp, &stats), 0);
+    CHECK_EQ_INT(stats.files, 0);
+    fclose(fp);
+    CHECK(strchr(out, '\n') != NULL && strchr(strchr(out, '\n') + 1, '\n') != NULL);
+    free(out);
+}
+
+int main(void) {
+    write_corpus();
+    RUN_TEST(test_threads);
+    RUN_TEST(test_strict_der);
+    RUN_TEST(test_small);
+    fixture_rmdir(dir);
+    for (size_t i = 0; i < path_count; i++) {
+        free(paths[i]);
+    }
+    free(dir);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * App receipt decoding with the asn1c decoders, as PsiphonAppReceipt does on launch and on every
+ * receipt refresh, for receipts with a growing number of subscription renewals.
+ */
+
+#include "bench.h"
+#include "fixtures.h"
+#include "receipt_reference.h"
+#include <string.h>
+
+// Receipts decoded per size, so that every size does a similar amount of work.
+#define TOTAL_IAPS 20000
+
+static volatile int64_t sink;
+
+int main(void) {
+    static const size_t sizes[] = { 1, 10, 100, 1000 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t state = 60;
+        size_t iaps = sizes[s], len;
+        uint8_t *receipt = fixture_receipt(&state, iaps, 1514764800000, NULL, &len);
+        uint64_t iterations = TOTAL_IAPS / iaps < 100 ? 100 : TOTAL_IAPS / iaps;
+
+        char name[96];
+        snprintf(name, sizeof(name), "receipt/size/%zu_iaps", iaps);
+        bench_counter(name, (double)len / 1024.0, "KB");
+
+        uint64_t start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            receipt_ref_t r;
+            if (receipt_ref_decode(receipt, len, &r) != 0) {
+                fprintf(stderr, "receipt decode failed\n");
+                return 1;
+            }
+            sink += r.latest_expiration_ms;
+        }
+        snprintf(name, sizeof(name), "receipt/decode/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            uint8_t *payload;
+            size_t payload_len;
+            receipt_ref_payload(receipt, len, &payload, &payload_len);
+            sink += payload_len;
+            free(payload);
+        }
+        snprintf(name, sizeof(name), "receipt/signed_data_only/%zu_iaps", iaps);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        free(receipt);
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "receipt_reference.h"
+#include "IA5String.h"
+#include "ReceiptAttributes.h"
+#include "SignedData.h"
+#include "UTF8String.h"
+#include "timestamp.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RECEIPT_TYPE_BUNDLE_ID 2
+#define RECEIPT_TYPE_IN_APP_PURCHASE 17
+#define RECEIPT_TYPE_PRODUCT_ID 1702
+#define RECEIPT_TYPE_EXPIRATION_DATE 1708
+#define RECEIPT_TYPE_CANCELLATION_DATE 1712
+
+// Decodes a string attribute value into dst. Returns 0 on success.
+static int read_string(asn_TYPE_descriptor_t *type, const OCTET_STRING_t *value, char *dst, size_t len) {
+    OCTET_STRING_t *s = NULL;
+    asn_dec_rval_t rval = ber_decode(0, type, (void **)&s, value->buf, value->size);
+    int ok = (rval.code == RC_OK && (size_t)s->size < len);
+    if (ok) {
+        memcpy(dst, s->buf, s->size);
+        dst[s->size] = '\0';
+    }
+    if (s != NULL) {
+        ASN_STRUCT_FREE(*type, s);
+    }
+    return ok ? 0 : -1;
+}
+
+// Parses a date attribute value. Returns 0 on success, -1 if it's missing or not a date, like a nil NSDate.
+static int read_date(const OCTET_STRING_t *value, int64_t *ms) {
+    char s[64];
+    timestamp_t ts;
+    if (read_string(&asn_DEF_IA5String, value, s, sizeof(s)) != 0 || timestamp_parse(s, strlen(s), &ts) != 0) {
+        return -1;
+    }
+    *ms = ts.sec * 1000 + ts.nsec / 1000000;
+    return 0;
+}
+
+static void read_in_app_purchase(const OCTET_STRING_t *value, receipt_ref_t *r) {
+    ReceiptAttributes_t *attrs = NULL;
+    asn_dec_rval_t rval = ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, value->buf, value->size);
+    if (rval.code != RC_OK) {
+        if (attrs != NULL) {
+            ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+        }
+        return;
+    }
+
+    char product_id[128] = "";
+    int64_t expiration_ms = 0, cancellation_ms;
+    int has_expiration = 0, cancelled = 0;
+    for (int i = 0; i < attrs->list.count; i++) {
+        const ReceiptAttribute_t *attr = attrs->list.array[i];
+        if (attr->value.size == 0) {
+            continue;
+        }
+        switch (attr->type) {
+            case RECEIPT_TYPE_PRODUCT_ID:
+                read_string(&asn_DEF_UTF8String, &attr->value, product_id, sizeof(product_id));
+                break;
+            case RECEIPT_TYPE_EXPIRATION_DATE:
+                has_expiration = (read_date(&attr->value, &expiration_ms) == 0);
+                break;
+            case RECEIPT_TYPE_CANCELLATION_DATE:
+                cancelled = (read_date(&attr->value, &cancellation_ms) == 0);
+                break;
+        }
+    }
+
+    r->iap_count++;
+    if (cancelled) {
+        r->cancelled_count++;
+    } else if (has_expiration && product_id[0] != '\0' &&
+               (r->product_id[0] == '\0' || r->latest_expiration_ms < expiration_ms)) {
+        r->latest_expiration_ms = expiration_ms;
+        strcpy(r->product_id, product_id);
+    }
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+}
+
+// See comment in header
+int receipt_ref_decode(const uint8_t *buf, size_t len, receipt_ref_t *r) {
+    memset(r, 0, sizeof(*r));
+    SignedData_t *signed_data = NULL;
+    ReceiptAttributes_t *attrs = NULL;
+    int ret = -1;
+
+    asn_dec_rval_t rval = ber_decode(0, &asn_DEF_SignedData, (void **)&signed_data, buf, len);
+    if (rval.code != RC_OK) {
+        goto done;
+    }
+    const OCTET_STRING_t *content = &signed_data->content.contentInfo.contentData;
+    rval = ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, content->buf, content->size);
+    if (rval.code != RC_OK) {
+        goto done;
+    }
+
+    for (int i = 0; i < attrs->list.count; i++) {
+        const ReceiptAttribute_t *attr = attrs->list.array[i];
+        if (attr->value.size == 0) {
+            continue;
+        }
+        switch (attr->type) {
+            case RECEIPT_TYPE_BUNDLE_ID:
+                read_string(&asn_DEF_UTF8String, &attr->value, r->bundle_id, sizeof(r->bundle_id));
+                break;
+            case RECEIPT_TYPE_IN_APP_PURCHASE:
+                read_in_app_purchase(&attr->value, r);
+                break;
+        }
+    }
+    ret = 0;
+
+done:
+    if (attrs != NULL) {
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    }
+    if (signed_data != NULL) {
+        ASN_STRUCT_FREE(asn_DEF_SignedData, signed_data);
+    }
+    return ret;
+}
+
+// See comment in header
+int receipt_ref_payload(const uint8_t *buf, size_t len, uint8_t **payload, size_t *payload_len) {
+    SignedData_t *signed_data = NULL;
+    int ret = -1;
+    asn_dec_rval_t rval = ber_decode(0, &asn_DEF_SignedData, (void **)&signed_data, buf, len);
+    if (rval.code == RC_OK) {
+        const OCTET_STRING_t *content = &signed_data->content.contentInfo.contentData;
+        *payload = malloc(content->size);
+        memcpy(*payload, content->buf, content->size);
+        *payload_len = content->size;
+        ret = 0;
+    }
+    if (signed_data != NULL) {
+        ASN_STRUCT_FREE(asn_DEF_SignedData, signed_data);
+    }
+    return ret;
+}
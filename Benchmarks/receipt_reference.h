@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef receipt_reference_h
+#define receipt_reference_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * App receipt decoding with the generated asn1c decoders, following PsiphonAppReceipt: the
+ * SignedData, then the receipt attributes, then each in-app purchase's attributes, with dates
+ * parsed from their RFC 3339 strings. Used as the baseline for receipt decoding work and as the
+ * reference its results are checked against.
+ */
+
+typedef struct {
+    char bundle_id[128];
+    char product_id[128];           // Product of the latest expiring subscription, or "" if there is none.
+    int64_t latest_expiration_ms;   // 0 if there is no subscription.
+    size_t iap_count;               // In-app purchase attributes, including cancelled ones.
+    size_t cancelled_count;
+} receipt_ref_t;
+
+/*!
+ * @brief Decodes a DER app receipt.
+ *
+ * Like PsiphonAppReceipt, purchases that are cancelled or lack a product or expiration date are
+ * skipped, and the first of equally late expirations wins.
+ *
+ * @return 0 on success, -1 if the receipt or its attributes can't be decoded.
+ */
+int receipt_ref_decode(const uint8_t *buf, size_t len, receipt_ref_t *r);
+
+/*!
+ * @brief Decodes only the SignedData wrapper.
+ *
+ * @param payload Populated with a malloc'd copy of the receipt attributes' DER. Caller must free.
+ * @return 0 on success, -1 on error.
+ */
+int receipt_ref_payload(const uint8_t *buf, size_t len, uint8_t **payload, size_t *payload_len);
+
+#endif /* receipt_reference_h */
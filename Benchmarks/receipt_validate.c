@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Validates and summarizes receipt files in parallel, as JSON lines on standard output, with the totals
+ * on standard error. See receipt_batch.h.
+ *
+ *   receipt_validate [-j threads] [-s] [-l list] [file...]
+ *
+ *   -j threads  Worker threads. Defaults to the number of online CPUs.
+ *   -s          Also reject receipts that aren't canonical DER.
+ *   -l list     Also validate the files named in list, one per line, or "-" for standard input.
+ *
+ * Exits with 0 if every receipt is valid, 1 if any isn't, and 2 on errors.
+ */
+
+#include "receipt_batch.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+    char **p;
+    size_t count;
+    size_t cap;
+} paths_t;
+
+static int add_path(paths_t *paths, char *path) {
+    if (paths->count == paths->cap) {
+        size_t cap = paths->cap ? paths->cap * 2 : 1024;
+        char **p = realloc(paths->p, cap * sizeof(*p));
+        if (p == NULL) {
+            return -1;
+        }
+        paths->p = p;
+        paths->cap = cap;
+    }
+    paths->p[paths->count++] = path;
+    return 0;
+}
+
+// Adds the non-empty lines of a list file.
+static int add_list(paths_t *paths, const char *list) {
+    FILE *fp = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    int ret = 0;
+    while ((n = getline(&line, &cap, fp)) >= 0) {
+        if (n > 0 && line[n - 1] == '\n') {
+            line[--n] = '\0';
+        }
+        if (n == 0) {
+            continue;
+        }
+        char *path = strdup(line);
+        if (path == NULL || add_path(paths, path) != 0) {
+            free(path);
+            ret = -1;
+            break;
+        }
+    }
+    if (ferror(fp)) {
+        ret = -1;
+    }
+    free(line);
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    return ret;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: receipt_validate [-j threads] [-s] [-l list] [file...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    receipt_batch_options_t options = { .threads = (int)sysconf(_SC_NPROCESSORS_ONLN) };
+    paths_t paths = { 0 };
+    const char *list = NULL;
+    int c;
+
+    while ((c = getopt(argc, argv, "j:sl:")) != -1) {
+        switch (c) {
+            case 'j':
+                options.threads = atoi(optarg);
+                if (options.threads < 1) {
+                    usage();
+                }
+                break;
+            case 's':
+                options.strict_der = 1;
+                break;
+            case 'l':
+                list = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    for (int i = optind; i < argc; i++) {
+        if (add_path(&paths, argv[i]) != 0) {
+            perror("receipt_validate");
+            return 2;
+        }
+    }
+    if (list != NULL && add_list(&paths, list) != 0) {
+        fprintf(stderr, "receipt_validate: %s: %s\n", list, strerror(errno));
+        return 2;
+    }
+    if (paths.count == 0) {
+        usage();
+    }
+    if (options.threads < 1) {
+        options.threads = 1;
+    }
+
+    receipt_batch_stats_t stats;
+    if (receipt_batch_run((const char *const *)paths.p, paths.count, &options, stdout, &stats) != 0) {
+        perror("receipt_validate");
+        return 2;
+    }
+    double ms = stats.elapsed_ns / 1e6;
+    fprintf(stderr, "%zu files, %zu failed, %.1f MB in %.1f ms: %.0f receipts/s, %.1f MB/s on %d threads, %zu steals\n",
+            stats.files, stats.failed, stats.bytes / (1024.0 * 1024.0), ms, ms > 0 ? stats.files / (ms / 1000) : 0,
+            ms > 0 ? stats.bytes / (1024.0 * 1024.0) / (ms / 1000) : 0, options.threads, stats.steals);
+    return stats.failed ? 1 : 0;
+}
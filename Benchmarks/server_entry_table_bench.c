@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Server entry table load and query latency, against re-scanning the raw file for each query
+ * (hex decode and JSON scan per line, as egressRegionsFromFile: does), and the table's memory
+ * footprint against keeping the raw file in memory.
+ */
+
+#define _GNU_SOURCE
+#include "ServerEntryTable.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define ENTRIES 3000
+#define QUERIES 10000
+
+static int hex_value(char c) {
+    return c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+}
+
+// Baseline: count the entries of a region by decoding every line of the raw file.
+static size_t raw_scan(const char *data, size_t len, const char *region) {
+    char needle[32];
+    snprintf(needle, sizeof(needle), "\"region\":\"%s\"", region);
+    size_t matches = 0;
+    char *decoded = malloc(len / 2 + 1);
+    const char *p = data, *end = data + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        size_t n = (size_t)((nl ? nl : end) - p) / 2;
+        for (size_t i = 0; i < n; i++) {
+            decoded[i] = (char)(hex_value(p[2 * i]) << 4 | hex_value(p[2 * i + 1]));
+        }
+        decoded[n] = '\0';
+        if (strstr(decoded, needle) != NULL) {
+            matches++;
+        }
+        p = nl ? nl + 1 : end;
+    }
+    free(decoded);
+    return matches;
+}
+
+static const char *table_path;
+
+static int run_load(void *arg) {
+    server_entry_table_t *t = server_entry_table_load(table_path);
+    if (t == NULL) {
+        return -1;
+    }
+    server_entry_table_free(t);
+    return 0;
+}
+
+static int run_raw(void *arg) {
+    size_t len;
+    char *data = fixture_read_file(table_path, &len);
+    if (data == NULL) {
+        return -1;
+    }
+    free(data);
+    return 0;
+}
+
+static int run_noop(void *arg) {
+    return 0;
+}
+
+int main(void) {
+    char *dir = fixture_tmpdir();
+    char *path, *filtered;
+    asprintf(&path, "%s/embedded_server_entries", dir);
+    asprintf(&filtered, "%s/filtered", dir);
+    table_path = path;
+    uint64_t state = 11;
+    fixture_write_server_entries_file(path, ENTRIES, &state, NULL);
+
+    size_t len;
+    char *data = fixture_read_file(path, &len);
+
+    uint64_t start = bench_now_ns();
+    server_entry_table_t *t = server_entry_table_load(path);
+    bench_report("server_entry_table/load", 1, bench_now_ns() - start, len);
+
+    bench_counter("server_entry_table/raw_file", (double)len / 1024.0, "KB");
+    bench_counter("server_entry_table/table_memory", (double)server_entry_table_memory(t) / 1024.0, "KB");
+    long idle = bench_peak_rss_kb(run_noop, NULL);
+    bench_counter("server_entry_table/load_peak_rss_over_idle", (double)(bench_peak_rss_kb(run_load, NULL) - idle), "KB");
+    bench_counter("server_entry_table/raw_peak_rss_over_idle", (double)(bench_peak_rss_kb(run_raw, NULL) - idle), "KB");
+
+    int region = server_entry_table_region_id(t, "DE");
+    uint64_t caps = (UINT64_C(1) << server_entry_table_capability_bit(t, "OSSH")) |
+                    (UINT64_C(1) << server_entry_table_capability_bit(t, "QUIC"));
+    uint32_t *indices = malloc(ENTRIES * sizeof(uint32_t));
+    uint64_t sink = 0;
+
+    start = bench_now_ns();
+    for (int i = 0; i < QUERIES; i++) {
+        sink += server_entry_table_query(t, region, 0, indices, ENTRIES);
+    }
+    bench_report("server_entry_table/query_region", QUERIES, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < QUERIES; i++) {
+        sink += server_entry_table_query(t, region, caps, indices, ENTRIES);
+    }
+    bench_report("server_entry_table/query_region_capabilities", QUERIES, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < 3; i++) {
+        sink += raw_scan(data, len, "DE");
+    }
+    bench_report("server_entry_table/query_region/raw_scan_baseline", 3, bench_now_ns() - start, len * 3);
+
+    start = bench_now_ns();
+    long written = server_entry_table_write_filtered(t, path, filtered, region, caps);
+    bench_report("server_entry_table/write_filtered", 1, bench_now_ns() - start, 0);
+    bench_counter("server_entry_table/write_filtered_entries", (double)written, "entries");
+
+    free(indices);
+    free(data);
+    server_entry_table_free(t);
+    fixture_rmdir(dir);
+    free(path);
+    free(filtered);
+    free(dir);
+    return sink == 0 ? 1 : 0;
+}
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "ServerEntryTable.h"
+#include "check.h"
+#include "fixtures.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ENTRIES 700
+
+static fixture_server_entry_t entries[ENTRIES];
+
+// Maps a table capability bit set to the fixture's capability bits.
+static uint64_t fixture_capabilities(const server_entry_table_t *t, uint64_t table_bits) {
+    uint64_t bits = 0;
+    for (int b = 0; b < 64; b++) {
+        if (table_bits & (UINT64_C(1) << b)) {
+            const char *name = server_entry_table_capability_name(t, b);
+            CHECK(name != NULL);
+            for (int i = 0; i < FIXTURE_CAPABILITY_COUNT; i++) {
+                if (strcmp(name, kFixtureCapabilities[i]) == 0) {
+                    bits |= UINT64_C(1) << i;
+                }
+            }
+        }
+    }
+    return bits;
+}
+
+static void check_rows(const server_entry_table_t *t) {
+    CHECK_EQ_INT(server_entry_table_count(t), ENTRIES);
+
+    // Regions are numbered in order of first appearance.
+    int next_region = 0;
+    for (int i = 0; i < ENTRIES; i++) {
+        server_entry_t e;
+        CHECK_EQ_INT(server_entry_table_entry(t, (size_t)i, &e), 0);
+        CHECK(strcmp(e.region, entries[i].region) == 0);
+        if (e.region_id == next_region) {
+            next_region++;
+        }
+        CHECK(e.region_id < next_region);
+        CHECK_EQ_INT(fixture_capabilities(t, e.capabilities), entries[i].capabilities);
+        struct in_addr addr;
+        CHECK(inet_pton(AF_INET, entries[i].ip_address, &addr) == 1);
+        CHECK_EQ_INT(e.ipv4, ntohl(addr.s_addr));
+    }
+    CHECK_EQ_INT(server_entry_table_region_count(t), next_region);
+    server_entry_t e;
+    CHECK(server_entry_table_entry(t, ENTRIES, &e) != 0);
+}
+
+static void check_queries(const server_entry_table_t *t) {
+    static uint32_t indices[ENTRIES];
+    int ossh = server_entry_table_capability_bit(t, "OSSH");
+    int quic = server_entry_table_capability_bit(t, "QUIC");
+    CHECK(ossh >= 0 && quic >= 0);
+    const uint64_t masks[] = { 0, UINT64_C(1) << ossh, (UINT64_C(1) << ossh) | (UINT64_C(1) << quic) };
+
+    for (int r = SERVER_ENTRY_TABLE_ANY_REGION; r < (int)server_entry_table_region_count(t); r++) {
+        for (size_t m = 0; m < sizeof(masks) / sizeof(masks[0]); m++) {
+            size_t total = server_entry_table_query(t, r, masks[m], indices, ENTRIES);
+            size_t expected = 0;
+            for (int i = 0; i < ENTRIES; i++) {
+                server_entry_t e;
+                server_entry_table_entry(t, (size_t)i, &e);
+                if ((r == SERVER_ENTRY_TABLE_ANY_REGION || e.region_id == r) && (e.capabilities & masks[m]) == masks[m]) {
+                    CHECK(expected < total && indices[expected] == (uint32_t)i);
+                    expected++;
+                }
+            }
+            CHECK_EQ_INT(total, expected);
+            // Truncated results still report the total.
+            CHECK_EQ_INT(server_entry_table_query(t, r, masks[m], indices, 1), total);
+        }
+    }
+    CHECK_EQ_INT(server_entry_table_query(t, 1000, 0, indices, ENTRIES), 0);
+    CHECK_EQ_INT(server_entry_table_query(t, SERVER_ENTRY_TABLE_ANY_REGION, UINT64_C(1) << 63, indices, ENTRIES), 0);
+}
+
+static void test_load_query_and_filter(void) {
+    char *dir = fixture_tmpdir();
+    char *path, *filtered;
+    asprintf(&path, "%s/embedded_server_entries", dir);
+    asprintf(&filtered, "%s/filtered", dir);
+    uint64_t state = 5;
+    CHECK_EQ_INT(fixture_write_server_entries_file(path, ENTRIES, &state, entries), 0);
+
+    // Append malformed lines, which are skipped: odd length, bad hex, no JSON, no region.
+    FILE *fp = fopen(path, "ab");
+    fputs("abc\n", fp);
+    fputs("zz11\n", fp);
+    fputs("3120322033203420\n", fp);                                        // "1 2 3 4 "
+    fputs("312032203320342037b2261223a317d\n", fp);                         // odd
+    fputs("3120322033203420 7b2261223a317d\r\n", fp);                       // space in hex
+    fputs("31203220332034207b2261223a317d\r\n", fp);                        // "1 2 3 4 {"a":1}"
+    fputs("\n", fp);
+    fclose(fp);
+
+    server_entry_table_t *t = server_entry_table_load(path);
+    CHECK(t != NULL);
+    CHECK_EQ_INT(server_entry_table_skipped(t), 6);
+    check_rows(t);
+    check_queries(t);
+
+    size_t len;
+    char *data = fixture_read_file(path, &len);
+    server_entry_table_t *parsed = server_entry_table_parse(data, len);
+    CHECK_EQ_INT(server_entry_table_count(parsed), ENTRIES);
+    for (int i = 0; i < ENTRIES; i++) {
+        server_entry_t a, b;
+        server_entry_table_entry(t, (size_t)i, &a);
+        server_entry_table_entry(parsed, (size_t)i, &b);
+        CHECK(a.offset == b.offset && a.length == b.length && a.ipv4 == b.ipv4 && a.region_id == b.region_id);
+        // Offsets point at the original line.
+        CHECK(a.offset + a.length < len && data[a.offset + a.length] == '\n');
+        CHECK(a.offset == 0 || data[a.offset - 1] == '\n');
+    }
+    server_entry_table_free(parsed);
+
+    // Filtered file holds exactly the matching original lines, in order.
+    int region = server_entry_table_region_id(t, "US");
+    uint64_t ossh = UINT64_C(1) << server_entry_table_capability_bit(t, "OSSH");
+    long written = server_entry_table_write_filtered(t, path, filtered, region, ossh);
+    CHECK(written > 0);
+    CHECK_EQ_INT(written, server_entry_table_query(t, region, ossh, NULL, 0));
+
+    size_t filtered_len;
+    char *filtered_data = fixture_read_file(filtered, &filtered_len);
+    char *expected = malloc(len + 1);
+    size_t expected_len = 0;
+    for (int i = 0; i < ENTRIES; i++) {
+        server_entry_t e;
+        server_entry_table_entry(t, (size_t)i, &e);
+        if (e.region_id == region && (e.capabilities & ossh)) {
+            memcpy(expected + expected_len, data + e.offset, e.length);
+            expected_len += e.length;
+            expected[expected_len++] = '\n';
+        }
+    }
+    CHECK_EQ_INT(filtered_len, expected_len);
+    CHECK(memcmp(filtered_data, expected, expected_len) == 0);
+
+    server_entry_table_t *reloaded = server_entry_table_load(filtered);
+    CHECK_EQ_INT(server_entry_table_count(reloaded), written);
+    CHECK_EQ_INT(server_entry_table_region_count(reloaded), 1);
+    CHECK(strcmp(server_entry_table_region_name(reloaded, 0), "US") == 0);
+    server_entry_table_free(reloaded);
+
+    CHECK(server_entry_table_load("/nonexistent/embedded_server_entries") == NULL);
+    CHECK_EQ_INT(server_entry_table_write_filtered(t, "/nonexistent/file", filtered, region, 0), -1);
+
+    free(expected);
+    free(filtered_data);
+    free(data);
+    server_entry_table_free(t);
+    fixture_rmdir(dir);
+    free(path);
+    free(filtered);
+    free(dir);
+}
+
+static void test_empty(void) {
+    server_entry_table_t *t = server_entry_table_parse("", 0);
+    CHECK(t != NULL);
+    CHECK_EQ_INT(server_entry_table_count(t), 0);
+    CHECK_EQ_INT(server_entry_table_query(t, SERVER_ENTRY_TABLE_ANY_REGION, 0, NULL, 0), 0);
+    server_entry_table_free(t);
+}
+
+int main(void) {
+    RUN_TEST(test_load_query_and_filter);
+    RUN_TEST(test_empty);
+    return 0;
+}
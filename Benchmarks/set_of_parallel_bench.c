@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Decoding the attributes of receipts with 1k to 50k in-app purchases, each with its own nested attribute
+ * set, on 1 to 8 threads with SET_OF_decode_ber_parallel, against ber_decode and a loop over the purchases.
+ */
+
+#include "ReceiptAttributes.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "receipt_reference.h"
+#include <string.h>
+
+#define RECEIPT_TYPE_IN_APP_PURCHASE 17
+
+// Attributes decoded per measurement, so that every size does a similar amount of work.
+#define TOTAL_ATTRIBUTES 100000
+
+static volatile long sink;
+
+// Nested purchase attribute sets, by the index of their attribute.
+typedef struct {
+    ReceiptAttributes_t **nested;
+} purchases_t;
+
+static ReceiptAttributes_t * decode_purchase(const ReceiptAttribute_t *attr) {
+    ReceiptAttributes_t *iap = NULL;
+    if (attr->type != RECEIPT_TYPE_IN_APP_PURCHASE) {
+        return NULL;
+    }
+    ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&iap, attr->value.buf, attr->value.size);
+    return iap;
+}
+
+static void purchase_decoded(void *member, int index, void *key) {
+    ((purchases_t *)key)->nested[index] = decode_purchase(member);
+}
+
+static void free_all(ReceiptAttributes_t *attrs, purchases_t *p) {
+    for (int i = 0; p != NULL && i < attrs->list.count; i++) {
+        if (p->nested[i] != NULL) {
+            sink += p->nested[i]->list.count;
+            ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, p->nested[i]);
+        }
+    }
+    sink += attrs->list.count;
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+}
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+int main(void) {
+    static const size_t sizes[] = { 1000, 10000, 50000 };
+    static const int threads[] = { 1, 2, 4, 8 };
+    char name[96];
+
+    bench_counter("set_of_parallel/cpus", (double)sysconf(_SC_NPROCESSORS_ONLN), "cpus");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t state = 72;
+        size_t receipt_len, len;
+        uint8_t *receipt = fixture_receipt(&state, sizes[s], 1514764800000, NULL, &receipt_len);
+        uint8_t *payload;
+        if (receipt_ref_payload(receipt, receipt_len, &payload, &len) != 0) {
+            fail("receipt_ref_payload");
+        }
+        free(receipt);
+        uint64_t iterations = TOTAL_ATTRIBUTES / sizes[s] < 2 ? 2 : TOTAL_ATTRIBUTES / sizes[s];
+        purchases_t p = { calloc(sizes[s] + 64, sizeof(ReceiptAttributes_t *)) };
+
+        // Baseline: ber_decode, then each purchase in turn.
+        uint64_t start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            ReceiptAttributes_t *attrs = NULL;
+            if (ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, len).code != RC_OK) {
+                fail("ber_decode");
+            }
+            for (int j = 0; j < attrs->list.count; j++) {
+                p.nested[j] = decode_purchase(attrs->list.array[j]);
+            }
+            free_all(attrs, &p);
+        }
+        uint64_t baseline_ns = bench_now_ns() - start;
+        snprintf(name, sizeof(name), "set_of_parallel/ber_decode/%zu_iaps", sizes[s]);
+        bench_report(name, iterations, baseline_ns, len * iterations);
+
+        start = bench_now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            ReceiptAttributes_t *attrs = NULL;
+            ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, len);
+            free_all(attrs, NULL);
+        }
+        snprintf(name, sizeof(name), "set_of_parallel/ber_decode_set_only/%zu_iaps", sizes[s]);
+        bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+
+        for (size_t t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+            asn_SET_OF_parallel_t options = { threads[t], 256, purchase_decoded, &p };
+            start = bench_now_ns();
+            for (uint64_t i = 0; i < iterations; i++) {
+                ReceiptAttributes_t *attrs = NULL;
+                if (SET_OF_decode_ber_parallel(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, len,
+                                               &options).code != RC_OK) {
+                    fail("SET_OF_decode_ber_parallel");
+                }
+                free_all(attrs, &p);
+            }
+            uint64_t ns = bench_now_ns() - start;
+            snprintf(name, sizeof(name), "set_of_parallel/parallel/%zu_iaps/%d_threads", sizes[s], threads[t]);
+            bench_report(name, iterations, ns, len * iterations);
+            snprintf(name, sizeof(name), "set_of_parallel/speedup/%zu_iaps/%d_threads", sizes[s], threads[t]);
+            bench_counter(name, (double)baseline_ns / (double)ns, "x");
+
+            options.member_decoded = NULL;
+            start = bench_now_ns();
+            for (uint64_t i = 0; i < iterations; i++) {
+                ReceiptAttributes_t *attrs = NULL;
+                SET_OF_decode_ber_parallel(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, len, &options);
+                free_all(attrs, NULL);
+            }
+            snprintf(name, sizeof(name), "set_of_parallel/parallel_set_only/%zu_iaps/%d_threads", sizes[s],
+                     threads[t]);
+            bench_report(name, iterations, bench_now_ns() - start, len * iterations);
+        }
+
+        free(p.nested);
+        free(payload);
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Parallel SET OF decoding in asn1c, checked against ber_decode on receipt attributes: the same lists in the
+ * same order for any number of threads, and the same results for input the parallel path doesn't take.
+ */
+
+#include "ReceiptAttributes.h"
+#include "check.h"
+#include "fixtures.h"
+#include "receipt_reference.h"
+#include <string.h>
+
+typedef struct {
+    void **members;
+    int *calls;
+    int max;
+} hook_t;
+
+static void record_member(void *member, int index, void *key) {
+    hook_t *h = key;
+    CHECK(index >= 0 && index < h->max);
+    h->members[index] = member;
+    h->calls[index]++;  // Each index is passed to one thread only.
+}
+
+static uint8_t * attributes_payload(size_t iaps, size_t *len) {
+    uint64_t state = 72;
+    size_t receipt_len;
+    uint8_t *receipt = fixture_receipt(&state, iaps, 1514764800000, NULL, &receipt_len);
+    uint8_t *payload;
+    CHECK_EQ_INT(receipt_ref_payload(receipt, receipt_len, &payload, len), 0);
+    free(receipt);
+    return payload;
+}
+
+// Checks the parallel decoder against ber_decode on one input, with hook checks when both succeed.
+static void check_same(const uint8_t *buf, size_t len, int threads) {
+    ReceiptAttributes_t *expected = NULL, *attrs = NULL;
+    asn_dec_rval_t e = ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&expected, buf, len);
+
+    int max = (int)len / 2 + 1;
+    hook_t h = { calloc(max, sizeof(void *)), calloc(max, sizeof(int)), max };
+    asn_SET_OF_parallel_t options = { threads, 0, record_member, &h };
+    asn_dec_rval_t r = SET_OF_decode_ber_parallel(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, buf, len, &options);
+
+    CHECK_EQ_INT(r.code, e.code);
+    CHECK_EQ_INT(r.consumed, e.consumed);
+    if (e.code == RC_OK) {
+        CHECK_EQ_INT(attrs->list.count, expected->list.count);
+        CHECK(attrs->list.size >= attrs->list.count);
+        for (int i = 0; i < attrs->list.count; i++) {
+            const ReceiptAttribute_t *a = attrs->list.array[i], *b = expected->list.array[i];
+            CHECK_EQ_INT(a->type, b->type);
+            CHECK_EQ_INT(a->version, b->version);
+            CHECK_EQ_INT(a->value.size, b->value.size);
+            CHECK(memcmp(a->value.buf, b->value.buf, b->value.size) == 0);
+            CHECK(h.members[i] == a);
+            CHECK_EQ_INT(h.calls[i], 1);
+        }
+    }
+
+    free(h.members);
+    free(h.calls);
+    if (expected != NULL) {
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, expected);
+    }
+    if (attrs != NULL) {
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    }
+}
+
+static void test_receipts(void) {
+    static const size_t sizes[] = { 0, 1, 100, 1000 };
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len;
+        uint8_t *payload = attributes_payload(sizes[s], &len);
+        for (int threads = 1; threads <= 8; threads++) {
+            check_same(payload, len, threads);
+        }
+
+        // Small sets stay on the calling thread, and the list is allocated at its final size either way.
+        ReceiptAttributes_t *attrs = NULL;
+        asn_SET_OF_parallel_t options = { 4, 1 << 30, NULL, NULL };
+        asn_dec_rval_t r = SET_OF_decode_ber_parallel(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, len,
+                                                      &options);
+        CHECK(r.code == RC_OK);
+        CHECK_EQ_INT(r.consumed, len);
+        CHECK_EQ_INT(attrs->list.size, attrs->list.count);
+        CHECK(der_encoded_size(&asn_DEF_ReceiptAttributes, attrs) == (ssize_t)len);
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+        free(payload);
+    }
+}
+
+static void test_fallback(void) {
+    size_t len;
+    uint8_t *payload = attributes_payload(20, &len);
+
+    // Indefinite length, which the pre-scan leaves to the sequential decoder.
+    size_t header = 2 + ((payload[1] & 0x80) ? (payload[1] & 0x7f) : 0);
+    size_t indefinite_len = len - header + 4;
+    uint8_t *indefinite = malloc(indefinite_len);
+    indefinite[0] = payload[0];
+    indefinite[1] = 0x80;
+    memcpy(indefinite + 2, payload + header, len - header);
+    indefinite[indefinite_len - 2] = indefinite[indefinite_len - 1] = 0;
+    check_same(indefinite, indefinite_len, 4);
+    free(indefinite);
+
+    // Truncated and corrupted input fails the way ber_decode does.
+    uint64_t state = 73;
+    for (int i = 0; i < 300; i++) {
+        check_same(payload, fixture_rand(&state) % len, 1 + i % 4);
+    }
+    uint8_t *corrupt = malloc(len);
+    for (int i = 0; i < 2000; i++) {
+        memcpy(corrupt, payload, len);
+        for (int j = 0; j < 1 + i % 3; j++) {
+            corrupt[fixture_rand(&state) % len] = (uint8_t)fixture_rand(&state);
+        }
+        check_same(corrupt, len, 1 + i % 4);
+    }
+    free(corrupt);
+
+    // Decoding into a structure that already has members continues with the sequential decoder.
+    ReceiptAttributes_t *attrs = NULL;
+    CHECK(ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, len).code == RC_OK);
+    int count = attrs->list.count;
+    asn_SET_OF_parallel_t options = { 2, 0, NULL, NULL };
+    attrs->_asn_ctx.phase = 0;
+    asn_dec_rval_t r = SET_OF_decode_ber_parallel(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, len,
+                                                  &options);
+    CHECK(r.code == RC_OK);
+    CHECK_EQ_INT(attrs->list.count, 2 * count);
+    ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+
+    free(payload);
+}
+
+int main(void) {
+    RUN_TEST(test_receipts);
+    RUN_TEST(test_fallback);
+    return 0;
+}
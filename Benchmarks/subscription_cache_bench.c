@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Subscription checks against the subscription cache, against the same checks through a property list:
+ * reading the preferences plist, parsing it into a tree of nodes and looking up the expiry, as reading
+ * the subscription dictionary from NSUserDefaults involves. Then writes: a cache record, against
+ * serializing and atomically replacing the plist.
+ */
+
+#define _GNU_SOURCE
+#include "SubscriptionCache.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "timestamp.h"
+#include <fcntl.h>
+#include <string.h>
+
+#define READS 200000
+#define PLIST_READS 20000
+#define WRITES 2000
+
+static volatile long sink;
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+/*** Property list baseline ***/
+
+typedef enum { NODE_DICT, NODE_ARRAY, NODE_STRING, NODE_INTEGER, NODE_DATE, NODE_TRUE, NODE_FALSE } node_type_t;
+
+typedef struct node {
+    node_type_t type;
+    char *text;             // Unescaped contents of scalars.
+    char **keys;            // Keys of a dict.
+    struct node **children;
+    size_t count;
+} node_t;
+
+static void node_free(node_t *n) {
+    if (n == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < n->count; i++) {
+        node_free(n->children[i]);
+        if (n->keys != NULL) {
+            free(n->keys[i]);
+        }
+    }
+    free(n->children);
+    free(n->keys);
+    free(n->text);
+    free(n);
+}
+
+static void skip_space(const char **p) {
+    while (**p == ' ' || **p == '\n' || **p == '\t' || **p == '\r') {
+        (*p)++;
+    }
+}
+
+static int consume(const char **p, const char *s) {
+    skip_space(p);
+    size_t n = strlen(s);
+    if (strncmp(*p, s, n) != 0) {
+        return 0;
+    }
+    *p += n;
+    return 1;
+}
+
+// Reads text up to the next '<', unescaping entities.
+static char * parse_text(const char **p) {
+    const char *end = strchr(*p, '<');
+    if (end == NULL) {
+        return NULL;
+    }
+    char *text = malloc(end - *p + 1), *q = text;
+    for (const char *s = *p; s < end;) {
+        if (*s == '&') {
+            static const struct { const char *entity; char c; } entities[] = {
+                { "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' }, { "&quot;", '"' }, { "&apos;", '\'' } };
+            size_t i = 0;
+            while (i < 5 && strncmp(s, entities[i].entity, strlen(entities[i].entity)) != 0) {
+                i++;
+            }
+            if (i == 5) {
+                free(text);
+                return NULL;
+            }
+            *q++ = entities[i].c;
+            s += strlen(entities[i].entity);
+        } else {
+            *q++ = *s++;
+        }
+    }
+    *q = '\0';
+    *p = end;
+    return text;
+}
+
+static node_t * parse_node(const char **p);
+
+static int add_child(node_t *n, char *key, node_t *child) {
+    n->children = realloc(n->children, (n->count + 1) * sizeof(*n->children));
+    if (key != NULL) {
+        n->keys = realloc(n->keys, (n->count + 1) * sizeof(*n->keys));
+        n->keys[n->count] = key;
+    }
+    n->children[n->count++] = child;
+    return 0;
+}
+
+static node_t * parse_node(const char **p) {
+    static const struct { const char *open; const char *close; node_type_t type; } scalars[] = {
+        { "<string>", "</string>", NODE_STRING }, { "<integer>", "</integer>", NODE_INTEGER },
+        { "<date>", "</date>", NODE_DATE } };
+    node_t *n = calloc(1, sizeof(*n));
+    if (consume(p, "<dict>")) {
+        n->type = NODE_DICT;
+        while (!consume(p, "</dict>")) {
+            char *key;
+            node_t *child;
+            if (!consume(p, "<key>") || (key = parse_text(p)) == NULL) {
+                goto fail;
+            }
+            if (!consume(p, "</key>") || (child = parse_node(p)) == NULL) {
+                free(key);
+                goto fail;
+            }
+            add_child(n, key, child);
+        }
+        return n;
+    }
+    if (consume(p, "<array>")) {
+        n->type = NODE_ARRAY;
+        while (!consume(p, "</array>")) {
+            node_t *child = parse_node(p);
+            if (child == NULL) {
+                goto fail;
+            }
+            add_child(n, NULL, child);
+        }
+        return n;
+    }
+    if (consume(p, "<true/>") || consume(p, "<false/>")) {
+        n->type = (*p)[-2] == 'e' && (*p)[-3] == 'u' ? NODE_TRUE : NODE_FALSE;
+        return n;
+    }
+    for (size_t i = 0; i < sizeof(scalars) / sizeof(scalars[0]); i++) {
+        if (consume(p, scalars[i].open)) {
+            n->type = scalars[i].type;
+            if ((n->text = parse_text(p)) == NULL || !consume(p, scalars[i].close)) {
+                goto fail;
+            }
+            return n;
+        }
+    }
+
+fail:
+    node_free(n);
+    return NULL;
+}
+
+static node_t * plist_parse(const char *s) {
+    const char *p = strstr(s, "<plist");
+    if (p == NULL || (p = strchr(p, '>')) == NULL) {
+        return NULL;
+    }
+    p++;
+    return parse_node(&p);
+}
+
+static const node_t * dict_get(const node_t *n, const char *key) {
+    for (size_t i = 0; n != NULL && n->type == NODE_DICT && i < n->count; i++) {
+        if (strcmp(n->keys[i], key) == 0) {
+            return n->children[i];
+        }
+    }
+    return NULL;
+}
+
+// Formats the preferences plist with the subscription dictionaries, as NSUserDefaults writes it.
+static size_t plist_format(char *dst, size_t len, const subscription_record_t *r, const char *authorization) {
+    char expiry[40];
+    timestamp_t ts = { .sec = r->latest_expiry_ms / 1000 };
+    timestamp_format(expiry, sizeof(expiry), &ts);
+    return snprintf(dst, len,
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+        "<plist version=\"1.0\">\n<dict>\n"
+        "\t<key>LastConnectedRegion</key>\n\t<string>US</string>\n"
+        "\t<key>kSubscriptionDictionary</key>\n\t<dict>\n"
+        "\t\t<key>kAppReceiptFileSize</key>\n\t\t<integer>%llu</integer>\n"
+        "\t\t<key>kLatestExpirationDate</key>\n\t\t<date>%s</date>\n"
+        "\t\t<key>kProductId</key>\n\t\t<string>%s</string>\n"
+        "\t\t<key>kPendingRenewalInfo</key>\n\t\t<array>\n\t\t\t<dict>\n"
+        "\t\t\t\t<key>auto_renew_product_id</key>\n\t\t\t\t<string>%s</string>\n"
+        "\t\t\t\t<key>auto_renew_status</key>\n\t\t\t\t<string>1</string>\n"
+        "\t\t\t\t<key>original_transaction_id</key>\n\t\t\t\t<string>170000123456789</string>\n"
+        "\t\t\t\t<key>product_id</key>\n\t\t\t\t<string>%s</string>\n"
+        "\t\t\t</dict>\n\t\t</array>\n"
+        "\t\t<key>kSubscriptionAuthorization</key>\n\t\t<string>%s</string>\n"
+        "\t</dict>\n"
+        "\t<key>ShowedUpgradeNotice</key>\n\t<true/>\n"
+        "</dict>\n</plist>\n",
+        (unsigned long long)r->receipt_file_size, expiry, r->product_id, r->product_id, r->product_id,
+        authorization);
+}
+
+// Reads the plist and finds the latest expiration date, as hasActiveSubscriptionForDate: does.
+static int plist_check(const char *path, int64_t now_ms) {
+    size_t len;
+    char *s = fixture_read_file(path, &len);
+    node_t *root = s ? plist_parse(s) : NULL;
+    const node_t *date = dict_get(dict_get(root, "kSubscriptionDictionary"), "kLatestExpirationDate");
+    timestamp_t ts;
+    if (date == NULL || date->type != NODE_DATE || timestamp_parse(date->text, strlen(date->text), &ts) != 0) {
+        fail("plist read");
+    }
+    node_free(root);
+    free(s);
+    return now_ms <= ts.sec * 1000;
+}
+
+// Writes the plist to a temporary file and renames it into place.
+static void plist_write(const char *path, const char *tmp, const char *s, size_t len) {
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || write(fd, s, len) != (ssize_t)len || fsync(fd) != 0 || close(fd) != 0 || rename(tmp, path) != 0) {
+        fail("plist write");
+    }
+}
+
+/*** Benchmarks ***/
+
+int main(void) {
+    char *dir = fixture_tmpdir(), *cache_path, *plist_path, *tmp_path;
+    if (dir == NULL || asprintf(&cache_path, "%s/subscription", dir) < 0 ||
+        asprintf(&plist_path, "%s/ca.psiphon.Psiphon.plist", dir) < 0 ||
+        asprintf(&tmp_path, "%s/ca.psiphon.Psiphon.plist.tmp", dir) < 0) {
+        fail("setup");
+    }
+
+    uint64_t state = 67;
+    subscription_record_t r = { .receipt_file_size = 5621, .latest_expiry_ms = 1517443200000,
+                                .authorization_expiry_ms = 1517529600000,
+                                .product_id = "ca.psiphon.Psiphon.1.month", .authorization_id = "" };
+    for (size_t i = 0; i < sizeof(r.receipt_hash); i++) {
+        r.receipt_hash[i] = (uint8_t)fixture_rand(&state);
+    }
+    char authorization[512];
+    size_t authorization_len = fixture_authorization_json(&state, authorization, sizeof(authorization),
+                                                          r.authorization_expiry_ms);
+    snprintf(r.authorization_id, sizeof(r.authorization_id), "%.44s", authorization);
+    // The authorization is persisted base64 encoded, about a third longer than its JSON.
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    char authorization_b64[700];
+    size_t b64_len = (authorization_len + 2) / 3 * 4;
+    for (size_t i = 0; i < b64_len; i++) {
+        authorization_b64[i] = alphabet[fixture_rand(&state) % 64];
+    }
+    authorization_b64[b64_len] = '\0';
+
+    subscription_cache_t *writer = subscription_cache_open(cache_path, SUBSCRIPTION_CACHE_WRITE);
+    subscription_cache_t *reader = subscription_cache_open(cache_path, 0);
+    if (writer == NULL || reader == NULL || subscription_cache_write(writer, &r) != 0) {
+        fail("cache open");
+    }
+    char plist[4096];
+    size_t plist_len = plist_format(plist, sizeof(plist), &r, authorization_b64);
+    plist_write(plist_path, tmp_path, plist, plist_len);
+    bench_counter("subscription_cache/file_size", SUBSCRIPTION_CACHE_FILE_LEN, "B");
+    bench_counter("subscription_cache/plist_baseline/file_size", (double)plist_len, "B");
+
+    int64_t now_ms = 1516000000000;
+    subscription_record_t read;
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < READS; i++) {
+        if (subscription_cache_read(reader, &read) != 0) {
+            fail("cache read");
+        }
+        sink += subscription_record_active(&read, now_ms + i);
+    }
+    bench_report("subscription_cache/check", READS, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < PLIST_READS; i++) {
+        subscription_cache_t *c = subscription_cache_open(cache_path, 0);
+        if (c == NULL || subscription_cache_read(c, &read) != 0) {
+            fail("cache open and read");
+        }
+        sink += subscription_record_active(&read, now_ms + i);
+        subscription_cache_close(c);
+    }
+    bench_report("subscription_cache/open_check_close", PLIST_READS, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < PLIST_READS; i++) {
+        sink += plist_check(plist_path, now_ms + i);
+    }
+    bench_report("subscription_cache/plist_baseline/check", PLIST_READS, bench_now_ns() - start,
+                 (uint64_t)plist_len * PLIST_READS);
+
+    start = bench_now_ns();
+    for (int i = 0; i < WRITES; i++) {
+        r.receipt_file_size++;
+        if (subscription_cache_write(writer, &r) != 0) {
+            fail("cache write");
+        }
+    }
+    bench_report("subscription_cache/write", WRITES, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (int i = 0; i < WRITES; i++) {
+        r.receipt_file_size++;
+        plist_len = plist_format(plist, sizeof(plist), &r, authorization_b64);
+        plist_write(plist_path, tmp_path, plist, plist_len);
+    }
+    bench_report("subscription_cache/plist_baseline/write", WRITES, bench_now_ns() - start, 0);
+
+    subscription_cache_close(reader);
+    subscription_cache_close(writer);
+    fixture_rmdir(dir);
+    free(cache_path);
+    free(plist_path);
+    free(tmp_path);
+    free(dir);
+    return 0;
+}
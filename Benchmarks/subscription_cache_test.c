@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _GNU_SOURCE
+#include "SubscriptionCache.h"
+#include "check.h"
+#include "fixtures.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define WRITES 300
+
+// A record whose fields are all derived from n, so that a mix of two records is detectable.
+static void make_record(uint32_t n, subscription_record_t *r) {
+    memset(r, 0, sizeof(*r));
+    for (size_t i = 0; i < sizeof(r->receipt_hash); i++) {
+        r->receipt_hash[i] = (uint8_t)(n * 31 + i);
+    }
+    r->receipt_file_size = 4000 + n;
+    r->latest_expiry_ms = 1514764800000 + (int64_t)n * 1000;
+    r->authorization_expiry_ms = r->latest_expiry_ms + 86400000;
+    snprintf(r->product_id, sizeof(r->product_id), "ca.psiphon.Psiphon.%u.month", n);
+    snprintf(r->authorization_id, sizeof(r->authorization_id), "id-%u", n);
+}
+
+// Returns n if the record is make_record(n), or -1.
+static long record_number(const subscription_record_t *r) {
+    unsigned n;
+    subscription_record_t expected;
+    if (sscanf(r->product_id, "ca.psiphon.Psiphon.%u.month", &n) != 1) {
+        return -1;
+    }
+    make_record(n, &expected);
+    return memcmp(r, &expected, sizeof(expected)) == 0 ? (long)n : -1;
+}
+
+static void recompute_crc(uint8_t *buf) {
+    uint32_t crc = (uint32_t)crc32(crc32(0, Z_NULL, 0), buf + 4, SUBSCRIPTION_CACHE_RECORD_LEN - 4);
+    for (int i = 0; i < 4; i++) {
+        buf[i] = (uint8_t)(crc >> (8 * i));
+    }
+}
+
+static void test_encoding(void) {
+    subscription_record_t r, decoded;
+    uint8_t buf[SUBSCRIPTION_CACHE_RECORD_LEN], again[SUBSCRIPTION_CACHE_RECORD_LEN];
+    uint64_t generation;
+
+    make_record(7, &r);
+    CHECK_EQ_INT(subscription_record_encode(&r, 9, buf), 0);
+    CHECK_EQ_INT(subscription_record_decode(buf, &decoded, &generation), 0);
+    CHECK_EQ_INT(generation, 9);
+    CHECK_EQ_INT(record_number(&decoded), 7);
+
+    // One encoding per record: whatever follows a string's NUL in the record isn't encoded.
+    strcpy(r.product_id + strlen(r.product_id) + 1, "stale");
+    CHECK_EQ_INT(subscription_record_encode(&r, 9, again), 0);
+    CHECK(memcmp(buf, again, sizeof(buf)) == 0);
+    CHECK_EQ_INT(subscription_record_encode(&decoded, 9, again), 0);
+    CHECK(memcmp(buf, again, sizeof(buf)) == 0);
+
+    // Little-endian fields at fixed offsets.
+    CHECK_EQ_INT(buf[4], SUBSCRIPTION_CACHE_VERSION);
+    CHECK_EQ_INT(buf[48] | (buf[49] << 8), 4007);
+    CHECK(strcmp((const char *)buf + 72, "ca.psiphon.Psiphon.7.month") == 0);
+
+    // Every corrupted octet is caught by the checksum.
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        for (int bit = 0; bit < 8; bit++) {
+            memcpy(again, buf, sizeof(buf));
+            again[i] ^= 1 << bit;
+            CHECK_EQ_INT(subscription_record_decode(again, &decoded, NULL), -1);
+        }
+    }
+
+    // Non-canonical encodings are rejected even with a valid checksum: padding, reserved bits, version and
+    // unterminated strings.
+    static const size_t offsets[] = { 4, 6, 72 + 119, 192 + 63 };
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); i++) {
+        memcpy(again, buf, sizeof(buf));
+        again[offsets[i]] ^= 0x40;
+        recompute_crc(again);
+        CHECK_EQ_INT(subscription_record_decode(again, &decoded, NULL), -1);
+    }
+    memset(again + 72, 'x', SUBSCRIPTION_CACHE_PRODUCT_ID_SIZE);
+    recompute_crc(again);
+    CHECK_EQ_INT(subscription_record_decode(again, &decoded, NULL), -1);
+
+    // Strings must fit.
+    memset(r.authorization_id, 'x', sizeof(r.authorization_id));
+    CHECK_EQ_INT(subscription_record_encode(&r, 1, buf), -1);
+}
+
+static void test_file(void) {
+    char *dir = fixture_tmpdir(), *path;
+    CHECK(asprintf(&path, "%s/subscription", dir) > 0);
+    subscription_record_t r, read;
+
+    // Readers need an existing cache.
+    errno = 0;
+    CHECK(subscription_cache_open(path, 0) == NULL);
+    CHECK_EQ_INT(errno, ENOENT);
+
+    subscription_cache_t *writer = subscription_cache_open(path, SUBSCRIPTION_CACHE_WRITE);
+    CHECK(writer != NULL);
+    subscription_cache_t *reader = subscription_cache_open(path, 0);
+    CHECK(reader != NULL);
+    CHECK_EQ_INT(subscription_cache_read(reader, &read), -1);
+
+    make_record(1, &r);
+    CHECK_EQ_INT(subscription_cache_write(writer, &r), 0);
+    CHECK_EQ_INT(subscription_cache_read(reader, &read), 0);
+    CHECK_EQ_INT(record_number(&read), 1);
+    CHECK(subscription_record_active(&read, read.latest_expiry_ms));
+    CHECK(!subscription_record_active(&read, read.latest_expiry_ms + 1));
+    CHECK(subscription_record_authorized(&read, read.authorization_expiry_ms));
+
+    // Readers see later writes through their existing mapping, including from other writers.
+    subscription_cache_t *other = subscription_cache_open(path, SUBSCRIPTION_CACHE_WRITE);
+    CHECK(other != NULL);
+    make_record(2, &r);
+    CHECK_EQ_INT(subscription_cache_write(other, &r), 0);
+    CHECK_EQ_INT(subscription_cache_read(reader, &read), 0);
+    CHECK_EQ_INT(record_number(&read), 2);
+    make_record(3, &r);
+    CHECK_EQ_INT(subscription_cache_write(writer, &r), 0);
+    CHECK_EQ_INT(subscription_cache_read(reader, &read), 0);
+    CHECK_EQ_INT(record_number(&read), 3);
+    subscription_cache_close(other);
+
+    // Opening again keeps the record.
+    subscription_cache_close(writer);
+    writer = subscription_cache_open(path, SUBSCRIPTION_CACHE_WRITE);
+    CHECK(writer != NULL);
+    CHECK_EQ_INT(subscription_cache_read(writer, &read), 0);
+    CHECK_EQ_INT(record_number(&read), 3);
+
+    // Readers can't write, and strings must fit.
+    errno = 0;
+    CHECK_EQ_INT(subscription_cache_write(reader, &r), -1);
+    CHECK_EQ_INT(errno, EBADF);
+    memset(r.product_id, 'x', sizeof(r.product_id));
+    CHECK_EQ_INT(subscription_cache_write(writer, &r), -1);
+    CHECK_EQ_INT(errno, EINVAL);
+    CHECK_EQ_INT(subscription_cache_read(reader, &read), 0);
+    CHECK_EQ_INT(record_number(&read), 3);
+    subscription_cache_close(reader);
+    subscription_cache_close(writer);
+
+    // A file that isn't a cache is rejected by readers, and replaced by writers.
+    FILE *fp = fopen(path, "w");
+    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>", fp);
+    fclose(fp);
+    errno = 0;
+    CHECK(subscription_cache_open(path, 0) == NULL);
+    CHECK_EQ_INT(errno, EINVAL);
+    writer = subscription_cache_open(path, SUBSCRIPTION_CACHE_WRITE);
+    CHECK(writer != NULL);
+    CHECK_EQ_INT(subscription_cache_read(writer, &read), -1);
+    subscription_cache_close(writer);
+
+    free(path);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+typedef struct {
+    const char *path;
+    atomic_int done;
+    atomic_long reads;
+} concurrent_t;
+
+static void * read_until_done(void *arg) {
+    concurrent_t *c = arg;
+    subscription_cache_t *reader = subscription_cache_open(c->path, 0);
+    CHECK(reader != NULL);
+    subscription_record_t r;
+    long last = 0;
+    while (!atomic_load(&c->done)) {
+        int ret = subscription_cache_read(reader, &r);
+        if (ret != 0) {
+            // Only if writers kept replacing the record for every attempt.
+            CHECK_EQ_INT(errno, EAGAIN);
+            continue;
+        }
+        long n = record_number(&r);
+        CHECK(n >= last);
+        last = n;
+        atomic_fetch_add(&c->reads, 1);
+    }
+    subscription_cache_close(reader);
+    return NULL;
+}
+
+// Readers never see a mix of two records, whether the writer is another thread or another process.
+static void test_concurrent(void) {
+    char *dir = fixture_tmpdir(), *path;
+    CHECK(asprintf(&path, "%s/subscription", dir) > 0);
+    subscription_cache_t *writer = subscription_cache_open(path, SUBSCRIPTION_CACHE_WRITE);
+    CHECK(writer != NULL);
+    subscription_record_t r;
+    make_record(0, &r);
+    CHECK_EQ_INT(subscription_cache_write(writer, &r), 0);
+
+    // Another process writes through its own handle once this one is done. It is forked before the reader
+    // threads start, and waits for a byte on a pipe.
+    int start[2];
+    CHECK_EQ_INT(pipe(start), 0);
+    pid_t pid = fork();
+    if (pid == 0) {
+        char byte;
+        close(start[1]);
+        subscription_cache_t *child = NULL;
+        if (read(start[0], &byte, 1) == 1) {
+            child = subscription_cache_open(path, SUBSCRIPTION_CACHE_WRITE);
+        }
+        subscription_record_t cr;
+        for (uint32_t n = WRITES + 1; n <= 2 * WRITES && child != NULL; n++) {
+            make_record(n, &cr);
+            if (subscription_cache_write(child, &cr) != 0) {
+                _exit(1);
+            }
+        }
+        _exit(child != NULL ? 0 : 1);
+    }
+    CHECK(pid > 0);
+    close(start[0]);
+
+    concurrent_t c = { .path = path };
+    pthread_t readers[3];
+    for (int i = 0; i < 3; i++) {
+        CHECK_EQ_INT(pthread_create(&readers[i], NULL, read_until_done, &c), 0);
+    }
+    for (uint32_t n = 1; n <= WRITES; n++) {
+        make_record(n, &r);
+        CHECK_EQ_INT(subscription_cache_write(writer, &r), 0);
+    }
+    CHECK_EQ_INT(write(start[1], "", 1), 1);
+    close(start[1]);
+    int status;
+    CHECK_EQ_INT(waitpid(pid, &status, 0), pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    make_record(2 * WRITES + 1, &r);
+    CHECK_EQ_INT(subscription_cache_write(writer, &r), 0);
+
+    atomic_store(&c.done, 1);
+    for (int i = 0; i < 3; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    CHECK(atomic_load(&c.reads) > 0);
+    subscription_record_t last;
+    CHECK_EQ_INT(subscription_cache_read(writer, &last), 0);
+    CHECK_EQ_INT(record_number(&last), 2 * WRITES + 1);
+
+    subscription_cache_close(writer);
+    free(path);
+    fixture_rmdir(dir);
+    free(dir);
+}
+
+int main(void) {
+    RUN_TEST(test_encoding);
+    RUN_TEST(test_file);
+    RUN_TEST(test_concurrent);
+    return 0;
+}
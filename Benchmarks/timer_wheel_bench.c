@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Timer wheel operation costs with 100k timers, and wakeup counts of the wheel driven by its
+ * next expiry against one timer per task (one wakeup per distinct deadline), in simulated time.
+ */
+
+#include "TimerWheel.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define TIMERS 100000
+
+static int64_t deadlines[TIMERS];
+static timer_wheel_id_t ids[TIMERS];
+static uint64_t fired;
+
+static void on_fire(void *ctx) {
+    fired++;
+}
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Number of wakeups needed with one timer per task: one per distinct deadline.
+static uint64_t distinct_deadlines(const int64_t *values, size_t n) {
+    int64_t *sorted = malloc(n * sizeof(int64_t));
+    memcpy(sorted, values, n * sizeof(int64_t));
+    qsort(sorted, n, sizeof(int64_t), compare_int64);
+    uint64_t distinct = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || sorted[i] != sorted[i - 1]) {
+            distinct++;
+        }
+    }
+    free(sorted);
+    return distinct;
+}
+
+// Fires everything, waking only at the wheel's next expiry. Returns the number of wakeups.
+static uint64_t drain(timer_wheel_t *w) {
+    uint64_t wakeups = 0;
+    int64_t next;
+    while (timer_wheel_next_expiry(w, &next) == 0) {
+        timer_wheel_advance(w, next);
+        wakeups++;
+    }
+    return wakeups;
+}
+
+static void oneshot(int64_t slack_ms) {
+    char name[96];
+    timer_wheel_t *w = timer_wheel_new(1, 0);
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < TIMERS; i++) {
+        ids[i] = timer_wheel_add(w, deadlines[i], slack_ms, on_fire, NULL);
+    }
+    snprintf(name, sizeof(name), "timer_wheel/add/slack_%" PRId64 "ms", slack_ms);
+    bench_report(name, TIMERS, bench_now_ns() - start, 0);
+
+    fired = 0;
+    start = bench_now_ns();
+    uint64_t wakeups = drain(w);
+    snprintf(name, sizeof(name), "timer_wheel/fire/slack_%" PRId64 "ms", slack_ms);
+    bench_report(name, fired, bench_now_ns() - start, 0);
+    snprintf(name, sizeof(name), "timer_wheel/wakeups/slack_%" PRId64 "ms", slack_ms);
+    bench_counter(name, (double)wakeups, "wakeups");
+    timer_wheel_free(w);
+}
+
+typedef struct {
+    timer_wheel_t *wheel;
+    int64_t period_ms;
+    int64_t slack_ms;
+    int64_t end_ms;
+    int64_t next_ms;
+    uint64_t runs;
+} periodic_t;
+
+static int64_t now_ms;
+
+static void periodic_fire(void *ctx) {
+    periodic_t *p = ctx;
+    p->runs++;
+    // Reschedule from the ideal time, like a repeating timer.
+    p->next_ms += p->period_ms;
+    if (p->next_ms < p->end_ms) {
+        timer_wheel_add(p->wheel, p->next_ms, p->slack_ms, periodic_fire, p);
+    }
+}
+
+/*
+ * A day of the extension's periodic work: profiling, subscription checks, PsiCash polling and
+ * a few status refreshes, each with a random phase and 10% slack. Without coalescing every run
+ * is a separate wakeup.
+ */
+static void periodic_day(void) {
+    const int64_t periods_ms[] = { 5000, 15000, 30000, 60000, 60000, 300000, 900000, 3600000 };
+    const size_t n = sizeof(periods_ms) / sizeof(periods_ms[0]);
+    const int64_t day_ms = INT64_C(24) * 3600 * 1000;
+    uint64_t state = 3;
+
+    timer_wheel_t *w = timer_wheel_new(10, 0);
+    periodic_t tasks[sizeof(periods_ms) / sizeof(periods_ms[0])];
+    for (size_t i = 0; i < n; i++) {
+        tasks[i] = (periodic_t){ w, periods_ms[i], periods_ms[i] / 10, day_ms,
+                                 (int64_t)(fixture_rand(&state) % (uint64_t)periods_ms[i]), 0 };
+        timer_wheel_add(w, tasks[i].next_ms, tasks[i].slack_ms, periodic_fire, &tasks[i]);
+    }
+
+    uint64_t wakeups = 0;
+    while (timer_wheel_next_expiry(w, &now_ms) == 0) {
+        timer_wheel_advance(w, now_ms);
+        wakeups++;
+    }
+    uint64_t runs = 0;
+    for (size_t i = 0; i < n; i++) {
+        runs += tasks[i].runs;
+    }
+    bench_counter("timer_wheel/periodic_day/one_timer_per_task_wakeups", (double)runs, "wakeups");
+    bench_counter("timer_wheel/periodic_day/wheel_wakeups", (double)wakeups, "wakeups");
+    timer_wheel_free(w);
+}
+
+int main(void) {
+    uint64_t state = 1;
+    // Deadlines over the next hour.
+    for (int i = 0; i < TIMERS; i++) {
+        deadlines[i] = 1 + (int64_t)(fixture_rand(&state) % 3600000);
+    }
+    bench_counter("timer_wheel/one_timer_per_task/wakeups", (double)distinct_deadlines(deadlines, TIMERS), "wakeups");
+    oneshot(0);
+    oneshot(100);
+    oneshot(1000);
+
+    // Cancel cost, in random order.
+    timer_wheel_t *w = timer_wheel_new(1, 0);
+    for (int i = 0; i < TIMERS; i++) {
+        ids[i] = timer_wheel_add(w, deadlines[i], 0, on_fire, NULL);
+    }
+    for (int i = TIMERS - 1; i > 0; i--) {
+        int j = (int)(fixture_rand(&state) % (uint64_t)(i + 1));
+        timer_wheel_id_t t = ids[i];
+        ids[i] = ids[j];
+        ids[j] = t;
+    }
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < TIMERS; i++) {
+        timer_wheel_cancel(w, ids[i]);
+    }
+    bench_report("timer_wheel/cancel", TIMERS, bench_now_ns() - start, 0);
+    timer_wheel_free(w);
+
+    periodic_day();
+    return 0;
+}
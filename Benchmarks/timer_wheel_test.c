@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TimerWheel.h"
+#include "check.h"
+#include "fixtures.h"
+#include <string.h>
+#include <unistd.h>
+
+#define TIMERS 20000
+
+typedef struct {
+    int64_t deadline;
+    int64_t slack;
+    int64_t fired_at;       // -1 until fired.
+    timer_wheel_id_t id;
+    int cancelled;
+} model_t;
+
+static model_t model[TIMERS];
+static int64_t clock_ms;
+static int64_t last_fired;
+
+static void on_fire(void *ctx) {
+    model_t *m = ctx;
+    CHECK(m->fired_at < 0);
+    CHECK(!m->cancelled);
+    m->fired_at = clock_ms;
+    // Timers fire in expiry order.
+    CHECK(last_fired <= clock_ms);
+    last_fired = clock_ms;
+}
+
+static void test_fires_within_window_across_levels(void) {
+    uint64_t state = 7;
+    const int64_t tick = 10;
+    clock_ms = 1000;
+    last_fired = 0;
+    timer_wheel_t *w = timer_wheel_new(tick, clock_ms);
+
+    for (int i = 0; i < TIMERS; i++) {
+        // Deadlines from the past up to ~100 days out, so that every level is used.
+        uint64_t r = fixture_rand(&state);
+        int64_t span = INT64_C(1) << (r % 34);
+        model[i].deadline = clock_ms - 50 + (int64_t)(fixture_rand(&state) % (uint64_t)span);
+        model[i].slack = (r >> 8) % 4 == 0 ? 0 : (int64_t)((r >> 16) % 5000);
+        model[i].fired_at = -1;
+        model[i].cancelled = 0;
+        model[i].id = timer_wheel_add(w, model[i].deadline, model[i].slack, on_fire, &model[i]);
+        CHECK(model[i].id != 0);
+    }
+    CHECK_EQ_INT(timer_wheel_count(w), TIMERS);
+
+    // Cancel every tenth timer.
+    for (int i = 0; i < TIMERS; i += 10) {
+        CHECK_EQ_INT(timer_wheel_cancel(w, model[i].id), 0);
+        CHECK_EQ_INT(timer_wheel_cancel(w, model[i].id), -1);
+        model[i].cancelled = 1;
+    }
+
+    // Drive the wheel the way the driver does: jump straight to the next expiry,
+    // interleaved with some random short advances.
+    int64_t next;
+    while (timer_wheel_next_expiry(w, &next) == 0) {
+        // The reported expiry matches the earliest pending timer's window.
+        int64_t min_deadline = INT64_MAX;
+        for (int i = 0; i < TIMERS; i++) {
+            if (!model[i].cancelled && model[i].fired_at < 0 && model[i].deadline < min_deadline) {
+                min_deadline = model[i].deadline;
+            }
+        }
+        CHECK(next > clock_ms);
+        CHECK(next >= min_deadline);
+
+        if (fixture_rand(&state) % 4 == 0 && next - clock_ms > 1) {
+            clock_ms += 1 + (int64_t)(fixture_rand(&state) % (uint64_t)(next - clock_ms - 1));
+            CHECK_EQ_INT(timer_wheel_advance(w, clock_ms), 0);
+        } else {
+            clock_ms = next;
+            CHECK(timer_wheel_advance(w, clock_ms) > 0);
+        }
+    }
+
+    for (int i = 0; i < TIMERS; i++) {
+        if (model[i].cancelled) {
+            CHECK(model[i].fired_at < 0);
+            continue;
+        }
+        CHECK(model[i].fired_at >= 0);
+        int64_t earliest = model[i].deadline < 1000 ? 1000 : model[i].deadline;
+        CHECK(model[i].fired_at >= earliest);
+        CHECK(model[i].fired_at <= earliest + model[i].slack + tick);
+        CHECK_EQ_INT(timer_wheel_cancel(w, model[i].id), -1);
+    }
+    CHECK_EQ_INT(timer_wheel_count(w), 0);
+    timer_wheel_free(w);
+}
+
+static int fired_count;
+
+static void count_fire(void *ctx) {
+    fired_count++;
+}
+
+static void test_slack_coalesces(void) {
+    timer_wheel_t *w = timer_wheel_new(1, 0);
+    fired_count = 0;
+
+    // 100 deadlines spread over 100ms, each allowed to be 128ms late, share at most two ticks.
+    for (int i = 0; i < 100; i++) {
+        timer_wheel_add(w, 1000 + i, 128, count_fire, NULL);
+    }
+    int wakeups = 0;
+    int64_t next;
+    while (timer_wheel_next_expiry(w, &next) == 0) {
+        CHECK(next >= 1000 && next <= 1099 + 128);
+        timer_wheel_advance(w, next);
+        wakeups++;
+    }
+    CHECK_EQ_INT(fired_count, 100);
+    CHECK(wakeups <= 2);
+
+    // Without slack every deadline is its own wakeup.
+    for (int i = 0; i < 100; i++) {
+        timer_wheel_add(w, 2000 + i, 0, count_fire, NULL);
+    }
+    wakeups = 0;
+    while (timer_wheel_next_expiry(w, &next) == 0) {
+        timer_wheel_advance(w, next);
+        wakeups++;
+    }
+    CHECK_EQ_INT(wakeups, 100);
+    timer_wheel_free(w);
+}
+
+typedef struct {
+    timer_wheel_t *wheel;
+    timer_wheel_id_t victim;
+    int rescheduled;
+    int victim_fired;
+} reentrant_t;
+
+static void victim_fire(void *ctx) {
+    ((reentrant_t *)ctx)->victim_fired = 1;
+}
+
+static void periodic_fire(void *ctx) {
+    reentrant_t *r = ctx;
+    // Cancel a timer due on the same tick, and reschedule ourselves.
+    timer_wheel_cancel(r->wheel, r->victim);
+    if (++r->rescheduled < 5) {
+        timer_wheel_add(r->wheel, 100 * (r->rescheduled + 1), 0, periodic_fire, r);
+    }
+}
+
+static void test_callbacks_add_and_cancel(void) {
+    reentrant_t r = { 0 };
+    r.wheel = timer_wheel_new(1, 0);
+    // The periodic timer is added last, so it fires first from its slot and cancels the victim.
+    r.victim = timer_wheel_add(r.wheel, 100, 0, victim_fire, &r);
+    timer_wheel_add(r.wheel, 100, 0, periodic_fire, &r);
+
+    CHECK_EQ_INT(timer_wheel_advance(r.wheel, 10000), 5);
+    CHECK_EQ_INT(r.rescheduled, 5);
+    CHECK_EQ_INT(r.victim_fired, 0);
+    CHECK_EQ_INT(timer_wheel_count(r.wheel), 0);
+    timer_wheel_free(r.wheel);
+}
+
+static volatile int driver_fired;
+
+static void driver_fire(void *ctx) {
+    __atomic_add_fetch(&driver_fired, (int)(intptr_t)ctx, __ATOMIC_SEQ_CST);
+}
+
+static void test_driver(void) {
+    timer_wheel_driver_t *d = timer_wheel_driver_new(1);
+    CHECK(d != NULL);
+    timer_wheel_driver_add(d, 20, 10, driver_fire, (void *)1);
+    timer_wheel_driver_add(d, 25, 10, driver_fire, (void *)2);
+    timer_wheel_id_t cancelled = timer_wheel_driver_add(d, 30, 0, driver_fire, (void *)100);
+    timer_wheel_driver_add(d, 3600 * 1000, 0, driver_fire, (void *)1000);
+    CHECK_EQ_INT(timer_wheel_driver_cancel(d, cancelled), 0);
+
+    for (int i = 0; i < 200 && __atomic_load_n(&driver_fired, __ATOMIC_SEQ_CST) != 3; i++) {
+        usleep(5000);
+    }
+    usleep(20000);
+    CHECK_EQ_INT(driver_fired, 3);
+    // One wakeup per add that moved the deadline earlier, plus at most one per expiry.
+    CHECK(timer_wheel_driver_wakeups(d) <= 6);
+    timer_wheel_driver_free(d);
+}
+
+int main(void) {
+    RUN_TEST(test_fires_within_window_across_levels);
+    RUN_TEST(test_slack_coalesces);
+    RUN_TEST(test_callbacks_add_and_cancel);
+    RUN_TEST(test_driver);
+    return 0;
+}
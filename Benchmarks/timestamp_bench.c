@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The vendored c-timestamp functions over two corpora: the RFC3339Milli UTC timestamps of notices,
+ * which is what the app parses most, and a mix of the RFC 3339 variants it accepts.
+ */
+
+#include "bench.h"
+#include "fixtures.h"
+#include "timestamp.h"
+#include <string.h>
+
+#define COUNT 100000
+#define TIMESTAMP_LEN 40
+
+static volatile int64_t sink;
+
+static void run_parse(const char *name, char (*corpus)[TIMESTAMP_LEN], size_t *lens, timestamp_t *parsed) {
+    size_t bytes = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        if (timestamp_parse(corpus[i], lens[i], &parsed[i]) != 0) {
+            fprintf(stderr, "failed to parse %s\n", corpus[i]);
+            exit(1);
+        }
+        bytes += lens[i];
+    }
+    bench_report(name, COUNT, bench_now_ns() - start, bytes);
+}
+
+int main(void) {
+    char (*milli)[TIMESTAMP_LEN] = malloc(COUNT * TIMESTAMP_LEN);
+    char (*variants)[TIMESTAMP_LEN] = malloc(COUNT * TIMESTAMP_LEN);
+    size_t *milli_lens = malloc(COUNT * sizeof(size_t)), *variant_lens = malloc(COUNT * sizeof(size_t));
+    timestamp_t *parsed = malloc(COUNT * sizeof(timestamp_t));
+
+    uint64_t state = 60;
+    int64_t unix_ms = 1514764800000;
+    for (size_t i = 0; i < COUNT; i++) {
+        unix_ms += 1 + (int64_t)(fixture_rand(&state) % 5000);
+        milli_lens[i] = fixture_timestamp(milli[i], TIMESTAMP_LEN, unix_ms, 0);
+        variant_lens[i] = fixture_timestamp_variant(&state, variants[i], TIMESTAMP_LEN, unix_ms);
+    }
+
+    run_parse("timestamp/parse/variants", variants, variant_lens, parsed);
+    run_parse("timestamp/parse/rfc3339_milli", milli, milli_lens, parsed);
+
+    char buf[TIMESTAMP_LEN];
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        sink += timestamp_format_precision(buf, sizeof(buf), &parsed[i], 3);
+    }
+    bench_report("timestamp/format_precision_3", COUNT, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        sink += timestamp_format(buf, sizeof(buf), &parsed[i]);
+    }
+    bench_report("timestamp/format", COUNT, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (size_t i = 1; i < COUNT; i++) {
+        sink += timestamp_compare(&parsed[i - 1], &parsed[i]);
+    }
+    bench_report("timestamp/compare", COUNT - 1, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        sink += timestamp_valid(&parsed[i]);
+    }
+    bench_report("timestamp/valid", COUNT, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        struct tm tm;
+        sink += timestamp_to_tm_utc(&parsed[i], &tm)->tm_mday;
+    }
+    bench_report("timestamp/to_tm_utc", COUNT, bench_now_ns() - start, 0);
+
+    free(milli);
+    free(variants);
+    free(milli_lens);
+    free(variant_lens);
+    free(parsed);
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Storing log timestamps in a timestamp column rather than as the RFC3339Milli strings of the notice
+ * files: bytes per timestamp for several block lengths, and the time to encode, decode, format back
+ * to strings and reach a random timestamp, against formatting and parsing the strings. Two sequences:
+ * the bursty notice stream of the fixtures, and samples once a second with a few ms of jitter.
+ */
+
+#include "TimestampColumn.h"
+#include "bench.h"
+#include "fixtures.h"
+#include <string.h>
+
+#define COUNT 200000
+#define PRECISION 3     // RFC3339Milli, like NSDate+PSIDateExtension.
+#define RANDOM_READS 100000
+
+static volatile long sink;
+
+static void fail(const char *what) {
+    fprintf(stderr, "%s failed\n", what);
+    exit(1);
+}
+
+static void notices(timestamp_t *ts) {
+    uint64_t state = 73;
+    int64_t now_ms = 1514764800000;
+    for (size_t i = 0; i < COUNT; i++) {
+        fixture_notice_t n;
+        fixture_notice(&state, &now_ms, &n);
+        if (timestamp_parse(n.timestamp, strlen(n.timestamp), &ts[i]) != 0) {
+            fail("timestamp_parse");
+        }
+    }
+}
+
+static void samples(timestamp_t *ts) {
+    uint64_t state = 74;
+    int64_t start_ms = 1514764800000;
+    for (size_t i = 0; i < COUNT; i++) {
+        int64_t ms = start_ms + (int64_t)i * 1000 + (int64_t)(fixture_rand(&state) % 7);
+        ts[i] = (timestamp_t){ ms / 1000, (int32_t)(ms % 1000) * 1000000, -240 };
+    }
+}
+
+static timestamp_column_t * encode(const timestamp_t *ts, size_t block_len) {
+    timestamp_column_t *c = timestamp_column_new(block_len);
+    for (size_t i = 0; i < COUNT; i++) {
+        if (timestamp_column_append(c, &ts[i]) != 0) {
+            fail("timestamp_column_append");
+        }
+    }
+    if (timestamp_column_flush(c) != 0) {
+        fail("timestamp_column_flush");
+    }
+    return c;
+}
+
+static void run(const char *sequence, const timestamp_t *ts) {
+    static const size_t block_lens[] = { 16, 128, 1024 };
+    char name[128];
+    char (*strings)[TIMESTAMP_COLUMN_STRING_LEN] = malloc(COUNT * sizeof(*strings));
+    timestamp_t *decoded = malloc(COUNT * sizeof(*decoded));
+
+    // Baseline: the strings the notice files store.
+    size_t string_bytes = 0;
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        string_bytes += timestamp_format_precision(strings[i], sizeof(strings[i]), &ts[i], PRECISION);
+    }
+    snprintf(name, sizeof(name), "timestamp_column/%s/format_strings", sequence);
+    bench_report(name, COUNT, bench_now_ns() - start, 0);
+    snprintf(name, sizeof(name), "timestamp_column/%s/string_bytes_per_timestamp", sequence);
+    bench_counter(name, (double)string_bytes / COUNT, "B");
+
+    start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        if (timestamp_parse(strings[i], strlen(strings[i]), &decoded[i]) != 0) {
+            fail("timestamp_parse");
+        }
+    }
+    snprintf(name, sizeof(name), "timestamp_column/%s/parse_strings", sequence);
+    bench_report(name, COUNT, bench_now_ns() - start, 0);
+
+    for (size_t b = 0; b < sizeof(block_lens) / sizeof(block_lens[0]); b++) {
+        size_t block_len = block_lens[b];
+        start = bench_now_ns();
+        timestamp_column_t *c = encode(ts, block_len);
+        snprintf(name, sizeof(name), "timestamp_column/%s/%zu/encode", sequence, block_len);
+        bench_report(name, COUNT, bench_now_ns() - start, 0);
+
+        size_t len;
+        timestamp_column_data(c, &len);
+        snprintf(name, sizeof(name), "timestamp_column/%s/%zu/bytes_per_timestamp", sequence, block_len);
+        bench_counter(name, (double)len / COUNT, "B");
+
+        start = bench_now_ns();
+        if (timestamp_column_decode(c, 0, COUNT, decoded) != COUNT) {
+            fail("timestamp_column_decode");
+        }
+        snprintf(name, sizeof(name), "timestamp_column/%s/%zu/decode", sequence, block_len);
+        bench_report(name, COUNT, bench_now_ns() - start, 0);
+        if (memcmp(decoded, ts, COUNT * sizeof(*ts)) != 0) {
+            fail("round trip");
+        }
+
+        start = bench_now_ns();
+        if (timestamp_column_format(c, 0, COUNT, PRECISION, strings[0], sizeof(strings[0])) != COUNT) {
+            fail("timestamp_column_format");
+        }
+        snprintf(name, sizeof(name), "timestamp_column/%s/%zu/format", sequence, block_len);
+        bench_report(name, COUNT, bench_now_ns() - start, 0);
+
+        uint64_t state = 75;
+        start = bench_now_ns();
+        for (int i = 0; i < RANDOM_READS; i++) {
+            timestamp_t one;
+            timestamp_column_decode(c, fixture_rand(&state) % COUNT, 1, &one);
+            sink += one.nsec;
+        }
+        snprintf(name, sizeof(name), "timestamp_column/%s/%zu/random_read", sequence, block_len);
+        bench_report(name, RANDOM_READS, bench_now_ns() - start, 0);
+
+        timestamp_column_free(c);
+    }
+
+    free(decoded);
+    free(strings);
+}
+
+int main(void) {
+    timestamp_t *ts = malloc(COUNT * sizeof(*ts));
+    notices(ts);
+    run("notices", ts);
+    samples(ts);
+    run("samples", ts);
+    free(ts);
+    return 0;
+}
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TimestampColumn.h"
+#include "check.h"
+#include "fixtures.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define MIN_SEC INT64_C(-62135596800)   // 0001-01-01T00:00:00Z
+#define MAX_SEC INT64_C(253402300799)   // 9999-12-31T23:59:59Z
+
+static bool same(const timestamp_t *a, const timestamp_t *b) {
+    return a->sec == b->sec && a->nsec == b->nsec && a->offset == b->offset;
+}
+
+// Timestamps of several shapes: log lines a few ms apart, mixed precisions, out of order, offset changes,
+// and jumps across the whole range.
+static size_t generate(uint64_t *state, timestamp_t *ts, size_t count) {
+    int64_t now_ms = 1514764800000;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t r = fixture_rand(state);
+        switch (r % 16) {
+            case 0:     // Anywhere in the range.
+                ts[i].sec = MIN_SEC + (int64_t)(fixture_rand(state) % (uint64_t)(MAX_SEC - MIN_SEC + 1));
+                ts[i].nsec = (int32_t)(fixture_rand(state) % 1000000000);
+                ts[i].offset = (int16_t)((int)(fixture_rand(state) % 2879) - 1439);
+                continue;
+            case 1:     // Backwards.
+                now_ms -= (int64_t)(fixture_rand(state) % 100000);
+                break;
+            default: {
+                fixture_notice_t n;
+                fixture_notice(state, &now_ms, &n);
+            }
+        }
+        ts[i].sec = now_ms / 1000 - (now_ms % 1000 < 0);
+        ts[i].nsec = (int32_t)((now_ms % 1000 + 1000) % 1000) * 1000000;
+        ts[i].offset = (r >> 8) % 64 == 0 ? 60 : -240;
+        if ((r >> 16) % 32 == 0) {
+            ts[i].nsec += (int32_t)(fixture_rand(state) % 1000000);  // Microseconds or nanoseconds.
+        } else if ((r >> 16) % 32 == 1) {
+            ts[i].nsec = 0;
+        }
+    }
+    return count;
+}
+
+static void test_encoding(void) {
+    static const uint8_t expected[] = {
+        0x0d,                               // Length of the block's body.
+        0x01, 0x04, 0xdf, 0x03,             // Milliseconds, 4 timestamps, -04:00.
+        0x80, 0xe8, 0xcb, 0xa4, 0x0b, 0x00, // 2018-01-01T00:00:00.000Z
+        0x0a, 0x00, 0x05,                   // +5 ms, +5 ms, +2 ms.
+    };
+    timestamp_column_t *c = timestamp_column_new(128);
+    int64_t ms[] = { 0, 5, 10, 12 };
+    for (int i = 0; i < 4; i++) {
+        timestamp_t ts = { 1514764800, (int32_t)ms[i] * 1000000, -240 };
+        CHECK_EQ_INT(timestamp_column_append(c, &ts), 0);
+    }
+    size_t len;
+    timestamp_column_data(c, &len);
+    CHECK_EQ_INT(len, 0);
+    CHECK_EQ_INT(timestamp_column_count(c), 4);
+    CHECK_EQ_INT(timestamp_column_block_count(c), 1);
+    CHECK_EQ_INT(timestamp_column_flush(c), 0);
+    const uint8_t *data = timestamp_column_data(c, &len);
+    CHECK_EQ_INT(len, sizeof(expected));
+    CHECK(memcmp(data, expected, len) == 0);
+
+    char s[4][TIMESTAMP_COLUMN_STRING_LEN];
+    CHECK_EQ_INT(timestamp_column_format(c, 0, 4, 3, s[0], sizeof(s[0])), 4);
+    CHECK(strcmp(s[0], "2017-12-31T20:00:00.000-04:00") == 0);
+    CHECK(strcmp(s[3], "2017-12-31T20:00:00.012-04:00") == 0);
+    CHECK_EQ_INT(timestamp_column_format(c, 0, 4, 10, s[0], sizeof(s[0])), 0);
+    CHECK_EQ_INT(timestamp_column_format(c, 0, 4, 3, s[0], 20), 0);
+
+    // An offset change starts a new block, and invalid timestamps are rejected.
+    timestamp_t utc = { 1514764800, 0, 0 }, invalid = { 1514764800, 1000000000, 0 };
+    CHECK_EQ_INT(timestamp_column_append(c, &utc), 0);
+    CHECK_EQ_INT(timestamp_column_append(c, &utc), 0);
+    utc.offset = 60;
+    CHECK_EQ_INT(timestamp_column_append(c, &utc), 0);
+    CHECK_EQ_INT(timestamp_column_append(c, &invalid), -1);
+    CHECK_EQ_INT(timestamp_column_count(c), 7);
+    CHECK_EQ_INT(timestamp_column_block_count(c), 3);
+    size_t first, count;
+    CHECK_EQ_INT(timestamp_column_block(c, 1, &first, &count), 0);
+    CHECK_EQ_INT(first, 4);
+    CHECK_EQ_INT(count, 2);
+    CHECK_EQ_INT(timestamp_column_block(c, 2, &first, &count), 0);
+    CHECK_EQ_INT(first, 6);
+    CHECK_EQ_INT(count, 1);
+    CHECK_EQ_INT(timestamp_column_block(c, 3, &first, &count), -1);
+    CHECK_EQ_INT(timestamp_column_block_of(c, 5), 1);
+    CHECK_EQ_INT(timestamp_column_block_of(c, 6), 2);
+    CHECK_EQ_INT(timestamp_column_block_of(c, 7), -1);
+    timestamp_column_free(c);
+
+    CHECK(timestamp_column_new(0) == NULL);
+    CHECK(timestamp_column_new(TIMESTAMP_COLUMN_MAX_BLOCK_LEN + 1) == NULL);
+}
+
+// Checks every way of reading c against ts.
+static void check_column(const timestamp_column_t *c, const timestamp_t *ts, size_t count, uint64_t *state) {
+    CHECK_EQ_INT(timestamp_column_count(c), count);
+    timestamp_t *out = malloc((count + 1) * sizeof(*out));
+    CHECK_EQ_INT(timestamp_column_decode(c, 0, count + 10, out), count);
+    for (size_t i = 0; i < count; i++) {
+        CHECK(same(&out[i], &ts[i]));
+    }
+
+    size_t expected_first = 0;
+    for (size_t b = 0; b < timestamp_column_block_count(c); b++) {
+        size_t first, n;
+        CHECK_EQ_INT(timestamp_column_block(c, b, &first, &n), 0);
+        CHECK_EQ_INT(first, expected_first);
+        CHECK(n > 0);
+        CHECK_EQ_INT(timestamp_column_block_of(c, first), b);
+        CHECK_EQ_INT(timestamp_column_block_of(c, first + n - 1), b);
+        expected_first += n;
+    }
+    CHECK_EQ_INT(expected_first, count);
+
+    char (*s)[TIMESTAMP_COLUMN_STRING_LEN] = malloc((count + 1) * sizeof(*s));
+    for (int i = 0; i < 50 && count > 0; i++) {
+        size_t first = fixture_rand(state) % count, n = fixture_rand(state) % 300;
+        size_t expected = first + n > count ? count - first : n;
+        CHECK_EQ_INT(timestamp_column_decode(c, first, n, out), expected);
+        for (size_t j = 0; j < expected; j++) {
+            CHECK(same(&out[j], &ts[first + j]));
+        }
+
+        int precision = (int)(fixture_rand(state) % 10);
+        CHECK_EQ_INT(timestamp_column_format(c, first, n, precision, s[0], sizeof(s[0])), expected);
+        for (size_t j = 0; j < expected; j++) {
+            char e[TIMESTAMP_COLUMN_STRING_LEN];
+            CHECK(timestamp_format_precision(e, sizeof(e), &ts[first + j], precision) > 0);
+            if (strcmp(e, s[j]) != 0) {
+                fprintf(stderr, "%s != %s\n", s[j], e);
+                CHECK(false);
+            }
+        }
+    }
+    CHECK_EQ_INT(timestamp_column_decode(c, count, 1, out), 0);
+    free(s);
+    free(out);
+}
+
+static void test_round_trip(void) {
+    static const size_t block_lens[] = { 1, 3, 128, 4096 };
+    uint64_t state = 73;
+    size_t count = 20000;
+    timestamp_t *ts = malloc(count * sizeof(*ts));
+    generate(&state, ts, count);
+
+    for (size_t b = 0; b < sizeof(block_lens) / sizeof(block_lens[0]); b++) {
+        timestamp_column_t *c = timestamp_column_new(block_lens[b]);
+        for (size_t i = 0; i < count; i++) {
+            CHECK_EQ_INT(timestamp_column_append(c, &ts[i]), 0);
+            if (i == 1000) {
+                // Part of the current block is read from memory.
+                check_column(c, ts, i + 1, &state);
+            }
+        }
+        check_column(c, ts, count, &state);
+        CHECK_EQ_INT(timestamp_column_flush(c), 0);
+        check_column(c, ts, count, &state);
+
+        // Stored and loaded, then appended to.
+        size_t len;
+        const uint8_t *data = timestamp_column_data(c, &len);
+        timestamp_column_t *loaded = timestamp_column_load(data, len, block_lens[b]);
+        CHECK(loaded != NULL);
+        CHECK_EQ_INT(timestamp_column_block_count(loaded), timestamp_column_block_count(c));
+        check_column(loaded, ts, count, &state);
+        timestamp_t more[100];
+        generate(&state, more, 100);
+        timestamp_t *all = malloc((count + 100) * sizeof(*all));
+        memcpy(all, ts, count * sizeof(*ts));
+        memcpy(all + count, more, sizeof(more));
+        for (int i = 0; i < 100; i++) {
+            CHECK_EQ_INT(timestamp_column_append(loaded, &more[i]), 0);
+        }
+        check_column(loaded, all, count + 100, &state);
+        CHECK(timestamp_column_memory(loaded) > len);
+        free(all);
+        timestamp_column_free(loaded);
+        timestamp_column_free(c);
+    }
+    free(ts);
+
+    // The extremes of the range, within one block and across blocks.
+    timestamp_t extremes[] = {
+        { MIN_SEC, 0, 0 }, { MAX_SEC, 999999999, 0 }, { MIN_SEC, 1, 0 }, { MIN_SEC + 1, 0, 0 },
+        { MAX_SEC - INT32_MAX, 0, 0 }, { MAX_SEC, 999999999, 0 }, { MAX_SEC, 0, 0 },
+    };
+    size_t n = sizeof(extremes) / sizeof(extremes[0]);
+    timestamp_column_t *c = timestamp_column_new(64);
+    for (size_t i = 0; i < n; i++) {
+        CHECK_EQ_INT(timestamp_column_append(c, &extremes[i]), 0);
+    }
+    CHECK_EQ_INT(timestamp_column_flush(c), 0);
+    CHECK_EQ_INT(timestamp_column_block_count(c), 4);
+    check_column(c, extremes, n, &state);
+    timestamp_column_free(c);
+}
+
+static void test_malformed(void) {
+    uint64_t state = 74;
+    size_t count = 2000;
+    timestamp_t *ts = malloc(count * sizeof(*ts));
+    generate(&state, ts, count);
+    timestamp_column_t *c = timestamp_column_new(50);
+    for (size_t i = 0; i < count; i++) {
+        timestamp_column_append(c, &ts[i]);
+    }
+    timestamp_column_flush(c);
+    size_t len;
+    const uint8_t *data = timestamp_column_data(c, &len);
+    uint8_t *copy = malloc(len);
+    timestamp_t *out = malloc(count * sizeof(*out));
+
+    // Truncated data loads only if it ends at a block boundary.
+    for (size_t i = 0; i < 500; i++) {
+        size_t cut = fixture_rand(&state) % len;
+        timestamp_column_t *t = timestamp_column_load(data, cut, 50);
+        if (t != NULL) {
+            size_t n = timestamp_column_count(t);
+            CHECK(n < count);
+            CHECK_EQ_INT(timestamp_column_decode(t, 0, n, out), n);
+            for (size_t j = 0; j < n; j++) {
+                CHECK(same(&out[j], &ts[j]));
+            }
+            timestamp_column_free(t);
+        }
+    }
+
+    // Corrupted data either fails to load or decodes to valid timestamps.
+    for (size_t i = 0; i < 2000; i++) {
+        memcpy(copy, data, len);
+        for (int j = 0; j < 1 + (int)(i % 4); j++) {
+            copy[fixture_rand(&state) % len] = (uint8_t)fixture_rand(&state);
+        }
+        timestamp_column_t *t = timestamp_column_load(copy, len, 50);
+        if (t != NULL) {
+            size_t n = timestamp_column_count(t);
+            timestamp_t *decoded = malloc((n + 1) * sizeof(*decoded));
+            CHECK_EQ_INT(timestamp_column_decode(t, 0, n, decoded), n);
+            for (size_t j = 0; j < n; j++) {
+                CHECK(timestamp_valid(&decoded[j]));
+            }
+            free(decoded);
+            timestamp_column_free(t);
+        }
+    }
+
+    static const uint8_t overlong[] = { 0x0b, 0x04, 0x01, 0x00, 0x00, 0x00, 0x00 };
+    CHECK(timestamp_column_load(overlong, sizeof(overlong), 50) == NULL);
+    static const uint8_t empty_block[] = { 0x05, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    CHECK(timestamp_column_load(empty_block, sizeof(empty_block), 50) == NULL);
+    static const uint8_t trailing[] = { 0x06, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00 };
+    CHECK(timestamp_column_load(trailing, sizeof(trailing), 50) == NULL);
+    static const uint8_t one[] = { 0x05, 0x00, 0x01, 0x00, 0x00, 0x00 };
+    timestamp_column_t *t = timestamp_column_load(one, sizeof(one), 50);
+    CHECK(t != NULL);
+    CHECK_EQ_INT(timestamp_column_count(t), 1);
+    timestamp_column_free(t);
+
+    free(out);
+    free(copy);
+    free(ts);
+    timestamp_column_free(c);
+}
+
+int main(void) {
+    RUN_TEST(test_encoding);
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_malformed);
+    return 0;
+}
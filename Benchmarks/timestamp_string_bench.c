@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Sorting 1M log timestamps, as collected from the three log files, by comparing the strings directly
+ * against parsing both sides of each comparison and against parsing each timestamp once up front.
+ * Once with RFC3339Milli UTC timestamps throughout, and once with a quarter of them at UTC-4, where
+ * comparisons across offsets fall back to parsing. Then validation against parsing.
+ */
+
+#include "TimestampString.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "timestamp.h"
+#include <string.h>
+
+#define COUNT 1000000
+#define TIMESTAMP_LEN 40
+#define RUNS 3
+
+typedef struct {
+    const char *s;
+    size_t len;
+} entry_t;
+
+typedef struct {
+    timestamp_t ts;
+    const char *s;
+} parsed_t;
+
+static volatile long sink;
+
+static int compare_str(const void *a, const void *b) {
+    const entry_t *x = a, *y = b;
+    int result = 0;
+    if (timestamp_compare_str(x->s, x->len, y->s, y->len, &result) != 0) {
+        exit(1);
+    }
+    return result;
+}
+
+static int compare_parsing(const void *a, const void *b) {
+    const entry_t *x = a, *y = b;
+    timestamp_t tx, ty;
+    if (timestamp_parse(x->s, x->len, &tx) != 0 || timestamp_parse(y->s, y->len, &ty) != 0) {
+        exit(1);
+    }
+    return timestamp_compare(&tx, &ty);
+}
+
+static int compare_parsed(const void *a, const void *b) {
+    return timestamp_compare(&((const parsed_t *)a)->ts, &((const parsed_t *)b)->ts);
+}
+
+// Three sorted runs, one per log file, of interleaved times.
+static void make_corpus(char (*corpus)[TIMESTAMP_LEN], entry_t *entries, int offset_percent) {
+    uint64_t state = 68;
+    int64_t now_ms[RUNS] = { 1514764800000, 1514764800000, 1514764800000 };
+    for (size_t i = 0; i < COUNT; i++) {
+        int run = (int)(i * RUNS / COUNT);
+        now_ms[run] += 1 + (int64_t)(fixture_rand(&state) % 3000);
+        int offset = (int)(fixture_rand(&state) % 100) < offset_percent ? -240 : 0;
+        entries[i].s = corpus[i];
+        entries[i].len = fixture_timestamp(corpus[i], TIMESTAMP_LEN, now_ms[run], offset);
+    }
+}
+
+static void check_sorted(const entry_t *entries) {
+    for (size_t i = 1; i < COUNT; i++) {
+        if (compare_parsing(&entries[i - 1], &entries[i]) > 0) {
+            fprintf(stderr, "not sorted at %zu\n", i);
+            exit(1);
+        }
+    }
+}
+
+static void run(const char *name, int offset_percent) {
+    char (*corpus)[TIMESTAMP_LEN] = malloc(COUNT * TIMESTAMP_LEN);
+    entry_t *entries = malloc(COUNT * sizeof(entry_t));
+    parsed_t *parsed = malloc(COUNT * sizeof(parsed_t));
+    char label[128];
+
+    make_corpus(corpus, entries, offset_percent);
+    uint64_t start = bench_now_ns();
+    qsort(entries, COUNT, sizeof(entry_t), compare_parsing);
+    snprintf(label, sizeof(label), "timestamp_string/%s/sort_parsing_comparator", name);
+    bench_report(label, COUNT, bench_now_ns() - start, 0);
+    check_sorted(entries);
+
+    make_corpus(corpus, entries, offset_percent);
+    start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        if (timestamp_parse(entries[i].s, entries[i].len, &parsed[i].ts) != 0) {
+            exit(1);
+        }
+        parsed[i].s = entries[i].s;
+    }
+    qsort(parsed, COUNT, sizeof(parsed_t), compare_parsed);
+    snprintf(label, sizeof(label), "timestamp_string/%s/sort_parsed_once", name);
+    bench_report(label, COUNT, bench_now_ns() - start, 0);
+
+    make_corpus(corpus, entries, offset_percent);
+    start = bench_now_ns();
+    qsort(entries, COUNT, sizeof(entry_t), compare_str);
+    snprintf(label, sizeof(label), "timestamp_string/%s/sort_compare_str", name);
+    bench_report(label, COUNT, bench_now_ns() - start, 0);
+    check_sorted(entries);
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < COUNT; i++) {
+        bytes += entries[i].len;
+    }
+    start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        sink += timestamp_valid_str(entries[i].s, entries[i].len);
+    }
+    snprintf(label, sizeof(label), "timestamp_string/%s/valid_str", name);
+    bench_report(label, COUNT, bench_now_ns() - start, bytes);
+
+    start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        timestamp_t ts;
+        sink += timestamp_parse(entries[i].s, entries[i].len, &ts);
+    }
+    snprintf(label, sizeof(label), "timestamp_string/%s/parse", name);
+    bench_report(label, COUNT, bench_now_ns() - start, bytes);
+
+    free(corpus);
+    free(entries);
+    free(parsed);
+}
+
+int main(void) {
+    run("utc", 0);
+    run("mixed_offsets", 25);
+    return 0;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TimestampString.h"
+#include "check.h"
+#include "fixtures.h"
+#include "timestamp.h"
+#include <string.h>
+
+// Room past the end of every string: timestamp_parse can read a few bytes past a truncated offset.
+#define BUF_LEN 64
+
+static bool reference_valid(const char *s, size_t len) {
+    timestamp_t t;
+    return timestamp_parse(s, len, &t) == 0;
+}
+
+static int reference_compare(const char *s1, size_t len1, const char *s2, size_t len2) {
+    timestamp_t t1, t2;
+    CHECK(timestamp_parse(s1, len1, &t1) == 0 && timestamp_parse(s2, len2, &t2) == 0);
+    return timestamp_compare(&t1, &t2);
+}
+
+typedef struct {
+    int year, month, day, hour, minute, second;
+    int fraction;               // Index in fractions.
+    int zone;                   // Index in zones.
+} fields_t;
+
+// Fractions and zones, each row being one value written different ways.
+static const char *fractions[][3] = {
+    { "", ".0", ".000000000" }, { ".5", ".50", ".500000000" }, { ".000000001", ".000000001", ".000000001" },
+    { ".123", ".1230", ".12300" }, { ".999999999", ".999999999", ".999999999" } };
+static const char *zones[][4] = {
+    { "Z", "z", "+00:00", "-00:00" }, { "+01:00", "+01:00", "+01:00", "+01:00" },
+    { "-04:00", "-04:00", "-04:00", "-04:00" }, { "+23:59", "+23:59", "+23:59", "+23:59" } };
+
+// Random fields from a small set of values for each, so that equal instants are common.
+static void random_fields(uint64_t *state, fields_t *f) {
+    static const int years[] = { 1, 2000, 2018, 2100, 9999 };
+    uint64_t r = fixture_rand(state);
+    f->year = years[r % 5];
+    f->month = (r >> 4) % 2 ? 2 : 12;
+    f->day = (f->month == 2 ? 27 : 29) + (int)((r >> 8) % 2);
+    f->hour = (int)((r >> 12) % 3) * 11;
+    f->minute = (int)((r >> 16) % 2) * 59;
+    f->second = (int)((r >> 20) % 2) * 59;
+    f->fraction = (int)((r >> 24) % 5);
+    f->zone = (int)((r >> 28) % 4);
+}
+
+// Writes the fields, choosing randomly between the ways of writing the separator, fraction and zone.
+static size_t format_fields(uint64_t *state, const fields_t *f, char *dst) {
+    static const char separators[] = "Tt ";
+    uint64_t r = fixture_rand(state);
+    int n = snprintf(dst, BUF_LEN, "%04d-%02d-%02d%c%02d:%02d:%02d%s%s", f->year, f->month, f->day,
+                     separators[r % 3], f->hour, f->minute, f->second, fractions[f->fraction][(r >> 4) % 3],
+                     zones[f->zone][(r >> 8) % 4]);
+    return (size_t)n;
+}
+
+static size_t random_timestamp(uint64_t *state, char *dst) {
+    fields_t f;
+    random_fields(state, &f);
+    return format_fields(state, &f, dst);
+}
+
+static void test_cases(void) {
+    static const char *valid[] = {
+        "2013-12-31T23:59:59Z", "2013-12-31t23:59:59z", "2013-12-31 23:59:59.1+00:00",
+        "0001-01-01T00:00:00.000000000-23:59", "9999-12-31T23:59:59.999999999+23:59",
+        "2000-02-29T12:00:00Z", "2018-02-28T00:00:00.123-04:00" };
+    static const char *invalid[] = {
+        "", "2013-12-31T23:59:59", "2013-12-31T23:59:5Z", "2013-12-31T23:59:60Z", "2013-12-31T24:00:00Z",
+        "2013-12-31T23:60:00Z", "2013-12-32T00:00:00Z", "2013-13-01T00:00:00Z", "2013-00-01T00:00:00Z",
+        "2013-12-00T00:00:00Z", "0000-01-01T00:00:00Z", "1900-02-29T00:00:00Z", "2013-04-31T00:00:00Z",
+        "2013-12-31X23:59:59Z", "2013/12/31T23:59:59Z", "2013-12-31T23-59-59Z", "2013-12-31T23:59:59.Z",
+        "2013-12-31T23:59:59.1234567890Z", "2013-12-31T23:59:59.1", "2013-12-31T23:59:59+24:00",
+        "2013-12-31T23:59:59+00:60", "2013-12-31T23:59:59+0000", "2013-12-31T23:59:59+00:0",
+        "2013-12-31T23:59:59+00:000", "2013-12-31T23:59:59ZZ", "2013-12-31T23:59:59 Z", "+013-12-31T23:59:59Z",
+        "2013-12-31T23:59:59.1 Z", "2013-12-31T2a:59:59Z" };
+
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+        char buf[BUF_LEN] = { 0 };
+        strcpy(buf, valid[i]);
+        CHECK(timestamp_valid_str(buf, strlen(buf)));
+        CHECK(reference_valid(buf, strlen(buf)));
+    }
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        char buf[BUF_LEN] = { 0 };
+        strcpy(buf, invalid[i]);
+        CHECK(!timestamp_valid_str(buf, strlen(buf)));
+        CHECK(!reference_valid(buf, strlen(buf)));
+    }
+
+    static const struct { const char *a, *b; int expected; } comparisons[] = {
+        { "2013-12-31T23:59:59.5Z", "2013-12-31T23:59:59.500000000Z", 0 },
+        { "2013-12-31T23:59:59Z", "2013-12-31T23:59:59.000z", 0 },
+        { "2013-12-31T23:59:59Z", "2013-12-31T23:59:59.000000001Z", -1 },
+        { "2013-12-31 23:59:59.1Z", "2013-12-31T23:59:59.09Z", 1 },
+        { "2013-12-31T23:59:59+01:00", "2013-12-31T22:59:59Z", 0 },
+        { "2013-12-31T23:59:59-01:00", "2014-01-01T00:59:59Z", 0 },
+        { "2014-01-01T00:00:00+05:30", "2013-12-31T23:00:00Z", -1 },
+        { "2013-12-31T23:59:59+00:00", "2013-12-31T23:59:59-00:00", 0 },
+        { "2013-12-31T23:59:59.2-04:00", "2013-12-31T23:59:59.10-04:00", 1 } };
+    for (size_t i = 0; i < sizeof(comparisons) / sizeof(comparisons[0]); i++) {
+        // Exact-size copies without a terminator, so that reads past the end are caught by AddressSanitizer.
+        size_t a_len = strlen(comparisons[i].a), b_len = strlen(comparisons[i].b);
+        char *a = malloc(a_len), *b = malloc(b_len);
+        memcpy(a, comparisons[i].a, a_len);
+        memcpy(b, comparisons[i].b, b_len);
+        int result = 2;
+        CHECK_EQ_INT(timestamp_compare_str(a, a_len, b, b_len, &result), 0);
+        CHECK_EQ_INT(result, comparisons[i].expected);
+        CHECK_EQ_INT(timestamp_compare_str(b, b_len, a, a_len, &result), 0);
+        CHECK_EQ_INT(result, -comparisons[i].expected);
+        free(a);
+        free(b);
+    }
+
+    int result = 2;
+    CHECK_EQ_INT(timestamp_compare_str(valid[0], strlen(valid[0]), invalid[1], strlen(invalid[1]), &result), -1);
+    CHECK_EQ_INT(timestamp_compare_str(invalid[1], strlen(invalid[1]), valid[0], strlen(valid[0]), &result), -1);
+    CHECK_EQ_INT(result, 2);
+}
+
+// Validity agrees with timestamp_parse on valid timestamps and on mutations of them.
+static void test_valid_property(void) {
+    static const char alphabet[] = "0123456789-:.TtZz+ x9\xff";
+    uint64_t state = 68;
+    int valid = 0, invalid = 0;
+    for (int i = 0; i < 300000; i++) {
+        char buf[BUF_LEN] = { 0 };
+        size_t len = random_timestamp(&state, buf);
+        uint64_t r = fixture_rand(&state);
+        switch (r % 4) {
+        case 0:
+            break;
+        case 1:
+            buf[(r >> 8) % len] = alphabet[(r >> 16) % (sizeof(alphabet) - 1)];
+            break;
+        case 2:
+            len = (r >> 8) % (len + 1);
+            break;
+        case 3: {
+            size_t at = (r >> 8) % (len + 1);
+            memmove(buf + at + 1, buf + at, len - at);
+            buf[at] = alphabet[(r >> 16) % (sizeof(alphabet) - 1)];
+            len++;
+            break;
+        }
+        }
+        bool expected = reference_valid(buf, len);
+        CHECK_EQ_INT(timestamp_valid_str(buf, len), expected);
+        expected ? valid++ : invalid++;
+    }
+    // Both outcomes are well represented.
+    CHECK(valid > 50000 && invalid > 50000);
+}
+
+// Comparisons agree with parsing and comparing.
+static void test_compare_property(void) {
+    uint64_t state = 680;
+    int outcomes[3] = { 0 };
+    for (int i = 0; i < 300000; i++) {
+        char a[BUF_LEN], b[BUF_LEN];
+        fields_t fa, fb;
+        random_fields(&state, &fa);
+        uint64_t r = fixture_rand(&state);
+        if (r % 3 == 0) {
+            random_fields(&state, &fb);
+        } else {
+            // The same instant or a nearby one, possibly at UTC+1.
+            fb = fa;
+            fb.fraction = (r >> 4) % 2 ? fb.fraction : (int)((r >> 8) % 5);
+            if (fb.zone == 0 && (r >> 12) % 2) {
+                fb.zone = 1;
+                fb.hour++;
+            }
+        }
+        size_t len_a = format_fields(&state, &fa, a), len_b = format_fields(&state, &fb, b);
+        int result = 2, expected = reference_compare(a, len_a, b, len_b);
+        CHECK_EQ_INT(timestamp_compare_str(a, len_a, b, len_b, &result), 0);
+        if (result != expected) {
+            fprintf(stderr, "%s vs %s: %d, expected %d\n", a, b, result, expected);
+        }
+        CHECK_EQ_INT(result, expected);
+        outcomes[result + 1]++;
+    }
+    CHECK(outcomes[0] > 10000 && outcomes[1] > 10000 && outcomes[2] > 10000);
+}
+
+int main(void) {
+    RUN_TEST(test_cases);
+    RUN_TEST(test_valid_property);
+    RUN_TEST(test_compare_property);
+    return 0;
+}
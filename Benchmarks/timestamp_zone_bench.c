@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Converting 1M timestamps to local time in America/New_York: localtime_r against a loaded zone, one
+ * timestamp at a time and in batches. Once in order of time, a few seconds apart like log rows
+ * over about a month, and once spread randomly over 2000-2040.
+ */
+
+#include "TimestampZone.h"
+#include "bench.h"
+#include "fixtures.h"
+
+#define COUNT 1000000
+#define ZONE "America/New_York"
+#define LOADS 1000
+
+static volatile long sink;
+
+static void run(const char *name, const timestamp_zone_t *zone, const timestamp_t *ts, struct tm *tms) {
+    char label[128];
+    uint64_t start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        time_t t = (time_t)ts[i].sec;
+        if (localtime_r(&t, &tms[i]) == NULL) {
+            exit(1);
+        }
+    }
+    snprintf(label, sizeof(label), "timestamp_zone/%s/localtime_r", name);
+    bench_report(label, COUNT, bench_now_ns() - start, 0);
+    long expected = 0;
+    for (size_t i = 0; i < COUNT; i++) {
+        expected += tms[i].tm_hour + tms[i].tm_gmtoff;
+    }
+
+    start = bench_now_ns();
+    for (size_t i = 0; i < COUNT; i++) {
+        if (timestamp_zone_to_tm(zone, &ts[i], &tms[i]) == NULL) {
+            exit(1);
+        }
+    }
+    snprintf(label, sizeof(label), "timestamp_zone/%s/to_tm", name);
+    bench_report(label, COUNT, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    if (timestamp_zone_to_tm_batch(zone, ts, COUNT, tms) != COUNT) {
+        exit(1);
+    }
+    snprintf(label, sizeof(label), "timestamp_zone/%s/to_tm_batch", name);
+    bench_report(label, COUNT, bench_now_ns() - start, 0);
+
+    long actual = 0;
+    for (size_t i = 0; i < COUNT; i++) {
+        actual += tms[i].tm_hour + tms[i].tm_gmtoff;
+    }
+    if (actual != expected) {
+        fprintf(stderr, "%s: conversions differ from localtime_r\n", name);
+        exit(1);
+    }
+}
+
+int main(void) {
+    timestamp_t *ts = malloc(COUNT * sizeof(*ts));
+    struct tm *tms = malloc(COUNT * sizeof(*tms));
+    setenv("TZ", ZONE, 1);
+    tzset();
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < LOADS; i++) {
+        timestamp_zone_free(timestamp_zone_load("/usr/share/zoneinfo/" ZONE));
+    }
+    bench_report("timestamp_zone/load", LOADS, bench_now_ns() - start, 0);
+    timestamp_zone_t *zone = timestamp_zone_load("/usr/share/zoneinfo/" ZONE);
+    if (zone == NULL) {
+        fprintf(stderr, "can't load " ZONE "\n");
+        return 1;
+    }
+
+    // Across the March 2018 transition.
+    uint64_t state = 69;
+    int64_t sec = 1519862400;
+    for (size_t i = 0; i < COUNT; i++) {
+        sec += (int64_t)(fixture_rand(&state) % 5);
+        ts[i] = (timestamp_t){ .sec = sec, .nsec = (int32_t)(fixture_rand(&state) % 1000000000) };
+    }
+    run("log_order", zone, ts, tms);
+
+    for (size_t i = 0; i < COUNT; i++) {
+        ts[i].sec = 946684800 + (int64_t)(fixture_rand(&state) % (40 * 365 * 86400ULL));
+    }
+    run("random", zone, ts, tms);
+
+    timestamp_zone_free(zone);
+    free(ts);
+    free(tms);
+    return 0;
+}
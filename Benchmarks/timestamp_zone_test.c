@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TimestampZone.h"
+#include "check.h"
+#include "fixtures.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#define ZONEINFO "/usr/share/zoneinfo/"
+
+static const char *zones[] = {
+    "America/New_York", "Europe/London", "Europe/Dublin", "Australia/Sydney", "Pacific/Chatham",
+    "Asia/Kolkata", "America/Sao_Paulo", "UTC" };
+
+static void use_tz(const char *name) {
+    setenv("TZ", name, 1);
+    tzset();
+}
+
+static timestamp_zone_t * load(const char *name) {
+    char path[256];
+    snprintf(path, sizeof(path), ZONEINFO "%s", name);
+    timestamp_zone_t *z = timestamp_zone_load(path);
+    CHECK(z != NULL);
+    return z;
+}
+
+// The conversion of sec agrees with localtime_r in the current TZ.
+static void check_against_libc(const timestamp_zone_t *z, int64_t sec) {
+    time_t t = (time_t)sec;
+    struct tm expected, actual;
+    timestamp_t ts = { .sec = sec };
+    CHECK(localtime_r(&t, &expected) != NULL);
+    CHECK(timestamp_zone_to_tm(z, &ts, &actual) == &actual);
+    if (memcmp(&expected, &actual, offsetof(struct tm, tm_isdst)) != 0 || expected.tm_isdst != actual.tm_isdst ||
+        expected.tm_gmtoff != actual.tm_gmtoff || strcmp(expected.tm_zone, actual.tm_zone) != 0) {
+        fprintf(stderr, "%lld: %s %ld %d, expected %s %ld %d\n", (long long)sec, actual.tm_zone, actual.tm_gmtoff,
+                actual.tm_isdst, expected.tm_zone, expected.tm_gmtoff, expected.tm_isdst);
+        CHECK(false);
+    }
+
+    int is_dst;
+    const char *abbreviation;
+    CHECK_EQ_INT(timestamp_zone_offset(z, sec, &is_dst, &abbreviation), expected.tm_gmtoff);
+    CHECK_EQ_INT(is_dst, expected.tm_isdst);
+    CHECK(strcmp(abbreviation, expected.tm_zone) == 0);
+}
+
+static void test_against_libc(void) {
+    const int64_t from = -2208988800, until = 4102444800;   // 1900 to 2100.
+    uint64_t state = 69;
+    for (size_t i = 0; i < sizeof(zones) / sizeof(zones[0]); i++) {
+        timestamp_zone_t *z = load(zones[i]);
+        use_tz(zones[i]);
+        for (int j = 0; j < 100000; j++) {
+            check_against_libc(z, from + (int64_t)(fixture_rand(&state) % (uint64_t)(until - from)));
+        }
+        // Around every transition in the range, by finding them with a bisection of offset changes.
+        for (int64_t day = from; day < until; day += 86400) {
+            if (timestamp_zone_offset(z, day, NULL, NULL) == timestamp_zone_offset(z, day + 86400, NULL, NULL)) {
+                continue;
+            }
+            int64_t lo = day, hi = day + 86400;
+            while (hi - lo > 1) {
+                int64_t mid = lo + (hi - lo) / 2;
+                int same = timestamp_zone_offset(z, mid, NULL, NULL) == timestamp_zone_offset(z, lo, NULL, NULL);
+                *(same ? &lo : &hi) = mid;
+            }
+            check_against_libc(z, lo);
+            check_against_libc(z, hi);
+        }
+        timestamp_zone_free(z);
+    }
+    unsetenv("TZ");
+}
+
+static void test_batch(void) {
+    uint64_t state = 690;
+    timestamp_zone_t *z = load("Australia/Sydney");
+    enum { COUNT = 20000 };
+    timestamp_t *ts = malloc(COUNT * sizeof(*ts));
+    struct tm *batch = malloc(COUNT * sizeof(*batch));
+    // Runs in order of time, as in logs, with jumps back between them.
+    int64_t sec = 1514764800;
+    for (int i = 0; i < COUNT; i++) {
+        uint64_t r = fixture_rand(&state);
+        sec += (r % 100 == 0) ? -(int64_t)(r % 40000000) : (int64_t)(r % 20000);
+        ts[i] = (timestamp_t){ .sec = sec, .nsec = (int32_t)(r % 1000000000) };
+    }
+    CHECK_EQ_INT(timestamp_zone_to_tm_batch(z, ts, COUNT, batch), COUNT);
+    for (int i = 0; i < COUNT; i++) {
+        struct tm single;
+        CHECK(timestamp_zone_to_tm(z, &ts[i], &single) != NULL);
+        CHECK(memcmp(&single, &batch[i], offsetof(struct tm, tm_isdst)) == 0);
+        CHECK(single.tm_isdst == batch[i].tm_isdst && single.tm_gmtoff == batch[i].tm_gmtoff);
+    }
+
+    // Stops at an invalid timestamp.
+    ts[100].nsec = -1;
+    CHECK_EQ_INT(timestamp_zone_to_tm_batch(z, ts, COUNT, batch), 100);
+    ts[100] = (timestamp_t){ .sec = INT64_C(253402300799) };
+    CHECK_EQ_INT(timestamp_zone_to_tm_batch(z, ts, COUNT, batch), 100);
+    CHECK_EQ_INT(timestamp_zone_to_tm_batch(z, ts, 0, batch), 0);
+
+    free(ts);
+    free(batch);
+    timestamp_zone_free(z);
+}
+
+static size_t put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return 4;
+}
+
+// Version 2 data without transitions, as written by zic's slim output for zones of a single rule:
+// one type and the TZ string.
+static size_t slim_zone(uint8_t *buf, int32_t offset, const char *abbreviation, const char *tz_string) {
+    size_t n = 0, chars = strlen(abbreviation) + 1;
+    for (int block = 0; block < 2; block++) {
+        memcpy(buf + n, "TZif2", 5);
+        memset(buf + n + 5, 0, 15);
+        n += 20;
+        n += put32(buf + n, 0);
+        n += put32(buf + n, 0);
+        n += put32(buf + n, 0);
+        n += put32(buf + n, 0);
+        n += put32(buf + n, 1);
+        n += put32(buf + n, (uint32_t)chars);
+        n += put32(buf + n, (uint32_t)offset);
+        buf[n++] = 0;
+        buf[n++] = 0;
+        memcpy(buf + n, abbreviation, chars);
+        n += chars;
+    }
+    n += sprintf((char *)buf + n, "\n%s\n", tz_string);
+    return n;
+}
+
+static void test_tz_strings(void) {
+    uint64_t state = 6900;
+    uint8_t buf[512];
+    static const struct { const char *zone, *abbreviation, *tz_string; int32_t offset; int64_t from; } cases[] = {
+        { "America/New_York", "EST", "EST5EDT,M3.2.0,M11.1.0", -18000, 1199145600 },
+        { "Europe/Dublin", "IST", "IST-1GMT0,M10.5.0,M3.5.0/1", 3600, 1199145600 },
+        { "Pacific/Chatham", "+1245", "<+1245>-12:45<+1345>,M9.5.0/2:45,M4.1.0/3:45", 45900, 1230768000 },
+        { "Asia/Kolkata", "IST", "IST-5:30", 19800, 0 } };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t len = slim_zone(buf, cases[i].offset, cases[i].abbreviation, cases[i].tz_string);
+        timestamp_zone_t *z = timestamp_zone_parse(buf, len);
+        CHECK(z != NULL);
+        use_tz(cases[i].zone);
+        for (int j = 0; j < 20000; j++) {
+            check_against_libc(z, cases[i].from + (int64_t)(fixture_rand(&state) % (4102444800 - cases[i].from)));
+        }
+        timestamp_zone_free(z);
+    }
+
+    // J and zero-based day rules, and explicit times, against glibc's reading of the same TZ string.
+    static const char *rules[] = { "XST3XDT,J60/1:30,J300", "XST-3XDT-4:15,59/25,300/-1" };
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        size_t len = slim_zone(buf, -3 * 3600 * (i == 1 ? -1 : 1), "XST", rules[i]);
+        timestamp_zone_t *z = timestamp_zone_parse(buf, len);
+        CHECK(z != NULL);
+        use_tz(rules[i]);
+        for (int j = 0; j < 20000; j++) {
+            check_against_libc(z, (int64_t)(fixture_rand(&state) % 4102444800));
+        }
+        timestamp_zone_free(z);
+    }
+    unsetenv("TZ");
+
+    // Without a rule, the POSIX default. (glibc takes the rule from its posixrules file instead.)
+    size_t len = slim_zone(buf, -3 * 3600, "XST", "XST3XDT");
+    timestamp_zone_t *implied = timestamp_zone_parse(buf, len);
+    len = slim_zone(buf, -3 * 3600, "XST", "XST3XDT,M3.2.0,M11.1.0");
+    timestamp_zone_t *explicit = timestamp_zone_parse(buf, len);
+    CHECK(implied != NULL && explicit != NULL);
+    for (int j = 0; j < 20000; j++) {
+        int64_t sec = (int64_t)(fixture_rand(&state) % 4102444800);
+        CHECK_EQ_INT(timestamp_zone_offset(implied, sec, NULL, NULL), timestamp_zone_offset(explicit, sec, NULL, NULL));
+    }
+    CHECK(timestamp_zone_offset(implied, 1500000000, NULL, NULL) == -2 * 3600);
+    timestamp_zone_free(implied);
+    timestamp_zone_free(explicit);
+
+    static const char *invalid[] = { "EST", "EST5EDT,M3.2.0", "EST5EDT,M13.2.0,M11.1.0", "EST5EDT,M3.6.0,M11.1.0",
+                                     "EST5EDT,M3.2.7,M11.1.0", "EST5EDT,J0,J100", "EST5EDT,M3.2.0,M11.1.0,",
+                                     "<+0330-3:30", "EST25" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        size_t len = slim_zone(buf, 0, "EST", invalid[i]);
+        CHECK(timestamp_zone_parse(buf, len) == NULL);
+    }
+}
+
+static void test_invalid(void) {
+    size_t len;
+    uint8_t *data = (uint8_t *)fixture_read_file(ZONEINFO "America/New_York", &len);
+    CHECK(data != NULL);
+    // Every truncation short of the footer is rejected, or accepted as the same zone without a rule.
+    for (size_t i = 0; i < len; i++) {
+        timestamp_zone_t *z = timestamp_zone_parse(data, i);
+        if (z != NULL) {
+            CHECK(i == len - strlen("\nEST5EDT,M3.2.0,M11.1.0\n"));
+            timestamp_zone_free(z);
+        }
+    }
+    data[0] = 'X';
+    CHECK(timestamp_zone_parse(data, len) == NULL);
+    free(data);
+
+    timestamp_zone_t *z = timestamp_zone_load(NULL);
+    CHECK(z != NULL);
+    timestamp_zone_free(z);
+    CHECK(timestamp_zone_load(ZONEINFO "Nowhere/Nothing") == NULL);
+    CHECK_EQ_INT(errno, ENOENT);
+    CHECK(timestamp_zone_load(ZONEINFO "zone.tab") == NULL);
+    CHECK_EQ_INT(errno, EINVAL);
+    CHECK(timestamp_zone_load(ZONEINFO "right/UTC") == NULL);
+    CHECK_EQ_INT(errno, EINVAL);
+}
+
+int main(void) {
+    RUN_TEST(test_against_libc);
+    RUN_TEST(test_batch);
+    RUN_TEST(test_tz_strings);
+    RUN_TEST(test_invalid);
+    return 0;
+}
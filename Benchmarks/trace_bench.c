@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Tracing overhead per span, enabled and disabled, against an uninstrumented loop; then a capture
+ * of a simulated launch through the instrumented components, written to build/startup_trace.json
+ * for loading in chrome://tracing or Perfetto.
+ *
+ * Built with PSIPHON_TRACE, like an instrumented build of the app.
+ */
+
+#define _GNU_SOURCE
+#include "Trace.h"
+#include "CompressedLog.h"
+#include "EmbeddedServerEntriesHelpers.h"
+#include "FeedbackBundle.h"
+#include "PurchaseIndex.h"
+#include "ReceiptAttributes.h"
+#include "ServerEntryTable.h"
+#include "bench.h"
+#include "fixtures.h"
+#include "receipt_reference.h"
+#include <pthread.h>
+#include <string.h>
+
+#define SPANS 1000000
+
+static volatile uint64_t sink;
+
+static void __attribute__((noinline)) work(uint64_t i) {
+    sink += i * 2654435761u;
+}
+
+static void run_spans(const char *name) {
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < SPANS; i++) {
+        TRACE_SCOPE("span");
+        work(i);
+        if ((i & (TRACE_BUFFER_EVENTS - 1)) == TRACE_BUFFER_EVENTS - 1) {
+            trace_reset();
+        }
+    }
+    bench_report(name, SPANS, bench_now_ns() - start, 0);
+}
+
+static int discard(void *ctx, const uint8_t *buf, size_t len) {
+    return 0;
+}
+
+typedef struct {
+    const char *notices_path;
+    const char *log_path;
+    const char *older_log_path;
+} extension_args_t;
+
+// Stand-in for the extension's start: reading the last notices for feedback, and logging.
+static void * extension_main(void *arg) {
+    const extension_args_t *args = arg;
+    TRACE_THREAD_NAME("extension");
+    TRACE_SCOPE("extension_start");
+    feedback_bundle_writer_t *w = feedback_bundle_writer_new(discard, NULL, 64 * 1024);
+    feedback_bundle_source_t source = { NULL, args->notices_path };
+    feedback_bundle_add_sources(w, &source, 1);
+    feedback_bundle_finish(w);
+    feedback_bundle_writer_free(w);
+
+    compressed_log_options_t options = { COMPRESSED_LOG_FRAME_SIZE, 1024 * 1024, 6 };
+    compressed_log_t *log = compressed_log_open(args->log_path, args->older_log_path, &options);
+    if (log != NULL) {
+        for (int i = 0; i < 100; i++) {
+            char line[64];
+            int len = snprintf(line, sizeof(line), "{\"noticeType\":\"Info\",\"data\":{\"n\":%d}}", i);
+            compressed_log_append(log, line, len);
+        }
+        compressed_log_close(log);
+    }
+    return NULL;
+}
+
+// Stand-in for EmbeddedServerEntries egressRegionsFromFile:, which scans the file with the C helpers.
+static void scan_server_entries(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, fp) != -1) {
+        drop_newline_and_carriage_return(line);
+        char *decoded = hex_decode(line);
+        if (decoded != NULL) {
+            sink += (uintptr_t)server_entry_json(decoded);
+        }
+        free(decoded);
+    }
+    free(line);
+    fclose(fp);
+}
+
+static void capture_startup(void) {
+    char *dir = fixture_tmpdir();
+    char *entries_path, *notices_path, *log_path, *older_log_path;
+    asprintf(&entries_path, "%s/embedded_server_entries", dir);
+    asprintf(&notices_path, "%s/notices", dir);
+    asprintf(&log_path, "%s/log", dir);
+    asprintf(&older_log_path, "%s/log.1", dir);
+    uint64_t state = 59;
+    int64_t now_ms = 1514764800000;
+    fixture_write_server_entries_file(entries_path, 500, &state, NULL);
+    fixture_write_notices_file(notices_path, 512 * 1024, &state, &now_ms);
+
+    purchase_index_t *idx = purchase_index_new();
+    for (int i = 0; i < 100; i++) {
+        char id[32];
+        snprintf(id, sizeof(id), "purchase-%d", i);
+        purchase_t p = { id, "speed-boost", "", now_ms + i * 60000, 0 };
+        purchase_index_put(idx, &p);
+    }
+    size_t len;
+    uint8_t *purchases = purchase_index_serialize(idx, &len);
+    purchase_index_free(idx);
+
+    size_t receipt_len, payload_len;
+    uint8_t *receipt = fixture_receipt(&state, 100, now_ms, NULL, &receipt_len), *payload;
+    receipt_ref_payload(receipt, receipt_len, &payload, &payload_len);
+
+    trace_reset();
+    trace_set_enabled(1);
+    TRACE_THREAD_NAME("main");
+    {
+        TRACE_SCOPE("app_launch");
+        pthread_t extension;
+        extension_args_t args = { notices_path, log_path, older_log_path };
+        pthread_create(&extension, NULL, extension_main, &args);
+
+        ReceiptAttributes_t *attrs = NULL;
+        ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)&attrs, payload, payload_len);
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+        purchase_index_free(purchase_index_deserialize(purchases, len));
+        scan_server_entries(entries_path);
+        server_entry_table_free(server_entry_table_load(entries_path));
+        TRACE_INSTANT("egress_regions_ready");
+
+        pthread_join(extension, NULL);
+    }
+    trace_set_enabled(0);
+
+    FILE *fp = fopen("build/startup_trace.json", "w");
+    long events = fp ? trace_write_chrome_json(fp) : -1;
+    long size = fp ? ftell(fp) : 0;
+    if (fp) {
+        fclose(fp);
+    }
+    bench_counter("trace/startup_capture_events", (double)events, "events");
+    bench_counter("trace/startup_capture_size", (double)size / 1024.0, "KB");
+    bench_counter("trace/startup_capture_dropped", (double)trace_dropped(), "events");
+
+    free(purchases);
+    free(receipt);
+    free(payload);
+    fixture_rmdir(dir);
+    free(entries_path);
+    free(notices_path);
+    free(log_path);
+    free(older_log_path);
+    free(dir);
+}
+
+int main(void) {
+    uint64_t start = bench_now_ns();
+    for (uint64_t i = 0; i < SPANS; i++) {
+        work(i);
+    }
+    bench_report("trace/uninstrumented_baseline", SPANS, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (uint64_t i = 0; i < SPANS; i++) {
+        sink += trace_now_ns();
+    }
+    bench_report("trace/now_ns", SPANS, bench_now_ns() - start, 0);
+
+    trace_set_enabled(0);
+    run_spans("trace/span_disabled");
+    trace_set_enabled(1);
+    run_spans("trace/span_enabled");
+    trace_set_enabled(0);
+    trace_reset();
+
+    capture_startup();
+    return 0;
+}
@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Built with PSIPHON_TRACE, like an instrumented build of the app.
+ */
+
+#define _GNU_SOURCE
+#include "Trace.h"
+#include "ServerEntryTable.h"
+#include "check.h"
+#include "timestamp.h"
+#include "fixtures.h"
+#include "json_reference.h"
+#include <pthread.h>
+#include <string.h>
+
+// Exports the trace and parses it back.
+static json_ref_t * export_trace(long *events) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&buf, &len);
+    *events = trace_write_chrome_json(fp);
+    fclose(fp);
+    json_ref_t *doc = json_ref_parse(buf, len);
+    CHECK(doc != NULL);
+    free(buf);
+    return doc;
+}
+
+static const json_ref_t * field(const json_ref_t *event, const char *key) {
+    const json_ref_t *v = json_ref_path(event, key);
+    CHECK(v != NULL);
+    return v;
+}
+
+static int is_name(const json_ref_t *event, const char *name) {
+    const json_ref_t *v = field(event, "name");
+    return v->type == JSON_REF_STRING && strcmp(v->string, name) == 0;
+}
+
+// Finds the n'th event with the given name and phase.
+static const json_ref_t * find_event(const json_ref_t *doc, const char *name, const char *ph, int n) {
+    const json_ref_t *events = field(doc, "traceEvents");
+    for (size_t i = 0; i < events->child_count; i++) {
+        const json_ref_t *e = events->children[i];
+        if (is_name(e, name) && strcmp(field(e, "ph")->string, ph) == 0 && n-- == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Finds the thread_name metadata event naming a thread.
+static const json_ref_t * find_thread(const json_ref_t *doc, const char *name) {
+    const json_ref_t *events = field(doc, "traceEvents");
+    for (size_t i = 0; i < events->child_count; i++) {
+        const json_ref_t *e = events->children[i];
+        if (is_name(e, "thread_name") && strcmp(field(e, "args.name")->string, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void inner(void) {
+    TRACE_SCOPE("inner");
+    struct timespec ts = { 0, 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+static void test_spans(void) {
+    trace_reset();
+    TRACE_SCOPE("disabled");
+    trace_set_enabled(1);
+    TRACE_THREAD_NAME("main");
+    {
+        TRACE_SCOPE("outer");
+        inner();
+        TRACE_INSTANT("marker");
+    }
+    TRACE_BEGIN(explicit_span, "explicit \"quoted\"");
+    TRACE_END(explicit_span);
+    trace_set_enabled(0);
+
+    long count;
+    json_ref_t *doc = export_trace(&count);
+    CHECK_EQ_INT(count, 4);
+    CHECK(find_event(doc, "disabled", "X", 0) == NULL);
+
+    const json_ref_t *outer = find_event(doc, "outer", "X", 0), *in = find_event(doc, "inner", "X", 0);
+    CHECK(outer != NULL && in != NULL);
+    double outer_ts = field(outer, "ts")->number, outer_dur = field(outer, "dur")->number;
+    double inner_ts = field(in, "ts")->number, inner_dur = field(in, "dur")->number;
+    CHECK(inner_dur >= 1000.0);
+    CHECK(inner_ts >= outer_ts && inner_ts + inner_dur <= outer_ts + outer_dur);
+    CHECK(field(outer, "tid")->number == field(in, "tid")->number);
+
+    const json_ref_t *marker = find_event(doc, "marker", "i", 0);
+    CHECK(marker != NULL && field(marker, "ts")->number >= inner_ts + inner_dur);
+    CHECK(find_event(doc, "explicit \"quoted\"", "X", 0) != NULL);
+    const json_ref_t *thread = find_event(doc, "thread_name", "M", 0);
+    CHECK(thread != NULL && strcmp(field(thread, "args.name")->string, "main") == 0);
+    json_ref_free(doc);
+
+    trace_reset();
+    doc = export_trace(&count);
+    CHECK_EQ_INT(count, 0);
+    json_ref_free(doc);
+}
+
+#define THREADS 4
+#define SPANS_PER_THREAD 1000
+
+static void * worker(void *arg) {
+    static const char *names[THREADS] = { "worker 0", "worker 1", "worker 2", "worker 3" };
+    TRACE_THREAD_NAME(names[(intptr_t)arg]);
+    for (int i = 0; i < SPANS_PER_THREAD; i++) {
+        TRACE_SCOPE("work");
+    }
+    return NULL;
+}
+
+static void test_threads(void) {
+    trace_reset();
+    trace_set_enabled(1);
+    pthread_t threads[THREADS];
+    for (intptr_t i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)i);
+    }
+    // Exporting while threads record only leaves out events.
+    long count;
+    json_ref_free(export_trace(&count));
+    CHECK(count <= THREADS * SPANS_PER_THREAD);
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    trace_set_enabled(0);
+
+    json_ref_t *doc = export_trace(&count);
+    CHECK_EQ_INT(count, THREADS * SPANS_PER_THREAD);
+    CHECK_EQ_INT(trace_dropped(), 0);
+
+    // Each worker's spans are on its own, named, thread.
+    double tids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "worker %d", i);
+        const json_ref_t *meta = find_thread(doc, name);
+        CHECK(meta != NULL);
+        tids[i] = field(meta, "tid")->number;
+        const json_ref_t *events = field(doc, "traceEvents");
+        int spans = 0;
+        for (size_t j = 0; j < events->child_count; j++) {
+            const json_ref_t *e = events->children[j];
+            spans += is_name(e, "work") && field(e, "tid")->number == tids[i];
+        }
+        CHECK_EQ_INT(spans, SPANS_PER_THREAD);
+        for (int k = 0; k < i; k++) {
+            CHECK(tids[k] != tids[i]);
+        }
+    }
+    json_ref_free(doc);
+}
+
+static void * idle_thread(void *arg) {
+    TRACE_THREAD_NAME("idle");
+    return NULL;
+}
+
+static void * late_thread(void *arg) {
+    TRACE_THREAD_NAME("late");
+    trace_set_enabled(1);
+    TRACE_SCOPE("late_span");
+    return NULL;
+}
+
+static void test_thread_name_while_disabled(void) {
+    trace_reset();
+    trace_set_enabled(0);
+    pthread_t thread;
+
+    // Naming a thread doesn't allocate its buffer while tracing is disabled...
+    pthread_create(&thread, NULL, idle_thread, NULL);
+    pthread_join(thread, NULL);
+    // ...but the name is applied if the thread records later.
+    pthread_create(&thread, NULL, late_thread, NULL);
+    pthread_join(thread, NULL);
+    trace_set_enabled(0);
+
+    long count;
+    json_ref_t *doc = export_trace(&count);
+    CHECK(find_thread(doc, "idle") == NULL);
+    const json_ref_t *late = find_thread(doc, "late"), *span = find_event(doc, "late_span", "X", 0);
+    CHECK(late != NULL && span != NULL);
+    CHECK(field(late, "tid")->number == field(span, "tid")->number);
+    json_ref_free(doc);
+}
+
+static void * short_thread(void *arg) {
+    TRACE_THREAD_NAME("short");
+    TRACE_SCOPE("short_span");
+    return NULL;
+}
+
+static void test_exited_thread_buffers_reused(void) {
+    trace_reset();
+    trace_set_enabled(1);
+    size_t buffers = 0;
+    for (int i = 0; i < 50; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, short_thread, NULL);
+        pthread_join(thread, NULL);
+
+        // Exported after its thread exited: the buffer goes to the next thread.
+        long count;
+        json_ref_t *doc = export_trace(&count);
+        CHECK(find_event(doc, "short_span", "X", 0) != NULL);
+        CHECK(find_thread(doc, "short") != NULL);
+        json_ref_free(doc);
+        if (i == 0) {
+            buffers = trace_buffers();
+        }
+        CHECK_EQ_INT(trace_buffers(), buffers);
+    }
+
+    // Not exported: the threads' events are all kept.
+    for (int i = 0; i < 3; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, short_thread, NULL);
+        pthread_join(thread, NULL);
+    }
+    trace_set_enabled(0);
+    long count;
+    json_ref_t *doc = export_trace(&count);
+    CHECK(find_event(doc, "short_span", "X", 2) != NULL);
+    json_ref_free(doc);
+}
+
+static void test_overflow(void) {
+    trace_reset();
+    trace_set_enabled(1);
+    for (int i = 0; i < TRACE_BUFFER_EVENTS + 10; i++) {
+        TRACE_SCOPE("span");
+    }
+    trace_set_enabled(0);
+    CHECK_EQ_INT(trace_dropped(), 10);
+    long count;
+    json_ref_free(export_trace(&count));
+    CHECK_EQ_INT(count, TRACE_BUFFER_EVENTS);
+    trace_reset();
+    CHECK_EQ_INT(trace_dropped(), 0);
+}
+
+static void test_instrumented_components(void) {
+    char *dir = fixture_tmpdir();
+    char *path;
+    asprintf(&path, "%s/embedded_server_entries", dir);
+    uint64_t state = 59;
+    fixture_write_server_entries_file(path, 20, &state, NULL);
+
+    trace_reset();
+    trace_set_enabled(1);
+    server_entry_table_t *t = server_entry_table_load(path);
+    timestamp_t ts;
+    CHECK_EQ_INT(timestamp_parse("2018-01-01T00:00:00Z", 20, &ts), 0);
+    trace_set_enabled(0);
+    CHECK(t != NULL);
+
+    long count;
+    json_ref_t *doc = export_trace(&count);
+    CHECK(find_event(doc, "server_entry_table_load", "X", 0) != NULL);
+    CHECK(find_event(doc, "timestamp_parse", "X", 0) != NULL);
+    json_ref_free(doc);
+
+    server_entry_table_free(t);
+    fixture_rmdir(dir);
+    free(path);
+    free(dir);
+}
+
+int main(void) {
+    RUN_TEST(test_spans);
+    RUN_TEST(test_threads);
+    RUN_TEST(test_thread_name_while_disabled);
+    RUN_TEST(test_exited_thread_buffers_reused);
+    RUN_TEST(test_overflow);
+    RUN_TEST(test_instrumented_components);
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Update cost of traffic_stats_add from several threads, against a single shared atomic
+ * counter pair and a mutex-protected counter pair, plus the CPU cost of a paced load of
+ * 100k updates per second with a tick every second.
+ */
+
+#include "TrafficStats.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#define UPDATES_PER_THREAD 2000000
+
+typedef enum { MODE_SHARDED, MODE_ATOMIC, MODE_MUTEX } mode_t_;
+
+static traffic_stats_t *stats;
+static _Atomic uint64_t shared_sent, shared_received;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t locked_sent, locked_received;
+
+static void * worker(void *arg) {
+    mode_t_ mode = *(mode_t_ *)arg;
+    for (int i = 0; i < UPDATES_PER_THREAD; i++) {
+        switch (mode) {
+            case MODE_SHARDED:
+                traffic_stats_add(stats, 1400, 1400);
+                break;
+            case MODE_ATOMIC:
+                atomic_fetch_add_explicit(&shared_sent, 1400, memory_order_relaxed);
+                atomic_fetch_add_explicit(&shared_received, 1400, memory_order_relaxed);
+                break;
+            case MODE_MUTEX:
+                pthread_mutex_lock(&mutex);
+                locked_sent += 1400;
+                locked_received += 1400;
+                pthread_mutex_unlock(&mutex);
+                break;
+        }
+    }
+    return NULL;
+}
+
+static void run(const char *name, mode_t_ mode, int threads) {
+    pthread_t t[16];
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < threads; i++) {
+        pthread_create(&t[i], NULL, worker, &mode);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(t[i], NULL);
+    }
+    uint64_t elapsed = bench_now_ns() - start;
+
+    char label[96];
+    snprintf(label, sizeof(label), "traffic_stats/%s/threads_%d", name, threads);
+    // Per update cost as seen by one thread: wall time divided by updates per thread.
+    bench_report(label, UPDATES_PER_THREAD, elapsed, 0);
+}
+
+typedef struct {
+    int updates_per_sec;
+    int seconds;
+} paced_t;
+
+static void * paced_worker(void *arg) {
+    paced_t *p = arg;
+    const int batch = 100;
+    struct timespec pause = { 0, (long)(1000000000LL * batch / p->updates_per_sec) };
+    for (int s = 0; s < p->seconds; s++) {
+        for (int i = 0; i < p->updates_per_sec; i += batch) {
+            for (int j = 0; j < batch; j++) {
+                traffic_stats_add(stats, 1400, 1400);
+            }
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+static double cpu_seconds(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (double)ru.ru_utime.tv_sec + (double)ru.ru_utime.tv_usec / 1e6 +
+           (double)ru.ru_stime.tv_sec + (double)ru.ru_stime.tv_usec / 1e6;
+}
+
+int main(void) {
+    stats = traffic_stats_new();
+
+    const int thread_counts[] = { 1, 2, 4, 8 };
+    for (size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+        run("sharded", MODE_SHARDED, thread_counts[i]);
+        run("single_atomic", MODE_ATOMIC, thread_counts[i]);
+        run("mutex", MODE_MUTEX, thread_counts[i]);
+    }
+
+    // Tick and snapshot cost with a full series.
+    for (uint64_t t = 1; t <= 90000; t++) {
+        traffic_stats_add(stats, 1, 1);
+        traffic_stats_tick(stats, t);
+    }
+    traffic_stats_snapshot_t snapshot;
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < 100000; i++) {
+        traffic_stats_snapshot(stats, &snapshot);
+    }
+    bench_report("traffic_stats/snapshot", 100000, bench_now_ns() - start, 0);
+
+    start = bench_now_ns();
+    for (uint64_t t = 90001; t <= 190000; t++) {
+        traffic_stats_tick(stats, t);
+    }
+    bench_report("traffic_stats/tick", 100000, bench_now_ns() - start, 0);
+
+    // 100k updates per second from 4 threads for 2 seconds, ticking once a second.
+    paced_t paced = { 25000, 2 };
+    pthread_t t[4];
+    double cpu_start = cpu_seconds();
+    start = bench_now_ns();
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&t[i], NULL, paced_worker, &paced);
+    }
+    for (int s = 1; s <= paced.seconds; s++) {
+        struct timespec one = { 1, 0 };
+        nanosleep(&one, NULL);
+        traffic_stats_tick(stats, 190000 + (uint64_t)s);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(t[i], NULL);
+    }
+    double wall = (double)(bench_now_ns() - start) / 1e9;
+    bench_counter("traffic_stats/paced_100k_per_sec/cpu", 100.0 * (cpu_seconds() - cpu_start) / wall, "% of one core");
+
+    traffic_stats_free(stats);
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TrafficStats.h"
+#include "check.h"
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 4
+#define ADDS_PER_THREAD 250000
+
+static void * add_worker(void *arg) {
+    traffic_stats_t *ts = arg;
+    for (int i = 0; i < ADDS_PER_THREAD; i++) {
+        traffic_stats_add(ts, 3, i % 7);
+    }
+    return NULL;
+}
+
+static void test_concurrent_totals_are_exact(void) {
+    traffic_stats_t *ts = traffic_stats_new();
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, add_worker, ts);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    uint64_t received_per_thread = 0;
+    for (int i = 0; i < ADDS_PER_THREAD; i++) {
+        received_per_thread += i % 7;
+    }
+
+    traffic_stats_tick(ts, 100);
+    traffic_stats_snapshot_t s;
+    traffic_stats_snapshot(ts, &s);
+    CHECK_EQ_INT(s.total_sent, 3ULL * ADDS_PER_THREAD * THREADS);
+    CHECK_EQ_INT(s.total_received, received_per_thread * THREADS);
+    CHECK_EQ_INT(s.updates, (uint64_t)ADDS_PER_THREAD * THREADS);
+    CHECK_EQ_INT(s.last_10s.received, received_per_thread * THREADS);
+    traffic_stats_free(ts);
+}
+
+static void test_second_rates_and_percentiles(void) {
+    traffic_stats_t *ts = traffic_stats_new();
+    for (int i = 1; i <= 60; i++) {
+        traffic_stats_add(ts, i * 10, i * 1000);
+        traffic_stats_tick(ts, 1000 + i);
+    }
+
+    traffic_stats_snapshot_t s;
+    traffic_stats_snapshot(ts, &s);
+    CHECK_EQ_INT(s.uptime_sec, 60);
+    CHECK_EQ_INT(s.last_1m.received, 30500);          // mean of 1000..60000
+    CHECK_EQ_INT(s.last_10s.received, 55500);         // mean of 51000..60000
+    CHECK_EQ_INT(s.p50_1s.received, 30000);           // nearest rank 30 of 60
+    CHECK_EQ_INT(s.p90_1s.received, 54000);           // nearest rank 54
+    CHECK_EQ_INT(s.p99_1s.received, 60000);           // nearest rank 60
+    CHECK_EQ_INT(s.peak_1s.sent, 600);
+    CHECK_EQ_INT(s.last_1h.received, 30500);
+    traffic_stats_free(ts);
+}
+
+static void test_gap_is_spread_evenly(void) {
+    traffic_stats_t *ts = traffic_stats_new();
+    traffic_stats_tick(ts, 10);
+    traffic_stats_add(ts, 0, 10003);
+    traffic_stats_tick(ts, 20);
+    traffic_stats_tick(ts, 20);   // Same second is a no-op.
+
+    traffic_stats_snapshot_t s;
+    traffic_stats_snapshot(ts, &s);
+    CHECK_EQ_INT(s.last_10s.received, 1000);
+    CHECK_EQ_INT(s.peak_1s.received, 1003);
+    CHECK_EQ_INT(s.p50_1s.received, 1000);
+    CHECK_EQ_INT(s.total_received, 10003);
+    traffic_stats_free(ts);
+}
+
+static void test_minutes_and_hours_roll_up(void) {
+    traffic_stats_t *ts = traffic_stats_new();
+    uint64_t t = 5;
+    // Two hours at 100 B/s received, then 30 minutes at 400 B/s.
+    for (int i = 0; i < 7200; i++) {
+        traffic_stats_add(ts, 1, 100);
+        traffic_stats_tick(ts, ++t);
+    }
+    traffic_stats_snapshot_t s;
+    traffic_stats_snapshot(ts, &s);
+    CHECK_EQ_INT(s.last_1h.received, 100);
+    CHECK_EQ_INT(s.last_24h.received, 100);
+    CHECK_EQ_INT(s.p50_1m.received, 100);
+
+    for (int i = 0; i < 1800; i++) {
+        traffic_stats_add(ts, 1, 400);
+        traffic_stats_tick(ts, ++t);
+    }
+    traffic_stats_snapshot(ts, &s);
+    CHECK_EQ_INT(s.last_1h.received, 250);            // 30 min at 100, 30 min at 400
+    CHECK_EQ_INT(s.last_24h.received, 160);           // 7200 s at 100, 1800 s at 400
+    CHECK_EQ_INT(s.p90_1m.received, 400);
+
+    // A gap longer than the series span starts over.
+    traffic_stats_add(ts, 0, 50);
+    traffic_stats_tick(ts, t + 2 * 86400);
+    traffic_stats_snapshot(ts, &s);
+    CHECK_EQ_INT(s.last_1m.received, 50);
+    CHECK_EQ_INT(s.last_24h.received, 50);
+    traffic_stats_free(ts);
+}
+
+static void test_snapshot_serialization(void) {
+    traffic_stats_t *ts = traffic_stats_new();
+    for (int i = 0; i < 90; i++) {
+        traffic_stats_add(ts, 1234567 + i, 7654321 + i);
+        traffic_stats_tick(ts, 100 + i);
+    }
+    traffic_stats_snapshot_t s, decoded;
+    traffic_stats_snapshot(ts, &s);
+
+    uint8_t buf[TRAFFIC_STATS_SNAPSHOT_LEN];
+    traffic_stats_snapshot_encode(&s, buf);
+    CHECK(traffic_stats_snapshot_decode(buf, sizeof(buf), &decoded) == 0);
+    CHECK(memcmp(&s, &decoded, sizeof(s)) == 0);
+    CHECK(traffic_stats_snapshot_decode(buf, sizeof(buf) - 1, &decoded) != 0);
+
+    char json[1024];
+    long n = traffic_stats_snapshot_format_json(&s, json, sizeof(json));
+    CHECK(n > 0 && (size_t)n == strlen(json));
+    CHECK(strstr(json, "\"uptimeSec\":90,") != NULL);
+    CHECK(strstr(json, "\"peak1s\":{\"sent\":1234656,\"received\":7654410}") != NULL);
+    CHECK(traffic_stats_snapshot_format_json(&s, json, 20) < 0);
+    traffic_stats_free(ts);
+}
+
+int main(void) {
+    RUN_TEST(test_concurrent_totals_are_exact);
+    RUN_TEST(test_second_rates_and_percentiles);
+    RUN_TEST(test_gap_is_spread_evenly);
+    RUN_TEST(test_minutes_and_hours_roll_up);
+    RUN_TEST(test_snapshot_serialization);
+    return 0;
+}
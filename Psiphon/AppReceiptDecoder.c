@@ -0,0 +1,954 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "AppReceiptDecoder.h"
+#include "IA5String.h"
+#include "Trace.h"
+#include "UTF8String.h"
+#include "timestamp.h"
+#include <stdlib.h>
+#include <string.h>
+// DER tags of the receipt's types.
+#define TAG_INTEGER 0x02
+#define TAG_OCTET_STRING 0x04
+#define TAG_OBJECT_IDENTIFIER 0x06
+#define TAG_SEQUENCE 0x30
+#define TAG_SET 0x31
+#define TAG_CONTEXT_0 0xa0
+#define TAG_CONSTRUCTED 0x20
+#define TAG_CLASS 0xc0
+
+// Longest length the specialized decoder reads, in octets of the long form. Longer lengths fall back.
+#define MAX_LENGTH_OCTETS 3
+
+// Deepest nesting inside digestAlgorithms that is checked here. Deeper values fall back.
+#define MAX_ANY_DEPTH 16
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} span_t;
+
+// State of APP_RECEIPT_STRICT_DER checking. Functions that take one check DER canonical form when it isn't NULL.
+typedef struct {
+    const uint8_t *error;   // First octet that isn't canonical DER, or where decoding failed.
+} der_check_t;
+
+/*** DER ***/
+
+// Records where decoding stopped, if checking. Returns -1.
+static inline int fail_at(der_check_t *check, const uint8_t *at) {
+    if (check != NULL && check->error == NULL) {
+        check->error = at;
+    }
+    return -1;
+}
+
+// Reads a TLV with a single-octet tag and a definite length that fits in s, and moves s past it.
+// Returns 0 on success, -1 if the TLV isn't one the specialized decoder handles.
+static inline int read_tlv(span_t *s, uint8_t *tag, span_t *contents, der_check_t *check) {
+    const uint8_t *p = s->p;
+    if (s->end - p < 2 || p[0] == 0 || (p[0] & 0x1f) == 0x1f) {
+        return fail_at(check, p);
+    }
+    *tag = p[0];
+    const uint8_t *length = p + 1;
+    size_t len = *length;
+    p += 2;
+    if (len & 0x80) {
+        // Indefinite, too long, or in DER, longer than needed.
+        size_t n = len & 0x7f;
+        if (n == 0 || n > MAX_LENGTH_OCTETS || (size_t)(s->end - p) < n || (check != NULL && p[0] == 0)) {
+            return fail_at(check, length);
+        }
+        len = 0;
+        for (size_t i = 0; i < n; i++) {
+            len = (len << 8) | p[i];
+        }
+        if (check != NULL && len < 0x80) {
+            return fail_at(check, length);
+        }
+        p += n;
+    }
+    if ((size_t)(s->end - p) < len) {
+        return fail_at(check, length);
+    }
+    contents->p = p;
+    contents->end = p + len;
+    s->p = p + len;
+    return 0;
+}
+
+// Reads a TLV with an expected tag.
+static inline int expect_tlv(span_t *s, uint8_t expected, span_t *contents, der_check_t *check) {
+    const uint8_t *p = s->p;
+    uint8_t tag;
+    if (read_tlv(s, &tag, contents, check) != 0) {
+        return -1;
+    }
+    return tag == expected ? 0 : fail_at(check, p);
+}
+
+// Checks that s has been read to its end.
+static inline int expect_end(const span_t *s, der_check_t *check) {
+    return s->p == s->end ? 0 : fail_at(check, s->p);
+}
+
+// Returns 1 if INTEGER contents are in the fewest octets, as DER requires: not empty, and the first nine bits
+// not all the same.
+static inline int is_minimal_integer(const span_t *v) {
+    size_t len = v->end - v->p;
+    return len == 1 ||
+           (len > 1 && !(v->p[0] == 0 && !(v->p[1] & 0x80)) && !(v->p[0] == 0xff && (v->p[1] & 0x80)));
+}
+
+// Converts INTEGER contents, like NativeInteger. Empty and oversized contents are left to the generic decoder.
+static inline int read_long(const span_t *v, long *l, der_check_t *check) {
+    size_t len = v->end - v->p;
+    if (len == 0 || len > sizeof(long) || (check != NULL && !is_minimal_integer(v))) {
+        return fail_at(check, v->p);
+    }
+    unsigned long x = (v->p[0] & 0x80) ? ~0UL : 0;
+    for (size_t i = 0; i < len; i++) {
+        x = (x << 8) | v->p[i];
+    }
+    *l = (long)x;
+    return 0;
+}
+
+// Orders SET OF elements as DER does, comparing their encodings as octet strings padded with trailing zeros.
+static int der_compare(const span_t *a, const span_t *b) {
+    size_t a_len = a->end - a->p, b_len = b->end - b->p, n = a_len < b_len ? a_len : b_len;
+    int c = memcmp(a->p, b->p, n);
+    if (c != 0 || a_len == b_len) {
+        return c;
+    }
+    const span_t *longer = a_len > b_len ? a : b;
+    for (const uint8_t *p = longer->p + n; p < longer->end; p++) {
+        if (*p != 0) {
+            return longer == a ? 1 : -1;
+        }
+    }
+    return 0;
+}
+
+// Copies contents into the buffer of an OCTET STRING, OBJECT IDENTIFIER or ANY, NUL terminated like the
+// generic decoders.
+#define copy_octets(p, end, st) copy_buffer((p), (end), &(st)->buf, &(st)->size)
+
+static inline int copy_buffer(const uint8_t *p, const uint8_t *end, uint8_t **buf, int *size) {
+    size_t len = end - p;
+    *buf = malloc(len + 1);
+    if (*buf == NULL) {
+        return -1;
+    }
+    memcpy(*buf, p, len);
+    (*buf)[len] = '\0';
+    *size = (int)len;
+    return 0;
+}
+
+// Returns 1 for the universal string types, which DER encodes in primitive form only.
+static inline int is_string_tag(uint8_t tag) {
+    uint8_t number = tag & 0x1f;
+    return (tag & TAG_CLASS) == 0 && (number == 3 || number == 4 || number == 12 || (number >= 18 && number <= 30));
+}
+
+// Checks the contents of a constructed value are TLVs nested within their parents, as the generic ANY decoder
+// walks them. When checking DER, also checks the elements of SETs are in order, strings are primitive and
+// INTEGERs are minimal.
+static int check_nested(span_t v, uint8_t parent, int depth, der_check_t *check) {
+    span_t previous = { NULL, NULL };
+    if (depth > MAX_ANY_DEPTH) {
+        return fail_at(check, v.p);
+    }
+    while (v.p < v.end) {
+        const uint8_t *element = v.p;
+        uint8_t tag;
+        span_t contents;
+        if (read_tlv(&v, &tag, &contents, check) != 0) {
+            return -1;
+        }
+        if (check != NULL) {
+            span_t encoding = { element, v.p };
+            if (parent == TAG_SET && previous.p != NULL && der_compare(&previous, &encoding) > 0) {
+                return fail_at(check, element);
+            }
+            if ((tag & TAG_CONSTRUCTED) && is_string_tag(tag)) {
+                return fail_at(check, element);
+            }
+            if (tag == TAG_INTEGER && !is_minimal_integer(&contents)) {
+                return fail_at(check, contents.p);
+            }
+            previous = encoding;
+        }
+        if ((tag & TAG_CONSTRUCTED) && check_nested(contents, tag, depth + 1, check) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*** SignedData ***/
+
+/*
+ * SignedData ::= SEQUENCE {
+ *     contentType OBJECT IDENTIFIER,
+ *     content [0] EXPLICIT SEQUENCE {
+ *         version INTEGER,
+ *         digestAlgorithms ANY,
+ *         contentInfo SEQUENCE {
+ *             contentType OBJECT IDENTIFIER,
+ *             contentData [0] EXPLICIT OCTET STRING
+ *         },
+ *         ...
+ *     }
+ * }
+ */
+// The members of a SignedData, pointing into the input.
+typedef struct {
+    span_t content_type;
+    span_t version;
+    span_t digest_algorithms;   // The whole TLV.
+    span_t info_content_type;
+    span_t content_data;
+} signed_data_view_t;
+
+// Reads a SignedData as decode_signed_data does, without copying anything.
+static int read_signed_data(const uint8_t *buf, size_t size, signed_data_view_t *sd, size_t *consumed,
+                            der_check_t *check) {
+    span_t in = { buf, buf + size }, seq, v, tagged, content, info;
+    uint8_t tag;
+
+    if (expect_tlv(&in, TAG_SEQUENCE, &seq, check) != 0) {
+        return -1;
+    }
+    *consumed = in.p - buf;
+
+    if (expect_tlv(&seq, TAG_OBJECT_IDENTIFIER, &sd->content_type, check) != 0) {
+        return -1;
+    }
+    if (expect_tlv(&seq, TAG_CONTEXT_0, &tagged, check) != 0 || expect_end(&seq, check) != 0) {
+        return -1;
+    }
+    if (expect_tlv(&tagged, TAG_SEQUENCE, &content, check) != 0 || expect_end(&tagged, check) != 0) {
+        return -1;
+    }
+    if (expect_tlv(&content, TAG_INTEGER, &sd->version, check) != 0) {
+        return -1;
+    }
+    if (check != NULL && !is_minimal_integer(&sd->version)) {
+        return fail_at(check, sd->version.p);
+    }
+
+    const uint8_t *any = content.p;
+    if (read_tlv(&content, &tag, &v, check) != 0 ||
+        ((tag & TAG_CONSTRUCTED) && check_nested(v, tag, 0, check) != 0)) {
+        return -1;
+    }
+    sd->digest_algorithms.p = any;
+    sd->digest_algorithms.end = content.p;
+
+    if (expect_tlv(&content, TAG_SEQUENCE, &info, check) != 0) {
+        return -1;
+    }
+    if (expect_tlv(&info, TAG_OBJECT_IDENTIFIER, &sd->info_content_type, check) != 0) {
+        return -1;
+    }
+    if (expect_tlv(&info, TAG_CONTEXT_0, &tagged, check) != 0 || expect_end(&info, check) != 0) {
+        return -1;
+    }
+    if (expect_tlv(&tagged, TAG_OCTET_STRING, &sd->content_data, check) != 0 || expect_end(&tagged, check) != 0) {
+        return -1;
+    }
+
+    // Extensions (certificates, crls, signerInfos) are skipped, and when checking DER, walked.
+    while (content.p < content.end) {
+        if (read_tlv(&content, &tag, &v, check) != 0 ||
+            (check != NULL && (tag & TAG_CONSTRUCTED) && check_nested(v, tag, 0, check) != 0)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int decode_signed_data(const uint8_t *buf, size_t size, SignedData_t *sd, size_t *consumed,
+                              der_check_t *check) {
+    signed_data_view_t view;
+    if (read_signed_data(buf, size, &view, consumed, check) != 0 ||
+        read_long(&view.version, &sd->content.version, check) != 0) {
+        return -1;
+    }
+    if (copy_octets(view.content_type.p, view.content_type.end, &sd->contentType) != 0 ||
+        copy_octets(view.digest_algorithms.p, view.digest_algorithms.end, &sd->content.digestAlgorithms) != 0 ||
+        copy_octets(view.info_content_type.p, view.info_content_type.end, &sd->content.contentInfo.contentType) != 0 ||
+        copy_octets(view.content_data.p, view.content_data.end, &sd->content.contentInfo.contentData) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// See comment in header
+asn_dec_rval_t app_receipt_decode_signed_data(const void *buf, size_t size, SignedData_t **signed_data, int flags) {
+    asn_dec_rval_t rval = { RC_FAIL, 0 };
+    der_check_t strict = { NULL }, *check = (flags & APP_RECEIPT_STRICT_DER) ? &strict : NULL;
+
+    if (*signed_data == NULL) {
+        size_t consumed;
+        SignedData_t *sd = calloc(1, sizeof(*sd));
+        if (sd == NULL) {
+            return rval;
+        }
+        if (decode_signed_data(buf, size, sd, &consumed, check) == 0) {
+            *signed_data = sd;
+            rval.code = RC_OK;
+            rval.consumed = consumed;
+            return rval;
+        }
+        ASN_STRUCT_FREE(asn_DEF_SignedData, sd);
+    }
+
+    if (check != NULL) {
+        rval.consumed = strict.error ? strict.error - (const uint8_t *)buf : 0;
+        return rval;
+    }
+    if (flags & APP_RECEIPT_NO_FALLBACK) {
+        return rval;
+    }
+    TRACE_INSTANT("app_receipt_decode_signed_data/fallback");
+    return ber_decode(0, &asn_DEF_SignedData, (void **)signed_data, buf, size);
+}
+
+/*** ReceiptAttributes ***/
+
+/*
+ * ReceiptAttribute ::= SEQUENCE {
+ *     type    INTEGER,
+ *     version INTEGER,
+ *     value   OCTET STRING }
+ *
+ * ReceiptAttributes ::= SET OF ReceiptAttribute
+ */
+static int decode_attributes(const uint8_t *buf, size_t size, ReceiptAttributes_t *attrs, size_t *consumed,
+                             der_check_t *check) {
+    span_t in = { buf, buf + size }, set, seq, v, previous = { NULL, NULL };
+
+    if (expect_tlv(&in, TAG_SET, &set, check) != 0) {
+        return -1;
+    }
+    *consumed = in.p - buf;
+
+    while (set.p < set.end) {
+        const uint8_t *element = set.p;
+        if (expect_tlv(&set, TAG_SEQUENCE, &seq, check) != 0) {
+            return -1;
+        }
+        if (check != NULL) {
+            // Each element is compared with the one before it as it is read.
+            span_t encoding = { element, set.p };
+            if (previous.p != NULL && der_compare(&previous, &encoding) > 0) {
+                return fail_at(check, element);
+            }
+            previous = encoding;
+        }
+        ReceiptAttribute_t *attr = calloc(1, sizeof(*attr));
+        if (attr == NULL) {
+            return -1;
+        }
+        if (ASN_SET_ADD(&attrs->list, attr) != 0) {
+            free(attr);
+            return -1;
+        }
+        if (expect_tlv(&seq, TAG_INTEGER, &v, check) != 0 || read_long(&v, &attr->type, check) != 0 ||
+            expect_tlv(&seq, TAG_INTEGER, &v, check) != 0 || read_long(&v, &attr->version, check) != 0 ||
+            expect_tlv(&seq, TAG_OCTET_STRING, &v, check) != 0 || expect_end(&seq, check) != 0 ||
+            copy_octets(v.p, v.end, &attr->value) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// See comment in header
+asn_dec_rval_t app_receipt_decode_attributes(const void *buf, size_t size, ReceiptAttributes_t **attrs, int flags) {
+    asn_dec_rval_t rval = { RC_FAIL, 0 };
+    der_check_t strict = { NULL }, *check = (flags & APP_RECEIPT_STRICT_DER) ? &strict : NULL;
+
+    if (*attrs == NULL) {
+        size_t consumed;
+        ReceiptAttributes_t *a = calloc(1, sizeof(*a));
+        if (a == NULL) {
+            return rval;
+        }
+        if (decode_attributes(buf, size, a, &consumed, check) == 0) {
+            *attrs = a;
+            rval.code = RC_OK;
+            rval.consumed = consumed;
+            return rval;
+        }
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, a);
+    }
+
+    if (check != NULL) {
+        rval.consumed = strict.error ? strict.error - (const uint8_t *)buf : 0;
+        return rval;
+    }
+    if (flags & APP_RECEIPT_NO_FALLBACK) {
+        return rval;
+    }
+    TRACE_INSTANT("app_receipt_decode_attributes/fallback");
+    return ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)attrs, buf, size);
+}
+
+/*** JSON ***/
+
+// Bytes of JSON buffered before each write.
+#define JSON_BUFFER 1024
+
+typedef enum {
+    VALUE_BYTES,
+    VALUE_STRING,
+    VALUE_DATE,
+    VALUE_INTEGER,
+    VALUE_IN_APP,
+} value_kind_t;
+
+// Receipt fields, from https://developer.apple.com/library/archive/releasenotes/General/ValidateAppStoreReceipt/Chapters/ReceiptFields.html
+static const struct {
+    long type;
+    const char *name;
+    value_kind_t kind;
+} kReceiptFields[] = {
+    { 0, "receipt_type", VALUE_STRING },
+    { 2, "bundle_id", VALUE_STRING },
+    { 3, "application_version", VALUE_STRING },
+    { 4, "opaque_value", VALUE_BYTES },
+    { 5, "sha1_hash", VALUE_BYTES },
+    { 12, "receipt_creation_date", VALUE_DATE },
+    { 17, "in_app", VALUE_IN_APP },
+    { 19, "original_application_version", VALUE_STRING },
+    { 21, "expiration_date", VALUE_DATE },
+    { 1701, "quantity", VALUE_INTEGER },
+    { 1702, "product_id", VALUE_STRING },
+    { 1703, "transaction_id", VALUE_STRING },
+    { 1704, "purchase_date", VALUE_DATE },
+    { 1705, "original_transaction_id", VALUE_STRING },
+    { 1706, "original_purchase_date", VALUE_DATE },
+    { 1708, "expires_date", VALUE_DATE },
+    { 1711, "web_order_line_item_id", VALUE_INTEGER },
+    { 1712, "cancellation_date", VALUE_DATE },
+    { 1713, "is_trial_period", VALUE_INTEGER },
+    { 1719, "is_in_intro_offer_period", VALUE_INTEGER },
+};
+
+typedef struct {
+    char buf[JSON_BUFFER];
+    size_t len;
+    asn_app_consume_bytes_f *write;
+    void *key;
+    int failed;
+} json_out_t;
+
+// A receipt attribute, pointing into the receipt.
+typedef struct {
+    long type;
+    long version;
+    span_t value;
+} attribute_t;
+
+static int json_flush(json_out_t *out) {
+    if (out->len > 0 && !out->failed && out->write(out->buf, out->len, out->key) != 0) {
+        out->failed = 1;
+    }
+    out->len = 0;
+    return out->failed ? -1 : 0;
+}
+
+static void json_bytes(json_out_t *out, const void *p, size_t n) {
+    if (out->len + n > sizeof(out->buf)) {
+        json_flush(out);
+        if (n > sizeof(out->buf)) {
+            if (!out->failed && out->write(p, n, out->key) != 0) {
+                out->failed = 1;
+            }
+            return;
+        }
+    }
+    memcpy(out->buf + out->len, p, n);
+    out->len += n;
+}
+
+static inline void json_char(json_out_t *out, char c) {
+    if (out->len == sizeof(out->buf)) {
+        json_flush(out);
+    }
+    out->buf[out->len++] = c;
+}
+
+static void json_literal(json_out_t *out, const char *s) {
+    json_bytes(out, s, strlen(s));
+}
+
+static void json_long(json_out_t *out, long l) {
+    char s[24];
+    int n = snprintf(s, sizeof(s), "%ld", l);
+    json_bytes(out, s, n);
+}
+
+// Writes a JSON string of UTF-8 text.
+static void json_string(json_out_t *out, const uint8_t *p, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    json_char(out, '"');
+    const uint8_t *run = p;
+    for (const uint8_t *end = p + n; p < end; p++) {
+        if (*p >= 0x20 && *p != '"' && *p != '\\') {
+            continue;
+        }
+        json_bytes(out, run, p - run);
+        char escape[6] = { '\\', (char)*p };
+        if (*p < 0x20) {
+            memcpy(escape + 1, "u00", 3);
+            escape[4] = hex[*p >> 4];
+            escape[5] = hex[*p & 0xf];
+            json_bytes(out, escape, 6);
+        } else {
+            json_bytes(out, escape, 2);
+        }
+        run = p + 1;
+    }
+    json_bytes(out, run, p - run);
+    json_char(out, '"');
+}
+
+// Writes a JSON string of base64.
+static void json_base64(json_out_t *out, const uint8_t *p, size_t n) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    json_char(out, '"');
+    for (; n >= 3; p += 3, n -= 3) {
+        char quad[4] = { alphabet[p[0] >> 2], alphabet[((p[0] & 3) << 4) | (p[1] >> 4)],
+                         alphabet[((p[1] & 0xf) << 2) | (p[2] >> 6)], alphabet[p[2] & 0x3f] };
+        json_bytes(out, quad, 4);
+    }
+    if (n > 0) {
+        char quad[4] = { alphabet[p[0] >> 2], '=', '=', '=' };
+        quad[1] = alphabet[((p[0] & 3) << 4) | (n == 2 ? p[1] >> 4 : 0)];
+        quad[2] = (n == 2) ? alphabet[(p[1] & 0xf) << 2] : '=';
+        json_bytes(out, quad, 4);
+    }
+    json_char(out, '"');
+}
+
+// Returns 1 if p is well-formed UTF-8 that a JSON string can carry.
+static int is_utf8(const uint8_t *p, size_t n) {
+    const uint8_t *end = p + n;
+    while (p < end) {
+        uint8_t c = *p++;
+        if (c < 0x80) {
+            continue;
+        }
+        int more;
+        uint32_t cp;
+        if (c >= 0xc2 && c <= 0xdf) {
+            more = 1;
+            cp = c & 0x1f;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            more = 2;
+            cp = c & 0x0f;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            more = 3;
+            cp = c & 0x07;
+        } else {
+            return 0;
+        }
+        if (end - p < more) {
+            return 0;
+        }
+        for (int i = 0; i < more; i++, p++) {
+            if ((*p & 0xc0) != 0x80) {
+                return 0;
+            }
+            cp = (cp << 6) | (*p & 0x3f);
+        }
+        // Overlong, surrogate or out of range.
+        if ((more == 2 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) ||
+            (more == 3 && (cp < 0x10000 || cp > 0x10ffff))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Reads the contents of a string TLV that fills v: UTF8String, PrintableString or IA5String.
+static int read_string(span_t v, span_t *contents) {
+    uint8_t tag;
+    if (read_tlv(&v, &tag, contents, NULL) != 0 || v.p != v.end || (tag != 0x0c && tag != 0x13 && tag != 0x16)) {
+        return -1;
+    }
+    return is_utf8(contents->p, contents->end - contents->p) ? 0 : -1;
+}
+
+// Reads a receipt attribute.
+static int read_attribute(span_t *set, attribute_t *attr) {
+    span_t seq, v;
+    if (expect_tlv(set, TAG_SEQUENCE, &seq, NULL) != 0 ||
+        expect_tlv(&seq, TAG_INTEGER, &v, NULL) != 0 || read_long(&v, &attr->type, NULL) != 0 ||
+        expect_tlv(&seq, TAG_INTEGER, &v, NULL) != 0 || read_long(&v, &attr->version, NULL) != 0 ||
+        expect_tlv(&seq, TAG_OCTET_STRING, &attr->value, NULL) != 0 || seq.p != seq.end) {
+        return -1;
+    }
+    return 0;
+}
+
+// Checks a SET OF ReceiptAttribute fills v, and bounds its elements.
+static int read_attributes(span_t v, span_t *set) {
+    if (expect_tlv(&v, TAG_SET, set, NULL) != 0 || v.p != v.end) {
+        return -1;
+    }
+    for (span_t s = *set; s.p < s.end;) {
+        attribute_t attr;
+        if (read_attribute(&s, &attr) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int field_index(long type) {
+    for (int i = 0; i < (int)(sizeof(kReceiptFields) / sizeof(kReceiptFields[0])); i++) {
+        if (kReceiptFields[i].type == type) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void json_attributes(json_out_t *out, span_t set, int nested);
+
+// Writes a value as its kind, or base64 if it doesn't decode as one.
+static void json_value(json_out_t *out, value_kind_t kind, span_t value) {
+    span_t contents, set;
+    switch (kind) {
+        case VALUE_STRING:
+            if (read_string(value, &contents) == 0) {
+                json_string(out, contents.p, contents.end - contents.p);
+                return;
+            }
+            break;
+        case VALUE_DATE:
+            if (read_string(value, &contents) == 0) {
+                timestamp_t ts;
+                char s[40];
+                if (timestamp_parse((const char *)contents.p, contents.end - contents.p, &ts) == 0) {
+                    ts.offset = 0;
+                    json_char(out, '"');
+                    json_bytes(out, s, timestamp_format(s, sizeof(s), &ts));
+                    json_char(out, '"');
+                } else {
+                    json_string(out, contents.p, contents.end - contents.p);
+                }
+                return;
+            }
+            break;
+        case VALUE_INTEGER: {
+            span_t v = value;
+            long l;
+            if (expect_tlv(&v, TAG_INTEGER, &contents, NULL) == 0 && v.p == v.end &&
+                read_long(&contents, &l, NULL) == 0) {
+                json_long(out, l);
+                return;
+            }
+            break;
+        }
+        case VALUE_IN_APP:
+            if (read_attributes(value, &set) == 0) {
+                json_attributes(out, set, 1);
+                return;
+            }
+            break;
+        case VALUE_BYTES:
+            break;
+    }
+    json_base64(out, value.p, value.end - value.p);
+}
+
+/*
+ * Writes an object of the attributes in a checked SET: the named fields in the order of the SET, then the
+ * in-app purchases as "in_app", then the remaining attributes as "attributes".
+ */
+static void json_attributes(json_out_t *out, span_t set, int nested) {
+    attribute_t attr;
+    int first = 1, any_in_app = 0, any_unknown = 0;
+
+    json_char(out, '{');
+    for (span_t s = set; s.p < s.end && read_attribute(&s, &attr) == 0;) {
+        int i = field_index(attr.type);
+        if (i < 0 || (nested && kReceiptFields[i].kind == VALUE_IN_APP)) {
+            any_unknown = 1;
+            continue;
+        }
+        if (kReceiptFields[i].kind == VALUE_IN_APP) {
+            any_in_app = 1;
+            continue;
+        }
+        json_literal(out, first ? "\"" : ",\"");
+        json_literal(out, kReceiptFields[i].name);
+        json_literal(out, "\":");
+        json_value(out, kReceiptFields[i].kind, attr.value);
+        first = 0;
+    }
+
+    if (any_in_app) {
+        json_literal(out, first ? "\"in_app\":[" : ",\"in_app\":[");
+        int first_in_app = 1;
+        for (span_t s = set; s.p < s.end && read_attribute(&s, &attr) == 0;) {
+            int i = field_index(attr.type);
+            if (i >= 0 && kReceiptFields[i].kind == VALUE_IN_APP) {
+                if (!first_in_app) {
+                    json_char(out, ',');
+                }
+                json_value(out, VALUE_IN_APP, attr.value);
+                first_in_app = 0;
+            }
+        }
+        json_char(out, ']');
+        first = 0;
+    }
+
+    if (any_unknown) {
+        json_literal(out, first ? "\"attributes\":[" : ",\"attributes\":[");
+        int first_unknown = 1;
+        for (span_t s = set; s.p < s.end && read_attribute(&s, &attr) == 0;) {
+            int i = field_index(attr.type);
+            if (i >= 0 && !(nested && kReceiptFields[i].kind == VALUE_IN_APP)) {
+                continue;
+            }
+            json_literal(out, first_unknown ? "{\"type\":" : ",{\"type\":");
+            json_long(out, attr.type);
+            json_literal(out, ",\"version\":");
+            json_long(out, attr.version);
+            json_literal(out, ",\"value\":");
+            json_base64(out, attr.value.p, attr.value.end - attr.value.p);
+            json_char(out, '}');
+            first_unknown = 0;
+        }
+        json_char(out, ']');
+    }
+    json_char(out, '}');
+}
+
+// See comment in header
+int app_receipt_to_json(const void *buf, size_t size, asn_app_consume_bytes_f *write, void *key) {
+    TRACE_SCOPE("app_receipt_to_json");
+    span_t in = { buf, (const uint8_t *)buf + size }, seq, v, tagged, content, info, set;
+    uint8_t tag;
+
+    // The SignedData down to its content, then the receipt attributes.
+    if (expect_tlv(&in, TAG_SEQUENCE, &seq, NULL) != 0 || expect_tlv(&seq, TAG_OBJECT_IDENTIFIER, &v, NULL) != 0 ||
+        expect_tlv(&seq, TAG_CONTEXT_0, &tagged, NULL) != 0 ||
+        expect_tlv(&tagged, TAG_SEQUENCE, &content, NULL) != 0 || expect_tlv(&content, TAG_INTEGER, &v, NULL) != 0 ||
+        read_tlv(&content, &tag, &v, NULL) != 0 || expect_tlv(&content, TAG_SEQUENCE, &info, NULL) != 0 ||
+        expect_tlv(&info, TAG_OBJECT_IDENTIFIER, &v, NULL) != 0 ||
+        expect_tlv(&info, TAG_CONTEXT_0, &tagged, NULL) != 0 || expect_tlv(&tagged, TAG_OCTET_STRING, &v, NULL) != 0 ||
+        read_attributes(v, &set) != 0) {
+        return -1;
+    }
+
+    json_out_t out = { .write = write, .key = key };
+    json_attributes(&out, set, 0);
+    return json_flush(&out);
+}
+
+/*** Summary ***/
+
+#define RECEIPT_TYPE_BUNDLE_ID 2
+#define RECEIPT_TYPE_IN_APP_PURCHASE 17
+#define RECEIPT_TYPE_PRODUCT_ID 1702
+#define RECEIPT_TYPE_EXPIRATION_DATE 1708
+#define RECEIPT_TYPE_CANCELLATION_DATE 1712
+
+// Reads a SET OF ReceiptAttribute at the start of v, as decode_attributes does.
+static int read_attribute_set(span_t v, span_t *set) {
+    if (expect_tlv(&v, TAG_SET, set, NULL) != 0) {
+        return -1;
+    }
+    for (span_t s = *set; s.p < s.end;) {
+        attribute_t attr;
+        if (read_attribute(&s, &attr) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Reads a string attribute value of the given type into dst, like ber_decode. Returns 0 on success.
+static int summary_string(span_t value, uint8_t expected, asn_TYPE_descriptor_t *type, char *dst, size_t len) {
+    span_t v = value, contents;
+    uint8_t tag;
+    if (read_tlv(&v, &tag, &contents, NULL) == 0 && tag == expected) {
+        size_t n = contents.end - contents.p;
+        if (n >= len) {
+            return -1;
+        }
+        memcpy(dst, contents.p, n);
+        dst[n] = '\0';
+        return 0;
+    }
+
+    // Constructed and long-form strings, and whatever else ber_decode makes of the value.
+    OCTET_STRING_t *s = NULL;
+    asn_dec_rval_t rval = ber_decode(0, type, (void **)&s, value.p, value.end - value.p);
+    int ok = (rval.code == RC_OK && (size_t)s->size < len);
+    if (ok) {
+        memcpy(dst, s->buf, s->size);
+        dst[s->size] = '\0';
+    }
+    if (s != NULL) {
+        ASN_STRUCT_FREE(*type, s);
+    }
+    return ok ? 0 : -1;
+}
+
+// Parses a date attribute value. Returns 0 on success, -1 if it's missing or not a date, like a nil NSDate.
+static int summary_date(span_t value, int64_t *ms) {
+    char s[64];
+    timestamp_t ts;
+    if (summary_string(value, 0x16, &asn_DEF_IA5String, s, sizeof(s)) != 0 ||
+        timestamp_parse(s, strlen(s), &ts) != 0) {
+        return -1;
+    }
+    *ms = ts.sec * 1000 + ts.nsec / 1000000;
+    return 0;
+}
+
+// An in-app purchase as it is read.
+typedef struct {
+    char product_id[APP_RECEIPT_SUMMARY_STRING];
+    int64_t expiration_ms;
+    int has_expiration;
+    int cancelled;
+} in_app_t;
+
+static void summary_in_app_attribute(long type, span_t value, in_app_t *iap) {
+    int64_t cancellation_ms;
+    if (value.p == value.end) {
+        return;
+    }
+    switch (type) {
+        case RECEIPT_TYPE_PRODUCT_ID:
+            summary_string(value, 0x0c, &asn_DEF_UTF8String, iap->product_id, sizeof(iap->product_id));
+            break;
+        case RECEIPT_TYPE_EXPIRATION_DATE:
+            iap->has_expiration = (summary_date(value, &iap->expiration_ms) == 0);
+            break;
+        case RECEIPT_TYPE_CANCELLATION_DATE:
+            iap->cancelled = (summary_date(value, &cancellation_ms) == 0);
+            break;
+    }
+}
+
+static void summary_in_app(span_t value, app_receipt_summary_t *summary) {
+    in_app_t iap = { "" };
+    span_t set;
+    attribute_t attr;
+    if (read_attribute_set(value, &set) == 0) {
+        while (set.p < set.end && read_attribute(&set, &attr) == 0) {
+            summary_in_app_attribute(attr.type, attr.value, &iap);
+        }
+    } else {
+        ReceiptAttributes_t *attrs = NULL;
+        if (app_receipt_decode_attributes(value.p, value.end - value.p, &attrs, 0).code != RC_OK) {
+            ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+            return;
+        }
+        for (int i = 0; i < attrs->list.count; i++) {
+            const ReceiptAttribute_t *a = attrs->list.array[i];
+            span_t v = { a->value.buf, a->value.buf + a->value.size };
+            summary_in_app_attribute(a->type, v, &iap);
+        }
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    }
+
+    summary->iap_count++;
+    if (iap.cancelled) {
+        summary->cancelled_count++;
+    } else if (iap.has_expiration && iap.product_id[0] != '\0' &&
+               (summary->product_id[0] == '\0' || summary->latest_expiration_ms < iap.expiration_ms)) {
+        summary->latest_expiration_ms = iap.expiration_ms;
+        strcpy(summary->product_id, iap.product_id);
+    }
+}
+
+static void summary_attribute(long type, span_t value, app_receipt_summary_t *summary) {
+    if (value.p == value.end) {
+        return;
+    }
+    switch (type) {
+        case RECEIPT_TYPE_BUNDLE_ID:
+            summary_string(value, 0x0c, &asn_DEF_UTF8String, summary->bundle_id, sizeof(summary->bundle_id));
+            break;
+        case RECEIPT_TYPE_IN_APP_PURCHASE:
+            summary_in_app(value, summary);
+            break;
+    }
+}
+
+// See comment in header
+int app_receipt_summarize(const void *buf, size_t size, app_receipt_summary_t *summary) {
+    TRACE_SCOPE("app_receipt_summarize");
+    SignedData_t *sd = NULL;
+    signed_data_view_t view;
+    span_t payload, set;
+    size_t consumed;
+    attribute_t attr;
+
+    memset(summary, 0, sizeof(*summary));
+    long version;
+    if (read_signed_data(buf, size, &view, &consumed, NULL) == 0 && read_long(&view.version, &version, NULL) == 0) {
+        payload = view.content_data;
+    } else {
+        if (app_receipt_decode_signed_data(buf, size, &sd, 0).code != RC_OK) {
+            ASN_STRUCT_FREE(asn_DEF_SignedData, sd);
+            return -1;
+        }
+        const OCTET_STRING_t *content = &sd->content.contentInfo.contentData;
+        payload.p = content->buf;
+        payload.end = content->buf + content->size;
+    }
+
+    int ret = 0;
+    if (read_attribute_set(payload, &set) == 0) {
+        while (set.p < set.end && read_attribute(&set, &attr) == 0) {
+            summary_attribute(attr.type, attr.value, summary);
+        }
+    } else {
+        ReceiptAttributes_t *attrs = NULL;
+        if (app_receipt_decode_attributes(payload.p, payload.end - payload.p, &attrs, 0).code == RC_OK) {
+            for (int i = 0; i < attrs->list.count; i++) {
+                const ReceiptAttribute_t *a = attrs->list.array[i];
+                span_t v = { a->value.buf, a->value.buf + a->value.size };
+                summary_attribute(a->type, v, summary);
+            }
+        } else {
+            ret = -1;
+        }
+        ASN_STRUCT_FREE(asn_DEF_ReceiptAttributes, attrs);
+    }
+    ASN_STRUCT_FREE(asn_DEF_SignedData, sd);
+    return ret;
+}
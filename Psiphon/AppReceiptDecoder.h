@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef AppReceiptDecoder_h
+#define AppReceiptDecoder_h
+
+#include "ReceiptAttributes.h"
+#include "SignedData.h"
+
+/*
+ * Decoders for the app receipt's ASN.1 types, specialized by hand from pkcs7-signed-data-simplified.asn1:
+ * the tags, lengths and members of SignedData, ReceiptAttributes and ReceiptAttribute are read in
+ * straight-line code instead of through the generic asn1c tables. They produce the same structures as
+ * ber_decode with asn_DEF_SignedData and asn_DEF_ReceiptAttributes, to be freed with ASN_STRUCT_FREE.
+ *
+ * Only the DER shapes the App Store produces are decoded this way. Anything else (indefinite lengths,
+ * constructed strings, unexpected tags, truncated input) falls back to ber_decode, so the results are
+ * always those of the generic decoder.
+ *
+ * Keep in step with the generated SignedData.c, ReceiptAttributes.c and ReceiptAttribute.c.
+ */
+
+// Flag: don't fall back to ber_decode. Input the specialized decoder doesn't handle fails with RC_FAIL.
+#define APP_RECEIPT_NO_FALLBACK 1
+
+/*
+ * Flag: accept only canonical DER, checked in the same pass as decoding: definite lengths in the fewest
+ * octets, SET OF elements in DER order (each compared with the one before it as it is read), primitive
+ * strings and minimal INTEGERs, down through the SignedData's certificates and signer infos. There is no
+ * fallback. On failure, rval.consumed is the offset of the first octet that isn't canonical DER, or that
+ * the specialized decoder stopped at.
+ *
+ * The DER encoding of a value is unique, so a receipt that passes can be remembered by its hash and its
+ * decoded contents reused without checking it again.
+ */
+#define APP_RECEIPT_STRICT_DER 2
+
+/*!
+ * @brief Decodes a SignedData, like ber_decode(0, &asn_DEF_SignedData, (void **)signed_data, buf, size).
+ *
+ * @param signed_data Populated with the decoded structure, which must be freed with ASN_STRUCT_FREE even if
+ *                    decoding fails. If it isn't NULL on entry, decoding continues into it with ber_decode,
+ *                    or fails with APP_RECEIPT_STRICT_DER.
+ * @param flags 0, APP_RECEIPT_NO_FALLBACK or APP_RECEIPT_STRICT_DER.
+ */
+asn_dec_rval_t app_receipt_decode_signed_data(const void *buf, size_t size, SignedData_t **signed_data, int flags);
+
+/*!
+ * @brief Decodes ReceiptAttributes, like ber_decode(0, &asn_DEF_ReceiptAttributes, (void **)attrs, buf, size).
+ *
+ * Used for both the receipt's attributes and the attributes of each in-app purchase.
+ *
+ * @param attrs Populated with the decoded structure, which must be freed with ASN_STRUCT_FREE even if
+ *              decoding fails. If it isn't NULL on entry, decoding continues into it with ber_decode, or
+ *              fails with APP_RECEIPT_STRICT_DER.
+ * @param flags 0, APP_RECEIPT_NO_FALLBACK or APP_RECEIPT_STRICT_DER.
+ */
+asn_dec_rval_t app_receipt_decode_attributes(const void *buf, size_t size, ReceiptAttributes_t **attrs, int flags);
+
+/*!
+ * @brief Transcodes a DER app receipt into compact JSON, for support and feedback.
+ *
+ * The receipt's TLVs are walked directly and written out as they are read, through a fixed-size buffer:
+ * no structures are decoded and nothing is allocated. The output is an object shaped like the App Store's
+ * verifyReceipt response, e.g.
+ *
+ *     {"bundle_id":"ca.psiphon.Psiphon",...,"in_app":[{"product_id":"...","expires_date":"2018-02-01T00:00:00Z",...}],
+ *      "attributes":[{"type":8,"version":1,"value":"..."}]}
+ *
+ * Known attribute types are named. Dates are normalized to UTC, integers are numbers, and strings are
+ * JSON strings. Everything else, including unknown types and values that don't decode as their type's
+ * value should, is kept under "attributes" or as the named value, base64 encoded.
+ *
+ * The receipt's structure is checked before anything is written.
+ *
+ * @param write Called with the JSON in chunks. Returns 0 on success, or -1 to stop.
+ * @return 0 on success, -1 if the receipt is malformed or write failed.
+ */
+int app_receipt_to_json(const void *buf, size_t size, asn_app_consume_bytes_f *write, void *key);
+
+// Size of the summary's strings, including the terminating NUL.
+#define APP_RECEIPT_SUMMARY_STRING 128
+
+/*!
+ * @brief What PsiphonAppReceipt reads from a receipt.
+ */
+typedef struct {
+    char bundle_id[APP_RECEIPT_SUMMARY_STRING];
+    char product_id[APP_RECEIPT_SUMMARY_STRING];    // Product of the latest expiring subscription, or "".
+    int64_t latest_expiration_ms;                   // 0 if there is no subscription.
+    size_t iap_count;                               // In-app purchases, including cancelled ones.
+    size_t cancelled_count;
+} app_receipt_summary_t;
+
+/*!
+ * @brief Summarizes a DER app receipt the way PsiphonAppReceipt reads it.
+ *
+ * Purchases that are cancelled or lack a product or expiration date are skipped, and the first of equally
+ * late expirations wins. Strings that don't fit the summary are ignored, and dates that don't parse as
+ * RFC 3339 are treated as missing.
+ *
+ * The receipt's TLVs are walked in place, and only values in forms the specialized decoders don't handle
+ * are decoded through asn1c, so the results are those of decoding with ber_decode.
+ *
+ * @return 0 on success, -1 if the receipt or its attributes can't be decoded.
+ */
+int app_receipt_summarize(const void *buf, size_t size, app_receipt_summary_t *summary);
+
+#endif /* AppReceiptDecoder_h */
@@ -18,6 +18,11 @@
  */
 
 #import "EmbeddedServerEntriesHelpers.h"
+#ifdef PSIPHON_TRACE
+#import "Trace.h"
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#endif
 #import <errno.h>
 #import <stdlib.h>
 #import <string.h>
@@ -28,6 +33,7 @@ char * strchrn(char const *s, int c, int n);
 
 // See comment in header
 char * hex_decode(const char *s) {
+    TRACE_SCOPE("hex_decode");
     if (s == NULL) {
         return NULL;
     }
@@ -76,6 +82,7 @@ void drop_newline_and_carriage_return(char *s) {
 
 // See comment in header
 char * server_entry_json(const char *s) {
+    TRACE_SCOPE("server_entry_json");
     // Skip past legacy format (4 space delimited fields)
     // to the JSON config and return a pointer to it.
     const char delim = ' ';
@@ -0,0 +1,707 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "FeedbackBundle.h"
+#include "JSONPath.h"
+#include "Trace.h"
+#include "timestamp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define EPOCH_TIMESTAMP "1970-01-01T00:00:00.000Z"
+
+// Worst case size of a re-encoded entry: every byte of the line escaped, plus the fixed layout.
+#define MAX_ENTRY_LEN (2 * FEEDBACK_BUNDLE_MAX_LINE + 256)
+
+struct feedback_bundle_writer {
+    feedback_bundle_write_fn write;
+    void *ctx;
+    int failed;
+
+    // Chunked output.
+    uint8_t *out;
+    size_t out_len;
+    size_t chunk_size;
+    uint64_t payload_offset;
+
+    // Current uncompressed frame.
+    uint8_t raw[FEEDBACK_BUNDLE_FRAME_SIZE];
+    size_t raw_len;
+    uint64_t raw_offset;
+    uint32_t frame_first_entry;
+    uint32_t frame_entry_count;
+
+    // Compressor.
+    z_stream zs;
+    uint8_t *comp;
+    size_t comp_cap;
+
+    // Frame index.
+    feedback_bundle_frame_t *frames;
+    uint32_t frame_count;
+
+    // Notice members extracted from each line.
+    json_path_set_t *notice_paths;
+
+    uint32_t entry_count;
+
+    // Line assembly and entry re-encoding.
+    char read_buf[FEEDBACK_BUNDLE_READ_SIZE];
+    char line[FEEDBACK_BUNDLE_MAX_LINE];
+    char entry[MAX_ENTRY_LEN];
+};
+
+/*** Little-endian helpers ***/
+
+static void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/*** Output ***/
+
+static int out_flush(feedback_bundle_writer_t *w) {
+    if (w->out_len > 0 && !w->failed) {
+        if (w->write(w->ctx, w->out, w->out_len) != 0) {
+            w->failed = 1;
+        }
+    }
+    w->out_len = 0;
+    return w->failed ? -1 : 0;
+}
+
+static int out_write(feedback_bundle_writer_t *w, const uint8_t *buf, size_t len) {
+    while (len > 0) {
+        size_t n = w->chunk_size - w->out_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->out + w->out_len, buf, n);
+        w->out_len += n;
+        w->payload_offset += n;
+        buf += n;
+        len -= n;
+        if (w->out_len == w->chunk_size && out_flush(w) != 0) {
+            return -1;
+        }
+    }
+    return w->failed ? -1 : 0;
+}
+
+static int flush_frame(feedback_bundle_writer_t *w) {
+    if (w->raw_len == 0) {
+        return 0;
+    }
+
+    if (w->frame_count == FEEDBACK_BUNDLE_MAX_FRAMES) {
+        return -1;
+    }
+
+    // Each frame is a complete raw deflate stream so that it can be inflated on its own.
+    if (deflateReset(&w->zs) != Z_OK) {
+        return -1;
+    }
+    w->zs.next_in = w->raw;
+    w->zs.avail_in = (uInt)w->raw_len;
+    w->zs.next_out = w->comp;
+    w->zs.avail_out = (uInt)w->comp_cap;
+    if (deflate(&w->zs, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    size_t comp_len = w->comp_cap - w->zs.avail_out;
+
+    feedback_bundle_frame_t *f = &w->frames[w->frame_count++];
+    f->raw_offset = w->raw_offset;
+    f->payload_offset = w->payload_offset;
+    f->compressed_len = (uint32_t)comp_len;
+    f->raw_len = (uint32_t)w->raw_len;
+    f->first_entry = w->frame_first_entry;
+    f->entry_count = w->frame_entry_count;
+
+    uint8_t header[FEEDBACK_BUNDLE_FRAME_HEADER_LEN];
+    put_u32(header, (uint32_t)comp_len);
+    put_u32(header + 4, (uint32_t)w->raw_len);
+    if (out_write(w, header, sizeof(header)) != 0 || out_write(w, w->comp, comp_len) != 0) {
+        return -1;
+    }
+
+    w->raw_offset += w->raw_len;
+    w->raw_len = 0;
+    w->frame_first_entry = w->entry_count;
+    w->frame_entry_count = 0;
+    return 0;
+}
+
+static int emit_raw(feedback_bundle_writer_t *w, const char *buf, size_t len) {
+    while (len > 0) {
+        if (w->raw_len == FEEDBACK_BUNDLE_FRAME_SIZE && flush_frame(w) != 0) {
+            return -1;
+        }
+        size_t n = FEEDBACK_BUNDLE_FRAME_SIZE - w->raw_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(w->raw + w->raw_len, buf, n);
+        w->raw_len += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Emits one complete entry. Entries are kept within a single frame whenever they fit.
+static int emit_entry(feedback_bundle_writer_t *w, const char *entry, size_t len) {
+    size_t total = len + 1; // leading '[' or ','
+    if (w->raw_len > 0 && w->raw_len + total > FEEDBACK_BUNDLE_FRAME_SIZE) {
+        if (flush_frame(w) != 0) {
+            return -1;
+        }
+    }
+
+    if (w->frame_entry_count == 0) {
+        w->frame_first_entry = w->entry_count;
+    }
+    w->frame_entry_count++;
+
+    const char *sep = (w->entry_count == 0) ? "[" : ",";
+    w->entry_count++;
+
+    if (emit_raw(w, sep, 1) != 0 || emit_raw(w, entry, len) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/*** Notice members ***/
+
+// Paths extracted from each notice line, in this order.
+static const char *const kNoticePaths[] = { "data", "noticeType", "timestamp" };
+enum { NOTICE_DATA, NOTICE_TYPE, NOTICE_TIMESTAMP, NOTICE_PATH_COUNT };
+
+/*** Entry re-encoding ***/
+
+static char * append(char *dst, const char *src, size_t len) {
+    memcpy(dst, src, len);
+    return dst + len;
+}
+
+// Appends JSON text so that it reads back verbatim from inside a JSON string.
+static char * append_escaped(char *dst, const char *src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = src[i];
+        if (c == '"' || c == '\\') {
+            *dst++ = '\\';
+        }
+        *dst++ = c;
+    }
+    return dst;
+}
+
+/*!
+ * @brief Appends the string form of a JSON value, close to what -[NSObject description] prints.
+ *
+ * String values are already escaped, their contents are copied as-is. Objects are copied
+ * in their compact serialized form, which is what readLogsData: re-serializes them to.
+ * Arrays and numbers are copied as JSON text too, which differs from their descriptions:
+ * see the header.
+ */
+static char * append_description(char *dst, const json_path_value_t *v) {
+    switch (v->type) {
+        case JSON_PATH_MISSING:
+            return append(dst, "(null)", 6);
+        case JSON_PATH_STRING:
+            return append(dst, v->start, v->len);
+        case JSON_PATH_TRUE:
+            return append(dst, "1", 1);
+        case JSON_PATH_FALSE:
+            return append(dst, "0", 1);
+        case JSON_PATH_NULL:
+            return append(dst, "<null>", 6);
+        default:
+            return append_escaped(dst, v->start, v->len);
+    }
+}
+
+#define ENTRY_PREFIX "{\"data\":{},\"msg\":\""
+#define ENTRY_PREFIX_LEN (sizeof(ENTRY_PREFIX) - 1)
+#define ENTRY_TIMESTAMP "\",\"timestamp!!timestamp\":\""
+#define ENTRY_TIMESTAMP_LEN (sizeof(ENTRY_TIMESTAMP) - 1)
+
+// Maximum length of a timestamp passed to feedback_bundle_add_entry.
+#define MAX_TIMESTAMP_LEN 64
+
+/*!
+ * @brief Completes an entry whose msg has already been written at entry + ENTRY_PREFIX_LEN.
+ * @return Length of the entry.
+ */
+static size_t finish_entry(char *entry, size_t msg_len, const char *timestamp, size_t timestamp_len) {
+    memcpy(entry, ENTRY_PREFIX, ENTRY_PREFIX_LEN);
+    char *p = entry + ENTRY_PREFIX_LEN + msg_len;
+    p = append(p, ENTRY_TIMESTAMP, ENTRY_TIMESTAMP_LEN);
+    p = append(p, timestamp, timestamp_len);
+    p = append(p, "\"}", 2);
+    return (size_t)(p - entry);
+}
+
+static int is_valid_timestamp(const json_path_value_t *ts) {
+    timestamp_t t;
+    return ts->type == JSON_PATH_STRING && timestamp_parse(ts->start, ts->len, &t) == 0;
+}
+
+static int add_notice_line(feedback_bundle_writer_t *w, const char *line, size_t len) {
+    json_path_value_t members[NOTICE_PATH_COUNT];
+
+    if (json_path_extract(w->notice_paths, line, len, members) < 0) {
+        // Same as readLogsData:, lines that fail to parse are skipped.
+        return 0;
+    }
+
+    // msg is "<noticeType>: <data>", built in place after the fixed prefix of the entry.
+    char *msg = w->entry + ENTRY_PREFIX_LEN;
+    char *p = append_description(msg, &members[NOTICE_TYPE]);
+    p = append(p, ": ", 2);
+    p = append_description(p, &members[NOTICE_DATA]);
+
+    const char *ts = EPOCH_TIMESTAMP;
+    size_t ts_len = sizeof(EPOCH_TIMESTAMP) - 1;
+    if (is_valid_timestamp(&members[NOTICE_TIMESTAMP])) {
+        ts = members[NOTICE_TIMESTAMP].start;
+        ts_len = members[NOTICE_TIMESTAMP].len;
+    }
+
+    size_t entry_len = finish_entry(w->entry, (size_t)(p - msg), ts, ts_len);
+    return emit_entry(w, w->entry, entry_len);
+}
+
+/*** Sources ***/
+
+/*!
+ * @brief Reads the timestamp of the last notice in the file at path.
+ * @return 1 if found, 0 otherwise.
+ */
+static int last_timestamp(feedback_bundle_writer_t *w, const char *path, timestamp_t *tsp) {
+    TRACE_SCOPE("feedback_bundle_last_timestamp");
+    if (path == NULL) {
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    int found = 0;
+    if (fseek(fp, 0, SEEK_END) == 0) {
+        long size = ftell(fp);
+        long n = (size > FEEDBACK_BUNDLE_MAX_LINE) ? FEEDBACK_BUNDLE_MAX_LINE : size;
+        if (n > 0 && fseek(fp, size - n, SEEK_SET) == 0 && fread(w->line, 1, (size_t)n, fp) == (size_t)n) {
+            // Walk lines backwards until one with a valid timestamp is found.
+            long end = n;
+            while (end > 0 && !found) {
+                long start = end - 1;
+                while (start > 0 && w->line[start - 1] != '\n') {
+                    start--;
+                }
+                json_path_value_t members[NOTICE_PATH_COUNT];
+                if (end > start &&
+                    json_path_extract(w->notice_paths, w->line + start, (size_t)(end - start), members) >= 0 &&
+                    is_valid_timestamp(&members[NOTICE_TIMESTAMP])) {
+                    found = (timestamp_parse(members[NOTICE_TIMESTAMP].start, members[NOTICE_TIMESTAMP].len, tsp) == 0);
+                }
+                if (start == 0 && size > n) {
+                    // Partial line at the start of the window.
+                    break;
+                }
+                end = start - 1;
+            }
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+// See comment in header
+int feedback_bundle_add_sources(feedback_bundle_writer_t *w, const feedback_bundle_source_t *sources, size_t n) {
+    TRACE_SCOPE("feedback_bundle_add_sources");
+    if (n == 0) {
+        return 0;
+    }
+
+    size_t *order = malloc(n * sizeof(size_t));
+    timestamp_t *last = malloc(n * sizeof(timestamp_t));
+    int *has_last = malloc(n * sizeof(int));
+    if (order == NULL || last == NULL || has_last == NULL) {
+        free(order);
+        free(last);
+        free(has_last);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        has_last[i] = last_timestamp(w, sources[i].path, &last[i]) ||
+                      last_timestamp(w, sources[i].older_path, &last[i]);
+    }
+
+    // Stable insertion sort, newest last notice first. Sources without notices go last.
+    for (size_t i = 0; i < n; i++) {
+        size_t j = i;
+        while (j > 0) {
+            size_t a = order[j - 1];
+            int newer = has_last[i] && (!has_last[a] || timestamp_compare(&last[i], &last[a]) > 0);
+            if (!newer) {
+                break;
+            }
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; i++) {
+        const feedback_bundle_source_t *s = &sources[order[i]];
+        if (s->older_path != NULL) {
+            rc = feedback_bundle_add_file(w, s->older_path);
+        }
+        if (rc == 0 && s->path != NULL) {
+            rc = feedback_bundle_add_file(w, s->path);
+        }
+    }
+
+    free(order);
+    free(last);
+    free(has_last);
+    return rc;
+}
+
+// See comment in header
+int feedback_bundle_add_file(feedback_bundle_writer_t *w, const char *path) {
+    TRACE_SCOPE("feedback_bundle_add_file");
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    size_t line_len = 0;
+    int overflow = 0;
+    int rc = 0;
+    size_t nread;
+
+    while (rc == 0 && (nread = fread(w->read_buf, 1, sizeof(w->read_buf), fp)) > 0) {
+        const char *p = w->read_buf, *end = w->read_buf + nread;
+        while (p < end && rc == 0) {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            size_t n = (size_t)((nl != NULL ? nl : end) - p);
+
+            if (!overflow) {
+                if (line_len + n > sizeof(w->line)) {
+                    overflow = 1;
+                } else {
+                    memcpy(w->line + line_len, p, n);
+                    line_len += n;
+                }
+            }
+
+            if (nl == NULL) {
+                break;
+            }
+
+            if (!overflow) {
+                if (line_len > 0 && w->line[line_len - 1] == '\r') {
+                    line_len--;
+                }
+                if (line_len > 0) {
+                    rc = add_notice_line(w, w->line, line_len);
+                }
+            }
+            line_len = 0;
+            overflow = 0;
+            p = nl + 1;
+        }
+    }
+
+    if (rc == 0 && ferror(fp)) {
+        rc = -1;
+    }
+
+    // Trailing line without a newline.
+    if (rc == 0 && !overflow && line_len > 0) {
+        if (w->line[line_len - 1] == '\r') {
+            line_len--;
+        }
+        if (line_len > 0) {
+            rc = add_notice_line(w, w->line, line_len);
+        }
+    }
+
+    fclose(fp);
+    return rc;
+}
+
+// See comment in header
+int feedback_bundle_add_entry(feedback_bundle_writer_t *w, const char *msg, size_t msg_len, const char *timestamp) {
+    size_t timestamp_len = strlen(timestamp);
+    if (msg_len > FEEDBACK_BUNDLE_MAX_LINE || timestamp_len > MAX_TIMESTAMP_LEN) {
+        return -1;
+    }
+
+    // msg is plain text here and needs full JSON string escaping.
+    char *start = w->entry + ENTRY_PREFIX_LEN;
+    char *p = start;
+    for (size_t i = 0; i < msg_len; i++) {
+        unsigned char c = (unsigned char)msg[i];
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = (char)c;
+        } else if (c == '\n') {
+            p = append(p, "\\n", 2);
+        } else if (c == '\r') {
+            p = append(p, "\\r", 2);
+        } else if (c == '\t') {
+            p = append(p, "\\t", 2);
+        } else if (c < 0x20) {
+            // Control characters are rare enough that dropping them is acceptable.
+            continue;
+        } else {
+            *p++ = (char)c;
+        }
+    }
+
+    size_t len = finish_entry(w->entry, (size_t)(p - start), timestamp, timestamp_len);
+    return emit_entry(w, w->entry, len);
+}
+
+/*** Writer lifecycle ***/
+
+// See comment in header
+feedback_bundle_writer_t * feedback_bundle_writer_new(feedback_bundle_write_fn write, void *ctx, size_t chunk_size) {
+    if (write == NULL || chunk_size == 0) {
+        return NULL;
+    }
+
+    feedback_bundle_writer_t *w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return NULL;
+    }
+
+    w->write = write;
+    w->ctx = ctx;
+    w->chunk_size = chunk_size;
+    w->out = malloc(chunk_size);
+    w->frames = malloc(FEEDBACK_BUNDLE_MAX_FRAMES * sizeof(feedback_bundle_frame_t));
+
+    // Raw deflate (negative window bits), no zlib header per frame.
+    if (deflateInit2(&w->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(w->out);
+        free(w->frames);
+        free(w);
+        return NULL;
+    }
+    w->comp_cap = deflateBound(&w->zs, FEEDBACK_BUNDLE_FRAME_SIZE);
+    w->comp = malloc(w->comp_cap);
+    // The whole line is walked so that truncated lines are skipped, like readLogsData: does.
+    w->notice_paths = json_path_set_new(kNoticePaths, NOTICE_PATH_COUNT, JSON_PATH_WHOLE_OBJECT);
+
+    if (w->out == NULL || w->frames == NULL || w->comp == NULL || w->notice_paths == NULL) {
+        feedback_bundle_writer_free(w);
+        return NULL;
+    }
+
+    uint8_t header[FEEDBACK_BUNDLE_HEADER_LEN];
+    memcpy(header, "PSFB", 4);
+    header[4] = FEEDBACK_BUNDLE_VERSION;
+    header[5] = FEEDBACK_BUNDLE_CODEC_DEFLATE;
+    put_u16(header + 6, 0);
+    if (out_write(w, header, sizeof(header)) != 0) {
+        feedback_bundle_writer_free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+// See comment in header
+int feedback_bundle_finish(feedback_bundle_writer_t *w) {
+    TRACE_SCOPE("feedback_bundle_finish");
+    const char *close = (w->entry_count == 0) ? "[]" : "]";
+    if (emit_raw(w, close, strlen(close)) != 0 || flush_frame(w) != 0) {
+        return -1;
+    }
+
+    uint8_t rec[FEEDBACK_BUNDLE_INDEX_ENTRY_LEN];
+    for (uint32_t i = 0; i < w->frame_count; i++) {
+        const feedback_bundle_frame_t *f = &w->frames[i];
+        put_u64(rec, f->raw_offset);
+        put_u64(rec + 8, f->payload_offset);
+        put_u32(rec + 16, f->compressed_len);
+        put_u32(rec + 20, f->raw_len);
+        put_u32(rec + 24, f->first_entry);
+        put_u32(rec + 28, f->entry_count);
+        if (out_write(w, rec, sizeof(rec)) != 0) {
+            return -1;
+        }
+    }
+
+    uint8_t footer[FEEDBACK_BUNDLE_FOOTER_LEN];
+    put_u32(footer, w->frame_count);
+    put_u32(footer + 4, w->entry_count);
+    memcpy(footer + 8, "PSFI", 4);
+    if (out_write(w, footer, sizeof(footer)) != 0) {
+        return -1;
+    }
+
+    return out_flush(w);
+}
+
+// See comment in header
+uint32_t feedback_bundle_entry_count(const feedback_bundle_writer_t *w) {
+    return w->entry_count;
+}
+
+// See comment in header
+void feedback_bundle_writer_free(feedback_bundle_writer_t *w) {
+    if (w == NULL) {
+        return;
+    }
+    deflateEnd(&w->zs);
+    free(w->out);
+    free(w->comp);
+    free(w->frames);
+    json_path_set_free(w->notice_paths);
+    free(w);
+}
+
+/*** Reading ***/
+
+// See comment in header
+int feedback_bundle_read_index(const uint8_t *payload, size_t len, feedback_bundle_frame_t **frames, uint32_t *count) {
+    if (len < FEEDBACK_BUNDLE_HEADER_LEN + FEEDBACK_BUNDLE_FOOTER_LEN ||
+        memcmp(payload, "PSFB", 4) != 0 || payload[4] != FEEDBACK_BUNDLE_VERSION ||
+        payload[5] != FEEDBACK_BUNDLE_CODEC_DEFLATE ||
+        memcmp(payload + len - 4, "PSFI", 4) != 0) {
+        return -1;
+    }
+
+    uint32_t n = get_u32(payload + len - FEEDBACK_BUNDLE_FOOTER_LEN);
+    if (n > FEEDBACK_BUNDLE_MAX_FRAMES ||
+        (uint64_t)n * FEEDBACK_BUNDLE_INDEX_ENTRY_LEN > len - FEEDBACK_BUNDLE_HEADER_LEN - FEEDBACK_BUNDLE_FOOTER_LEN) {
+        return -1;
+    }
+
+    size_t index_offset = len - FEEDBACK_BUNDLE_FOOTER_LEN - (size_t)n * FEEDBACK_BUNDLE_INDEX_ENTRY_LEN;
+
+    feedback_bundle_frame_t *f = malloc((n > 0 ? n : 1) * sizeof(feedback_bundle_frame_t));
+    if (f == NULL) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *rec = payload + index_offset + (size_t)i * FEEDBACK_BUNDLE_INDEX_ENTRY_LEN;
+        f[i].raw_offset = get_u64(rec);
+        f[i].payload_offset = get_u64(rec + 8);
+        f[i].compressed_len = get_u32(rec + 16);
+        f[i].raw_len = get_u32(rec + 20);
+        f[i].first_entry = get_u32(rec + 24);
+        f[i].entry_count = get_u32(rec + 28);
+
+        // Subtractions rather than sums, which a crafted payload_offset could wrap.
+        if (f[i].payload_offset < FEEDBACK_BUNDLE_HEADER_LEN || f[i].payload_offset > index_offset ||
+            index_offset - f[i].payload_offset < FEEDBACK_BUNDLE_FRAME_HEADER_LEN ||
+            f[i].compressed_len > index_offset - f[i].payload_offset - FEEDBACK_BUNDLE_FRAME_HEADER_LEN ||
+            f[i].raw_len > FEEDBACK_BUNDLE_FRAME_SIZE) {
+            free(f);
+            return -1;
+        }
+    }
+
+    *frames = f;
+    *count = n;
+    return 0;
+}
+
+// See comment in header
+int feedback_bundle_decompress(const uint8_t *payload, size_t len, feedback_bundle_write_fn write, void *ctx) {
+    feedback_bundle_frame_t *frames;
+    uint32_t count;
+
+    if (feedback_bundle_read_index(payload, len, &frames, &count) != 0) {
+        return -1;
+    }
+
+    uint8_t *raw = malloc(FEEDBACK_BUNDLE_FRAME_SIZE);
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (raw == NULL || inflateInit2(&zs, -15) != Z_OK) {
+        free(raw);
+        free(frames);
+        return -1;
+    }
+
+    int rc = 0;
+    for (uint32_t i = 0; i < count && rc == 0; i++) {
+        const uint8_t *frame = payload + frames[i].payload_offset;
+        if (get_u32(frame) != frames[i].compressed_len || get_u32(frame + 4) != frames[i].raw_len) {
+            rc = -1;
+            break;
+        }
+
+        inflateReset(&zs);
+        zs.next_in = (Bytef *)(frame + FEEDBACK_BUNDLE_FRAME_HEADER_LEN);
+        zs.avail_in = frames[i].compressed_len;
+        zs.next_out = raw;
+        zs.avail_out = FEEDBACK_BUNDLE_FRAME_SIZE;
+        if (inflate(&zs, Z_FINISH) != Z_STREAM_END ||
+            FEEDBACK_BUNDLE_FRAME_SIZE - zs.avail_out != frames[i].raw_len) {
+            rc = -1;
+            break;
+        }
+
+        if (write(ctx, raw, frames[i].raw_len) != 0) {
+            rc = -1;
+        }
+    }
+
+    inflateEnd(&zs);
+    free(raw);
+    free(frames);
+    return rc;
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FeedbackBundle_h
+#define FeedbackBundle_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming builder for the feedback diagnostics bundle.
+ *
+ * Reads the rotating notices files line by line through fixed size buffers,
+ * re-encodes every notice into the diagnostic history entry layout produced by
+ * FeedbackUpload for a DiagnosticEntry:
+ *
+ *   {"data":{},"msg":"<noticeType>: <data>","timestamp!!timestamp":"<timestamp>"}
+ *
+ * and deflates the resulting JSON array into independently decompressible frames.
+ * Peak memory is bounded by the buffer sizes below, regardless of how many log
+ * lines the notices files contain.
+ *
+ * The entries are not identical to those of readLogsData: for every notice. Object,
+ * boolean, null and plain string data match, but:
+ *   - array and number data are copied as JSON text, e.g. [1,2] and 1.50, where
+ *     NSArray and NSNumber descriptions would be "(\n    1,\n    2\n)" and 1.5;
+ *   - the timestamp is copied as the notice wrote it, where FeedbackUpload renders
+ *     the parsed NSDate, e.g. in UTC rather than the notice's UTC offset;
+ *   - string data is copied with its JSON escapes as written, e.g. \u00e9 is not
+ *     turned into the character.
+ * Timestamps that fail to parse are replaced with the epoch, as readLogsData: does.
+ *
+ * Payload layout (all integers little-endian):
+ *
+ *   header:  "PSFB" | u8 version | u8 codec | u16 reserved
+ *   frame:   u32 compressed length | u32 raw length | raw deflate data
+ *   ...
+ *   index:   n x { u64 raw offset | u64 payload offset | u32 compressed length |
+ *                  u32 raw length | u32 first entry | u32 entry count }
+ *   footer:  u32 frame count | u32 total entry count | "PSFI"
+ *
+ * Concatenating the inflated frames yields the diagnostic history JSON array.
+ */
+
+#define FEEDBACK_BUNDLE_VERSION 1
+#define FEEDBACK_BUNDLE_CODEC_DEFLATE 1
+
+#define FEEDBACK_BUNDLE_HEADER_LEN 8
+#define FEEDBACK_BUNDLE_FRAME_HEADER_LEN 8
+#define FEEDBACK_BUNDLE_INDEX_ENTRY_LEN 32
+#define FEEDBACK_BUNDLE_FOOTER_LEN 12
+
+// Uncompressed bytes per frame.
+#define FEEDBACK_BUNDLE_FRAME_SIZE (32 * 1024)
+
+// Bytes read from a notices file at a time.
+#define FEEDBACK_BUNDLE_READ_SIZE (16 * 1024)
+
+// Longest notice line that is re-encoded. Longer lines are dropped.
+#define FEEDBACK_BUNDLE_MAX_LINE (64 * 1024)
+
+// Maximum number of frames recorded in the index.
+#define FEEDBACK_BUNDLE_MAX_FRAMES 4096
+
+/*!
+ * @brief Output callback. Receives chunks of the compressed payload in order.
+ * @return 0 on success, non-zero to abort the bundle.
+ */
+typedef int (*feedback_bundle_write_fn)(void *ctx, const uint8_t *buf, size_t len);
+
+typedef struct feedback_bundle_writer feedback_bundle_writer_t;
+
+/*!
+ * @brief A rotating notices log, i.e. the current file and its ".1" predecessor.
+ *
+ * Either path may be NULL or point to a file that doesn't exist.
+ */
+typedef struct {
+    const char *older_path;
+    const char *path;
+} feedback_bundle_source_t;
+
+/*!
+ * @brief Index entry for a single frame of the payload.
+ */
+typedef struct {
+    uint64_t raw_offset;
+    uint64_t payload_offset;
+    uint32_t compressed_len;
+    uint32_t raw_len;
+    uint32_t first_entry;
+    uint32_t entry_count;
+} feedback_bundle_frame_t;
+
+/*!
+ * @brief Creates a new bundle writer and emits the payload header.
+ *
+ * @param write Output callback.
+ * @param ctx Context passed to the output callback.
+ * @param chunk_size Output is handed to the callback in chunks of at most this many bytes.
+ * @return Writer, or NULL if allocation failed or the output callback failed.
+ */
+feedback_bundle_writer_t * feedback_bundle_writer_new(feedback_bundle_write_fn write, void *ctx, size_t chunk_size);
+
+/*!
+ * @brief Appends the notices of all sources to the bundle.
+ *
+ * Same ordering as -[PsiphonDataSharedDB getAllLogs]: sources are ordered by the timestamp
+ * of their last notice, newest first, and within a source the older file precedes the current one.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int feedback_bundle_add_sources(feedback_bundle_writer_t *w, const feedback_bundle_source_t *sources, size_t n);
+
+/*!
+ * @brief Appends all notices from a single JSON-lines file.
+ *
+ * Empty lines and lines that are not notice objects are skipped.
+ *
+ * @return 0 on success (including a missing file), -1 on error.
+ */
+int feedback_bundle_add_file(feedback_bundle_writer_t *w, const char *path);
+
+/*!
+ * @brief Appends a single diagnostic entry with the given message and RFC3339 timestamp.
+ * @return 0 on success, -1 on error.
+ */
+int feedback_bundle_add_entry(feedback_bundle_writer_t *w, const char *msg, size_t msg_len, const char *timestamp);
+
+/*!
+ * @brief Flushes the last frame, writes the index and footer.
+ * @return 0 on success, -1 on error.
+ */
+int feedback_bundle_finish(feedback_bundle_writer_t *w);
+
+/*!
+ * @brief Number of entries written so far.
+ */
+uint32_t feedback_bundle_entry_count(const feedback_bundle_writer_t *w);
+
+/*!
+ * @brief Frees the writer. Does not finish the bundle.
+ */
+void feedback_bundle_writer_free(feedback_bundle_writer_t *w);
+
+/*!
+ * @brief Reads the frame index from a complete payload.
+ *
+ * @param frames Populated with a pointer into a newly allocated array. Caller must free.
+ * @param count Populated with the number of frames.
+ * @return 0 on success, -1 if the payload is malformed.
+ */
+int feedback_bundle_read_index(const uint8_t *payload, size_t len, feedback_bundle_frame_t **frames, uint32_t *count);
+
+/*!
+ * @brief Inflates every frame of a complete payload in order, handing the raw JSON to the callback.
+ * @return 0 on success, -1 if the payload is malformed or the callback failed.
+ */
+int feedback_bundle_decompress(const uint8_t *payload, size_t len, feedback_bundle_write_fn write, void *ctx);
+
+#endif /* FeedbackBundle_h */
@@ -0,0 +1,579 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "NoticeFolding.h"
+#include "timestamp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEMPLATE_CAP (2 * NOTICE_FOLD_MAX_MESSAGE)
+#define PARAMS_CAP (NOTICE_FOLD_MAX_MESSAGE + NOTICE_FOLD_MAX_PARAMS)
+
+typedef struct {
+    uint64_t hash;
+    char notice_type[NOTICE_FOLD_MAX_NOTICE_TYPE];
+    char template[TEMPLATE_CAP];
+    size_t template_len;
+    char first_params[PARAMS_CAP];
+    size_t first_params_len;
+    char last_params[PARAMS_CAP];
+    size_t last_params_len;
+    uint32_t param_count;
+    uint32_t count;
+    int64_t first_ms;
+    int64_t last_ms;
+    int16_t offset;
+    char timestamp[NOTICE_FOLD_MAX_TIMESTAMP];
+    size_t timestamp_len;
+    char line[NOTICE_FOLD_MAX_LINE];
+    size_t line_len;
+    int has_line;
+} run_slot_t;
+
+struct notice_folder {
+    notice_fold_emit_fn emit;
+    void *ctx;
+    int64_t max_gap_ms;
+    unsigned window;
+
+    // Open runs, in order of first occurrence: slots[order[head]], ..., for open runs.
+    run_slot_t *slots;
+    unsigned order[NOTICE_FOLD_MAX_WINDOW];
+    unsigned open;
+
+    // Scratch space for the incoming notice.
+    char template[TEMPLATE_CAP];
+    char params[PARAMS_CAP];
+};
+
+/*** Templates ***/
+
+static int is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int is_hex(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+static int is_word(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+// Length of a run of digits starting at p, at most max.
+static size_t digits(const char *p, const char *end, size_t max) {
+    size_t n = 0;
+    while (p + n < end && n < max && is_digit(p[n])) {
+        n++;
+    }
+    return n;
+}
+
+// Length of an RFC3339 timestamp at p, or 0.
+static size_t match_timestamp(const char *p, const char *end) {
+    // Shortest form: 2006-01-02T15:04:05Z
+    if (end - p < 20 || p[4] != '-' || p[7] != '-' || (p[10] != 'T' && p[10] != 't') ||
+        p[13] != ':' || p[16] != ':' || digits(p, end, 4) != 4) {
+        return 0;
+    }
+
+    const char *q = p + 19;
+    if (q < end && *q == '.') {
+        q++;
+        q += digits(q, end, 9);
+    }
+    if (q < end && (*q == 'Z' || *q == 'z')) {
+        q++;
+    } else if (end - q >= 6 && (*q == '+' || *q == '-') && q[3] == ':') {
+        q += 6;
+    } else {
+        return 0;
+    }
+
+    timestamp_t ts;
+    if (timestamp_parse(p, (size_t)(q - p), &ts) != 0) {
+        return 0;
+    }
+    return (size_t)(q - p);
+}
+
+// Length of an IPv4 address with optional port at p, or 0.
+static size_t match_ipv4(const char *p, const char *end) {
+    const char *q = p;
+    for (int i = 0; i < 4; i++) {
+        size_t n = digits(q, end, 3);
+        if (n == 0) {
+            return 0;
+        }
+        q += n;
+        if (i < 3) {
+            if (q >= end || *q != '.') {
+                return 0;
+            }
+            q++;
+        }
+    }
+    if (q < end && is_digit(*q)) {
+        return 0;
+    }
+    if (q + 1 < end && *q == ':' && is_digit(q[1])) {
+        q++;
+        q += digits(q, end, 5);
+    }
+    return (size_t)(q - p);
+}
+
+// Length of a number at p, or 0.
+static size_t match_number(const char *p, const char *end) {
+    if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && is_hex(p[2])) {
+        const char *q = p + 2;
+        while (q < end && is_hex(*q)) {
+            q++;
+        }
+        return (size_t)(q - p);
+    }
+
+    size_t n = digits(p, end, SIZE_MAX);
+    if (n > 0 && p + n + 1 < end && p[n] == '.' && is_digit(p[n + 1])) {
+        n++;
+        n += digits(p + n, end, SIZE_MAX);
+    }
+    return n;
+}
+
+// See comment in header
+size_t notice_fold_templatize(const char *message, size_t message_len, char *template,
+                              char *params, size_t *params_len, uint32_t *param_count) {
+    const char *p = message, *end = message + message_len;
+    char *t = template, *q = params;
+    uint32_t count = 0;
+
+    while (p < end) {
+        char c = *p;
+
+        if (c == '%') {
+            *t++ = '%';
+            *t++ = '%';
+            p++;
+            continue;
+        }
+
+        // Variable parts only start at a digit that isn't part of a word, e.g. "IPv4" stays literal.
+        if (is_digit(c) && count < NOTICE_FOLD_MAX_PARAMS && (p == message || !is_word(p[-1]))) {
+            size_t n;
+            char kind;
+            if ((n = match_timestamp(p, end)) > 0) {
+                kind = 't';
+            } else if ((n = match_ipv4(p, end)) > 0) {
+                kind = 'a';
+            } else {
+                n = match_number(p, end);
+                kind = 'n';
+            }
+
+            *t++ = '%';
+            *t++ = kind;
+            memcpy(q, p, n);
+            q += n;
+            *q++ = '\0';
+            count++;
+            p += n;
+            continue;
+        }
+
+        *t++ = c;
+        p++;
+    }
+
+    *params_len = (size_t)(q - params);
+    *param_count = count;
+    return (size_t)(t - template);
+}
+
+// See comment in header
+long notice_fold_expand(const char *template, size_t template_len, const char *params, size_t params_len,
+                        char *dst, size_t len) {
+    const char *t = template, *end = template + template_len;
+    const char *p = params, *params_end = params + params_len;
+    char *d = dst, *dst_end = dst + len;
+
+    while (t < end) {
+        if (*t == '%' && t + 1 < end) {
+            if (t[1] == '%') {
+                if (d >= dst_end) {
+                    return -1;
+                }
+                *d++ = '%';
+            } else {
+                if (p >= params_end) {
+                    return -1;
+                }
+                size_t n = strlen(p);
+                if ((size_t)(dst_end - d) < n) {
+                    return -1;
+                }
+                memcpy(d, p, n);
+                d += n;
+                p += n + 1;
+            }
+            t += 2;
+            continue;
+        }
+        if (d >= dst_end) {
+            return -1;
+        }
+        *d++ = *t++;
+    }
+
+    if (p != params_end) {
+        return -1;
+    }
+    return (long)(d - dst);
+}
+
+static uint64_t fnv1a(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= UINT64_C(1099511628211);
+    }
+    return h;
+}
+
+/*** Folder ***/
+
+static void run_to_public(const run_slot_t *s, notice_fold_run_t *run) {
+    run->notice_type = s->notice_type;
+    run->template = s->template;
+    run->template_len = s->template_len;
+    run->first_params = s->first_params;
+    run->first_params_len = s->first_params_len;
+    run->last_params = s->last_params;
+    run->last_params_len = s->last_params_len;
+    run->param_count = s->param_count;
+    run->count = s->count;
+    run->first_ms = s->first_ms;
+    run->last_ms = s->last_ms;
+    run->offset = s->offset;
+    run->timestamp = s->timestamp_len > 0 ? s->timestamp : NULL;
+    run->timestamp_len = s->timestamp_len;
+    run->line = s->has_line ? s->line : NULL;
+    run->line_len = s->line_len;
+}
+
+// Emits and closes the oldest open run.
+static int emit_front(notice_folder_t *f) {
+    notice_fold_run_t run;
+    run_to_public(&f->slots[f->order[0]], &run);
+
+    // Recycle the slot at the back of the order.
+    unsigned slot = f->order[0];
+    memmove(f->order, f->order + 1, (f->open - 1) * sizeof(f->order[0]));
+    f->open--;
+    f->order[f->open] = slot;
+
+    return f->emit(f->ctx, &run) == 0 ? 0 : -1;
+}
+
+// See comment in header
+notice_folder_t * notice_folder_new(unsigned window, int64_t max_gap_ms, notice_fold_emit_fn emit, void *ctx) {
+    if (window == 0 || window > NOTICE_FOLD_MAX_WINDOW || emit == NULL) {
+        return NULL;
+    }
+
+    notice_folder_t *f = calloc(1, sizeof(*f));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->slots = calloc(window, sizeof(run_slot_t));
+    if (f->slots == NULL) {
+        free(f);
+        return NULL;
+    }
+
+    f->emit = emit;
+    f->ctx = ctx;
+    f->max_gap_ms = max_gap_ms;
+    f->window = window;
+    for (unsigned i = 0; i < window; i++) {
+        f->order[i] = i;
+    }
+    return f;
+}
+
+// Emits a notice that is too long to fold as a run of one, ahead of everything after it.
+static int pass_through(notice_folder_t *f, const char *notice_type, size_t type_len, const char *message,
+                        size_t message_len, int64_t ms, int16_t offset, const char *timestamp, size_t timestamp_len,
+                        const char *line, size_t line_len) {
+    if (notice_folder_flush(f) != 0) {
+        return -1;
+    }
+
+    char *template = malloc(2 * message_len);
+    if (template == NULL) {
+        return -1;
+    }
+    size_t t = 0;
+    for (size_t i = 0; i < message_len; i++) {
+        if (message[i] == '%') {
+            template[t++] = '%';
+        }
+        template[t++] = message[i];
+    }
+
+    char type[NOTICE_FOLD_MAX_NOTICE_TYPE];
+    memcpy(type, notice_type, type_len);
+    type[type_len] = '\0';
+
+    notice_fold_run_t run = {
+        .notice_type = type,
+        .template = template,
+        .template_len = t,
+        .first_params = "",
+        .last_params = "",
+        .count = 1,
+        .first_ms = ms,
+        .last_ms = ms,
+        .offset = offset,
+        .timestamp = timestamp_len < NOTICE_FOLD_MAX_TIMESTAMP ? timestamp : NULL,
+        .timestamp_len = timestamp_len,
+        .line = line,
+        .line_len = line_len,
+    };
+    int rc = f->emit(f->ctx, &run) == 0 ? 0 : -1;
+    free(template);
+    return rc;
+}
+
+// See comment in header
+int notice_folder_add(notice_folder_t *f, const char *notice_type, const char *message, size_t message_len,
+                      const char *timestamp, size_t timestamp_len, const char *line, size_t line_len) {
+    timestamp_t ts;
+    if (timestamp_parse(timestamp, timestamp_len, &ts) != 0) {
+        return -1;
+    }
+    int64_t ms = ts.sec * 1000 + ts.nsec / 1000000;
+
+    size_t type_len = strlen(notice_type);
+    if (type_len >= NOTICE_FOLD_MAX_NOTICE_TYPE) {
+        type_len = NOTICE_FOLD_MAX_NOTICE_TYPE - 1;
+    }
+
+    if (message_len > NOTICE_FOLD_MAX_MESSAGE || (line != NULL && line_len > NOTICE_FOLD_MAX_LINE)) {
+        return pass_through(f, notice_type, type_len, message, message_len, ms, ts.offset, timestamp, timestamp_len,
+                            line, line_len);
+    }
+
+    size_t params_len;
+    uint32_t param_count;
+    size_t template_len = notice_fold_templatize(message, message_len, f->template, f->params, &params_len, &param_count);
+
+    uint64_t hash = fnv1a(UINT64_C(14695981039346656037), notice_type, type_len);
+    hash = fnv1a(hash, f->template, template_len);
+
+    // Runs idle for longer than the gap are closed once they reach the front.
+    while (f->open > 0 && ms - f->slots[f->order[0]].last_ms > f->max_gap_ms) {
+        if (emit_front(f) != 0) {
+            return -1;
+        }
+    }
+
+    for (unsigned i = 0; i < f->open; i++) {
+        run_slot_t *s = &f->slots[f->order[i]];
+        if (s->hash == hash && s->template_len == template_len &&
+            ms - s->last_ms <= f->max_gap_ms &&
+            strncmp(s->notice_type, notice_type, type_len) == 0 && s->notice_type[type_len] == '\0' &&
+            memcmp(s->template, f->template, template_len) == 0) {
+            s->count++;
+            s->last_ms = ms;
+            memcpy(s->last_params, f->params, params_len);
+            s->last_params_len = params_len;
+            return 0;
+        }
+    }
+
+    if (f->open == f->window && emit_front(f) != 0) {
+        return -1;
+    }
+
+    run_slot_t *s = &f->slots[f->order[f->open++]];
+    s->hash = hash;
+    memcpy(s->notice_type, notice_type, type_len);
+    s->notice_type[type_len] = '\0';
+    memcpy(s->template, f->template, template_len);
+    s->template_len = template_len;
+    memcpy(s->first_params, f->params, params_len);
+    s->first_params_len = params_len;
+    memcpy(s->last_params, f->params, params_len);
+    s->last_params_len = params_len;
+    s->param_count = param_count;
+    s->count = 1;
+    s->first_ms = ms;
+    s->last_ms = ms;
+    s->offset = ts.offset;
+    s->timestamp_len = timestamp_len < NOTICE_FOLD_MAX_TIMESTAMP ? timestamp_len : 0;
+    memcpy(s->timestamp, timestamp, s->timestamp_len);
+    s->has_line = line != NULL;
+    s->line_len = 0;
+    if (s->has_line) {
+        memcpy(s->line, line, line_len);
+        s->line_len = line_len;
+    }
+    return 0;
+}
+
+// See comment in header
+int notice_folder_flush(notice_folder_t *f) {
+    while (f->open > 0) {
+        if (emit_front(f) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// See comment in header
+void notice_folder_free(notice_folder_t *f) {
+    if (f == NULL) {
+        return;
+    }
+    free(f->slots);
+    free(f);
+}
+
+/*** JSON output ***/
+
+typedef struct {
+    char *p;
+    char *end;
+    int overflow;
+} out_t;
+
+static void out_raw(out_t *o, const char *s, size_t len) {
+    if ((size_t)(o->end - o->p) < len) {
+        o->overflow = 1;
+        return;
+    }
+    memcpy(o->p, s, len);
+    o->p += len;
+}
+
+static void out_str(out_t *o, const char *s) {
+    out_raw(o, s, strlen(s));
+}
+
+static void out_escaped(out_t *o, const char *s, size_t len) {
+    for (size_t i = 0; i < len && !o->overflow; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            char e[2] = { '\\', (char)c };
+            out_raw(o, e, 2);
+        } else if (c < 0x20) {
+            char e[7];
+            snprintf(e, sizeof(e), "\\u%04x", c);
+            out_raw(o, e, 6);
+        } else {
+            out_raw(o, (const char *)&s[i], 1);
+        }
+    }
+}
+
+static void out_timestamp(out_t *o, int64_t ms, int16_t offset) {
+    timestamp_t ts;
+    ts.sec = ms / 1000;
+    ts.nsec = (int32_t)(ms % 1000) * 1000000;
+    ts.offset = offset;
+    if (ts.nsec < 0) {
+        ts.sec--;
+        ts.nsec += 1000000000;
+    }
+
+    char buf[40];
+    size_t n = timestamp_format_precision(buf, sizeof(buf), &ts, 3);
+    out_raw(o, buf, n);
+}
+
+static void out_params(out_t *o, const char *params, size_t len) {
+    out_str(o, "[");
+    const char *p = params, *end = params + len;
+    while (p < end) {
+        size_t n = strlen(p);
+        if (p != params) {
+            out_str(o, ",");
+        }
+        out_str(o, "\"");
+        out_escaped(o, p, n);
+        out_str(o, "\"");
+        p += n + 1;
+    }
+    out_str(o, "]");
+}
+
+// See comment in header
+long notice_fold_format_json(const notice_fold_run_t *run, char *dst, size_t len) {
+    out_t o = { dst, dst + len, 0 };
+
+    if (run->count == 1 && run->line != NULL) {
+        out_raw(&o, run->line, run->line_len);
+        return o.overflow ? -1 : (long)(o.p - dst);
+    }
+
+    if (run->count == 1) {
+        out_str(&o, "{\"data\":");
+        if (!o.overflow) {
+            long n = notice_fold_expand(run->template, run->template_len, run->first_params, run->first_params_len,
+                                        o.p, (size_t)(o.end - o.p));
+            if (n < 0) {
+                return -1;
+            }
+            o.p += n;
+        }
+        out_str(&o, ",\"noticeType\":\"");
+        out_escaped(&o, run->notice_type, strlen(run->notice_type));
+        out_str(&o, "\",\"timestamp\":\"");
+        if (run->timestamp != NULL) {
+            out_escaped(&o, run->timestamp, run->timestamp_len);
+        } else {
+            out_timestamp(&o, run->first_ms, run->offset);
+        }
+        out_str(&o, "\"}");
+        return o.overflow ? -1 : (long)(o.p - dst);
+    }
+
+    char count[16];
+    snprintf(count, sizeof(count), "%u", run->count);
+
+    out_str(&o, "{\"noticeType\":\"");
+    out_escaped(&o, run->notice_type, strlen(run->notice_type));
+    out_str(&o, "\",\"template\":\"");
+    out_escaped(&o, run->template, run->template_len);
+    out_str(&o, "\",\"count\":");
+    out_str(&o, count);
+    out_str(&o, ",\"first\":\"");
+    out_timestamp(&o, run->first_ms, run->offset);
+    out_str(&o, "\",\"last\":\"");
+    out_timestamp(&o, run->last_ms, run->offset);
+    out_str(&o, "\",\"firstParams\":");
+    out_params(&o, run->first_params, run->first_params_len);
+    out_str(&o, ",\"lastParams\":");
+    out_params(&o, run->last_params, run->last_params_len);
+    out_str(&o, "}");
+
+    return o.overflow ? -1 : (long)(o.p - dst);
+}
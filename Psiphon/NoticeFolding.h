@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef NoticeFolding_h
+#define NoticeFolding_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Folds repetitive notices before they are uploaded with feedback.
+ *
+ * Every message is reduced to a template by replacing its variable parts with placeholders:
+ *
+ *   %n  a number (decimal, with optional fraction, or 0x hex)
+ *   %a  an IPv4 address, with optional :port
+ *   %t  an RFC3339 timestamp
+ *   %%  a literal '%'
+ *
+ * The replaced text is kept as the message parameters, so that a template together with its
+ * parameters expands back to the exact original message.
+ *
+ * Notices with the same notice type and template that arrive within a window of recently seen
+ * templates (i.e. consecutive, or interleaved with a few other templates) are folded into a single
+ * run: "template x count over [t0, t1]", keeping the parameters of the first and last occurrence.
+ * Runs are emitted in order of their first occurrence.
+ */
+
+// Maximum number of runs that are open at once.
+#define NOTICE_FOLD_MAX_WINDOW 64
+
+// Messages longer than this are passed through unfolded.
+#define NOTICE_FOLD_MAX_MESSAGE 4096
+
+// Notice lines longer than this are passed through unfolded, so that a run of one keeps its line.
+#define NOTICE_FOLD_MAX_LINE (NOTICE_FOLD_MAX_MESSAGE + 1024)
+
+// Timestamps longer than this are formatted from their time rather than kept as written.
+#define NOTICE_FOLD_MAX_TIMESTAMP 64
+
+// Maximum number of parameters extracted from a message. Further variable parts stay literal.
+#define NOTICE_FOLD_MAX_PARAMS 32
+
+#define NOTICE_FOLD_MAX_NOTICE_TYPE 64
+
+/*!
+ * @brief A folded run of notices.
+ *
+ * Parameters are stored back to back, each terminated by '\0'.
+ * Pointers are only valid for the duration of the emit callback.
+ */
+typedef struct {
+    const char *notice_type;
+    const char *template;
+    size_t template_len;
+    const char *first_params;
+    size_t first_params_len;
+    const char *last_params;
+    size_t last_params_len;
+    uint32_t param_count;
+    uint32_t count;
+    int64_t first_ms;   // Unix time in milliseconds of the first occurrence.
+    int64_t last_ms;    // Unix time in milliseconds of the last occurrence.
+    int16_t offset;     // UTC offset in minutes of the first occurrence's timestamp.
+    const char *timestamp;      // The first occurrence's timestamp as written, or NULL if too long.
+    size_t timestamp_len;
+    const char *line;           // The first occurrence's notice line, or NULL if not given.
+    size_t line_len;
+} notice_fold_run_t;
+
+/*!
+ * @brief Emit callback. Called once per run when it closes.
+ * @return 0 on success, non-zero to stop folding.
+ */
+typedef int (*notice_fold_emit_fn)(void *ctx, const notice_fold_run_t *run);
+
+typedef struct notice_folder notice_folder_t;
+
+/*!
+ * @brief Creates a folder.
+ *
+ * @param window Number of templates kept open for folding, [1, NOTICE_FOLD_MAX_WINDOW].
+ * @param max_gap_ms A run is closed when its template hasn't been seen for this long.
+ * @param emit Emit callback.
+ * @param ctx Context passed to the emit callback.
+ * @return Folder, or NULL on invalid arguments or allocation failure.
+ */
+notice_folder_t * notice_folder_new(unsigned window, int64_t max_gap_ms, notice_fold_emit_fn emit, void *ctx);
+
+/*!
+ * @brief Adds a notice.
+ *
+ * @param notice_type Notice type, e.g. "tunnel-core".
+ * @param message Message text, e.g. the JSON text of the notice data.
+ * @param timestamp RFC3339 timestamp of the notice.
+ * @param line The notice line the parts were read from, without the trailing newline, or NULL.
+ *             If the notice isn't folded with others, it is formatted as this line.
+ * @return 0 on success, -1 if the timestamp is invalid or the emit callback failed.
+ */
+int notice_folder_add(notice_folder_t *f, const char *notice_type, const char *message, size_t message_len,
+                      const char *timestamp, size_t timestamp_len, const char *line, size_t line_len);
+
+/*!
+ * @brief Emits all open runs.
+ * @return 0 on success, -1 if the emit callback failed.
+ */
+int notice_folder_flush(notice_folder_t *f);
+
+void notice_folder_free(notice_folder_t *f);
+
+/*!
+ * @brief Reduces a message to its template.
+ *
+ * @param template Populated with the template. Must hold at least 2 * message_len bytes.
+ * @param params Populated with the parameters, each terminated by '\0'. Must hold at least message_len + NOTICE_FOLD_MAX_PARAMS bytes.
+ * @param params_len Populated with the total length of params.
+ * @param param_count Populated with the number of parameters.
+ * @return Length of the template.
+ */
+size_t notice_fold_templatize(const char *message, size_t message_len, char *template,
+                              char *params, size_t *params_len, uint32_t *param_count);
+
+/*!
+ * @brief Expands a template with its parameters back to the original message.
+ *
+ * @param dst Destination buffer.
+ * @param len Size of dst.
+ * @return Length of the message, or -1 if dst is too small or the parameters don't match the template.
+ */
+long notice_fold_expand(const char *template, size_t template_len, const char *params, size_t params_len,
+                        char *dst, size_t len);
+
+/*!
+ * @brief Formats a run as a single JSON line, without the trailing newline.
+ *
+ * Runs of a single notice are formatted as their notice line, byte for byte. Without the line, they
+ * are rebuilt from the notice's parts, which leaves out any other keys of the notice:
+ *   {"data":<message>,"noticeType":"<type>","timestamp":"<t0>"}
+ * Folded runs are formatted as:
+ *   {"noticeType":"<type>","template":"<template>","count":<n>,"first":"<t0>","last":"<t1>","firstParams":[...],"lastParams":[...]}
+ *
+ * @return Length written, or -1 if dst is too small.
+ */
+long notice_fold_format_json(const notice_fold_run_t *run, char *dst, size_t len);
+
+#endif /* NoticeFolding_h */
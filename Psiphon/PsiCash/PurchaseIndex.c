@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "PurchaseIndex.h"
+#include "Trace.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NONE UINT32_MAX
+
+#define SERIALIZED_MAGIC "PSPI"
+#define SERIALIZED_VERSION 1
+#define SERIALIZED_HEADER_LEN 12
+#define SERIALIZED_RECORD_FIXED_LEN 12
+
+#define FLAG_MARKED_EXPIRED 0x01
+
+// Fields used by scans and heap maintenance, kept apart from the strings so that scans stay in cache.
+typedef struct {
+    int64_t expiry_ms;
+    uint32_t heap_pos;      // NONE if the purchase doesn't expire.
+    uint32_t next_free;
+    uint32_t id_hash;
+    uint32_t authorization_hash;
+    uint32_t class_hash;
+    uint8_t used;
+    uint8_t marked_expired;
+    uint8_t has_authorization;
+} record_t;
+
+typedef struct {
+    char id[PURCHASE_INDEX_MAX_ID + 1];
+    char transaction_class[PURCHASE_INDEX_MAX_CLASS + 1];
+    char authorization_id[PURCHASE_INDEX_MAX_ID + 1];
+} strings_t;
+
+typedef struct {
+    int64_t expiry_ms;
+    uint32_t record;
+} heap_entry_t;
+
+typedef struct {
+    uint32_t hash;
+    uint32_t record;        // NONE if empty.
+} bucket_t;
+
+// Open addressing hash table with linear probing, keyed by a string field of strings_t.
+typedef struct {
+    bucket_t *buckets;
+    uint32_t mask;
+    uint32_t count;
+    size_t key_offset;
+} table_t;
+
+struct purchase_index {
+    record_t *records;
+    strings_t *strings;     // Parallel to records.
+    uint32_t capacity;
+    uint32_t free_head;
+    uint32_t count;
+    uint32_t marked_count;
+
+    heap_entry_t *heap;     // Min-heap by expiry.
+    uint32_t heap_count;
+
+    table_t by_id;
+    table_t by_authorization;
+};
+
+static uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s; s++) {
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    }
+    return h;
+}
+
+static inline const char * record_key(const purchase_index_t *idx, const table_t *t, uint32_t record) {
+    return (const char *)&idx->strings[record] + t->key_offset;
+}
+
+/*** Hash tables ***/
+
+static int table_init(table_t *t, size_t key_offset, uint32_t size) {
+    t->buckets = malloc(size * sizeof(bucket_t));
+    if (t->buckets == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        t->buckets[i].record = NONE;
+    }
+    t->mask = size - 1;
+    t->count = 0;
+    t->key_offset = key_offset;
+    return 0;
+}
+
+static void table_insert_bucket(table_t *t, bucket_t b) {
+    uint32_t i = b.hash & t->mask;
+    while (t->buckets[i].record != NONE) {
+        i = (i + 1) & t->mask;
+    }
+    t->buckets[i] = b;
+    t->count++;
+}
+
+// Makes room for one more record, so that the next insert doesn't allocate.
+static int table_reserve(table_t *t) {
+    if ((t->count + 1) * 2 > t->mask + 1) {
+        uint32_t size = (t->mask + 1) * 2;
+        bucket_t *old = t->buckets;
+        uint32_t old_size = t->mask + 1;
+        if (table_init(t, t->key_offset, size) != 0) {
+            t->buckets = old;
+            return -1;
+        }
+        for (uint32_t i = 0; i < old_size; i++) {
+            if (old[i].record != NONE) {
+                table_insert_bucket(t, old[i]);
+            }
+        }
+        free(old);
+    }
+    return 0;
+}
+
+static int table_insert(table_t *t, uint32_t hash, uint32_t record) {
+    if (table_reserve(t) != 0) {
+        return -1;
+    }
+    table_insert_bucket(t, (bucket_t){ hash, record });
+    return 0;
+}
+
+// Returns the bucket of the first record with the given key at or after bucket start, or NONE.
+static uint32_t table_find_from(const purchase_index_t *idx, const table_t *t, const char *key, uint32_t hash, uint32_t start) {
+    for (uint32_t i = start; t->buckets[i].record != NONE; i = (i + 1) & t->mask) {
+        if (t->buckets[i].hash == hash && strcmp(record_key(idx, t, t->buckets[i].record), key) == 0) {
+            return i;
+        }
+    }
+    return NONE;
+}
+
+// Removes the bucket of a specific record, shifting back the rest of its cluster.
+static void table_remove(table_t *t, uint32_t hash, uint32_t record) {
+    uint32_t i = hash & t->mask;
+    while (t->buckets[i].record != record) {
+        i = (i + 1) & t->mask;
+    }
+    for (uint32_t j = (i + 1) & t->mask; t->buckets[j].record != NONE; j = (j + 1) & t->mask) {
+        uint32_t home = t->buckets[j].hash & t->mask;
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->buckets[i] = t->buckets[j];
+            i = j;
+        }
+    }
+    t->buckets[i].record = NONE;
+    t->count--;
+}
+
+/*** Heap ***/
+
+static inline int heap_less(const purchase_index_t *idx, uint32_t a, uint32_t b) {
+    return idx->heap[a].expiry_ms < idx->heap[b].expiry_ms;
+}
+
+static inline void heap_swap(purchase_index_t *idx, uint32_t a, uint32_t b) {
+    heap_entry_t t = idx->heap[a];
+    idx->heap[a] = idx->heap[b];
+    idx->heap[b] = t;
+    idx->records[idx->heap[a].record].heap_pos = a;
+    idx->records[idx->heap[b].record].heap_pos = b;
+}
+
+static void heap_up(purchase_index_t *idx, uint32_t i) {
+    while (i > 0 && heap_less(idx, i, (i - 1) / 2)) {
+        heap_swap(idx, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void heap_down(purchase_index_t *idx, uint32_t i) {
+    for (;;) {
+        uint32_t smallest = i, l = 2 * i + 1, r = l + 1;
+        if (l < idx->heap_count && heap_less(idx, l, smallest)) {
+            smallest = l;
+        }
+        if (r < idx->heap_count && heap_less(idx, r, smallest)) {
+            smallest = r;
+        }
+        if (smallest == i) {
+            return;
+        }
+        heap_swap(idx, i, smallest);
+        i = smallest;
+    }
+}
+
+static void heap_push(purchase_index_t *idx, uint32_t record) {
+    uint32_t i = idx->heap_count++;
+    idx->heap[i] = (heap_entry_t){ idx->records[record].expiry_ms, record };
+    idx->records[record].heap_pos = i;
+    heap_up(idx, i);
+}
+
+static void heap_remove(purchase_index_t *idx, uint32_t record) {
+    uint32_t i = idx->records[record].heap_pos;
+    idx->records[record].heap_pos = NONE;
+    uint32_t last = --idx->heap_count;
+    if (i != last) {
+        idx->heap[i] = idx->heap[last];
+        idx->records[idx->heap[i].record].heap_pos = i;
+        heap_down(idx, i);
+        heap_up(idx, i);
+    }
+}
+
+/*** Records ***/
+
+static int grow(purchase_index_t *idx) {
+    uint32_t capacity = idx->capacity ? idx->capacity * 2 : 16;
+    record_t *records = realloc(idx->records, capacity * sizeof(record_t));
+    if (records == NULL) {
+        return -1;
+    }
+    idx->records = records;
+    strings_t *strings = realloc(idx->strings, capacity * sizeof(strings_t));
+    if (strings == NULL) {
+        return -1;
+    }
+    idx->strings = strings;
+    heap_entry_t *heap = realloc(idx->heap, capacity * sizeof(heap_entry_t));
+    if (heap == NULL) {
+        return -1;
+    }
+    idx->heap = heap;
+    for (uint32_t i = idx->capacity; i < capacity; i++) {
+        records[i].used = 0;
+        records[i].next_free = i + 1 < capacity ? i + 1 : NONE;
+    }
+    idx->free_head = idx->capacity;
+    idx->capacity = capacity;
+    return 0;
+}
+
+static void to_purchase(const purchase_index_t *idx, uint32_t i, purchase_t *p) {
+    p->id = idx->strings[i].id;
+    p->transaction_class = idx->strings[i].transaction_class;
+    p->authorization_id = idx->strings[i].authorization_id;
+    p->expiry_ms = idx->records[i].expiry_ms;
+    p->marked_expired = idx->records[i].marked_expired;
+}
+
+static uint32_t find_record(const purchase_index_t *idx, const char *id) {
+    uint32_t hash = hash_string(id);
+    uint32_t b = table_find_from(idx, &idx->by_id, id, hash, hash & idx->by_id.mask);
+    return b == NONE ? NONE : idx->by_id.buckets[b].record;
+}
+
+static void remove_record(purchase_index_t *idx, uint32_t i) {
+    record_t *r = &idx->records[i];
+    table_remove(&idx->by_id, r->id_hash, i);
+    if (r->has_authorization) {
+        table_remove(&idx->by_authorization, r->authorization_hash, i);
+    }
+    if (r->heap_pos != NONE) {
+        heap_remove(idx, i);
+    }
+    if (r->marked_expired) {
+        idx->marked_count--;
+    }
+    r->used = 0;
+    r->next_free = idx->free_head;
+    idx->free_head = i;
+    idx->count--;
+}
+
+// See comment in header
+purchase_index_t * purchase_index_new(void) {
+    purchase_index_t *idx = calloc(1, sizeof(purchase_index_t));
+    if (idx == NULL) {
+        return NULL;
+    }
+    idx->free_head = NONE;
+    if (table_init(&idx->by_id, offsetof(strings_t, id), 16) != 0) {
+        free(idx);
+        return NULL;
+    }
+    if (table_init(&idx->by_authorization, offsetof(strings_t, authorization_id), 16) != 0) {
+        free(idx->by_id.buckets);
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+// See comment in header
+void purchase_index_free(purchase_index_t *idx) {
+    if (idx == NULL) {
+        return;
+    }
+    free(idx->records);
+    free(idx->strings);
+    free(idx->heap);
+    free(idx->by_id.buckets);
+    free(idx->by_authorization.buckets);
+    free(idx);
+}
+
+static int put_record(purchase_index_t *idx, const purchase_t *p, int marked_expired) {
+    const char *authorization_id = p->authorization_id ? p->authorization_id : "";
+    if (strlen(p->id) > PURCHASE_INDEX_MAX_ID || strlen(p->transaction_class) > PURCHASE_INDEX_MAX_CLASS ||
+        strlen(authorization_id) > PURCHASE_INDEX_MAX_ID) {
+        return -1;
+    }
+
+    // The purchase may have come from this index, so copy its strings before modifying it.
+    strings_t copy;
+    strcpy(copy.id, p->id);
+    strcpy(copy.transaction_class, p->transaction_class);
+    strcpy(copy.authorization_id, authorization_id);
+    authorization_id = copy.authorization_id;
+
+    // Allocate first, so that a failed update leaves the index as it was.
+    if ((idx->free_head == NONE && grow(idx) != 0) || table_reserve(&idx->by_id) != 0 ||
+        (authorization_id[0] != '\0' && table_reserve(&idx->by_authorization) != 0)) {
+        return -1;
+    }
+
+    uint32_t existing = find_record(idx, copy.id);
+    if (existing != NONE) {
+        // Keep the marking if the authorization is unchanged.
+        if (strcmp(idx->strings[existing].authorization_id, authorization_id) == 0) {
+            marked_expired |= idx->records[existing].marked_expired;
+        }
+        remove_record(idx, existing);
+    }
+
+    uint32_t i = idx->free_head;
+    record_t *r = &idx->records[i];
+    strings_t *strings = &idx->strings[i];
+
+    // The tables compare keys against the strings, so they are filled in before inserting.
+    *strings = copy;
+    uint32_t id_hash = hash_string(copy.id);
+    uint32_t authorization_hash = hash_string(authorization_id);
+    if (table_insert(&idx->by_id, id_hash, i) != 0) {
+        return -1;
+    }
+    if (authorization_id[0] != '\0' && table_insert(&idx->by_authorization, authorization_hash, i) != 0) {
+        table_remove(&idx->by_id, id_hash, i);
+        return -1;
+    }
+    idx->free_head = r->next_free;
+
+    r->expiry_ms = p->expiry_ms;
+    r->used = 1;
+    r->id_hash = id_hash;
+    r->authorization_hash = authorization_hash;
+    r->class_hash = hash_string(copy.transaction_class);
+    r->has_authorization = authorization_id[0] != '\0';
+    r->marked_expired = marked_expired ? 1 : 0;
+    r->heap_pos = NONE;
+    if (r->expiry_ms != PURCHASE_INDEX_NO_EXPIRY) {
+        heap_push(idx, i);
+    }
+    idx->marked_count += r->marked_expired;
+    idx->count++;
+    return 0;
+}
+
+// See comment in header
+int purchase_index_put(purchase_index_t *idx, const purchase_t *purchase) {
+    return put_record(idx, purchase, 0);
+}
+
+// See comment in header
+int purchase_index_get(const purchase_index_t *idx, const char *id, purchase_t *purchase) {
+    uint32_t i = find_record(idx, id);
+    if (i == NONE) {
+        return -1;
+    }
+    to_purchase(idx, i, purchase);
+    return 0;
+}
+
+// See comment in header
+int purchase_index_remove(purchase_index_t *idx, const char *id) {
+    uint32_t i = find_record(idx, id);
+    if (i == NONE) {
+        return -1;
+    }
+    remove_record(idx, i);
+    return 0;
+}
+
+// See comment in header
+size_t purchase_index_count(const purchase_index_t *idx) {
+    return idx->count;
+}
+
+// See comment in header
+int purchase_index_next_expiring(const purchase_index_t *idx, purchase_t *purchase) {
+    if (idx->heap_count == 0) {
+        return -1;
+    }
+    to_purchase(idx, idx->heap[0].record, purchase);
+    return 0;
+}
+
+// See comment in header
+size_t purchase_index_expire(purchase_index_t *idx, int64_t now_ms, purchase_index_fn fn, void *ctx) {
+    size_t removed = 0;
+    while (idx->heap_count > 0 && idx->heap[0].expiry_ms <= now_ms) {
+        uint32_t i = idx->heap[0].record;
+        if (fn != NULL) {
+            purchase_t p;
+            to_purchase(idx, i, &p);
+            fn(ctx, &p);
+        }
+        remove_record(idx, i);
+        removed++;
+    }
+    return removed;
+}
+
+// See comment in header
+size_t purchase_index_mark_authorizations_expired(purchase_index_t *idx, const char *const *authorization_ids, size_t count) {
+    size_t marked = 0;
+    const table_t *t = &idx->by_authorization;
+    for (size_t n = 0; n < count; n++) {
+        uint32_t hash = hash_string(authorization_ids[n]);
+        // Authorization IDs are expected to be unique, but mark every purchase that shares one.
+        for (uint32_t b = table_find_from(idx, t, authorization_ids[n], hash, hash & t->mask); b != NONE;
+             b = table_find_from(idx, t, authorization_ids[n], hash, (b + 1) & t->mask)) {
+            record_t *r = &idx->records[t->buckets[b].record];
+            if (!r->marked_expired) {
+                r->marked_expired = 1;
+                idx->marked_count++;
+                marked++;
+            }
+        }
+    }
+    return marked;
+}
+
+// See comment in header
+size_t purchase_index_remove_marked(purchase_index_t *idx, purchase_index_fn fn, void *ctx) {
+    size_t removed = 0;
+    for (uint32_t i = 0; i < idx->capacity && idx->marked_count > 0; i++) {
+        record_t *r = &idx->records[i];
+        if (!r->used || !r->marked_expired) {
+            continue;
+        }
+        if (fn != NULL) {
+            purchase_t p;
+            to_purchase(idx, i, &p);
+            fn(ctx, &p);
+        }
+        remove_record(idx, i);
+        removed++;
+    }
+    return removed;
+}
+
+// See comment in header
+size_t purchase_index_each_active(const purchase_index_t *idx, int64_t now_ms, const char *transaction_class,
+                                  purchase_index_fn fn, void *ctx) {
+    size_t visited = 0;
+    uint32_t class_hash = transaction_class != NULL ? hash_string(transaction_class) : 0;
+    for (uint32_t i = 0; i < idx->capacity; i++) {
+        const record_t *r = &idx->records[i];
+        if (!r->used || r->marked_expired || !r->has_authorization || r->expiry_ms <= now_ms) {
+            continue;
+        }
+        if (transaction_class != NULL &&
+            (r->class_hash != class_hash || strcmp(idx->strings[i].transaction_class, transaction_class) != 0)) {
+            continue;
+        }
+        purchase_t p;
+        to_purchase(idx, i, &p);
+        fn(ctx, &p);
+        visited++;
+    }
+    return visited;
+}
+
+/*** Serialization ***/
+
+/*
+ * Format, little-endian:
+ *
+ *   "PSPI" | u8 version | 3 reserved bytes | u32 count
+ *   count x { i64 expiry_ms | u8 flags | u8 id_len | u8 class_len | u8 authorization_id_len | strings }
+ */
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        v |= (uint32_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        v |= (uint64_t)p[i] << (8 * i);
+    }
+    return v;
+}
+
+// See comment in header
+uint8_t * purchase_index_serialize(const purchase_index_t *idx, size_t *len) {
+    size_t total = SERIALIZED_HEADER_LEN;
+    for (uint32_t i = 0; i < idx->capacity; i++) {
+        const strings_t *strings = &idx->strings[i];
+        if (idx->records[i].used) {
+            total += SERIALIZED_RECORD_FIXED_LEN + strlen(strings->id) + strlen(strings->transaction_class) +
+                     strlen(strings->authorization_id);
+        }
+    }
+
+    uint8_t *buf = malloc(total);
+    if (buf == NULL) {
+        return NULL;
+    }
+    memcpy(buf, SERIALIZED_MAGIC, 4);
+    buf[4] = SERIALIZED_VERSION;
+    buf[5] = buf[6] = buf[7] = 0;
+    put_u32(buf + 8, idx->count);
+
+    uint8_t *p = buf + SERIALIZED_HEADER_LEN;
+    for (uint32_t i = 0; i < idx->capacity; i++) {
+        const record_t *r = &idx->records[i];
+        const strings_t *strings = &idx->strings[i];
+        if (!r->used) {
+            continue;
+        }
+        size_t lens[3] = { strlen(strings->id), strlen(strings->transaction_class), strlen(strings->authorization_id) };
+        put_u64(p, (uint64_t)r->expiry_ms);
+        p[8] = r->marked_expired ? FLAG_MARKED_EXPIRED : 0;
+        p[9] = (uint8_t)lens[0];
+        p[10] = (uint8_t)lens[1];
+        p[11] = (uint8_t)lens[2];
+        p += SERIALIZED_RECORD_FIXED_LEN;
+        memcpy(p, strings->id, lens[0]);
+        p += lens[0];
+        memcpy(p, strings->transaction_class, lens[1]);
+        p += lens[1];
+        memcpy(p, strings->authorization_id, lens[2]);
+        p += lens[2];
+    }
+    *len = total;
+    return buf;
+}
+
+// See comment in header
+purchase_index_t * purchase_index_deserialize(const uint8_t *buf, size_t len) {
+    TRACE_SCOPE("purchase_index_deserialize");
+    if (len < SERIALIZED_HEADER_LEN || memcmp(buf, SERIALIZED_MAGIC, 4) != 0 || buf[4] != SERIALIZED_VERSION) {
+        return NULL;
+    }
+    uint32_t count = get_u32(buf + 8);
+    purchase_index_t *idx = purchase_index_new();
+    if (idx == NULL) {
+        return NULL;
+    }
+
+    const uint8_t *p = buf + SERIALIZED_HEADER_LEN, *end = buf + len;
+    for (uint32_t n = 0; n < count; n++) {
+        if (end - p < SERIALIZED_RECORD_FIXED_LEN) {
+            goto fail;
+        }
+        size_t lens[3] = { p[9], p[10], p[11] };
+        if (lens[0] == 0 || lens[0] > PURCHASE_INDEX_MAX_ID || lens[1] > PURCHASE_INDEX_MAX_CLASS ||
+            lens[2] > PURCHASE_INDEX_MAX_ID ||
+            (size_t)(end - p) < SERIALIZED_RECORD_FIXED_LEN + lens[0] + lens[1] + lens[2]) {
+            goto fail;
+        }
+
+        char id[PURCHASE_INDEX_MAX_ID + 1], transaction_class[PURCHASE_INDEX_MAX_CLASS + 1];
+        char authorization_id[PURCHASE_INDEX_MAX_ID + 1];
+        const uint8_t *s = p + SERIALIZED_RECORD_FIXED_LEN;
+        memcpy(id, s, lens[0]);
+        id[lens[0]] = '\0';
+        memcpy(transaction_class, s + lens[0], lens[1]);
+        transaction_class[lens[1]] = '\0';
+        memcpy(authorization_id, s + lens[0] + lens[1], lens[2]);
+        authorization_id[lens[2]] = '\0';
+        if (strlen(id) != lens[0] || strlen(transaction_class) != lens[1] || strlen(authorization_id) != lens[2] ||
+            find_record(idx, id) != NONE) {
+            goto fail;
+        }
+
+        purchase_t purchase = { id, transaction_class, authorization_id, (int64_t)get_u64(p), 0 };
+        if (put_record(idx, &purchase, p[8] & FLAG_MARKED_EXPIRED) != 0) {
+            goto fail;
+        }
+        p = s + lens[0] + lens[1] + lens[2];
+    }
+    if (p != end) {
+        goto fail;
+    }
+    return idx;
+
+fail:
+    purchase_index_free(idx);
+    return NULL;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef PurchaseIndex_h
+#define PurchaseIndex_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Index of PsiCash purchases for PsiCashClient.
+ *
+ * Purchases are kept in a min-heap by local expiry, with hash tables by purchase ID and by
+ * authorization ID, so that:
+ *   - the next expiring purchase is O(1) and bulk expiration is O(k log n),
+ *   - put, get and remove by purchase ID are O(1) expected (plus O(log n) heap maintenance),
+ *   - marking the authorizations the extension reported as expired is O(1) per authorization,
+ *   - "active purchases" (not expired, with an authorization that isn't marked expired) are
+ *     visited in one pass without building intermediate sets.
+ *
+ * The index serializes to a compact binary format for persisting between launches.
+ */
+
+#define PURCHASE_INDEX_MAX_ID 64
+#define PURCHASE_INDEX_MAX_CLASS 32
+
+// Expiry of purchases that don't expire.
+#define PURCHASE_INDEX_NO_EXPIRY INT64_MAX
+
+/*!
+ * @brief A purchase.
+ *
+ * Strings returned by the index point into the index and are valid until it is next modified.
+ */
+typedef struct {
+    const char *id;
+    const char *transaction_class;      // e.g. "speed-boost".
+    const char *authorization_id;       // ID of the purchase's authorization, or "" if it has none.
+    int64_t expiry_ms;                  // Local time expiry in Unix milliseconds, or PURCHASE_INDEX_NO_EXPIRY.
+    int marked_expired;                 // Whether the authorization was marked expired by the extension.
+} purchase_t;
+
+/*!
+ * @brief Visitor callback.
+ */
+typedef void (*purchase_index_fn)(void *ctx, const purchase_t *purchase);
+
+typedef struct purchase_index purchase_index_t;
+
+/*!
+ * @brief Creates an empty index.
+ * @return Index, or NULL if allocation failed.
+ */
+purchase_index_t * purchase_index_new(void);
+
+void purchase_index_free(purchase_index_t *idx);
+
+/*!
+ * @brief Inserts a purchase, or replaces the purchase with the same ID.
+ *
+ * marked_expired is ignored; a replaced purchase keeps its marking if its authorization is unchanged.
+ *
+ * @return 0 on success, -1 if a string is too long or allocation failed.
+ */
+int purchase_index_put(purchase_index_t *idx, const purchase_t *purchase);
+
+/*!
+ * @brief Looks up a purchase by ID.
+ * @return 0 if found, -1 otherwise.
+ */
+int purchase_index_get(const purchase_index_t *idx, const char *id, purchase_t *purchase);
+
+/*!
+ * @brief Removes a purchase by ID.
+ * @return 0 if removed, -1 if not found.
+ */
+int purchase_index_remove(purchase_index_t *idx, const char *id);
+
+size_t purchase_index_count(const purchase_index_t *idx);
+
+/*!
+ * @brief The purchase that expires first. Purchases that don't expire are never returned.
+ * @return 0 if there is one, -1 otherwise.
+ */
+int purchase_index_next_expiring(const purchase_index_t *idx, purchase_t *purchase);
+
+/*!
+ * @brief Removes every purchase that expired at or before now_ms, in order of expiry.
+ *
+ * @param fn Called with each purchase before it is removed, or NULL. Must not modify the index.
+ * @return Number of purchases removed.
+ */
+size_t purchase_index_expire(purchase_index_t *idx, int64_t now_ms, purchase_index_fn fn, void *ctx);
+
+/*!
+ * @brief Marks the purchases with the given authorization IDs as expired, e.g. from
+ *        getMarkedExpiredAuthorizationIDs. IDs without a purchase are ignored.
+ * @return Number of purchases newly marked.
+ */
+size_t purchase_index_mark_authorizations_expired(purchase_index_t *idx, const char *const *authorization_ids, size_t count);
+
+/*!
+ * @brief Removes every purchase whose authorization was marked expired.
+ *
+ * @param fn Called with each purchase before it is removed, or NULL. Must not modify the index.
+ * @return Number of purchases removed.
+ */
+size_t purchase_index_remove_marked(purchase_index_t *idx, purchase_index_fn fn, void *ctx);
+
+/*!
+ * @brief Visits active purchases: not expired at now_ms, with an authorization that isn't marked expired.
+ *
+ * @param transaction_class Only visit purchases of this class, or NULL for all.
+ * @param fn Visitor. Must not modify the index.
+ * @return Number of purchases visited.
+ */
+size_t purchase_index_each_active(const purchase_index_t *idx, int64_t now_ms, const char *transaction_class,
+                                  purchase_index_fn fn, void *ctx);
+
+/*!
+ * @brief Serializes the index.
+ * @param len Populated with the length of the returned buffer.
+ * @return Buffer to be freed by the caller, or NULL if allocation failed.
+ */
+uint8_t * purchase_index_serialize(const purchase_index_t *idx, size_t *len);
+
+/*!
+ * @brief Creates an index from serialized data.
+ * @return Index, or NULL if the data is malformed or allocation failed.
+ */
+purchase_index_t * purchase_index_deserialize(const uint8_t *buf, size_t len);
+
+#endif /* PurchaseIndex_h */
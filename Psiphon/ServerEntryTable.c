@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#define _FILE_OFFSET_BITS 64
+#include "ServerEntryTable.h"
+#include "JSONPath.h"
+#include "Trace.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define MAX_NAME 31
+
+// Number of space delimited legacy fields before the JSON, see server_entry_json.
+#define LEGACY_FIELDS 4
+
+// Members extracted from each entry's JSON, in this order.
+static const char *const kEntryPaths[] = { "region", "ipAddress", "capabilities" };
+enum { ENTRY_REGION, ENTRY_IP_ADDRESS, ENTRY_CAPABILITIES, ENTRY_PATH_COUNT };
+
+struct server_entry_table {
+    size_t count;
+    size_t capacity;
+    size_t skipped;
+
+    // Columns.
+    uint8_t *region;
+    uint64_t *capabilities;
+    uint32_t *ipv4;
+    uint64_t *offset;
+    uint32_t *length;
+
+    char region_names[SERVER_ENTRY_TABLE_MAX_REGIONS][MAX_NAME + 1];
+    size_t region_count;
+    char capability_names[SERVER_ENTRY_TABLE_MAX_CAPABILITIES][MAX_NAME + 1];
+    int capability_count;
+
+    // Bitmaps over the entries, words per bitmap each.
+    size_t words;
+    uint64_t *region_bits;          // region_count bitmaps.
+    uint64_t *capability_bits;      // capability_count bitmaps.
+
+    // Hex decoding buffer and JSON paths, only used while parsing.
+    char *scratch;
+    size_t scratch_len;
+    json_path_set_t *paths;
+};
+
+/*** Interning ***/
+
+static int intern(char names[][MAX_NAME + 1], size_t *count, size_t max, const char *s, size_t len) {
+    if (len == 0 || len > MAX_NAME) {
+        return -1;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        if (strncmp(names[i], s, len) == 0 && names[i][len] == '\0') {
+            return (int)i;
+        }
+    }
+    if (*count == max) {
+        return -1;
+    }
+    memcpy(names[*count], s, len);
+    names[*count][len] = '\0';
+    return (int)(*count)++;
+}
+
+/*** Parsing ***/
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static uint32_t parse_ipv4(const char *s, size_t len) {
+    uint32_t ip = 0;
+    unsigned octets = 0, value = 0, digits = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (i == len || s[i] == '.') {
+            if (digits == 0 || value > 255) {
+                return 0;
+            }
+            ip = (ip << 8) | value;
+            octets++;
+            value = digits = 0;
+        } else if (s[i] >= '0' && s[i] <= '9' && digits < 3) {
+            value = value * 10 + (unsigned)(s[i] - '0');
+            digits++;
+        } else {
+            return 0;
+        }
+    }
+    return octets == 4 ? ip : 0;
+}
+
+static int append_row(server_entry_table_t *t) {
+    if (t->count < t->capacity) {
+        return 0;
+    }
+    size_t capacity = t->capacity ? t->capacity * 2 : 256;
+    uint8_t *region = realloc(t->region, capacity * sizeof(uint8_t));
+    if (region == NULL) {
+        return -1;
+    }
+    t->region = region;
+    uint64_t *capabilities = realloc(t->capabilities, capacity * sizeof(uint64_t));
+    if (capabilities == NULL) {
+        return -1;
+    }
+    t->capabilities = capabilities;
+    uint32_t *ipv4 = realloc(t->ipv4, capacity * sizeof(uint32_t));
+    if (ipv4 == NULL) {
+        return -1;
+    }
+    t->ipv4 = ipv4;
+    uint64_t *offset = realloc(t->offset, capacity * sizeof(uint64_t));
+    if (offset == NULL) {
+        return -1;
+    }
+    t->offset = offset;
+    uint32_t *length = realloc(t->length, capacity * sizeof(uint32_t));
+    if (length == NULL) {
+        return -1;
+    }
+    t->length = length;
+    t->capacity = capacity;
+    return 0;
+}
+
+// Decodes one line and appends its row. Returns -1 only on allocation failure.
+static int parse_line(server_entry_table_t *t, const char *line, size_t len, uint64_t offset) {
+    size_t line_len = len;
+    if (len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (len % 2 != 0 || line_len > UINT32_MAX) {
+        t->skipped++;
+        return 0;
+    }
+
+    size_t decoded_len = len / 2;
+    if (decoded_len > t->scratch_len) {
+        char *scratch = realloc(t->scratch, decoded_len);
+        if (scratch == NULL) {
+            return -1;
+        }
+        t->scratch = scratch;
+        t->scratch_len = decoded_len;
+    }
+    for (size_t i = 0; i < decoded_len; i++) {
+        int hi = hex_value(line[2 * i]), lo = hex_value(line[2 * i + 1]);
+        if (hi < 0 || lo < 0) {
+            t->skipped++;
+            return 0;
+        }
+        t->scratch[i] = (char)(hi << 4 | lo);
+    }
+
+    // Skip past the legacy fields to the JSON.
+    const char *p = t->scratch, *end = t->scratch + decoded_len;
+    for (int field = 0; field < LEGACY_FIELDS; field++) {
+        p = memchr(p, ' ', (size_t)(end - p));
+        if (p == NULL) {
+            t->skipped++;
+            return 0;
+        }
+        p++;
+    }
+
+    json_path_value_t values[ENTRY_PATH_COUNT];
+    if (json_path_extract(t->paths, p, (size_t)(end - p), values) < 0 || values[ENTRY_REGION].type != JSON_PATH_STRING) {
+        t->skipped++;
+        return 0;
+    }
+
+    uint64_t capabilities = 0;
+    json_path_iter_t it;
+    json_path_value_t capability;
+    if (json_path_array_begin(&it, &values[ENTRY_CAPABILITIES]) == 0) {
+        while (json_path_array_next(&it, &capability) == 1) {
+            if (capability.type != JSON_PATH_STRING) {
+                continue;
+            }
+            size_t count = (size_t)t->capability_count;
+            int bit = intern(t->capability_names, &count, SERVER_ENTRY_TABLE_MAX_CAPABILITIES, capability.start, capability.len);
+            t->capability_count = (int)count;
+            if (bit >= 0) {
+                capabilities |= UINT64_C(1) << bit;
+            }
+        }
+    }
+
+    int region_id = intern(t->region_names, &t->region_count, SERVER_ENTRY_TABLE_MAX_REGIONS,
+                           values[ENTRY_REGION].start, values[ENTRY_REGION].len);
+    if (region_id < 0) {
+        t->skipped++;
+        return 0;
+    }
+
+    if (append_row(t) != 0) {
+        return -1;
+    }
+    size_t row = t->count++;
+    t->region[row] = (uint8_t)region_id;
+    t->capabilities[row] = capabilities;
+    t->ipv4[row] = (values[ENTRY_IP_ADDRESS].type == JSON_PATH_STRING) ?
+                   parse_ipv4(values[ENTRY_IP_ADDRESS].start, values[ENTRY_IP_ADDRESS].len) : 0;
+    t->offset[row] = offset;
+    t->length[row] = (uint32_t)line_len;
+    return 0;
+}
+
+// Builds the bitmaps once all rows are in, and drops parsing state.
+static int finish(server_entry_table_t *t) {
+    free(t->scratch);
+    t->scratch = NULL;
+    t->scratch_len = 0;
+    json_path_set_free(t->paths);
+    t->paths = NULL;
+
+    t->words = (t->count + 63) / 64;
+    t->region_bits = calloc(t->region_count * t->words + 1, sizeof(uint64_t));
+    t->capability_bits = calloc((size_t)t->capability_count * t->words + 1, sizeof(uint64_t));
+    if (t->region_bits == NULL || t->capability_bits == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < t->count; i++) {
+        uint64_t bit = UINT64_C(1) << (i % 64);
+        size_t word = i / 64;
+        t->region_bits[t->region[i] * t->words + word] |= bit;
+        uint64_t capabilities = t->capabilities[i];
+        while (capabilities) {
+            int c = __builtin_ctzll(capabilities);
+            t->capability_bits[(size_t)c * t->words + word] |= bit;
+            capabilities &= capabilities - 1;
+        }
+    }
+    return 0;
+}
+
+static server_entry_table_t * table_new(void) {
+    server_entry_table_t *t = calloc(1, sizeof(server_entry_table_t));
+    if (t == NULL) {
+        return NULL;
+    }
+    // The whole object is walked so that truncated lines are skipped.
+    t->paths = json_path_set_new(kEntryPaths, ENTRY_PATH_COUNT, JSON_PATH_WHOLE_OBJECT);
+    if (t->paths == NULL) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// See comment in header
+server_entry_table_t * server_entry_table_load(const char *path) {
+    TRACE_SCOPE("server_entry_table_load");
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    server_entry_table_t *t = table_new();
+    if (t == NULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t nread;
+    uint64_t offset = 0;
+    int failed = 0;
+    while (!failed && (nread = getline(&line, &cap, fp)) != -1) {
+        size_t len = (size_t)nread;
+        if (len > 0 && line[len - 1] == '\n') {
+            len--;
+        }
+        failed = parse_line(t, line, len, offset) != 0;
+        offset += (uint64_t)nread;
+    }
+    failed |= ferror(fp) != 0;
+    free(line);
+    fclose(fp);
+
+    if (failed || finish(t) != 0) {
+        server_entry_table_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// See comment in header
+server_entry_table_t * server_entry_table_parse(const char *data, size_t len) {
+    TRACE_SCOPE("server_entry_table_parse");
+    server_entry_table_t *t = table_new();
+    if (t == NULL) {
+        return NULL;
+    }
+    const char *p = data, *end = data + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t)(end - p));
+        const char *line_end = nl ? nl : end;
+        if (parse_line(t, p, (size_t)(line_end - p), (uint64_t)(p - data)) != 0) {
+            server_entry_table_free(t);
+            return NULL;
+        }
+        p = nl ? nl + 1 : end;
+    }
+    if (finish(t) != 0) {
+        server_entry_table_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// See comment in header
+void server_entry_table_free(server_entry_table_t *t) {
+    if (t == NULL) {
+        return;
+    }
+    free(t->region);
+    free(t->capabilities);
+    free(t->ipv4);
+    free(t->offset);
+    free(t->length);
+    free(t->region_bits);
+    free(t->capability_bits);
+    free(t->scratch);
+    json_path_set_free(t->paths);
+    free(t);
+}
+
+// See comment in header
+size_t server_entry_table_count(const server_entry_table_t *t) {
+    return t->count;
+}
+
+// See comment in header
+size_t server_entry_table_skipped(const server_entry_table_t *t) {
+    return t->skipped;
+}
+
+// See comment in header
+size_t server_entry_table_region_count(const server_entry_table_t *t) {
+    return t->region_count;
+}
+
+// See comment in header
+const char * server_entry_table_region_name(const server_entry_table_t *t, int region_id) {
+    if (region_id < 0 || (size_t)region_id >= t->region_count) {
+        return NULL;
+    }
+    return t->region_names[region_id];
+}
+
+// See comment in header
+int server_entry_table_region_id(const server_entry_table_t *t, const char *region) {
+    for (size_t i = 0; i < t->region_count; i++) {
+        if (strcmp(t->region_names[i], region) == 0) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+// See comment in header
+const char * server_entry_table_capability_name(const server_entry_table_t *t, int bit) {
+    if (bit < 0 || bit >= t->capability_count) {
+        return NULL;
+    }
+    return t->capability_names[bit];
+}
+
+// See comment in header
+int server_entry_table_capability_bit(const server_entry_table_t *t, const char *capability) {
+    for (int i = 0; i < t->capability_count; i++) {
+        if (strcmp(t->capability_names[i], capability) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// See comment in header
+int server_entry_table_entry(const server_entry_table_t *t, size_t index, server_entry_t *entry) {
+    if (index >= t->count) {
+        return -1;
+    }
+    entry->region_id = t->region[index];
+    entry->region = t->region_names[entry->region_id];
+    entry->capabilities = t->capabilities[index];
+    entry->ipv4 = t->ipv4[index];
+    entry->offset = t->offset[index];
+    entry->length = t->length[index];
+    return 0;
+}
+
+// See comment in header
+size_t server_entry_table_query(const server_entry_table_t *t, int region_id, uint64_t capabilities,
+                                uint32_t *indices, size_t max) {
+    if (region_id != SERVER_ENTRY_TABLE_ANY_REGION && (region_id < 0 || (size_t)region_id >= t->region_count)) {
+        return 0;
+    }
+    if (t->capability_count < 64 && (capabilities >> t->capability_count) != 0) {
+        // No entry has a capability that was never seen.
+        return 0;
+    }
+
+    const uint64_t *rows[SERVER_ENTRY_TABLE_MAX_CAPABILITIES + 1];
+    int row_count = 0;
+    if (region_id != SERVER_ENTRY_TABLE_ANY_REGION) {
+        rows[row_count++] = &t->region_bits[(size_t)region_id * t->words];
+    }
+    for (uint64_t c = capabilities; c; c &= c - 1) {
+        rows[row_count++] = &t->capability_bits[(size_t)__builtin_ctzll(c) * t->words];
+    }
+
+    size_t total = 0;
+    for (size_t w = 0; w < t->words; w++) {
+        uint64_t m = (w == t->words - 1 && t->count % 64) ? (UINT64_C(1) << (t->count % 64)) - 1 : ~UINT64_C(0);
+        for (int r = 0; r < row_count && m; r++) {
+            m &= rows[r][w];
+        }
+        while (m) {
+            if (total < max) {
+                indices[total] = (uint32_t)(w * 64 + (size_t)__builtin_ctzll(m));
+            }
+            total++;
+            m &= m - 1;
+        }
+    }
+    return total;
+}
+
+// See comment in header
+long server_entry_table_write_filtered(const server_entry_table_t *t, const char *src_path, const char *dst_path,
+                                       int region_id, uint64_t capabilities) {
+    TRACE_SCOPE("server_entry_table_write_filtered");
+    size_t total = server_entry_table_query(t, region_id, capabilities, NULL, 0);
+    uint32_t *indices = malloc((total + 1) * sizeof(uint32_t));
+    if (indices == NULL) {
+        return -1;
+    }
+    server_entry_table_query(t, region_id, capabilities, indices, total);
+
+    FILE *src = fopen(src_path, "rb");
+    FILE *dst = src ? fopen(dst_path, "wb") : NULL;
+    char *line = NULL;
+    size_t cap = 0;
+    long written = 0;
+    int saved_errno = 0;
+
+    errno = 0;
+    for (size_t i = 0; dst != NULL && i < total; i++) {
+        uint32_t row = indices[i];
+        size_t len = t->length[row];
+        if (len + 1 > cap) {
+            char *grown = realloc(line, len + 1);
+            if (grown == NULL) {
+                saved_errno = ENOMEM;
+                break;
+            }
+            line = grown;
+            cap = len + 1;
+        }
+        if (fseeko(src, (off_t)t->offset[row], SEEK_SET) != 0 || fread(line, 1, len, src) != len) {
+            saved_errno = errno ? errno : EIO;
+            break;
+        }
+        line[len] = '\n';
+        if (fwrite(line, 1, len + 1, dst) != len + 1) {
+            saved_errno = errno;
+            break;
+        }
+        written++;
+    }
+
+    if (src == NULL || dst == NULL) {
+        saved_errno = errno;
+    }
+    if (dst != NULL && fclose(dst) != 0 && saved_errno == 0) {
+        saved_errno = errno;
+    }
+    if (src != NULL) {
+        fclose(src);
+    }
+    free(line);
+    free(indices);
+    if (saved_errno != 0 || src == NULL || dst == NULL) {
+        errno = saved_errno;
+        return -1;
+    }
+    return written;
+}
+
+// See comment in header
+size_t server_entry_table_memory(const server_entry_table_t *t) {
+    size_t per_row = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    return sizeof(server_entry_table_t) + t->capacity * per_row +
+           (t->region_count + (size_t)t->capability_count) * t->words * sizeof(uint64_t) + t->scratch_len;
+}
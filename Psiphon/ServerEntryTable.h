@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ServerEntryTable_h
+#define ServerEntryTable_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compact in-memory table of the embedded server entries.
+ *
+ * The embedded server entries file is parsed once, and only the fields the app selects on are kept,
+ * in columns: region ID, capabilities bitset, IPv4 address and the location of the entry's line in
+ * the original file. Each region and each capability also has a bitmap over the entries, so
+ * "entries in region X with capabilities Y" is an AND of a few bitmaps.
+ *
+ * The table replaces re-parsing the file for its egress regions, and can write a filtered copy of
+ * the file for a region-restricted tunnel start.
+ *
+ * Lines that fail to decode are skipped and counted, rather than ending the parse.
+ */
+
+// Maximum number of distinct capabilities across all entries. Further capabilities are ignored.
+#define SERVER_ENTRY_TABLE_MAX_CAPABILITIES 64
+
+// Maximum number of distinct regions. Entries in further regions are skipped.
+#define SERVER_ENTRY_TABLE_MAX_REGIONS 255
+
+// Region ID that matches every region in queries.
+#define SERVER_ENTRY_TABLE_ANY_REGION -1
+
+typedef struct server_entry_table server_entry_table_t;
+
+/*!
+ * @brief A row of the table.
+ */
+typedef struct {
+    const char *region;         // e.g. "US". Valid for the lifetime of the table.
+    int region_id;
+    uint64_t capabilities;      // Bit i is set if the entry has capability i, see server_entry_table_capability_name.
+    uint32_t ipv4;              // IPv4 address in host byte order, or 0 if the entry doesn't have one.
+    uint64_t offset;            // Offset of the entry's line in the original file.
+    uint32_t length;            // Length of the line, without the newline.
+} server_entry_t;
+
+/*!
+ * @brief Parses an embedded server entries file.
+ *
+ * The file is read line by line and isn't kept in memory.
+ *
+ * @return Table, or NULL if the file can't be read (errno is set) or allocation failed.
+ */
+server_entry_table_t * server_entry_table_load(const char *path);
+
+/*!
+ * @brief Parses embedded server entries from memory. The data isn't retained.
+ * @return Table, or NULL if allocation failed.
+ */
+server_entry_table_t * server_entry_table_parse(const char *data, size_t len);
+
+void server_entry_table_free(server_entry_table_t *t);
+
+/*!
+ * @brief Number of entries.
+ */
+size_t server_entry_table_count(const server_entry_table_t *t);
+
+/*!
+ * @brief Number of lines that were skipped because they couldn't be decoded.
+ */
+size_t server_entry_table_skipped(const server_entry_table_t *t);
+
+/*!
+ * @brief Number of distinct regions. Region IDs are [0, count), in order of first appearance in the file.
+ */
+size_t server_entry_table_region_count(const server_entry_table_t *t);
+
+/*!
+ * @brief Region code of a region ID, or NULL if out of range.
+ */
+const char * server_entry_table_region_name(const server_entry_table_t *t, int region_id);
+
+/*!
+ * @brief Region ID of a region code.
+ * @return Region ID, or -1 if no entry is in that region.
+ */
+int server_entry_table_region_id(const server_entry_table_t *t, const char *region);
+
+/*!
+ * @brief Capability name of a capability bit, or NULL if out of range.
+ */
+const char * server_entry_table_capability_name(const server_entry_table_t *t, int bit);
+
+/*!
+ * @brief Capability bit of a capability name.
+ * @return Bit, or -1 if no entry has that capability.
+ */
+int server_entry_table_capability_bit(const server_entry_table_t *t, const char *capability);
+
+/*!
+ * @brief Reads a row.
+ * @return 0 on success, -1 if index is out of range.
+ */
+int server_entry_table_entry(const server_entry_table_t *t, size_t index, server_entry_t *entry);
+
+/*!
+ * @brief Finds the entries in a region that have all of the required capabilities.
+ *
+ * @param region_id Region ID, or SERVER_ENTRY_TABLE_ANY_REGION.
+ * @param capabilities Required capability bits, or 0 for no requirement.
+ * @param indices Populated with the matching entry indices in file order, up to max. May be NULL if max is 0.
+ * @return Total number of matching entries, which may exceed max.
+ */
+size_t server_entry_table_query(const server_entry_table_t *t, int region_id, uint64_t capabilities,
+                                uint32_t *indices, size_t max);
+
+/*!
+ * @brief Writes the original lines of the matching entries to a new embedded server entries file.
+ *
+ * @param src_path The file the table was loaded from.
+ * @param dst_path File to write. Overwritten if it exists.
+ * @return Number of entries written, or -1 on error (errno is set).
+ */
+long server_entry_table_write_filtered(const server_entry_table_t *t, const char *src_path, const char *dst_path,
+                                       int region_id, uint64_t capabilities);
+
+/*!
+ * @brief Bytes of heap memory held by the table.
+ */
+size_t server_entry_table_memory(const server_entry_table_t *t);
+
+#endif /* ServerEntryTable_h */
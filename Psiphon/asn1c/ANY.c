@@ -87,6 +87,34 @@ ANY_fromType(ANY_t *st, asn_TYPE_descriptor_t *td, void *sptr) {
 	return 0;
 }
 
+int
+ANY_fromType_exact(ANY_t *st, asn_TYPE_descriptor_t *td, void *sptr) {
+	void *buffer;
+	ssize_t size;
+
+	if(!st || !td) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(!sptr) {
+		if(st->buf) FREEMEM(st->buf);
+		st->size = 0;
+		return 0;
+	}
+
+	/* Measured first, so the buffer is allocated once at its final size */
+	size = der_encode_to_new_buffer(td, sptr, &buffer);
+	if(size == -1)
+		return -1;
+
+	if(st->buf) FREEMEM(st->buf);
+	st->buf = (uint8_t *)buffer;
+	st->size = size;
+
+	return 0;
+}
+
 ANY_t *
 ANY_new_fromType(asn_TYPE_descriptor_t *td, void *sptr) {
 	ANY_t tmp;
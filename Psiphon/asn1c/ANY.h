@@ -34,6 +34,14 @@ xer_type_encoder_f ANY_encode_xer;
 int ANY_fromType(ANY_t *, asn_TYPE_descriptor_t *td, void *struct_ptr);
 ANY_t *ANY_new_fromType(asn_TYPE_descriptor_t *td, void *struct_ptr);
 
+/*
+ * A variant of ANY_fromType() which measures the encoding first and keeps
+ * an exact-size buffer instead of the over-allocated growing one. It walks
+ * the structure twice, so it is slower; use it for ANY values that are
+ * retained for a long time and where the memory matters more.
+ */
+int ANY_fromType_exact(ANY_t *, asn_TYPE_descriptor_t *td, void *struct_ptr);
+
 /* Convert the contents of the ANY type into the specified type. */
 int ANY_to_type(ANY_t *, asn_TYPE_descriptor_t *td, void **struct_ptr);
 
@@ -562,7 +562,14 @@ OCTET_STRING_encode_der(asn_TYPE_descriptor_t *td, void *sptr,
 	}
 
 	/* Invoke callback for the main part of the buffer */
-	ASN__CALLBACK(st->buf, st->size - fix_last_byte);
+	if(cb == der_iovec_consume_bytes) {
+		/* Referenced rather than copied, see der_encode_to_iovec() */
+		if(der_iovec_reference(app_key, st->buf,
+				st->size - fix_last_byte) < 0)
+			goto cb_failed;
+	} else {
+		ASN__CALLBACK(st->buf, st->size - fix_last_byte);
+	}
 
 	/* The last octet should be stripped off the unused bits */
 	if(fix_last_byte) {
@@ -1647,6 +1654,9 @@ OCTET_STRING_encode_uper(asn_TYPE_descriptor_t *td,
 			buf += maySave >> 3;
 		sizeinunits -= maySave;
 		assert(!(maySave & 0x07) || !sizeinunits);
+		/* X.691#10.9.3.8.1: fragments end with a length under 16K */
+		if(!sizeinunits && maySave >= 16384 && uper_put_length(po, 0))
+			ASN__ENCODE_FAILED;
 	}
 
 	ASN__ENCODED_OK(er);
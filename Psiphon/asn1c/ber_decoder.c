@@ -3,6 +3,11 @@
  * Redistribution and modifications are permitted subject to BSD license.
  */
 #include <asn_internal.h>
+#ifdef PSIPHON_TRACE
+#include "Trace.h"
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#endif
 
 #undef	ADVANCE
 #define	ADVANCE(num_bytes)	do {					\
@@ -31,6 +36,7 @@ ber_decode(asn_codec_ctx_t *opt_codec_ctx,
 	asn_TYPE_descriptor_t *type_descriptor,
 	void **struct_ptr, const void *ptr, size_t size) {
 	asn_codec_ctx_t s_codec_ctx;
+	TRACE_SCOPE("ber_decode");
 
 	/*
 	 * Stack checker requires that the codec context
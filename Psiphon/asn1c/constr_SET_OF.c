@@ -6,6 +6,7 @@
 #include <asn_internal.h>
 #include <constr_SET_OF.h>
 #include <asn_SET_OF.h>
+#include <pthread.h>
 
 /*
  * Number of bytes left for this structure.
@@ -264,6 +265,217 @@ SET_OF_decode_ber(asn_codec_ctx_t *opt_codec_ctx, asn_TYPE_descriptor_t *td,
 	RETURN(RC_OK);
 }
 
+/*
+ * Members taken by a thread of SET_OF_decode_ber_parallel() at a time.
+ */
+#define	SET_OF_PARALLEL_BATCH	64
+
+struct _set_of_parallel {
+	asn_codec_ctx_t codec_ctx;	/* Copied to each thread's stack */
+	asn_TYPE_member_t *elm;
+	const asn_SET_OF_parallel_t *options;
+	const uint8_t *base;
+	const size_t *offsets;	/* Member i is [offsets[i], offsets[i+1]) */
+	void **array;
+	int count;
+
+	pthread_mutex_t lock;
+	int next;		/* First member not yet taken */
+	int failed;
+};
+
+/*
+ * Locates the members of a SET OF in its contents. Returns the number of
+ * members, filling in their offsets if offsets isn't 0, or -1 if they
+ * aren't all there in definite or indefinite length TLVs of the member's
+ * tag.
+ */
+static ssize_t
+SET_OF_parallel_scan(asn_codec_ctx_t *opt_codec_ctx, asn_TYPE_member_t *elm,
+	const uint8_t *ptr, size_t size, size_t *offsets) {
+	size_t offset = 0;
+	ssize_t count = 0;
+
+	while(offset < size) {
+		ber_tlv_tag_t tlv_tag;
+		ssize_t tag_len, skip;
+
+		tag_len = ber_fetch_tag(ptr + offset, size - offset, &tlv_tag);
+		if(tag_len <= 0)
+			return -1;
+		if(elm->tag != (ber_tlv_tag_t)-1
+		&& !BER_TAGS_EQUAL(tlv_tag, elm->tag))
+			return -1;
+		skip = ber_skip_length(opt_codec_ctx,
+			BER_TLV_CONSTRUCTED(ptr + offset),
+			ptr + offset + tag_len, size - offset - tag_len);
+		if(skip <= 0 || count == INT_MAX - 1)
+			return -1;
+
+		if(offsets) offsets[count] = offset;
+		offset += tag_len + skip;
+		count++;
+	}
+
+	if(offsets) offsets[count] = offset;
+	return count;
+}
+
+static void *
+SET_OF_parallel_worker(void *arg) {
+	struct _set_of_parallel *p = (struct _set_of_parallel *)arg;
+	asn_codec_ctx_t s_codec_ctx = p->codec_ctx;	/* See ber_decode() */
+	asn_TYPE_descriptor_t *type = p->elm->type;
+
+	for(;;) {
+		int start, end, i;
+
+		pthread_mutex_lock(&p->lock);
+		start = p->failed ? p->count : p->next;
+		end = (p->count - start > SET_OF_PARALLEL_BATCH)
+			? start + SET_OF_PARALLEL_BATCH : p->count;
+		p->next = end;
+		pthread_mutex_unlock(&p->lock);
+		if(start >= end)
+			break;
+
+		for(i = start; i < end; i++) {
+			size_t len = p->offsets[i + 1] - p->offsets[i];
+			asn_dec_rval_t rval;
+
+			rval = type->ber_decoder(&s_codec_ctx, type, &p->array[i],
+				p->base + p->offsets[i], len, 0);
+			if(rval.code != RC_OK || rval.consumed != len) {
+				pthread_mutex_lock(&p->lock);
+				p->failed = 1;
+				pthread_mutex_unlock(&p->lock);
+				break;
+			}
+			if(p->options->member_decoded)
+				p->options->member_decoded(p->array[i], i,
+					p->options->app_key);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The SET OF decoder for large sets.
+ */
+asn_dec_rval_t
+SET_OF_decode_ber_parallel(asn_codec_ctx_t *opt_codec_ctx,
+	asn_TYPE_descriptor_t *td, void **struct_ptr,
+	const void *ptr, size_t size, const asn_SET_OF_parallel_t *options) {
+	asn_SET_OF_specifics_t *specs = (asn_SET_OF_specifics_t *)td->specifics;
+	struct _set_of_parallel p;
+	asn_struct_ctx_t scan_ctx;
+	asn_anonymous_set_ *list;
+	asn_dec_rval_t rval;
+	ber_tlv_len_t left;
+	ssize_t count;
+	pthread_t *threads = 0;
+	int started = 0;
+	int nthreads;
+	int i;
+
+	memset(&p, 0, sizeof(p));
+	if(opt_codec_ctx) {
+		p.codec_ctx = *opt_codec_ctx;
+	} else {
+		p.codec_ctx.max_stack_size = ASN__DEFAULT_STACK_MAX;
+	}
+
+	/*
+	 * The SET OF's own tags, and then its members.
+	 */
+	if(*struct_ptr)
+		goto sequential;
+	memset(&scan_ctx, 0, sizeof(scan_ctx));
+	rval = ber_check_tags(&p.codec_ctx, td, &scan_ctx, ptr, size,
+		0, 1, &left, 0);
+	if(rval.code != RC_OK || left < 0
+	|| (size_t)left > size - rval.consumed)
+		goto sequential;
+
+	p.elm = td->elements;
+	p.options = options;
+	p.base = (const uint8_t *)ptr + rval.consumed;
+	count = SET_OF_parallel_scan(&p.codec_ctx, p.elm, p.base, left, 0);
+	if(count < 0)
+		goto sequential;
+
+	*struct_ptr = CALLOC(1, specs->struct_size);
+	p.offsets = (size_t *)MALLOC((count + 1) * sizeof(p.offsets[0]));
+	if(!*struct_ptr || !p.offsets) {
+		FREEMEM((void *)p.offsets);
+		rval.code = RC_FAIL;
+		rval.consumed = 0;
+		return rval;
+	}
+	SET_OF_parallel_scan(&p.codec_ctx, p.elm, p.base, left,
+		(size_t *)p.offsets);
+
+	list = _A_SET_FROM_VOID(*struct_ptr);
+	if(count) {
+		list->array = (void **)CALLOC(count, sizeof(list->array[0]));
+		if(!list->array) {
+			FREEMEM((void *)p.offsets);
+			rval.code = RC_FAIL;
+			rval.consumed = 0;
+			return rval;
+		}
+		list->count = list->size = count;
+	}
+	p.array = list->array;
+	p.count = count;
+
+	/*
+	 * Decode the members, on the calling thread and as many others as
+	 * can be started.
+	 */
+	nthreads = options->threads;
+	if(count < options->min_members || nthreads < 1)
+		nthreads = 1;
+	if(nthreads > 1)
+		threads = (pthread_t *)MALLOC((nthreads - 1) * sizeof(threads[0]));
+	pthread_mutex_init(&p.lock, 0);
+	for(i = 0; threads && i < nthreads - 1; i++) {
+		if(pthread_create(&threads[started], 0,
+				SET_OF_parallel_worker, &p) == 0)
+			started++;
+	}
+	SET_OF_parallel_worker(&p);
+	for(i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+	pthread_mutex_destroy(&p.lock);
+	FREEMEM(threads);
+	FREEMEM((void *)p.offsets);
+
+	if(p.failed) {
+		/* Start over, for ber_decode()'s account of the failure */
+		ASN_STRUCT_FREE(*td, *struct_ptr);
+		*struct_ptr = 0;
+		goto sequential;
+	}
+
+	((asn_struct_ctx_t *)((char *)*struct_ptr + specs->ctx_offset))->phase
+		= 10;	/* See PHASE_OUT() */
+	rval.code = RC_OK;
+	rval.consumed = (p.base - (const uint8_t *)ptr) + left;
+	return rval;
+
+sequential:
+	rval = SET_OF_decode_ber(&p.codec_ctx, td, struct_ptr, ptr, size, 0);
+	if(rval.code == RC_OK && options->member_decoded) {
+		list = _A_SET_FROM_VOID(*struct_ptr);
+		for(i = 0; i < list->count; i++)
+			options->member_decoded(list->array[i], i,
+				options->app_key);
+	}
+	return rval;
+}
+
 /*
  * Internally visible buffer holding a single encoded element.
  */
@@ -306,6 +518,69 @@ static int _el_buf_cmp(const void *ap, const void *bp) {
 	return ret;
 }
 
+static int _el_iovec_cmp(const void *ap, const void *bp) {
+	return der_iovec_compare(*(der_iovec_t * const *)ap,
+		*(der_iovec_t * const *)bp);
+}
+
+/*
+ * Encodes the members of a SET OF for der_encode_to_iovec(). Each member is
+ * encoded into a vector of its own, so that contents the members reference
+ * stay referenced through the sorting.
+ */
+static asn_enc_rval_t
+SET_OF_encode_der_iovec(asn_TYPE_descriptor_t *td, void *ptr,
+	size_t computed_size, ssize_t encoding_size, void *app_key) {
+	asn_TYPE_member_t *elm = td->elements;
+	asn_anonymous_set_ *list = _A_SET_FROM_VOID(ptr);
+	der_iovec_t *els;
+	der_iovec_t **sorted;
+	asn_enc_rval_t erval;
+	int eels_count = 0;
+	int ret = 0;
+	int edx;
+
+	els = (der_iovec_t *)CALLOC(list->count, sizeof(els[0]));
+	sorted = (der_iovec_t **)MALLOC(list->count * sizeof(sorted[0]));
+	if(!els || !sorted) ret = -1;
+
+	for(edx = 0; ret == 0 && edx < list->count; edx++) {
+		void *memb_ptr = list->array[edx];
+		if(!memb_ptr) continue;
+		erval = der_encode_to_iovec(elm->type, memb_ptr, &els[eels_count]);
+		if(erval.encoded == -1) {
+			ret = -1;
+			break;
+		}
+		sorted[eels_count] = &els[eels_count];
+		encoding_size += erval.encoded;
+		eels_count++;
+	}
+
+	if(ret == 0) {
+		qsort(sorted, eels_count, sizeof(sorted[0]), _el_iovec_cmp);
+		for(edx = 0; ret == 0 && edx < eels_count; edx++)
+			ret = der_iovec_append((der_iovec_t *)app_key, sorted[edx]);
+	}
+
+	if(els) {
+		for(edx = 0; edx < list->count; edx++)
+			der_iovec_free(&els[edx]);
+		FREEMEM(els);
+	}
+	FREEMEM(sorted);
+
+	if(ret || computed_size != (size_t)encoding_size) {
+		erval.encoded = -1;
+		erval.failed_type = td;
+		erval.structure_ptr = ptr;
+	} else {
+		erval.encoded = computed_size;
+	}
+
+	ASN__ENCODED_OK(erval);
+}
+
 /*
  * The DER encoder of the SET OF type.
  */
@@ -362,6 +637,10 @@ SET_OF_encode_der(asn_TYPE_descriptor_t *td, void *ptr,
 		ASN__ENCODED_OK(erval);
 	}
 
+	if(cb == der_iovec_consume_bytes)
+		return SET_OF_encode_der_iovec(td, ptr, computed_size,
+			encoding_size, app_key);
+
 	/*
 	 * DER mandates dynamic sorting of the SET OF elements
 	 * according to their encodings. Build an array of the
@@ -35,6 +35,47 @@ xer_type_encoder_f SET_OF_encode_xer;
 per_type_decoder_f SET_OF_decode_uper;
 per_type_encoder_f SET_OF_encode_uper;
 
+/*
+ * Options of SET_OF_decode_ber_parallel().
+ */
+typedef struct asn_SET_OF_parallel_s {
+	int threads;		/* Decoding threads, including the caller */
+	int min_members;	/* Fewer members are decoded on the caller */
+
+	/*
+	 * Optional. Called on the decoding thread with each member once
+	 * it is decoded, e.g. to decode a value nested in it. The index is
+	 * the member's position in the list. May be called for members of
+	 * a SET OF that then fails to decode.
+	 */
+	void (*member_decoded)(void *member_ptr, int index, void *app_key);
+	void *app_key;
+} asn_SET_OF_parallel_t;
+
+/*
+ * Decodes a SET OF with many members, like ber_decode(opt_codec_ctx,
+ * td, struct_ptr, ptr, size), on several threads.
+ *
+ * The members' TLVs are located first with ber_fetch_tag() and
+ * ber_skip_length(), so that the list is allocated once, at its final
+ * size. The members are then decoded in batches, taken by the threads
+ * in turn, each into its own slot of the list. The list is in encoding
+ * order whatever the number of threads.
+ *
+ * Anything the pre-scan doesn't handle (an indefinite length SET OF,
+ * a structure already partially decoded, a truncated buffer) and any
+ * member that fails to decode is left to SET_OF_decode_ber(), so the
+ * results are always those of ber_decode().
+ */
+asn_dec_rval_t SET_OF_decode_ber_parallel(
+		struct asn_codec_ctx_s *opt_codec_ctx,
+		struct asn_TYPE_descriptor_s *td,
+		void **struct_ptr,	/* Pointer to a target structure's ptr */
+		const void *ptr,	/* Data to be decoded */
+		size_t size,		/* Size of that buffer */
+		const asn_SET_OF_parallel_t *options
+	);
+
 #ifdef __cplusplus
 }
 #endif
@@ -69,6 +69,184 @@ der_encode_to_buffer(asn_TYPE_descriptor_t *type_descriptor, void *struct_ptr,
 	return ec;
 }
 
+ssize_t
+der_encoded_size(asn_TYPE_descriptor_t *type_descriptor, void *struct_ptr) {
+	asn_enc_rval_t ec;
+
+	/* Without a callback the encoders only compute the size */
+	ec = type_descriptor->der_encoder(type_descriptor,
+		struct_ptr, 0, 0, 0, 0);
+	return ec.encoded;
+}
+
+ssize_t
+der_encode_to_new_buffer(asn_TYPE_descriptor_t *type_descriptor,
+	void *struct_ptr, void **buffer_r) {
+	enc_to_buf_arg arg;
+	asn_enc_rval_t ec;
+	ssize_t size;
+	void *buffer;
+
+	size = der_encoded_size(type_descriptor, struct_ptr);
+	if(size == -1) return -1;
+
+	buffer = MALLOC(size + 1);
+	if(!buffer) return -1;
+
+	arg.buffer = buffer;
+	arg.left = size;
+	ec = type_descriptor->der_encoder(type_descriptor,
+		struct_ptr, 0, 0, encode_to_buffer_cb, &arg);
+	if(ec.encoded != size) {
+		/* The structure changed between the passes, or a callback failed */
+		FREEMEM(buffer);
+		return -1;
+	}
+
+	((uint8_t *)buffer)[size] = '\0';
+	*buffer_r = buffer;
+	return size;
+}
+
+/*
+ * I/O vector elements are collected with the offset of copied bytes in
+ * the scratch space rather than their address, since the scratch space
+ * may move as it grows. They are resolved once encoding is complete.
+ */
+#define	DER_IOVEC_SCRATCH	((void *)1)	/* iov_base of copied bytes */
+
+static int
+der_iovec_add(der_iovec_t *v, void *base, size_t len) {
+	if(v->iovcnt == v->iov_allocated) {
+		int n = v->iov_allocated ? v->iov_allocated << 1 : 16;
+		void *p = REALLOC(v->iov, n * sizeof(v->iov[0]));
+		if(!p) return -1;
+		v->iov = (struct iovec *)p;
+		v->iov_allocated = n;
+	}
+	v->iov[v->iovcnt].iov_base = base;
+	v->iov[v->iovcnt].iov_len = len;
+	v->iovcnt++;
+	v->length += len;
+	return 0;
+}
+
+int
+der_iovec_consume_bytes(const void *buffer, size_t size, void *app_key) {
+	der_iovec_t *v = (der_iovec_t *)app_key;
+	struct iovec *last;
+
+	if(v->scratch_used + size > v->scratch_size) {
+		size_t n = v->scratch_size ? v->scratch_size << 1 : 256;
+		void *p;
+		while(n < v->scratch_used + size) n <<= 1;
+		p = REALLOC(v->scratch, n);
+		if(!p) return -1;
+		v->scratch = (uint8_t *)p;
+		v->scratch_size = n;
+	}
+	memcpy(v->scratch + v->scratch_used, buffer, size);
+
+	/* Extend the previous element if it also holds copied bytes */
+	last = v->iovcnt ? &v->iov[v->iovcnt - 1] : 0;
+	if(last && last->iov_base == DER_IOVEC_SCRATCH) {
+		last->iov_len += size;
+		v->length += size;
+	} else if(der_iovec_add(v, DER_IOVEC_SCRATCH, size)) {
+		return -1;
+	}
+	v->scratch_used += size;
+	return 0;
+}
+
+int
+der_iovec_reference(void *app_key, const void *buffer, size_t size) {
+	der_iovec_t *v = (der_iovec_t *)app_key;
+
+	if(size < DER_IOVEC_MIN_REFERENCE)
+		return der_iovec_consume_bytes(buffer, size, app_key);
+	return der_iovec_add(v, (void *)buffer, size);
+}
+
+asn_enc_rval_t
+der_encode_to_iovec(asn_TYPE_descriptor_t *type_descriptor,
+	void *struct_ptr, der_iovec_t *v) {
+	asn_enc_rval_t ec;
+	size_t offset = 0;
+	int i;
+
+	v->iovcnt = 0;
+	v->length = 0;
+	v->scratch_used = 0;
+
+	ec = type_descriptor->der_encoder(type_descriptor,
+		struct_ptr, 0, 0, der_iovec_consume_bytes, v);
+	if(ec.encoded == -1) {
+		v->iovcnt = 0;
+		v->length = 0;
+		return ec;
+	}
+	assert(ec.encoded == (ssize_t)v->length);
+
+	/* Resolve copied bytes to their place in the scratch space */
+	for(i = 0; i < v->iovcnt; i++) {
+		if(v->iov[i].iov_base == DER_IOVEC_SCRATCH) {
+			v->iov[i].iov_base = v->scratch + offset;
+			offset += v->iov[i].iov_len;
+		}
+	}
+
+	return ec;
+}
+
+int
+der_iovec_compare(const der_iovec_t *a, const der_iovec_t *b) {
+	int ai = 0, bi = 0;
+	size_t aoff = 0, boff = 0;
+
+	while(ai < a->iovcnt && bi < b->iovcnt) {
+		size_t alen = a->iov[ai].iov_len - aoff;
+		size_t blen = b->iov[bi].iov_len - boff;
+		size_t n = alen < blen ? alen : blen;
+		int ret = memcmp((uint8_t *)a->iov[ai].iov_base + aoff,
+			(uint8_t *)b->iov[bi].iov_base + boff, n);
+		if(ret) return ret;
+		aoff += n;
+		boff += n;
+		if(aoff == a->iov[ai].iov_len) { ai++; aoff = 0; }
+		if(boff == b->iov[bi].iov_len) { bi++; boff = 0; }
+	}
+
+	if(a->length < b->length) return -1;
+	if(a->length > b->length) return 1;
+	return 0;
+}
+
+int
+der_iovec_append(der_iovec_t *dst, const der_iovec_t *src) {
+	int i;
+
+	for(i = 0; i < src->iovcnt; i++) {
+		uint8_t *base = (uint8_t *)src->iov[i].iov_base;
+		size_t len = src->iov[i].iov_len;
+		int ret;
+		if(base >= src->scratch && base < src->scratch + src->scratch_used)
+			ret = der_iovec_consume_bytes(base, len, dst);
+		else
+			ret = der_iovec_add(dst, base, len);
+		if(ret) return -1;
+	}
+
+	return 0;
+}
+
+void
+der_iovec_free(der_iovec_t *v) {
+	if(!v) return;
+	FREEMEM(v->iov);
+	FREEMEM(v->scratch);
+	memset(v, 0, sizeof(*v));
+}
 
 /*
  * Write out leading TL[v] sequence according to the type definition.
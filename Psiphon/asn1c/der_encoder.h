@@ -6,6 +6,7 @@
 #define	_DER_ENCODER_H_
 
 #include <asn_application.h>
+#include <sys/uio.h>	/* For struct iovec */
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,6 +32,63 @@ asn_enc_rval_t der_encode_to_buffer(
 		size_t buffer_size	/* Initial buffer size (maximum) */
 	);
 
+/*
+ * Computes the size of the DER encoding without producing it.
+ * Returns the number of bytes, or -1 if the structure can't be encoded.
+ */
+ssize_t der_encoded_size(
+		struct asn_TYPE_descriptor_s *type_descriptor,
+		void *struct_ptr	/* Structure to be encoded */
+	);
+
+/*
+ * A variant of der_encode_to_buffer() which measures the encoding first
+ * and allocates the buffer itself, once and at the exact size (plus a
+ * terminating 0 byte, like OCTET STRING buffers).
+ * Returns the number of bytes in the buffer or -1 in case of failure.
+ */
+ssize_t der_encode_to_new_buffer(
+		struct asn_TYPE_descriptor_s *type_descriptor,
+		void *struct_ptr,	/* Structure to be encoded */
+		void **buffer_r		/* Buffer allocated and returned */
+	);
+
+/*
+ * An encoding as an I/O vector, for writev(2) and the like.
+ * The contents of OCTET STRING based values (including ANY and the
+ * string types) of at least DER_IOVEC_MIN_REFERENCE bytes point into the
+ * encoded structure, which must outlive the vector. Everything else
+ * (tags, lengths, integers, short strings) is copied into scratch space
+ * owned by the vector, coalescing adjacent copies into one element.
+ */
+#define	DER_IOVEC_MIN_REFERENCE	64
+typedef struct der_iovec_s {
+	struct iovec *iov;
+	int iovcnt;
+	size_t length;		/* Total bytes across iov */
+
+	/* Private */
+	int iov_allocated;
+	uint8_t *scratch;
+	size_t scratch_used;
+	size_t scratch_size;
+} der_iovec_t;
+
+/*
+ * Encodes into v, which must be zeroed or previously released with
+ * der_iovec_free(). Returns the encoded size as der_encode() does.
+ */
+asn_enc_rval_t der_encode_to_iovec(
+		struct asn_TYPE_descriptor_s *type_descriptor,
+		void *struct_ptr,	/* Structure to be encoded */
+		der_iovec_t *v
+	);
+
+/*
+ * Releases the vector's storage (but not the referenced structure).
+ */
+void der_iovec_free(der_iovec_t *v);
+
 /*
  * Type of the generic DER encoder.
  */
@@ -61,6 +119,23 @@ ssize_t der_write_tags(
 		void *app_key
 	);
 
+/*
+ * The der_encode_to_iovec() callback, and the entry point through which
+ * OCTET_STRING_encode_der() hands over its contents by reference when the
+ * callback is der_iovec_consume_bytes.
+ */
+int der_iovec_consume_bytes(const void *buffer, size_t size, void *app_key);
+int der_iovec_reference(void *app_key, const void *buffer, size_t size);
+
+/*
+ * Vector helpers for constructed types that reorder their members (SET OF).
+ * der_iovec_compare() orders the bytes of two vectors like memcmp(), with
+ * the shorter first on a common prefix. der_iovec_append() appends src to
+ * dst, keeping references and copying the rest.
+ */
+int der_iovec_compare(const der_iovec_t *a, const der_iovec_t *b);
+int der_iovec_append(der_iovec_t *dst, const der_iovec_t *src);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,16 +7,23 @@
 #include <constr_TYPE.h>
 #include <per_opentype.h>
 
-typedef struct uper_ugot_key {
-	asn_per_data_t oldpd;	/* Old per data source */
-	size_t unclaimed;
-	size_t ot_moved;	/* Number of bits moved by OT processing */
-	int repeat;
-} uper_ugot_key;
-
-static int uper_ugot_refill(asn_per_data_t *pd);
+/*
+ * The open type is decoded through a view of the enclosing stream: an
+ * asn_per_data_t sharing the enclosing stream's buffer, bounded to the
+ * current fragment of the open type. When the inner decoder reaches the end
+ * of a fragment, the refill moves the enclosing stream past it, reads the
+ * next fragment's length and bounds the view to that fragment. Nothing is
+ * copied, and open types nested in open types are views of views.
+ */
+typedef struct uper_ot_view_key {
+	asn_per_data_t *parent;	/* Enclosing stream */
+	size_t remaining;	/* Bits of the current fragment beyond the view */
+	size_t synced;		/* View's moved when parent was last advanced */
+	int repeat;		/* More fragments follow the current one */
+} uper_ot_view_key;
+
+static int uper_ot_view_refill(asn_per_data_t *view);
 static int per_skip_bits(asn_per_data_t *pd, int skip_nbits);
-static asn_dec_rval_t uper_sot_suck(asn_codec_ctx_t *, asn_TYPE_descriptor_t *td, asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd);
 
 /*
  * Encode an "open type field".
@@ -42,6 +49,11 @@ uper_open_type_put(asn_TYPE_descriptor_t *td, asn_per_constraints_t *constraints
 		if(per_put_many_bits(po, bptr, maySave * 8)) break;
 		bptr = (char *)bptr + maySave;
 		toGo -= maySave;
+		/* X.691#10.9.3.8.1: fragments end with a length under 16K */
+		if(!toGo && maySave >= 16384 && uper_put_length(po, 0)) {
+			FREEMEM(buf);
+			return -1;
+		}
 	}
 
 	FREEMEM(buf);
@@ -53,308 +65,152 @@ uper_open_type_put(asn_TYPE_descriptor_t *td, asn_per_constraints_t *constraints
 	return 0;
 }
 
-static asn_dec_rval_t
-uper_open_type_get_simple(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
-	asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd) {
-	asn_dec_rval_t rv;
-	ssize_t chunk_bytes;
-	int repeat;
-	uint8_t *buf = 0;
-	size_t bufLen = 0;
-	size_t bufSize = 0;
-	asn_per_data_t spd;
-	size_t padding;
+/* Advances the enclosing stream to the view's position */
+static void
+uper_ot_view_sync(asn_per_data_t *view, uper_ot_view_key *key) {
+	asn_per_data_t *parent = key->parent;
 
-	ASN__STACK_OVERFLOW_CHECK(ctx);
+	parent->nbits -= (view->buffer - parent->buffer) << 3;
+	parent->buffer = view->buffer;
+	parent->nboff = view->nboff;
+	parent->moved += view->moved - key->synced;
+	key->synced = view->moved;
+}
 
-	ASN_DEBUG("Getting open type %s...", td->name);
+/* Bounds the view to what the enclosing stream holds of the fragment */
+static int
+uper_ot_view_fill(asn_per_data_t *view, uper_ot_view_key *key) {
+	asn_per_data_t *parent = key->parent;
+	size_t avail;
 
-	do {
-		chunk_bytes = uper_get_length(pd, -1, &repeat);
-		if(chunk_bytes < 0) {
-			FREEMEM(buf);
-			ASN__DECODE_STARVED;
-		}
-		if(bufLen + chunk_bytes > bufSize) {
-			void *ptr;
-			bufSize = chunk_bytes + (bufSize << 2);
-			ptr = REALLOC(buf, bufSize);
-			if(!ptr) {
-				FREEMEM(buf);
-				ASN__DECODE_FAILED;
-			}
-			buf = ptr;
-		}
-		if(per_get_many_bits(pd, buf + bufLen, 0, chunk_bytes << 3)) {
-			FREEMEM(buf);
-			ASN__DECODE_STARVED;
-		}
-		bufLen += chunk_bytes;
-	} while(repeat);
+	if(key->remaining && parent->nboff == parent->nbits) {
+		/* The enclosing stream is itself a view at a fragment end */
+		if(!parent->refill || parent->refill(parent))
+			return -1;
+	}
 
-	ASN_DEBUG("Getting open type %s encoded in %ld bytes", td->name,
-		(long)bufLen);
+	avail = parent->nbits - parent->nboff;
+	if(avail > key->remaining)
+		avail = key->remaining;
+	key->remaining -= avail;
 
-	memset(&spd, 0, sizeof(spd));
-	spd.buffer = buf;
-	spd.nbits = bufLen << 3;
+	view->buffer = parent->buffer;
+	view->nboff = parent->nboff;
+	view->nbits = parent->nboff + avail;
+	return 0;
+}
 
-	ASN_DEBUG_INDENT_ADD(+4);
-	rv = td->uper_decoder(ctx, td, constraints, sptr, &spd);
-	ASN_DEBUG_INDENT_ADD(-4);
+static int
+uper_ot_view_refill(asn_per_data_t *view) {
+	uper_ot_view_key *key = (uper_ot_view_key *)view->refill_key;
 
-	if(rv.code == RC_OK) {
-		/* Check padding validity */
-		padding = spd.nbits - spd.nboff;
-                if ((padding < 8 ||
-		/* X.691#10.1.3 */
-		(spd.nboff == 0 && spd.nbits == 8 && spd.buffer == buf)) &&
-                    per_get_few_bits(&spd, padding) == 0) {
-			/* Everything is cool */
-			FREEMEM(buf);
-			return rv;
-		}
-		FREEMEM(buf);
-		if(padding >= 8) {
-			ASN_DEBUG("Too large padding %d in open type", (int)padding);
-			ASN__DECODE_FAILED;
-		} else {
-			ASN_DEBUG("Non-zero padding");
-			ASN__DECODE_FAILED;
+	uper_ot_view_sync(view, key);
+
+	if(!key->remaining) {
+		ssize_t chunk_bytes;
+		if(!key->repeat) {
+			ASN_DEBUG("Want more but open type doesn't have it");
+			return -1;
 		}
-	} else {
-		FREEMEM(buf);
-		/* rv.code could be RC_WMORE, nonsense in this context */
-		rv.code = RC_FAIL; /* Noone would give us more */
+		chunk_bytes = uper_get_length(key->parent, -1, &key->repeat);
+		if(chunk_bytes < 0) return -1;
+		key->remaining = chunk_bytes << 3;
 	}
 
-	return rv;
+	return uper_ot_view_fill(view, key);
 }
 
-static asn_dec_rval_t GCC_NOTUSED
-uper_open_type_get_complex(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
+asn_dec_rval_t
+uper_open_type_get(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
 	asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd) {
-	uper_ugot_key arg;
+	uper_ot_view_key key;
+	asn_per_data_t view;
 	asn_dec_rval_t rv;
-	ssize_t padding;
+	ssize_t chunk_bytes;
+	size_t left;
 
 	ASN__STACK_OVERFLOW_CHECK(ctx);
 
-	ASN_DEBUG("Getting open type %s from %s", td->name,
-		per_data_string(pd));
-	arg.oldpd = *pd;
-	arg.unclaimed = 0;
-	arg.ot_moved = 0;
-	arg.repeat = 1;
-	pd->refill = uper_ugot_refill;
-	pd->refill_key = &arg;
-	pd->nbits = pd->nboff;	/* 0 good bits at this point, will refill */
-	pd->moved = 0;	/* This now counts the open type size in bits */
+	ASN_DEBUG("Getting open type %s...", td->name);
+
+	chunk_bytes = uper_get_length(pd, -1, &key.repeat);
+	if(chunk_bytes < 0) ASN__DECODE_STARVED;
+
+	key.parent = pd;
+	key.remaining = chunk_bytes << 3;
+	key.synced = 0;
+	memset(&view, 0, sizeof(view));
+	view.refill = uper_ot_view_refill;
+	view.refill_key = &key;
+	if(uper_ot_view_fill(&view, &key)) ASN__DECODE_STARVED;
 
 	ASN_DEBUG_INDENT_ADD(+4);
-	rv = td->uper_decoder(ctx, td, constraints, sptr, pd);
+	rv = td->uper_decoder(ctx, td, constraints, sptr, &view);
 	ASN_DEBUG_INDENT_ADD(-4);
 
-#define	UPDRESTOREPD	do {						\
-	/* buffer and nboff are valid, preserve them. */		\
-	pd->nbits = arg.oldpd.nbits - (pd->moved - arg.ot_moved);	\
-	pd->moved = arg.oldpd.moved + (pd->moved - arg.ot_moved);	\
-	pd->refill = arg.oldpd.refill;					\
-	pd->refill_key = arg.oldpd.refill_key;				\
-  } while(0)
-
 	if(rv.code != RC_OK) {
-		UPDRESTOREPD;
+		/* rv.code could be RC_WMORE, nonsense in this context */
+		rv.code = RC_FAIL; /* Noone would give us more */
 		return rv;
 	}
 
-	ASN_DEBUG("OpenType %s pd%s old%s unclaimed=%d, repeat=%d", td->name,
-		per_data_string(pd),
-		per_data_string(&arg.oldpd),
-		(int)arg.unclaimed, (int)arg.repeat);
-
-	padding = pd->moved % 8;
-	if(padding) {
-		int32_t pvalue;
-		if(padding > 7) {
-			ASN_DEBUG("Too large padding %d in open type",
-				(int)padding);
-			rv.code = RC_FAIL;
-			UPDRESTOREPD;
-			return rv;
-		}
-		padding = 8 - padding;
-		ASN_DEBUG("Getting padding of %d bits", (int)padding);
-		pvalue = per_get_few_bits(pd, padding);
-		switch(pvalue) {
-		case -1:
-			ASN_DEBUG("Padding skip failed");
-			UPDRESTOREPD;
-			ASN__DECODE_STARVED;
-		case 0: break;
-		default:
-			ASN_DEBUG("Non-blank padding (%d bits 0x%02x)",
-				(int)padding, (int)pvalue);
-			UPDRESTOREPD;
-			ASN__DECODE_FAILED;
-		}
+	/* A final empty fragment follows lengths that are multiples of 16K */
+	left = (view.nbits - view.nboff) + key.remaining;
+	while(left == 0 && key.repeat) {
+		uper_ot_view_sync(&view, &key);
+		chunk_bytes = uper_get_length(pd, -1, &key.repeat);
+		if(chunk_bytes < 0) ASN__DECODE_STARVED;
+		key.remaining = chunk_bytes << 3;
+		if(uper_ot_view_fill(&view, &key)) ASN__DECODE_STARVED;
+		left = (view.nbits - view.nboff) + key.remaining;
 	}
-	if(pd->nboff != pd->nbits) {
-		ASN_DEBUG("Open type %s overhead pd%s old%s", td->name,
-			per_data_string(pd), per_data_string(&arg.oldpd));
-		if(1) {
-			UPDRESTOREPD;
-			ASN__DECODE_FAILED;
-		} else {
-			arg.unclaimed += pd->nbits - pd->nboff;
-		}
+	if(key.repeat) {
+		ASN_DEBUG("Not consumed the whole thing");
+		ASN__DECODE_FAILED;
 	}
 
-	/* Adjust pd back so it points to original data */
-	UPDRESTOREPD;
-
-	/* Skip data not consumed by the decoder */
-	if(arg.unclaimed) {
-		ASN_DEBUG("Getting unclaimed %d", (int)arg.unclaimed);
-		switch(per_skip_bits(pd, arg.unclaimed)) {
-		case -1:
-			ASN_DEBUG("Claim of %d failed", (int)arg.unclaimed);
-			ASN__DECODE_STARVED;
-		case 0:
-			ASN_DEBUG("Got claim of %d", (int)arg.unclaimed);
-			break;
-		default:
-			/* Padding must be blank */
-			ASN_DEBUG("Non-blank unconsumed padding");
-			ASN__DECODE_FAILED;
-		}
-		arg.unclaimed = 0;
+	/* Check padding validity */
+	if(left >= 8
+	/* X.691#10.1.3 */
+	&& !(left == 8 && view.moved == 0)) {
+		ASN_DEBUG("Too large padding %d in open type", (int)left);
+		ASN__DECODE_FAILED;
 	}
-
-	if(arg.repeat) {
-		ASN_DEBUG("Not consumed the whole thing");
-		rv.code = RC_FAIL;
-		return rv;
+	if(left && per_get_few_bits(&view, left) != 0) {
+		ASN_DEBUG("Non-zero padding");
+		ASN__DECODE_FAILED;
 	}
 
+	uper_ot_view_sync(&view, &key);
 	return rv;
 }
 
-
-asn_dec_rval_t
-uper_open_type_get(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
-	asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd) {
-
-	return uper_open_type_get_simple(ctx, td, constraints, sptr, pd);
-}
-
 int
 uper_open_type_skip(asn_codec_ctx_t *ctx, asn_per_data_t *pd) {
-	asn_TYPE_descriptor_t s_td;
-	asn_dec_rval_t rv;
-
-	s_td.name = "<unknown extension>";
-	s_td.uper_decoder = uper_sot_suck;
-
-	rv = uper_open_type_get(ctx, &s_td, 0, 0, pd);
-	if(rv.code != RC_OK)
-		return -1;
-	else
-		return 0;
-}
-
-/*
- * Internal functions.
- */
-
-static asn_dec_rval_t
-uper_sot_suck(asn_codec_ctx_t *ctx, asn_TYPE_descriptor_t *td,
-	asn_per_constraints_t *constraints, void **sptr, asn_per_data_t *pd) {
-	asn_dec_rval_t rv;
+	ssize_t chunk_bytes;
+	int repeat;
 
 	(void)ctx;
-	(void)td;
-	(void)constraints;
-	(void)sptr;
-
-	while(per_get_few_bits(pd, 24) >= 0);
-
-	rv.code = RC_OK;
-	rv.consumed = pd->moved;
 
-	return rv;
-}
-
-static int
-uper_ugot_refill(asn_per_data_t *pd) {
-	uper_ugot_key *arg = pd->refill_key;
-	ssize_t next_chunk_bytes, next_chunk_bits;
-	ssize_t avail;
-
-	asn_per_data_t *oldpd = &arg->oldpd;
-
-	ASN_DEBUG("REFILLING pd->moved=%ld, oldpd->moved=%ld",
-		(long)pd->moved, (long)oldpd->moved);
-
-	/* Advance our position to where pd is */
-	oldpd->buffer = pd->buffer;
-	oldpd->nboff  = pd->nboff;
-	oldpd->nbits -= pd->moved - arg->ot_moved;
-	oldpd->moved += pd->moved - arg->ot_moved;
-	arg->ot_moved = pd->moved;
-
-	if(arg->unclaimed) {
-		/* Refill the container */
-		if(per_get_few_bits(oldpd, 1))
-			return -1;
-		if(oldpd->nboff == 0) {
-			assert(0);
+	do {
+		chunk_bytes = uper_get_length(pd, -1, &repeat);
+		if(chunk_bytes < 0) return -1;
+		if(!pd->refill && pd->nbits - pd->nboff >= (size_t)chunk_bytes << 3) {
+			/* Within this stream, so step over it */
+			pd->nboff += chunk_bytes << 3;
+			pd->moved += chunk_bytes << 3;
+		} else if(per_skip_bits(pd, chunk_bytes << 3) < 0) {
 			return -1;
 		}
-		pd->buffer = oldpd->buffer;
-		pd->nboff = oldpd->nboff - 1;
-		pd->nbits = oldpd->nbits;
-		ASN_DEBUG("UNCLAIMED <- return from (pd->moved=%ld)",
-			(long)pd->moved);
-		return 0;
-	}
-
-	if(!arg->repeat) {
-		ASN_DEBUG("Want more but refill doesn't have it");
-		return -1;
-	}
+	} while(repeat);
 
-	next_chunk_bytes = uper_get_length(oldpd, -1, &arg->repeat);
-	ASN_DEBUG("Open type LENGTH %ld bytes at off %ld, repeat %ld",
-		(long)next_chunk_bytes, (long)oldpd->moved, (long)arg->repeat);
-	if(next_chunk_bytes < 0) return -1;
-	if(next_chunk_bytes == 0) {
-		pd->refill = 0;	/* No more refills, naturally */
-		assert(!arg->repeat);	/* Implementation guarantee */
-	}
-	next_chunk_bits = next_chunk_bytes << 3;
-	avail = oldpd->nbits - oldpd->nboff;
-	if(avail >= next_chunk_bits) {
-		pd->nbits = oldpd->nboff + next_chunk_bits;
-		arg->unclaimed = 0;
-		ASN_DEBUG("!+Parent frame %ld bits, alloting %ld [%ld..%ld] (%ld)",
-			(long)next_chunk_bits, (long)oldpd->moved,
-			(long)oldpd->nboff, (long)oldpd->nbits,
-			(long)(oldpd->nbits - oldpd->nboff));
-	} else {
-		pd->nbits = oldpd->nbits;
-		arg->unclaimed = next_chunk_bits - avail;
-		ASN_DEBUG("!-Parent frame %ld, require %ld, will claim %ld",
-			(long)avail, (long)next_chunk_bits,
-			(long)arg->unclaimed);
-	}
-	pd->buffer = oldpd->buffer;
-	pd->nboff = oldpd->nboff;
-	ASN_DEBUG("Refilled pd%s old%s",
-		per_data_string(pd), per_data_string(oldpd));
 	return 0;
 }
 
+/*
+ * Internal functions.
+ */
+
 static int
 per_skip_bits(asn_per_data_t *pd, int skip_nbits) {
 	int hasNonZeroBits = 0;
@@ -0,0 +1,825 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CompressedLog.h"
+#include "Trace.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define FRAME_MAGIC "PSLF"
+#define FOOTER_MAGIC "PSLI"
+
+struct compressed_log {
+    int fd;
+    char *path;
+    char *older_path;
+    compressed_log_options_t options;
+
+    // Frames of the current file. Offsets are those of the frame headers.
+    compressed_log_frame_t *frames;
+    size_t frame_count;
+    size_t frame_cap;
+
+    // Uncompressed tail, as it is in the file after the last frame.
+    char *tail;
+    size_t tail_len;
+    size_t tail_cap;
+    uint64_t tail_offset;
+    uint32_t tail_lines;
+    uint32_t line_count;
+};
+
+struct compressed_log_reader {
+    uint8_t *data;
+    size_t len;
+
+    // Frames, then the tail if it isn't empty. Offsets are those of the frame data.
+    compressed_log_frame_t *frames;
+    size_t frame_count;
+    size_t line_count;
+};
+
+/*** Little-endian helpers ***/
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        p[i] = (uint8_t)(v >> (8 * i));
+    }
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+/*** Frames ***/
+
+static uint32_t crc(const uint8_t *p, size_t len) {
+    return (uint32_t)crc32(crc32(0L, Z_NULL, 0), p, (uInt)len);
+}
+
+static int push_frame(compressed_log_frame_t **frames, size_t *count, size_t *cap, const compressed_log_frame_t *f) {
+    if (*count == *cap) {
+        size_t n = *cap ? *cap * 2 : 16;
+        compressed_log_frame_t *p = realloc(*frames, n * sizeof(*p));
+        if (p == NULL) {
+            return -1;
+        }
+        *frames = p;
+        *cap = n;
+    }
+    (*frames)[(*count)++] = *f;
+    return 0;
+}
+
+static size_t count_lines(const uint8_t *p, size_t len) {
+    size_t n = 0;
+    const uint8_t *end = p + len;
+    while (p < end && (p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        n++;
+        p++;
+    }
+    // An unterminated last line, e.g. cut short by the process being killed, is still a line.
+    if (len > 0 && end[-1] != '\n') {
+        n++;
+    }
+    return n;
+}
+
+// Checks the frame header at data + offset, and populates f with the frame, its offset being that of the header.
+static int parse_header(const uint8_t *data, size_t len, uint64_t offset, compressed_log_frame_t *f) {
+    if (offset > len || len - offset < COMPRESSED_LOG_FRAME_HEADER_LEN) {
+        return -1;
+    }
+    const uint8_t *h = data + offset;
+    if (memcmp(h, FRAME_MAGIC, 4) != 0) {
+        return -1;
+    }
+    f->offset = offset;
+    f->stored_len = get_u32(h + 4);
+    f->raw_len = get_u32(h + 8);
+    f->line_count = get_u32(h + 12);
+    f->compressed = 1;
+    if (f->stored_len > len - offset - COMPRESSED_LOG_FRAME_HEADER_LEN || f->raw_len > COMPRESSED_LOG_MAX_FRAME_SIZE) {
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the frames from the index of a rotated file. Offsets are those of the headers.
+static int parse_index(const uint8_t *data, size_t len, compressed_log_frame_t **frames, size_t *count,
+                       size_t *cap, uint64_t *frames_end) {
+    if (len < COMPRESSED_LOG_FOOTER_LEN || memcmp(data + len - 4, FOOTER_MAGIC, 4) != 0) {
+        return -1;
+    }
+    const uint8_t *footer = data + len - COMPRESSED_LOG_FOOTER_LEN;
+    uint32_t n = get_u32(footer);
+    if (n > (len - COMPRESSED_LOG_FOOTER_LEN) / COMPRESSED_LOG_INDEX_ENTRY_LEN) {
+        return -1;
+    }
+    size_t index_len = (size_t)n * COMPRESSED_LOG_INDEX_ENTRY_LEN;
+    const uint8_t *index = footer - index_len;
+    if (crc(index, index_len) != get_u32(footer + 4)) {
+        return -1;
+    }
+
+    // Frames are contiguous from the start of the file up to the index.
+    uint64_t offset = 0;
+    uint32_t first_line = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *e = index + (size_t)i * COMPRESSED_LOG_INDEX_ENTRY_LEN;
+        compressed_log_frame_t f;
+        if (get_u64(e) != offset || parse_header(data, (size_t)(index - data), offset, &f) != 0 ||
+            f.stored_len != get_u32(e + 8) || f.raw_len != get_u32(e + 12) || f.line_count != get_u32(e + 16)) {
+            *count = 0;
+            return -1;
+        }
+        f.first_line = first_line;
+        if (push_frame(frames, count, cap, &f) != 0) {
+            *count = 0;
+            return -1;
+        }
+        offset += COMPRESSED_LOG_FRAME_HEADER_LEN + f.stored_len;
+        first_line += f.line_count;
+    }
+    if (offset != (uint64_t)(index - data)) {
+        *count = 0;
+        return -1;
+    }
+    *frames_end = offset;
+    return 0;
+}
+
+// Finds the frames of a file. Offsets are those of the headers. Populates frames_end with the offset of the tail,
+// or of the index in a rotated file, and indexed with whether the file is rotated.
+static int parse(const uint8_t *data, size_t len, compressed_log_frame_t **frames, size_t *count, size_t *cap,
+                 uint64_t *frames_end, int *indexed) {
+    *count = 0;
+    *indexed = 0;
+    if (parse_index(data, len, frames, count, cap, frames_end) == 0) {
+        *indexed = 1;
+        return 0;
+    }
+
+    // Follow the headers from the start. The first one that isn't a whole frame starts the tail.
+    uint64_t offset = 0;
+    uint32_t first_line = 0;
+    compressed_log_frame_t f;
+    while (parse_header(data, len, offset, &f) == 0) {
+        f.first_line = first_line;
+        if (push_frame(frames, count, cap, &f) != 0) {
+            return -1;
+        }
+        offset += COMPRESSED_LOG_FRAME_HEADER_LEN + f.stored_len;
+        first_line += f.line_count;
+    }
+
+    // Frames are never written over, so only the last one can have been cut short while it was written, in which
+    // case it starts the tail. The others are checked when they are read.
+    if (*count > 0) {
+        const compressed_log_frame_t *last = &(*frames)[*count - 1];
+        const uint8_t *stored = data + last->offset + COMPRESSED_LOG_FRAME_HEADER_LEN;
+        if (crc(stored, last->stored_len) != get_u32(data + last->offset + 16)) {
+            offset = last->offset;
+            (*count)--;
+        }
+    }
+    *frames_end = offset;
+    return 0;
+}
+
+// Inflates the frame whose header is at data + offset into dst, of at least its raw length.
+static long inflate_frame(const uint8_t *data, const compressed_log_frame_t *f, uint64_t header_offset, char *dst) {
+    const uint8_t *stored = data + header_offset + COMPRESSED_LOG_FRAME_HEADER_LEN;
+    if (crc(stored, f->stored_len) != get_u32(data + header_offset + 16)) {
+        return -1;
+    }
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK) {
+        return -1;
+    }
+    zs.next_in = (Bytef *)stored;
+    zs.avail_in = f->stored_len;
+    zs.next_out = (Bytef *)dst;
+    zs.avail_out = f->raw_len;
+    int ret = inflate(&zs, Z_FINISH);
+    size_t n = f->raw_len - zs.avail_out;
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END && n == f->raw_len ? (long)n : -1;
+}
+
+// Whether the tail is what is left of the tail the last frame was deflated from, followed by the frame written after
+// it, when the process was killed after the frame was written over the tail but before the file was truncated.
+static int is_sealed_remainder(const uint8_t *data, const compressed_log_frame_t *last, const uint8_t *tail,
+                               size_t tail_len) {
+    size_t frame_len = COMPRESSED_LOG_FRAME_HEADER_LEN + last->stored_len;
+    return tail_len > frame_len && tail_len == last->raw_len &&
+           memcmp(tail + tail_len - frame_len, data + last->offset, frame_len) == 0;
+}
+
+// Finds a frame being written after the tail it was deflated from, or over the start of that tail, when the process
+// was killed: it starts a line, at the raw length of the frame into the tail. Returns its offset into the tail, or
+// tail_len if there is none, and populates whole with whether the frame was wholly written after the tail.
+static size_t find_pending_frame(const uint8_t *tail, size_t tail_len, int *whole) {
+    *whole = 0;
+    const uint8_t *end = tail + tail_len;
+    for (const uint8_t *p = tail; (p = memchr(p, '\n', (size_t)(end - p))) != NULL;) {
+        p++;
+        size_t at = (size_t)(p - tail), left = (size_t)(end - p);
+        if (left < COMPRESSED_LOG_FRAME_HEADER_LEN) {
+            // Killed before the header was written: lines never start with the magic.
+            return left > 0 && memcmp(p, FRAME_MAGIC, left < 4 ? left : 4) == 0 ? at : tail_len;
+        }
+        if (memcmp(p, FRAME_MAGIC, 4) == 0 && get_u32(p + 8) == at) {
+            uint32_t stored_len = get_u32(p + 4);
+            *whole = stored_len == left - COMPRESSED_LOG_FRAME_HEADER_LEN &&
+                     crc(p + COMPRESSED_LOG_FRAME_HEADER_LEN, stored_len) == get_u32(p + 16);
+            return at;
+        }
+    }
+    return tail_len;
+}
+
+// Resolves what follows the frames of a file that isn't rotated. Returns the length of the tail to keep, and populates
+// pending with a frame wholly written after the tail it holds the lines of, with pending->raw_len 0 if there is none.
+static size_t resolve_tail(const uint8_t *data, size_t len, const compressed_log_frame_t *frames, size_t count,
+                           uint64_t frames_end, compressed_log_frame_t *pending) {
+    const uint8_t *tail = data + frames_end;
+    size_t tail_len = len - (size_t)frames_end;
+    pending->raw_len = 0;
+    if (count > 0 && is_sealed_remainder(data, &frames[count - 1], tail, tail_len)) {
+        return 0;
+    }
+    int whole;
+    size_t at = find_pending_frame(tail, tail_len, &whole);
+    if (whole && parse_header(data, len, frames_end + at, pending) == 0) {
+        pending->first_line = count > 0 ? frames[count - 1].first_line + frames[count - 1].line_count : 0;
+        return 0;
+    }
+    return at;
+}
+
+/*** Writer ***/
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int reserve_tail(compressed_log_t *log, size_t len) {
+    if (len > COMPRESSED_LOG_MAX_FRAME_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if (len <= log->tail_cap) {
+        return 0;
+    }
+    size_t cap = log->tail_cap ? log->tail_cap : log->options.frame_size + 1024;
+    while (cap < len) {
+        cap *= 2;
+    }
+    char *p = realloc(log->tail, cap);
+    if (p == NULL) {
+        return -1;
+    }
+    log->tail = p;
+    log->tail_cap = cap;
+    return 0;
+}
+
+// Deflates the tail into a frame that replaces it.
+static int seal(compressed_log_t *log) {
+    if (log->tail_len == 0) {
+        return 0;
+    }
+
+    // Frames are inflated on their own, so a window larger than a frame is of no use, and deflate's memory is
+    // mostly its window. The stream is only set up for the time of the frame.
+    int window_bits = log->options.frame_size <= (1 << 14) ? 14 : 15;
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, log->options.level, Z_DEFLATED, -window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+    size_t cap = COMPRESSED_LOG_FRAME_HEADER_LEN + deflateBound(&zs, (uLong)log->tail_len);
+    uint8_t *frame = malloc(cap);
+    if (frame == NULL) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef *)log->tail;
+    zs.avail_in = (uInt)log->tail_len;
+    zs.next_out = frame + COMPRESSED_LOG_FRAME_HEADER_LEN;
+    zs.avail_out = (uInt)(cap - COMPRESSED_LOG_FRAME_HEADER_LEN);
+    int ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END) {
+        free(frame);
+        errno = EIO;
+        return -1;
+    }
+    size_t stored_len = cap - COMPRESSED_LOG_FRAME_HEADER_LEN - zs.avail_out;
+
+    memcpy(frame, FRAME_MAGIC, 4);
+    put_u32(frame + 4, (uint32_t)stored_len);
+    put_u32(frame + 8, (uint32_t)log->tail_len);
+    put_u32(frame + 12, log->tail_lines);
+    put_u32(frame + 16, crc(frame + COMPRESSED_LOG_FRAME_HEADER_LEN, stored_len));
+
+    compressed_log_frame_t f = {
+        .offset = log->tail_offset,
+        .stored_len = (uint32_t)stored_len,
+        .raw_len = (uint32_t)log->tail_len,
+        .first_line = log->line_count - log->tail_lines,
+        .line_count = log->tail_lines,
+        .compressed = 1,
+    };
+    size_t frame_len = COMPRESSED_LOG_FRAME_HEADER_LEN + stored_len;
+    uint64_t end = log->tail_offset + frame_len;
+
+    // The frame is smaller than the tail it replaces (or the tail is left as it is). It is written after the tail
+    // before it is written over it, so that the file is at no point missing lines, and the file is then truncated to
+    // the end of the frame.
+    if (frame_len >= log->tail_len) {
+        free(frame);
+        return 0;
+    }
+    int err = push_frame(&log->frames, &log->frame_count, &log->frame_cap, &f);
+    if (err == 0) {
+        err = pwrite_all(log->fd, frame, frame_len, log->tail_offset + log->tail_len);
+        if (err == 0) {
+            err = pwrite_all(log->fd, frame, frame_len, log->tail_offset);
+        }
+        if (err == 0) {
+            err = ftruncate(log->fd, (off_t)end);
+        }
+        if (err != 0) {
+            // Put the tail back, so that later lines follow it.
+            int saved = errno;
+            log->frame_count--;
+            if (pwrite_all(log->fd, log->tail, log->tail_len, log->tail_offset) == 0) {
+                (void)ftruncate(log->fd, (off_t)(log->tail_offset + log->tail_len));
+            }
+            errno = saved;
+        }
+    }
+    free(frame);
+    if (err != 0) {
+        return -1;
+    }
+
+    log->tail_offset = end;
+    log->tail_len = 0;
+    log->tail_lines = 0;
+    return 0;
+}
+
+static int load(compressed_log_t *log) {
+    struct stat st;
+    if (fstat(log->fd, &st) != 0) {
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    uint8_t *data = malloc(len ? len : 1);
+    if (data == NULL) {
+        return -1;
+    }
+    for (size_t read_len = 0; read_len < len;) {
+        ssize_t n = pread(log->fd, data + read_len, len - read_len, (off_t)read_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(data);
+            errno = n == 0 ? EIO : errno;
+            return -1;
+        }
+        read_len += (size_t)n;
+    }
+
+    uint64_t frames_end;
+    int indexed;
+    if (parse(data, len, &log->frames, &log->frame_count, &log->frame_cap, &frames_end, &indexed) != 0) {
+        free(data);
+        return -1;
+    }
+    for (size_t i = 0; i < log->frame_count; i++) {
+        log->line_count += log->frames[i].line_count;
+    }
+
+    // The index of a file that was rotated but not renamed is dropped, and a seal cut short is either undone or, if
+    // the frame was wholly written, completed. Lines are appended after the rest.
+    size_t tail_len = 0;
+    if (!indexed) {
+        compressed_log_frame_t pending;
+        tail_len = resolve_tail(data, len, log->frames, log->frame_count, frames_end, &pending);
+        if (pending.raw_len > 0) {
+            size_t frame_len = COMPRESSED_LOG_FRAME_HEADER_LEN + pending.stored_len;
+            if (pwrite_all(log->fd, data + pending.offset, frame_len, frames_end) != 0) {
+                free(data);
+                return -1;
+            }
+            pending.offset = frames_end;
+            if (push_frame(&log->frames, &log->frame_count, &log->frame_cap, &pending) != 0) {
+                free(data);
+                return -1;
+            }
+            log->line_count += pending.line_count;
+            frames_end += frame_len;
+        }
+    }
+    const uint8_t *tail = data + frames_end;
+    log->tail_offset = frames_end;
+    if (tail_len != len - frames_end && ftruncate(log->fd, (off_t)(frames_end + tail_len)) != 0) {
+        free(data);
+        return -1;
+    }
+
+    if (reserve_tail(log, tail_len + 1) != 0) {
+        free(data);
+        return -1;
+    }
+    memcpy(log->tail, tail, tail_len);
+    log->tail_len = tail_len;
+    log->tail_lines = (uint32_t)count_lines(tail, tail_len);
+    log->line_count += log->tail_lines;
+    free(data);
+
+    // End a line cut short, so that it doesn't run into the next one.
+    if (tail_len > 0 && log->tail[tail_len - 1] != '\n') {
+        log->tail[log->tail_len++] = '\n';
+        if (pwrite_all(log->fd, "\n", 1, log->tail_offset + tail_len) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// See comment in header
+compressed_log_t * compressed_log_open(const char *path, const char *older_path,
+                                        const compressed_log_options_t *options) {
+    if (path == NULL || older_path == NULL || options == NULL || options->frame_size == 0 ||
+        options->frame_size > COMPRESSED_LOG_MAX_FRAME_SIZE || options->max_file_size == 0 ||
+        options->level < 1 || options->level > 9) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    compressed_log_t *log = calloc(1, sizeof(*log));
+    if (log == NULL) {
+        return NULL;
+    }
+    log->fd = -1;
+    log->options = *options;
+    log->path = strdup(path);
+    log->older_path = strdup(older_path);
+    if (log->path == NULL || log->older_path == NULL) {
+        compressed_log_close(log);
+        return NULL;
+    }
+
+    log->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log->fd < 0 || load(log) != 0) {
+        int saved = errno;
+        compressed_log_close(log);
+        errno = saved;
+        return NULL;
+    }
+    return log;
+}
+
+// Opens a new, empty current file, e.g. again after a rotation that couldn't open it.
+static int open_current(compressed_log_t *log) {
+    if (log->fd >= 0) {
+        return 0;
+    }
+    log->fd = open(log->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return log->fd >= 0 ? 0 : -1;
+}
+
+// See comment in header
+int compressed_log_append(compressed_log_t *log, const char *line, size_t len) {
+    TRACE_SCOPE("compressed_log_append");
+    if (open_current(log) != 0 || reserve_tail(log, log->tail_len + len + 1) != 0) {
+        return -1;
+    }
+
+    // The line and its newline are written at once, at the end of the tail.
+    char *p = log->tail + log->tail_len;
+    memcpy(p, line, len);
+    p[len] = '\n';
+    if (pwrite_all(log->fd, p, len + 1, log->tail_offset + log->tail_len) != 0) {
+        return -1;
+    }
+    log->tail_len += len + 1;
+    log->tail_lines++;
+    log->line_count++;
+
+    if (log->tail_len >= log->options.frame_size && seal(log) != 0) {
+        return -1;
+    }
+    if (compressed_log_size(log) >= log->options.max_file_size) {
+        return compressed_log_rotate(log);
+    }
+    return 0;
+}
+
+// See comment in header
+int compressed_log_flush(compressed_log_t *log) {
+    return seal(log);
+}
+
+// See comment in header
+int compressed_log_rotate(compressed_log_t *log) {
+    if (log->fd < 0) {
+        // The last rotation couldn't open the new file, so there is nothing to rotate.
+        return open_current(log);
+    }
+    if (seal(log) != 0) {
+        return -1;
+    }
+
+    // Unless the tail didn't compress and stays as it is, a rotated file has no tail and is read from its index.
+    if (log->tail_len == 0 && log->frame_count > 0) {
+        size_t index_len = log->frame_count * COMPRESSED_LOG_INDEX_ENTRY_LEN;
+        uint8_t *index = malloc(index_len + COMPRESSED_LOG_FOOTER_LEN);
+        if (index == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < log->frame_count; i++) {
+            const compressed_log_frame_t *f = &log->frames[i];
+            uint8_t *e = index + i * COMPRESSED_LOG_INDEX_ENTRY_LEN;
+            put_u64(e, f->offset);
+            put_u32(e + 8, f->stored_len);
+            put_u32(e + 12, f->raw_len);
+            put_u32(e + 16, f->line_count);
+            put_u32(e + 20, 0);
+        }
+        uint8_t *footer = index + index_len;
+        put_u32(footer, (uint32_t)log->frame_count);
+        put_u32(footer + 4, crc(index, index_len));
+        memcpy(footer + 8, FOOTER_MAGIC, 4);
+        int err = pwrite_all(log->fd, index, index_len + COMPRESSED_LOG_FOOTER_LEN, log->tail_offset);
+        free(index);
+        if (err != 0) {
+            return -1;
+        }
+    }
+
+    if (rename(log->path, log->older_path) != 0) {
+        return -1;
+    }
+
+    // The renamed file is done with whether or not the new one opens, which is otherwise tried again on the next
+    // append: lines mustn't be written over its index.
+    close(log->fd);
+    log->fd = -1;
+    log->frame_count = 0;
+    log->tail_len = 0;
+    log->tail_offset = 0;
+    log->tail_lines = 0;
+    log->line_count = 0;
+    return open_current(log);
+}
+
+// See comment in header
+uint64_t compressed_log_size(const compressed_log_t *log) {
+    return log->tail_offset + log->tail_len;
+}
+
+// See comment in header
+void compressed_log_close(compressed_log_t *log) {
+    if (log == NULL) {
+        return;
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+    }
+    free(log->path);
+    free(log->older_path);
+    free(log->frames);
+    free(log->tail);
+    free(log);
+}
+
+/*** Reader ***/
+
+// Takes ownership of data.
+static compressed_log_reader_t * reader_new(uint8_t *data, size_t len) {
+    compressed_log_reader_t *r = calloc(1, sizeof(*r));
+    if (r == NULL) {
+        free(data);
+        return NULL;
+    }
+    r->data = data;
+    r->len = len;
+
+    size_t cap = 0;
+    uint64_t frames_end;
+    int indexed;
+    if (parse(r->data, len, &r->frames, &r->frame_count, &cap, &frames_end, &indexed) != 0) {
+        compressed_log_reader_free(r);
+        return NULL;
+    }
+
+    const uint8_t *tail = r->data + frames_end;
+    size_t tail_len = 0;
+    if (!indexed) {
+        compressed_log_frame_t pending;
+        tail_len = resolve_tail(r->data, len, r->frames, r->frame_count, frames_end, &pending);
+        if (pending.raw_len > 0 && push_frame(&r->frames, &r->frame_count, &cap, &pending) != 0) {
+            compressed_log_reader_free(r);
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < r->frame_count; i++) {
+        r->frames[i].offset += COMPRESSED_LOG_FRAME_HEADER_LEN;
+        r->line_count += r->frames[i].line_count;
+    }
+    if (tail_len > 0) {
+        compressed_log_frame_t f = {
+            .offset = frames_end,
+            .stored_len = (uint32_t)tail_len,
+            .raw_len = (uint32_t)tail_len,
+            .first_line = (uint32_t)r->line_count,
+            .line_count = (uint32_t)count_lines(tail, tail_len),
+            .compressed = 0,
+        };
+        if (tail_len > COMPRESSED_LOG_MAX_FRAME_SIZE ||
+            push_frame(&r->frames, &r->frame_count, &cap, &f) != 0) {
+            compressed_log_reader_free(r);
+            return NULL;
+        }
+        r->line_count += f.line_count;
+    }
+    return r;
+}
+
+// See comment in header
+compressed_log_reader_t * compressed_log_reader_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t len = (size_t)st.st_size;
+    uint8_t *data = malloc(len ? len : 1);
+    size_t read_len = 0;
+    while (data != NULL && read_len < len) {
+        ssize_t n = read(fd, data + read_len, len - read_len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            // The file is read as it was when it was opened, even if it shrank since.
+            break;
+        }
+        read_len += (size_t)n;
+    }
+    close(fd);
+    return data != NULL ? reader_new(data, read_len) : NULL;
+}
+
+// See comment in header
+compressed_log_reader_t * compressed_log_reader_parse(const void *data, size_t len) {
+    uint8_t *copy = malloc(len ? len : 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, data, len);
+    return reader_new(copy, len);
+}
+
+// See comment in header
+void compressed_log_reader_free(compressed_log_reader_t *r) {
+    if (r == NULL) {
+        return;
+    }
+    free(r->data);
+    free(r->frames);
+    free(r);
+}
+
+// See comment in header
+size_t compressed_log_reader_frame_count(const compressed_log_reader_t *r) {
+    return r->frame_count;
+}
+
+// See comment in header
+const compressed_log_frame_t * compressed_log_reader_frame(const compressed_log_reader_t *r, size_t i) {
+    return i < r->frame_count ? &r->frames[i] : NULL;
+}
+
+// See comment in header
+size_t compressed_log_reader_line_count(const compressed_log_reader_t *r) {
+    return r->line_count;
+}
+
+// See comment in header
+long compressed_log_reader_read(const compressed_log_reader_t *r, size_t i, char *dst, size_t len) {
+    if (i >= r->frame_count || len < r->frames[i].raw_len) {
+        return -1;
+    }
+    const compressed_log_frame_t *f = &r->frames[i];
+    if (!f->compressed) {
+        memcpy(dst, r->data + f->offset, f->raw_len);
+        return (long)f->raw_len;
+    }
+    return inflate_frame(r->data, f, f->offset - COMPRESSED_LOG_FRAME_HEADER_LEN, dst);
+}
+
+// See comment in header
+long compressed_log_reader_tail(const compressed_log_reader_t *r, size_t lines, char **out, size_t *len) {
+    // The last frames that hold the lines.
+    size_t first = r->frame_count;
+    size_t held = 0;
+    size_t raw_len = 0;
+    while (first > 0 && held < lines) {
+        first--;
+        held += r->frames[first].line_count;
+        raw_len += r->frames[first].raw_len;
+    }
+
+    // One more byte, to end an unterminated last line.
+    char *buf = malloc(raw_len + 1);
+    if (buf == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    for (size_t i = first; i < r->frame_count; i++) {
+        long read_len = compressed_log_reader_read(r, i, buf + n, r->frames[i].raw_len);
+        if (read_len < 0) {
+            free(buf);
+            return -1;
+        }
+        n += (size_t)read_len;
+    }
+    if (n > 0 && buf[n - 1] != '\n') {
+        buf[n++] = '\n';
+    }
+
+    // Skip the lines of the first frame that weren't asked for.
+    size_t skip = held > lines ? held - lines : 0;
+    size_t start = 0;
+    for (; skip > 0; skip--) {
+        const char *nl = memchr(buf + start, '\n', n - start);
+        if (nl == NULL) {
+            break;
+        }
+        start = (size_t)(nl - buf) + 1;
+    }
+    memmove(buf, buf + start, n - start);
+    *out = buf;
+    *len = n - start;
+    return (long)(held < lines ? held : lines);
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CompressedLog_h
+#define CompressedLog_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Seekable compressed rotating log files, for the notices files of PsiFeedbackLogger: the same
+ * JSON lines, with the rotation budget applying to compressed bytes.
+ *
+ * Lines are appended uncompressed after the last frame, one write per line as before, so a line
+ * written is in the file even if the process is killed right after. Once the uncompressed tail
+ * reaches the frame size it is deflated into a frame that replaces it: the frame is written after
+ * the tail, then over it, and the file is truncated to its end. Each frame is a raw deflate stream
+ * of whole lines that can be inflated on its own, so readers decompress only the frames they need,
+ * e.g. the last one or two for a tail view.
+ *
+ * When the file reaches the size limit it is rotated: the tail is deflated into a last frame, a
+ * frame index is appended, and the file is renamed to the older path, replacing it. Readers find the
+ * frames of a rotated file from its index, and those of the current file by following the frame
+ * headers from the start.
+ *
+ * File layout (all integers little-endian):
+ *
+ *   frame:   "PSLF" | u32 compressed length | u32 raw length | u32 line count | u32 CRC-32 of the
+ *            compressed data | raw deflate data
+ *   ...
+ *   tail:    uncompressed lines, in the current file
+ *   index:   n x { u64 frame offset | u32 compressed length | u32 raw length | u32 line count |
+ *                  u32 reserved }, in a rotated file
+ *   footer:  u32 frame count | u32 CRC-32 of the index | "PSLI"
+ *
+ * A notices file written before this format, of lines only, reads as a file that is all tail, and
+ * is deflated into frames as lines are appended to it. If the process is killed while a frame is
+ * written, the lines are whole in the tail or in the frame after it, and are read from there; the
+ * next open completes or undoes the frame. A frame damaged otherwise fails its CRC, and from there
+ * the file reads as tail: the damaged bytes become a malformed line that readers of notices skip.
+ */
+
+#define COMPRESSED_LOG_FRAME_HEADER_LEN 20
+#define COMPRESSED_LOG_INDEX_ENTRY_LEN 24
+#define COMPRESSED_LOG_FOOTER_LEN 12
+
+// Default uncompressed bytes per frame.
+#define COMPRESSED_LOG_FRAME_SIZE (16 * 1024)
+
+// Largest frame size accepted, in the options and in files read.
+#define COMPRESSED_LOG_MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+/*!
+ * @brief Options of a log.
+ */
+typedef struct {
+    size_t frame_size;      // Uncompressed bytes per frame, e.g. COMPRESSED_LOG_FRAME_SIZE.
+    size_t max_file_size;   // Size in bytes, frames and tail, at which the file is rotated.
+    int level;              // zlib compression level, 1 to 9.
+} compressed_log_options_t;
+
+typedef struct compressed_log compressed_log_t;
+
+/*!
+ * @brief Opens a log for appending, creating the file if it doesn't exist.
+ *
+ * Only one log may be open for a file at a time.
+ *
+ * @param path The current file, e.g. ".../rotating_notices".
+ * @param older_path The file it is rotated to, e.g. ".../rotating_notices.1".
+ * @return Log, or NULL if the file can't be opened or read (errno is set), the options are invalid
+ *         (errno is EINVAL), or allocation failed.
+ */
+compressed_log_t * compressed_log_open(const char *path, const char *older_path,
+                                        const compressed_log_options_t *options);
+
+/*!
+ * @brief Appends a line. A newline is added.
+ *
+ * Deflates the tail into a frame if it has reached the frame size, then rotates the file if it has
+ * reached the size limit.
+ *
+ * @param line The line, without a newline.
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int compressed_log_append(compressed_log_t *log, const char *line, size_t len);
+
+/*!
+ * @brief Deflates the tail into a frame now, whatever its size, e.g. before the process is suspended.
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int compressed_log_flush(compressed_log_t *log);
+
+/*!
+ * @brief Rotates the file now.
+ * @return 0 on success, -1 on error (errno is set).
+ */
+int compressed_log_rotate(compressed_log_t *log);
+
+/*!
+ * @brief Current size of the file in bytes.
+ */
+uint64_t compressed_log_size(const compressed_log_t *log);
+
+void compressed_log_close(compressed_log_t *log);
+
+/*!
+ * @brief A frame of a log file, or its uncompressed tail.
+ */
+typedef struct {
+    uint64_t offset;            // Offset of the frame's data, or of the tail, in the file.
+    uint32_t stored_len;        // Bytes in the file.
+    uint32_t raw_len;           // Bytes once inflated.
+    uint32_t first_line;        // Index of the frame's first line in the file.
+    uint32_t line_count;
+    int compressed;             // 0 for the tail.
+} compressed_log_frame_t;
+
+typedef struct compressed_log_reader compressed_log_reader_t;
+
+/*!
+ * @brief Opens a log file for reading, as it is at the time of the call.
+ *
+ * The file is read into memory, which costs less than inflating it, and isn't affected by the
+ * writer afterwards.
+ *
+ * @return Reader, or NULL if the file can't be read (errno is set) or allocation failed.
+ */
+compressed_log_reader_t * compressed_log_reader_open(const char *path);
+
+/*!
+ * @brief Reads a log file from memory. The data is copied.
+ * @return Reader, or NULL if allocation failed.
+ */
+compressed_log_reader_t * compressed_log_reader_parse(const void *data, size_t len);
+
+void compressed_log_reader_free(compressed_log_reader_t *r);
+
+/*!
+ * @brief Number of frames, including the tail if it isn't empty.
+ */
+size_t compressed_log_reader_frame_count(const compressed_log_reader_t *r);
+
+/*!
+ * @brief A frame, or NULL if i is out of range. Valid for the lifetime of the reader.
+ */
+const compressed_log_frame_t * compressed_log_reader_frame(const compressed_log_reader_t *r, size_t i);
+
+/*!
+ * @brief Number of lines in the file.
+ */
+size_t compressed_log_reader_line_count(const compressed_log_reader_t *r);
+
+/*!
+ * @brief Inflates a frame.
+ *
+ * @param dst Buffer of at least the frame's raw_len bytes.
+ * @return Number of bytes written, or -1 if i is out of range, dst is too small or the frame is corrupt.
+ */
+long compressed_log_reader_read(const compressed_log_reader_t *r, size_t i, char *dst, size_t len);
+
+/*!
+ * @brief Reads the last lines of the file, inflating only the frames that hold them.
+ *
+ * @param lines Number of lines to read, or more for all of them.
+ * @param out Populated with the lines, each followed by a newline. Caller must free.
+ * @param len Populated with the length of out.
+ * @return Number of lines read, or -1 if a frame is corrupt or allocation failed.
+ */
+long compressed_log_reader_tail(const compressed_log_reader_t *r, size_t lines, char **out, size_t *len);
+
+#endif /* CompressedLog_h */
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "EgressRegionSet.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WORDS (EGRESS_REGION_INDEX_COUNT / 64)
+
+// Number of two letter codes, the most regions a source can have.
+#define MAX_REGIONS (26 * 26)
+
+#define SERIALIZED_MAGIC "PSER"
+#define SERIALIZED_VERSION 1
+#define SERIALIZED_HEADER_LEN 8
+
+typedef struct {
+    egress_region_bitmap_t present;
+    uint16_t order[MAX_REGIONS];
+    uint16_t count;
+} source_t;
+
+struct egress_region_set {
+    source_t sources[EGRESS_REGION_SOURCES];
+};
+
+/*** Region codes ***/
+
+// See comment in header
+int egress_region_index(const char *code) {
+    if (code == NULL || code[0] < 'A' || code[0] > 'Z' || code[1] < 'A' || code[1] > 'Z') {
+        return -1;
+    }
+    return (code[0] - 'A') * 26 + (code[1] - 'A');
+}
+
+// See comment in header
+int egress_region_code(int index, char code[3]) {
+    if (index < 0 || index >= MAX_REGIONS) {
+        return -1;
+    }
+    code[0] = (char)('A' + index / 26);
+    code[1] = (char)('A' + index % 26);
+    code[2] = '\0';
+    return 0;
+}
+
+/*** Set ***/
+
+// Index of a NUL-terminated region code, or -1.
+static int code_index(const char *code) {
+    int index = egress_region_index(code);
+    return (index >= 0 && code[2] == '\0') ? index : -1;
+}
+
+static inline int has(const egress_region_bitmap_t *b, int index) {
+    return (b->words[index / 64] >> (index % 64)) & 1;
+}
+
+static int add_index(source_t *src, int index) {
+    if (has(&src->present, index)) {
+        return 0;
+    }
+    src->present.words[index / 64] |= UINT64_C(1) << (index % 64);
+    src->order[src->count++] = (uint16_t)index;
+    return 1;
+}
+
+// See comment in header
+egress_region_set_t * egress_region_set_new(void) {
+    return calloc(1, sizeof(egress_region_set_t));
+}
+
+// See comment in header
+void egress_region_set_free(egress_region_set_t *s) {
+    free(s);
+}
+
+// See comment in header
+int egress_region_set_replace(egress_region_set_t *s, int source, const char *const *codes, size_t count) {
+    if (source < 0 || source >= EGRESS_REGION_SOURCES) {
+        return -1;
+    }
+    source_t *src = &s->sources[source];
+    memset(&src->present, 0, sizeof(src->present));
+    src->count = 0;
+    for (size_t i = 0; i < count; i++) {
+        int index = code_index(codes[i]);
+        if (index >= 0) {
+            add_index(src, index);
+        }
+    }
+    return src->count;
+}
+
+// See comment in header
+int egress_region_set_add(egress_region_set_t *s, int source, const char *code) {
+    int index = code_index(code);
+    if (source < 0 || source >= EGRESS_REGION_SOURCES || index < 0) {
+        return -1;
+    }
+    return add_index(&s->sources[source], index);
+}
+
+// See comment in header
+int egress_region_set_contains(const egress_region_set_t *s, unsigned source_mask, const char *code) {
+    int index = code_index(code);
+    if (index < 0) {
+        return 0;
+    }
+    for (int i = 0; i < EGRESS_REGION_SOURCES; i++) {
+        if ((source_mask & (1u << i)) && has(&s->sources[i].present, index)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// See comment in header
+void egress_region_set_union(const egress_region_set_t *s, unsigned source_mask, egress_region_bitmap_t *bitmap) {
+    memset(bitmap, 0, sizeof(*bitmap));
+    for (int i = 0; i < EGRESS_REGION_SOURCES; i++) {
+        if (source_mask & (1u << i)) {
+            for (int w = 0; w < WORDS; w++) {
+                bitmap->words[w] |= s->sources[i].present.words[w];
+            }
+        }
+    }
+}
+
+// See comment in header
+size_t egress_region_set_count(const egress_region_set_t *s, unsigned source_mask) {
+    egress_region_bitmap_t bitmap;
+    egress_region_set_union(s, source_mask, &bitmap);
+    size_t count = 0;
+    for (int w = 0; w < WORDS; w++) {
+        count += (size_t)__builtin_popcountll(bitmap.words[w]);
+    }
+    return count;
+}
+
+// See comment in header
+size_t egress_region_set_merged(const egress_region_set_t *s, unsigned source_mask, uint16_t *indices, size_t max) {
+    // Regions of earlier sources, to skip in later ones.
+    egress_region_bitmap_t seen;
+    memset(&seen, 0, sizeof(seen));
+    size_t n = 0;
+    for (int i = 0; i < EGRESS_REGION_SOURCES; i++) {
+        if (!(source_mask & (1u << i))) {
+            continue;
+        }
+        const source_t *src = &s->sources[i];
+        for (uint16_t j = 0; j < src->count; j++) {
+            uint16_t index = src->order[j];
+            if (has(&seen, index)) {
+                continue;
+            }
+            if (n < max) {
+                indices[n] = index;
+            }
+            n++;
+        }
+        for (int w = 0; w < WORDS; w++) {
+            seen.words[w] |= src->present.words[w];
+        }
+    }
+    return n;
+}
+
+/*** Serialization ***/
+
+/*
+ * Format, little-endian:
+ *   "PSER" | u8 version | u8 source count | 2 reserved bytes
+ *   per source: u16 count | count * u16 region index, in order
+ */
+
+// See comment in header
+uint8_t * egress_region_set_serialize(const egress_region_set_t *s, size_t *len) {
+    size_t total = SERIALIZED_HEADER_LEN;
+    for (int i = 0; i < EGRESS_REGION_SOURCES; i++) {
+        total += 2 + 2 * (size_t)s->sources[i].count;
+    }
+
+    uint8_t *buf = malloc(total);
+    if (buf == NULL) {
+        return NULL;
+    }
+    memcpy(buf, SERIALIZED_MAGIC, 4);
+    buf[4] = SERIALIZED_VERSION;
+    buf[5] = EGRESS_REGION_SOURCES;
+    buf[6] = buf[7] = 0;
+
+    uint8_t *p = buf + SERIALIZED_HEADER_LEN;
+    for (int i = 0; i < EGRESS_REGION_SOURCES; i++) {
+        const source_t *src = &s->sources[i];
+        p[0] = (uint8_t)src->count;
+        p[1] = (uint8_t)(src->count >> 8);
+        p += 2;
+        for (uint16_t j = 0; j < src->count; j++) {
+            p[0] = (uint8_t)src->order[j];
+            p[1] = (uint8_t)(src->order[j] >> 8);
+            p += 2;
+        }
+    }
+    *len = total;
+    return buf;
+}
+
+// See comment in header
+egress_region_set_t * egress_region_set_deserialize(const uint8_t *buf, size_t len) {
+    if (len < SERIALIZED_HEADER_LEN || memcmp(buf, SERIALIZED_MAGIC, 4) != 0 || buf[4] != SERIALIZED_VERSION ||
+        buf[5] > EGRESS_REGION_SOURCES) {
+        return NULL;
+    }
+    egress_region_set_t *s = egress_region_set_new();
+    if (s == NULL) {
+        return NULL;
+    }
+
+    const uint8_t *p = buf + SERIALIZED_HEADER_LEN, *end = buf + len;
+    for (int i = 0; i < buf[5]; i++) {
+        if (end - p < 2) {
+            goto fail;
+        }
+        size_t count = (size_t)p[0] | (size_t)p[1] << 8;
+        p += 2;
+        if (count > MAX_REGIONS || (size_t)(end - p) < 2 * count) {
+            goto fail;
+        }
+        for (size_t j = 0; j < count; j++, p += 2) {
+            int index = p[0] | p[1] << 8;
+            if (index >= MAX_REGIONS || add_index(&s->sources[i], index) == 0) {
+                goto fail;
+            }
+        }
+    }
+    if (p != end) {
+        goto fail;
+    }
+    return s;
+
+fail:
+    egress_region_set_free(s);
+    return NULL;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef EgressRegionSet_h
+#define EgressRegionSet_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Egress regions known to the app, by source: the regions emitted by tunnel-core through
+ * onAvailableEgressRegions:, and the regions of the embedded server entries.
+ *
+ * A region code is two uppercase letters, which map to a perfect index in [0, 1024) ("AA" is 0,
+ * "ZZ" is 675). Each source keeps a 1024-bit presence bitmap and its regions in insertion order,
+ * so membership is O(1), merging sources is an OR of 16 words, and the merged regions are
+ * listed in a stable order in O(k): the first source's regions in its order, then the regions
+ * of the next source that aren't already listed, and so on, as embeddedAndEmittedEgressRegions does
+ * with an ordered set.
+ *
+ * The set serializes to a few hundred bytes, for passing between the extension and the container.
+ */
+
+// Number of distinct region indices.
+#define EGRESS_REGION_INDEX_COUNT 1024
+
+// Number of sources.
+#define EGRESS_REGION_SOURCES 4
+
+#define EGRESS_REGION_SOURCE_EMITTED 0
+#define EGRESS_REGION_SOURCE_EMBEDDED 1
+
+// Source mask of every source.
+#define EGRESS_REGION_ALL_SOURCES ((1u << EGRESS_REGION_SOURCES) - 1)
+
+/*!
+ * @brief Presence bitmap over region indices.
+ */
+typedef struct {
+    uint64_t words[EGRESS_REGION_INDEX_COUNT / 64];
+} egress_region_bitmap_t;
+
+typedef struct egress_region_set egress_region_set_t;
+
+/*!
+ * @brief Index of a region code.
+ * @param code Two uppercase letters, e.g. "US", not necessarily NUL-terminated after them.
+ * @return Index, or -1 if code isn't a region code.
+ */
+int egress_region_index(const char *code);
+
+/*!
+ * @brief Region code of an index, NUL-terminated.
+ * @return 0 on success, -1 if index isn't the index of a region code.
+ */
+int egress_region_code(int index, char code[3]);
+
+/*!
+ * @brief Creates an empty set.
+ * @return Set, or NULL if allocation failed.
+ */
+egress_region_set_t * egress_region_set_new(void);
+
+void egress_region_set_free(egress_region_set_t *s);
+
+/*!
+ * @brief Replaces the regions of a source, keeping their order. Duplicates and invalid codes are skipped.
+ * @return Number of regions in the source, or -1 if source is out of range.
+ */
+int egress_region_set_replace(egress_region_set_t *s, int source, const char *const *codes, size_t count);
+
+/*!
+ * @brief Appends a region to a source, if it isn't there already.
+ * @return 1 if added, 0 if already present, -1 if the code or source is invalid.
+ */
+int egress_region_set_add(egress_region_set_t *s, int source, const char *code);
+
+/*!
+ * @brief Whether any of the sources in source_mask has the region.
+ */
+int egress_region_set_contains(const egress_region_set_t *s, unsigned source_mask, const char *code);
+
+/*!
+ * @brief Union of the sources in source_mask.
+ */
+void egress_region_set_union(const egress_region_set_t *s, unsigned source_mask, egress_region_bitmap_t *bitmap);
+
+/*!
+ * @brief Number of distinct regions in the sources in source_mask.
+ */
+size_t egress_region_set_count(const egress_region_set_t *s, unsigned source_mask);
+
+/*!
+ * @brief Lists the distinct regions of the sources in source_mask in stable order: by source,
+ *        then in the order they were added to the source.
+ *
+ * @param indices Populated with region indices, up to max. May be NULL if max is 0.
+ * @return Number of distinct regions, which may exceed max.
+ */
+size_t egress_region_set_merged(const egress_region_set_t *s, unsigned source_mask, uint16_t *indices, size_t max);
+
+/*!
+ * @brief Serializes the set.
+ * @param len Populated with the length of the returned buffer.
+ * @return Buffer to be freed by the caller, or NULL if allocation failed.
+ */
+uint8_t * egress_region_set_serialize(const egress_region_set_t *s, size_t *len);
+
+/*!
+ * @brief Creates a set from serialized data.
+ * @return Set, or NULL if the data is malformed or allocation failed.
+ */
+egress_region_set_t * egress_region_set_deserialize(const uint8_t *buf, size_t len);
+
+#endif /* EgressRegionSet_h */
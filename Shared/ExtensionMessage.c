@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ExtensionMessage.h"
+#include <string.h>
+
+#define FIELD_COUNT 9
+#define MAX_VARINT_LEN 10
+
+typedef enum {
+    VALUE_NONE = 0,
+    VALUE_BOOL,
+    VALUE_UINT,
+    VALUE_STRING,
+    VALUE_LIST,
+} value_type_t;
+
+static const value_type_t field_types[FIELD_COUNT] = {
+    [EXTENSION_FIELD_PROVIDER_ZOMBIE] = VALUE_BOOL,
+    [EXTENSION_FIELD_TUNNEL_CONNECTED] = VALUE_BOOL,
+    [EXTENSION_FIELD_CLIENT_REGION] = VALUE_STRING,
+    [EXTENSION_FIELD_SPONSOR_ID] = VALUE_STRING,
+    [EXTENSION_FIELD_SERVER_TIMESTAMP] = VALUE_STRING,
+    [EXTENSION_FIELD_JETSAM_COUNT] = VALUE_UINT,
+    [EXTENSION_FIELD_MARKED_AUTHORIZATIONS] = VALUE_LIST,
+    [EXTENSION_FIELD_EGRESS_REGIONS] = VALUE_LIST,
+};
+
+/*** Encoding ***/
+
+typedef struct {
+    uint8_t *p;
+    uint8_t *end;
+    bool overflow;
+} writer_t;
+
+static void put(writer_t *w, const void *data, size_t len) {
+    if (w->overflow || (size_t)(w->end - w->p) < len) {
+        w->overflow = true;
+        return;
+    }
+    memcpy(w->p, data, len);
+    w->p += len;
+}
+
+static void put_byte(writer_t *w, uint8_t b) {
+    put(w, &b, 1);
+}
+
+static size_t varint_len(uint64_t v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+static void put_varint(writer_t *w, uint64_t v) {
+    uint8_t buf[MAX_VARINT_LEN];
+    size_t n = 0;
+    while (v >= 0x80) {
+        buf[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    buf[n++] = (uint8_t)v;
+    put(w, buf, n);
+}
+
+static void put_header(writer_t *w, extension_message_kind_t kind) {
+    const uint8_t header[EXTENSION_MESSAGE_HEADER_LEN] = { EXTENSION_MESSAGE_MAGIC, EXTENSION_MESSAGE_VERSION, kind };
+    put(w, header, sizeof(header));
+}
+
+static void put_string(writer_t *w, uint8_t field, const extension_message_string_t *s) {
+    put_byte(w, field);
+    put_varint(w, s->len);
+    put(w, s->p, s->len);
+}
+
+static void put_list(writer_t *w, uint8_t field, const extension_message_list_t *list) {
+    size_t len = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        len += varint_len(list->items[i].len) + list->items[i].len;
+    }
+    put_byte(w, field);
+    put_varint(w, len);
+    for (size_t i = 0; i < list->count; i++) {
+        put_varint(w, list->items[i].len);
+        put(w, list->items[i].p, list->items[i].len);
+    }
+}
+
+// See comment in header
+long extension_request_encode(uint32_t fields, uint8_t *dst, size_t dst_len) {
+    fields &= EXTENSION_FIELDS_ALL;
+    if (fields == 0) {
+        return -1;
+    }
+    writer_t w = { dst, dst + dst_len, false };
+    put_header(&w, EXTENSION_MESSAGE_REQUEST);
+    for (uint8_t field = 1; field < FIELD_COUNT; field++) {
+        if (fields & EXTENSION_FIELD_BIT(field)) {
+            const uint8_t tlv[2] = { field, 0 };
+            put(&w, tlv, sizeof(tlv));
+        }
+    }
+    return w.overflow ? -1 : (long)(w.p - dst);
+}
+
+// See comment in header
+long extension_response_encode(const extension_status_t *status, uint32_t fields, uint8_t *dst, size_t dst_len) {
+    writer_t w = { dst, dst + dst_len, false };
+    fields &= status->fields & EXTENSION_FIELDS_ALL;
+    if (status->marked_authorizations.count > EXTENSION_MESSAGE_MAX_LIST ||
+        status->egress_regions.count > EXTENSION_MESSAGE_MAX_LIST) {
+        return -1;
+    }
+    put_header(&w, EXTENSION_MESSAGE_RESPONSE);
+    for (uint8_t field = 1; field < FIELD_COUNT; field++) {
+        if (!(fields & EXTENSION_FIELD_BIT(field))) {
+            continue;
+        }
+        switch ((extension_field_t)field) {
+        case EXTENSION_FIELD_PROVIDER_ZOMBIE:
+        case EXTENSION_FIELD_TUNNEL_CONNECTED: {
+            bool value = field == EXTENSION_FIELD_PROVIDER_ZOMBIE ? status->provider_zombie : status->tunnel_connected;
+            const uint8_t tlv[3] = { field, 1, value };
+            put(&w, tlv, sizeof(tlv));
+            break;
+        }
+        case EXTENSION_FIELD_CLIENT_REGION:
+            put_string(&w, field, &status->client_region);
+            break;
+        case EXTENSION_FIELD_SPONSOR_ID:
+            put_string(&w, field, &status->sponsor_id);
+            break;
+        case EXTENSION_FIELD_SERVER_TIMESTAMP:
+            put_string(&w, field, &status->server_timestamp);
+            break;
+        case EXTENSION_FIELD_JETSAM_COUNT:
+            put_byte(&w, field);
+            put_varint(&w, varint_len(status->jetsam_count));
+            put_varint(&w, status->jetsam_count);
+            break;
+        case EXTENSION_FIELD_MARKED_AUTHORIZATIONS:
+            put_list(&w, field, &status->marked_authorizations);
+            break;
+        case EXTENSION_FIELD_EGRESS_REGIONS:
+            put_list(&w, field, &status->egress_regions);
+            break;
+        }
+    }
+    return w.overflow ? -1 : (long)(w.p - dst);
+}
+
+/*** Decoding ***/
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} reader_t;
+
+// Reads a minimally encoded varint.
+static int get_varint(reader_t *r, uint64_t *v) {
+    uint64_t value = 0;
+    for (int i = 0; i < MAX_VARINT_LEN && r->p < r->end; i++) {
+        uint8_t b = *r->p++;
+        if (i == MAX_VARINT_LEN - 1 && b > 1) {
+            return -1;
+        }
+        value |= (uint64_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            if (b == 0 && i > 0) {
+                return -1;
+            }
+            *v = value;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Reads the next TLV, setting value to its contents.
+static int get_tlv(reader_t *r, uint8_t *field, reader_t *value) {
+    uint64_t len;
+    if (r->p == r->end) {
+        return -1;
+    }
+    *field = *r->p++;
+    if (get_varint(r, &len) != 0 || len > (uint64_t)(r->end - r->p)) {
+        return -1;
+    }
+    value->p = r->p;
+    value->end = r->p + len;
+    r->p += len;
+    return 0;
+}
+
+static int get_header(reader_t *r, extension_message_kind_t kind) {
+    if (r->end - r->p < EXTENSION_MESSAGE_HEADER_LEN || r->p[0] != EXTENSION_MESSAGE_MAGIC ||
+        r->p[1] != EXTENSION_MESSAGE_VERSION || r->p[2] != kind) {
+        return -1;
+    }
+    r->p += EXTENSION_MESSAGE_HEADER_LEN;
+    return 0;
+}
+
+static int get_list(reader_t *value, extension_message_list_t *list) {
+    list->count = 0;
+    while (value->p < value->end) {
+        uint64_t len;
+        if (list->count == EXTENSION_MESSAGE_MAX_LIST || get_varint(value, &len) != 0 ||
+            len > (uint64_t)(value->end - value->p)) {
+            return -1;
+        }
+        list->items[list->count++] = (extension_message_string_t){ (const char *)value->p, (size_t)len };
+        value->p += len;
+    }
+    return 0;
+}
+
+// See comment in header
+bool extension_message_is_binary(const void *data, size_t len) {
+    return len > 0 && *(const uint8_t *)data == EXTENSION_MESSAGE_MAGIC;
+}
+
+// See comment in header
+int extension_request_decode(const uint8_t *data, size_t len, uint32_t *fields) {
+    reader_t r = { data, data + len };
+    if (get_header(&r, EXTENSION_MESSAGE_REQUEST) != 0) {
+        return -1;
+    }
+    uint32_t requested = 0;
+    while (r.p < r.end) {
+        uint8_t field;
+        reader_t value;
+        if (get_tlv(&r, &field, &value) != 0) {
+            return -1;
+        }
+        if (field < FIELD_COUNT && field_types[field] != VALUE_NONE) {
+            requested |= EXTENSION_FIELD_BIT(field);
+        }
+    }
+    *fields = requested;
+    return 0;
+}
+
+// See comment in header
+int extension_response_decode(const uint8_t *data, size_t len, extension_status_t *status) {
+    reader_t r = { data, data + len };
+    if (get_header(&r, EXTENSION_MESSAGE_RESPONSE) != 0) {
+        return -1;
+    }
+    status->fields = 0;
+    while (r.p < r.end) {
+        uint8_t field;
+        reader_t value;
+        if (get_tlv(&r, &field, &value) != 0) {
+            return -1;
+        }
+        if (field >= FIELD_COUNT || field_types[field] == VALUE_NONE) {
+            continue;
+        }
+        if (status->fields & EXTENSION_FIELD_BIT(field)) {
+            return -1;
+        }
+        status->fields |= EXTENSION_FIELD_BIT(field);
+
+        extension_message_string_t s = { (const char *)value.p, (size_t)(value.end - value.p) };
+        switch ((extension_field_t)field) {
+        case EXTENSION_FIELD_PROVIDER_ZOMBIE:
+        case EXTENSION_FIELD_TUNNEL_CONNECTED:
+            if (s.len != 1 || value.p[0] > 1) {
+                return -1;
+            }
+            *(field == EXTENSION_FIELD_PROVIDER_ZOMBIE ? &status->provider_zombie : &status->tunnel_connected) =
+                value.p[0];
+            break;
+        case EXTENSION_FIELD_CLIENT_REGION:
+            status->client_region = s;
+            break;
+        case EXTENSION_FIELD_SPONSOR_ID:
+            status->sponsor_id = s;
+            break;
+        case EXTENSION_FIELD_SERVER_TIMESTAMP:
+            status->server_timestamp = s;
+            break;
+        case EXTENSION_FIELD_JETSAM_COUNT:
+            if (get_varint(&value, &status->jetsam_count) != 0 || value.p != value.end) {
+                return -1;
+            }
+            break;
+        case EXTENSION_FIELD_MARKED_AUTHORIZATIONS:
+            if (get_list(&value, &status->marked_authorizations) != 0) {
+                return -1;
+            }
+            break;
+        case EXTENSION_FIELD_EGRESS_REGIONS:
+            if (get_list(&value, &status->egress_regions) != 0) {
+                return -1;
+            }
+            break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ExtensionMessage_h
+#define ExtensionMessage_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary provider messages between the container and the network extension: a request listing the
+ * fields the container wants, and a status snapshot response with those fields, so that one
+ * sendProviderMessage: round trip answers what otherwise takes a query per field (see NEBridge.h)
+ * plus reads of the shared defaults.
+ *
+ * A message is a 3-byte header, EXTENSION_MESSAGE_MAGIC, the version and the kind, followed by
+ * TLVs: a field ID byte, the value's length as a LEB128 varint, then the value. Requests carry one
+ * empty TLV per requested field. Responses carry one TLV per field, whose value is:
+ *
+ *   bool:          1 byte, 0 or 1
+ *   uint:          LEB128 varint
+ *   string:        the UTF-8 bytes
+ *   string list:   each string's length as a varint, then its bytes
+ *
+ * The magic byte can't start a UTF-8 string, so the extension can tell binary messages from the
+ * string queries of older containers. Decoders skip fields they don't know, so fields can be added
+ * without a new version; the version changes only if the framing does.
+ *
+ * Nothing is allocated: decoded strings point into the message.
+ */
+
+#define EXTENSION_MESSAGE_MAGIC 0xB5
+#define EXTENSION_MESSAGE_VERSION 1
+#define EXTENSION_MESSAGE_HEADER_LEN 3
+
+// Maximum number of strings in a decoded string list.
+#define EXTENSION_MESSAGE_MAX_LIST 64
+
+typedef enum {
+    EXTENSION_MESSAGE_REQUEST = 1,
+    EXTENSION_MESSAGE_RESPONSE = 2,
+} extension_message_kind_t;
+
+typedef enum {
+    EXTENSION_FIELD_PROVIDER_ZOMBIE = 1,        // bool, isProviderZombie
+    EXTENSION_FIELD_TUNNEL_CONNECTED = 2,       // bool, isTunnelConnected
+    EXTENSION_FIELD_CLIENT_REGION = 3,          // string
+    EXTENSION_FIELD_SPONSOR_ID = 4,             // string
+    EXTENSION_FIELD_SERVER_TIMESTAMP = 5,       // string, RFC 3339
+    EXTENSION_FIELD_JETSAM_COUNT = 6,           // uint
+    EXTENSION_FIELD_MARKED_AUTHORIZATIONS = 7,  // string list, IDs of authorizations marked as expired
+    EXTENSION_FIELD_EGRESS_REGIONS = 8,         // string list, regions emitted by tunnel-core
+} extension_field_t;
+
+#define EXTENSION_FIELD_BIT(field) (1u << (field))
+
+// Every field of the snapshot.
+#define EXTENSION_FIELDS_ALL 0x1feu
+
+typedef struct {
+    const char *p;
+    size_t len;
+} extension_message_string_t;
+
+typedef struct {
+    extension_message_string_t items[EXTENSION_MESSAGE_MAX_LIST];
+    size_t count;
+} extension_message_list_t;
+
+/*!
+ * @brief Tunnel state fields. Only the fields whose bits are set in fields are meaningful.
+ */
+typedef struct {
+    uint32_t fields;            // EXTENSION_FIELD_BIT of each field present.
+    bool provider_zombie;
+    bool tunnel_connected;
+    extension_message_string_t client_region;
+    extension_message_string_t sponsor_id;
+    extension_message_string_t server_timestamp;
+    uint64_t jetsam_count;
+    extension_message_list_t marked_authorizations;
+    extension_message_list_t egress_regions;
+} extension_status_t;
+
+/*!
+ * @brief Checks whether data starts like a binary message, rather than a string query.
+ */
+bool extension_message_is_binary(const void *data, size_t len);
+
+/*!
+ * @brief Encodes a request for fields.
+ * @return Length of the message, or -1 if fields has no known field or dst is too small.
+ */
+long extension_request_encode(uint32_t fields, uint8_t *dst, size_t dst_len);
+
+/*!
+ * @brief Decodes a request.
+ * @param fields Set to the known fields requested.
+ * @return 0 on success, -1 if the message is malformed or of another version or kind.
+ */
+int extension_request_decode(const uint8_t *data, size_t len, uint32_t *fields);
+
+/*!
+ * @brief Encodes a response with the requested fields that the status has.
+ * @return Length of the message, or -1 if dst is too small or a list has more than EXTENSION_MESSAGE_MAX_LIST strings.
+ */
+long extension_response_encode(const extension_status_t *status, uint32_t fields, uint8_t *dst, size_t dst_len);
+
+/*!
+ * @brief Decodes a response. Unknown fields are skipped.
+ * @return 0 on success, -1 if the message is malformed, repeats a field, or is of another version or kind.
+ */
+int extension_response_decode(const uint8_t *data, size_t len, extension_status_t *status);
+
+#endif /* ExtensionMessage_h */
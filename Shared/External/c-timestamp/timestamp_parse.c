@@ -25,6 +25,11 @@
  */
 #include <stddef.h>
 #include "timestamp.h"
+#ifdef PSIPHON_TRACE
+#include "Trace.h"
+#else
+#define TRACE_SCOPE(name) do {} while (0)
+#endif
 
 static int
 leap_year(uint16_t y) {
@@ -77,6 +82,7 @@ timestamp_parse(const char *str, size_t len, timestamp_t *tsp) {
     uint16_t year, month, day, hour, min, sec;
     uint32_t rdn, sod, nsec;
     int16_t offset;
+    TRACE_SCOPE("timestamp_parse");
 
     /*
      *           1
@@ -0,0 +1,693 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "JSONPath.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(JSON_PATH_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2 1
+#elif !defined(JSON_PATH_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#endif
+
+#define BLOCK 64
+#define MAX_NODES (JSON_PATH_MAX_PATHS * JSON_PATH_MAX_DEPTH + 1)
+#define MAX_KEYS_LEN 1024
+
+// Node of the trie of path keys. Node 0 is the root, i.e. the top level object.
+typedef struct {
+    uint16_t key;               // Offset of the key in keys.
+    uint16_t key_len;
+    int16_t first_child;
+    int16_t next_sibling;
+    int16_t path;               // Index of the path ending at this node, or -1.
+} node_t;
+
+struct json_path_set {
+    int flags;
+    size_t path_count;
+    size_t node_count;
+    node_t nodes[MAX_NODES];
+    char keys[MAX_KEYS_LEN];
+    size_t keys_len;
+};
+
+/*** Path sets ***/
+
+static int16_t find_child(const json_path_set_t *set, int16_t parent, const char *key, size_t len) {
+    for (int16_t i = set->nodes[parent].first_child; i >= 0; i = set->nodes[i].next_sibling) {
+        const node_t *n = &set->nodes[i];
+        if (n->key_len == len && memcmp(set->keys + n->key, key, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int16_t add_child(json_path_set_t *set, int16_t parent, const char *key, size_t len) {
+    if (set->node_count >= MAX_NODES || set->keys_len + len > MAX_KEYS_LEN) {
+        return -1;
+    }
+    int16_t i = (int16_t)set->node_count++;
+    node_t *n = &set->nodes[i];
+    memcpy(set->keys + set->keys_len, key, len);
+    n->key = (uint16_t)set->keys_len;
+    n->key_len = (uint16_t)len;
+    set->keys_len += len;
+    n->first_child = -1;
+    n->path = -1;
+    n->next_sibling = set->nodes[parent].first_child;
+    set->nodes[parent].first_child = i;
+    return i;
+}
+
+// See comment in header
+json_path_set_t * json_path_set_new(const char *const *paths, size_t count, int flags) {
+    if (count > JSON_PATH_MAX_PATHS) {
+        return NULL;
+    }
+    json_path_set_t *set = calloc(1, sizeof(*set));
+    if (set == NULL) {
+        return NULL;
+    }
+    set->flags = flags;
+    set->path_count = count;
+    set->node_count = 1;
+    set->nodes[0].first_child = -1;
+    set->nodes[0].next_sibling = -1;
+    set->nodes[0].path = -1;
+
+    for (size_t i = 0; i < count; i++) {
+        int16_t node = 0;
+        int depth = 0;
+        const char *p = paths[i];
+        for (;;) {
+            const char *dot = strchr(p, '.');
+            size_t len = dot ? (size_t)(dot - p) : strlen(p);
+            if (len == 0 || ++depth > JSON_PATH_MAX_DEPTH) {
+                json_path_set_free(set);
+                return NULL;
+            }
+            int16_t child = find_child(set, node, p, len);
+            if (child < 0 && (child = add_child(set, node, p, len)) < 0) {
+                json_path_set_free(set);
+                return NULL;
+            }
+            node = child;
+            if (dot == NULL) {
+                break;
+            }
+            p = dot + 1;
+        }
+        if (set->nodes[node].path >= 0) {
+            // Duplicate path.
+            json_path_set_free(set);
+            return NULL;
+        }
+        set->nodes[node].path = (int16_t)i;
+    }
+
+    return set;
+}
+
+// See comment in header
+void json_path_set_free(json_path_set_t *set) {
+    free(set);
+}
+
+/*** Structural index ***/
+
+/*
+ * The input is scanned 64 bytes at a time into bitmasks, as in simdjson's stage 1. Per block:
+ *   - quotes and backslashes are found, and quotes escaped by an odd run of backslashes dropped,
+ *   - a prefix XOR over the quotes gives the bytes inside strings,
+ *   - structurals are the quotes, plus {}[]:, outside of strings.
+ * The walk then pops structurals off the current block's mask, so the structural index is never
+ * materialized and nothing is allocated.
+ */
+
+typedef struct {
+    const char *doc;
+    size_t len;
+    size_t block;               // Offset of the current block.
+    size_t next_block;
+    uint64_t bits;              // Structurals of the current block not yet consumed.
+    uint64_t prev_in_string;    // All ones if the previous block ended inside a string.
+    uint64_t prev_escaped;      // 1 if the previous block ended with an odd run of backslashes.
+} scanner_t;
+
+#if USE_NEON
+static inline uint64_t neon_mask(uint8x16_t a, uint8x16_t b, uint8x16_t c, uint8x16_t d) {
+    const uint8x16_t weights = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t s0 = vpaddq_u8(vandq_u8(a, weights), vandq_u8(b, weights));
+    uint8x16_t s1 = vpaddq_u8(vandq_u8(c, weights), vandq_u8(d, weights));
+    s0 = vpaddq_u8(s0, s1);
+    s0 = vpaddq_u8(s0, s0);
+    return vgetq_lane_u64(vreinterpretq_u64_u8(s0), 0);
+}
+#endif
+
+// Finds the quotes, backslashes and {}[]:, of a block.
+static inline void block_masks(const uint8_t *p, uint64_t *quote, uint64_t *backslash, uint64_t *op) {
+#if USE_SSE2
+    uint64_t q = 0, b = 0, o = 0;
+    for (int i = 0; i < BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        // '{' and '[', '}' and ']' differ only in bit 0x20.
+        __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i ops = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                                                _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+                                   _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                                                _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        q |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << i;
+        b |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+        o |= (uint64_t)(uint16_t)_mm_movemask_epi8(ops) << i;
+    }
+    *quote = q;
+    *backslash = b;
+    *op = o;
+#elif USE_NEON
+    uint8x16_t v[4], q[4], b[4], o[4];
+    for (int i = 0; i < 4; i++) {
+        v[i] = vld1q_u8(p + 16 * i);
+        uint8x16_t folded = vorrq_u8(v[i], vdupq_n_u8(0x20));
+        o[i] = vorrq_u8(vorrq_u8(vceqq_u8(folded, vdupq_n_u8('{')), vceqq_u8(folded, vdupq_n_u8('}'))),
+                        vorrq_u8(vceqq_u8(v[i], vdupq_n_u8(':')), vceqq_u8(v[i], vdupq_n_u8(','))));
+        q[i] = vceqq_u8(v[i], vdupq_n_u8('"'));
+        b[i] = vceqq_u8(v[i], vdupq_n_u8('\\'));
+    }
+    *quote = neon_mask(q[0], q[1], q[2], q[3]);
+    *backslash = neon_mask(b[0], b[1], b[2], b[3]);
+    *op = neon_mask(o[0], o[1], o[2], o[3]);
+#else
+    uint64_t q = 0, b = 0, o = 0;
+    for (int i = 0; i < BLOCK; i++) {
+        uint8_t c = p[i] | 0x20;
+        q |= (uint64_t)(p[i] == '"') << i;
+        b |= (uint64_t)(p[i] == '\\') << i;
+        o |= (uint64_t)(c == '{' || c == '}' || p[i] == ':' || p[i] == ',') << i;
+    }
+    *quote = q;
+    *backslash = b;
+    *op = o;
+#endif
+}
+
+// Returns the characters escaped by an odd-length run of backslashes, carrying runs across blocks.
+static inline uint64_t escaped_chars(uint64_t backslash, uint64_t *prev_escaped) {
+    const uint64_t even_bits = UINT64_C(0x5555555555555555);
+    const uint64_t odd_bits = ~even_bits;
+
+    uint64_t start_edges = backslash & ~(backslash << 1);
+    uint64_t even_start_mask = even_bits ^ *prev_escaped;
+    uint64_t even_starts = start_edges & even_start_mask;
+    uint64_t odd_starts = start_edges & ~even_start_mask;
+    uint64_t even_carries = backslash + even_starts;
+    uint64_t odd_carries = backslash + odd_starts;
+    uint64_t ends_odd = odd_carries < backslash;
+    odd_carries |= *prev_escaped;
+    *prev_escaped = ends_odd;
+
+    uint64_t even_carry_ends = even_carries & ~backslash;
+    uint64_t odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+}
+
+static inline uint64_t prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static void scan_block(scanner_t *s) {
+    uint8_t tail[BLOCK];
+    const uint8_t *p = (const uint8_t *)s->doc + s->next_block;
+    size_t remaining = s->len - s->next_block;
+    if (remaining < BLOCK) {
+        memset(tail, ' ', BLOCK);
+        memcpy(tail, p, remaining);
+        p = tail;
+    }
+
+    uint64_t quote, backslash, op;
+    block_masks(p, &quote, &backslash, &op);
+    quote &= ~escaped_chars(backslash, &s->prev_escaped);
+    uint64_t in_string = prefix_xor(quote) ^ s->prev_in_string;
+    s->prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+    s->bits = (op & ~in_string) | quote;
+    s->block = s->next_block;
+    s->next_block += BLOCK;
+}
+
+// Pops the next structural. Returns 1 with its offset in pos, or 0 at the end of the input.
+static inline int next_structural(scanner_t *s, size_t *pos) {
+    while (s->bits == 0) {
+        if (s->next_block >= s->len) {
+            return 0;
+        }
+        scan_block(s);
+    }
+    *pos = s->block + (size_t)__builtin_ctzll(s->bits);
+    s->bits &= s->bits - 1;
+    return 1;
+}
+
+/*** Walk ***/
+
+static inline int is_ws(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static inline size_t skip_ws(const char *doc, size_t pos, size_t len) {
+    while (pos < len && is_ws(doc[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+// Skips an object or array whose opening bracket was just consumed. Returns 0 with the offset
+// of the closing bracket in end, or -1.
+static int skip_container(scanner_t *s, size_t *end) {
+    int depth = 1;
+    size_t pos;
+    while (next_structural(s, &pos)) {
+        char c = s->doc[pos];
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && --depth == 0) {
+            *end = pos;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Types a scalar from its text. Returns JSON_PATH_MISSING if it isn't a literal or made of number characters.
+static json_path_type_t scalar_type(const char *s, size_t len) {
+    if (len == 4 && memcmp(s, "true", 4) == 0) {
+        return JSON_PATH_TRUE;
+    }
+    if (len == 5 && memcmp(s, "false", 5) == 0) {
+        return JSON_PATH_FALSE;
+    }
+    if (len == 4 && memcmp(s, "null", 4) == 0) {
+        return JSON_PATH_NULL;
+    }
+    if (len == 0 || (s[0] != '-' && (s[0] < '0' || s[0] > '9'))) {
+        return JSON_PATH_MISSING;
+    }
+    for (size_t i = 1; i < len; i++) {
+        char c = s[i];
+        if ((c < '0' || c > '9') && c != '.' && c != 'e' && c != 'E' && c != '+' && c != '-') {
+            return JSON_PATH_MISSING;
+        }
+    }
+    return JSON_PATH_NUMBER;
+}
+
+// See comment in header
+int json_path_extract(const json_path_set_t *set, const char *doc, size_t len, json_path_value_t *values) {
+    memset(values, 0, sizeof(*values) * set->path_count);
+
+    scanner_t s = { .doc = doc, .len = len };
+    size_t pos;
+    if (!next_structural(&s, &pos) || pos != skip_ws(doc, 0, len) || doc[pos] != '{') {
+        return -1;
+    }
+
+    const int whole = (set->flags & JSON_PATH_WHOLE_OBJECT) != 0;
+    const int want = (int)set->path_count;
+    int found = 0;
+
+    // Trie node and start offset of each object being walked.
+    int16_t nodes[JSON_PATH_MAX_DEPTH + 1];
+    size_t starts[JSON_PATH_MAX_DEPTH + 1];
+    int depth = 0;
+    nodes[0] = 0;
+    starts[0] = pos;
+
+    // Offset of the '{' or ',' before the next member.
+    size_t prev = pos;
+    int at_object_start = 1;
+
+    for (;;) {
+        if (!next_structural(&s, &pos) || skip_ws(doc, prev + 1, len) != pos) {
+            return -1;
+        }
+
+        if (doc[pos] != '}' || !at_object_start) {
+            // A member: key, colon and value, then the ',' or '}' after it.
+            size_t key_end, colon;
+            if (doc[pos] != '"' || !next_structural(&s, &key_end) || !next_structural(&s, &colon) ||
+                doc[colon] != ':' || skip_ws(doc, key_end + 1, len) != colon) {
+                return -1;
+            }
+            int16_t child = find_child(set, nodes[depth], doc + pos + 1, key_end - pos - 1);
+            int16_t path = (child >= 0) ? set->nodes[child].path : -1;
+
+            size_t value_start = skip_ws(doc, colon + 1, len);
+            if (value_start >= len) {
+                return -1;
+            }
+            char c = doc[value_start];
+            json_path_value_t value;
+            size_t value_end, after;
+
+            if (c == '"' || c == '{' || c == '[') {
+                if (!next_structural(&s, &pos) || pos != value_start) {
+                    return -1;
+                }
+            }
+
+            if (c == '{' && child >= 0 && set->nodes[child].first_child >= 0 && depth < JSON_PATH_MAX_DEPTH) {
+                // Descend into an object that paths go through. Its own value, if it is also a
+                // path, is recorded when it ends.
+                nodes[++depth] = child;
+                starts[depth] = value_start;
+                prev = value_start;
+                at_object_start = 1;
+                continue;
+            }
+
+            if (c == '"') {
+                if (!next_structural(&s, &value_end)) {
+                    return -1;
+                }
+                value.type = JSON_PATH_STRING;
+                value.start = doc + value_start + 1;
+                value.len = value_end - value_start - 1;
+                value_end++;
+            } else if (c == '{' || c == '[') {
+                if (skip_container(&s, &value_end) != 0 || doc[value_end] != (c == '{' ? '}' : ']')) {
+                    return -1;
+                }
+                value_end++;
+                value.type = (c == '{') ? JSON_PATH_OBJECT : JSON_PATH_ARRAY;
+                value.start = doc + value_start;
+                value.len = value_end - value_start;
+            } else {
+                // Scalars run up to the next structural.
+                if (!next_structural(&s, &after)) {
+                    return -1;
+                }
+                value_end = after;
+                while (value_end > value_start && is_ws(doc[value_end - 1])) {
+                    value_end--;
+                }
+                value.type = scalar_type(doc + value_start, value_end - value_start);
+                if (value.type == JSON_PATH_MISSING) {
+                    return -1;
+                }
+                value.start = doc + value_start;
+                value.len = value_end - value_start;
+            }
+
+            if (c == '"' || c == '{' || c == '[') {
+                if (!next_structural(&s, &after)) {
+                    return -1;
+                }
+            }
+            if (skip_ws(doc, value_end, len) != after) {
+                return -1;
+            }
+
+            if (path >= 0 && (whole || values[path].type == JSON_PATH_MISSING)) {
+                found += (values[path].type == JSON_PATH_MISSING);
+                values[path] = value;
+            }
+            if (!whole && found == want) {
+                return found;
+            }
+
+            at_object_start = 0;
+            if (doc[after] == ',') {
+                prev = after;
+                continue;
+            }
+            if (doc[after] != '}') {
+                return -1;
+            }
+            pos = after;
+        }
+
+        // pos is the closing brace of the object at depth. Close it, and the enclosing objects
+        // that end right after it.
+        for (;;) {
+            int16_t object_path = set->nodes[nodes[depth]].path;
+            if (depth > 0 && object_path >= 0 && (whole || values[object_path].type == JSON_PATH_MISSING)) {
+                found += (values[object_path].type == JSON_PATH_MISSING);
+                values[object_path].type = JSON_PATH_OBJECT;
+                values[object_path].start = doc + starts[depth];
+                values[object_path].len = pos + 1 - starts[depth];
+            }
+            if (depth == 0) {
+                // Only whitespace may follow the top level object.
+                if (whole && skip_ws(doc, pos + 1, len) != len) {
+                    return -1;
+                }
+                return found;
+            }
+            depth--;
+            if (!whole && found == want) {
+                return found;
+            }
+
+            size_t after;
+            if (!next_structural(&s, &after) || skip_ws(doc, pos + 1, len) != after) {
+                return -1;
+            }
+            if (doc[after] == ',') {
+                prev = after;
+                at_object_start = 0;
+                break;
+            }
+            if (doc[after] != '}') {
+                return -1;
+            }
+            pos = after;
+        }
+    }
+}
+
+/*** Strings ***/
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static long read_hex4(const char *s) {
+    long v = 0;
+    for (int i = 0; i < 4; i++) {
+        int d = hex_digit(s[i]);
+        if (d < 0) {
+            return -1;
+        }
+        v = v << 4 | d;
+    }
+    return v;
+}
+
+// See comment in header
+long json_path_unescape(const char *s, size_t len, char *dst, size_t dst_len) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        if (s[i] != '\\') {
+            if (o >= dst_len) {
+                return -1;
+            }
+            dst[o++] = s[i++];
+            continue;
+        }
+        if (i + 1 >= len) {
+            return -1;
+        }
+        char c = s[i + 1];
+        char simple = 0;
+        switch (c) {
+            case '"': simple = '"'; break;
+            case '\\': simple = '\\'; break;
+            case '/': simple = '/'; break;
+            case 'b': simple = '\b'; break;
+            case 'f': simple = '\f'; break;
+            case 'n': simple = '\n'; break;
+            case 'r': simple = '\r'; break;
+            case 't': simple = '\t'; break;
+            case 'u': break;
+            default: return -1;
+        }
+        if (simple) {
+            if (o >= dst_len) {
+                return -1;
+            }
+            dst[o++] = simple;
+            i += 2;
+            continue;
+        }
+
+        if (i + 6 > len) {
+            return -1;
+        }
+        long cp = read_hex4(s + i + 2);
+        if (cp < 0) {
+            return -1;
+        }
+        i += 6;
+        if (cp >= 0xd800 && cp <= 0xdbff) {
+            long lo;
+            if (i + 6 > len || s[i] != '\\' || s[i + 1] != 'u' || (lo = read_hex4(s + i + 2)) < 0xdc00 || lo > 0xdfff) {
+                return -1;
+            }
+            cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+            i += 6;
+        } else if (cp >= 0xdc00 && cp <= 0xdfff) {
+            return -1;
+        }
+
+        // At most 4 bytes for 6 or 12 bytes of input, so dst may alias s.
+        size_t n = (cp < 0x80) ? 1 : (cp < 0x800) ? 2 : (cp < 0x10000) ? 3 : 4;
+        if (o + n > dst_len) {
+            return -1;
+        }
+        if (n == 1) {
+            dst[o++] = (char)cp;
+        } else if (n == 2) {
+            dst[o++] = (char)(0xc0 | cp >> 6);
+            dst[o++] = (char)(0x80 | (cp & 0x3f));
+        } else if (n == 3) {
+            dst[o++] = (char)(0xe0 | cp >> 12);
+            dst[o++] = (char)(0x80 | ((cp >> 6) & 0x3f));
+            dst[o++] = (char)(0x80 | (cp & 0x3f));
+        } else {
+            dst[o++] = (char)(0xf0 | cp >> 18);
+            dst[o++] = (char)(0x80 | ((cp >> 12) & 0x3f));
+            dst[o++] = (char)(0x80 | ((cp >> 6) & 0x3f));
+            dst[o++] = (char)(0x80 | (cp & 0x3f));
+        }
+    }
+    return (long)o;
+}
+
+/*** Arrays ***/
+
+// Arrays the app reads are short, e.g. capabilities, so elements are scanned byte by byte.
+
+static const char * skip_string(const char *p, const char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+// See comment in header
+int json_path_array_begin(json_path_iter_t *it, const json_path_value_t *array) {
+    if (array->type != JSON_PATH_ARRAY || array->len < 2) {
+        return -1;
+    }
+    it->p = array->start + 1;
+    it->end = array->start + array->len - 1;
+    return 0;
+}
+
+// See comment in header
+int json_path_array_next(json_path_iter_t *it, json_path_value_t *element) {
+    const char *p = it->p, *end = it->end;
+    while (p < end && is_ws(*p)) {
+        p++;
+    }
+    if (p >= end) {
+        return 0;
+    }
+
+    const char *start = p;
+    if (*p == '"') {
+        p = skip_string(p, end);
+        if (p == NULL) {
+            return -1;
+        }
+        element->type = JSON_PATH_STRING;
+        element->start = start + 1;
+        element->len = (size_t)(p - start - 2);
+    } else if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            if (*p == '"') {
+                p = skip_string(p, end);
+                if (p == NULL) {
+                    return -1;
+                }
+                continue;
+            }
+            if (*p == '{' || *p == '[') {
+                depth++;
+            } else if ((*p == '}' || *p == ']') && --depth == 0) {
+                break;
+            }
+            p++;
+        }
+        if (p >= end) {
+            return -1;
+        }
+        p++;
+        element->type = (*start == '{') ? JSON_PATH_OBJECT : JSON_PATH_ARRAY;
+        element->start = start;
+        element->len = (size_t)(p - start);
+    } else {
+        while (p < end && *p != ',' && !is_ws(*p)) {
+            p++;
+        }
+        element->type = scalar_type(start, (size_t)(p - start));
+        if (element->type == JSON_PATH_MISSING) {
+            return -1;
+        }
+        element->start = start;
+        element->len = (size_t)(p - start);
+    }
+
+    while (p < end && is_ws(*p)) {
+        p++;
+    }
+    if (p < end) {
+        if (*p != ',') {
+            return -1;
+        }
+        p++;
+    }
+    it->p = p;
+    return 1;
+}
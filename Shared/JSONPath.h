@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef JSONPath_h
+#define JSONPath_h
+
+#include <stddef.h>
+
+/*
+ * On-demand extraction of a few known members from JSON objects, for the JSON-lines readers
+ * (notices, homepage notices, embedded server entries, authorizations) that only need one to three
+ * keys out of each line.
+ *
+ * A path set is compiled once from dotted key paths, e.g. "data.url". Extraction then finds the
+ * structural characters of the line 64 bytes at a time (with SSE2 or NEON where available),
+ * outside of strings, and walks only those: string contents and the members of objects that no
+ * path goes through are skipped without being looked at byte by byte. Extraction doesn't allocate,
+ * and values are returned as spans of the input.
+ *
+ * This isn't a validator. Malformed input is detected where it breaks the structure the walk
+ * depends on, and by default extraction stops as soon as every path has been found, without
+ * looking at the rest of the line.
+ */
+
+// Maximum number of paths in a set.
+#define JSON_PATH_MAX_PATHS 16
+
+// Maximum number of keys in a path.
+#define JSON_PATH_MAX_DEPTH 8
+
+// Flag: walk the whole object even once every path is found, so that lines with a broken structure
+// anywhere are rejected. When a key is repeated the last value is returned, like NSJSONSerialization;
+// otherwise the first one is.
+#define JSON_PATH_WHOLE_OBJECT 1
+
+typedef enum {
+    JSON_PATH_MISSING = 0,
+    JSON_PATH_STRING,
+    JSON_PATH_NUMBER,
+    JSON_PATH_OBJECT,
+    JSON_PATH_ARRAY,
+    JSON_PATH_TRUE,
+    JSON_PATH_FALSE,
+    JSON_PATH_NULL,
+} json_path_type_t;
+
+/*!
+ * @brief A value found in the input.
+ *
+ * For strings the span is the contents between the quotes, with escapes as-is (see json_path_unescape).
+ * For everything else it is the value's text, e.g. the whole object from '{' to '}'.
+ */
+typedef struct {
+    json_path_type_t type;
+    const char *start;
+    size_t len;
+} json_path_value_t;
+
+typedef struct json_path_set json_path_set_t;
+
+/*!
+ * @brief Compiles a set of paths.
+ *
+ * Keys are separated by '.' and are matched against the raw text of the input's keys.
+ *
+ * @param paths Paths, e.g. { "noticeType", "data.url" }.
+ * @param flags 0 or JSON_PATH_WHOLE_OBJECT.
+ * @return Path set, or NULL if a path is empty or too deep, there are too many paths, or allocation failed.
+ */
+json_path_set_t * json_path_set_new(const char *const *paths, size_t count, int flags);
+
+void json_path_set_free(json_path_set_t *set);
+
+/*!
+ * @brief Extracts the paths from a JSON object.
+ *
+ * @param values Populated with the value of each path, in the order they were given to json_path_set_new.
+ *               Paths that aren't in the object are JSON_PATH_MISSING.
+ * @return Number of paths found, or -1 if doc isn't a JSON object or is malformed.
+ */
+int json_path_extract(const json_path_set_t *set, const char *doc, size_t len, json_path_value_t *values);
+
+/*!
+ * @brief Decodes the escapes of a string value's contents into UTF-8.
+ *
+ * dst may be the same as s. The result is never longer than the input.
+ *
+ * @return Length of the decoded string, or -1 if an escape is invalid or dst is too small.
+ */
+long json_path_unescape(const char *s, size_t len, char *dst, size_t dst_len);
+
+/*!
+ * @brief Iterator over the elements of an array value.
+ */
+typedef struct {
+    const char *p;
+    const char *end;
+} json_path_iter_t;
+
+/*!
+ * @brief Starts iterating over an array value.
+ * @return 0 on success, -1 if the value isn't an array.
+ */
+int json_path_array_begin(json_path_iter_t *it, const json_path_value_t *array);
+
+/*!
+ * @brief Reads the next element of an array.
+ * @return 1 if element was populated, 0 at the end of the array, -1 if the array is malformed.
+ */
+int json_path_array_next(json_path_iter_t *it, json_path_value_t *element);
+
+#endif /* JSONPath_h */
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "LineIndex.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(LINE_INDEX_NO_SIMD) && defined(__AVX2__)
+#include <immintrin.h>
+#define USE_AVX2 1
+#elif !defined(LINE_INDEX_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2 1
+#elif !defined(LINE_INDEX_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#endif
+
+#define BLOCK 32
+#define INITIAL_CAPACITY 64
+
+struct line_index {
+    uint32_t *starts;           // Start of each complete line, then of the partial line. starts[0] is 0.
+    uint64_t *crlf;             // Bit i is set if line i ended with "\r\n".
+    size_t count;               // Complete lines.
+    size_t capacity;            // Entries of starts. crlf has a bit for each.
+    uint32_t size;
+    uint32_t last_cr;           // 1 if the last byte appended was '\r'.
+};
+
+// See comment in header
+line_index_t * line_index_new(void) {
+    line_index_t *idx = calloc(1, sizeof(*idx));
+    if (idx == NULL) {
+        return NULL;
+    }
+    idx->starts = malloc(INITIAL_CAPACITY * sizeof(*idx->starts));
+    idx->crlf = calloc(INITIAL_CAPACITY / 64, sizeof(*idx->crlf));
+    if (idx->starts == NULL || idx->crlf == NULL) {
+        line_index_free(idx);
+        return NULL;
+    }
+    idx->capacity = INITIAL_CAPACITY;
+    idx->starts[0] = 0;
+    return idx;
+}
+
+// See comment in header
+void line_index_free(line_index_t *idx) {
+    if (idx == NULL) {
+        return;
+    }
+    free(idx->starts);
+    free(idx->crlf);
+    free(idx);
+}
+
+// See comment in header
+void line_index_reset(line_index_t *idx) {
+    idx->count = 0;
+    idx->size = 0;
+    idx->last_cr = 0;
+}
+
+// Makes room for starts[0..lines].
+static int reserve(line_index_t *idx, size_t lines) {
+    if (lines < idx->capacity) {
+        return 0;
+    }
+    size_t capacity = idx->capacity * 2;
+    while (capacity <= lines) {
+        capacity *= 2;
+    }
+    uint32_t *starts = realloc(idx->starts, capacity * sizeof(*starts));
+    if (starts == NULL) {
+        return -1;
+    }
+    idx->starts = starts;
+    uint64_t *crlf = realloc(idx->crlf, capacity / 64 * sizeof(*crlf));
+    if (crlf == NULL) {
+        return -1;
+    }
+    memset(crlf + idx->capacity / 64, 0, (capacity - idx->capacity) / 64 * sizeof(*crlf));
+    idx->crlf = crlf;
+    idx->capacity = capacity;
+    return 0;
+}
+
+#if USE_NEON
+static inline uint32_t neon_mask(uint8x16_t a, uint8x16_t b) {
+    const uint8x16_t weights = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t s = vpaddq_u8(vandq_u8(a, weights), vandq_u8(b, weights));
+    s = vpaddq_u8(s, s);
+    s = vpaddq_u8(s, s);
+    return vgetq_lane_u32(vreinterpretq_u32_u8(s), 0);
+}
+#endif
+
+// Finds the '\n' and '\r' of a block.
+static inline void block_masks(const uint8_t *p, uint32_t *nl, uint32_t *cr) {
+#if USE_AVX2
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    *nl = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    *cr = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+#elif USE_SSE2
+    __m128i lo = _mm_loadu_si128((const __m128i *)p), hi = _mm_loadu_si128((const __m128i *)(p + 16));
+    const __m128i n = _mm_set1_epi8('\n'), r = _mm_set1_epi8('\r');
+    *nl = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, n)) |
+          (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, n)) << 16;
+    *cr = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, r)) |
+          (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, r)) << 16;
+#elif USE_NEON
+    uint8x16_t lo = vld1q_u8(p), hi = vld1q_u8(p + 16);
+    const uint8x16_t n = vdupq_n_u8('\n'), r = vdupq_n_u8('\r');
+    *nl = neon_mask(vceqq_u8(lo, n), vceqq_u8(hi, n));
+    *cr = neon_mask(vceqq_u8(lo, r), vceqq_u8(hi, r));
+#else
+    uint32_t n = 0, r = 0;
+    for (int i = 0; i < BLOCK; i++) {
+        n |= (uint32_t)(p[i] == '\n') << i;
+        r |= (uint32_t)(p[i] == '\r') << i;
+    }
+    *nl = n;
+    *cr = r;
+#endif
+}
+
+// Records the lines ended by the newlines of a block starting at offset.
+static inline void record(line_index_t *idx, uint32_t offset, uint32_t nl, uint32_t crlf) {
+    while (nl != 0) {
+        int bit = __builtin_ctz(nl);
+        size_t line = idx->count++;
+        uint64_t m = UINT64_C(1) << (line % 64);
+        idx->starts[line + 1] = offset + (uint32_t)bit + 1;
+        idx->crlf[line / 64] = (idx->crlf[line / 64] & ~m) | ((crlf >> bit & 1) ? m : 0);
+        nl &= nl - 1;
+    }
+}
+
+// See comment in header
+int line_index_append(line_index_t *idx, const char *data, size_t len) {
+    if (len > LINE_INDEX_MAX_SIZE - idx->size) {
+        return -1;
+    }
+    const uint8_t *p = (const uint8_t *)data;
+    size_t count = idx->count;
+    uint32_t carry = idx->last_cr;
+    size_t i = 0;
+    for (; i + BLOCK <= len; i += BLOCK) {
+        uint32_t nl, cr;
+        block_masks(p + i, &nl, &cr);
+        if (nl != 0) {
+            if (reserve(idx, idx->count + BLOCK + 1) != 0) {
+                idx->count = count;
+                return -1;
+            }
+            record(idx, idx->size + (uint32_t)i, nl, nl & (cr << 1 | carry));
+        }
+        carry = cr >> (BLOCK - 1);
+    }
+    if (i < len) {
+        uint32_t nl = 0, cr = 0;
+        for (size_t j = 0; i + j < len; j++) {
+            nl |= (uint32_t)(p[i + j] == '\n') << j;
+            cr |= (uint32_t)(p[i + j] == '\r') << j;
+        }
+        if (nl != 0 && reserve(idx, idx->count + BLOCK + 1) != 0) {
+            idx->count = count;
+            return -1;
+        }
+        record(idx, idx->size + (uint32_t)i, nl, nl & (cr << 1 | carry));
+        carry = cr >> (len - i - 1);
+    }
+    idx->size += (uint32_t)len;
+    if (len > 0) {
+        idx->last_cr = carry;
+    }
+    return 0;
+}
+
+// See comment in header
+size_t line_index_count(const line_index_t *idx) {
+    return idx->count;
+}
+
+// See comment in header
+int line_index_line(const line_index_t *idx, size_t index, uint32_t *offset, uint32_t *len) {
+    if (index >= idx->count) {
+        return -1;
+    }
+    *offset = idx->starts[index];
+    *len = idx->starts[index + 1] - 1 - idx->starts[index] - (uint32_t)(idx->crlf[index / 64] >> (index % 64) & 1);
+    return 0;
+}
+
+// See comment in header
+int line_index_partial(const line_index_t *idx, uint32_t *offset, uint32_t *len) {
+    *offset = idx->starts[idx->count];
+    *len = idx->size - *offset;
+    return *len > 0;
+}
+
+// See comment in header
+uint32_t line_index_size(const line_index_t *idx) {
+    return idx->size;
+}
+
+// See comment in header
+size_t line_index_memory(const line_index_t *idx) {
+    return sizeof(*idx) + idx->capacity * sizeof(*idx->starts) + idx->capacity / 64 * sizeof(*idx->crlf);
+}
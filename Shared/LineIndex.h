@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LineIndex_h
+#define LineIndex_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Index of the lines of a JSON-lines file (notices, homepage notices, embedded server entries,
+ * diagnostic logs), built as the file's bytes are appended to it.
+ *
+ * The index keeps the offset at which each line starts, as uint32_t, and one bit per line for
+ * whether it ended in "\r\n". Lines are found 32 bytes at a time by comparing against '\n' and
+ * '\r' with AVX2, SSE2 or NEON where available. The file's contents aren't kept: offsets are into
+ * the concatenation of everything appended, e.g. an mmap of the file or a buffer being read into.
+ *
+ * Appends can split a line, or a "\r\n", anywhere. The line after the last '\n' is partial until
+ * its newline is appended.
+ */
+
+// Largest number of bytes an index covers.
+#define LINE_INDEX_MAX_SIZE UINT32_MAX
+
+typedef struct line_index line_index_t;
+
+line_index_t * line_index_new(void);
+
+void line_index_free(line_index_t *idx);
+
+/*!
+ * @brief Empties the index, e.g. when the file it indexes has been rotated.
+ */
+void line_index_reset(line_index_t *idx);
+
+/*!
+ * @brief Indexes the next bytes of the file.
+ * @return 0 on success, -1 if the index would exceed LINE_INDEX_MAX_SIZE bytes or allocation failed.
+ *         The index is unchanged on failure.
+ */
+int line_index_append(line_index_t *idx, const char *data, size_t len);
+
+/*!
+ * @brief Number of complete lines, i.e. of '\n' appended.
+ */
+size_t line_index_count(const line_index_t *idx);
+
+/*!
+ * @brief Finds a complete line.
+ *
+ * @param offset Set to the offset of the line's first byte.
+ * @param len Set to the length of the line, without its "\n" or "\r\n".
+ * @return 0 on success, -1 if index is out of range.
+ */
+int line_index_line(const line_index_t *idx, size_t index, uint32_t *offset, uint32_t *len);
+
+/*!
+ * @brief Finds the partial line after the last newline.
+ *
+ * @param offset Set to the offset of the partial line.
+ * @param len Set to its length, including any trailing '\r'.
+ * @return 1 if there is a partial line, 0 if the bytes appended so far end with a newline or there are none.
+ */
+int line_index_partial(const line_index_t *idx, uint32_t *offset, uint32_t *len);
+
+/*!
+ * @brief Number of bytes appended.
+ */
+uint32_t line_index_size(const line_index_t *idx);
+
+/*!
+ * @brief Bytes of heap memory held by the index.
+ */
+size_t line_index_memory(const line_index_t *idx);
+
+#endif /* LineIndex_h */
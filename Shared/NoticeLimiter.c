@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "NoticeLimiter.h"
+#include "timestamp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tokens are counted in thousandths of a notice, so that a rate in notices per second refills a whole number of
+// tokens per millisecond.
+#define TOKEN 1000
+
+#define FNV_OFFSET UINT64_C(14695981039346656037)
+#define FNV_PRIME UINT64_C(1099511628211)
+
+typedef struct {
+    uint64_t hash;
+    char notice_type[NOTICE_LIMIT_MAX_NOTICE_TYPE];
+    notice_limit_rule_t rule;
+} rule_slot_t;
+
+typedef struct {
+    uint64_t key;                       // 0 for an empty slot.
+    const notice_limit_rule_t *rule;
+    uint64_t tokens;
+    int64_t refill_ms;
+
+    // Suppressed notices of the current burst.
+    uint64_t suppressed;
+    int64_t first_ms;
+    int64_t last_ms;
+    int16_t offset;
+    uint16_t sample_len;
+    char sample[NOTICE_LIMIT_MAX_SAMPLE];
+    char notice_type[NOTICE_LIMIT_MAX_NOTICE_TYPE];
+} bucket_t;
+
+struct notice_limiter {
+    notice_limit_emit_fn emit;
+    void *ctx;
+
+    rule_slot_t rules[NOTICE_LIMIT_MAX_RULES];
+    unsigned rule_count;
+    notice_limit_rule_t default_rule;
+
+    bucket_t *buckets;
+    size_t capacity;
+
+    notice_limit_stats_t stats;
+};
+
+/*** Keys ***/
+
+static uint64_t hash_bytes(uint64_t h, const char *s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+// Hash of a message with its digits left out, continuing h.
+static uint64_t hash_message(uint64_t h, const char *s, size_t len) {
+    h = (h ^ 0xff) * FNV_PRIME;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') {
+            h = (h ^ (unsigned char)s[i]) * FNV_PRIME;
+        }
+    }
+    return h;
+}
+
+static size_t type_len(const char *notice_type) {
+    size_t n = strlen(notice_type);
+    return n < NOTICE_LIMIT_MAX_NOTICE_TYPE ? n : NOTICE_LIMIT_MAX_NOTICE_TYPE - 1;
+}
+
+// Index of the notice type's rule, or rule_count if it has none.
+static unsigned find_rule(const notice_limiter_t *l, const char *notice_type, size_t len, uint64_t hash) {
+    unsigned i = 0;
+    for (; i < l->rule_count; i++) {
+        const rule_slot_t *r = &l->rules[i];
+        if (r->hash == hash && strncmp(r->notice_type, notice_type, len) == 0 && r->notice_type[len] == '\0') {
+            break;
+        }
+    }
+    return i;
+}
+
+static int rule_valid(const notice_limit_rule_t *rule) {
+    return rule->rate == 0 || (rule->burst > 0 && rule->burst <= UINT32_MAX / TOKEN && rule->summary_ms >= 0);
+}
+
+/*** Buckets ***/
+
+// Tokens of the bucket at ms. Time going backwards, e.g. a notice timestamped before the last poll, adds none.
+// Never more than the burst, which a new rule may have lowered.
+static uint64_t tokens_at(const bucket_t *b, int64_t ms) {
+    uint64_t full = (uint64_t)b->rule->burst * TOKEN;
+    if (ms <= b->refill_ms) {
+        return b->tokens < full ? b->tokens : full;
+    }
+    uint64_t elapsed = (uint64_t)(ms - b->refill_ms);
+    if (elapsed >= full) {
+        // Enough to fill the bucket at any rate of at least 1.
+        return full;
+    }
+    uint64_t tokens = b->tokens + elapsed * b->rule->rate;
+    return tokens < full ? tokens : full;
+}
+
+static void refill(bucket_t *b, int64_t ms) {
+    b->tokens = tokens_at(b, ms);
+    if (ms > b->refill_ms) {
+        b->refill_ms = ms;
+    }
+}
+
+static int is_full(const bucket_t *b) {
+    return b->tokens == (uint64_t)b->rule->burst * TOKEN;
+}
+
+// A full bucket with nothing suppressed behaves as a new one, so its slot can be reused.
+static int is_idle(const bucket_t *b, int64_t ms) {
+    return b->key == 0 || (b->suppressed == 0 && tokens_at(b, ms) == (uint64_t)b->rule->burst * TOKEN);
+}
+
+static bucket_t * find_bucket(notice_limiter_t *l, uint64_t key, int64_t ms) {
+    size_t base = (size_t)(key % l->capacity);
+    bucket_t *idle = NULL;
+    for (size_t i = 0; i < NOTICE_LIMIT_PROBE; i++) {
+        bucket_t *b = &l->buckets[(base + i) % l->capacity];
+        if (b->key == key) {
+            return b;
+        }
+        if (idle == NULL && is_idle(b, ms)) {
+            idle = b;
+        }
+    }
+    return idle;
+}
+
+static int emit_summary(notice_limiter_t *l, bucket_t *b) {
+    notice_limit_summary_t s = {
+        .notice_type = b->notice_type,
+        .sample = b->sample,
+        .sample_len = b->sample_len,
+        .count = b->suppressed,
+        .first_ms = b->first_ms,
+        .last_ms = b->last_ms,
+        .offset = b->offset,
+    };
+    if (l->emit(l->ctx, &s) != 0) {
+        return -1;
+    }
+    l->stats.summaries++;
+    b->suppressed = 0;
+    return 0;
+}
+
+/*** Limiter ***/
+
+// See comment in header
+notice_limiter_t * notice_limiter_new(size_t capacity, const notice_limit_rule_t *default_rule,
+                                      notice_limit_emit_fn emit, void *ctx) {
+    if (capacity < NOTICE_LIMIT_PROBE || default_rule == NULL || !rule_valid(default_rule) || emit == NULL) {
+        return NULL;
+    }
+
+    notice_limiter_t *l = calloc(1, sizeof(*l));
+    if (l == NULL) {
+        return NULL;
+    }
+    l->buckets = calloc(capacity, sizeof(bucket_t));
+    if (l->buckets == NULL) {
+        free(l);
+        return NULL;
+    }
+    l->capacity = capacity;
+    l->default_rule = *default_rule;
+    l->emit = emit;
+    l->ctx = ctx;
+    return l;
+}
+
+// See comment in header
+int notice_limiter_set_rule(notice_limiter_t *l, const char *notice_type, const notice_limit_rule_t *rule) {
+    if (rule == NULL || !rule_valid(rule)) {
+        return -1;
+    }
+    size_t len = type_len(notice_type);
+    uint64_t hash = hash_bytes(FNV_OFFSET, notice_type, len);
+
+    unsigned i = find_rule(l, notice_type, len, hash);
+    if (i == NOTICE_LIMIT_MAX_RULES) {
+        return -1;
+    }
+    rule_slot_t *r = &l->rules[i];
+    if (i == l->rule_count) {
+        r->hash = hash;
+        memcpy(r->notice_type, notice_type, len);
+        r->notice_type[len] = '\0';
+        l->rule_count++;
+    }
+    r->rule = *rule;
+
+    // Buckets in use of the notice type follow the rule, e.g. for notice_limiter_poll().
+    for (size_t j = 0; j < l->capacity; j++) {
+        bucket_t *b = &l->buckets[j];
+        if (b->key != 0 && strcmp(b->notice_type, r->notice_type) == 0) {
+            b->rule = &r->rule;
+        }
+    }
+    return 0;
+}
+
+// See comment in header
+int notice_limiter_admit(notice_limiter_t *l, const char *notice_type, const char *message, size_t message_len,
+                         const char *timestamp, size_t timestamp_len) {
+    timestamp_t ts;
+    if (timestamp_parse(timestamp, timestamp_len, &ts) != 0) {
+        l->stats.admitted++;
+        return -1;
+    }
+    int64_t ms = ts.sec * 1000 + ts.nsec / 1000000;
+
+    size_t len = type_len(notice_type);
+    uint64_t key = hash_bytes(FNV_OFFSET, notice_type, len);
+    unsigned i = find_rule(l, notice_type, len, key);
+    const notice_limit_rule_t *rule = i < l->rule_count ? &l->rules[i].rule : &l->default_rule;
+    if (rule->rate == 0) {
+        l->stats.admitted++;
+        return 1;
+    }
+    if (rule->flags & NOTICE_LIMIT_PER_MESSAGE) {
+        key = hash_message(key, message, message_len);
+    }
+    if (key == 0) {
+        key = 1;
+    }
+
+    bucket_t *b = find_bucket(l, key, ms);
+    if (b == NULL) {
+        // Every slot of the key is in a burst: admit rather than lose notices without counting them.
+        l->stats.admitted++;
+        l->stats.untracked++;
+        return 1;
+    }
+    if (b->key != key) {
+        b->key = key;
+        b->tokens = (uint64_t)rule->burst * TOKEN;
+        b->refill_ms = ms;
+        b->suppressed = 0;
+        memcpy(b->notice_type, notice_type, len);
+        b->notice_type[len] = '\0';
+    }
+    // The rule may have changed since the bucket was taken.
+    b->rule = rule;
+
+    refill(b, ms);
+    if (b->tokens >= TOKEN) {
+        // The burst ended, the bucket having filled up since: its summary goes before this notice.
+        if (b->suppressed > 0 && is_full(b) && emit_summary(l, b) != 0) {
+            l->stats.admitted++;
+            return -1;
+        }
+        b->tokens -= TOKEN;
+        l->stats.admitted++;
+        return 1;
+    }
+
+    if (b->suppressed == 0) {
+        b->first_ms = ms;
+        b->offset = ts.offset;
+        b->sample_len = (uint16_t)(message_len < NOTICE_LIMIT_MAX_SAMPLE ? message_len : NOTICE_LIMIT_MAX_SAMPLE);
+        memcpy(b->sample, message, b->sample_len);
+    }
+    b->suppressed++;
+    b->last_ms = ms;
+    l->stats.suppressed++;
+    return 0;
+}
+
+// See comment in header
+int notice_limiter_poll(notice_limiter_t *l, int64_t now_ms) {
+    for (size_t i = 0; i < l->capacity; i++) {
+        bucket_t *b = &l->buckets[i];
+        if (b->key == 0 || b->suppressed == 0) {
+            continue;
+        }
+        refill(b, now_ms);
+        int interval = b->rule->summary_ms > 0 && now_ms - b->first_ms >= b->rule->summary_ms;
+        if ((is_full(b) || interval) && emit_summary(l, b) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// See comment in header
+int notice_limiter_flush(notice_limiter_t *l) {
+    for (size_t i = 0; i < l->capacity; i++) {
+        bucket_t *b = &l->buckets[i];
+        if (b->key != 0 && b->suppressed > 0 && emit_summary(l, b) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// See comment in header
+void notice_limiter_stats(const notice_limiter_t *l, notice_limit_stats_t *stats) {
+    *stats = l->stats;
+}
+
+// See comment in header
+void notice_limiter_free(notice_limiter_t *l) {
+    if (l == NULL) {
+        return;
+    }
+    free(l->buckets);
+    free(l);
+}
+
+/*** JSON ***/
+
+typedef struct {
+    char *p;
+    char *end;
+    int overflow;
+} out_t;
+
+static void out_raw(out_t *o, const char *s, size_t len) {
+    if ((size_t)(o->end - o->p) < len) {
+        o->overflow = 1;
+        return;
+    }
+    memcpy(o->p, s, len);
+    o->p += len;
+}
+
+static void out_str(out_t *o, const char *s) {
+    out_raw(o, s, strlen(s));
+}
+
+static void out_escaped(out_t *o, const char *s, size_t len) {
+    for (size_t i = 0; i < len && !o->overflow; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            char e[2] = { '\\', (char)c };
+            out_raw(o, e, 2);
+        } else if (c < 0x20) {
+            char e[7];
+            snprintf(e, sizeof(e), "\\u%04x", c);
+            out_raw(o, e, 6);
+        } else {
+            out_raw(o, (const char *)&s[i], 1);
+        }
+    }
+}
+
+static void out_timestamp(out_t *o, int64_t ms, int16_t offset) {
+    timestamp_t ts;
+    ts.sec = ms / 1000;
+    ts.nsec = (int32_t)(ms % 1000) * 1000000;
+    ts.offset = offset;
+    if (ts.nsec < 0) {
+        ts.sec--;
+        ts.nsec += 1000000000;
+    }
+
+    char buf[40];
+    size_t n = timestamp_format_precision(buf, sizeof(buf), &ts, 3);
+    out_raw(o, buf, n);
+}
+
+// Length of the sample without a UTF-8 sequence cut short by truncation at its end.
+static size_t sample_len(const char *s, size_t len) {
+    size_t i = len, continuation = 0;
+    while (i > 0 && continuation < 3 && ((unsigned char)s[i - 1] & 0xc0) == 0x80) {
+        i--;
+        continuation++;
+    }
+    unsigned char lead = i > 0 ? (unsigned char)s[i - 1] : 0;
+    if (lead >= 0xc0) {
+        size_t need = lead >= 0xf0 ? 3 : lead >= 0xe0 ? 2 : 1;
+        if (continuation < need) {
+            return i - 1;
+        }
+    }
+    return len;
+}
+
+// See comment in header
+long notice_limit_format_json(const notice_limit_summary_t *summary, char *dst, size_t len) {
+    out_t o = { dst, dst + len, 0 };
+
+    char count[24];
+    snprintf(count, sizeof(count), "%llu", (unsigned long long)summary->count);
+
+    out_str(&o, "{\"data\":{\"message\":\"suppressed ");
+    out_str(&o, count);
+    out_str(&o, summary->count == 1 ? " similar message\",\"count\":" : " similar messages\",\"count\":");
+    out_str(&o, count);
+    out_str(&o, ",\"first\":\"");
+    out_timestamp(&o, summary->first_ms, summary->offset);
+    out_str(&o, "\",\"last\":\"");
+    out_timestamp(&o, summary->last_ms, summary->offset);
+    out_str(&o, "\",\"sample\":\"");
+    out_escaped(&o, summary->sample, sample_len(summary->sample, summary->sample_len));
+    out_str(&o, "\"},\"noticeType\":\"");
+    out_escaped(&o, summary->notice_type, strlen(summary->notice_type));
+    out_str(&o, "\",\"showUser\":false,\"timestamp\":\"");
+    out_timestamp(&o, summary->last_ms, summary->offset);
+    out_str(&o, "\"}");
+
+    return o.overflow ? -1 : (long)(o.p - dst);
+}
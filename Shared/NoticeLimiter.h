@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef NoticeLimiter_h
+#define NoticeLimiter_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Admission control for the notices written by PsiFeedbackLogger, so that a storm of notices (e.g.
+ * tunnel-core reconnecting in a loop, or reachability flapping) costs neither the serialization, lock
+ * and sync of every notice nor the history the rotating files hold.
+ *
+ * Notices are rate limited by a token bucket per key: the notice type, or the notice type and the
+ * message with its digits left out, so that e.g. "retry 1" and "retry 2" share a bucket. The rule
+ * of each notice type (rate, burst, keying) is configurable, with a default rule for the others.
+ * Buckets are kept in a fixed-size hashed table, found by probing a few slots. A bucket that is full
+ * and has nothing suppressed is the same as no bucket, so its slot can be taken by another key.
+ *
+ * Suppressed notices are counted, and when the burst ends (the bucket fills up again) a summary of
+ * them is emitted: the count, the timestamps of the first and last, and the first one as a sample.
+ * Every notice is either admitted or counted in exactly one summary, once the limiter is flushed.
+ *
+ * The limiter isn't thread-safe. Bucket time is that of the notice timestamps, and of the callers
+ * of notice_limiter_poll().
+ */
+
+// Maximum number of notice types with their own rule.
+#define NOTICE_LIMIT_MAX_RULES 32
+
+// Maximum length of a notice type. Longer ones are truncated.
+#define NOTICE_LIMIT_MAX_NOTICE_TYPE 64
+
+// Maximum length of the sample message kept for a summary. Longer messages are truncated.
+#define NOTICE_LIMIT_MAX_SAMPLE 128
+
+// Number of slots probed for a key.
+#define NOTICE_LIMIT_PROBE 8
+
+// Rule flag: key buckets by message as well as notice type, leaving out the digits of the message.
+#define NOTICE_LIMIT_PER_MESSAGE 1
+
+/*!
+ * @brief Rate limit of a notice type.
+ */
+typedef struct {
+    uint32_t rate;          // Notices per second. 0 admits every notice.
+    uint32_t burst;         // Notices admitted at once, after a quiet period. At least 1 unless rate is 0.
+    int64_t summary_ms;     // If not 0, notice_limiter_poll() summarizes a burst at this interval while it lasts.
+    int flags;              // 0 or NOTICE_LIMIT_PER_MESSAGE.
+} notice_limit_rule_t;
+
+/*!
+ * @brief Summary of suppressed notices. Pointers are only valid for the duration of the emit callback.
+ */
+typedef struct {
+    const char *notice_type;
+    const char *sample;         // The first suppressed message, truncated to NOTICE_LIMIT_MAX_SAMPLE bytes.
+    size_t sample_len;
+    uint64_t count;             // Number of notices suppressed.
+    int64_t first_ms;           // Unix time in milliseconds of the first suppressed notice.
+    int64_t last_ms;            // Unix time in milliseconds of the last suppressed notice.
+    int16_t offset;             // UTC offset in minutes of the first suppressed notice's timestamp.
+} notice_limit_summary_t;
+
+/*!
+ * @brief Counters of a limiter.
+ */
+typedef struct {
+    uint64_t admitted;          // Including those notice_limiter_admit() returned -1 for.
+    uint64_t suppressed;
+    uint64_t summaries;
+    uint64_t untracked;         // Admitted without a bucket, the slots of their key all being in use.
+} notice_limit_stats_t;
+
+/*!
+ * @brief Emit callback. Called once per summary.
+ * @return 0 on success, non-zero on error.
+ */
+typedef int (*notice_limit_emit_fn)(void *ctx, const notice_limit_summary_t *summary);
+
+typedef struct notice_limiter notice_limiter_t;
+
+/*!
+ * @brief Creates a limiter.
+ *
+ * @param capacity Number of buckets, at least NOTICE_LIMIT_PROBE.
+ * @param default_rule Rule of the notice types without their own rule.
+ * @param emit Emit callback.
+ * @param ctx Context passed to the emit callback.
+ * @return Limiter, or NULL on invalid arguments or allocation failure.
+ */
+notice_limiter_t * notice_limiter_new(size_t capacity, const notice_limit_rule_t *default_rule,
+                                      notice_limit_emit_fn emit, void *ctx);
+
+/*!
+ * @brief Sets the rule of a notice type, e.g. "tunnel-core".
+ *
+ * May be called at any time. Buckets in use follow the new rule from then on.
+ *
+ * @return 0 on success, -1 if the rule is invalid or there are too many rules.
+ */
+int notice_limiter_set_rule(notice_limiter_t *l, const char *notice_type, const notice_limit_rule_t *rule);
+
+/*!
+ * @brief Decides whether a notice is written.
+ *
+ * If the notice ends a burst of its key, the burst's summary is emitted first, so that it is written
+ * before the notice.
+ *
+ * @param timestamp RFC3339 timestamp of the notice.
+ * @return 1 if the notice should be written, 0 if it is suppressed, -1 if the timestamp is invalid or the emit
+ *         callback failed, in which case the notice should be written.
+ */
+int notice_limiter_admit(notice_limiter_t *l, const char *notice_type, const char *message, size_t message_len,
+                         const char *timestamp, size_t timestamp_len);
+
+/*!
+ * @brief Emits the summaries of bursts that have ended, or have lasted their rule's summary interval, by now_ms.
+ *
+ * Meant to be called periodically, so that the summary of a burst with no notice after it is written.
+ *
+ * @param now_ms Unix time in milliseconds.
+ * @return 0 on success, -1 if the emit callback failed.
+ */
+int notice_limiter_poll(notice_limiter_t *l, int64_t now_ms);
+
+/*!
+ * @brief Emits the summaries of all bursts, e.g. before the logs are read for feedback.
+ * @return 0 on success, -1 if the emit callback failed.
+ */
+int notice_limiter_flush(notice_limiter_t *l);
+
+void notice_limiter_stats(const notice_limiter_t *l, notice_limit_stats_t *stats);
+
+void notice_limiter_free(notice_limiter_t *l);
+
+/*!
+ * @brief Formats a summary as a single notice JSON line, without the trailing newline:
+ *   {"data":{"message":"suppressed <n> similar messages","count":<n>,"first":"<t0>","last":"<t1>","sample":"..."},
+ *    "noticeType":"<type>","showUser":false,"timestamp":"<t1>"}
+ *
+ * @return Length written, or -1 if dst is too small.
+ */
+long notice_limit_format_json(const notice_limit_summary_t *summary, char *dst, size_t len);
+
+#endif /* NoticeLimiter_h */
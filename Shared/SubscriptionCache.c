@@ -0,0 +1,354 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SubscriptionCache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * File layout:
+ *
+ *   0    magic "PSUB"
+ *   4    version, u16
+ *   6    record length, u16
+ *   8    generation, u64 in the device's byte order: 0 before the first write, then the number of writes.
+ *        The current record is in slot generation % 2.
+ *   16   zero
+ *   64   slot 0
+ *   320  slot 1
+ *
+ * Record layout:
+ *
+ *   0    CRC-32 of bytes 4 to the end
+ *   4    version, u16
+ *   6    zero, u16
+ *   8    generation, u64
+ *   16   receipt hash
+ *   48   receipt file size, u64
+ *   56   latest expiry, i64
+ *   64   authorization expiry, i64
+ *   72   product ID, NUL-padded
+ *   192  authorization ID, NUL-padded
+ */
+
+#define HEADER_LEN 64
+#define GENERATION_OFFSET 8
+#define RECORD_PRODUCT_ID_OFFSET 72
+#define RECORD_AUTHORIZATION_ID_OFFSET (RECORD_PRODUCT_ID_OFFSET + SUBSCRIPTION_CACHE_PRODUCT_ID_SIZE)
+
+// Times a read is retried while writers keep replacing the record.
+#define READ_ATTEMPTS 64
+
+static const uint8_t kMagic[4] = { 'P', 'S', 'U', 'B' };
+
+struct subscription_cache {
+    int fd;
+    int flags;
+    uint8_t *map;
+    _Atomic uint64_t *generation;
+    // Generation whose record has been checked by this handle, so that later reads of it only copy it.
+    _Atomic uint64_t verified;
+};
+
+_Static_assert(RECORD_AUTHORIZATION_ID_OFFSET + SUBSCRIPTION_CACHE_AUTHORIZATION_ID_SIZE ==
+               SUBSCRIPTION_CACHE_RECORD_LEN, "record layout");
+
+/*** Records ***/
+
+static uint8_t * put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    return p + 2;
+}
+
+static uint8_t * put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        *p++ = (uint8_t)(v >> (8 * i));
+    }
+    return p;
+}
+
+static uint8_t * put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        *p++ = (uint8_t)(v >> (8 * i));
+    }
+    return p;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+// Copies a string into a NUL-padded field. Returns 0 on success, -1 if it isn't NUL-terminated within size.
+static int put_string(uint8_t *p, const char *s, size_t size) {
+    const char *nul = memchr(s, '\0', size);
+    if (nul == NULL) {
+        return -1;
+    }
+    size_t len = nul - s;
+    memcpy(p, s, len);
+    memset(p + len, 0, size - len);
+    return 0;
+}
+
+// Reads a NUL-padded field. Returns 0 on success, -1 if it isn't terminated or the padding isn't zero.
+static int get_string(const uint8_t *p, char *s, size_t size) {
+    const uint8_t *nul = memchr(p, '\0', size);
+    if (nul == NULL) {
+        return -1;
+    }
+    for (const uint8_t *q = nul; q < p + size; q++) {
+        if (*q != 0) {
+            return -1;
+        }
+    }
+    memcpy(s, p, size);
+    return 0;
+}
+
+static uint32_t record_crc(const uint8_t *buf) {
+    return (uint32_t)crc32(crc32(0, Z_NULL, 0), buf + 4, SUBSCRIPTION_CACHE_RECORD_LEN - 4);
+}
+
+// Reads the fields of a checked record.
+static void get_fields(const uint8_t *buf, subscription_record_t *record) {
+    memcpy(record->receipt_hash, buf + 16, sizeof(record->receipt_hash));
+    record->receipt_file_size = get_u64(buf + 48);
+    record->latest_expiry_ms = (int64_t)get_u64(buf + 56);
+    record->authorization_expiry_ms = (int64_t)get_u64(buf + 64);
+    memcpy(record->product_id, buf + RECORD_PRODUCT_ID_OFFSET, SUBSCRIPTION_CACHE_PRODUCT_ID_SIZE);
+    memcpy(record->authorization_id, buf + RECORD_AUTHORIZATION_ID_OFFSET, SUBSCRIPTION_CACHE_AUTHORIZATION_ID_SIZE);
+}
+
+// See comment in header
+int subscription_record_encode(const subscription_record_t *record, uint64_t generation,
+                               uint8_t buf[SUBSCRIPTION_CACHE_RECORD_LEN]) {
+    uint8_t *p = buf + 4;
+    p = put_u16(p, SUBSCRIPTION_CACHE_VERSION);
+    p = put_u16(p, 0);
+    p = put_u64(p, generation);
+    memcpy(p, record->receipt_hash, sizeof(record->receipt_hash));
+    p += sizeof(record->receipt_hash);
+    p = put_u64(p, record->receipt_file_size);
+    p = put_u64(p, (uint64_t)record->latest_expiry_ms);
+    put_u64(p, (uint64_t)record->authorization_expiry_ms);
+    if (put_string(buf + RECORD_PRODUCT_ID_OFFSET, record->product_id, SUBSCRIPTION_CACHE_PRODUCT_ID_SIZE) != 0 ||
+        put_string(buf + RECORD_AUTHORIZATION_ID_OFFSET, record->authorization_id,
+                   SUBSCRIPTION_CACHE_AUTHORIZATION_ID_SIZE) != 0) {
+        return -1;
+    }
+    put_u32(buf, record_crc(buf));
+    return 0;
+}
+
+// See comment in header
+int subscription_record_decode(const uint8_t buf[SUBSCRIPTION_CACHE_RECORD_LEN], subscription_record_t *record,
+                               uint64_t *generation) {
+    if (get_u32(buf) != record_crc(buf) || get_u16(buf + 4) != SUBSCRIPTION_CACHE_VERSION || get_u16(buf + 6) != 0) {
+        return -1;
+    }
+    if (get_string(buf + RECORD_PRODUCT_ID_OFFSET, record->product_id, SUBSCRIPTION_CACHE_PRODUCT_ID_SIZE) != 0 ||
+        get_string(buf + RECORD_AUTHORIZATION_ID_OFFSET, record->authorization_id,
+                   SUBSCRIPTION_CACHE_AUTHORIZATION_ID_SIZE) != 0) {
+        return -1;
+    }
+    get_fields(buf, record);
+    if (generation != NULL) {
+        *generation = get_u64(buf + 8);
+    }
+    return 0;
+}
+
+/*** File ***/
+
+static int header_valid(const uint8_t *map) {
+    return memcmp(map, kMagic, sizeof(kMagic)) == 0 && get_u16(map + 4) == SUBSCRIPTION_CACHE_VERSION &&
+           get_u16(map + 6) == SUBSCRIPTION_CACHE_RECORD_LEN;
+}
+
+// Makes the file an empty cache, if it isn't a cache of this version. Must hold the file lock.
+static int initialize(int fd) {
+    struct stat st;
+    uint8_t header[HEADER_LEN];
+    if (fstat(fd, &st) != 0) {
+        return -1;
+    }
+    if (st.st_size == SUBSCRIPTION_CACHE_FILE_LEN && pread(fd, header, sizeof(header), 0) == sizeof(header) &&
+        header_valid(header)) {
+        return 0;
+    }
+
+    uint8_t file[SUBSCRIPTION_CACHE_FILE_LEN] = { 0 };
+    memcpy(file, kMagic, sizeof(kMagic));
+    put_u16(file + 4, SUBSCRIPTION_CACHE_VERSION);
+    put_u16(file + 6, SUBSCRIPTION_CACHE_RECORD_LEN);
+    if (ftruncate(fd, SUBSCRIPTION_CACHE_FILE_LEN) != 0 ||
+        pwrite(fd, file, sizeof(file), 0) != (ssize_t)sizeof(file) || fsync(fd) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// See comment in header
+subscription_cache_t * subscription_cache_open(const char *path, int flags) {
+    int write = (flags & SUBSCRIPTION_CACHE_WRITE) != 0;
+    subscription_cache_t *cache = calloc(1, sizeof(*cache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->flags = flags;
+    cache->map = MAP_FAILED;
+    cache->fd = open(path, write ? O_RDWR | O_CREAT | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0600);
+    if (cache->fd < 0) {
+        goto fail;
+    }
+
+    if (write) {
+        if (flock(cache->fd, LOCK_EX) != 0) {
+            goto fail;
+        }
+        int ret = initialize(cache->fd);
+        flock(cache->fd, LOCK_UN);
+        if (ret != 0) {
+            goto fail;
+        }
+    } else {
+        struct stat st;
+        if (fstat(cache->fd, &st) != 0) {
+            goto fail;
+        }
+        if (st.st_size != SUBSCRIPTION_CACHE_FILE_LEN) {
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+
+    cache->map = mmap(NULL, SUBSCRIPTION_CACHE_FILE_LEN, write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                      cache->fd, 0);
+    if (cache->map == MAP_FAILED) {
+        goto fail;
+    }
+    if (!header_valid(cache->map)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    cache->generation = (_Atomic uint64_t *)(cache->map + GENERATION_OFFSET);
+    atomic_init(&cache->verified, 0);
+    return cache;
+
+fail:
+    subscription_cache_close(cache);
+    return NULL;
+}
+
+// See comment in header
+void subscription_cache_close(subscription_cache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    int saved = errno;
+    if (cache->map != MAP_FAILED) {
+        munmap(cache->map, SUBSCRIPTION_CACHE_FILE_LEN);
+    }
+    if (cache->fd >= 0) {
+        close(cache->fd);
+    }
+    free(cache);
+    errno = saved;
+}
+
+static inline const uint8_t * slot(const subscription_cache_t *cache, uint64_t generation) {
+    return cache->map + HEADER_LEN + (generation % 2) * SUBSCRIPTION_CACHE_RECORD_LEN;
+}
+
+// See comment in header
+int subscription_cache_read(const subscription_cache_t *cache, subscription_record_t *record) {
+    // The handle's note of what it has verified is a cache, not part of its observable state.
+    subscription_cache_t *c = (subscription_cache_t *)cache;
+    uint8_t buf[SUBSCRIPTION_CACHE_RECORD_LEN];
+
+    for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+        uint64_t generation = atomic_load_explicit(cache->generation, memory_order_acquire);
+        if (generation == 0) {
+            return -1;
+        }
+        memcpy(buf, slot(cache, generation), sizeof(buf));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(cache->generation, memory_order_relaxed) != generation) {
+            // A writer replaced the record while it was copied.
+            continue;
+        }
+
+        if (atomic_load_explicit(&c->verified, memory_order_relaxed) == generation) {
+            get_fields(buf, record);
+            return 0;
+        }
+        uint64_t record_generation;
+        if (subscription_record_decode(buf, record, &record_generation) != 0 || record_generation != generation) {
+            return -1;
+        }
+        atomic_store_explicit(&c->verified, generation, memory_order_relaxed);
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+// See comment in header
+int subscription_cache_write(subscription_cache_t *cache, const subscription_record_t *record) {
+    uint8_t buf[SUBSCRIPTION_CACHE_RECORD_LEN];
+    if (!(cache->flags & SUBSCRIPTION_CACHE_WRITE)) {
+        errno = EBADF;
+        return -1;
+    }
+    if (flock(cache->fd, LOCK_EX) != 0) {
+        return -1;
+    }
+
+    // The slot that isn't current, which no reader is relying on.
+    uint64_t generation = atomic_load_explicit(cache->generation, memory_order_relaxed) + 1;
+    int ret = -1;
+    if (subscription_record_encode(record, generation, buf) != 0) {
+        errno = EINVAL;
+        goto done;
+    }
+    memcpy((uint8_t *)slot(cache, generation), buf, sizeof(buf));
+    atomic_store_explicit(cache->generation, generation, memory_order_release);
+    ret = msync(cache->map, SUBSCRIPTION_CACHE_FILE_LEN, MS_SYNC);
+
+done:
+    flock(cache->fd, LOCK_UN);
+    return ret;
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SubscriptionCache_h
+#define SubscriptionCache_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Decoded subscription state, shared between the container and the extension in a small file, in place of
+ * the subscription dictionaries IAPStoreHelper and Subscription keep in NSUserDefaults.
+ *
+ * The state is a fixed-layout record: little-endian integers, NUL-padded strings and a CRC-32, so each
+ * state has exactly one encoding. The file holds a header and two record slots. A writer fills the slot
+ * that isn't current and then publishes it by bumping a generation counter in the header; writers are
+ * serialized with flock(2). Readers map the file and copy the current slot without any lock, checking
+ * that the generation didn't change while they copied it, so a check costs a few loads and a 256 byte
+ * copy rather than reading and parsing a property list.
+ *
+ * The generation counter is in the device's byte order: the file isn't meant to leave the device. A new
+ * version of the format must use a new file, since readers of the old version may have it mapped.
+ */
+
+#define SUBSCRIPTION_CACHE_VERSION 1
+
+// Size of an encoded record.
+#define SUBSCRIPTION_CACHE_RECORD_LEN 256
+
+// Size of the file.
+#define SUBSCRIPTION_CACHE_FILE_LEN (64 + 2 * SUBSCRIPTION_CACHE_RECORD_LEN)
+
+// Sizes of the strings, including the terminating NUL.
+#define SUBSCRIPTION_CACHE_PRODUCT_ID_SIZE 120
+#define SUBSCRIPTION_CACHE_AUTHORIZATION_ID_SIZE 64
+
+// Flag: open for writing, creating the file if needed.
+#define SUBSCRIPTION_CACHE_WRITE 1
+
+/*!
+ * @brief Subscription state as of a receipt.
+ */
+typedef struct {
+    uint8_t receipt_hash[32];           // e.g. the SHA-256 of the receipt the state was decoded from.
+    uint64_t receipt_file_size;
+    int64_t latest_expiry_ms;           // Latest subscription expiry in unix milliseconds, or 0 if none.
+    int64_t authorization_expiry_ms;    // Expiry of the authorization, or 0 if there is none.
+    char product_id[SUBSCRIPTION_CACHE_PRODUCT_ID_SIZE];
+    char authorization_id[SUBSCRIPTION_CACHE_AUTHORIZATION_ID_SIZE];
+} subscription_record_t;
+
+typedef struct subscription_cache subscription_cache_t;
+
+/*!
+ * @brief Opens a cache file.
+ *
+ * @param flags 0 to only read, or SUBSCRIPTION_CACHE_WRITE.
+ * @return Cache, or NULL on error (errno is set). Without SUBSCRIPTION_CACHE_WRITE, a file that doesn't
+ *         exist or isn't a cache of this version is an error.
+ */
+subscription_cache_t * subscription_cache_open(const char *path, int flags);
+
+void subscription_cache_close(subscription_cache_t *cache);
+
+/*!
+ * @brief Reads the current record. Lock-free, and safe against concurrent writers in any process.
+ * @return 0 on success, -1 if nothing has been written yet or the record is corrupt.
+ */
+int subscription_cache_read(const subscription_cache_t *cache, subscription_record_t *record);
+
+/*!
+ * @brief Writes a record and makes it current, and syncs the file.
+ *
+ * Writers with their own handles, in any process, are serialized. Writes through one handle must not be
+ * concurrent.
+ *
+ * @return 0 on success, -1 on error (errno is set), e.g. EBADF if the cache isn't open for writing, or
+ *         EINVAL if a string isn't NUL-terminated.
+ */
+int subscription_cache_write(subscription_cache_t *cache, const subscription_record_t *record);
+
+/*!
+ * @brief Encodes a record. Bytes after the strings' NULs are zero.
+ * @param generation The write the record is for, which readers match against the file's header.
+ * @return 0 on success, -1 if a string isn't NUL-terminated.
+ */
+int subscription_record_encode(const subscription_record_t *record, uint64_t generation,
+                               uint8_t buf[SUBSCRIPTION_CACHE_RECORD_LEN]);
+
+/*!
+ * @brief Decodes a record, checking its version, checksum and padding.
+ * @param generation Populated with the generation the record was written as, or NULL.
+ * @return 0 on success, -1 if the record isn't a valid encoding.
+ */
+int subscription_record_decode(const uint8_t buf[SUBSCRIPTION_CACHE_RECORD_LEN], subscription_record_t *record,
+                               uint64_t *generation);
+
+/*!
+ * @brief Whether the record has a subscription that hasn't expired at now_ms, like
+ *        hasActiveSubscriptionForDate:inDict:getExpiryDate:.
+ */
+static inline int subscription_record_active(const subscription_record_t *record, int64_t now_ms) {
+    return record->latest_expiry_ms != 0 && now_ms <= record->latest_expiry_ms;
+}
+
+/*!
+ * @brief Whether the record has an authorization that hasn't expired at now_ms, like
+ *        hasActiveAuthorizationForDate:.
+ */
+static inline int subscription_record_authorized(const subscription_record_t *record, int64_t now_ms) {
+    return record->authorization_id[0] != '\0' && now_ms <= record->authorization_expiry_ms;
+}
+
+#endif /* SubscriptionCache_h */
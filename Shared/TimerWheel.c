@@ -0,0 +1,538 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TimerWheel.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SLOT_BITS 6
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Largest expiry distance the wheel can represent. Timers further out are parked in the
+// farthest top level slot and re-placed when it comes up.
+#define MAX_DELTA ((INT64_C(1) << (SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+#define NIL UINT32_MAX
+
+// List index of the timers being fired by the current tick.
+#define FIRING_LIST (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+#define NO_LIST UINT16_MAX
+
+#define INITIAL_CAPACITY 64
+
+// Slot minimum that must be recomputed, after the timer holding it was cancelled.
+#define MIN_UNKNOWN INT64_MIN
+
+typedef struct {
+    int64_t expiry;         // Tick.
+    timer_wheel_fn fn;
+    void *ctx;
+    uint32_t prev;
+    uint32_t next;          // Also links the free list.
+    uint32_t gen;
+    uint16_t list;
+} node_t;
+
+struct timer_wheel {
+    int64_t tick_ms;
+    int64_t base_ms;
+    int64_t now_tick;       // Last tick processed.
+
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    uint32_t heads[FIRING_LIST + 1];
+    int64_t slot_min[FIRING_LIST];     // Earliest expiry in each slot, INT64_MAX if empty.
+
+    node_t *nodes;
+    uint32_t capacity;
+    uint32_t free_head;
+    size_t count;
+};
+
+/*** Lists ***/
+
+static void list_push(timer_wheel_t *w, uint32_t list, uint32_t idx) {
+    node_t *n = &w->nodes[idx];
+    n->list = (uint16_t)list;
+    n->prev = NIL;
+    n->next = w->heads[list];
+    if (n->next != NIL) {
+        w->nodes[n->next].prev = idx;
+    }
+    w->heads[list] = idx;
+    if (list < FIRING_LIST) {
+        w->occupied[list / TIMER_WHEEL_SLOTS] |= UINT64_C(1) << (list % TIMER_WHEEL_SLOTS);
+        if (w->slot_min[list] != MIN_UNKNOWN && n->expiry < w->slot_min[list]) {
+            w->slot_min[list] = n->expiry;
+        }
+    }
+}
+
+static void list_remove(timer_wheel_t *w, uint32_t idx) {
+    node_t *n = &w->nodes[idx];
+    if (n->prev != NIL) {
+        w->nodes[n->prev].next = n->next;
+    } else {
+        w->heads[n->list] = n->next;
+    }
+    if (n->next != NIL) {
+        w->nodes[n->next].prev = n->prev;
+    }
+    if (n->list < FIRING_LIST) {
+        if (w->heads[n->list] == NIL) {
+            w->occupied[n->list / TIMER_WHEEL_SLOTS] &= ~(UINT64_C(1) << (n->list % TIMER_WHEEL_SLOTS));
+            w->slot_min[n->list] = INT64_MAX;
+        } else if (n->expiry == w->slot_min[n->list]) {
+            w->slot_min[n->list] = MIN_UNKNOWN;
+        }
+    }
+    n->list = NO_LIST;
+}
+
+// Detaches a slot's list and returns its first node. Nodes keep their links to each other.
+static uint32_t list_take(timer_wheel_t *w, uint32_t list) {
+    uint32_t head = w->heads[list];
+    w->heads[list] = NIL;
+    w->occupied[list / TIMER_WHEEL_SLOTS] &= ~(UINT64_C(1) << (list % TIMER_WHEEL_SLOTS));
+    w->slot_min[list] = INT64_MAX;
+    return head;
+}
+
+/*** Nodes ***/
+
+static uint32_t node_alloc(timer_wheel_t *w) {
+    if (w->free_head == NIL) {
+        if (w->capacity >= NIL / 2) {
+            return NIL;
+        }
+        uint32_t capacity = w->capacity * 2;
+        node_t *nodes = realloc(w->nodes, capacity * sizeof(node_t));
+        if (nodes == NULL) {
+            return NIL;
+        }
+        for (uint32_t i = w->capacity; i < capacity; i++) {
+            nodes[i].gen = 1;
+            nodes[i].list = NO_LIST;
+            nodes[i].next = i + 1 < capacity ? i + 1 : NIL;
+        }
+        w->nodes = nodes;
+        w->free_head = w->capacity;
+        w->capacity = capacity;
+    }
+    uint32_t idx = w->free_head;
+    w->free_head = w->nodes[idx].next;
+    w->count++;
+    return idx;
+}
+
+static void node_free(timer_wheel_t *w, uint32_t idx) {
+    node_t *n = &w->nodes[idx];
+    n->gen++;
+    n->list = NO_LIST;
+    n->next = w->free_head;
+    w->free_head = idx;
+    w->count--;
+}
+
+static inline timer_wheel_id_t node_id(const timer_wheel_t *w, uint32_t idx) {
+    return ((uint64_t)w->nodes[idx].gen << 32) | (uint64_t)(idx + 1);
+}
+
+// Returns the node index of a pending timer, or NIL.
+static uint32_t node_lookup(const timer_wheel_t *w, timer_wheel_id_t id) {
+    uint64_t low = id & UINT32_MAX;
+    if (low == 0 || low > w->capacity) {
+        return NIL;
+    }
+    uint32_t idx = (uint32_t)(low - 1);
+    const node_t *n = &w->nodes[idx];
+    if (n->gen != (uint32_t)(id >> 32) || n->list == NO_LIST) {
+        return NIL;
+    }
+    return idx;
+}
+
+/*** Wheel ***/
+
+// Places a node in the slot for its expiry, relative to the current tick.
+static void place(timer_wheel_t *w, uint32_t idx) {
+    int64_t expiry = w->nodes[idx].expiry;
+    if (expiry < w->now_tick) {
+        expiry = w->now_tick;
+    }
+    int64_t delta = expiry - w->now_tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expiry = w->now_tick + MAX_DELTA;
+    }
+
+    unsigned level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (INT64_C(1) << (SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    unsigned slot = (unsigned)(expiry >> (SLOT_BITS * level)) & SLOT_MASK;
+    list_push(w, level * TIMER_WHEEL_SLOTS + slot, idx);
+}
+
+// Moves the timers of every higher level slot that comes up at tick down the wheel.
+// Called when tick is a multiple of TIMER_WHEEL_SLOTS, after now_tick was set to it.
+static void cascade(timer_wheel_t *w, int64_t tick) {
+    for (int level = TIMER_WHEEL_LEVELS - 1; level >= 1; level--) {
+        if ((tick & ((INT64_C(1) << (SLOT_BITS * level)) - 1)) != 0) {
+            continue;
+        }
+        unsigned slot = (unsigned)(tick >> (SLOT_BITS * level)) & SLOT_MASK;
+        uint32_t idx = list_take(w, (uint32_t)(level * TIMER_WHEEL_SLOTS + slot));
+        while (idx != NIL) {
+            uint32_t next = w->nodes[idx].next;
+            place(w, idx);
+            idx = next;
+        }
+    }
+}
+
+static size_t fire_slot(timer_wheel_t *w, unsigned slot) {
+    // Move the slot to the firing list first, so callbacks can cancel timers that are yet to fire.
+    uint32_t idx = list_take(w, slot);
+    while (idx != NIL) {
+        uint32_t next = w->nodes[idx].next;
+        list_push(w, FIRING_LIST, idx);
+        idx = next;
+    }
+
+    size_t fired = 0;
+    while ((idx = w->heads[FIRING_LIST]) != NIL) {
+        timer_wheel_fn fn = w->nodes[idx].fn;
+        void *ctx = w->nodes[idx].ctx;
+        list_remove(w, idx);
+        node_free(w, idx);
+        fn(ctx);
+        fired++;
+    }
+    return fired;
+}
+
+static inline uint64_t rotate_right(uint64_t x, unsigned k) {
+    return k == 0 ? x : (x >> k) | (x << (64 - k));
+}
+
+// See comment in header
+timer_wheel_t * timer_wheel_new(int64_t tick_ms, int64_t now_ms) {
+    if (tick_ms <= 0) {
+        return NULL;
+    }
+    timer_wheel_t *w = calloc(1, sizeof(timer_wheel_t));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->nodes = malloc(INITIAL_CAPACITY * sizeof(node_t));
+    if (w->nodes == NULL) {
+        free(w);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < INITIAL_CAPACITY; i++) {
+        w->nodes[i].gen = 1;
+        w->nodes[i].list = NO_LIST;
+        w->nodes[i].next = i + 1 < INITIAL_CAPACITY ? i + 1 : NIL;
+    }
+    w->capacity = INITIAL_CAPACITY;
+    w->free_head = 0;
+    for (size_t i = 0; i <= FIRING_LIST; i++) {
+        w->heads[i] = NIL;
+    }
+    for (size_t i = 0; i < FIRING_LIST; i++) {
+        w->slot_min[i] = INT64_MAX;
+    }
+    w->tick_ms = tick_ms;
+    w->base_ms = now_ms;
+    return w;
+}
+
+// See comment in header
+void timer_wheel_free(timer_wheel_t *w) {
+    if (w == NULL) {
+        return;
+    }
+    free(w->nodes);
+    free(w);
+}
+
+// See comment in header
+timer_wheel_id_t timer_wheel_add(timer_wheel_t *w, int64_t deadline_ms, int64_t slack_ms, timer_wheel_fn fn, void *ctx) {
+    uint32_t idx = node_alloc(w);
+    if (idx == NIL) {
+        return 0;
+    }
+
+    // Earliest tick at or after the deadline.
+    int64_t since_base = deadline_ms - w->base_ms;
+    int64_t expiry = since_base <= 0 ? 0 : (since_base + w->tick_ms - 1) / w->tick_ms;
+
+    // Round up to the largest power of two ticks within the slack, so that timers with
+    // overlapping windows share a tick.
+    int64_t slack_ticks = slack_ms > 0 ? slack_ms / w->tick_ms : 0;
+    if (slack_ticks > 1) {
+        int64_t granularity = 1;
+        while (granularity <= slack_ticks / 2) {
+            granularity <<= 1;
+        }
+        expiry = (expiry + granularity - 1) & ~(granularity - 1);
+    }
+    if (expiry <= w->now_tick) {
+        expiry = w->now_tick + 1;
+    }
+
+    node_t *n = &w->nodes[idx];
+    n->expiry = expiry;
+    n->fn = fn;
+    n->ctx = ctx;
+    place(w, idx);
+    return node_id(w, idx);
+}
+
+// See comment in header
+int timer_wheel_cancel(timer_wheel_t *w, timer_wheel_id_t id) {
+    uint32_t idx = node_lookup(w, id);
+    if (idx == NIL) {
+        return -1;
+    }
+    list_remove(w, idx);
+    node_free(w, idx);
+    return 0;
+}
+
+// See comment in header
+size_t timer_wheel_advance(timer_wheel_t *w, int64_t now_ms) {
+    if (now_ms < w->base_ms) {
+        return 0;
+    }
+    int64_t target = (now_ms - w->base_ms) / w->tick_ms;
+    size_t fired = 0;
+
+    while (w->now_tick < target) {
+        // Skip to the next occupied level 0 slot, or the next cascade, whichever comes first.
+        int64_t t = w->now_tick + 1;
+        unsigned offset = (unsigned)t & SLOT_MASK;
+        uint64_t pending = w->occupied[0] & (~UINT64_C(0) << offset);
+        int64_t next;
+        if (offset == 0 || pending == 0) {
+            next = t - offset + (offset == 0 ? 0 : TIMER_WHEEL_SLOTS);
+        } else {
+            next = t - offset + __builtin_ctzll(pending);
+        }
+        if (next > target) {
+            w->now_tick = target;
+            break;
+        }
+
+        w->now_tick = next;
+        if ((next & SLOT_MASK) == 0) {
+            cascade(w, next);
+        }
+        fired += fire_slot(w, (unsigned)next & SLOT_MASK);
+    }
+    return fired;
+}
+
+// See comment in header
+int timer_wheel_next_expiry(timer_wheel_t *w, int64_t *expiry_ms) {
+    if (w->count == 0) {
+        return -1;
+    }
+
+    // Slots of each level are in expiry order starting from the one after the current position,
+    // so only the first occupied slot of each level needs to be looked at. Higher level slots
+    // keep their earliest expiry, which is only recomputed after it was cancelled.
+    int64_t best = INT64_MAX;
+    for (unsigned level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if (w->occupied[level] == 0) {
+            continue;
+        }
+        unsigned start = (unsigned)((w->now_tick >> (SLOT_BITS * level)) + 1) & SLOT_MASK;
+        uint64_t rotated = rotate_right(w->occupied[level], start);
+        unsigned slot = (start + (unsigned)__builtin_ctzll(rotated)) & SLOT_MASK;
+        if (level == 0) {
+            int64_t expiry = w->now_tick + 1 + __builtin_ctzll(rotated);
+            if (expiry < best) {
+                best = expiry;
+            }
+            continue;
+        }
+        uint32_t list = level * TIMER_WHEEL_SLOTS + slot;
+        if (w->slot_min[list] == MIN_UNKNOWN) {
+            int64_t min = INT64_MAX;
+            for (uint32_t idx = w->heads[list]; idx != NIL; idx = w->nodes[idx].next) {
+                if (w->nodes[idx].expiry < min) {
+                    min = w->nodes[idx].expiry;
+                }
+            }
+            w->slot_min[list] = min;
+        }
+        if (w->slot_min[list] < best) {
+            best = w->slot_min[list];
+        }
+    }
+
+    *expiry_ms = w->base_ms + best * w->tick_ms;
+    return 0;
+}
+
+// See comment in header
+size_t timer_wheel_count(const timer_wheel_t *w) {
+    return w->count;
+}
+
+/*** Driver ***/
+
+struct timer_wheel_driver {
+    timer_wheel_t *wheel;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+    int64_t sleep_until_ms;     // INT64_MAX while waiting without a deadline.
+    uint64_t wakeups;
+};
+
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Waits on the driver's condition until signalled or until deadline_ms on the monotonic clock.
+static void wait_until(timer_wheel_driver_t *d, int64_t deadline_ms) {
+    int64_t remaining = deadline_ms - monotonic_ms();
+    if (remaining <= 0) {
+        return;
+    }
+#if defined(__APPLE__)
+    // Apple platforms lack pthread_condattr_setclock.
+    struct timespec ts = { (time_t)(remaining / 1000), (long)(remaining % 1000) * 1000000 };
+    pthread_cond_timedwait_relative_np(&d->cond, &d->lock, &ts);
+#else
+    struct timespec ts = { (time_t)(deadline_ms / 1000), (long)(deadline_ms % 1000) * 1000000 };
+    pthread_cond_timedwait(&d->cond, &d->lock, &ts);
+#endif
+}
+
+static void * driver_main(void *arg) {
+    timer_wheel_driver_t *d = arg;
+    pthread_mutex_lock(&d->lock);
+    while (!d->stop) {
+        timer_wheel_advance(d->wheel, monotonic_ms());
+        int64_t next;
+        if (timer_wheel_next_expiry(d->wheel, &next) == 0) {
+            d->sleep_until_ms = next;
+            wait_until(d, next);
+        } else {
+            d->sleep_until_ms = INT64_MAX;
+            pthread_cond_wait(&d->cond, &d->lock);
+        }
+        d->wakeups++;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
+
+// See comment in header
+timer_wheel_driver_t * timer_wheel_driver_new(int64_t tick_ms) {
+    timer_wheel_driver_t *d = calloc(1, sizeof(timer_wheel_driver_t));
+    if (d == NULL) {
+        return NULL;
+    }
+    d->wheel = timer_wheel_new(tick_ms, monotonic_ms());
+    if (d->wheel == NULL) {
+        free(d);
+        return NULL;
+    }
+
+    // Recursive, so that callbacks running on the driver thread can add and cancel timers.
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&d->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+#if !defined(__APPLE__)
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&d->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    d->sleep_until_ms = INT64_MAX;
+    if (pthread_create(&d->thread, NULL, driver_main, d) != 0) {
+        pthread_cond_destroy(&d->cond);
+        pthread_mutex_destroy(&d->lock);
+        timer_wheel_free(d->wheel);
+        free(d);
+        return NULL;
+    }
+    return d;
+}
+
+// See comment in header
+void timer_wheel_driver_free(timer_wheel_driver_t *d) {
+    if (d == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&d->lock);
+    d->stop = 1;
+    pthread_cond_signal(&d->cond);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    pthread_cond_destroy(&d->cond);
+    pthread_mutex_destroy(&d->lock);
+    timer_wheel_free(d->wheel);
+    free(d);
+}
+
+// See comment in header
+timer_wheel_id_t timer_wheel_driver_add(timer_wheel_driver_t *d, int64_t delay_ms, int64_t slack_ms,
+                                        timer_wheel_fn fn, void *ctx) {
+    pthread_mutex_lock(&d->lock);
+    timer_wheel_id_t id = timer_wheel_add(d->wheel, monotonic_ms() + delay_ms, slack_ms, fn, ctx);
+    int64_t next;
+    if (id != 0 && timer_wheel_next_expiry(d->wheel, &next) == 0 && next < d->sleep_until_ms) {
+        d->sleep_until_ms = next;
+        pthread_cond_signal(&d->cond);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return id;
+}
+
+// See comment in header
+int timer_wheel_driver_cancel(timer_wheel_driver_t *d, timer_wheel_id_t id) {
+    pthread_mutex_lock(&d->lock);
+    int rc = timer_wheel_cancel(d->wheel, id);
+    pthread_mutex_unlock(&d->lock);
+    return rc;
+}
+
+// See comment in header
+uint64_t timer_wheel_driver_wakeups(timer_wheel_driver_t *d) {
+    pthread_mutex_lock(&d->lock);
+    uint64_t wakeups = d->wakeups;
+    pthread_mutex_unlock(&d->lock);
+    return wakeups;
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TimerWheel_h
+#define TimerWheel_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hierarchical timing wheel for coalescing the app's periodic and one-shot work
+ * (profiling, subscription checks, grace period, purchase expiry) onto a single thread.
+ *
+ * Time is divided into ticks of a fixed number of milliseconds. The wheel has TIMER_WHEEL_LEVELS
+ * levels of TIMER_WHEEL_SLOTS slots each; a timer is kept at the lowest level whose span covers its
+ * expiry, and moves down a level each time its slot comes up. Insert and cancel are O(1).
+ *
+ * Each timer has a slack: it may fire at any point in [deadline, deadline + slack]. Expiries are
+ * rounded up to the largest power-of-two number of ticks that fits in the slack, so timers with
+ * overlapping windows land on the same tick and fire on the same wakeup.
+ *
+ * timer_wheel_t is not thread-safe. timer_wheel_driver_t wraps a wheel with a driver thread that
+ * sleeps until the next expiry and can be used from any thread.
+ */
+
+#define TIMER_WHEEL_LEVELS 6
+#define TIMER_WHEEL_SLOTS 64
+
+/*!
+ * @brief Timer callback. Called once when the timer fires.
+ */
+typedef void (*timer_wheel_fn)(void *ctx);
+
+/*!
+ * @brief Timer handle. 0 is never a valid handle.
+ */
+typedef uint64_t timer_wheel_id_t;
+
+typedef struct timer_wheel timer_wheel_t;
+
+/*!
+ * @brief Creates a wheel.
+ *
+ * @param tick_ms Tick length in milliseconds. Timers fire at tick granularity.
+ * @param now_ms Current time in milliseconds, on whatever monotonic clock the caller uses for deadlines.
+ * @return Wheel, or NULL on invalid arguments or allocation failure.
+ */
+timer_wheel_t * timer_wheel_new(int64_t tick_ms, int64_t now_ms);
+
+/*!
+ * @brief Frees the wheel. Pending timers are dropped without firing.
+ */
+void timer_wheel_free(timer_wheel_t *w);
+
+/*!
+ * @brief Schedules a timer.
+ *
+ * Deadlines at or before the wheel's current time fire on the next tick.
+ *
+ * @param deadline_ms Earliest time to fire.
+ * @param slack_ms How late the timer may fire, for coalescing with other timers.
+ * @return Handle, or 0 if allocation failed.
+ */
+timer_wheel_id_t timer_wheel_add(timer_wheel_t *w, int64_t deadline_ms, int64_t slack_ms, timer_wheel_fn fn, void *ctx);
+
+/*!
+ * @brief Cancels a pending timer.
+ * @return 0 if the timer was cancelled, -1 if it already fired or was cancelled.
+ */
+int timer_wheel_cancel(timer_wheel_t *w, timer_wheel_id_t id);
+
+/*!
+ * @brief Advances the wheel to now_ms, firing every timer that expired in order of expiry.
+ *
+ * Callbacks may add and cancel timers, but must not call timer_wheel_advance.
+ *
+ * @return Number of timers fired.
+ */
+size_t timer_wheel_advance(timer_wheel_t *w, int64_t now_ms);
+
+/*!
+ * @brief Time at which the earliest pending timer fires.
+ * @return 0 if there is a pending timer, -1 if the wheel is empty.
+ */
+int timer_wheel_next_expiry(timer_wheel_t *w, int64_t *expiry_ms);
+
+/*!
+ * @brief Number of pending timers.
+ */
+size_t timer_wheel_count(const timer_wheel_t *w);
+
+/*** Driver ***/
+
+typedef struct timer_wheel_driver timer_wheel_driver_t;
+
+/*!
+ * @brief Starts a driver thread for a new wheel, on the monotonic clock.
+ *
+ * Callbacks run on the driver thread with the driver's lock held. They should be short, e.g. a
+ * dispatch to a queue, and may add or cancel timers.
+ *
+ * @return Driver, or NULL on failure.
+ */
+timer_wheel_driver_t * timer_wheel_driver_new(int64_t tick_ms);
+
+/*!
+ * @brief Stops the driver thread and frees the driver. Pending timers are dropped without firing.
+ *
+ * Must not be called from a timer callback.
+ */
+void timer_wheel_driver_free(timer_wheel_driver_t *d);
+
+/*!
+ * @brief Schedules a timer delay_ms from now. Thread-safe.
+ *
+ * The driver thread is only woken if the new timer fires before its current wakeup.
+ *
+ * @return Handle, or 0 if allocation failed.
+ */
+timer_wheel_id_t timer_wheel_driver_add(timer_wheel_driver_t *d, int64_t delay_ms, int64_t slack_ms,
+                                        timer_wheel_fn fn, void *ctx);
+
+/*!
+ * @brief Cancels a pending timer. Thread-safe.
+ * @return 0 if the timer was cancelled, -1 if it already fired or was cancelled.
+ */
+int timer_wheel_driver_cancel(timer_wheel_driver_t *d, timer_wheel_id_t id);
+
+/*!
+ * @brief Number of times the driver thread has woken up, e.g. for comparing against one timer per task.
+ */
+uint64_t timer_wheel_driver_wakeups(timer_wheel_driver_t *d);
+
+#endif /* TimerWheel_h */
@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TimestampColumn.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NSEC_PER_SEC INT64_C(1000000000)
+
+// Longest varint, and longest block header: unit, count, offset, anchor seconds and nanoseconds.
+#define MAX_VARINT_LEN 10
+#define MAX_HEADER_LEN (1 + 4 * MAX_VARINT_LEN)
+
+// Furthest a timestamp may be from its block's anchor, so that its delta in nanoseconds, and the
+// difference of two such deltas, fit in 64 bits.
+#define MAX_ANCHOR_DISTANCE_SEC INT32_MAX
+
+// Timestamps decoded at a time when formatting.
+#define FORMAT_CHUNK 64
+
+// Nanoseconds per unit, by unit byte.
+static const int64_t unit_nsec[4] = { NSEC_PER_SEC, 1000000, 1000, 1 };
+
+typedef struct {
+    size_t offset;      // Offset of the block's body in data.
+    size_t len;         // Length of the body.
+    size_t first;       // Index of the block's first timestamp in the column.
+    size_t count;
+} block_t;
+
+struct timestamp_column {
+    size_t block_len;
+    uint8_t *data;      // Encoded blocks.
+    size_t len;
+    size_t capacity;
+    block_t *blocks;    // Encoded blocks.
+    size_t block_count;
+    size_t block_capacity;
+    size_t encoded;     // Timestamps in encoded blocks.
+    timestamp_t *current;   // Timestamps of the current block, not yet encoded.
+    size_t current_count;
+    uint8_t *scratch;   // Body of the block being encoded.
+};
+
+/*** Varints ***/
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t u) {
+    return (int64_t)((u >> 1) ^ (~(u & 1) + 1));
+}
+
+static inline uint8_t * put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+// Reads a varint at *pp, advancing it. Returns false if the varint is truncated or longer than 64 bits.
+static inline bool get_varint(const uint8_t **pp, const uint8_t *end, uint64_t *v) {
+    const uint8_t *p = *pp;
+    if (p < end && *p < 0x80) {
+        *v = *p;
+        *pp = p + 1;
+        return true;
+    }
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (p == end) {
+            return false;
+        }
+        uint8_t b = *p++;
+        if (shift == 63 && b > 1) {
+            return false;
+        }
+        result |= (uint64_t)(b & 0x7f) << shift;
+        if (b < 0x80) {
+            *v = result;
+            *pp = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*** Blocks ***/
+
+static int64_t floor_div(int64_t a, int64_t b, int64_t *rem) {
+    int64_t q = a / b, r = a % b;
+    if (r < 0) {
+        r += b;
+        q--;
+    }
+    *rem = r;
+    return q;
+}
+
+// Coarsest unit that represents every timestamp exactly.
+static int block_unit(const timestamp_t *ts, size_t count) {
+    int unit = 0;
+    for (size_t i = 0; i < count && unit < 3; i++) {
+        int32_t nsec = ts[i].nsec;
+        int u = (nsec == 0) ? 0 : (nsec % 1000000 == 0) ? 1 : (nsec % 1000 == 0) ? 2 : 3;
+        if (u > unit) {
+            unit = u;
+        }
+    }
+    return unit;
+}
+
+// Encodes the current block onto the end of data.
+static int end_block(timestamp_column_t *c) {
+    if (c->current_count == 0) {
+        return 0;
+    }
+
+    const timestamp_t *ts = c->current;
+    size_t count = c->current_count;
+    int unit = block_unit(ts, count);
+    int64_t per_unit = unit_nsec[unit];
+
+    uint8_t *p = c->scratch;
+    *p++ = (uint8_t)unit;
+    p = put_varint(p, count);
+    p = put_varint(p, zigzag(ts[0].offset));
+    p = put_varint(p, zigzag(ts[0].sec));
+    p = put_varint(p, (uint64_t)ts[0].nsec);
+    int64_t prev = 0, prev_delta = 0;
+    for (size_t i = 1; i < count; i++) {
+        // Exact, as both nanoseconds are multiples of the unit.
+        int64_t t = ((ts[i].sec - ts[0].sec) * NSEC_PER_SEC + ts[i].nsec - ts[0].nsec) / per_unit;
+        int64_t delta = t - prev;
+        p = put_varint(p, zigzag(delta - prev_delta));
+        prev = t;
+        prev_delta = delta;
+    }
+    size_t body_len = (size_t)(p - c->scratch);
+
+    if (c->len + MAX_VARINT_LEN + body_len > c->capacity) {
+        size_t capacity = c->capacity ? c->capacity : 256;
+        while (c->len + MAX_VARINT_LEN + body_len > capacity) {
+            capacity *= 2;
+        }
+        uint8_t *data = realloc(c->data, capacity);
+        if (data == NULL) {
+            return -1;
+        }
+        c->data = data;
+        c->capacity = capacity;
+    }
+    if (c->block_count == c->block_capacity) {
+        size_t capacity = c->block_capacity ? c->block_capacity * 2 : 16;
+        block_t *blocks = realloc(c->blocks, capacity * sizeof(*blocks));
+        if (blocks == NULL) {
+            return -1;
+        }
+        c->blocks = blocks;
+        c->block_capacity = capacity;
+    }
+
+    uint8_t *start = put_varint(c->data + c->len, body_len);
+    memcpy(start, c->scratch, body_len);
+    c->blocks[c->block_count++] = (block_t){ (size_t)(start - c->data), body_len, c->encoded, count };
+    c->len = (size_t)(start - c->data) + body_len;
+    c->encoded += count;
+    c->current_count = 0;
+    return 0;
+}
+
+/*
+ * Reader of a block's timestamps in order. With check, the block must be well formed and decode to
+ * valid timestamps; otherwise it is trusted to be, having been encoded here or checked when loaded.
+ */
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    timestamp_t anchor;
+    int64_t per_unit;
+    int64_t t;          // Units since the anchor.
+    int64_t delta;
+    size_t count;
+    size_t next;        // Index of the next timestamp in the block.
+    bool check;
+} cursor_t;
+
+// Reads a block's header. Returns false if it is malformed.
+static bool cursor_open(cursor_t *r, const uint8_t *body, size_t len, bool check) {
+    uint64_t unit, count, offset, sec, nsec;
+    r->p = body;
+    r->end = body + len;
+    if (r->p == r->end || (unit = *r->p++) > 3 || !get_varint(&r->p, r->end, &count) ||
+        !get_varint(&r->p, r->end, &offset) || !get_varint(&r->p, r->end, &sec) ||
+        !get_varint(&r->p, r->end, &nsec)) {
+        return false;
+    }
+    r->anchor = (timestamp_t){ unzigzag(sec), (int32_t)nsec, (int16_t)unzigzag(offset) };
+    if (check && (count == 0 || count > TIMESTAMP_COLUMN_MAX_BLOCK_LEN || nsec >= (uint64_t)NSEC_PER_SEC ||
+                  unzigzag(offset) != r->anchor.offset || !timestamp_valid(&r->anchor))) {
+        return false;
+    }
+    r->per_unit = unit_nsec[unit];
+    r->t = 0;
+    r->delta = 0;
+    r->count = (size_t)count;
+    r->next = 0;
+    r->check = check;
+    return true;
+}
+
+// Reads the next timestamp. Returns false at the end of the block, or if it is malformed.
+static inline bool cursor_next(cursor_t *r, timestamp_t *ts) {
+    if (r->next == r->count) {
+        return false;
+    }
+    *ts = r->anchor;
+    if (r->next++ == 0) {
+        return true;
+    }
+
+    uint64_t u;
+    int64_t ns, rem;
+    if (!get_varint(&r->p, r->end, &u) || __builtin_add_overflow(r->delta, unzigzag(u), &r->delta) ||
+        __builtin_add_overflow(r->t, r->delta, &r->t) || __builtin_mul_overflow(r->t, r->per_unit, &ns) ||
+        __builtin_add_overflow(ns, (int64_t)r->anchor.nsec, &ns)) {
+        return false;
+    }
+    ts->sec = r->anchor.sec + floor_div(ns, NSEC_PER_SEC, &rem);
+    ts->nsec = (int32_t)rem;
+    return !r->check || timestamp_valid(ts);
+}
+
+// Skips timestamps of a block. Returns the number skipped.
+static size_t cursor_skip(cursor_t *r, size_t n) {
+    timestamp_t ts;
+    size_t skipped = 0;
+    while (skipped < n && cursor_next(r, &ts)) {
+        skipped++;
+    }
+    return skipped;
+}
+
+/*** Column ***/
+
+static timestamp_column_t * column_new(size_t block_len) {
+    if (block_len < 1 || block_len > TIMESTAMP_COLUMN_MAX_BLOCK_LEN) {
+        return NULL;
+    }
+    timestamp_column_t *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->block_len = block_len;
+    c->current = malloc(block_len * sizeof(*c->current));
+    c->scratch = malloc(MAX_HEADER_LEN + block_len * MAX_VARINT_LEN);
+    if (c->current == NULL || c->scratch == NULL) {
+        timestamp_column_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+// See comment in header
+timestamp_column_t * timestamp_column_new(size_t block_len) {
+    return column_new(block_len);
+}
+
+// See comment in header
+timestamp_column_t * timestamp_column_load(const void *data, size_t len, size_t block_len) {
+    timestamp_column_t *c = column_new(block_len);
+    if (c == NULL) {
+        return NULL;
+    }
+    if (len > 0) {
+        c->data = malloc(len);
+        if (c->data == NULL) {
+            timestamp_column_free(c);
+            return NULL;
+        }
+        memcpy(c->data, data, len);
+        c->len = c->capacity = len;
+    }
+
+    const uint8_t *p = c->data, *end = c->data + len;
+    while (p < end) {
+        uint64_t body_len;
+        cursor_t r;
+        if (!get_varint(&p, end, &body_len) || body_len > (uint64_t)(end - p) ||
+            !cursor_open(&r, p, (size_t)body_len, true) || cursor_skip(&r, r.count) != r.count || r.p != r.end) {
+            timestamp_column_free(c);
+            return NULL;
+        }
+        if (c->block_count == c->block_capacity) {
+            size_t capacity = c->block_capacity ? c->block_capacity * 2 : 16;
+            block_t *blocks = realloc(c->blocks, capacity * sizeof(*blocks));
+            if (blocks == NULL) {
+                timestamp_column_free(c);
+                return NULL;
+            }
+            c->blocks = blocks;
+            c->block_capacity = capacity;
+        }
+        c->blocks[c->block_count++] = (block_t){ (size_t)(p - c->data), (size_t)body_len, c->encoded, r.count };
+        c->encoded += r.count;
+        p += body_len;
+    }
+    return c;
+}
+
+// See comment in header
+void timestamp_column_free(timestamp_column_t *c) {
+    if (c == NULL) {
+        return;
+    }
+    free(c->data);
+    free(c->blocks);
+    free(c->current);
+    free(c->scratch);
+    free(c);
+}
+
+// See comment in header
+int timestamp_column_append(timestamp_column_t *c, const timestamp_t *tsp) {
+    if (!timestamp_valid(tsp)) {
+        return -1;
+    }
+    if (c->current_count > 0) {
+        const timestamp_t *anchor = &c->current[0];
+        int64_t distance = tsp->sec - anchor->sec;
+        if ((tsp->offset != anchor->offset || distance > MAX_ANCHOR_DISTANCE_SEC ||
+             distance < -MAX_ANCHOR_DISTANCE_SEC) && end_block(c) != 0) {
+            return -1;
+        }
+    }
+    c->current[c->current_count++] = *tsp;
+    if (c->current_count == c->block_len && end_block(c) != 0) {
+        // Leave the column as it was before the append.
+        c->current_count--;
+        return -1;
+    }
+    return 0;
+}
+
+// See comment in header
+int timestamp_column_flush(timestamp_column_t *c) {
+    return end_block(c);
+}
+
+// See comment in header
+const uint8_t * timestamp_column_data(const timestamp_column_t *c, size_t *len) {
+    *len = c->len;
+    return c->data;
+}
+
+// See comment in header
+size_t timestamp_column_count(const timestamp_column_t *c) {
+    return c->encoded + c->current_count;
+}
+
+// See comment in header
+size_t timestamp_column_block_count(const timestamp_column_t *c) {
+    return c->block_count + (c->current_count > 0);
+}
+
+// See comment in header
+int timestamp_column_block(const timestamp_column_t *c, size_t block, size_t *first, size_t *count) {
+    if (block < c->block_count) {
+        *first = c->blocks[block].first;
+        *count = c->blocks[block].count;
+        return 0;
+    }
+    if (block == c->block_count && c->current_count > 0) {
+        *first = c->encoded;
+        *count = c->current_count;
+        return 0;
+    }
+    return -1;
+}
+
+// See comment in header
+long timestamp_column_block_of(const timestamp_column_t *c, size_t index) {
+    if (index >= timestamp_column_count(c)) {
+        return -1;
+    }
+    if (index >= c->encoded) {
+        return (long)c->block_count;
+    }
+    size_t lo = 0, hi = c->block_count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (c->blocks[mid].first <= index) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return (long)lo;
+}
+
+/*
+ * Reads the timestamps at [first, first + count). Without fn, they are written to buf, which has room
+ * for count. With fn, they are passed to it in chunks of up to max, read into buf. Returns the number of
+ * timestamps read.
+ */
+static size_t read_range(const timestamp_column_t *c, size_t first, size_t count, timestamp_t *buf, size_t max,
+                         void (*fn)(const timestamp_t *ts, size_t n, void *key), void *key) {
+    long block = timestamp_column_block_of(c, first);
+    if (block < 0) {
+        return 0;
+    }
+    if (count > timestamp_column_count(c) - first) {
+        count = timestamp_column_count(c) - first;
+    }
+
+    size_t read = 0;
+    for (size_t b = (size_t)block; b < c->block_count && read < count; b++) {
+        const block_t *k = &c->blocks[b];
+        cursor_t r;
+        cursor_open(&r, c->data + k->offset, k->len, false);
+        cursor_skip(&r, first + read - k->first);
+        while (read < count && r.next < r.count) {
+            timestamp_t *dst = fn ? buf : buf + read;
+            size_t n = 0, want = count - read < max ? count - read : max;
+            while (n < want && cursor_next(&r, &dst[n])) {
+                n++;
+            }
+            if (fn) {
+                fn(buf, n, key);
+            }
+            read += n;
+        }
+    }
+    while (read < count) {
+        timestamp_t *dst = fn ? buf : buf + read;
+        size_t n = count - read < max ? count - read : max;
+        memcpy(dst, c->current + (first + read - c->encoded), n * sizeof(*dst));
+        if (fn) {
+            fn(buf, n, key);
+        }
+        read += n;
+    }
+    return read;
+}
+
+// See comment in header
+size_t timestamp_column_decode(const timestamp_column_t *c, size_t first, size_t count, timestamp_t *out) {
+    return read_range(c, first, count, out, SIZE_MAX, NULL, NULL);
+}
+
+/*** Formatting ***/
+
+static const uint32_t pow10[10] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+
+typedef struct {
+    const char *prev;   // Previous string, or NULL.
+    size_t prev_len;
+    int64_t day;        // Local day of the previous string.
+    int16_t offset;
+} format_state_t;
+
+static void format_one(const timestamp_t *ts, int precision, char *dst, format_state_t *f) {
+    int64_t sod;
+    int64_t day = floor_div(ts->sec + ts->offset * 60, 86400, &sod);
+    if (f->prev == NULL || day != f->day || ts->offset != f->offset) {
+        size_t len = timestamp_format_precision(dst, TIMESTAMP_COLUMN_STRING_LEN, ts, precision);
+        f->prev = dst;
+        f->prev_len = len;
+        f->day = day;
+        f->offset = ts->offset;
+        return;
+    }
+
+    // Same date and offset: only the time of day and fraction differ. See timestamp_format_internal.
+    memcpy(dst, f->prev, f->prev_len + 1);
+    uint32_t v = (uint32_t)sod;
+    dst[18] = (char)('0' + v % 10); v /= 10;
+    dst[17] = (char)('0' + v % 6); v /= 6;
+    dst[15] = (char)('0' + v % 10); v /= 10;
+    dst[14] = (char)('0' + v % 6); v /= 6;
+    dst[12] = (char)('0' + v % 10); v /= 10;
+    dst[11] = (char)('0' + v % 10);
+    if (precision > 0) {
+        v = (uint32_t)ts->nsec / pow10[9 - precision];
+        for (int i = precision; i >= 1; i--) {
+            dst[19 + i] = (char)('0' + v % 10);
+            v /= 10;
+        }
+    }
+    f->prev = dst;
+}
+
+typedef struct {
+    format_state_t state;
+    int precision;
+    char *dst;
+    size_t stride;
+} format_key_t;
+
+static void format_chunk(const timestamp_t *ts, size_t n, void *key) {
+    format_key_t *k = key;
+    for (size_t i = 0; i < n; i++) {
+        format_one(&ts[i], k->precision, k->dst, &k->state);
+        k->dst += k->stride;
+    }
+}
+
+// See comment in header
+size_t timestamp_column_format(const timestamp_column_t *c, size_t first, size_t count, int precision, char *dst,
+                               size_t stride) {
+    if (precision < 0 || precision > 9 || stride < TIMESTAMP_COLUMN_STRING_LEN) {
+        return 0;
+    }
+    timestamp_t buf[FORMAT_CHUNK];
+    format_key_t key = { { NULL, 0, 0, 0 }, precision, dst, stride };
+    return read_range(c, first, count, buf, FORMAT_CHUNK, format_chunk, &key);
+}
+
+// See comment in header
+size_t timestamp_column_memory(const timestamp_column_t *c) {
+    return sizeof(*c) + c->capacity + c->block_capacity * sizeof(*c->blocks) +
+           c->block_len * (sizeof(*c->current) + MAX_VARINT_LEN) + MAX_HEADER_LEN;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TimestampColumn_h
+#define TimestampColumn_h
+
+#include "timestamp.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compact storage of a column of c-timestamp timestamps, e.g. the timestamps of a log's lines,
+ * instead of an RFC 3339 string of up to 35 bytes per line.
+ *
+ * Timestamps are stored in blocks of up to block_len. Each block starts with its first timestamp
+ * in full (the anchor), and the rest are stored as the difference between their delta from the
+ * timestamp before and the previous delta, zigzag-encoded as LEB128 varints. Deltas are counted in
+ * the coarsest unit (seconds, milliseconds, microseconds or nanoseconds) that represents every
+ * timestamp of the block exactly, so a log written with millisecond timestamps a few milliseconds
+ * to a few seconds apart takes one to three bytes per line.
+ *
+ * A block also holds the UTC offset of its timestamps: a timestamp with a different offset
+ * starts a new block, as does one more than 68 years from the block's anchor. Blocks are indexed
+ * as they are added, so a block or a range of timestamps is decoded without decoding the column
+ * from the start.
+ *
+ * Encoding is lossless: timestamps decode to the same seconds, nanoseconds and offset.
+ *
+ * Encoded blocks, as returned by timestamp_column_data:
+ *
+ *   block   := varint(length of body) body
+ *   body    := unit count offset anchor_sec anchor_nsec delta*
+ *   unit    := byte: 0 seconds, 1 milliseconds, 2 microseconds, 3 nanoseconds
+ *   count   := varint, at least 1
+ *   offset  := zigzag varint, minutes
+ *   anchor_sec  := zigzag varint, seconds since the epoch
+ *   anchor_nsec := varint
+ *   delta   := zigzag varint: the first delta, then each delta minus the one before it, in units
+ */
+
+// Length of the longest string timestamp_column_format writes, including the terminating NUL.
+#define TIMESTAMP_COLUMN_STRING_LEN 36
+
+// Maximum number of timestamps in a block.
+#define TIMESTAMP_COLUMN_MAX_BLOCK_LEN 65536
+
+typedef struct timestamp_column timestamp_column_t;
+
+/*!
+ * @brief Creates an empty column.
+ *
+ * @param block_len Timestamps per block, from 1 to TIMESTAMP_COLUMN_MAX_BLOCK_LEN, e.g. 128. Longer
+ *                  blocks store fewer anchors, at the cost of decoding more to reach a timestamp.
+ * @return Column, or NULL if block_len is out of range or allocation failed.
+ */
+timestamp_column_t * timestamp_column_new(size_t block_len);
+
+/*!
+ * @brief Loads a column from blocks previously returned by timestamp_column_data.
+ *
+ * Every block is checked: data that doesn't decode to valid timestamps is rejected. Timestamps
+ * appended to the column go into new blocks.
+ *
+ * @return Column, or NULL if the data is malformed, block_len is out of range or allocation failed.
+ */
+timestamp_column_t * timestamp_column_load(const void *data, size_t len, size_t block_len);
+
+void timestamp_column_free(timestamp_column_t *c);
+
+/*!
+ * @brief Appends a timestamp.
+ *
+ * Timestamps needn't be in order, but the column is smallest when they are.
+ *
+ * @return 0 on success, -1 if the timestamp is invalid or allocation failed.
+ */
+int timestamp_column_append(timestamp_column_t *c, const timestamp_t *tsp);
+
+/*!
+ * @brief Ends the current block, so that timestamp_column_data includes every timestamp appended.
+ *
+ * The next timestamp appended starts a new block.
+ *
+ * @return 0 on success, -1 if allocation failed.
+ */
+int timestamp_column_flush(timestamp_column_t *c);
+
+/*!
+ * @brief The encoded blocks, for storage.
+ *
+ * Timestamps appended since the last block ended, by filling up or by timestamp_column_flush, aren't
+ * included.
+ *
+ * @param len Populated with the length of the data.
+ * @return The data, valid until the column is next changed.
+ */
+const uint8_t * timestamp_column_data(const timestamp_column_t *c, size_t *len);
+
+/*!
+ * @brief Number of timestamps, including those not yet in an ended block.
+ */
+size_t timestamp_column_count(const timestamp_column_t *c);
+
+/*!
+ * @brief Number of blocks, including the current block if it isn't empty.
+ */
+size_t timestamp_column_block_count(const timestamp_column_t *c);
+
+/*!
+ * @brief Finds the timestamps of a block.
+ *
+ * @param first Populated with the index of the block's first timestamp in the column.
+ * @param count Populated with the number of timestamps in the block.
+ * @return 0 on success, -1 if block is out of range.
+ */
+int timestamp_column_block(const timestamp_column_t *c, size_t block, size_t *first, size_t *count);
+
+/*!
+ * @brief Finds the block holding a timestamp.
+ * @return Block, or -1 if index is out of range.
+ */
+long timestamp_column_block_of(const timestamp_column_t *c, size_t index);
+
+/*!
+ * @brief Decodes the timestamps at [first, first + count).
+ *
+ * Only the blocks holding the range are decoded.
+ *
+ * @return Number of timestamps decoded, which is less than count if the range extends past the end of the column.
+ */
+size_t timestamp_column_decode(const timestamp_column_t *c, size_t first, size_t count, timestamp_t *out);
+
+/*!
+ * @brief Formats the timestamps at [first, first + count) as RFC 3339 strings, like timestamp_format_precision.
+ *
+ * Timestamp i is written, NUL-terminated, at dst + i * stride. Timestamps on the same day as the one before
+ * reuse its date rather than computing it again.
+ *
+ * @param precision Digits of fractional seconds, 0 to 9.
+ * @param stride At least TIMESTAMP_COLUMN_STRING_LEN.
+ * @return Number of timestamps formatted, which is less than count if the range extends past the end of the
+ *         column, or 0 if precision or stride is invalid.
+ */
+size_t timestamp_column_format(const timestamp_column_t *c, size_t first, size_t count, int precision, char *dst,
+                               size_t stride);
+
+/*!
+ * @brief Bytes of heap memory held by the column.
+ */
+size_t timestamp_column_memory(const timestamp_column_t *c);
+
+#endif /* TimestampColumn_h */
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TimestampString.h"
+#include "timestamp.h"
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(TIMESTAMP_STRING_NO_SIMD) && defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE2 1
+#elif !defined(TIMESTAMP_STRING_NO_SIMD) && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define USE_NEON 1
+#endif
+
+// "2013-12-31T23:59:59", which every timestamp starts with.
+#define DATE_TIME_LEN 19
+
+// Shortest timestamp, "2013-12-31T23:59:59Z".
+#define MIN_LEN 20
+
+#define MAX_FRACTION_DIGITS 9
+
+typedef struct {
+    size_t fraction_len;        // Number of fractional digits, starting after the '.' at DATE_TIME_LEN.
+    size_t zone;                // Index of the 'Z' or of the offset's sign.
+} layout_t;
+
+static inline bool is_digit(unsigned char c) {
+    return (unsigned char)(c - '0') <= 9;
+}
+
+static inline int two_digits(const unsigned char *p) {
+    return (p[0] - '0') * 10 + (p[1] - '0');
+}
+
+static bool leap_year(int y) {
+    return (y & 3) == 0 && (y % 100 != 0 || y % 400 == 0);
+}
+
+// Checks the digits and the '-' and ':' separators of the date and time. The 'T' isn't checked.
+static inline bool date_time_chars(const unsigned char *p) {
+#if USE_SSE2 || USE_NEON
+    // Two overlapping loads, of bytes 0-15 and 3-18, so that the ':' at 16 lines up with the one at 13
+    // and a single pattern serves both. Lanes are checked for a digit, for the pattern's character, or not at all.
+    #define ALL 0xff
+    static const unsigned char pattern[16] = { 0, 0, 0, 0, '-', 0, 0, '-', 0, 0, 0, 0, 0, ':', 0, 0 };
+    static const unsigned char digits[2][16] = {
+        { ALL, ALL, ALL, ALL, 0, ALL, ALL, 0, ALL, ALL, 0, ALL, ALL, 0, ALL, ALL },
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ALL, ALL } };
+    static const unsigned char literals[2][16] = {
+        { 0, 0, 0, 0, ALL, 0, 0, ALL, 0, 0, 0, 0, 0, ALL, 0, 0 },
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ALL, 0, 0 } };
+    static const unsigned char unchecked[2][16] = {
+        { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, ALL, 0, 0, 0, 0, 0 },
+        { ALL, ALL, ALL, ALL, ALL, ALL, ALL, ALL, ALL, ALL, ALL, ALL, ALL, 0, 0, 0 } };
+    #undef ALL
+#endif
+#if USE_SSE2
+    const __m128i expected = _mm_loadu_si128((const __m128i *)pattern);
+    for (int i = 0; i < 2; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 3 * i));
+        __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+        __m128i is_digit = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d);
+        __m128i ok = _mm_or_si128(_mm_and_si128(is_digit, _mm_loadu_si128((const __m128i *)digits[i])),
+                                  _mm_and_si128(_mm_cmpeq_epi8(v, expected),
+                                                _mm_loadu_si128((const __m128i *)literals[i])));
+        ok = _mm_or_si128(ok, _mm_loadu_si128((const __m128i *)unchecked[i]));
+        if (_mm_movemask_epi8(ok) != 0xffff) {
+            return false;
+        }
+    }
+    return true;
+#elif USE_NEON
+    const uint8x16_t expected = vld1q_u8(pattern);
+    uint8x16_t all = vdupq_n_u8(0xff);
+    for (int i = 0; i < 2; i++) {
+        uint8x16_t v = vld1q_u8(p + 3 * i);
+        uint8x16_t is_digit = vcleq_u8(vsubq_u8(v, vdupq_n_u8('0')), vdupq_n_u8(9));
+        uint8x16_t ok = vorrq_u8(vandq_u8(is_digit, vld1q_u8(digits[i])),
+                                 vandq_u8(vceqq_u8(v, expected), vld1q_u8(literals[i])));
+        all = vandq_u8(all, vorrq_u8(ok, vld1q_u8(unchecked[i])));
+    }
+    return vminvq_u8(all) == 0xff;
+#else
+    static const char pattern[DATE_TIME_LEN + 1] = "dddd-dd-ddTdd:dd:dd";
+    for (int i = 0; i < DATE_TIME_LEN; i++) {
+        if (pattern[i] == 'd' ? !is_digit(p[i]) : (pattern[i] != 'T' && p[i] != pattern[i])) {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+// Validates a timestamp and finds its fraction and offset.
+static bool scan(const char *str, size_t len, layout_t *layout) {
+    static const unsigned char days[13] = { 0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    const unsigned char *p = (const unsigned char *)str;
+    if (len < MIN_LEN || !date_time_chars(p) || !(p[10] == 'T' || p[10] == 't' || p[10] == ' ')) {
+        return false;
+    }
+
+    int year = two_digits(p) * 100 + two_digits(p + 2);
+    int month = two_digits(p + 5), day = two_digits(p + 8);
+    if (year < 1 || month < 1 || month > 12 || day < 1 ||
+        day > days[month] + (month == 2 && leap_year(year)) ||
+        two_digits(p + 11) > 23 || two_digits(p + 14) > 59 || two_digits(p + 17) > 59) {
+        return false;
+    }
+
+    size_t i = DATE_TIME_LEN;
+    if (p[i] == '.') {
+        size_t start = ++i;
+        while (i < len && is_digit(p[i])) {
+            i++;
+        }
+        if (i == start || i - start > MAX_FRACTION_DIGITS || i == len) {
+            return false;
+        }
+        layout->fraction_len = i - start;
+    } else {
+        layout->fraction_len = 0;
+    }
+
+    layout->zone = i;
+    if (p[i] == 'Z' || p[i] == 'z') {
+        return i + 1 == len;
+    }
+    // ±hh:mm
+    return (p[i] == '+' || p[i] == '-') && len - i == 6 &&
+           is_digit(p[i + 1]) && is_digit(p[i + 2]) && p[i + 3] == ':' && is_digit(p[i + 4]) && is_digit(p[i + 5]) &&
+           two_digits(p + i + 1) <= 23 && two_digits(p + i + 4) <= 59;
+}
+
+// See comment in header
+bool timestamp_valid_str(const char *str, size_t len) {
+    layout_t layout;
+    return scan(str, len, &layout);
+}
+
+// Converts a timestamp that scan accepted, as timestamp_parse would.
+static void to_timestamp(const char *str, const layout_t *layout, timestamp_t *ts) {
+    static const uint16_t day_offset[13] = { 0, 306, 337, 0, 31, 61, 92, 122, 153, 184, 214, 245, 275 };
+    const unsigned char *p = (const unsigned char *)str;
+    int year = two_digits(p) * 100 + two_digits(p + 2), month = two_digits(p + 5);
+    if (month < 3) {
+        year--;
+    }
+    int64_t rdn = (1461 * year) / 4 - year / 100 + year / 400 + day_offset[month] + two_digits(p + 8) - 306;
+    int sod = two_digits(p + 11) * 3600 + two_digits(p + 14) * 60 + two_digits(p + 17);
+
+    int32_t nsec = 0;
+    for (size_t i = 0; i < MAX_FRACTION_DIGITS; i++) {
+        nsec = nsec * 10 + (i < layout->fraction_len ? p[DATE_TIME_LEN + 1 + i] - '0' : 0);
+    }
+
+    const unsigned char *zone = p + layout->zone;
+    int offset = 0;
+    if (*zone == '+' || *zone == '-') {
+        offset = two_digits(zone + 1) * 60 + two_digits(zone + 4);
+        offset = *zone == '-' ? -offset : offset;
+    }
+
+    ts->sec = (rdn - 719163) * 86400 + sod - offset * 60;
+    ts->nsec = nsec;
+    ts->offset = (int16_t)offset;
+}
+
+static bool same_offset(const char *str1, const layout_t *l1, const char *str2, const layout_t *l2) {
+    // A 'Z' zone is a single character, so 6 bytes are only compared when both zones are numeric offsets.
+    const char *z1 = str1 + l1->zone, *z2 = str2 + l2->zone;
+    bool utc1 = (*z1 | 0x20) == 'z', utc2 = (*z2 | 0x20) == 'z';
+    if (utc1 || utc2) {
+        return utc1 && utc2;
+    }
+    return memcmp(z1, z2, 6) == 0;
+}
+
+// See comment in header
+int timestamp_compare_str(const char *str1, size_t len1, const char *str2, size_t len2, int *result) {
+    layout_t l1, l2;
+    if (!scan(str1, len1, &l1) || !scan(str2, len2, &l2)) {
+        return -1;
+    }
+
+    if (!same_offset(str1, &l1, str2, &l2)) {
+        timestamp_t t1, t2;
+        to_timestamp(str1, &l1, &t1);
+        to_timestamp(str2, &l2, &t2);
+        *result = timestamp_compare(&t1, &t2);
+        return 0;
+    }
+
+    // With the same offset, local times order the same as instants, and all the fields are fixed-width
+    // digits except the fraction, which is compared as if padded with zeros to the longer precision.
+    int c = memcmp(str1, str2, 10);
+    if (c == 0) {
+        c = memcmp(str1 + 11, str2 + 11, DATE_TIME_LEN - 11);
+    }
+    const char *f1 = str1 + DATE_TIME_LEN + 1, *f2 = str2 + DATE_TIME_LEN + 1;
+    size_t n = l1.fraction_len > l2.fraction_len ? l1.fraction_len : l2.fraction_len;
+    for (size_t i = 0; c == 0 && i < n; i++) {
+        c = (i < l1.fraction_len ? f1[i] : '0') - (i < l2.fraction_len ? f2[i] : '0');
+    }
+    *result = (c > 0) - (c < 0);
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TimestampString_h
+#define TimestampString_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Validation and comparison of RFC 3339 timestamps as strings, without parsing them into a
+ * timestamp_t first.
+ *
+ * The accepted syntax is exactly that of c-timestamp's timestamp_parse: a string is valid here if and
+ * only if timestamp_parse accepts it, and comparisons agree with timestamp_compare of the parsed
+ * timestamps. Validation checks the fixed-width date and time with SSE2 or NEON where available.
+ *
+ * Timestamps with the same UTC offset are compared digit by digit, including when their fractional
+ * seconds have different precisions. Only timestamps with different offsets are parsed to be compared.
+ *
+ * This suits one-off comparisons, e.g. of an expiry against the current time. Sorting many timestamps
+ * is still faster by parsing each of them once.
+ */
+
+/*!
+ * @brief Checks that a string is an RFC 3339 timestamp that timestamp_parse accepts.
+ */
+bool timestamp_valid_str(const char *str, size_t len);
+
+/*!
+ * @brief Compares two RFC 3339 timestamps.
+ *
+ * @param result Set to -1, 0 or 1 as the first timestamp is earlier than, the same instant as, or later
+ *               than the second.
+ * @return 0 on success, or -1 if either string isn't a valid timestamp.
+ */
+int timestamp_compare_str(const char *str1, size_t len1, const char *str2, size_t len2, int *result);
+
+#endif /* TimestampString_h */
@@ -0,0 +1,543 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TimestampZone.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define HEADER_LEN 44
+#define MAX_TYPES 256
+#define MAX_FILE_LEN (1 << 20)
+#define MAX_NAME_LEN 32
+#define DEFAULT_PATH "/etc/localtime"
+
+typedef struct {
+    int32_t offset;
+    uint8_t is_dst;
+    uint32_t abbreviation;      // Offset in abbreviations.
+} zone_type_t;
+
+struct timestamp_zone {
+    int64_t *times;             // Transition times, ascending.
+    uint8_t *types;             // Type in effect from each transition.
+    size_t count;
+    size_t capacity;
+    zone_type_t zone_types[MAX_TYPES];
+    size_t type_count;
+    char *abbreviations;        // NUL-terminated abbreviations, back to back.
+    size_t abbreviations_len;
+};
+
+/*** Calendar ***/
+
+static const uint16_t day_offset[13] = { 0, 306, 337, 0, 31, 61, 92, 122, 153, 184, 214, 245, 275 };
+
+static bool leap_year(int y) {
+    return (y & 3) == 0 && (y % 100 != 0 || y % 400 == 0);
+}
+
+static int month_days(int y, int m) {
+    static const uint8_t days[13] = { 0, 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    return days[m] + (m == 2 && leap_year(y));
+}
+
+// Days since the epoch of a date, with the Rata Die arithmetic of timestamp_parse.
+static int64_t days_from_civil(int y, int m, int d) {
+    if (m < 3) {
+        y--;
+    }
+    return (int64_t)(1461 * y) / 4 - y / 100 + y / 400 + day_offset[m] + d - 306 - 719163;
+}
+
+// Day of the week of a day since the epoch, Sunday being 0.
+static int weekday(int64_t days) {
+    return (int)(((days % 7) + 11) % 7);
+}
+
+/*** POSIX TZ strings ***/
+
+// Rule of a TZ string for the day and time of a transition.
+typedef struct {
+    char kind;                  // 'J': day 1-365 without leap days, 'D': day 0-365, 'M': day of a week of a month.
+    int month;
+    int week;                   // 1-5, 5 being the last.
+    int day;
+    int32_t time;               // Seconds after local midnight, may be negative or past 24 hours.
+} tz_rule_t;
+
+typedef struct {
+    char std[MAX_NAME_LEN], dst[MAX_NAME_LEN];
+    int32_t std_offset, dst_offset;     // East of UTC positive.
+    bool has_dst;
+    tz_rule_t start, end;
+} tz_string_t;
+
+static bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool parse_name(const char **p, const char *end, char *name) {
+    const char *s = *p, *start;
+    size_t len;
+    if (s < end && *s == '<') {
+        start = ++s;
+        while (s < end && (is_alpha(*s) || is_digit(*s) || *s == '+' || *s == '-')) {
+            s++;
+        }
+        len = s - start;
+        if (s == end || *s++ != '>') {
+            return false;
+        }
+    } else {
+        start = s;
+        while (s < end && is_alpha(*s)) {
+            s++;
+        }
+        len = s - start;
+    }
+    if (len < 3 || len >= MAX_NAME_LEN) {
+        return false;
+    }
+    memcpy(name, start, len);
+    name[len] = '\0';
+    *p = s;
+    return true;
+}
+
+static bool parse_number(const char **p, const char *end, int max, int *value) {
+    const char *s = *p;
+    int v = 0;
+    while (s < end && is_digit(*s) && s - *p < 3) {
+        v = v * 10 + (*s++ - '0');
+    }
+    if (s == *p || v > max) {
+        return false;
+    }
+    *value = v;
+    *p = s;
+    return true;
+}
+
+// [+-]hh[:mm[:ss]], in seconds.
+static bool parse_time(const char **p, const char *end, int max_hours, int32_t *seconds) {
+    int sign = 1, h, m = 0, s = 0;
+    if (*p < end && (**p == '+' || **p == '-')) {
+        sign = (**p == '-') ? -1 : 1;
+        (*p)++;
+    }
+    if (!parse_number(p, end, max_hours, &h)) {
+        return false;
+    }
+    if (*p < end && **p == ':') {
+        (*p)++;
+        if (!parse_number(p, end, 59, &m)) {
+            return false;
+        }
+        if (*p < end && **p == ':') {
+            (*p)++;
+            if (!parse_number(p, end, 59, &s)) {
+                return false;
+            }
+        }
+    }
+    *seconds = sign * (h * 3600 + m * 60 + s);
+    return true;
+}
+
+static bool parse_rule(const char **p, const char *end, tz_rule_t *rule) {
+    if (*p == end) {
+        return false;
+    }
+    rule->time = 2 * 3600;
+    if (**p == 'J') {
+        (*p)++;
+        rule->kind = 'J';
+        if (!parse_number(p, end, 365, &rule->day) || rule->day < 1) {
+            return false;
+        }
+    } else if (**p == 'M') {
+        (*p)++;
+        rule->kind = 'M';
+        if (!parse_number(p, end, 12, &rule->month) || rule->month < 1 || *p == end || *(*p)++ != '.' ||
+            !parse_number(p, end, 5, &rule->week) || rule->week < 1 || *p == end || *(*p)++ != '.' ||
+            !parse_number(p, end, 6, &rule->day)) {
+            return false;
+        }
+    } else {
+        rule->kind = 'D';
+        if (!parse_number(p, end, 365, &rule->day)) {
+            return false;
+        }
+    }
+    if (*p < end && **p == '/') {
+        (*p)++;
+        return parse_time(p, end, 167, &rule->time);
+    }
+    return true;
+}
+
+static bool parse_tz_string(const char *s, const char *end, tz_string_t *tz) {
+    int32_t offset;
+    if (!parse_name(&s, end, tz->std) || !parse_time(&s, end, 24, &offset)) {
+        return false;
+    }
+    // TZ strings count offsets west of UTC.
+    tz->std_offset = -offset;
+    tz->has_dst = (s < end);
+    if (!tz->has_dst) {
+        return true;
+    }
+    if (!parse_name(&s, end, tz->dst)) {
+        return false;
+    }
+    tz->dst_offset = tz->std_offset + 3600;
+    if (s < end && *s != ',') {
+        if (!parse_time(&s, end, 24, &offset)) {
+            return false;
+        }
+        tz->dst_offset = -offset;
+    }
+    if (s == end) {
+        // No rule: the POSIX default, which is the US rule.
+        tz->start = (tz_rule_t){ .kind = 'M', .month = 3, .week = 2, .day = 0, .time = 2 * 3600 };
+        tz->end = (tz_rule_t){ .kind = 'M', .month = 11, .week = 1, .day = 0, .time = 2 * 3600 };
+        return true;
+    }
+    return *s++ == ',' && parse_rule(&s, end, &tz->start) && s < end && *s++ == ',' &&
+           parse_rule(&s, end, &tz->end) && s == end;
+}
+
+// Instant of a rule's transition in a year, from the offset in effect before it.
+static int64_t rule_time(const tz_rule_t *rule, int year, int32_t offset) {
+    int64_t day;
+    if (rule->kind == 'J') {
+        day = days_from_civil(year, 1, 1) + rule->day - 1 + (leap_year(year) && rule->day >= 60);
+    } else if (rule->kind == 'D') {
+        day = days_from_civil(year, 1, 1) + rule->day;
+    } else {
+        int64_t first = days_from_civil(year, rule->month, 1);
+        int mday = (rule->day - weekday(first) + 7) % 7 + (rule->week - 1) * 7;
+        while (mday >= month_days(year, rule->month)) {
+            mday -= 7;
+        }
+        day = first + mday;
+    }
+    return day * 86400 + rule->time - offset;
+}
+
+/*** Loading ***/
+
+typedef struct {
+    uint32_t isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt;
+} header_t;
+
+static uint32_t be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static int64_t be64(const uint8_t *p) {
+    return (int64_t)((uint64_t)be32(p) << 32 | be32(p + 4));
+}
+
+static bool read_header(const uint8_t *p, const uint8_t *end, header_t *h) {
+    if (end - p < HEADER_LEN || memcmp(p, "TZif", 4) != 0) {
+        return false;
+    }
+    h->isutcnt = be32(p + 20);
+    h->isstdcnt = be32(p + 24);
+    h->leapcnt = be32(p + 28);
+    h->timecnt = be32(p + 32);
+    h->typecnt = be32(p + 36);
+    h->charcnt = be32(p + 40);
+    return true;
+}
+
+// Length of the data block that follows a header.
+static uint64_t block_len(const header_t *h, size_t time_size) {
+    return (uint64_t)h->timecnt * (time_size + 1) + (uint64_t)h->typecnt * 6 + h->charcnt +
+           (uint64_t)h->leapcnt * (time_size + 4) + h->isstdcnt + h->isutcnt;
+}
+
+static bool push_transition(timestamp_zone_t *z, int64_t time, uint8_t type) {
+    if (z->count == z->capacity) {
+        size_t capacity = z->capacity ? z->capacity * 2 : 64;
+        int64_t *times = realloc(z->times, capacity * sizeof(*times));
+        if (times == NULL) {
+            return false;
+        }
+        z->times = times;
+        uint8_t *types = realloc(z->types, capacity);
+        if (types == NULL) {
+            return false;
+        }
+        z->types = types;
+        z->capacity = capacity;
+    }
+    z->times[z->count] = time;
+    z->types[z->count++] = type;
+    return true;
+}
+
+// Finds or adds a type, returning its index or -1.
+static int intern_type(timestamp_zone_t *z, int32_t offset, bool is_dst, const char *name) {
+    uint32_t abbreviation = 0;
+    while (abbreviation < z->abbreviations_len && strcmp(z->abbreviations + abbreviation, name) != 0) {
+        abbreviation += strlen(z->abbreviations + abbreviation) + 1;
+    }
+    for (size_t i = 0; i < z->type_count; i++) {
+        const zone_type_t *t = &z->zone_types[i];
+        if (t->offset == offset && t->is_dst == is_dst && t->abbreviation == abbreviation) {
+            return (int)i;
+        }
+    }
+    if (z->type_count == MAX_TYPES) {
+        return -1;
+    }
+    if (abbreviation == z->abbreviations_len) {
+        size_t len = strlen(name) + 1;
+        char *abbreviations = realloc(z->abbreviations, z->abbreviations_len + len);
+        if (abbreviations == NULL) {
+            return -1;
+        }
+        memcpy(abbreviations + z->abbreviations_len, name, len);
+        z->abbreviations = abbreviations;
+        z->abbreviations_len += len;
+    }
+    z->zone_types[z->type_count] = (zone_type_t){ .offset = offset, .is_dst = is_dst, .abbreviation = abbreviation };
+    return (int)z->type_count++;
+}
+
+// Adds the transitions of a TZ string's rule after the last explicit transition.
+static bool expand_tz_string(timestamp_zone_t *z, const tz_string_t *tz) {
+    int std = intern_type(z, tz->std_offset, false, tz->std);
+    int dst = intern_type(z, tz->dst_offset, true, tz->dst);
+    if (std < 0 || dst < 0) {
+        return false;
+    }
+    int first_year = 1970;
+    struct tm tm;
+    if (z->count > 0) {
+        timestamp_t last = { .sec = z->times[z->count - 1] };
+        if (timestamp_to_tm_utc(&last, &tm) == NULL) {
+            return true;
+        }
+        first_year = tm.tm_year + 1900;
+    }
+    for (int year = first_year; year <= TIMESTAMP_ZONE_MAX_YEAR; year++) {
+        int64_t start = rule_time(&tz->start, year, tz->std_offset);
+        int64_t end = rule_time(&tz->end, year, tz->dst_offset);
+        // In the southern hemisphere daylight saving time ends first.
+        int64_t times[2] = { start < end ? start : end, start < end ? end : start };
+        int types[2] = { start < end ? dst : std, start < end ? std : dst };
+        for (int i = 0; i < 2; i++) {
+            if ((z->count == 0 || times[i] > z->times[z->count - 1]) &&
+                !push_transition(z, times[i], (uint8_t)types[i])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool parse_zone(timestamp_zone_t *z, const uint8_t *p, const uint8_t *end) {
+    header_t h;
+    if (!read_header(p, end, &h)) {
+        return false;
+    }
+    int version = p[4] ? p[4] - '0' : 1;
+    size_t time_size = 4;
+    if (version >= 2) {
+        uint64_t v1_len = block_len(&h, 4);
+        if (v1_len > (uint64_t)(end - p - HEADER_LEN)) {
+            return false;
+        }
+        p += HEADER_LEN + v1_len;
+        if (!read_header(p, end, &h)) {
+            return false;
+        }
+        time_size = 8;
+    }
+    p += HEADER_LEN;
+    if (block_len(&h, time_size) > (uint64_t)(end - p) || h.leapcnt != 0 ||
+        h.typecnt == 0 || h.typecnt > MAX_TYPES || h.charcnt == 0) {
+        return false;
+    }
+
+    const uint8_t *times = p, *indices = p + (size_t)h.timecnt * time_size;
+    const uint8_t *types = indices + h.timecnt, *chars = types + (size_t)h.typecnt * 6;
+    if (chars[h.charcnt - 1] != '\0' || (z->abbreviations = malloc(h.charcnt)) == NULL) {
+        return false;
+    }
+    memcpy(z->abbreviations, chars, h.charcnt);
+    z->abbreviations_len = h.charcnt;
+    for (uint32_t i = 0; i < h.typecnt; i++) {
+        const uint8_t *t = types + 6 * i;
+        if (t[4] > 1 || t[5] >= h.charcnt) {
+            return false;
+        }
+        z->zone_types[i] = (zone_type_t){ .offset = (int32_t)be32(t), .is_dst = t[4], .abbreviation = t[5] };
+    }
+    z->type_count = h.typecnt;
+    for (uint32_t i = 0; i < h.timecnt; i++) {
+        int64_t time = time_size == 8 ? be64(times + 8 * i) : (int32_t)be32(times + 4 * i);
+        if ((i > 0 && time <= z->times[z->count - 1]) || indices[i] >= h.typecnt ||
+            !push_transition(z, time, indices[i])) {
+            return false;
+        }
+    }
+
+    // The footer, "\n<TZ string>\n", covers the times after the last transition.
+    p += block_len(&h, time_size);
+    if (version < 2 || p == end) {
+        return true;
+    }
+    const uint8_t *footer_end = (end - p >= 2 && *p == '\n') ? memchr(p + 1, '\n', end - p - 1) : NULL;
+    if (footer_end == NULL) {
+        return false;
+    }
+    tz_string_t tz;
+    if (footer_end == p + 1) {
+        return true;
+    }
+    if (!parse_tz_string((const char *)p + 1, (const char *)footer_end, &tz)) {
+        return false;
+    }
+    return !tz.has_dst || expand_tz_string(z, &tz);
+}
+
+// See comment in header
+timestamp_zone_t * timestamp_zone_parse(const void *data, size_t len) {
+    timestamp_zone_t *z = calloc(1, sizeof(*z));
+    if (z != NULL && !parse_zone(z, data, (const uint8_t *)data + len)) {
+        timestamp_zone_free(z);
+        return NULL;
+    }
+    return z;
+}
+
+// See comment in header
+timestamp_zone_t * timestamp_zone_load(const char *path) {
+    FILE *f = fopen(path ? path : DEFAULT_PATH, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    struct stat st;
+    uint8_t *data = NULL;
+    timestamp_zone_t *z = NULL;
+    if (fstat(fileno(f), &st) == 0 && st.st_size <= MAX_FILE_LEN && (data = malloc(st.st_size + 1)) != NULL &&
+        fread(data, 1, st.st_size, f) == (size_t)st.st_size) {
+        z = timestamp_zone_parse(data, st.st_size);
+        if (z == NULL) {
+            errno = EINVAL;
+        }
+    } else if (st.st_size > MAX_FILE_LEN) {
+        errno = EINVAL;
+    }
+    free(data);
+    fclose(f);
+    return z;
+}
+
+// See comment in header
+void timestamp_zone_free(timestamp_zone_t *zone) {
+    if (zone == NULL) {
+        return;
+    }
+    free(zone->times);
+    free(zone->types);
+    free(zone->abbreviations);
+    free(zone);
+}
+
+/*** Conversion ***/
+
+// Index of the last transition at or before sec, or -1 if there is none.
+static ptrdiff_t find_transition(const timestamp_zone_t *z, int64_t sec) {
+    if (z->count == 0 || sec < z->times[0]) {
+        return -1;
+    }
+    const int64_t *base = z->times;
+    size_t n = z->count;
+    while (n > 1) {
+        size_t half = n / 2;
+        base = (base[half] <= sec) ? base + half : base;
+        n -= half;
+    }
+    return base - z->times;
+}
+
+// Before the first transition the first type is in effect.
+static const zone_type_t * transition_type(const timestamp_zone_t *z, ptrdiff_t i) {
+    return &z->zone_types[i < 0 ? 0 : z->types[i]];
+}
+
+static struct tm * to_tm(const timestamp_zone_t *z, const zone_type_t *type, const timestamp_t *tsp, struct tm *tmp) {
+    timestamp_t local = { .sec = tsp->sec + type->offset, .nsec = tsp->nsec };
+    if (!timestamp_valid(tsp) || timestamp_to_tm_utc(&local, tmp) == NULL) {
+        return NULL;
+    }
+    tmp->tm_isdst = type->is_dst;
+    tmp->tm_gmtoff = type->offset;
+    tmp->tm_zone = (char *)z->abbreviations + type->abbreviation;
+    return tmp;
+}
+
+// See comment in header
+int32_t timestamp_zone_offset(const timestamp_zone_t *zone, int64_t sec, int *is_dst, const char **abbreviation) {
+    const zone_type_t *type = transition_type(zone, find_transition(zone, sec));
+    if (is_dst != NULL) {
+        *is_dst = type->is_dst;
+    }
+    if (abbreviation != NULL) {
+        *abbreviation = zone->abbreviations + type->abbreviation;
+    }
+    return type->offset;
+}
+
+// See comment in header
+struct tm * timestamp_zone_to_tm(const timestamp_zone_t *zone, const timestamp_t *tsp, struct tm *tmp) {
+    return to_tm(zone, transition_type(zone, find_transition(zone, tsp->sec)), tsp, tmp);
+}
+
+// See comment in header
+size_t timestamp_zone_to_tm_batch(const timestamp_zone_t *zone, const timestamp_t *tsp, size_t count, struct tm *tms) {
+    // The range of times [from, until) of the previous timestamp's transition.
+    int64_t from = 0, until = 0;
+    ptrdiff_t transition = -1;
+    for (size_t i = 0; i < count; i++) {
+        int64_t sec = tsp[i].sec;
+        if (sec < from || sec >= until) {
+            transition = find_transition(zone, sec);
+            from = transition < 0 ? INT64_MIN : zone->times[transition];
+            until = (size_t)(transition + 1) < zone->count ? zone->times[transition + 1] : INT64_MAX;
+        }
+        if (to_tm(zone, transition_type(zone, transition), &tsp[i], &tms[i]) == NULL) {
+            return i;
+        }
+    }
+    return count;
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TimestampZone_h
+#define TimestampZone_h
+
+#include "timestamp.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Conversion of c-timestamp timestamps to broken-down time in a time zone, from the zone's TZif data
+ * (RFC 8536), e.g. /etc/localtime or the data of an NSTimeZone.
+ *
+ * The zone's UTC offset transitions are loaded once, and the rule the data ends with is expanded
+ * into explicit transitions up to TIMESTAMP_ZONE_MAX_YEAR. Converting a timestamp is a binary
+ * search over the transitions, and a batch of timestamps in order of time mostly reuses the previous
+ * timestamp's transition. Unlike localtime_r there is no global state: a loaded zone is immutable
+ * and can be used from any number of threads at once.
+ *
+ * timestamp_to_tm_local is different: it converts to the offset the timestamp was written with.
+ */
+
+// Last year for which the zone's ending rule is expanded. Later times use the last offset in effect.
+#define TIMESTAMP_ZONE_MAX_YEAR 2100
+
+typedef struct timestamp_zone timestamp_zone_t;
+
+/*!
+ * @brief Loads a zone from TZif data.
+ *
+ * Version 1 to 4 data is accepted. Zones with leap seconds ("right/" zones) are not.
+ *
+ * @return Zone, or NULL if the data is invalid or allocation failed.
+ */
+timestamp_zone_t * timestamp_zone_parse(const void *data, size_t len);
+
+/*!
+ * @brief Loads a zone from a TZif file.
+ *
+ * @param path File to read, or NULL for /etc/localtime.
+ * @return Zone, or NULL if the file can't be read (errno is set), is invalid (errno is EINVAL),
+ *         or allocation failed.
+ */
+timestamp_zone_t * timestamp_zone_load(const char *path);
+
+void timestamp_zone_free(timestamp_zone_t *zone);
+
+/*!
+ * @brief Finds the offset from UTC in effect at an instant.
+ *
+ * @param sec Seconds since the epoch.
+ * @param is_dst If not NULL, set to 1 if the offset is daylight saving time, 0 otherwise.
+ * @param abbreviation If not NULL, set to the offset's abbreviation, e.g. "EDT". Valid for the lifetime of the zone.
+ * @return Offset in seconds, east of UTC positive.
+ */
+int32_t timestamp_zone_offset(const timestamp_zone_t *zone, int64_t sec, int *is_dst, const char **abbreviation);
+
+/*!
+ * @brief Converts a timestamp to broken-down time in the zone, like localtime_r.
+ *
+ * tm_gmtoff and tm_zone are set; tm_zone points into the zone.
+ *
+ * @return tmp, or NULL if the timestamp is invalid or its local time is outside of years 1 to 9999.
+ */
+struct tm * timestamp_zone_to_tm(const timestamp_zone_t *zone, const timestamp_t *tsp, struct tm *tmp);
+
+/*!
+ * @brief Converts timestamps to broken-down time in the zone.
+ *
+ * Fastest when the timestamps are in order of time, as log rows are, but any order is correct.
+ *
+ * @return Number of timestamps converted. Conversion stops at the first timestamp that
+ *         timestamp_zone_to_tm would fail on.
+ */
+size_t timestamp_zone_to_tm_batch(const timestamp_zone_t *zone, const timestamp_t *tsp, size_t count, struct tm *tms);
+
+#endif /* TimestampZone_h */
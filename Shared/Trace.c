@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Trace.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef enum {
+    EVENT_SPAN,
+    EVENT_INSTANT,
+} event_type_t;
+
+typedef struct {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    event_type_t type;
+} event_t;
+
+/*
+ * Buffers are pushed onto a global list the first time a thread records, so that the spans of
+ * threads that have exited can still be exported. When a thread exits its buffer is marked, and once
+ * the buffer has been exported (or reset) it goes to the next thread that needs one rather than a new
+ * allocation. Only the owning thread writes events; it publishes each one by incrementing count with
+ * release ordering. The list, and the fields other than thread_name and count, are guarded by lock.
+ */
+typedef struct thread_buffer {
+    struct thread_buffer *next;
+    uint32_t tid;
+    int exited;
+    int exported;
+    _Atomic(const char *) thread_name;
+    _Atomic uint32_t count;
+    event_t events[TRACE_BUFFER_EVENTS];
+} thread_buffer_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static thread_buffer_t *buffers;
+static size_t buffer_count;
+static uint32_t next_tid = 1;
+static _Atomic int enabled;
+static _Atomic uint64_t origin_ns;
+static _Atomic uint64_t dropped;
+
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t exit_key;
+static int exit_key_error;
+
+static _Thread_local thread_buffer_t *local_buffer;
+// Set by trace_set_thread_name, for threads named before their buffer exists.
+static _Thread_local const char *local_thread_name;
+
+// See comment in header
+uint64_t trace_now_ns(void) {
+#if defined(__APPLE__)
+    return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+// See comment in header
+void trace_set_enabled(int on) {
+    if (on) {
+        uint64_t expected = 0;
+        atomic_compare_exchange_strong(&origin_ns, &expected, trace_now_ns());
+    }
+    atomic_store_explicit(&enabled, on != 0, memory_order_relaxed);
+}
+
+// See comment in header
+int trace_enabled(void) {
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+// Destructor of exit_key, run when a thread with a buffer exits.
+static void thread_exited(void *arg) {
+    thread_buffer_t *b = arg;
+    pthread_mutex_lock(&lock);
+    b->exited = 1;
+    pthread_mutex_unlock(&lock);
+    // A destructor running after this one that records gets a buffer of its own.
+    local_buffer = NULL;
+}
+
+static void create_exit_key(void) {
+    exit_key_error = pthread_key_create(&exit_key, thread_exited);
+}
+
+static thread_buffer_t * thread_buffer(void) {
+    thread_buffer_t *b = local_buffer;
+    if (b != NULL) {
+        return b;
+    }
+    pthread_once(&exit_key_once, create_exit_key);
+    if (exit_key_error != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    for (b = buffers; b != NULL && !(b->exited && b->exported); b = b->next) {
+    }
+    if (b == NULL) {
+        b = calloc(1, sizeof(thread_buffer_t));
+        if (b != NULL) {
+            b->next = buffers;
+            buffers = b;
+            buffer_count++;
+        }
+    }
+    if (b != NULL) {
+        b->tid = next_tid++;
+        b->exited = 0;
+        b->exported = 0;
+        atomic_store_explicit(&b->thread_name, local_thread_name, memory_order_relaxed);
+        atomic_store_explicit(&b->count, 0, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (b == NULL) {
+        return NULL;
+    }
+    if (pthread_setspecific(exit_key, b) != 0) {
+        // Without the destructor the buffer would never be reused: give it back.
+        pthread_mutex_lock(&lock);
+        b->exited = 1;
+        b->exported = 1;
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    local_buffer = b;
+    return b;
+}
+
+static void record(const char *name, uint64_t start_ns, uint64_t end_ns, event_type_t type) {
+    thread_buffer_t *b = thread_buffer();
+    if (b == NULL) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    uint32_t n = atomic_load_explicit(&b->count, memory_order_relaxed);
+    if (n >= TRACE_BUFFER_EVENTS) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+    event_t *e = &b->events[n];
+    e->name = name;
+    e->start_ns = start_ns;
+    e->end_ns = end_ns;
+    e->type = type;
+    atomic_store_explicit(&b->count, n + 1, memory_order_release);
+}
+
+// See comment in header
+trace_span_t trace_begin(const char *name) {
+    trace_span_t span = { NULL, 0 };
+    if (atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        span.name = name;
+        span.start_ns = trace_now_ns();
+    }
+    return span;
+}
+
+// See comment in header
+void trace_end(trace_span_t span) {
+    if (span.name != NULL) {
+        record(span.name, span.start_ns, trace_now_ns(), EVENT_SPAN);
+    }
+}
+
+// See comment in header
+void trace_instant(const char *name) {
+    if (atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        uint64_t now = trace_now_ns();
+        record(name, now, now, EVENT_INSTANT);
+    }
+}
+
+// See comment in header
+void trace_set_thread_name(const char *name) {
+    local_thread_name = name;
+    // A buffer is only taken here if the thread could record into it.
+    thread_buffer_t *b = trace_enabled() ? thread_buffer() : local_buffer;
+    if (b != NULL) {
+        atomic_store_explicit(&b->thread_name, name, memory_order_relaxed);
+    }
+}
+
+// See comment in header
+uint64_t trace_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+// See comment in header
+size_t trace_buffers(void) {
+    pthread_mutex_lock(&lock);
+    size_t n = buffer_count;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+/*** Export ***/
+
+static void write_escaped(FILE *fp, const char *s) {
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else {
+            fputc(c, fp);
+        }
+    }
+}
+
+// Microseconds since the origin, which is what Chrome trace timestamps are in.
+static void write_us(FILE *fp, uint64_t ns, uint64_t origin) {
+    uint64_t rel = (ns > origin) ? ns - origin : 0;
+    fprintf(fp, "%" PRIu64 ".%03u", rel / 1000, (unsigned)(rel % 1000));
+}
+
+// See comment in header
+long trace_write_chrome_json(FILE *fp) {
+    uint64_t origin = atomic_load_explicit(&origin_ns, memory_order_relaxed);
+    long written = 0;
+    const char *sep = "";
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", fp);
+    // Held throughout, so that no buffer is reused while its events are written.
+    pthread_mutex_lock(&lock);
+    for (thread_buffer_t *b = buffers; b != NULL; b = b->next) {
+        const char *thread_name = atomic_load_explicit(&b->thread_name, memory_order_relaxed);
+        if (thread_name != NULL) {
+            fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%" PRIu32 ",\"args\":{\"name\":\"",
+                    sep, b->tid);
+            write_escaped(fp, thread_name);
+            fputs("\"}}", fp);
+            sep = ",";
+        }
+
+        uint32_t n = atomic_load_explicit(&b->count, memory_order_acquire);
+        for (uint32_t i = 0; i < n; i++) {
+            const event_t *e = &b->events[i];
+            fprintf(fp, "%s\n{\"name\":\"", sep);
+            write_escaped(fp, e->name);
+            fputs("\",\"cat\":\"psiphon\",\"ts\":", fp);
+            write_us(fp, e->start_ns, origin);
+            if (e->type == EVENT_SPAN) {
+                fputs(",\"ph\":\"X\",\"dur\":", fp);
+                write_us(fp, e->end_ns - e->start_ns, 0);
+            } else {
+                fputs(",\"ph\":\"i\",\"s\":\"t\"", fp);
+            }
+            fprintf(fp, ",\"pid\":1,\"tid\":%" PRIu32 "}", b->tid);
+            sep = ",";
+            written++;
+        }
+        // The thread has exited, so these are all of its events.
+        b->exported = b->exited;
+    }
+    pthread_mutex_unlock(&lock);
+    fputs("\n]}\n", fp);
+
+    return ferror(fp) ? -1 : written;
+}
+
+// See comment in header
+void trace_reset(void) {
+    pthread_mutex_lock(&lock);
+    for (thread_buffer_t *b = buffers; b != NULL; b = b->next) {
+        atomic_store_explicit(&b->count, 0, memory_order_relaxed);
+        b->exported = b->exited;
+    }
+    pthread_mutex_unlock(&lock);
+    atomic_store_explicit(&dropped, 0, memory_order_relaxed);
+}
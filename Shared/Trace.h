@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef Trace_h
+#define Trace_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Span tracer for the startup critical path, exported as Chrome trace JSON (chrome://tracing, Perfetto).
+ *
+ * Each thread records completed spans into its own fixed-size buffer, so recording takes no locks
+ * and doesn't allocate after the thread's first span. Timestamps are monotonic nanoseconds. Span
+ * names must be static strings, e.g. literals: only the pointer is recorded.
+ *
+ * The buffer of a thread that has exited is kept until it has been exported (or reset), then given
+ * to the next thread that records, so memory is bounded by the threads recording between exports
+ * rather than by every thread that ever recorded. The events of an exited thread can be left out of
+ * exports after the first.
+ *
+ * Instrumentation goes through the TRACE_* macros, which compile to nothing unless PSIPHON_TRACE is
+ * defined. When compiled in, tracing is still off until trace_set_enabled(1), and a disabled span
+ * costs one relaxed atomic load.
+ */
+
+// Spans recorded per thread. Further spans are counted as dropped. Sized for the per-call spans of
+// the hot paths, e.g. one timestamp_parse per notice when the last notices are read for feedback.
+// A buffer takes about 512 KB.
+#define TRACE_BUFFER_EVENTS 16384
+
+/*!
+ * @brief An open span, from trace_begin.
+ */
+typedef struct {
+    const char *name;           // NULL if tracing was disabled when the span began.
+    uint64_t start_ns;
+} trace_span_t;
+
+/*!
+ * @brief Enables or disables recording. Enabling the first time sets the trace's time origin.
+ */
+void trace_set_enabled(int enabled);
+
+int trace_enabled(void);
+
+/*!
+ * @brief Monotonic time in nanoseconds.
+ */
+uint64_t trace_now_ns(void);
+
+/*!
+ * @brief Opens a span.
+ * @param name Static string.
+ */
+trace_span_t trace_begin(const char *name);
+
+/*!
+ * @brief Closes a span and records it on the calling thread, which must be the thread that opened it.
+ */
+void trace_end(trace_span_t span);
+
+/*!
+ * @brief Records an instant event, e.g. "first tunnel connected".
+ * @param name Static string.
+ */
+void trace_instant(const char *name);
+
+/*!
+ * @brief Names the calling thread in exported traces.
+ *
+ * While tracing is disabled the name is only remembered, and applied if the thread records later.
+ *
+ * @param name Static string.
+ */
+void trace_set_thread_name(const char *name);
+
+/*!
+ * @brief Number of spans dropped because a thread's buffer was full.
+ */
+uint64_t trace_dropped(void);
+
+/*!
+ * @brief Number of thread buffers allocated, whether in use or waiting for a thread.
+ */
+size_t trace_buffers(void);
+
+/*!
+ * @brief Writes every recorded event as Chrome trace JSON.
+ *
+ * May be called while other threads are recording; events recorded during the export may be left out.
+ *
+ * @return Number of events written, or -1 on write error.
+ */
+long trace_write_chrome_json(FILE *fp);
+
+/*!
+ * @brief Discards every recorded event. Must not be called while other threads are recording.
+ */
+void trace_reset(void);
+
+#if defined(PSIPHON_TRACE)
+
+static inline void trace_end_scope(trace_span_t *span) {
+    trace_end(*span);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// Opens a span that closes when the enclosing scope exits.
+#define TRACE_SCOPE(name) \
+    trace_span_t TRACE_CONCAT(trace_scope_, __LINE__) __attribute__((cleanup(trace_end_scope))) = trace_begin(name)
+
+// Opens and closes a span explicitly, for spans that don't match a scope.
+#define TRACE_BEGIN(var, name) trace_span_t var = trace_begin(name)
+#define TRACE_END(var) trace_end(var)
+
+#define TRACE_INSTANT(name) trace_instant(name)
+#define TRACE_THREAD_NAME(name) trace_set_thread_name(name)
+
+#else
+
+#define TRACE_SCOPE(name) do {} while (0)
+#define TRACE_BEGIN(var, name) do {} while (0)
+#define TRACE_END(var) do {} while (0)
+#define TRACE_INSTANT(name) do {} while (0)
+#define TRACE_THREAD_NAME(name) do {} while (0)
+
+#endif
+
+#endif /* Trace_h */
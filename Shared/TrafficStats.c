@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TrafficStats.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CACHE_LINE 64
+
+// Longest gap between ticks that is replayed second by second. Longer gaps wipe the series.
+#define MAX_REPLAY_SEC (TRAFFIC_STATS_HOURS * 3600)
+
+typedef struct {
+    _Atomic uint64_t sent;
+    _Atomic uint64_t received;
+    _Atomic uint64_t updates;
+    char pad[CACHE_LINE - 3 * sizeof(uint64_t)];
+} shard_t;
+
+// Fixed size ring of byte counts, newest at head.
+typedef struct {
+    uint64_t sent[TRAFFIC_STATS_SECONDS > TRAFFIC_STATS_HOURS ? TRAFFIC_STATS_SECONDS : TRAFFIC_STATS_HOURS];
+    uint64_t received[TRAFFIC_STATS_SECONDS > TRAFFIC_STATS_HOURS ? TRAFFIC_STATS_SECONDS : TRAFFIC_STATS_HOURS];
+    unsigned capacity;
+    unsigned head;
+    unsigned count;
+
+    // Partial bucket of the next level up.
+    uint64_t acc_sent;
+    uint64_t acc_received;
+    unsigned acc_count;
+} ring_t;
+
+struct traffic_stats {
+    shard_t shards[TRAFFIC_STATS_SHARDS];
+
+    // Tick owner state.
+    int started;
+    uint64_t first_sec;
+    uint64_t last_sec;
+    uint64_t ticked_sent;
+    uint64_t ticked_received;
+
+    ring_t seconds;
+    ring_t minutes;
+    ring_t hours;
+};
+
+static atomic_uint next_shard;
+static _Thread_local int thread_shard = -1;
+
+static inline shard_t * shard_for_thread(traffic_stats_t *ts) {
+    if (thread_shard < 0) {
+        thread_shard = (int)(atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed) % TRAFFIC_STATS_SHARDS);
+    }
+    return &ts->shards[thread_shard];
+}
+
+// See comment in header
+traffic_stats_t * traffic_stats_new(void) {
+    traffic_stats_t *ts;
+    if (posix_memalign((void **)&ts, CACHE_LINE, sizeof(*ts)) != 0) {
+        return NULL;
+    }
+    memset(ts, 0, sizeof(*ts));
+    for (int i = 0; i < TRAFFIC_STATS_SHARDS; i++) {
+        atomic_init(&ts->shards[i].sent, 0);
+        atomic_init(&ts->shards[i].received, 0);
+        atomic_init(&ts->shards[i].updates, 0);
+    }
+    ts->seconds.capacity = TRAFFIC_STATS_SECONDS;
+    ts->minutes.capacity = TRAFFIC_STATS_MINUTES;
+    ts->hours.capacity = TRAFFIC_STATS_HOURS;
+    return ts;
+}
+
+// See comment in header
+void traffic_stats_free(traffic_stats_t *ts) {
+    free(ts);
+}
+
+// See comment in header
+void traffic_stats_add(traffic_stats_t *ts, int64_t sent, int64_t received) {
+    shard_t *s = shard_for_thread(ts);
+    if (sent > 0) {
+        atomic_fetch_add_explicit(&s->sent, (uint64_t)sent, memory_order_relaxed);
+    }
+    if (received > 0) {
+        atomic_fetch_add_explicit(&s->received, (uint64_t)received, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&s->updates, 1, memory_order_relaxed);
+}
+
+static void totals(const traffic_stats_t *ts, uint64_t *sent, uint64_t *received, uint64_t *updates) {
+    uint64_t s = 0, r = 0, u = 0;
+    for (int i = 0; i < TRAFFIC_STATS_SHARDS; i++) {
+        // Loads don't modify the shard; the cast drops const for the atomic load signature.
+        shard_t *shard = (shard_t *)&ts->shards[i];
+        s += atomic_load_explicit(&shard->sent, memory_order_relaxed);
+        r += atomic_load_explicit(&shard->received, memory_order_relaxed);
+        u += atomic_load_explicit(&shard->updates, memory_order_relaxed);
+    }
+    *sent = s;
+    *received = r;
+    if (updates != NULL) {
+        *updates = u;
+    }
+}
+
+// Pushes a bucket into the ring. Returns 1 when the ring's partial next-level bucket completes.
+static int ring_push(ring_t *r, uint64_t sent, uint64_t received, unsigned per_next) {
+    r->head = (r->head + 1) % r->capacity;
+    r->sent[r->head] = sent;
+    r->received[r->head] = received;
+    if (r->count < r->capacity) {
+        r->count++;
+    }
+
+    r->acc_sent += sent;
+    r->acc_received += received;
+    return ++r->acc_count == per_next;
+}
+
+static void ring_take_acc(ring_t *r, uint64_t *sent, uint64_t *received) {
+    *sent = r->acc_sent;
+    *received = r->acc_received;
+    r->acc_sent = 0;
+    r->acc_received = 0;
+    r->acc_count = 0;
+}
+
+static void push_second(traffic_stats_t *ts, uint64_t sent, uint64_t received) {
+    uint64_t s, r;
+    if (ring_push(&ts->seconds, sent, received, 60)) {
+        ring_take_acc(&ts->seconds, &s, &r);
+        if (ring_push(&ts->minutes, s, r, 60)) {
+            ring_take_acc(&ts->minutes, &s, &r);
+            ring_push(&ts->hours, s, r, 0);
+        }
+    }
+}
+
+// See comment in header
+void traffic_stats_tick(traffic_stats_t *ts, uint64_t now_sec) {
+    uint64_t gap;
+    if (!ts->started) {
+        // Bytes added before the first tick belong to the second ending at now_sec.
+        ts->started = 1;
+        ts->first_sec = now_sec;
+        gap = 1;
+    } else if (now_sec <= ts->last_sec) {
+        return;
+    } else {
+        gap = now_sec - ts->last_sec;
+    }
+    ts->last_sec = now_sec;
+
+    uint64_t sent, received;
+    totals(ts, &sent, &received, NULL);
+    uint64_t delta_sent = sent - ts->ticked_sent;
+    uint64_t delta_received = received - ts->ticked_received;
+    ts->ticked_sent = sent;
+    ts->ticked_received = received;
+
+    if (gap > MAX_REPLAY_SEC) {
+        // Everything in the series is older than its span; start over.
+        memset(&ts->seconds, 0, sizeof(ts->seconds));
+        memset(&ts->minutes, 0, sizeof(ts->minutes));
+        memset(&ts->hours, 0, sizeof(ts->hours));
+        ts->seconds.capacity = TRAFFIC_STATS_SECONDS;
+        ts->minutes.capacity = TRAFFIC_STATS_MINUTES;
+        ts->hours.capacity = TRAFFIC_STATS_HOURS;
+        gap = 1;
+    }
+
+    // Spread evenly, remainder on the last second, so the series sums to the totals exactly.
+    uint64_t each_sent = delta_sent / gap, each_received = delta_received / gap;
+    for (uint64_t i = 1; i < gap; i++) {
+        push_second(ts, each_sent, each_received);
+    }
+    push_second(ts, delta_sent - each_sent * (gap - 1), delta_received - each_received * (gap - 1));
+}
+
+/*** Snapshot ***/
+
+// Sum of the newest n buckets.
+static void ring_sum(const ring_t *r, unsigned n, uint64_t *sent, uint64_t *received) {
+    uint64_t s = 0, rcv = 0;
+    if (n > r->count) {
+        n = r->count;
+    }
+    for (unsigned i = 0; i < n; i++) {
+        unsigned idx = (r->head + r->capacity - i) % r->capacity;
+        s += r->sent[idx];
+        rcv += r->received[idx];
+    }
+    *sent = s;
+    *received = rcv;
+}
+
+static void average(const ring_t *r, unsigned n, unsigned sec_per_bucket, traffic_rate_t *rate) {
+    uint64_t s, rcv;
+    unsigned buckets = (n < r->count) ? n : r->count;
+    ring_sum(r, buckets, &s, &rcv);
+    uint64_t secs = (uint64_t)buckets * sec_per_bucket;
+    rate->sent = secs ? s / secs : 0;
+    rate->received = secs ? rcv / secs : 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentiles of the ring's buckets, in bytes per second.
+static void percentiles(const ring_t *r, unsigned sec_per_bucket, const double *ps, traffic_rate_t **out, int n_ps) {
+    uint64_t sent[TRAFFIC_STATS_SECONDS > TRAFFIC_STATS_HOURS ? TRAFFIC_STATS_SECONDS : TRAFFIC_STATS_HOURS];
+    uint64_t received[TRAFFIC_STATS_SECONDS > TRAFFIC_STATS_HOURS ? TRAFFIC_STATS_SECONDS : TRAFFIC_STATS_HOURS];
+    unsigned n = r->count;
+
+    for (unsigned i = 0; i < n; i++) {
+        unsigned idx = (r->head + r->capacity - i) % r->capacity;
+        sent[i] = r->sent[idx] / sec_per_bucket;
+        received[i] = r->received[idx] / sec_per_bucket;
+    }
+    qsort(sent, n, sizeof(uint64_t), compare_u64);
+    qsort(received, n, sizeof(uint64_t), compare_u64);
+
+    for (int i = 0; i < n_ps; i++) {
+        if (n == 0) {
+            out[i]->sent = out[i]->received = 0;
+            continue;
+        }
+        unsigned rank = (unsigned)(ps[i] * n + 0.999999);
+        if (rank == 0) {
+            rank = 1;
+        }
+        if (rank > n) {
+            rank = n;
+        }
+        out[i]->sent = sent[rank - 1];
+        out[i]->received = received[rank - 1];
+    }
+}
+
+// See comment in header
+void traffic_stats_snapshot(const traffic_stats_t *ts, traffic_stats_snapshot_t *snapshot) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->version = TRAFFIC_STATS_SNAPSHOT_VERSION;
+    totals(ts, &snapshot->total_sent, &snapshot->total_received, &snapshot->updates);
+
+    if (!ts->started) {
+        return;
+    }
+    snapshot->uptime_sec = (uint32_t)(ts->last_sec - ts->first_sec + 1);
+
+    average(&ts->seconds, 10, 1, &snapshot->last_10s);
+    average(&ts->seconds, 60, 1, &snapshot->last_1m);
+
+    // The hour and day averages are over the partially filled bucket plus as many complete
+    // buckets as fit in the window.
+    uint64_t s, r;
+    unsigned partial = ts->seconds.acc_count > 0;
+    unsigned k = ts->minutes.count < TRAFFIC_STATS_MINUTES - partial ? ts->minutes.count : TRAFFIC_STATS_MINUTES - partial;
+    ring_sum(&ts->minutes, k, &s, &r);
+    uint64_t secs = (uint64_t)k * 60 + ts->seconds.acc_count;
+    s += ts->seconds.acc_sent;
+    r += ts->seconds.acc_received;
+    snapshot->last_1h.sent = secs ? s / secs : 0;
+    snapshot->last_1h.received = secs ? r / secs : 0;
+
+    partial = ts->minutes.acc_count > 0 || ts->seconds.acc_count > 0;
+    k = ts->hours.count < TRAFFIC_STATS_HOURS - partial ? ts->hours.count : TRAFFIC_STATS_HOURS - partial;
+    ring_sum(&ts->hours, k, &s, &r);
+    secs = (uint64_t)k * 3600 + (uint64_t)ts->minutes.acc_count * 60 + ts->seconds.acc_count;
+    s += ts->minutes.acc_sent + ts->seconds.acc_sent;
+    r += ts->minutes.acc_received + ts->seconds.acc_received;
+    snapshot->last_24h.sent = secs ? s / secs : 0;
+    snapshot->last_24h.received = secs ? r / secs : 0;
+
+    const double second_ps[] = { 0.50, 0.90, 0.99, 1.0 };
+    traffic_rate_t *second_out[] = { &snapshot->p50_1s, &snapshot->p90_1s, &snapshot->p99_1s, &snapshot->peak_1s };
+    percentiles(&ts->seconds, 1, second_ps, second_out, 4);
+
+    const double minute_ps[] = { 0.50, 0.90 };
+    traffic_rate_t *minute_out[] = { &snapshot->p50_1m, &snapshot->p90_1m };
+    percentiles(&ts->minutes, 60, minute_ps, minute_out, 2);
+}
+
+/*** Serialization ***/
+
+static uint8_t * put_u32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        *p++ = (uint8_t)(v >> (8 * i));
+    }
+    return p;
+}
+
+static uint8_t * put_u64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) {
+        *p++ = (uint8_t)(v >> (8 * i));
+    }
+    return p;
+}
+
+static const uint8_t * get_u32(const uint8_t *p, uint32_t *v) {
+    *v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return p + 4;
+}
+
+static const uint8_t * get_u64(const uint8_t *p, uint64_t *v) {
+    uint32_t lo, hi;
+    p = get_u32(p, &lo);
+    p = get_u32(p, &hi);
+    *v = (uint64_t)lo | ((uint64_t)hi << 32);
+    return p;
+}
+
+// Rates in serialization order.
+#define SNAPSHOT_RATES(s) { &(s)->last_10s, &(s)->last_1m, &(s)->last_1h, &(s)->last_24h, \
+    &(s)->p50_1s, &(s)->p90_1s, &(s)->p99_1s, &(s)->peak_1s, &(s)->p50_1m, &(s)->p90_1m }
+#define SNAPSHOT_RATE_COUNT 10
+
+// See comment in header
+void traffic_stats_snapshot_encode(const traffic_stats_snapshot_t *snapshot, uint8_t buf[TRAFFIC_STATS_SNAPSHOT_LEN]) {
+    uint8_t *p = buf;
+    p = put_u32(p, TRAFFIC_STATS_SNAPSHOT_VERSION);
+    p = put_u32(p, snapshot->uptime_sec);
+    p = put_u64(p, snapshot->total_sent);
+    p = put_u64(p, snapshot->total_received);
+    p = put_u64(p, snapshot->updates);
+
+    const traffic_rate_t *rates[] = SNAPSHOT_RATES(snapshot);
+    for (int i = 0; i < SNAPSHOT_RATE_COUNT; i++) {
+        p = put_u64(p, rates[i]->sent);
+        p = put_u64(p, rates[i]->received);
+    }
+
+    // Pad to the fixed length.
+    memset(p, 0, TRAFFIC_STATS_SNAPSHOT_LEN - (size_t)(p - buf));
+}
+
+// See comment in header
+int traffic_stats_snapshot_decode(const uint8_t *buf, size_t len, traffic_stats_snapshot_t *snapshot) {
+    if (len < TRAFFIC_STATS_SNAPSHOT_LEN) {
+        return -1;
+    }
+
+    const uint8_t *p = get_u32(buf, &snapshot->version);
+    if (snapshot->version != TRAFFIC_STATS_SNAPSHOT_VERSION) {
+        return -1;
+    }
+    p = get_u32(p, &snapshot->uptime_sec);
+    p = get_u64(p, &snapshot->total_sent);
+    p = get_u64(p, &snapshot->total_received);
+    p = get_u64(p, &snapshot->updates);
+
+    traffic_rate_t *rates[] = SNAPSHOT_RATES(snapshot);
+    for (int i = 0; i < SNAPSHOT_RATE_COUNT; i++) {
+        p = get_u64(p, &rates[i]->sent);
+        p = get_u64(p, &rates[i]->received);
+    }
+    return 0;
+}
+
+// See comment in header
+long traffic_stats_snapshot_format_json(const traffic_stats_snapshot_t *s, char *dst, size_t len) {
+    static const char *names[SNAPSHOT_RATE_COUNT] = {
+        "last10s", "last1m", "last1h", "last24h", "p50_1s", "p90_1s", "p99_1s", "peak1s", "p50_1m", "p90_1m"
+    };
+    const traffic_rate_t *rates[] = SNAPSHOT_RATES(s);
+
+    int n = snprintf(dst, len,
+                     "{\"uptimeSec\":%" PRIu32 ",\"totalSent\":%" PRIu64 ",\"totalReceived\":%" PRIu64 ",\"updates\":%" PRIu64 ",\"bytesPerSec\":{",
+                     s->uptime_sec, s->total_sent, s->total_received, s->updates);
+    if (n < 0 || (size_t)n >= len) {
+        return -1;
+    }
+    size_t off = (size_t)n;
+
+    for (int i = 0; i < SNAPSHOT_RATE_COUNT; i++) {
+        n = snprintf(dst + off, len - off, "%s\"%s\":{\"sent\":%" PRIu64 ",\"received\":%" PRIu64 "}",
+                     i ? "," : "", names[i], rates[i]->sent, rates[i]->received);
+        if (n < 0 || (size_t)n >= len - off) {
+            return -1;
+        }
+        off += (size_t)n;
+    }
+
+    if (len - off < 3) {
+        return -1;
+    }
+    memcpy(dst + off, "}}", 3);
+    return (long)(off + 2);
+}
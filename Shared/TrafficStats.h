@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2018, Psiphon Inc.
+ * All rights reserved.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TrafficStats_h
+#define TrafficStats_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Traffic accounting for onBytesTransferred::.
+ *
+ * Updates go to one of TRAFFIC_STATS_SHARDS cache line sized accumulators, picked once per
+ * thread, with relaxed atomic adds. Callers on different threads never share a cache line
+ * and never take a lock.
+ *
+ * A single owner (e.g. the extension's work queue) periodically calls traffic_stats_tick(),
+ * which folds the accumulators into a fixed-memory hierarchical series:
+ *
+ *   1 second buckets x 60, 1 minute buckets x 60, 1 hour buckets x 24
+ *
+ * Rates and percentiles are computed from the series into a compact snapshot, which
+ * serializes to TRAFFIC_STATS_SNAPSHOT_LEN bytes for sharing with the container and for
+ * including in feedback.
+ */
+
+#define TRAFFIC_STATS_SHARDS 16
+
+#define TRAFFIC_STATS_SECONDS 60
+#define TRAFFIC_STATS_MINUTES 60
+#define TRAFFIC_STATS_HOURS 24
+
+#define TRAFFIC_STATS_SNAPSHOT_VERSION 1
+#define TRAFFIC_STATS_SNAPSHOT_LEN 208
+
+typedef struct traffic_stats traffic_stats_t;
+
+/*!
+ * @brief Byte rates in bytes per second.
+ */
+typedef struct {
+    uint64_t sent;
+    uint64_t received;
+} traffic_rate_t;
+
+/*!
+ * @brief Point-in-time summary of the traffic series.
+ *
+ * Averages are over the most recent complete buckets. Percentiles are of the
+ * per-bucket rates of the last minute (1s buckets) and the last hour (1m buckets).
+ */
+typedef struct {
+    uint32_t version;
+    uint32_t uptime_sec;        // Seconds since the first tick.
+    uint64_t total_sent;
+    uint64_t total_received;
+    uint64_t updates;           // Number of traffic_stats_add calls.
+    traffic_rate_t last_10s;    // Average over the last 10 seconds.
+    traffic_rate_t last_1m;     // Average over the last 60 seconds.
+    traffic_rate_t last_1h;     // Average over the last 60 minutes.
+    traffic_rate_t last_24h;    // Average over the last 24 hours.
+    traffic_rate_t p50_1s;      // Median of per-second rates in the last minute.
+    traffic_rate_t p90_1s;
+    traffic_rate_t p99_1s;
+    traffic_rate_t peak_1s;     // Busiest second in the last minute.
+    traffic_rate_t p50_1m;      // Median of per-minute rates in the last hour.
+    traffic_rate_t p90_1m;
+} traffic_stats_snapshot_t;
+
+/*!
+ * @brief Creates a traffic stats instance. All counters start at zero.
+ * @return Instance, or NULL if allocation failed.
+ */
+traffic_stats_t * traffic_stats_new(void);
+
+void traffic_stats_free(traffic_stats_t *ts);
+
+/*!
+ * @brief Records transferred bytes. Thread-safe and lock-free.
+ */
+void traffic_stats_add(traffic_stats_t *ts, int64_t sent, int64_t received);
+
+/*!
+ * @brief Folds accumulated bytes into the series up to now_sec.
+ *
+ * Bytes accumulated since the previous tick are spread evenly over the seconds elapsed since
+ * then, so ticking every few seconds still yields a usable per-second series. Calling again within
+ * the same second is a no-op. Must only be called by a single owner, with a non-decreasing
+ * monotonic time in seconds.
+ */
+void traffic_stats_tick(traffic_stats_t *ts, uint64_t now_sec);
+
+/*!
+ * @brief Computes a snapshot from the series as of the last tick. Must be called by the tick owner.
+ */
+void traffic_stats_snapshot(const traffic_stats_t *ts, traffic_stats_snapshot_t *snapshot);
+
+/*!
+ * @brief Serializes a snapshot to TRAFFIC_STATS_SNAPSHOT_LEN bytes, little-endian.
+ */
+void traffic_stats_snapshot_encode(const traffic_stats_snapshot_t *snapshot, uint8_t buf[TRAFFIC_STATS_SNAPSHOT_LEN]);
+
+/*!
+ * @brief Deserializes a snapshot.
+ * @return 0 on success, -1 if the buffer is too short or has an unknown version.
+ */
+int traffic_stats_snapshot_decode(const uint8_t *buf, size_t len, traffic_stats_snapshot_t *snapshot);
+
+/*!
+ * @brief Formats a snapshot as a JSON object for feedback, without a trailing newline.
+ * @return Length written, or -1 if dst is too small.
+ */
+long traffic_stats_snapshot_format_json(const traffic_stats_snapshot_t *snapshot, char *dst, size_t len);
+
+#endif /* TrafficStats_h */